@@ -89,6 +89,13 @@ static UINT32 WinDivertDivTen128(UINT32 *a);
 
 #define IPPROTO_MH      135
 
+#ifndef PROCESS_QUERY_LIMITED_INFORMATION
+#define PROCESS_QUERY_LIMITED_INFORMATION   0x1000
+#endif
+#ifndef PROCESS_NAME_NATIVE
+#define PROCESS_NAME_NATIVE                 0x00000001
+#endif
+
 #ifdef _MSC_VER
 
 #pragma intrinsic(memcpy)
@@ -140,6 +147,17 @@ static BOOLEAN WinDivertDriverInstall(VOID);
  */
 #include "windivert_shared.c"
 #include "windivert_helper.c"
+#include "windivert_encap.c"
+#include "windivert_sequencer.c"
+#include "windivert_recvpool.c"
+#include "windivert_sketch.c"
+#include "windivert_apistats.c"
+#include "windivert_merge.c"
+#include "windivert_dedup.c"
+#include "windivert_overlap.c"
+#include "windivert_tcpstats.c"
+#include "windivert_xlat.c"
+#include "windivert_anon.c"
 
 /*
  * Thread local.
@@ -465,10 +483,11 @@ HANDLE WinDivertOpen(const char *filter, WINDIVERT_LAYER layer, INT16 priority,
 
     // Static checks (should be compiled away if TRUE):
     if (sizeof(WINDIVERT_ADDRESS) != 80 ||
-        sizeof(WINDIVERT_DATA_NETWORK) != 8 ||
+        sizeof(WINDIVERT_DATA_NETWORK) != 12 ||
         offsetof(WINDIVERT_DATA_FLOW, Protocol) != 56 ||
         offsetof(WINDIVERT_DATA_SOCKET, Protocol) != 56 ||
         offsetof(WINDIVERT_DATA_REFLECT, Priority) != 24 ||
+        offsetof(WINDIVERT_DATA_REFLECT, CopyTime) != 56 ||
         sizeof(WINDIVERT_FILTER) != 24 ||
         offsetof(WINDIVERT_ADDRESS, Reserved3) != 16)
     {
@@ -503,29 +522,25 @@ HANDLE WinDivertOpen(const char *filter, WINDIVERT_LAYER layer, INT16 priority,
     }
 
     // Compile & analyze the filter:
-    pool = HeapCreate(HEAP_NO_SERIALIZE, WINDIVERT_MIN_POOL_SIZE,
-        WINDIVERT_MAX_POOL_SIZE);
+    pool = HeapCreate(HEAP_NO_SERIALIZE, WINDIVERT_MIN_POOL_SIZE, 0);
     if (pool == NULL)
     {
         return FALSE;
     }
-    object = HeapAlloc(pool, 0,
-        WINDIVERT_FILTER_MAXLEN * sizeof(WINDIVERT_FILTER));
-    if (object == NULL)
+    comp_err = WinDivertCompileFilter(filter, pool, layer, &object, &obj_len);
+    if (IS_ERROR(comp_err))
     {
-        err = GetLastError();
         HeapDestroy(pool);
-        SetLastError(err);
-        return FALSE;
+        SetLastError(GET_CODE(comp_err) == WINDIVERT_ERROR_NO_MEMORY?
+            ERROR_NOT_ENOUGH_MEMORY: ERROR_INVALID_PARAMETER);
+        return INVALID_HANDLE_VALUE;
     }
-    comp_err = WinDivertCompileFilter(filter, pool, layer, object, &obj_len);
-    if (IS_ERROR(comp_err))
+    if (!WinDivertAnalyzeFilter(pool, layer, object, obj_len, &filter_flags))
     {
         HeapDestroy(pool);
-        SetLastError(ERROR_INVALID_PARAMETER);
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
         return INVALID_HANDLE_VALUE;
     }
-    filter_flags = WinDivertAnalyzeFilter(layer, object, obj_len);
 
     // Attempt to open the WinDivert device:
     handle = CreateFile(L"\\\\.\\" WINDIVERT_DEVICE_NAME,
@@ -623,11 +638,18 @@ BOOL WinDivertRecv(HANDLE handle, PVOID pPacket, UINT packetLen, UINT *readLen,
     PWINDIVERT_ADDRESS addr)
 {
     WINDIVERT_IOCTL ioctl;
+    PWINDIVERT_API_COUNTERS counters;
+    INT64 start;
+    BOOL result;
+
     memset(&ioctl, 0, sizeof(ioctl));
     ioctl.recv.addr = (UINT64)(ULONG_PTR)addr;
     ioctl.recv.addr_len_ptr = (UINT64)(ULONG_PTR)NULL;
-    return WinDivertIoControl(handle, IOCTL_WINDIVERT_RECV, &ioctl,
+    counters = WinDivertApiStatsBegin(handle, WINDIVERT_API_RECV, &start);
+    result = WinDivertIoControl(handle, IOCTL_WINDIVERT_RECV, &ioctl,
         pPacket, packetLen, readLen);
+    WinDivertApiStatsEnd(counters, start, result, 1, 1);
+    return result;
 }
 
 /*
@@ -638,6 +660,11 @@ BOOL WinDivertRecvEx(HANDLE handle, PVOID pPacket, UINT packetLen,
     LPOVERLAPPED overlapped)
 {
     WINDIVERT_IOCTL ioctl;
+    PWINDIVERT_API_COUNTERS counters;
+    INT64 start;
+    UINT slots = 1, packets = 1;
+    BOOL result;
+
     memset(&ioctl, 0, sizeof(ioctl));
     ioctl.recv.addr = (UINT64)(ULONG_PTR)addr;
     ioctl.recv.addr_len_ptr = (UINT64)(ULONG_PTR)pAddrLen;
@@ -646,16 +673,27 @@ BOOL WinDivertRecvEx(HANDLE handle, PVOID pPacket, UINT packetLen,
         SetLastError(ERROR_INVALID_PARAMETER);
         return FALSE;
     }
+    counters = WinDivertApiStatsBegin(handle, WINDIVERT_API_RECV, &start);
+    if (counters != NULL && pAddrLen != NULL)
+    {
+        slots = *pAddrLen / sizeof(WINDIVERT_ADDRESS);
+    }
     if (overlapped == NULL)
     {
-        return WinDivertIoControl(handle, IOCTL_WINDIVERT_RECV, &ioctl,
+        result = WinDivertIoControl(handle, IOCTL_WINDIVERT_RECV, &ioctl,
             pPacket, packetLen, readLen);
     }
     else
     {
-        return WinDivertIoControlEx(handle, IOCTL_WINDIVERT_RECV, &ioctl,
+        result = WinDivertIoControlEx(handle, IOCTL_WINDIVERT_RECV, &ioctl,
             pPacket, packetLen, readLen, overlapped);
     }
+    if (counters != NULL && result && pAddrLen != NULL)
+    {
+        packets = *pAddrLen / sizeof(WINDIVERT_ADDRESS);
+    }
+    WinDivertApiStatsEnd(counters, start, result, packets, slots);
+    return result;
 }
 
 /*
@@ -665,11 +703,18 @@ BOOL WinDivertSend(HANDLE handle, const VOID *pPacket, UINT packetLen,
     UINT *writeLen, const WINDIVERT_ADDRESS *addr)
 {
     WINDIVERT_IOCTL ioctl;
+    PWINDIVERT_API_COUNTERS counters;
+    INT64 start;
+    BOOL result;
+
     memset(&ioctl, 0, sizeof(ioctl));
     ioctl.send.addr = (UINT64)(ULONG_PTR)addr;
     ioctl.send.addr_len = sizeof(WINDIVERT_ADDRESS);
-    return WinDivertIoControl(handle, IOCTL_WINDIVERT_SEND, &ioctl,
+    counters = WinDivertApiStatsBegin(handle, WINDIVERT_API_SEND, &start);
+    result = WinDivertIoControl(handle, IOCTL_WINDIVERT_SEND, &ioctl,
         (PVOID)pPacket, packetLen, writeLen);
+    WinDivertApiStatsEnd(counters, start, result, 1, 1);
+    return result;
 }
 
 /*
@@ -680,6 +725,11 @@ BOOL WinDivertSendEx(HANDLE handle, const VOID *pPacket, UINT packetLen,
     LPOVERLAPPED overlapped)
 {
     WINDIVERT_IOCTL ioctl;
+    PWINDIVERT_API_COUNTERS counters;
+    INT64 start;
+    UINT packets;
+    BOOL result;
+
     memset(&ioctl, 0, sizeof(ioctl));
     ioctl.send.addr = (UINT64)(ULONG_PTR)addr;
     ioctl.send.addr_len = addrLen;
@@ -688,16 +738,20 @@ BOOL WinDivertSendEx(HANDLE handle, const VOID *pPacket, UINT packetLen,
         SetLastError(ERROR_INVALID_PARAMETER);
         return FALSE;
     }
+    counters = WinDivertApiStatsBegin(handle, WINDIVERT_API_SEND, &start);
     if (overlapped == NULL)
     {
-        return WinDivertIoControl(handle, IOCTL_WINDIVERT_SEND, &ioctl,
+        result = WinDivertIoControl(handle, IOCTL_WINDIVERT_SEND, &ioctl,
             (PVOID)pPacket, packetLen, writeLen);
     }
     else
     {
-        return WinDivertIoControlEx(handle, IOCTL_WINDIVERT_SEND, &ioctl,
+        result = WinDivertIoControlEx(handle, IOCTL_WINDIVERT_SEND, &ioctl,
             (PVOID)pPacket, packetLen, writeLen, overlapped);
     }
+    packets = addrLen / sizeof(WINDIVERT_ADDRESS);
+    WinDivertApiStatsEnd(counters, start, result, packets, packets);
+    return result;
 }
 
 /*
@@ -706,10 +760,17 @@ BOOL WinDivertSendEx(HANDLE handle, const VOID *pPacket, UINT packetLen,
 BOOL WinDivertShutdown(HANDLE handle, WINDIVERT_SHUTDOWN how)
 {
     WINDIVERT_IOCTL ioctl;
+    PWINDIVERT_API_COUNTERS counters;
+    INT64 start;
+    BOOL result;
+
     memset(&ioctl, 0, sizeof(ioctl));
     ioctl.shutdown.how = (UINT32)how;
-    return WinDivertIoControl(handle, IOCTL_WINDIVERT_SHUTDOWN, &ioctl, NULL,
+    counters = WinDivertApiStatsBegin(handle, WINDIVERT_API_SHUTDOWN, &start);
+    result = WinDivertIoControl(handle, IOCTL_WINDIVERT_SHUTDOWN, &ioctl, NULL,
         0, NULL);
+    WinDivertApiStatsEnd(counters, start, result, 0, 0);
+    return result;
 }
 
 /*
@@ -717,6 +778,11 @@ BOOL WinDivertShutdown(HANDLE handle, WINDIVERT_SHUTDOWN how)
  */
 BOOL WinDivertClose(HANDLE handle)
 {
+    if (windivert_api_enabled != 0 &&
+            WinDivertApiStatsLookup(handle) != NULL)
+    {
+        (VOID)WinDivertHelperApiStatsEnable(handle, FALSE);
+    }
     return CloseHandle(handle);
 }
 
@@ -726,11 +792,18 @@ BOOL WinDivertClose(HANDLE handle)
 BOOL WinDivertSetParam(HANDLE handle, WINDIVERT_PARAM param, UINT64 value)
 {
     WINDIVERT_IOCTL ioctl;
+    PWINDIVERT_API_COUNTERS counters;
+    INT64 start;
+    BOOL result;
+
     memset(&ioctl, 0, sizeof(ioctl));
     ioctl.set_param.param = (UINT32)param;
     ioctl.set_param.val   = value;
-    return WinDivertIoControl(handle, IOCTL_WINDIVERT_SET_PARAM, &ioctl, NULL,
+    counters = WinDivertApiStatsBegin(handle, WINDIVERT_API_SET_PARAM, &start);
+    result = WinDivertIoControl(handle, IOCTL_WINDIVERT_SET_PARAM, &ioctl, NULL,
         0, NULL);
+    WinDivertApiStatsEnd(counters, start, result, 0, 0);
+    return result;
 }
 
 /*
@@ -745,6 +818,92 @@ BOOL WinDivertGetParam(HANDLE handle, WINDIVERT_PARAM param, UINT64 *pValue)
         pValue, sizeof(UINT64), NULL);
 }
 
+/*
+ * Query the original destination of a redirected connection.
+ */
+BOOL WinDivertRedirectQuery(HANDLE handle, const UINT32 *pRemoteAddr,
+    UINT16 remotePort, UINT32 *pOrigAddr, UINT16 *pOrigPort)
+{
+    WINDIVERT_IOCTL ioctl;
+    UINT16 orig_port;
+    UINT i;
+
+    if (pRemoteAddr == NULL || pOrigPort == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    memset(&ioctl, 0, sizeof(ioctl));
+    if (pRemoteAddr[1] == 0x0000FFFF && pRemoteAddr[2] == 0 &&
+        pRemoteAddr[3] == 0)
+    {
+        ioctl.redirect_query.addr[0] = htonl(pRemoteAddr[0]);
+    }
+    else
+    {
+        ioctl.redirect_query.ipv6 = 1;
+        WinDivertHelperHtonIPv6Address(pRemoteAddr,
+            ioctl.redirect_query.addr);
+    }
+    ioctl.redirect_query.port = htons(remotePort);
+    if (!WinDivertIoControl(handle, IOCTL_WINDIVERT_REDIRECT_QUERY, &ioctl,
+            &orig_port, sizeof(orig_port), NULL))
+    {
+        return FALSE;
+    }
+    if (pOrigAddr != NULL)
+    {
+        for (i = 0; i < 4; i++)
+        {
+            pOrigAddr[i] = pRemoteAddr[i];
+        }
+    }
+    *pOrigPort = ntohs(orig_port);
+    return TRUE;
+}
+
+/*
+ * Get the recent trace events of a WinDivert handle, sorted by timestamp.
+ */
+BOOL WinDivertTraceQuery(HANDLE handle, UINT32 processId, INT64 timestamp,
+    WINDIVERT_TRACE_EVENT *pEvents, UINT eventsLen, UINT *pEventsLen)
+{
+    WINDIVERT_IOCTL ioctl;
+    WINDIVERT_TRACE_EVENT event;
+    UINT i, j, len, count;
+
+    if (pEvents == NULL || eventsLen < sizeof(WINDIVERT_TRACE_EVENT))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    memset(&ioctl, 0, sizeof(ioctl));
+    ioctl.trace.process_id = processId;
+    ioctl.trace.timestamp  = timestamp;
+    if (!WinDivertIoControl(handle, IOCTL_WINDIVERT_TRACE, &ioctl, pEvents,
+            eventsLen, &len))
+    {
+        return FALSE;
+    }
+
+    // The driver returns events grouped by processor; merge them:
+    count = len / sizeof(WINDIVERT_TRACE_EVENT);
+    for (i = 1; i < count; i++)
+    {
+        event = pEvents[i];
+        for (j = i; j > 0 && pEvents[j-1].Timestamp > event.Timestamp; j--)
+        {
+            pEvents[j] = pEvents[j-1];
+        }
+        pEvents[j] = event;
+    }
+    if (pEventsLen != NULL)
+    {
+        *pEventsLen = count * sizeof(WINDIVERT_TRACE_EVENT);
+    }
+    return TRUE;
+}
+
 /*****************************************************************************/
 /* REPLACEMENTS                                                              */
 /*****************************************************************************/
@@ -0,0 +1,895 @@
+/*
+ * windivert_anon.c
+ * (C) 2019, all rights reserved,
+ *
+ * This file is part of WinDivert.
+ *
+ * WinDivert is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * WinDivert is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Prefix-preserving address anonymization (Crypto-PAn).  Bit i of the
+ * anonymized address is bit i of the original address XOR the first bit of
+ * AES-128(K, P_i), where P_i is the first i bits of the original address
+ * followed by the remaining bits of a secret pad.  Two addresses that share
+ * a k-bit prefix therefore share a k-bit anonymized prefix, and the mapping
+ * is the same as other Crypto-PAn implementations for the same 32 byte key
+ * (an AES key followed by the pad seed).  IPv6 addresses use all 128 bits
+ * of the block.
+ *
+ * An uncached address costs one AES block per bit.  The blocks for an
+ * address are independent, so with AES-NI they are pipelined 8 at a time;
+ * otherwise a table-based AES is used.  Pads are cached per prefix (/16,
+ * /24 and /32 for IPv4, /32, /48, /64 and /128 for IPv6), so an address
+ * from a known /24 or /64 only needs the blocks for the remaining bits,
+ * and a repeated address needs none.
+ *
+ * The cache is an array of 128 byte buckets of 3 entries, with the entry
+ * levels in the first cache line.  Entries are replaced round-robin.
+ */
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) ||            \
+    defined(__x86_64__)
+#define WINDIVERT_ANON_AESNI
+#include <wmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define WINDIVERT_ANON_TARGET
+#else       /* _MSC_VER */
+#include <cpuid.h>
+#define WINDIVERT_ANON_TARGET   __attribute__((__target__("sse2,aes")))
+#endif      /* _MSC_VER */
+#endif
+
+#define WINDIVERT_ANON_WAYS             3           // Entries per bucket.
+#define WINDIVERT_ANON_SIZE_MIN         WINDIVERT_ANON_WAYS
+#define WINDIVERT_ANON_SIZE_MAX         (1 << 24)
+#define WINDIVERT_ANON_ROUNDS           10          // AES-128.
+#define WINDIVERT_ANON_LANES            8           // AES-NI blocks in flight.
+#define WINDIVERT_ANON_IPV4_LEVELS      3
+#define WINDIVERT_ANON_IPV6_LEVELS      4
+#define WINDIVERT_ANON_FLAGS_ALL        WINDIVERT_ANON_FLAG_NO_AESNI
+#define WINDIVERT_ANON_ROTR32(x, r)     (((x) >> (r)) | ((x) << (32 - (r))))
+
+/*
+ * Cached prefix lengths; IPv4 levels first.
+ */
+static const UINT8 WinDivertAnonLevels[] = {16, 24, 32, 32, 48, 64, 128};
+
+/*
+ * Cached pad for a prefix.  Words are in host byte order, most significant
+ * word first.
+ */
+typedef struct
+{
+    UINT32 prefix[4];               // Prefix (masked address).
+    UINT32 pad[4];                  // Pad bits for the prefix.
+} WINDIVERT_ANON_ENTRY, *PWINDIVERT_ANON_ENTRY;
+
+/*
+ * Bucket (two cache lines).
+ */
+typedef struct
+{
+    UINT8 levels[WINDIVERT_ANON_WAYS];  // Level + 1 (0 = free).
+    UINT8 victim;                       // Next entry to replace.
+    UINT8 reserved[28];
+    WINDIVERT_ANON_ENTRY entries[WINDIVERT_ANON_WAYS];
+} WINDIVERT_ANON_BUCKET, *PWINDIVERT_ANON_BUCKET;
+
+/*
+ * Anonymizer.
+ */
+struct WINDIVERT_ANON
+{
+    HANDLE pool;                    // Private heap.
+    PWINDIVERT_ANON_BUCKET buckets; // Buckets (cache line aligned).
+    UINT32 mask;                    // Bucket mask.
+    BOOL aesni;                     // Use AES-NI?
+    UINT64 seed;                    // Bucket hash seed.
+    UINT64 addresses;               // Addresses anonymized.
+    UINT64 hits;                    // Addresses found in the cache.
+    UINT64 blocks;                  // AES blocks encrypted.
+    UINT32 pad[4];                  // Pad (host byte order).
+    UINT32 round_keys[4 * (WINDIVERT_ANON_ROUNDS + 1)];
+    UINT8 key_bytes[16 * (WINDIVERT_ANON_ROUNDS + 1)];
+    UINT32 table[256];              // AES T-table.
+    UINT8 sbox[256];                // AES S-box.
+};
+
+/*
+ * Prototypes.
+ */
+static void WinDivertAnonInit(PWINDIVERT_ANON anon, const UINT8 *key);
+static UINT8 WinDivertAnonEncrypt(const struct WINDIVERT_ANON *anon,
+    const UINT32 *in, UINT8 *out);
+static void WinDivertAnonAddress(PWINDIVERT_ANON anon, UINT32 *addr,
+    BOOL ipv6);
+static void WinDivertAnonPad(PWINDIVERT_ANON anon, const UINT32 *addr,
+    UINT start, UINT bits, UINT32 *pad);
+#ifdef WINDIVERT_ANON_AESNI
+static BOOL WinDivertAnonHaveAesNi(void);
+static void WINDIVERT_ANON_TARGET WinDivertAnonPadAesNi(
+    PWINDIVERT_ANON anon, const UINT32 *addr, UINT start, UINT bits,
+    UINT32 *pad);
+#endif
+static UINT32 WinDivertAnonAddresses(PWINDIVERT_ANON anon, UINT8 *addrs,
+    UINT count, BOOL ipv6);
+static void WinDivertAnonPacket(PWINDIVERT_ANON anon, UINT8 *packet,
+    UINT packet_len);
+static UINT32 WinDivertAnonQuoted(PWINDIVERT_ANON anon, UINT8 *data,
+    UINT data_len);
+
+/*
+ * Create an anonymizer.
+ */
+PWINDIVERT_ANON WinDivertHelperAnonCreate(const UINT8 *pKey, UINT size,
+    UINT64 flags)
+{
+    HANDLE pool;
+    PWINDIVERT_ANON anon;
+    UINT8 *buckets;
+    UINT num_buckets;
+
+    if (pKey == NULL || size < WINDIVERT_ANON_SIZE_MIN ||
+        size > WINDIVERT_ANON_SIZE_MAX ||
+        (flags & ~(UINT64)WINDIVERT_ANON_FLAGS_ALL) != 0)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return NULL;
+    }
+    for (num_buckets = 1; num_buckets * WINDIVERT_ANON_WAYS < size;
+            num_buckets <<= 1)
+        ;
+
+    pool = HeapCreate(0, WINDIVERT_MIN_POOL_SIZE, 0);
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+    anon = (PWINDIVERT_ANON)HeapAlloc(pool, HEAP_ZERO_MEMORY,
+        sizeof(struct WINDIVERT_ANON));
+    buckets = (UINT8 *)HeapAlloc(pool, HEAP_ZERO_MEMORY,
+        num_buckets * sizeof(WINDIVERT_ANON_BUCKET) + 64);
+    if (anon == NULL || buckets == NULL)
+    {
+        HeapDestroy(pool);
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+    buckets += 64 - ((UINT_PTR)buckets % 64);
+    anon->pool    = pool;
+    anon->buckets = (PWINDIVERT_ANON_BUCKET)buckets;
+    anon->mask    = num_buckets - 1;
+#ifdef WINDIVERT_ANON_AESNI
+    anon->aesni   = ((flags & WINDIVERT_ANON_FLAG_NO_AESNI) == 0 &&
+        WinDivertAnonHaveAesNi());
+#endif
+    WinDivertAnonInit(anon, pKey);
+    return anon;
+}
+
+/*
+ * Anonymize an address.
+ */
+BOOL WinDivertHelperAnonAddress(PWINDIVERT_ANON anon, const UINT32 *pAddr,
+    UINT32 *pAnonAddr, BOOL ipv6)
+{
+    UINT32 addr[4] = {0, 0, 0, 0};
+    UINT i;
+
+    if (anon == NULL || pAddr == NULL || pAnonAddr == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    if (ipv6)
+    {
+        for (i = 0; i < 4; i++)
+        {
+            addr[i] = pAddr[3 - i];
+        }
+        WinDivertAnonAddress(anon, addr, TRUE);
+        for (i = 0; i < 4; i++)
+        {
+            pAnonAddr[3 - i] = addr[i];
+        }
+    }
+    else
+    {
+        addr[0] = pAddr[0];
+        WinDivertAnonAddress(anon, addr, FALSE);
+        pAnonAddr[0] = addr[0];
+    }
+    return TRUE;
+}
+
+/*
+ * Anonymize a batch of packets (in place).
+ */
+BOOL WinDivertHelperAnonPacket(PWINDIVERT_ANON anon, VOID *pPacket,
+    UINT packetLen, const WINDIVERT_ADDRESS *pAddr, UINT addrLen)
+{
+    UINT8 *packet = (UINT8 *)pPacket;
+    UINT count, len, i;
+
+    if (anon == NULL || (pPacket == NULL && packetLen != 0) ||
+        (pAddr != NULL && addrLen % sizeof(WINDIVERT_ADDRESS) != 0))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    if (pAddr == NULL)
+    {
+        // A single (possibly truncated) packet:
+        WinDivertAnonPacket(anon, packet, packetLen);
+        return TRUE;
+    }
+    count = addrLen / sizeof(WINDIVERT_ADDRESS);
+    for (i = 0; i < count; i++)
+    {
+        switch (pAddr[i].Layer)
+        {
+            case WINDIVERT_LAYER_NETWORK:
+            case WINDIVERT_LAYER_NETWORK_FORWARD:
+                len = (packet == NULL? 0:
+                    WinDivertGetPacketLength(packet, packetLen));
+                break;
+            default:
+                len = 0;
+                break;
+        }
+        if (len != 0)
+        {
+            WinDivertAnonPacket(anon, packet, len);
+        }
+        packet    += len;
+        packetLen -= len;
+    }
+    return TRUE;
+}
+
+/*
+ * Query anonymizer counters.
+ */
+BOOL WinDivertHelperAnonQuery(PWINDIVERT_ANON anon, UINT64 *pAddresses,
+    UINT64 *pHits, UINT64 *pBlocks)
+{
+    if (anon == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    if (pAddresses != NULL)
+    {
+        *pAddresses = anon->addresses;
+    }
+    if (pHits != NULL)
+    {
+        *pHits = anon->hits;
+    }
+    if (pBlocks != NULL)
+    {
+        *pBlocks = anon->blocks;
+    }
+    return TRUE;
+}
+
+/*
+ * Free an anonymizer.
+ */
+void WinDivertHelperAnonFree(PWINDIVERT_ANON anon)
+{
+    if (anon == NULL)
+    {
+        return;
+    }
+    HeapDestroy(anon->pool);
+}
+
+/*
+ * Build the AES tables, expand the key, and encrypt the pad seed.
+ */
+static void WinDivertAnonInit(PWINDIVERT_ANON anon, const UINT8 *key)
+{
+    static const UINT8 rcon[WINDIVERT_ANON_ROUNDS] =
+        {0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1B, 0x36};
+    UINT32 *rk = anon->round_keys, word, seed[4];
+    UINT8 p = 1, q = 1, s, s2, out[16];
+    UINT i;
+
+    // S-box (p runs over the multiplicative group, q = 1/p):
+    do
+    {
+        p = (UINT8)(p ^ (p << 1) ^ ((p & 0x80) != 0? 0x1B: 0));
+        q ^= (UINT8)(q << 1);
+        q ^= (UINT8)(q << 2);
+        q ^= (UINT8)(q << 4);
+        q ^= ((q & 0x80) != 0? 0x09: 0);
+        s = (UINT8)(q ^ (q << 1 | q >> 7) ^ (q << 2 | q >> 6) ^
+            (q << 3 | q >> 5) ^ (q << 4 | q >> 4));
+        anon->sbox[p] = s ^ 0x63;
+    }
+    while (p != 1);
+    anon->sbox[0] = 0x63;
+    for (i = 0; i < 256; i++)
+    {
+        s  = anon->sbox[i];
+        s2 = (UINT8)(s << 1 ^ ((s & 0x80) != 0? 0x1B: 0));
+        anon->table[i] = (UINT32)s2 << 24 | (UINT32)s << 16 |
+            (UINT32)s << 8 | (UINT32)(s2 ^ s);
+    }
+
+    // Key expansion:
+    for (i = 0; i < 4; i++)
+    {
+        rk[i] = (UINT32)key[4 * i] << 24 | (UINT32)key[4 * i + 1] << 16 |
+            (UINT32)key[4 * i + 2] << 8 | (UINT32)key[4 * i + 3];
+    }
+    for (i = 4; i < 4 * (WINDIVERT_ANON_ROUNDS + 1); i++)
+    {
+        word = rk[i - 1];
+        if (i % 4 == 0)
+        {
+            word = ((UINT32)anon->sbox[(word >> 16) & 0xFF] << 24 |
+                    (UINT32)anon->sbox[(word >> 8) & 0xFF] << 16 |
+                    (UINT32)anon->sbox[word & 0xFF] << 8 |
+                    (UINT32)anon->sbox[word >> 24]) ^
+                   ((UINT32)rcon[i / 4 - 1] << 24);
+        }
+        rk[i] = rk[i - 4] ^ word;
+    }
+    for (i = 0; i < 4 * (WINDIVERT_ANON_ROUNDS + 1); i++)
+    {
+        anon->key_bytes[4 * i]     = (UINT8)(rk[i] >> 24);
+        anon->key_bytes[4 * i + 1] = (UINT8)(rk[i] >> 16);
+        anon->key_bytes[4 * i + 2] = (UINT8)(rk[i] >> 8);
+        anon->key_bytes[4 * i + 3] = (UINT8)rk[i];
+    }
+
+    // Pad = AES(K, seed):
+    for (i = 0; i < 4; i++)
+    {
+        seed[i] = (UINT32)key[16 + 4 * i] << 24 |
+            (UINT32)key[16 + 4 * i + 1] << 16 |
+            (UINT32)key[16 + 4 * i + 2] << 8 | (UINT32)key[16 + 4 * i + 3];
+    }
+    WinDivertAnonEncrypt(anon, seed, out);
+    for (i = 0; i < 4; i++)
+    {
+        anon->pad[i] = (UINT32)out[4 * i] << 24 |
+            (UINT32)out[4 * i + 1] << 16 | (UINT32)out[4 * i + 2] << 8 |
+            (UINT32)out[4 * i + 3];
+    }
+    anon->seed = (UINT64)anon->pad[2] << 32 | (UINT64)anon->pad[3];
+}
+
+/*
+ * Encrypt a block (table-based AES-128).  The block is given as 4 words,
+ * most significant first.  Returns the first byte of the result, and
+ * stores the whole result if out != NULL.
+ */
+static UINT8 WinDivertAnonEncrypt(const struct WINDIVERT_ANON *anon,
+    const UINT32 *in, UINT8 *out)
+{
+    const UINT32 *rk = anon->round_keys, *table = anon->table;
+    const UINT8 *sbox = anon->sbox;
+    UINT32 s0, s1, s2, s3, t0, t1, t2, t3;
+    UINT r;
+
+    s0 = in[0] ^ rk[0];
+    s1 = in[1] ^ rk[1];
+    s2 = in[2] ^ rk[2];
+    s3 = in[3] ^ rk[3];
+    for (r = 1; r < WINDIVERT_ANON_ROUNDS; r++)
+    {
+        rk += 4;
+        t0 = table[s0 >> 24] ^
+             WINDIVERT_ANON_ROTR32(table[(s1 >> 16) & 0xFF], 8) ^
+             WINDIVERT_ANON_ROTR32(table[(s2 >> 8) & 0xFF], 16) ^
+             WINDIVERT_ANON_ROTR32(table[s3 & 0xFF], 24) ^ rk[0];
+        t1 = table[s1 >> 24] ^
+             WINDIVERT_ANON_ROTR32(table[(s2 >> 16) & 0xFF], 8) ^
+             WINDIVERT_ANON_ROTR32(table[(s3 >> 8) & 0xFF], 16) ^
+             WINDIVERT_ANON_ROTR32(table[s0 & 0xFF], 24) ^ rk[1];
+        t2 = table[s2 >> 24] ^
+             WINDIVERT_ANON_ROTR32(table[(s3 >> 16) & 0xFF], 8) ^
+             WINDIVERT_ANON_ROTR32(table[(s0 >> 8) & 0xFF], 16) ^
+             WINDIVERT_ANON_ROTR32(table[s1 & 0xFF], 24) ^ rk[2];
+        t3 = table[s3 >> 24] ^
+             WINDIVERT_ANON_ROTR32(table[(s0 >> 16) & 0xFF], 8) ^
+             WINDIVERT_ANON_ROTR32(table[(s1 >> 8) & 0xFF], 16) ^
+             WINDIVERT_ANON_ROTR32(table[s2 & 0xFF], 24) ^ rk[3];
+        s0 = t0;
+        s1 = t1;
+        s2 = t2;
+        s3 = t3;
+    }
+    rk += 4;
+    if (out != NULL)
+    {
+        out[0]  = sbox[s0 >> 24] ^ (UINT8)(rk[0] >> 24);
+        out[1]  = sbox[(s1 >> 16) & 0xFF] ^ (UINT8)(rk[0] >> 16);
+        out[2]  = sbox[(s2 >> 8) & 0xFF] ^ (UINT8)(rk[0] >> 8);
+        out[3]  = sbox[s3 & 0xFF] ^ (UINT8)rk[0];
+        out[4]  = sbox[s1 >> 24] ^ (UINT8)(rk[1] >> 24);
+        out[5]  = sbox[(s2 >> 16) & 0xFF] ^ (UINT8)(rk[1] >> 16);
+        out[6]  = sbox[(s3 >> 8) & 0xFF] ^ (UINT8)(rk[1] >> 8);
+        out[7]  = sbox[s0 & 0xFF] ^ (UINT8)rk[1];
+        out[8]  = sbox[s2 >> 24] ^ (UINT8)(rk[2] >> 24);
+        out[9]  = sbox[(s3 >> 16) & 0xFF] ^ (UINT8)(rk[2] >> 16);
+        out[10] = sbox[(s0 >> 8) & 0xFF] ^ (UINT8)(rk[2] >> 8);
+        out[11] = sbox[s1 & 0xFF] ^ (UINT8)rk[2];
+        out[12] = sbox[s3 >> 24] ^ (UINT8)(rk[3] >> 24);
+        out[13] = sbox[(s0 >> 16) & 0xFF] ^ (UINT8)(rk[3] >> 16);
+        out[14] = sbox[(s1 >> 8) & 0xFF] ^ (UINT8)(rk[3] >> 8);
+        out[15] = sbox[s2 & 0xFF] ^ (UINT8)rk[3];
+    }
+    return sbox[s0 >> 24] ^ (UINT8)(rk[0] >> 24);
+}
+
+/*
+ * Anonymize an address (4 words, most significant first; IPv4 addresses in
+ * addr[0]).
+ */
+static void WinDivertAnonAddress(PWINDIVERT_ANON anon, UINT32 *addr,
+    BOOL ipv6)
+{
+    PWINDIVERT_ANON_BUCKET buckets[WINDIVERT_ANON_IPV6_LEVELS], bucket;
+    PWINDIVERT_ANON_ENTRY entry;
+    UINT32 prefix[WINDIVERT_ANON_IPV6_LEVELS][4], pad[4] = {0, 0, 0, 0};
+    UINT32 mask;
+    UINT64 hash;
+    UINT first = (ipv6? WINDIVERT_ANON_IPV4_LEVELS: 0);
+    UINT count = (ipv6? WINDIVERT_ANON_IPV6_LEVELS:
+        WINDIVERT_ANON_IPV4_LEVELS);
+    UINT bits = (ipv6? 128: 32), start = 0, found = count, level, i, j, k;
+
+    anon->addresses++;
+
+    // Find the longest cached prefix:
+    for (i = count; i > 0 && found == count; i--)
+    {
+        level = WinDivertAnonLevels[first + i - 1];
+        for (j = 0; j < 4; j++)
+        {
+            mask = (32 * (j + 1) <= level? 0xFFFFFFFF:
+                32 * j >= level? 0: 0xFFFFFFFF << (32 * (j + 1) - level));
+            prefix[i - 1][j] = addr[j] & mask;
+        }
+        hash = WinDivertXXH64Round(anon->seed ^ (first + i),
+            (UINT64)prefix[i - 1][0] << 32 | (UINT64)prefix[i - 1][1]);
+        hash = WinDivertXXH64Round(hash,
+            (UINT64)prefix[i - 1][2] << 32 | (UINT64)prefix[i - 1][3]);
+        hash = WinDivertXXH64Avalanche(hash);
+        bucket = &anon->buckets[(UINT32)hash & anon->mask];
+        buckets[i - 1] = bucket;
+        for (j = 0; j < WINDIVERT_ANON_WAYS; j++)
+        {
+            entry = &bucket->entries[j];
+            if (bucket->levels[j] == first + i &&
+                entry->prefix[0] == prefix[i - 1][0] &&
+                entry->prefix[1] == prefix[i - 1][1] &&
+                entry->prefix[2] == prefix[i - 1][2] &&
+                entry->prefix[3] == prefix[i - 1][3])
+            {
+                memcpy(pad, entry->pad, sizeof(pad));
+                found = i - 1;
+                start = level;
+                break;
+            }
+        }
+    }
+    if (start == bits)
+    {
+        anon->hits++;
+    }
+    else
+    {
+        // Compute the remaining pad bits, and cache the longer prefixes:
+        WinDivertAnonPad(anon, addr, start, bits, pad);
+        for (i = (found == count? 0: found + 1); i < count; i++)
+        {
+            level  = WinDivertAnonLevels[first + i];
+            bucket = buckets[i];
+            for (j = 0; j < WINDIVERT_ANON_WAYS &&
+                    bucket->levels[j] != 0; j++)
+                ;
+            if (j == WINDIVERT_ANON_WAYS)
+            {
+                j = bucket->victim;
+                bucket->victim = (UINT8)((j + 1) % WINDIVERT_ANON_WAYS);
+            }
+            entry = &bucket->entries[j];
+            for (k = 0; k < 4; k++)
+            {
+                mask = (32 * (k + 1) <= level? 0xFFFFFFFF:
+                    32 * k >= level? 0: 0xFFFFFFFF << (32 * (k + 1) - level));
+                entry->prefix[k] = prefix[i][k];
+                entry->pad[k]    = pad[k] & mask;
+            }
+            bucket->levels[j] = (UINT8)(first + i + 1);
+        }
+    }
+    for (i = 0; i < 4; i++)
+    {
+        addr[i] ^= pad[i];
+    }
+}
+
+/*
+ * Compute pad bits [start, bits) of an address.
+ */
+static void WinDivertAnonPad(PWINDIVERT_ANON anon, const UINT32 *addr,
+    UINT start, UINT bits, UINT32 *pad)
+{
+    UINT32 in[4], mask;
+    UINT pos, word, i;
+
+    anon->blocks += bits - start;
+#ifdef WINDIVERT_ANON_AESNI
+    if (anon->aesni)
+    {
+        WinDivertAnonPadAesNi(anon, addr, start, bits, pad);
+        return;
+    }
+#endif
+    for (pos = start; pos < bits; pos++)
+    {
+        word = pos / 32;
+        mask = (pos % 32 == 0? 0: 0xFFFFFFFF << (32 - pos % 32));
+        for (i = 0; i < 4; i++)
+        {
+            in[i] = (i < word? addr[i]: i > word? anon->pad[i]:
+                (addr[i] & mask) | (anon->pad[i] & ~mask));
+        }
+        pad[word] |= (UINT32)(WinDivertAnonEncrypt(anon, in, NULL) >> 7) <<
+            (31 - pos % 32);
+    }
+}
+
+#ifdef WINDIVERT_ANON_AESNI
+
+/*
+ * Check for AES-NI support.
+ */
+static BOOL WinDivertAnonHaveAesNi(void)
+{
+#ifdef _MSC_VER
+    int info[4];
+
+    __cpuid(info, 1);
+    return ((info[2] & (1 << 25)) != 0 && (info[3] & (1 << 26)) != 0);
+#else       /* _MSC_VER */
+    unsigned eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    {
+        return FALSE;
+    }
+    return ((ecx & bit_AES) != 0 && (edx & bit_SSE2) != 0);
+#endif      /* _MSC_VER */
+}
+
+/*
+ * Compute pad bits [start, bits) of an address using AES-NI.  The blocks
+ * are independent, so WINDIVERT_ANON_LANES blocks are encrypted at once.
+ * The start is a multiple of 8 (as are all cached levels), so the blocks of
+ * a group only differ in one byte: block i has the first i bits of the
+ * address byte, and the rest from the pad.
+ */
+#define WINDIVERT_ANON_AESNI_ROUND(op, key)                             \
+    do                                                                  \
+    {                                                                   \
+        b0 = op(b0, key); b1 = op(b1, key);                             \
+        b2 = op(b2, key); b3 = op(b3, key);                             \
+        b4 = op(b4, key); b5 = op(b5, key);                             \
+        b6 = op(b6, key); b7 = op(b7, key);                             \
+    }                                                                   \
+    while (FALSE)
+#define WINDIVERT_ANON_AESNI_BIT(b, i)                                  \
+    ((UINT32)(_mm_movemask_epi8(b) & 1) << (7 - (i)))
+static void WINDIVERT_ANON_TARGET WinDivertAnonPadAesNi(
+    PWINDIVERT_ANON anon, const UINT32 *addr, UINT start, UINT bits,
+    UINT32 *pad)
+{
+    __m128i keys[WINDIVERT_ANON_ROUNDS + 1];
+    __m128i b0, b1, b2, b3, b4, b5, b6, b7;
+    __m128i in_addr, in_pad, diff, index, pos_bytes, base;
+    UINT32 words[4], byte;
+    UINT pos, r, i;
+
+    for (r = 0; r <= WINDIVERT_ANON_ROUNDS; r++)
+    {
+        keys[r] = _mm_loadu_si128((const __m128i *)(anon->key_bytes +
+            16 * r));
+    }
+    for (i = 0; i < 4; i++)
+    {
+        words[i] = BYTESWAP32(addr[i]);
+    }
+    in_addr = _mm_loadu_si128((const __m128i *)words);
+    for (i = 0; i < 4; i++)
+    {
+        words[i] = BYTESWAP32(anon->pad[i]);
+    }
+    in_pad = _mm_loadu_si128((const __m128i *)words);
+    index  = _mm_set_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1,
+        0);
+    for (pos = start; pos < bits; pos += WINDIVERT_ANON_LANES)
+    {
+        // base = address bytes before pos/8, pad bytes after; diff = the
+        // address/pad difference in byte pos/8.
+        pos_bytes = _mm_set1_epi8((char)(pos / 8));
+        base = _mm_or_si128(
+            _mm_and_si128(_mm_cmplt_epi8(index, pos_bytes), in_addr),
+            _mm_andnot_si128(_mm_cmplt_epi8(index, pos_bytes), in_pad));
+        diff = _mm_and_si128(_mm_cmpeq_epi8(index, pos_bytes),
+            _mm_xor_si128(in_addr, in_pad));
+        b0 = base;
+        b1 = _mm_xor_si128(base, _mm_and_si128(diff,
+            _mm_set1_epi8((char)0x80)));
+        b2 = _mm_xor_si128(base, _mm_and_si128(diff,
+            _mm_set1_epi8((char)0xC0)));
+        b3 = _mm_xor_si128(base, _mm_and_si128(diff,
+            _mm_set1_epi8((char)0xE0)));
+        b4 = _mm_xor_si128(base, _mm_and_si128(diff,
+            _mm_set1_epi8((char)0xF0)));
+        b5 = _mm_xor_si128(base, _mm_and_si128(diff,
+            _mm_set1_epi8((char)0xF8)));
+        b6 = _mm_xor_si128(base, _mm_and_si128(diff,
+            _mm_set1_epi8((char)0xFC)));
+        b7 = _mm_xor_si128(base, _mm_and_si128(diff,
+            _mm_set1_epi8((char)0xFE)));
+        WINDIVERT_ANON_AESNI_ROUND(_mm_xor_si128, keys[0]);
+        for (r = 1; r < WINDIVERT_ANON_ROUNDS; r++)
+        {
+            WINDIVERT_ANON_AESNI_ROUND(_mm_aesenc_si128, keys[r]);
+        }
+        WINDIVERT_ANON_AESNI_ROUND(_mm_aesenclast_si128,
+            keys[WINDIVERT_ANON_ROUNDS]);
+
+        // The first bit of each block forms the pad byte:
+        byte = WINDIVERT_ANON_AESNI_BIT(b0, 0) |
+            WINDIVERT_ANON_AESNI_BIT(b1, 1) |
+            WINDIVERT_ANON_AESNI_BIT(b2, 2) |
+            WINDIVERT_ANON_AESNI_BIT(b3, 3) |
+            WINDIVERT_ANON_AESNI_BIT(b4, 4) |
+            WINDIVERT_ANON_AESNI_BIT(b5, 5) |
+            WINDIVERT_ANON_AESNI_BIT(b6, 6) |
+            WINDIVERT_ANON_AESNI_BIT(b7, 7);
+        pad[pos / 32] |= byte << (24 - pos % 32);
+    }
+}
+
+#endif      /* WINDIVERT_ANON_AESNI */
+
+/*
+ * Anonymize consecutive addresses in a packet.  Returns the change to the
+ * one's complement sum.
+ */
+static UINT32 WinDivertAnonAddresses(PWINDIVERT_ANON anon, UINT8 *addrs,
+    UINT count, BOOL ipv6)
+{
+    UINT32 addr[4] = {0, 0, 0, 0}, old_sum, new_sum;
+    UINT words = (ipv6? 4: 1), i, j;
+
+    old_sum = WinDivertChecksumAdd(0, addrs, count * words * sizeof(UINT32));
+    for (i = 0; i < count; i++)
+    {
+        memcpy(addr, addrs + i * words * sizeof(UINT32),
+            words * sizeof(UINT32));
+        for (j = 0; j < words; j++)
+        {
+            addr[j] = ntohl(addr[j]);
+        }
+        WinDivertAnonAddress(anon, addr, ipv6);
+        for (j = 0; j < words; j++)
+        {
+            addr[j] = htonl(addr[j]);
+        }
+        memcpy(addrs + i * words * sizeof(UINT32), addr,
+            words * sizeof(UINT32));
+    }
+    new_sum = WinDivertChecksumAdd(0, addrs, count * words * sizeof(UINT32));
+    return WinDivertXlatChecksumSub(new_sum, old_sum);
+}
+
+/*
+ * Anonymize a packet, and adjust its checksums.
+ */
+static void WinDivertAnonPacket(PWINDIVERT_ANON anon, UINT8 *packet,
+    UINT packet_len)
+{
+    WINDIVERT_PACKET info;
+    UINT8 *payload;
+    UINT payload_len;
+    UINT32 sum, change = 0;
+    UINT8 type;
+    BOOL error = FALSE;
+
+    if (!WinDivertHelperParsePacketEx(packet, packet_len, &info))
+    {
+        return;
+    }
+    payload = info.Payload;
+    payload_len = (payload == NULL? 0: info.PayloadLength);
+    if (info.IPHeader != NULL)
+    {
+        sum = WinDivertAnonAddresses(anon, (UINT8 *)&info.IPHeader->SrcAddr,
+            2, FALSE);
+        info.IPHeader->Checksum = WinDivertXlatChecksumAdjust(
+            info.IPHeader->Checksum, sum);
+    }
+    else
+    {
+        sum = WinDivertAnonAddresses(anon,
+            (UINT8 *)info.IPv6Header->SrcAddr, 2, TRUE);
+    }
+
+    if (info.TCPHeader != NULL)
+    {
+        info.TCPHeader->Checksum = WinDivertXlatChecksumAdjust(
+            info.TCPHeader->Checksum, sum);
+    }
+    else if (info.UDPHeader != NULL)
+    {
+        if (info.UDPHeader->Checksum != 0)
+        {
+            info.UDPHeader->Checksum = WinDivertXlatChecksumAdjust(
+                info.UDPHeader->Checksum, sum);
+            info.UDPHeader->Checksum = (info.UDPHeader->Checksum == 0?
+                0xFFFF: info.UDPHeader->Checksum);
+        }
+    }
+    else if (info.ICMPHeader != NULL)
+    {
+        type = info.ICMPHeader->Type;
+        if (type == 5)
+        {
+            // Redirect gateway:
+            change = WinDivertAnonAddresses(anon,
+                (UINT8 *)&info.ICMPHeader->Body, 1, FALSE);
+        }
+        error = (type == 3 || type == 4 || type == 5 || type == 11 ||
+            type == 12);
+        if (error)
+        {
+            change += WinDivertAnonQuoted(anon, payload, payload_len);
+        }
+        info.ICMPHeader->Checksum = WinDivertXlatChecksumAdjust(
+            info.ICMPHeader->Checksum, change);
+    }
+    else if (info.ICMPv6Header != NULL)
+    {
+        type = info.ICMPv6Header->Type;
+        change = sum;
+        if (type >= 1 && type <= 4)
+        {
+            change += WinDivertAnonQuoted(anon, payload, payload_len);
+        }
+        else if ((type == 135 || type == 136) && payload_len >= 16)
+        {
+            // Neighbor solicitation/advertisement target:
+            change += WinDivertAnonAddresses(anon, payload, 1, TRUE);
+        }
+        else if (type == 137 && payload_len >= 32)
+        {
+            // Redirect target and destination:
+            change += WinDivertAnonAddresses(anon, payload, 2, TRUE);
+        }
+        info.ICMPv6Header->Checksum = WinDivertXlatChecksumAdjust(
+            info.ICMPv6Header->Checksum, change);
+    }
+}
+
+/*
+ * Anonymize the (possibly truncated) packet quoted by an ICMP error.  The
+ * quoted IPv4 and TCP/UDP/ICMPv6 checksums are adjusted if present.
+ * Returns the change to the one's complement sum of the quoted packet.
+ */
+static UINT32 WinDivertAnonQuoted(PWINDIVERT_ANON anon, UINT8 *data,
+    UINT data_len)
+{
+    UINT16 *checksum;
+    UINT32 old_sum, new_sum, sum;
+    UINT hdr_len, offset, end;
+    UINT8 protocol, *addrs;
+    BOOL ipv6, first;
+
+    if (data == NULL || data_len < sizeof(WINDIVERT_IPHDR))
+    {
+        return 0;
+    }
+    switch (data[0] >> 4)
+    {
+        case 4:
+            hdr_len  = (data[0] & 0x0F) * sizeof(UINT32);
+            if (hdr_len < sizeof(WINDIVERT_IPHDR) || hdr_len > data_len)
+            {
+                return 0;
+            }
+            protocol = data[9];
+            first    = ((data[6] & 0x1F) == 0 && data[7] == 0);
+            addrs    = data + 12;
+            ipv6     = FALSE;
+            break;
+        case 6:
+            if (data_len < sizeof(WINDIVERT_IPV6HDR))
+            {
+                return 0;
+            }
+            hdr_len  = sizeof(WINDIVERT_IPV6HDR);
+            protocol = data[6];
+            first    = TRUE;
+            addrs    = data + 8;
+            ipv6     = TRUE;
+            break;
+        default:
+            return 0;
+    }
+    switch (protocol)
+    {
+        case IPPROTO_TCP:
+            offset = 16;
+            break;
+        case IPPROTO_UDP:
+            offset = 6;
+            break;
+        case IPPROTO_ICMPV6:
+            offset = (ipv6? 2: 0);
+            break;
+        default:
+            offset = 0;
+            break;
+    }
+    offset = (offset != 0 && first && hdr_len + offset + 2 <= data_len?
+        hdr_len + offset: 0);
+    end = (offset != 0? offset + 2: hdr_len);
+
+    old_sum = WinDivertChecksumAdd(0, data, end);
+    sum = WinDivertAnonAddresses(anon, addrs, 2, ipv6);
+    if (!ipv6)
+    {
+        checksum  = (UINT16 *)(data + 10);
+        *checksum = WinDivertXlatChecksumAdjust(*checksum, sum);
+    }
+    if (offset != 0)
+    {
+        checksum = (UINT16 *)(data + offset);
+        if (protocol != IPPROTO_UDP || *checksum != 0)
+        {
+            *checksum = WinDivertXlatChecksumAdjust(*checksum, sum);
+            *checksum = (protocol == IPPROTO_UDP && *checksum == 0? 0xFFFF:
+                *checksum);
+        }
+    }
+    new_sum = WinDivertChecksumAdd(0, data, end);
+    return WinDivertXlatChecksumSub(new_sum, old_sum);
+}
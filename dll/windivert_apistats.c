@@ -0,0 +1,386 @@
+/*
+ * windivert_apistats.c
+ * (C) 2019, all rights reserved,
+ *
+ * This file is part of WinDivert.
+ *
+ * WinDivert is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * WinDivert is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Opt-in API latency statistics.  When no handle is enabled, the cost to
+ * each instrumented API call is a single (shared, read-mostly) load.
+ *
+ * Enabled handles are kept in a small fixed table, and counters are updated
+ * with interlocked operations so that a handle may be used by several
+ * threads.  Times are measured with QueryPerformanceCounter() and converted
+ * to nanoseconds using a fixed-point multiplier.  A call that is in progress
+ * when its handle is disabled may still be counted.
+ */
+
+#define WINDIVERT_API_STATS_HANDLES         16          // Power of 2.
+#define WINDIVERT_API_STATS_SHIFT           20
+
+/*
+ * Per-API counters.
+ */
+typedef struct
+{
+    volatile LONG64 calls;
+    volatile LONG64 errors;
+    volatile LONG64 pending;
+    volatile LONG64 time;
+    volatile LONG64 max_time;
+    volatile LONG64 packets;
+    volatile LONG64 slots;
+    volatile LONG64 hist[WINDIVERT_API_STATS_BUCKETS];
+    volatile LONG error_code[WINDIVERT_API_STATS_ERRORS];
+    volatile LONG64 error_count[WINDIVERT_API_STATS_ERRORS];
+} WINDIVERT_API_COUNTERS, *PWINDIVERT_API_COUNTERS;
+
+/*
+ * Per-handle entry.
+ */
+typedef struct
+{
+    HANDLE volatile handle;         // Handle (or NULL).
+    volatile LONG used;             // Entry claimed?
+    WINDIVERT_API_COUNTERS counters[WINDIVERT_API_MAX+1];
+} WINDIVERT_API_ENTRY, *PWINDIVERT_API_ENTRY;
+
+static WINDIVERT_API_ENTRY windivert_api_entries[WINDIVERT_API_STATS_HANDLES];
+static volatile LONG windivert_api_enabled = 0;
+static UINT64 windivert_api_mult = 0;       // ns/tick (fixed point).
+static UINT64 windivert_api_max_ticks = 0;  // Max ticks before overflow.
+
+/*
+ * Find the entry for a handle.
+ */
+static PWINDIVERT_API_ENTRY WinDivertApiStatsLookup(HANDLE handle)
+{
+    UINT i, idx = (UINT)((UINT_PTR)handle >> 2);
+
+    for (i = 0; i < WINDIVERT_API_STATS_HANDLES; i++, idx++)
+    {
+        idx &= (WINDIVERT_API_STATS_HANDLES - 1);
+        if (windivert_api_entries[idx].handle == handle)
+        {
+            return &windivert_api_entries[idx];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Begin an API call.  Returns NULL if the handle is not enabled.
+ */
+static PWINDIVERT_API_COUNTERS WinDivertApiStatsBegin(HANDLE handle,
+    WINDIVERT_API api, INT64 *start)
+{
+    PWINDIVERT_API_ENTRY entry;
+    LARGE_INTEGER now;
+
+    if (windivert_api_enabled == 0 || handle == NULL)
+    {
+        return NULL;
+    }
+    entry = WinDivertApiStatsLookup(handle);
+    if (entry == NULL)
+    {
+        return NULL;
+    }
+    QueryPerformanceCounter(&now);
+    *start = now.QuadPart;
+    return &entry->counters[api];
+}
+
+/*
+ * Map a time (in ns) to a histogram bucket.
+ */
+static UINT WinDivertApiStatsBucket(UINT64 ns)
+{
+    UINT bucket;
+
+    if (ns == 0)
+    {
+        return 0;
+    }
+    bucket = 64 - WinDivertClz64(ns);
+    return (bucket >= WINDIVERT_API_STATS_BUCKETS?
+        WINDIVERT_API_STATS_BUCKETS - 1: bucket);
+}
+
+/*
+ * Record a call of a given duration (in ticks).
+ */
+static void WinDivertApiStatsRecord(PWINDIVERT_API_COUNTERS counters,
+    UINT64 ticks, BOOL result, DWORD err, UINT packets, UINT slots)
+{
+    UINT64 ns;
+    LONG64 max_time, old_max_time;
+    UINT i;
+
+    ticks = (ticks > windivert_api_max_ticks? windivert_api_max_ticks: ticks);
+    ns = WINDIVERT_MUL64(ticks, windivert_api_mult) >>
+        WINDIVERT_API_STATS_SHIFT;
+    if (!result && err == ERROR_IO_PENDING)
+    {
+        // Overlapped; only the submission is timed.
+        InterlockedIncrement64(&counters->pending);
+    }
+    else
+    {
+        InterlockedIncrement64(&counters->calls);
+    }
+    InterlockedExchangeAdd64(&counters->time, (LONG64)ns);
+    InterlockedIncrement64(&counters->hist[WinDivertApiStatsBucket(ns)]);
+    max_time = counters->max_time;
+    while ((UINT64)max_time < ns)
+    {
+        old_max_time = InterlockedCompareExchange64(&counters->max_time,
+            (LONG64)ns, max_time);
+        if (old_max_time == max_time)
+        {
+            break;
+        }
+        max_time = old_max_time;
+    }
+    if (result)
+    {
+        InterlockedExchangeAdd64(&counters->packets, (LONG64)packets);
+        InterlockedExchangeAdd64(&counters->slots, (LONG64)slots);
+        return;
+    }
+    if (err == ERROR_IO_PENDING)
+    {
+        return;
+    }
+    InterlockedIncrement64(&counters->errors);
+    for (i = 0; i < WINDIVERT_API_STATS_ERRORS; i++)
+    {
+        if (counters->error_code[i] == 0)
+        {
+            (VOID)InterlockedCompareExchange(&counters->error_code[i],
+                (LONG)err, 0);
+        }
+        if (counters->error_code[i] == (LONG)err)
+        {
+            InterlockedIncrement64(&counters->error_count[i]);
+            break;
+        }
+    }
+}
+
+/*
+ * End an API call.  Preserves the last error.
+ */
+static void WinDivertApiStatsEnd(PWINDIVERT_API_COUNTERS counters,
+    INT64 start, BOOL result, UINT packets, UINT slots)
+{
+    LARGE_INTEGER now;
+    DWORD err;
+
+    if (counters == NULL)
+    {
+        return;
+    }
+    err = GetLastError();
+    QueryPerformanceCounter(&now);
+    WinDivertApiStatsRecord(counters,
+        (now.QuadPart > start? (UINT64)(now.QuadPart - start): 0), result,
+        err, packets, slots);
+    SetLastError(err);
+}
+
+/*
+ * Add counters to a WINDIVERT_API_STATS.
+ */
+static void WinDivertApiStatsAggregate(PWINDIVERT_API_STATS stats,
+    const WINDIVERT_API_COUNTERS *counters)
+{
+    UINT i, j;
+
+    stats->Calls     += (UINT64)counters->calls;
+    stats->Errors    += (UINT64)counters->errors;
+    stats->Pending   += (UINT64)counters->pending;
+    stats->TotalTime += (UINT64)counters->time;
+    stats->MaxTime    = ((UINT64)counters->max_time > stats->MaxTime?
+        (UINT64)counters->max_time: stats->MaxTime);
+    stats->Packets   += (UINT64)counters->packets;
+    stats->Slots     += (UINT64)counters->slots;
+    for (i = 0; i < WINDIVERT_API_STATS_BUCKETS; i++)
+    {
+        stats->Histogram[i] += (UINT64)counters->hist[i];
+    }
+    for (i = 0; i < WINDIVERT_API_STATS_ERRORS &&
+            counters->error_code[i] != 0; i++)
+    {
+        for (j = 0; j < WINDIVERT_API_STATS_ERRORS &&
+                stats->ErrorCode[j] != 0 &&
+                stats->ErrorCode[j] != (UINT32)counters->error_code[i]; j++)
+            ;
+        if (j >= WINDIVERT_API_STATS_ERRORS)
+        {
+            continue;
+        }
+        stats->ErrorCode[j]   = (UINT32)counters->error_code[i];
+        stats->ErrorCount[j] += (UINT64)counters->error_count[i];
+    }
+}
+
+/*
+ * Compute a percentile (as the upper bound of its histogram bucket).
+ */
+static UINT64 WinDivertApiStatsPercentile(const WINDIVERT_API_STATS *stats,
+    UINT percent)
+{
+    UINT64 total = 0, count = 0;
+    UINT i;
+
+    for (i = 0; i < WINDIVERT_API_STATS_BUCKETS; i++)
+    {
+        total += stats->Histogram[i];
+    }
+    if (total == 0)
+    {
+        return 0;
+    }
+    for (i = 0; i < WINDIVERT_API_STATS_BUCKETS - 1; i++)
+    {
+        count += stats->Histogram[i];
+        if (WINDIVERT_MUL64(count, 100) >= WINDIVERT_MUL64(total, percent))
+        {
+            break;
+        }
+    }
+    return ((UINT64)1 << i);
+}
+
+/*
+ * Enable or disable API statistics for a handle.
+ */
+BOOL WinDivertHelperApiStatsEnable(HANDLE handle, BOOL enable)
+{
+    PWINDIVERT_API_ENTRY entry;
+    LARGE_INTEGER freq;
+    UINT i, idx;
+
+    if (handle == NULL || handle == INVALID_HANDLE_VALUE)
+    {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return FALSE;
+    }
+    if (!enable)
+    {
+        entry = WinDivertApiStatsLookup(handle);
+        if (entry == NULL)
+        {
+            SetLastError(ERROR_NOT_FOUND);
+            return FALSE;
+        }
+        InterlockedExchangePointer((PVOID volatile *)&entry->handle, NULL);
+        InterlockedDecrement(&windivert_api_enabled);
+        InterlockedExchange(&entry->used, 0);
+        return TRUE;
+    }
+    if (windivert_api_mult == 0)
+    {
+        if (!QueryPerformanceFrequency(&freq) || freq.QuadPart <= 0)
+        {
+            return FALSE;
+        }
+        windivert_api_mult = WinDivertDiv64(
+            (UINT64)1000000000 << WINDIVERT_API_STATS_SHIFT,
+            (UINT64)freq.QuadPart);
+        windivert_api_mult = (windivert_api_mult == 0? 1: windivert_api_mult);
+        windivert_api_max_ticks = WinDivertDiv64(~(UINT64)0,
+            windivert_api_mult);
+    }
+    if (WinDivertApiStatsLookup(handle) != NULL)
+    {
+        return TRUE;
+    }
+    idx = (UINT)((UINT_PTR)handle >> 2);
+    for (i = 0; i < WINDIVERT_API_STATS_HANDLES; i++, idx++)
+    {
+        idx &= (WINDIVERT_API_STATS_HANDLES - 1);
+        entry = &windivert_api_entries[idx];
+        if (InterlockedCompareExchange(&entry->used, 1, 0) == 0)
+        {
+            memset((PVOID)entry->counters, 0, sizeof(entry->counters));
+            InterlockedExchangePointer((PVOID volatile *)&entry->handle,
+                handle);
+            InterlockedIncrement(&windivert_api_enabled);
+            return TRUE;
+        }
+    }
+    SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+    return FALSE;
+}
+
+/*
+ * Query API statistics for a handle (or all enabled handles if NULL).
+ */
+BOOL WinDivertHelperApiStatsQuery(HANDLE handle, WINDIVERT_API api,
+    PWINDIVERT_API_STATS pStats)
+{
+    PWINDIVERT_API_ENTRY entry;
+    UINT i;
+
+    if ((UINT)api > WINDIVERT_API_MAX || pStats == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    memset(pStats, 0, sizeof(*pStats));
+    if (handle != NULL)
+    {
+        entry = WinDivertApiStatsLookup(handle);
+        if (entry == NULL)
+        {
+            SetLastError(ERROR_NOT_FOUND);
+            return FALSE;
+        }
+        WinDivertApiStatsAggregate(pStats, &entry->counters[api]);
+    }
+    else
+    {
+        for (i = 0; i < WINDIVERT_API_STATS_HANDLES; i++)
+        {
+            entry = &windivert_api_entries[i];
+            if (entry->handle != NULL)
+            {
+                WinDivertApiStatsAggregate(pStats, &entry->counters[api]);
+            }
+        }
+    }
+    pStats->MedianTime = WinDivertApiStatsPercentile(pStats, 50);
+    pStats->P99Time    = WinDivertApiStatsPercentile(pStats, 99);
+    return TRUE;
+}
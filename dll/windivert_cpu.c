@@ -0,0 +1,144 @@
+/*
+ * windivert_cpu.c
+ * (C) 2019, all rights reserved,
+ *
+ * This file is part of WinDivert.
+ *
+ * WinDivert is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * WinDivert is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Sampled per-handle CPU accounting.  This is shared with the driver, but has
+ * no OS dependencies so that it can be tested in isolation.  The caller
+ * supplies the clock (e.g. KeQueryPerformanceCounter()).
+ *
+ * Every event is counted, but only 1-in-WINDIVERT_CPU_SAMPLE_RATE events are
+ * timed.  A sampled event is divided into consecutive phases, and the time
+ * since the previous phase boundary is charged to the phase that just ended.
+ * Counters are kept in per-processor slots (one cache line each) and are
+ * only aggregated when queried.  Updates are not atomic, so the results are
+ * estimates.
+ */
+
+#define WINDIVERT_CPU_SAMPLE_SHIFT          6
+#define WINDIVERT_CPU_SAMPLE_RATE           (1 << WINDIVERT_CPU_SAMPLE_SHIFT)
+#define WINDIVERT_CPU_SLOTS                 16          // Power of 2.
+
+#define WINDIVERT_CPU_PARSE                 0           // Header parsing.
+#define WINDIVERT_CPU_FILTER                1           // Filter evaluation.
+#define WINDIVERT_CPU_QUEUE                 2           // Queueing.
+#define WINDIVERT_CPU_COPY                  3           // Packet copying.
+#define WINDIVERT_CPU_MAX                   4
+
+/*
+ * Per-processor counters.
+ */
+typedef struct
+{
+    UINT64 events;                  // Events counted.
+    UINT64 time[WINDIVERT_CPU_MAX]; // Sampled time per phase.
+    UINT64 reserved[3];             // Pad to 64 bytes.
+} WINDIVERT_CPU_SLOT, *PWINDIVERT_CPU_SLOT;
+
+/*
+ * Per-handle counters.
+ */
+typedef struct WINDIVERT_CPU
+{
+    WINDIVERT_CPU_SLOT slots[WINDIVERT_CPU_SLOTS];
+} WINDIVERT_CPU, *PWINDIVERT_CPU;
+
+/*
+ * An in-progress sample.
+ */
+typedef struct WINDIVERT_CPU_SAMPLE
+{
+    PWINDIVERT_CPU_SLOT slot;       // Slot to charge.
+    INT64 time;                     // Start of the current phase.
+} WINDIVERT_CPU_SAMPLE, *PWINDIVERT_CPU_SAMPLE;
+
+/*
+ * Count an event, and start a sample if it is selected.  Returns NULL if the
+ * event is not sampled.
+ */
+static PWINDIVERT_CPU_SAMPLE WinDivertCpuSample(PWINDIVERT_CPU cpu,
+    UINT32 processor, INT64 now, PWINDIVERT_CPU_SAMPLE sample)
+{
+    PWINDIVERT_CPU_SLOT slot =
+        cpu->slots + (processor & (WINDIVERT_CPU_SLOTS - 1));
+    UINT64 events = slot->events++;
+
+    if ((events & (WINDIVERT_CPU_SAMPLE_RATE - 1)) != 0)
+    {
+        return NULL;
+    }
+    sample->slot = slot;
+    sample->time = now;
+    return sample;
+}
+
+/*
+ * End the current phase of a sample.
+ */
+static void WinDivertCpuPhase(PWINDIVERT_CPU_SAMPLE sample, UINT phase,
+    INT64 now)
+{
+    if (now > sample->time)
+    {
+        sample->slot->time[phase] += (UINT64)(now - sample->time);
+    }
+    sample->time = now;
+}
+
+/*
+ * Aggregate the counters.  Times are scaled by the sample rate.
+ */
+static void WinDivertCpuQuery(const WINDIVERT_CPU *cpu, UINT64 *events,
+    UINT64 *time)
+{
+    UINT i, j;
+
+    *events = 0;
+    for (j = 0; j < WINDIVERT_CPU_MAX; j++)
+    {
+        time[j] = 0;
+    }
+    for (i = 0; i < WINDIVERT_CPU_SLOTS; i++)
+    {
+        *events += cpu->slots[i].events;
+        for (j = 0; j < WINDIVERT_CPU_MAX; j++)
+        {
+            time[j] += cpu->slots[i].time[j];
+        }
+    }
+    for (j = 0; j < WINDIVERT_CPU_MAX; j++)
+    {
+        time[j] <<= WINDIVERT_CPU_SAMPLE_SHIFT;
+    }
+}
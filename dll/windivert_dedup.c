@@ -0,0 +1,472 @@
+/*
+ * windivert_dedup.c
+ * (C) 2019, all rights reserved,
+ *
+ * This file is part of WinDivert.
+ *
+ * WinDivert is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * WinDivert is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Duplicate packet suppression.  Each packet is reduced to a 64 bit content
+ * hash that ignores the fields that change when the same packet is seen
+ * twice (e.g. by both an outbound and inbound handle for loopback traffic,
+ * or before and after forwarding): the TTL/HopLimit and the IPv4, TCP, UDP
+ * and ICMP checksums.  A packet is a duplicate if a packet with the same
+ * hash was seen within the time window.
+ *
+ * The table is an array of 64 byte buckets of 8 slots, each slot holding a
+ * 32 bit fingerprint and the low 32 bits of the timestamp.  A lookup touches
+ * a single cache line, and slots are claimed with a compare-and-exchange,
+ * so handles on different threads can share the table without locks.  When
+ * a bucket is full, the oldest slot is replaced.  Slots are read without
+ * atomics; a torn read (32-bit builds only) can at worst misreport a single
+ * packet.
+ */
+
+#define WINDIVERT_DEDUP_BLOCK           32          // Packets per block.
+#define WINDIVERT_DEDUP_WAYS            8           // Slots per bucket.
+#define WINDIVERT_DEDUP_SIZE_MIN        WINDIVERT_DEDUP_WAYS
+#define WINDIVERT_DEDUP_SIZE_MAX        (1 << 26)
+#define WINDIVERT_DEDUP_WINDOW_MAX      (1 << 30)   // Timestamp units.
+#define WINDIVERT_DEDUP_RETRIES         4
+#define WINDIVERT_DEDUP_STRIPE          32          // Hash stripe (bytes).
+#define WINDIVERT_DEDUP_NORM_MAX        256         // Normalized prefix.
+#define WINDIVERT_DEDUP_SEED            0x9E3779B97F4A7C15ull
+#define WINDIVERT_DEDUP_SLOT(fp, time)                                  \
+    (((UINT64)(fp) << 32) | (UINT64)(UINT32)(time))
+
+/*
+ * Bucket (one cache line).
+ */
+typedef struct
+{
+    volatile LONG64 slots[WINDIVERT_DEDUP_WAYS];
+} WINDIVERT_DEDUP_BUCKET, *PWINDIVERT_DEDUP_BUCKET;
+
+/*
+ * Dedup table.
+ */
+struct WINDIVERT_DEDUP
+{
+    HANDLE pool;                    // Private heap.
+    PWINDIVERT_DEDUP_BUCKET buckets;// Buckets (cache line aligned).
+    UINT32 mask;                    // Bucket mask.
+    INT32 window;                   // Time window.
+    UINT64 flags;                   // WINDIVERT_DEDUP_FLAG_*
+    volatile LONG64 checked;        // Packets checked.
+    volatile LONG64 duplicates;     // Duplicates found.
+};
+
+/*
+ * Prototypes.
+ */
+static UINT WinDivertDedupBlock(PWINDIVERT_DEDUP dedup, const UINT8 **packet,
+    UINT *packet_len, const WINDIVERT_ADDRESS *addr, UINT count,
+    UINT8 *duplicate, UINT *lens);
+static UINT64 WinDivertDedupHash(const UINT8 *packet, UINT packet_len,
+    BOOL strict);
+static void WinDivertDedupStripes(UINT64 *acc, const UINT8 *data, UINT len);
+static BOOL WinDivertDedupInsert(PWINDIVERT_DEDUP dedup, UINT64 hash,
+    INT64 timestamp);
+
+/*
+ * Create a dedup table.
+ */
+PWINDIVERT_DEDUP WinDivertHelperDedupCreate(UINT size, INT64 window,
+    UINT64 flags)
+{
+    HANDLE pool;
+    PWINDIVERT_DEDUP dedup;
+    UINT8 *buckets;
+    UINT num_buckets;
+
+    if (size < WINDIVERT_DEDUP_SIZE_MIN || size > WINDIVERT_DEDUP_SIZE_MAX ||
+        window < 0 || window > WINDIVERT_DEDUP_WINDOW_MAX ||
+        (flags & ~WINDIVERT_DEDUP_FLAG_STRICT) != 0)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return NULL;
+    }
+    for (num_buckets = 1; num_buckets * WINDIVERT_DEDUP_WAYS < size;
+            num_buckets <<= 1)
+        ;
+
+    pool = HeapCreate(0, WINDIVERT_MIN_POOL_SIZE, 0);
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+    dedup = (PWINDIVERT_DEDUP)HeapAlloc(pool, HEAP_ZERO_MEMORY,
+        sizeof(struct WINDIVERT_DEDUP));
+    buckets = (UINT8 *)HeapAlloc(pool, HEAP_ZERO_MEMORY,
+        num_buckets * sizeof(WINDIVERT_DEDUP_BUCKET) +
+        sizeof(WINDIVERT_DEDUP_BUCKET));
+    if (dedup == NULL || buckets == NULL)
+    {
+        HeapDestroy(pool);
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+    buckets += sizeof(WINDIVERT_DEDUP_BUCKET) -
+        ((UINT_PTR)buckets % sizeof(WINDIVERT_DEDUP_BUCKET));
+    dedup->pool    = pool;
+    dedup->buckets = (PWINDIVERT_DEDUP_BUCKET)buckets;
+    dedup->mask    = num_buckets - 1;
+    dedup->window  = (INT32)window;
+    dedup->flags   = flags;
+    return dedup;
+}
+
+/*
+ * Check a batch of packets.  Sets pDuplicate[i] for each duplicate packet.
+ */
+BOOL WinDivertHelperDedupCheck(PWINDIVERT_DEDUP dedup, const VOID *pPacket,
+    UINT packetLen, const WINDIVERT_ADDRESS *pAddr, UINT addrLen,
+    UINT8 *pDuplicate, UINT *pDupCount)
+{
+    const UINT8 *packet = (const UINT8 *)pPacket;
+    UINT8 duplicate[WINDIVERT_DEDUP_BLOCK];
+    UINT lens[WINDIVERT_DEDUP_BLOCK];
+    UINT count, n, i, dups = 0;
+
+    if (dedup == NULL || pAddr == NULL ||
+        (pPacket == NULL && packetLen != 0) ||
+        addrLen % sizeof(WINDIVERT_ADDRESS) != 0)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    count = addrLen / sizeof(WINDIVERT_ADDRESS);
+
+    for (i = 0; i < count; i += n)
+    {
+        n = count - i;
+        n = (n > WINDIVERT_DEDUP_BLOCK? WINDIVERT_DEDUP_BLOCK: n);
+        dups += WinDivertDedupBlock(dedup, &packet, &packetLen, pAddr + i, n,
+            duplicate, lens);
+        if (pDuplicate != NULL)
+        {
+            memcpy(pDuplicate + i, duplicate, n);
+        }
+    }
+    if (pDupCount != NULL)
+    {
+        *pDupCount = dups;
+    }
+    return TRUE;
+}
+
+/*
+ * Remove the duplicates from a batch of packets (in place).
+ */
+BOOL WinDivertHelperDedupFilter(PWINDIVERT_DEDUP dedup, VOID *pPacket,
+    UINT *pPacketLen, WINDIVERT_ADDRESS *pAddr, UINT *pAddrLen)
+{
+    UINT8 *packet = (UINT8 *)pPacket, *out = (UINT8 *)pPacket;
+    const UINT8 *in = (const UINT8 *)pPacket;
+    UINT8 duplicate[WINDIVERT_DEDUP_BLOCK];
+    UINT lens[WINDIVERT_DEDUP_BLOCK];
+    UINT packet_len, count, n, i, j, out_count = 0;
+
+    if (dedup == NULL || pPacketLen == NULL || pAddr == NULL ||
+        pAddrLen == NULL || (pPacket == NULL && *pPacketLen != 0) ||
+        *pAddrLen % sizeof(WINDIVERT_ADDRESS) != 0)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    packet_len = *pPacketLen;
+    count = *pAddrLen / sizeof(WINDIVERT_ADDRESS);
+
+    for (i = 0; i < count; i += n)
+    {
+        n = count - i;
+        n = (n > WINDIVERT_DEDUP_BLOCK? WINDIVERT_DEDUP_BLOCK: n);
+        packet = (UINT8 *)in;
+        (VOID)WinDivertDedupBlock(dedup, &in, &packet_len, pAddr + i, n,
+            duplicate, lens);
+        for (j = 0; j < n; j++)
+        {
+            if (!duplicate[j])
+            {
+                WinDivertMoveMemory(out, packet, lens[j]);
+                if (out_count != i + j)
+                {
+                    memcpy(&pAddr[out_count], &pAddr[i + j],
+                        sizeof(WINDIVERT_ADDRESS));
+                }
+                out += lens[j];
+                out_count++;
+            }
+            packet += lens[j];
+        }
+    }
+    *pPacketLen = (UINT)(out - (UINT8 *)pPacket);
+    *pAddrLen   = out_count * sizeof(WINDIVERT_ADDRESS);
+    return TRUE;
+}
+
+/*
+ * Query dedup counters.
+ */
+BOOL WinDivertHelperDedupQuery(PWINDIVERT_DEDUP dedup, UINT64 *pChecked,
+    UINT64 *pDuplicates)
+{
+    if (dedup == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    if (pChecked != NULL)
+    {
+        *pChecked = (UINT64)dedup->checked;
+    }
+    if (pDuplicates != NULL)
+    {
+        *pDuplicates = (UINT64)dedup->duplicates;
+    }
+    return TRUE;
+}
+
+/*
+ * Free a dedup table.
+ */
+void WinDivertHelperDedupFree(PWINDIVERT_DEDUP dedup)
+{
+    if (dedup == NULL)
+    {
+        return;
+    }
+    HeapDestroy(dedup->pool);
+}
+
+/*
+ * Check a block of packets.  Packets are hashed first, and then looked up,
+ * so that the bucket misses of different packets can overlap.  Packets
+ * without data (non-network layers) are never duplicates.
+ */
+static UINT WinDivertDedupBlock(PWINDIVERT_DEDUP dedup, const UINT8 **packet,
+    UINT *packet_len, const WINDIVERT_ADDRESS *addr, UINT count,
+    UINT8 *duplicate, UINT *lens)
+{
+    UINT64 hash[WINDIVERT_DEDUP_BLOCK];
+    BOOL strict = ((dedup->flags & WINDIVERT_DEDUP_FLAG_STRICT) != 0);
+    UINT len, i, dups = 0;
+
+    // (1) Hash:
+    for (i = 0; i < count; i++)
+    {
+        switch (addr[i].Layer)
+        {
+            case WINDIVERT_LAYER_NETWORK:
+            case WINDIVERT_LAYER_NETWORK_FORWARD:
+                len = (*packet == NULL? 0:
+                    WinDivertGetPacketLength(*packet, *packet_len));
+                break;
+            default:
+                len = 0;
+                break;
+        }
+        hash[i] = (len == 0? 0: WinDivertDedupHash(*packet, len, strict));
+        lens[i] = len;
+        *packet     += len;
+        *packet_len -= len;
+    }
+
+    // (2) Lookup & insert:
+    for (i = 0; i < count; i++)
+    {
+        duplicate[i] = (UINT8)(lens[i] != 0 &&
+            !WinDivertDedupInsert(dedup, hash[i], addr[i].Timestamp));
+        dups += duplicate[i];
+    }
+
+    InterlockedExchangeAdd64(&dedup->checked, (LONG64)count);
+    if (dups != 0)
+    {
+        InterlockedExchangeAdd64(&dedup->duplicates, (LONG64)dups);
+    }
+    return dups;
+}
+
+/*
+ * Hash a packet (xxHash64-style, 4 lanes).  The prefix containing the
+ * ignored fields is copied and normalized first.
+ */
+static UINT64 WinDivertDedupHash(const UINT8 *packet, UINT packet_len,
+    BOOL strict)
+{
+    UINT64 norm[WINDIVERT_DEDUP_NORM_MAX / sizeof(UINT64)];
+    UINT64 acc[4], h64;
+    UINT8 *bytes = (UINT8 *)norm;
+    WINDIVERT_PACKET info;
+    UINT norm_len = 0, copy_len = 0, csum = 0, len;
+
+    if (!strict && WinDivertHelperParsePacketEx(packet, packet_len, &info))
+    {
+        if (info.TCPHeader != NULL)
+        {
+            csum = (UINT)((UINT8 *)&info.TCPHeader->Checksum - packet);
+        }
+        else if (info.UDPHeader != NULL)
+        {
+            csum = (UINT)((UINT8 *)&info.UDPHeader->Checksum - packet);
+        }
+        else if (info.ICMPHeader != NULL)
+        {
+            csum = (UINT)((UINT8 *)&info.ICMPHeader->Checksum - packet);
+        }
+        else if (info.ICMPv6Header != NULL)
+        {
+            csum = (UINT)((UINT8 *)&info.ICMPv6Header->Checksum - packet);
+        }
+        csum = (csum + sizeof(UINT16) > WINDIVERT_DEDUP_NORM_MAX? 0: csum);
+        norm_len = (csum != 0? csum + sizeof(UINT16):
+            sizeof(WINDIVERT_IPHDR));
+        copy_len = (norm_len + WINDIVERT_DEDUP_STRIPE - 1) &
+            ~(WINDIVERT_DEDUP_STRIPE - 1);
+        norm_len = copy_len;
+        copy_len = (copy_len > packet_len? packet_len: copy_len);
+        memcpy(norm, packet, copy_len);
+        memset(bytes + copy_len, 0, norm_len - copy_len);
+        if (info.IPHeader != NULL)
+        {
+            bytes[8]  = 0;                      // TTL
+            bytes[10] = bytes[11] = 0;          // Checksum
+        }
+        else
+        {
+            bytes[7] = 0;                       // HopLimit
+        }
+        if (csum != 0)
+        {
+            bytes[csum] = bytes[csum + 1] = 0;
+        }
+    }
+
+    acc[0] = WINDIVERT_DEDUP_SEED + WINDIVERT_PRIME64_1 + WINDIVERT_PRIME64_2;
+    acc[1] = WINDIVERT_DEDUP_SEED + WINDIVERT_PRIME64_2;
+    acc[2] = WINDIVERT_DEDUP_SEED;
+    acc[3] = WINDIVERT_DEDUP_SEED - WINDIVERT_PRIME64_1;
+    WinDivertDedupStripes(acc, bytes, norm_len);
+    packet     += copy_len;
+    packet_len -= copy_len;
+    len = packet_len & ~(WINDIVERT_DEDUP_STRIPE - 1);
+    WinDivertDedupStripes(acc, packet, len);
+    if (len < packet_len)
+    {
+        memset(bytes, 0, WINDIVERT_DEDUP_STRIPE);
+        memcpy(bytes, packet + len, packet_len - len);
+        WinDivertDedupStripes(acc, bytes, WINDIVERT_DEDUP_STRIPE);
+    }
+    packet_len += copy_len;
+
+    h64 = WINDIVERT_ROTL64(acc[0], 1) + WINDIVERT_ROTL64(acc[1], 7) +
+          WINDIVERT_ROTL64(acc[2], 12) + WINDIVERT_ROTL64(acc[3], 18);
+    h64 = WinDivertXXH64MergeRound(h64, acc[0]);
+    h64 = WinDivertXXH64MergeRound(h64, acc[1]);
+    h64 = WinDivertXXH64MergeRound(h64, acc[2]);
+    h64 = WinDivertXXH64MergeRound(h64, acc[3]);
+    h64 += packet_len;
+    return WinDivertXXH64Avalanche(h64);
+}
+
+/*
+ * Hash whole stripes (len is a multiple of WINDIVERT_DEDUP_STRIPE).
+ */
+static void WinDivertDedupStripes(UINT64 *acc, const UINT8 *data, UINT len)
+{
+    UINT64 v[4];
+    UINT i;
+
+    for (i = 0; i < len; i += WINDIVERT_DEDUP_STRIPE)
+    {
+        memcpy(v, data + i, WINDIVERT_DEDUP_STRIPE);
+        acc[0] = WinDivertXXH64Round(acc[0], v[0]);
+        acc[1] = WinDivertXXH64Round(acc[1], v[1]);
+        acc[2] = WinDivertXXH64Round(acc[2], v[2]);
+        acc[3] = WinDivertXXH64Round(acc[3], v[3]);
+    }
+}
+
+/*
+ * Look up a hash, and insert it if it was not seen within the window.
+ * Returns FALSE if the hash is a duplicate.
+ */
+static BOOL WinDivertDedupInsert(PWINDIVERT_DEDUP dedup, UINT64 hash,
+    INT64 timestamp)
+{
+    PWINDIVERT_DEDUP_BUCKET bucket =
+        &dedup->buckets[(UINT32)hash & dedup->mask];
+    UINT32 fp = (UINT32)(hash >> 32), now = (UINT32)timestamp;
+    LONG64 slot, victim_slot;
+    INT32 age, victim_age;
+    UINT retry, victim, i;
+
+    fp = (fp == 0? 1: fp);          // 0 = empty slot.
+    for (retry = 0; retry < WINDIVERT_DEDUP_RETRIES; retry++)
+    {
+        victim = 0;
+        victim_age = -1;
+        victim_slot = 0;
+        for (i = 0; i < WINDIVERT_DEDUP_WAYS; i++)
+        {
+            slot = bucket->slots[i];
+            age = (INT32)(now - (UINT32)slot);
+            if (age < 0)
+            {
+                // Other handles may be slightly behind:
+                age = (age == (INT32)0x80000000? 0x7FFFFFFF: -age);
+            }
+            if (slot == 0 || age > dedup->window)
+            {
+                age = 0x7FFFFFFF;       // Free or expired.
+            }
+            else if ((UINT32)((UINT64)slot >> 32) == fp)
+            {
+                return FALSE;
+            }
+            if (age > victim_age)
+            {
+                victim      = i;
+                victim_age  = age;
+                victim_slot = slot;
+            }
+        }
+        if (InterlockedCompareExchange64(&bucket->slots[victim],
+                (LONG64)WINDIVERT_DEDUP_SLOT(fp, now), victim_slot) ==
+                victim_slot)
+        {
+            return TRUE;
+        }
+        // Lost a race; the winner may have inserted the same packet.
+    }
+    return TRUE;
+}
@@ -0,0 +1,741 @@
+/*
+ * windivert_encap.c
+ * (C) 2021, all rights reserved,
+ *
+ * This file is part of WinDivert.
+ *
+ * WinDivert is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * WinDivert is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Encapsulation header offsets and constants.
+ */
+#define WINDIVERT_PROTO_IPIP        4
+#define WINDIVERT_PROTO_IPV6        41
+#define WINDIVERT_PROTO_GRE         47
+
+#define WINDIVERT_ETHERTYPE_IP      0x0800
+#define WINDIVERT_ETHERTYPE_IPV6    0x86DD
+
+#define WINDIVERT_GRE_FLAG_C        0x8000
+#define WINDIVERT_GRE_FLAG_K        0x2000
+#define WINDIVERT_GRE_FLAG_S        0x1000
+#define WINDIVERT_GRE_VERSION       0x0007
+
+#define WINDIVERT_VXLAN_PORT        4789
+#define WINDIVERT_VXLAN_FLAG_I      0x08
+#define WINDIVERT_VXLAN_HDR_LEN     8
+#define WINDIVERT_VXLAN_VNI_OFF     4
+#define WINDIVERT_ETH_HDR_LEN       14
+#define WINDIVERT_ETH_ADDR_LEN      6
+
+/*
+ * Prototypes.
+ */
+static UINT32 WinDivertChecksumAdd(UINT32 sum, const VOID *data, UINT len);
+static UINT16 WinDivertChecksumFold(UINT32 sum);
+static void WinDivertMoveMemory(UINT8 *dst, const UINT8 *src, UINT len);
+static void WinDivertEthAddr(UINT8 *eth_addr, UINT32 addr);
+
+/*
+ * Get the length of the IPv4/IPv6 packet at the start of a buffer.
+ */
+static UINT WinDivertGetPacketLength(const VOID *packet, UINT packet_len)
+{
+    const WINDIVERT_IPHDR *ip_header = (const WINDIVERT_IPHDR *)packet;
+    const WINDIVERT_IPV6HDR *ipv6_header;
+    UINT len;
+
+    if (packet_len < sizeof(WINDIVERT_IPHDR))
+    {
+        return 0;
+    }
+    switch (ip_header->Version)
+    {
+        case 4:
+            len = (UINT)ntohs(ip_header->Length);
+            if (len < sizeof(WINDIVERT_IPHDR))
+            {
+                return 0;
+            }
+            break;
+        case 6:
+            if (packet_len < sizeof(WINDIVERT_IPV6HDR))
+            {
+                return 0;
+            }
+            ipv6_header = (const WINDIVERT_IPV6HDR *)packet;
+            len = (UINT)ntohs(ipv6_header->Length) +
+                sizeof(WINDIVERT_IPV6HDR);
+            break;
+        default:
+            return 0;
+    }
+    return (len <= packet_len? len: 0);
+}
+
+/*
+ * Initialize an encapsulation template.
+ */
+BOOL WinDivertHelperEncapInit(PWINDIVERT_ENCAP pEncap,
+    WINDIVERT_ENCAP_TYPE type, BOOL ipv6, const UINT32 *pSrcAddr,
+    const UINT32 *pDstAddr, UINT16 srcPort, UINT16 dstPort, UINT32 key)
+{
+    PWINDIVERT_IPHDR ip_header;
+    PWINDIVERT_IPV6HDR ipv6_header;
+    PWINDIVERT_UDPHDR udp_header;
+    UINT8 *hdr, *eth_header;
+    UINT16 *gre_header;
+    UINT ip_len, i;
+
+    if (pEncap == NULL || pSrcAddr == NULL || pDstAddr == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    if (type == WINDIVERT_ENCAP_VXLAN && (key & 0xFF000000) != 0)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    memset(pEncap, 0, sizeof(WINDIVERT_ENCAP));
+    pEncap->Type = (UINT8)type;
+    pEncap->IPv6 = (ipv6? 1: 0);
+    hdr = pEncap->Header;
+
+    // Outer IP header (the length and protocol fields are set per-packet):
+    if (!ipv6)
+    {
+        ip_len = sizeof(WINDIVERT_IPHDR);
+        ip_header = (PWINDIVERT_IPHDR)hdr;
+        ip_header->Version   = 4;
+        ip_header->HdrLength = sizeof(WINDIVERT_IPHDR) / sizeof(UINT32);
+        ip_header->SrcAddr   = htonl(pSrcAddr[0]);
+        ip_header->DstAddr   = htonl(pDstAddr[0]);
+        WINDIVERT_IPHDR_SET_DF(ip_header, 1);
+    }
+    else
+    {
+        ip_len = sizeof(WINDIVERT_IPV6HDR);
+        ipv6_header = (PWINDIVERT_IPV6HDR)hdr;
+        ipv6_header->Version = 6;
+        WinDivertHelperHtonIPv6Address(pSrcAddr, ipv6_header->SrcAddr);
+        WinDivertHelperHtonIPv6Address(pDstAddr, ipv6_header->DstAddr);
+    }
+
+    // Tunnel header:
+    switch (type)
+    {
+        case WINDIVERT_ENCAP_IPIP:
+            pEncap->Length = (UINT8)ip_len;
+            break;
+        case WINDIVERT_ENCAP_GRE:
+            gre_header = (UINT16 *)(hdr + ip_len);
+            if (key != 0)
+            {
+                gre_header[0] = htons(WINDIVERT_GRE_FLAG_K);
+                *(UINT32 *)(gre_header + 2) = htonl(key);
+                pEncap->Length = (UINT8)(ip_len + 2 * sizeof(UINT32));
+            }
+            else
+            {
+                pEncap->Length = (UINT8)(ip_len + sizeof(UINT32));
+            }
+            break;
+        case WINDIVERT_ENCAP_UDP:
+        case WINDIVERT_ENCAP_VXLAN:
+            udp_header = (PWINDIVERT_UDPHDR)(hdr + ip_len);
+            if (type == WINDIVERT_ENCAP_VXLAN)
+            {
+                dstPort = (dstPort == 0? WINDIVERT_VXLAN_PORT: dstPort);
+                srcPort = (srcPort == 0? WINDIVERT_VXLAN_PORT: srcPort);
+                hdr[ip_len + sizeof(WINDIVERT_UDPHDR)] =
+                    WINDIVERT_VXLAN_FLAG_I;
+                *(UINT32 *)(hdr + ip_len + sizeof(WINDIVERT_UDPHDR) +
+                    WINDIVERT_VXLAN_VNI_OFF) = htonl(key << 8);
+
+                // Inner Ethernet header (the EtherType is set per-packet):
+                eth_header = hdr + ip_len + sizeof(WINDIVERT_UDPHDR) +
+                    WINDIVERT_VXLAN_HDR_LEN;
+                WinDivertEthAddr(eth_header, pDstAddr[0]);
+                WinDivertEthAddr(eth_header + WINDIVERT_ETH_ADDR_LEN,
+                    pSrcAddr[0]);
+                pEncap->Length = (UINT8)(ip_len + sizeof(WINDIVERT_UDPHDR) +
+                    WINDIVERT_VXLAN_HDR_LEN + WINDIVERT_ETH_HDR_LEN);
+            }
+            else
+            {
+                pEncap->Length = (UINT8)(ip_len + sizeof(WINDIVERT_UDPHDR));
+            }
+            if (dstPort == 0)
+            {
+                SetLastError(ERROR_INVALID_PARAMETER);
+                return FALSE;
+            }
+            udp_header->SrcPort = htons(srcPort);
+            udp_header->DstPort = htons(dstPort);
+            break;
+        default:
+            SetLastError(ERROR_INVALID_PARAMETER);
+            return FALSE;
+    }
+
+    // Pre-compute the checksum over the fixed fields:
+    if (!ipv6)
+    {
+        ip_header = (PWINDIVERT_IPHDR)hdr;
+        ip_header->TTL = 64;
+        switch (type)
+        {
+            case WINDIVERT_ENCAP_GRE:
+                ip_header->Protocol = WINDIVERT_PROTO_GRE;
+                break;
+            case WINDIVERT_ENCAP_UDP: case WINDIVERT_ENCAP_VXLAN:
+                ip_header->Protocol = IPPROTO_UDP;
+                break;
+            default:
+                break;
+        }
+        pEncap->Sum = WinDivertChecksumAdd(0, hdr, sizeof(WINDIVERT_IPHDR));
+    }
+    else
+    {
+        ipv6_header = (PWINDIVERT_IPV6HDR)hdr;
+        ipv6_header->HopLimit = 64;
+        switch (type)
+        {
+            case WINDIVERT_ENCAP_GRE:
+                ipv6_header->NextHdr = WINDIVERT_PROTO_GRE;
+                break;
+            case WINDIVERT_ENCAP_UDP: case WINDIVERT_ENCAP_VXLAN:
+                ipv6_header->NextHdr = IPPROTO_UDP;
+                // Pseudo header (excluding length) plus fixed UDP/VXLAN
+                // fields:
+                pEncap->Sum = WinDivertChecksumAdd(0, ipv6_header->SrcAddr,
+                    2 * sizeof(ipv6_header->SrcAddr));
+                pEncap->Sum += htons(IPPROTO_UDP);
+                for (i = ip_len; i < pEncap->Length; i += sizeof(UINT16))
+                {
+                    pEncap->Sum += *(UINT16 *)(hdr + i);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    return TRUE;
+}
+
+/*
+ * Write the outer headers for an inner packet of the given length.  For
+ * IPv6/UDP the inner packet must already follow the outer headers.
+ */
+static void WinDivertWriteEncap(const WINDIVERT_ENCAP *encap, UINT8 *outer,
+    UINT inner_len, UINT8 version)
+{
+    PWINDIVERT_IPHDR ip_header;
+    PWINDIVERT_IPV6HDR ipv6_header;
+    PWINDIVERT_UDPHDR udp_header;
+    UINT ip_len = (encap->IPv6? sizeof(WINDIVERT_IPV6HDR):
+        sizeof(WINDIVERT_IPHDR));
+    UINT total_len = inner_len + encap->Length;
+    UINT16 ethertype = htons(version == 4? WINDIVERT_ETHERTYPE_IP:
+        WINDIVERT_ETHERTYPE_IPV6);
+    UINT32 sum;
+
+    memcpy(outer, encap->Header, encap->Length);
+
+    // Tunnel header:
+    switch (encap->Type)
+    {
+        case WINDIVERT_ENCAP_GRE:
+            *(UINT16 *)(outer + ip_len + sizeof(UINT16)) = ethertype;
+            break;
+        case WINDIVERT_ENCAP_UDP:
+        case WINDIVERT_ENCAP_VXLAN:
+            udp_header = (PWINDIVERT_UDPHDR)(outer + ip_len);
+            udp_header->Length = htons((UINT16)(total_len - ip_len));
+            if (encap->Type == WINDIVERT_ENCAP_VXLAN)
+            {
+                *(UINT16 *)(outer + encap->Length - sizeof(UINT16)) =
+                    ethertype;
+            }
+            if (encap->IPv6)
+            {
+                // UDP checksums are mandatory for IPv6:
+                sum = encap->Sum;
+                sum += 2 * (UINT32)udp_header->Length;
+                if (encap->Type == WINDIVERT_ENCAP_VXLAN)
+                {
+                    sum += ethertype;
+                }
+                sum = WinDivertChecksumAdd(sum, outer + encap->Length,
+                    inner_len);
+                udp_header->Checksum = WinDivertChecksumFold(sum);
+                if (udp_header->Checksum == 0)
+                {
+                    udp_header->Checksum = 0xFFFF;
+                }
+            }
+            break;
+        default:
+            break;
+    }
+
+    // Outer IP header:
+    if (!encap->IPv6)
+    {
+        ip_header = (PWINDIVERT_IPHDR)outer;
+        ip_header->Length = htons((UINT16)total_len);
+        sum = encap->Sum + ip_header->Length;
+        if (encap->Type == WINDIVERT_ENCAP_IPIP)
+        {
+            ip_header->Protocol = (version == 4? WINDIVERT_PROTO_IPIP:
+                WINDIVERT_PROTO_IPV6);
+            sum += *((UINT16 *)ip_header + 4);
+            sum -= *((const UINT16 *)encap->Header + 4);
+        }
+        ip_header->Checksum = WinDivertChecksumFold(sum);
+    }
+    else
+    {
+        ipv6_header = (PWINDIVERT_IPV6HDR)outer;
+        ipv6_header->Length = htons((UINT16)(total_len - ip_len));
+        if (encap->Type == WINDIVERT_ENCAP_IPIP)
+        {
+            ipv6_header->NextHdr = (version == 4? WINDIVERT_PROTO_IPIP:
+                WINDIVERT_PROTO_IPV6);
+        }
+    }
+}
+
+/*
+ * Encapsulate a packet.
+ */
+BOOL WinDivertHelperEncap(const WINDIVERT_ENCAP *pEncap, PVOID pPacket,
+    UINT packetLen, UINT headroom, UINT bufLen, PVOID *ppPacket,
+    UINT *pPacketLen, WINDIVERT_ADDRESS *pAddr)
+{
+    UINT8 *packet = (UINT8 *)pPacket, *outer;
+    UINT inner_len, total_len, max_len;
+
+    if (pEncap == NULL || pPacket == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    inner_len = WinDivertGetPacketLength(pPacket, packetLen);
+    if (inner_len == 0)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    total_len = inner_len + pEncap->Length;
+    max_len = (pEncap->IPv6? UINT16_MAX + sizeof(WINDIVERT_IPV6HDR):
+        UINT16_MAX);
+    if (total_len > max_len)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    // Use the headroom if available, else make room in-place:
+    if (headroom >= pEncap->Length)
+    {
+        outer = packet - pEncap->Length;
+    }
+    else if (bufLen >= total_len)
+    {
+        WinDivertMoveMemory(packet + pEncap->Length, packet, inner_len);
+        outer = packet;
+    }
+    else
+    {
+        SetLastError(ERROR_INSUFFICIENT_BUFFER);
+        return FALSE;
+    }
+
+    WinDivertWriteEncap(pEncap, outer, inner_len,
+        ((const WINDIVERT_IPHDR *)(outer + pEncap->Length))->Version);
+
+    if (ppPacket != NULL)
+    {
+        *ppPacket = outer;
+    }
+    if (pPacketLen != NULL)
+    {
+        *pPacketLen = total_len;
+    }
+    if (pAddr != NULL)
+    {
+        pAddr->IPv6 = pEncap->IPv6;
+        pAddr->IPChecksum = 1;
+        pAddr->UDPChecksum = 1;
+    }
+    return TRUE;
+}
+
+/*
+ * Find the inner packet of an encapsulated packet.
+ */
+static UINT8 *WinDivertFindInner(const WINDIVERT_ENCAP *encap, UINT8 *packet,
+    UINT packet_len, UINT *inner_len_ptr)
+{
+    PWINDIVERT_IPHDR ip_header;
+    PWINDIVERT_IPV6HDR ipv6_header;
+    PWINDIVERT_UDPHDR udp_header;
+    const UINT8 *tunnel;
+    UINT8 protocol, *inner;
+    UINT hdr_len, total_len, min_len, i;
+    UINT16 gre_flags, ethertype;
+
+    total_len = WinDivertGetPacketLength(packet, packet_len);
+    if (total_len == 0)
+    {
+        return NULL;
+    }
+    if (!encap->IPv6)
+    {
+        ip_header = (PWINDIVERT_IPHDR)packet;
+        if (ip_header->Version != 4 || ip_header->HdrLength < 5 ||
+            WINDIVERT_IPHDR_GET_MF(ip_header) ||
+            WINDIVERT_IPHDR_GET_FRAGOFF(ip_header) != 0)
+        {
+            return NULL;
+        }
+        hdr_len  = ip_header->HdrLength * sizeof(UINT32);
+        protocol = ip_header->Protocol;
+    }
+    else
+    {
+        ipv6_header = (PWINDIVERT_IPV6HDR)packet;
+        if (ipv6_header->Version != 6)
+        {
+            return NULL;
+        }
+        hdr_len  = sizeof(WINDIVERT_IPV6HDR);
+        protocol = ipv6_header->NextHdr;
+    }
+
+    switch (encap->Type)
+    {
+        case WINDIVERT_ENCAP_IPIP:
+            if (protocol != WINDIVERT_PROTO_IPIP &&
+                protocol != WINDIVERT_PROTO_IPV6)
+            {
+                return NULL;
+            }
+            break;
+        case WINDIVERT_ENCAP_GRE:
+            if (protocol != WINDIVERT_PROTO_GRE ||
+                hdr_len + sizeof(UINT32) > total_len)
+            {
+                return NULL;
+            }
+            gre_flags = ntohs(*(UINT16 *)(packet + hdr_len));
+            ethertype = ntohs(*(UINT16 *)(packet + hdr_len + sizeof(UINT16)));
+            if ((gre_flags & WINDIVERT_GRE_VERSION) != 0 ||
+                (ethertype != WINDIVERT_ETHERTYPE_IP &&
+                 ethertype != WINDIVERT_ETHERTYPE_IPV6))
+            {
+                return NULL;
+            }
+            hdr_len += sizeof(UINT32);
+            hdr_len += ((gre_flags & WINDIVERT_GRE_FLAG_C) != 0?
+                sizeof(UINT32): 0);
+            hdr_len += ((gre_flags & WINDIVERT_GRE_FLAG_K) != 0?
+                sizeof(UINT32): 0);
+            hdr_len += ((gre_flags & WINDIVERT_GRE_FLAG_S) != 0?
+                sizeof(UINT32): 0);
+            break;
+        case WINDIVERT_ENCAP_UDP:
+        case WINDIVERT_ENCAP_VXLAN:
+            min_len = sizeof(WINDIVERT_UDPHDR) +
+                (encap->Type == WINDIVERT_ENCAP_VXLAN?
+                    WINDIVERT_VXLAN_HDR_LEN + WINDIVERT_ETH_HDR_LEN: 0);
+            if (protocol != IPPROTO_UDP || hdr_len + min_len > total_len)
+            {
+                return NULL;
+            }
+            udp_header = (PWINDIVERT_UDPHDR)(packet + hdr_len);
+            tunnel = encap->Header + (encap->IPv6?
+                sizeof(WINDIVERT_IPV6HDR): sizeof(WINDIVERT_IPHDR));
+            if (udp_header->DstPort !=
+                    ((const WINDIVERT_UDPHDR *)tunnel)->DstPort)
+            {
+                return NULL;
+            }
+            if (encap->Type == WINDIVERT_ENCAP_VXLAN)
+            {
+                if ((packet[hdr_len + sizeof(WINDIVERT_UDPHDR)] &
+                        WINDIVERT_VXLAN_FLAG_I) == 0)
+                {
+                    return NULL;
+                }
+                for (i = sizeof(WINDIVERT_UDPHDR) + WINDIVERT_VXLAN_VNI_OFF;
+                     i < sizeof(WINDIVERT_UDPHDR) +
+                        WINDIVERT_VXLAN_VNI_OFF + 3; i++)
+                {
+                    if (packet[hdr_len + i] != tunnel[i])
+                    {
+                        return NULL;        // Different VNI.
+                    }
+                }
+                ethertype = ntohs(*(UINT16 *)(packet + hdr_len + min_len -
+                    sizeof(UINT16)));
+                if (ethertype != WINDIVERT_ETHERTYPE_IP &&
+                    ethertype != WINDIVERT_ETHERTYPE_IPV6)
+                {
+                    return NULL;
+                }
+            }
+            hdr_len += min_len;
+            break;
+        default:
+            return NULL;
+    }
+
+    if (hdr_len >= total_len)
+    {
+        return NULL;
+    }
+    inner = packet + hdr_len;
+    *inner_len_ptr = WinDivertGetPacketLength(inner, total_len - hdr_len);
+    return (*inner_len_ptr == 0? NULL: inner);
+}
+
+/*
+ * Decapsulate a packet.
+ */
+BOOL WinDivertHelperDecap(const WINDIVERT_ENCAP *pEncap, PVOID pPacket,
+    UINT packetLen, PVOID *ppPacket, UINT *pPacketLen,
+    WINDIVERT_ADDRESS *pAddr)
+{
+    UINT8 *inner;
+    UINT inner_len;
+
+    if (pEncap == NULL || pPacket == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    inner = WinDivertFindInner(pEncap, (UINT8 *)pPacket, packetLen,
+        &inner_len);
+    if (inner == NULL)
+    {
+        SetLastError(ERROR_INVALID_DATA);
+        return FALSE;
+    }
+    if (ppPacket != NULL)
+    {
+        *ppPacket = inner;
+    }
+    if (pPacketLen != NULL)
+    {
+        *pPacketLen = inner_len;
+    }
+    if (pAddr != NULL)
+    {
+        pAddr->IPv6 = (((PWINDIVERT_IPHDR)inner)->Version == 6);
+    }
+    return TRUE;
+}
+
+/*
+ * Encapsulate a batch of packets.
+ */
+BOOL WinDivertHelperEncapBatch(const WINDIVERT_ENCAP *pEncap,
+    const VOID *pPackets, UINT packetsLen, PVOID pOutput, UINT outputLen,
+    UINT *pOutputLen, WINDIVERT_ADDRESS *pAddr, UINT addrLen)
+{
+    const UINT8 *packet = (const UINT8 *)pPackets;
+    UINT8 *output = (UINT8 *)pOutput;
+    UINT packet_len, len, i, n;
+
+    if (pEncap == NULL || pPackets == NULL || pOutput == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    n = (pAddr == NULL? 0: addrLen / sizeof(WINDIVERT_ADDRESS));
+    for (i = 0, len = 0; packetsLen > 0; i++)
+    {
+        packet_len = WinDivertGetPacketLength(packet, packetsLen);
+        if (packet_len == 0)
+        {
+            SetLastError(ERROR_INVALID_PARAMETER);
+            return FALSE;
+        }
+        if (packet_len + pEncap->Length > outputLen - len)
+        {
+            SetLastError(ERROR_INSUFFICIENT_BUFFER);
+            return FALSE;
+        }
+        memcpy(output + len + pEncap->Length, packet, packet_len);
+        WinDivertWriteEncap(pEncap, output + len, packet_len,
+            ((const WINDIVERT_IPHDR *)packet)->Version);
+        if (i < n)
+        {
+            pAddr[i].IPv6 = pEncap->IPv6;
+            pAddr[i].IPChecksum = 1;
+            pAddr[i].UDPChecksum = 1;
+        }
+        len        += packet_len + pEncap->Length;
+        packet     += packet_len;
+        packetsLen -= packet_len;
+    }
+
+    if (pOutputLen != NULL)
+    {
+        *pOutputLen = len;
+    }
+    return TRUE;
+}
+
+/*
+ * Decapsulate a batch of packets (in-place).
+ */
+BOOL WinDivertHelperDecapBatch(const WINDIVERT_ENCAP *pEncap,
+    PVOID pPackets, UINT packetsLen, UINT *pPacketsLen,
+    WINDIVERT_ADDRESS *pAddr, UINT addrLen)
+{
+    UINT8 *packets = (UINT8 *)pPackets, *inner;
+    UINT packet_len, inner_len, pos, len, i, n;
+
+    if (pEncap == NULL || pPackets == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    n = (pAddr == NULL? 0: addrLen / sizeof(WINDIVERT_ADDRESS));
+    for (i = 0, pos = 0, len = 0; pos < packetsLen; i++)
+    {
+        packet_len = WinDivertGetPacketLength(packets + pos,
+            packetsLen - pos);
+        if (packet_len == 0)
+        {
+            SetLastError(ERROR_INVALID_PARAMETER);
+            return FALSE;
+        }
+        inner = WinDivertFindInner(pEncap, packets + pos, packet_len,
+            &inner_len);
+        if (inner == NULL)
+        {
+            // Not encapsulated; keep as-is.
+            inner     = packets + pos;
+            inner_len = packet_len;
+        }
+        else if (i < n)
+        {
+            pAddr[i].IPv6 = (((PWINDIVERT_IPHDR)inner)->Version == 6);
+        }
+        WinDivertMoveMemory(packets + len, inner, inner_len);
+        len += inner_len;
+        pos += packet_len;
+    }
+
+    if (pPacketsLen != NULL)
+    {
+        *pPacketsLen = len;
+    }
+    return TRUE;
+}
+
+/*
+ * Add data to a (non-folded) one's complement sum.
+ */
+static UINT32 WinDivertChecksumAdd(UINT32 sum, const VOID *data, UINT len)
+{
+    const UINT16 *data16 = (const UINT16 *)data;
+    UINT len16 = len >> 1, i;
+
+    for (i = 0; i < len16; i++)
+    {
+        sum += (UINT32)data16[i];
+    }
+    if (len & 0x1)
+    {
+        sum += (UINT16)((const UINT8 *)data)[len-1];
+    }
+    return sum;
+}
+
+/*
+ * Fold a one's complement sum into a checksum.
+ */
+static UINT16 WinDivertChecksumFold(UINT32 sum)
+{
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum += (sum >> 16);
+    return (UINT16)~sum;
+}
+
+/*
+ * Derive a locally administered unicast Ethernet address from (the low 32
+ * bits of) a tunnel endpoint address.
+ */
+static void WinDivertEthAddr(UINT8 *eth_addr, UINT32 addr)
+{
+    eth_addr[0] = 0x02;
+    eth_addr[1] = 0x00;
+    eth_addr[2] = (UINT8)(addr >> 24);
+    eth_addr[3] = (UINT8)(addr >> 16);
+    eth_addr[4] = (UINT8)(addr >> 8);
+    eth_addr[5] = (UINT8)addr;
+}
+
+/*
+ * Move (possibly overlapping) memory.
+ */
+static void WinDivertMoveMemory(UINT8 *dst, const UINT8 *src, UINT len)
+{
+    UINT i;
+
+    if (dst == src)
+    {
+        return;
+    }
+    if (dst < src)
+    {
+        for (i = 0; i < len; i++)
+        {
+            dst[i] = src[i];
+        }
+    }
+    else
+    {
+        for (i = len; i > 0; i--)
+        {
+            dst[i-1] = src[i-1];
+        }
+    }
+}
@@ -79,11 +79,20 @@ typedef enum
     TOKEN_IP_TOS,
     TOKEN_IP_TTL,
     TOKEN_IPV6,
+    TOKEN_IPV6_AH,
     TOKEN_IPV6_DST_ADDR,
+    TOKEN_IPV6_DST_OPTS,
+    TOKEN_IPV6_EXT_HDR_COUNT,
+    TOKEN_IPV6_EXT_HDR_LENGTH,
     TOKEN_IPV6_FLOW_LABEL,
+    TOKEN_IPV6_FRAG_HDR,
     TOKEN_IPV6_HOP_LIMIT,
+    TOKEN_IPV6_HOP_OPTS,
     TOKEN_IPV6_LENGTH,
+    TOKEN_IPV6_MH,
     TOKEN_IPV6_NEXT_HDR,
+    TOKEN_IPV6_ROUTING,
+    TOKEN_IPV6_ROUTING_TYPE,
     TOKEN_IPV6_SRC_ADDR,
     TOKEN_IPV6_TRAFFIC_CLASS,
     TOKEN_TCP,
@@ -131,6 +140,7 @@ typedef enum
     TOKEN_FRAGMENT,
     TOKEN_IF_IDX,
     TOKEN_SUB_IF_IDX,
+    TOKEN_MARK,
     TOKEN_LOOPBACK,
     TOKEN_IMPOSTOR,
     TOKEN_PROCESS_ID,
@@ -143,6 +153,8 @@ typedef enum
     TOKEN_PARENT_ENDPOINT_ID,
     TOKEN_LAYER,
     TOKEN_PRIORITY,
+    TOKEN_PROCESS_NAME,
+    TOKEN_PROCESS_PATH,
     TOKEN_FLOW,
     TOKEN_SOCKET,
     TOKEN_NETWORK,
@@ -181,6 +193,7 @@ typedef enum
     TOKEN_COLON,
     TOKEN_QUESTION,
     TOKEN_NUMBER,
+    TOKEN_STRING,
     TOKEN_END,
 } KIND;
 
@@ -212,10 +225,11 @@ struct EXPR
         PEXPR arg[3];
     };
     UINT8 kind;
-    UINT8 count;
     BOOLEAN neg;
+    UINT16 count;
     UINT16 succ;
     UINT16 fail;
+    UINT16 label;
 };
 
 /*
@@ -237,7 +251,6 @@ typedef UINT64 ERROR, *PERROR;
 #define WINDIVERT_ERROR_ASSERTION_FAILED        10
 
 #define WINDIVERT_MIN_POOL_SIZE                 12288
-#define WINDIVERT_MAX_POOL_SIZE                 131072
 
 #define MAKE_ERROR(code, pos)                   \
     (((ERROR)(code) << 32) | (ERROR)(pos));
@@ -256,9 +269,11 @@ static UINT32 WinDivertKindToField(KIND kind);
 static PEXPR WinDivertParseFilter(HANDLE pool, TOKEN *toks, UINT *i,
     INT depth, BOOL and, PERROR error);
 static BOOL WinDivertCondExecFilter(PWINDIVERT_FILTER filter, UINT length,
-    UINT8 field, UINT32 arg);
+    BOOLEAN *result, UINT8 field, UINT32 arg);
 static int WinDivertCompare128(BOOL neg_a, const UINT32 *a, BOOL neg_b,
     const UINT32 *b, BOOL big);
+static BOOL WinDivertDeserializeFilterHeader(PWINDIVERT_STREAM stream,
+    UINT *length);
 static BOOL WinDivertDeserializeFilter(PWINDIVERT_STREAM stream,
     PWINDIVERT_FILTER filter, UINT *length);
 static void WinDivertFormatExpr(PWINDIVERT_STREAM stream, PEXPR expr,
@@ -611,6 +626,78 @@ static BOOL WinDivertExpandMacro(KIND kind, WINDIVERT_LAYER layer, UINT32 *val)
     }
 }
 
+/*
+ * Tokenize a (UTF-8) string literal into a processName/processPath constant.
+ * On entry, *i is the index after the opening quote.
+ */
+static BOOL WinDivertTokenizeString(const char *filter, UINT *i, UINT32 *val)
+{
+    UINT16 str[WINDIVERT_PROCESS_PATH_MAX];
+    UINT len = 0, n, k;
+    UINT32 c;
+    BOOL suffix = FALSE;
+
+    if (filter[*i] == '*')
+    {
+        suffix = TRUE;
+        *i = *i + 1;
+    }
+    while (filter[*i] != '"')
+    {
+        c = (UINT8)filter[*i];
+        if (c == '\0')
+        {
+            return FALSE;
+        }
+        if (c < 0x80)
+        {
+            n = 0;
+        }
+        else if ((c & 0xE0) == 0xC0)
+        {
+            c &= 0x1F; n = 1;
+        }
+        else if ((c & 0xF0) == 0xE0)
+        {
+            c &= 0x0F; n = 2;
+        }
+        else if ((c & 0xF8) == 0xF0)
+        {
+            c &= 0x07; n = 3;
+        }
+        else
+        {
+            return FALSE;
+        }
+        for (k = 1; k <= n; k++)
+        {
+            if (((UINT8)filter[*i + k] & 0xC0) != 0x80)
+            {
+                return FALSE;
+            }
+            c = (c << 6) | ((UINT8)filter[*i + k] & 0x3F);
+        }
+        *i = *i + 1 + n;
+        if (len + (c > 0xFFFF? 2: 1) > WINDIVERT_PROCESS_PATH_MAX)
+        {
+            return FALSE;
+        }
+        if (c > 0xFFFF)
+        {
+            c -= 0x10000;
+            str[len++] = (UINT16)(0xD800 | (c >> 10));
+            str[len++] = (UINT16)(0xDC00 | (c & 0x3FF));
+        }
+        else
+        {
+            str[len++] = (UINT16)c;
+        }
+    }
+    *i = *i + 1;
+    WinDivertProcessCompile(str, len, suffix, val);
+    return TRUE;
+}
+
 /*
  * Tokenize the given filter string.
  */
@@ -671,11 +758,20 @@ static ERROR WinDivertTokenizeFilter(const char *filter, WINDIVERT_LAYER layer,
         {"ip.TOS",              TOKEN_IP_TOS            },
         {"ip.TTL",              TOKEN_IP_TTL            },
         {"ipv6",                TOKEN_IPV6              },
+        {"ipv6.AH",             TOKEN_IPV6_AH           },
         {"ipv6.DstAddr",        TOKEN_IPV6_DST_ADDR     },
+        {"ipv6.DstOpts",        TOKEN_IPV6_DST_OPTS     },
+        {"ipv6.ExtHdrCount",    TOKEN_IPV6_EXT_HDR_COUNT},
+        {"ipv6.ExtHdrLength",   TOKEN_IPV6_EXT_HDR_LENGTH},
         {"ipv6.FlowLabel",      TOKEN_IPV6_FLOW_LABEL   },
+        {"ipv6.FragHdr",        TOKEN_IPV6_FRAG_HDR     },
         {"ipv6.HopLimit",       TOKEN_IPV6_HOP_LIMIT    },
+        {"ipv6.HopOpts",        TOKEN_IPV6_HOP_OPTS     },
         {"ipv6.Length",         TOKEN_IPV6_LENGTH       },
+        {"ipv6.MH",             TOKEN_IPV6_MH           },
         {"ipv6.NextHdr",        TOKEN_IPV6_NEXT_HDR     },
+        {"ipv6.Routing",        TOKEN_IPV6_ROUTING      },
+        {"ipv6.RoutingType",    TOKEN_IPV6_ROUTING_TYPE },
         {"ipv6.SrcAddr",        TOKEN_IPV6_SRC_ADDR     },
         {"ipv6.TrafficClass",   TOKEN_IPV6_TRAFFIC_CLASS},
         {"layer",               TOKEN_LAYER             },
@@ -683,6 +779,7 @@ static ERROR WinDivertTokenizeFilter(const char *filter, WINDIVERT_LAYER layer,
         {"localAddr",           TOKEN_LOCAL_ADDR        },
         {"localPort",           TOKEN_LOCAL_PORT        },
         {"loopback",            TOKEN_LOOPBACK          },
+        {"mark",                TOKEN_MARK              },
         {"not",                 TOKEN_NOT               },
         {"or",                  TOKEN_OR                },
         {"outbound",            TOKEN_OUTBOUND          },
@@ -692,6 +789,8 @@ static ERROR WinDivertTokenizeFilter(const char *filter, WINDIVERT_LAYER layer,
         {"parentEndpointId",    TOKEN_PARENT_ENDPOINT_ID},
         {"priority",            TOKEN_PRIORITY          },
         {"processId",           TOKEN_PROCESS_ID        },
+        {"processName",         TOKEN_PROCESS_NAME      },
+        {"processPath",         TOKEN_PROCESS_PATH      },
         {"protocol",            TOKEN_PROTOCOL          },
         {"random16",            TOKEN_RANDOM16          },
         {"random32",            TOKEN_RANDOM32          },
@@ -821,6 +920,14 @@ static ERROR WinDivertTokenizeFilter(const char *filter, WINDIVERT_LAYER layer,
             case '?':
                 tokens[tp++].kind = TOKEN_QUESTION;
                 continue;
+            case '"':
+                if (!WinDivertTokenizeString(filter, &i, tokens[tp].val))
+                {
+                    return MAKE_ERROR(WINDIVERT_ERROR_BAD_TOKEN,
+                        tokens[tp].pos);
+                }
+                tokens[tp++].kind = TOKEN_STRING;
+                continue;
             case '&':
                 if (filter[i++] != '&')
                 {
@@ -987,11 +1094,20 @@ static PEXPR WinDivertMakeVar(KIND kind, PERROR error)
         {{{0}}, TOKEN_IP_TOS},
         {{{0}}, TOKEN_IP_TTL},
         {{{0}}, TOKEN_IPV6},
+        {{{0}}, TOKEN_IPV6_AH},
         {{{0}}, TOKEN_IPV6_DST_ADDR},
+        {{{0}}, TOKEN_IPV6_DST_OPTS},
+        {{{0}}, TOKEN_IPV6_EXT_HDR_COUNT},
+        {{{0}}, TOKEN_IPV6_EXT_HDR_LENGTH},
         {{{0}}, TOKEN_IPV6_FLOW_LABEL},
+        {{{0}}, TOKEN_IPV6_FRAG_HDR},
         {{{0}}, TOKEN_IPV6_HOP_LIMIT},
+        {{{0}}, TOKEN_IPV6_HOP_OPTS},
         {{{0}}, TOKEN_IPV6_LENGTH},
+        {{{0}}, TOKEN_IPV6_MH},
         {{{0}}, TOKEN_IPV6_NEXT_HDR},
+        {{{0}}, TOKEN_IPV6_ROUTING},
+        {{{0}}, TOKEN_IPV6_ROUTING_TYPE},
         {{{0}}, TOKEN_IPV6_SRC_ADDR},
         {{{0}}, TOKEN_IPV6_TRAFFIC_CLASS},
         {{{0}}, TOKEN_TCP},
@@ -1030,6 +1146,7 @@ static PEXPR WinDivertMakeVar(KIND kind, PERROR error)
         {{{0}}, TOKEN_FRAGMENT},
         {{{0}}, TOKEN_IF_IDX},
         {{{0}}, TOKEN_SUB_IF_IDX},
+        {{{0}}, TOKEN_MARK},
         {{{0}}, TOKEN_LOOPBACK},
         {{{0}}, TOKEN_IMPOSTOR},
         {{{0}}, TOKEN_PROCESS_ID},
@@ -1042,6 +1159,8 @@ static PEXPR WinDivertMakeVar(KIND kind, PERROR error)
         {{{0}}, TOKEN_PARENT_ENDPOINT_ID},
         {{{0}}, TOKEN_LAYER},
         {{{0}}, TOKEN_PRIORITY},
+        {{{0}}, TOKEN_PROCESS_NAME},
+        {{{0}}, TOKEN_PROCESS_PATH},
     };
 
     // Binary search:
@@ -1194,6 +1313,7 @@ static PEXPR WinDivertParseTest(HANDLE pool, TOKEN *toks, UINT *i, PERROR error)
         case TOKEN_FRAGMENT:
         case TOKEN_IF_IDX:
         case TOKEN_SUB_IF_IDX:
+        case TOKEN_MARK:
         case TOKEN_LOOPBACK:
         case TOKEN_IMPOSTOR:
         case TOKEN_IP:
@@ -1231,6 +1351,15 @@ static PEXPR WinDivertParseTest(HANDLE pool, TOKEN *toks, UINT *i, PERROR error)
         case TOKEN_IPV6_HOP_LIMIT:
         case TOKEN_IPV6_SRC_ADDR:
         case TOKEN_IPV6_DST_ADDR:
+        case TOKEN_IPV6_HOP_OPTS:
+        case TOKEN_IPV6_ROUTING:
+        case TOKEN_IPV6_FRAG_HDR:
+        case TOKEN_IPV6_DST_OPTS:
+        case TOKEN_IPV6_AH:
+        case TOKEN_IPV6_MH:
+        case TOKEN_IPV6_ROUTING_TYPE:
+        case TOKEN_IPV6_EXT_HDR_COUNT:
+        case TOKEN_IPV6_EXT_HDR_LENGTH:
         case TOKEN_ICMP_TYPE:
         case TOKEN_ICMP_CODE:
         case TOKEN_ICMP_CHECKSUM:
@@ -1328,6 +1457,35 @@ static PEXPR WinDivertParseTest(HANDLE pool, TOKEN *toks, UINT *i, PERROR error)
             }
             *i = *i + 1;
             break;
+        case TOKEN_PROCESS_NAME:
+        case TOKEN_PROCESS_PATH:
+            // String fields only support (in)equality tests:
+            var = WinDivertMakeVar(toks[*i].kind, error);
+            *i = *i + 1;
+            switch (toks[*i].kind)
+            {
+                case TOKEN_EQ:
+                    kind = (not? TOKEN_NEQ: TOKEN_EQ);
+                    break;
+                case TOKEN_NEQ:
+                    kind = (not? TOKEN_EQ: TOKEN_NEQ);
+                    break;
+                default:
+                    goto unexpected_token;
+            }
+            *i = *i + 1;
+            if (toks[*i].kind != TOKEN_STRING &&
+                toks[*i].kind != TOKEN_NUMBER)
+            {
+                goto unexpected_token;
+            }
+            val = WinDivertMakeNumber(pool, toks[*i].val, error);
+            if (val == NULL)
+            {
+                return NULL;
+            }
+            *i = *i + 1;
+            return WinDivertMakeBinOp(pool, kind, var, val, error);
         default:
         unexpected_token:
             *error = MAKE_ERROR(WINDIVERT_ERROR_UNEXPECTED_TOKEN, toks[*i].pos);
@@ -1480,6 +1638,12 @@ static PEXPR WinDivertParseFilter(HANDLE pool, TOKEN *toks, UINT *i, INT depth,
                 expr = WinDivertMakeBinOp(pool, TOKEN_AND, expr, arg, error);
                 continue;
             case TOKEN_OR:
+                if (and)
+                {
+                    // Handled by the caller, so that long or-chains are
+                    // parsed iteratively rather than recursively:
+                    return expr;
+                }
                 *i = *i + 1;
                 arg = WinDivertParseFilter(pool, toks, i, depth, TRUE, error);
                 expr = WinDivertMakeBinOp(pool, TOKEN_OR, expr, arg, error);
@@ -1563,12 +1727,25 @@ static void WinDivertSimplifyTest(PEXPR test)
             type = TOKEN_IP;
             lb[0] = 0; ub[0] = 0xFF;
             break;
+        case TOKEN_IPV6_HOP_OPTS:
+        case TOKEN_IPV6_ROUTING:
+        case TOKEN_IPV6_FRAG_HDR:
+        case TOKEN_IPV6_DST_OPTS:
+        case TOKEN_IPV6_AH:
+        case TOKEN_IPV6_MH:
+            type = TOKEN_IPV6;
+            lb[0] = 0; ub[0] = 1;
+            break;
         case TOKEN_IPV6_TRAFFIC_CLASS:
         case TOKEN_IPV6_NEXT_HDR:
         case TOKEN_IPV6_HOP_LIMIT:
             type = TOKEN_IPV6;
             lb[0] = 0; ub[0] = 0xFF;
             break;
+        case TOKEN_IPV6_ROUTING_TYPE:
+            type = TOKEN_IPV6_ROUTING;
+            lb[0] = 0; ub[0] = 0xFF;
+            break;
         case TOKEN_ICMP_TYPE:
         case TOKEN_ICMP_CODE:
             type = TOKEN_ICMP;
@@ -1604,6 +1781,8 @@ static void WinDivertSimplifyTest(PEXPR test)
             lb[0] = 0; ub[0] = 0xFFFF;
             break;
         case TOKEN_IPV6_LENGTH:
+        case TOKEN_IPV6_EXT_HDR_COUNT:
+        case TOKEN_IPV6_EXT_HDR_LENGTH:
             type = TOKEN_IPV6;
             lb[0] = 0; ub[0] = 0xFFFF;
             break;
@@ -1681,6 +1860,7 @@ static void WinDivertSimplifyTest(PEXPR test)
             break;
         case TOKEN_IF_IDX:
         case TOKEN_SUB_IF_IDX:
+        case TOKEN_MARK:
         case TOKEN_RANDOM32:
         case TOKEN_PROCESS_ID:
             lb[0] = 0; ub[0] = 0xFFFFFFFF;
@@ -1819,8 +1999,9 @@ static INT16 WinDivertFlattenExpr(PEXPR expr, INT16 *label, INT16 succ,
                 return -1;
             }
             stack[*label] = expr;
-            expr->succ = succ;
-            expr->fail = fail;
+            expr->succ  = succ;
+            expr->fail  = fail;
+            expr->label = (UINT16)(*label + 1);
             succ = *label;
             *label = *label + 1;
             return succ;
@@ -1876,12 +2057,18 @@ static UINT32 WinDivertKindToField(KIND kind)
             return WINDIVERT_FILTER_FIELD_IFIDX;
         case TOKEN_SUB_IF_IDX:
             return WINDIVERT_FILTER_FIELD_SUBIFIDX;
+        case TOKEN_MARK:
+            return WINDIVERT_FILTER_FIELD_MARK;
         case TOKEN_LOOPBACK:
             return WINDIVERT_FILTER_FIELD_LOOPBACK;
         case TOKEN_IMPOSTOR:
             return WINDIVERT_FILTER_FIELD_IMPOSTOR;
         case TOKEN_PROCESS_ID:
             return WINDIVERT_FILTER_FIELD_PROCESSID;
+        case TOKEN_PROCESS_NAME:
+            return WINDIVERT_FILTER_FIELD_PROCESSNAME;
+        case TOKEN_PROCESS_PATH:
+            return WINDIVERT_FILTER_FIELD_PROCESSPATH;
         case TOKEN_LOCAL_ADDR:
             return WINDIVERT_FILTER_FIELD_LOCALADDR;
         case TOKEN_REMOTE_ADDR:
@@ -1946,6 +2133,24 @@ static UINT32 WinDivertKindToField(KIND kind)
             return WINDIVERT_FILTER_FIELD_IPV6_NEXTHDR;
         case TOKEN_IPV6_HOP_LIMIT:
             return WINDIVERT_FILTER_FIELD_IPV6_HOPLIMIT;
+        case TOKEN_IPV6_HOP_OPTS:
+            return WINDIVERT_FILTER_FIELD_IPV6_HOPOPTS;
+        case TOKEN_IPV6_ROUTING:
+            return WINDIVERT_FILTER_FIELD_IPV6_ROUTING;
+        case TOKEN_IPV6_FRAG_HDR:
+            return WINDIVERT_FILTER_FIELD_IPV6_FRAGHDR;
+        case TOKEN_IPV6_DST_OPTS:
+            return WINDIVERT_FILTER_FIELD_IPV6_DSTOPTS;
+        case TOKEN_IPV6_AH:
+            return WINDIVERT_FILTER_FIELD_IPV6_AH;
+        case TOKEN_IPV6_MH:
+            return WINDIVERT_FILTER_FIELD_IPV6_MH;
+        case TOKEN_IPV6_ROUTING_TYPE:
+            return WINDIVERT_FILTER_FIELD_IPV6_ROUTINGTYPE;
+        case TOKEN_IPV6_EXT_HDR_COUNT:
+            return WINDIVERT_FILTER_FIELD_IPV6_EXTHDRCOUNT;
+        case TOKEN_IPV6_EXT_HDR_LENGTH:
+            return WINDIVERT_FILTER_FIELD_IPV6_EXTHDRLENGTH;
         case TOKEN_IPV6_SRC_ADDR:
             return WINDIVERT_FILTER_FIELD_IPV6_SRCADDR;
         case TOKEN_IPV6_DST_ADDR:
@@ -2119,41 +2324,51 @@ static void WinDivertEmitFilter(PEXPR *stack, UINT len, UINT16 label,
 }
 
 /*
- * Analyze a filter object.
+ * Analyze a filter object.  The working memory is allocated from `pool'.
  */
-static UINT64 WinDivertAnalyzeFilter(WINDIVERT_LAYER layer,
-    PWINDIVERT_FILTER filter, UINT length)
+static BOOL WinDivertAnalyzeFilter(HANDLE pool, WINDIVERT_LAYER layer,
+    PWINDIVERT_FILTER filter, UINT length, UINT64 *flags_ptr)
 {
+    BOOLEAN *exec;
     BOOL result;
     UINT64 flags = 0;
 
+    exec = (BOOLEAN *)HeapAlloc(pool, 0,
+        (length == 0? 1: length) * sizeof(BOOLEAN));
+    if (exec == NULL)
+    {
+        return FALSE;
+    }
+
     // False filter?
-    result = WinDivertCondExecFilter(filter, length,
+    result = WinDivertCondExecFilter(filter, length, exec,
         WINDIVERT_FILTER_FIELD_ZERO, 0);
     if (!result)
     {
-        return 0;
+        HeapFree(pool, 0, exec);
+        *flags_ptr = 0;
+        return TRUE;
     }
 
     if (layer == WINDIVERT_LAYER_NETWORK ||
         layer == WINDIVERT_LAYER_NETWORK_FORWARD)
     {
         // Inbound?
-        result = WinDivertCondExecFilter(filter, length,
+        result = WinDivertCondExecFilter(filter, length, exec,
             WINDIVERT_FILTER_FIELD_INBOUND, 1);
         if (result)
         {
-            result = WinDivertCondExecFilter(filter, length,
+            result = WinDivertCondExecFilter(filter, length, exec,
                 WINDIVERT_FILTER_FIELD_OUTBOUND, 0);
         }
         flags |= (result? WINDIVERT_FILTER_FLAG_INBOUND: 0);
 
         // Outbound?
-        result = WinDivertCondExecFilter(filter, length,
+        result = WinDivertCondExecFilter(filter, length, exec,
             WINDIVERT_FILTER_FIELD_OUTBOUND, 1);
         if (result)
         {
-            result = WinDivertCondExecFilter(filter, length,
+            result = WinDivertCondExecFilter(filter, length, exec,
                 WINDIVERT_FILTER_FIELD_INBOUND, 0);
         }
         flags |= (result? WINDIVERT_FILTER_FLAG_OUTBOUND: 0);
@@ -2162,21 +2377,21 @@ static UINT64 WinDivertAnalyzeFilter(WINDIVERT_LAYER layer,
     if (layer != WINDIVERT_LAYER_REFLECT)
     {
         // IPv4? 
-        result = WinDivertCondExecFilter(filter, length,
+        result = WinDivertCondExecFilter(filter, length, exec,
             WINDIVERT_FILTER_FIELD_IP, 1);
         if (result)
         {   
-            result = WinDivertCondExecFilter(filter, length,
+            result = WinDivertCondExecFilter(filter, length, exec,
                 WINDIVERT_FILTER_FIELD_IPV6, 0);
         }
         flags |= (result? WINDIVERT_FILTER_FLAG_IP: 0);
 
         // Ipv6? 
-        result = WinDivertCondExecFilter(filter, length,
+        result = WinDivertCondExecFilter(filter, length, exec,
             WINDIVERT_FILTER_FIELD_IPV6, 1);
         if (result)
         {   
-            result = WinDivertCondExecFilter(filter, length,
+            result = WinDivertCondExecFilter(filter, length, exec,
                 WINDIVERT_FILTER_FIELD_IP, 0);
         }
         flags |= (result? WINDIVERT_FILTER_FLAG_IPV6: 0);
@@ -2186,25 +2401,25 @@ static UINT64 WinDivertAnalyzeFilter(WINDIVERT_LAYER layer,
     switch (layer)
     {
         case WINDIVERT_LAYER_FLOW:
-            result = WinDivertCondExecFilter(filter, length,
+            result = WinDivertCondExecFilter(filter, length, exec,
                 WINDIVERT_FILTER_FIELD_EVENT, WINDIVERT_EVENT_FLOW_DELETED);
             flags |= (result? WINDIVERT_FILTER_FLAG_EVENT_FLOW_DELETED: 0);
             break;
 
         case WINDIVERT_LAYER_SOCKET:
-            result = WinDivertCondExecFilter(filter, length,
+            result = WinDivertCondExecFilter(filter, length, exec,
                 WINDIVERT_FILTER_FIELD_EVENT, WINDIVERT_EVENT_SOCKET_BIND);
             flags |= (result? WINDIVERT_FILTER_FLAG_EVENT_SOCKET_BIND: 0);
-            result = WinDivertCondExecFilter(filter, length,
+            result = WinDivertCondExecFilter(filter, length, exec,
                 WINDIVERT_FILTER_FIELD_EVENT, WINDIVERT_EVENT_SOCKET_CONNECT);
             flags |= (result? WINDIVERT_FILTER_FLAG_EVENT_SOCKET_CONNECT: 0);
-            result = WinDivertCondExecFilter(filter, length,
+            result = WinDivertCondExecFilter(filter, length, exec,
                 WINDIVERT_FILTER_FIELD_EVENT, WINDIVERT_EVENT_SOCKET_CLOSE);
             flags |= (result? WINDIVERT_FILTER_FLAG_EVENT_SOCKET_CLOSE: 0);
-            result = WinDivertCondExecFilter(filter, length,
+            result = WinDivertCondExecFilter(filter, length, exec,
                 WINDIVERT_FILTER_FIELD_EVENT, WINDIVERT_EVENT_SOCKET_LISTEN);
             flags |= (result? WINDIVERT_FILTER_FLAG_EVENT_SOCKET_LISTEN: 0);
-            result = WinDivertCondExecFilter(filter, length,
+            result = WinDivertCondExecFilter(filter, length, exec,
                 WINDIVERT_FILTER_FIELD_EVENT, WINDIVERT_EVENT_SOCKET_ACCEPT);
             flags |= (result? WINDIVERT_FILTER_FLAG_EVENT_SOCKET_ACCEPT: 0);
             break;
@@ -2213,7 +2428,9 @@ static UINT64 WinDivertAnalyzeFilter(WINDIVERT_LAYER layer,
             break;
     }
 
-    return flags;
+    HeapFree(pool, 0, exec);
+    *flags_ptr = flags;
+    return TRUE;
 }
 
 /*
@@ -2221,11 +2438,10 @@ static UINT64 WinDivertAnalyzeFilter(WINDIVERT_LAYER layer,
  * FALSE = definite reject; TRUE = maybe accept.
  */
 static BOOL WinDivertCondExecFilter(PWINDIVERT_FILTER filter, UINT length,
-    UINT8 field, UINT32 arg)
+    BOOLEAN *result, UINT8 field, UINT32 arg)
 {
     INT16 ip;
     UINT16 succ, fail;
-    BOOLEAN result[WINDIVERT_FILTER_MAXLEN];
     BOOLEAN result_succ, result_fail, result_test;
 
     if (length == 0)
@@ -2317,17 +2533,66 @@ static BOOL WinDivertCondExecFilter(PWINDIVERT_FILTER filter, UINT length,
 }
 
 /*
- * Compile a filter string into an executable filter object.
+ * Tokenize and parse a filter string into an expression.
  */
-static ERROR WinDivertCompileFilter(const char *filter, HANDLE pool,
-    WINDIVERT_LAYER layer, PWINDIVERT_FILTER object, UINT *obj_len)
+static ERROR WinDivertParseFilterString(const char *filter, HANDLE pool,
+    WINDIVERT_LAYER layer, PEXPR *expr)
 {
     TOKEN *tokens;
+    UINT i, max_depth, pos;
+    SIZE_T tokens_size;
+    ERROR error;
+
+    // Every token except TOKEN_END consumes at least one character:
+    for (tokens_size = 3; tokens_size < 8 * WINDIVERT_FILTER_MAXLEN &&
+            filter[tokens_size-3] != '\0'; tokens_size++)
+        ;
+    tokens = (TOKEN *)HeapAlloc(pool, 0, tokens_size * sizeof(TOKEN));
+    if (tokens == NULL)
+    {
+        return MAKE_ERROR(WINDIVERT_ERROR_NO_MEMORY, 0);
+    }
+
+    // Tokenize the filter string:
+    error = WinDivertTokenizeFilter(filter, layer, tokens, tokens_size-1);
+    if (IS_ERROR(error))
+    {
+        HeapFree(pool, 0, tokens);
+        return error;
+    }
+
+    // Parse the filter into an expression:
+    i = 0;
+    max_depth = 1024;
+    *expr = WinDivertParseFilter(pool, tokens, &i, max_depth, FALSE, &error);
+    if (*expr == NULL)
+    {
+        HeapFree(pool, 0, tokens);
+        return error;
+    }
+    if (tokens[i].kind != TOKEN_END)
+    {
+        pos = tokens[i].pos;
+        HeapFree(pool, 0, tokens);
+        return MAKE_ERROR(WINDIVERT_ERROR_UNEXPECTED_TOKEN, pos);
+    }
+    HeapFree(pool, 0, tokens);
+
+    return MAKE_ERROR(WINDIVERT_ERROR_NONE, 0);
+}
+
+/*
+ * Compile a filter string into an executable filter object.  The object is
+ * allocated from the pool.
+ */
+static ERROR WinDivertCompileFilter(const char *filter, HANDLE pool,
+    WINDIVERT_LAYER layer, PWINDIVERT_FILTER *object, UINT *obj_len)
+{
     PEXPR *stack;
     PEXPR expr;
-    UINT i, max_depth, pos;
+    PWINDIVERT_FILTER filter_obj;
     INT16 label;
-    const SIZE_T tokens_size = 5 * WINDIVERT_FILTER_MAXLEN;
+    UINT length;
     ERROR error;
 
     // Check for pre-compiled filter object:
@@ -2339,43 +2604,45 @@ static ERROR WinDivertCompileFilter(const char *filter, HANDLE pool,
         stream.max      = UINT_MAX;
         stream.overflow = FALSE;
 
-        if (!WinDivertDeserializeFilter(&stream, object, obj_len))
+        if (!WinDivertDeserializeFilterHeader(&stream, &length))
+        {
+            SetLastError(ERROR_INVALID_PARAMETER);
+            return MAKE_ERROR(WINDIVERT_ERROR_BAD_OBJECT, 0);
+        }
+        filter_obj = (PWINDIVERT_FILTER)HeapAlloc(pool, 0,
+            length * sizeof(WINDIVERT_FILTER));
+        if (filter_obj == NULL)
+        {
+            return MAKE_ERROR(WINDIVERT_ERROR_NO_MEMORY, 0);
+        }
+        stream.pos = 0;
+        if (!WinDivertDeserializeFilter(&stream, filter_obj, &length))
         {
             SetLastError(ERROR_INVALID_PARAMETER);
             return MAKE_ERROR(WINDIVERT_ERROR_BAD_OBJECT, 0);
         }
+        if (object != NULL)
+        {
+            *object  = filter_obj;
+            *obj_len = length;
+        }
         return MAKE_ERROR(WINDIVERT_ERROR_NONE, 0);
     }
 
-    tokens = (TOKEN *)HeapAlloc(pool, 0, tokens_size * sizeof(TOKEN));
-    stack  = (PEXPR *)HeapAlloc(pool, 0,
+    stack = (PEXPR *)HeapAlloc(pool, 0,
         WINDIVERT_FILTER_MAXLEN * sizeof(PEXPR));
-    if (tokens == NULL || stack == NULL)
+    if (stack == NULL)
     {
         return MAKE_ERROR(WINDIVERT_ERROR_NO_MEMORY, 0);
     }
 
-    // Tokenize the filter string:
-    error = WinDivertTokenizeFilter(filter, layer, tokens, tokens_size-1);
+    // Parse the filter string:
+    error = WinDivertParseFilterString(filter, pool, layer, &expr);
     if (IS_ERROR(error))
     {
         return error;
     }
 
-    // Parse the filter into an expression:
-    i = 0;
-    max_depth = 1024;
-    expr = WinDivertParseFilter(pool, tokens, &i, max_depth, FALSE, &error);
-    if (expr == NULL)
-    {
-        return error;
-    }
-    if (tokens[i].kind != TOKEN_END)
-    {
-        pos = tokens[i].pos;
-        return MAKE_ERROR(WINDIVERT_ERROR_UNEXPECTED_TOKEN, pos);
-    }
-
     // Construct the filter tree:
     label = 0;
     label = WinDivertFlattenExpr(expr, &label, WINDIVERT_FILTER_RESULT_ACCEPT,
@@ -2388,7 +2655,15 @@ static ERROR WinDivertCompileFilter(const char *filter, HANDLE pool,
     // Emit the final object.
     if (object != NULL)
     {
-        WinDivertEmitFilter(stack, label, label, object, obj_len);
+        length = (label >= WINDIVERT_FILTER_RESULT_ACCEPT? 1: label + 1);
+        filter_obj = (PWINDIVERT_FILTER)HeapAlloc(pool, 0,
+            length * sizeof(WINDIVERT_FILTER));
+        if (filter_obj == NULL)
+        {
+            return MAKE_ERROR(WINDIVERT_ERROR_NO_MEMORY, 0);
+        }
+        WinDivertEmitFilter(stack, label, label, filter_obj, obj_len);
+        *object = filter_obj;
     }
 
     return MAKE_ERROR(WINDIVERT_ERROR_NONE, 0);
@@ -2443,8 +2718,7 @@ BOOL WinDivertHelperCompileFilter(const char *filter_str, WINDIVERT_LAYER layer,
         return FALSE;
     }
 
-    pool = HeapCreate(HEAP_NO_SERIALIZE, WINDIVERT_MIN_POOL_SIZE,
-        WINDIVERT_MAX_POOL_SIZE);
+    pool = HeapCreate(HEAP_NO_SERIALIZE, WINDIVERT_MIN_POOL_SIZE, 0);
     if (pool == NULL)
     {
         return FALSE;
@@ -2457,28 +2731,24 @@ BOOL WinDivertHelperCompileFilter(const char *filter_str, WINDIVERT_LAYER layer,
     }
     else
     {
-        WINDIVERT_FILTER *filter_obj = HeapAlloc(pool, 0,
-            WINDIVERT_FILTER_MAXLEN * sizeof(WINDIVERT_FILTER));
+        WINDIVERT_FILTER *filter_obj;
         UINT filter_obj_len;
-        err = WINDIVERT_ERROR_NO_MEMORY;
-        if (filter_obj != NULL)
+        err = WinDivertCompileFilter(filter_str, pool, layer, &filter_obj,
+            &filter_obj_len);
+        if (!IS_ERROR(err))
         {
-            err = WinDivertCompileFilter(filter_str, pool, layer, filter_obj,
-                &filter_obj_len);
-            if (!IS_ERROR(err))
+            WINDIVERT_STREAM stream;
+            stream.data     = object;
+            stream.pos      = 0;
+            stream.max      = obj_len;
+            stream.overflow = FALSE;
+        
+            WinDivertSerializeFilter(&stream, filter_obj,
+                (UINT16)filter_obj_len);
+            if (stream.overflow)
             {
-                WINDIVERT_STREAM stream;
-                stream.data     = object;
-                stream.pos      = 0;
-                stream.max      = obj_len;
-                stream.overflow = FALSE;
-            
-                WinDivertSerializeFilter(&stream, filter_obj, filter_obj_len);
-                if (stream.overflow)
-                {
-                    SetLastError(ERROR_INSUFFICIENT_BUFFER);
-                    err = MAKE_ERROR(WINDIVERT_ERROR_OUTPUT_TOO_SHORT, 0);
-                }
+                SetLastError(ERROR_INSUFFICIENT_BUFFER);
+                err = MAKE_ERROR(WINDIVERT_ERROR_OUTPUT_TOO_SHORT, 0);
             }
         }
     }
@@ -2496,138 +2766,546 @@ BOOL WinDivertHelperCompileFilter(const char *filter_str, WINDIVERT_LAYER layer,
 }
 
 /*
- * Get packet/payload data.
+ * Incremental (clause-level) filter objects.
+ *
+ * The filter is a top-level and/or of independently compiled clauses.  Each
+ * clause retains its flattened expression, and is emitted into its own
+ * contiguous range of the final object.  Adding or removing a clause only
+ * (re)emits the affected ranges.
  */
-static BOOL WinDivertGetData(const VOID *packet, UINT packet_len, INT min,
-    INT max, INT idx, PVOID data, UINT size)
+typedef struct
 {
-    idx += (idx < 0? max: min);
-    if (idx < min || idx > (max - (INT)size))
+    HANDLE pool;                        // Clause private heap.
+    PEXPR *stack;                       // Flattened clause tests.
+    INT16 entry;                        // Clause entry label.
+    UINT16 base;                        // Clause offset in the object.
+    UINT16 length;                      // Clause length in the object.
+    UINT id;                            // Clause identifier.
+} WINDIVERT_CLAUSE, *PWINDIVERT_CLAUSE;
+
+struct WINDIVERT_CLAUSE_FILTER
+{
+    HANDLE pool;                        // Filter heap.
+    WINDIVERT_LAYER layer;              // Filter layer.
+    BOOL and;                           // Conjunction (TRUE) or disjunction.
+    UINT next_id;                       // Next clause identifier.
+    UINT count;                         // Number of clauses.
+    UINT max;                           // Capacity of clauses.
+    PWINDIVERT_CLAUSE clauses;          // Clauses.
+    UINT length;                        // Object length.
+    UINT object_max;                    // Capacity of object.
+    PWINDIVERT_FILTER object;           // Object.
+};
+
+/*
+ * Emit clause i into its object range.
+ */
+static void WinDivertEmitClause(PWINDIVERT_CLAUSE_FILTER filter, UINT i)
+{
+    PWINDIVERT_CLAUSE clause = filter->clauses + i;
+    PWINDIVERT_FILTER object = filter->object + clause->base;
+    UINT16 next, pass, label;
+    INT16 j;
+
+    // The "pass" result falls through to the next clause (if any):
+    pass = (filter->and? WINDIVERT_FILTER_RESULT_ACCEPT:
+        WINDIVERT_FILTER_RESULT_REJECT);
+    next = (i+1 < filter->count? filter->clauses[i+1].base: pass);
+
+    switch ((UINT16)clause->entry)
     {
-        return FALSE;
+        case WINDIVERT_FILTER_RESULT_ACCEPT:
+        case WINDIVERT_FILTER_RESULT_REJECT:
+            label = (UINT16)clause->entry;
+            label = (label == pass? next: label);
+            object->field   = WINDIVERT_FILTER_FIELD_ZERO;
+            object->test    = WINDIVERT_FILTER_TEST_EQ;
+            object->neg     = 0;
+            object->arg[0]  = 0;
+            object->arg[1]  = 0;
+            object->arg[2]  = 0;
+            object->arg[3]  = 0;
+            object->success = label;
+            object->failure = label;
+            return;
+        default:
+            break;
     }
 
-    memcpy(data, (UINT8 *)packet + idx, size);
-    return TRUE;
+    for (j = 0; j <= clause->entry; j++, object++)
+    {
+        WinDivertEmitTest(clause->stack[clause->entry - j], clause->entry,
+            object);
+        switch (object->success)
+        {
+            case WINDIVERT_FILTER_RESULT_ACCEPT:
+            case WINDIVERT_FILTER_RESULT_REJECT:
+                object->success = (object->success == pass? next:
+                    object->success);
+                break;
+            default:
+                object->success += clause->base;
+                break;
+        }
+        switch (object->failure)
+        {
+            case WINDIVERT_FILTER_RESULT_ACCEPT:
+            case WINDIVERT_FILTER_RESULT_REJECT:
+                object->failure = (object->failure == pass? next:
+                    object->failure);
+                break;
+            default:
+                object->failure += clause->base;
+                break;
+        }
+    }
 }
 
 /*
- * Evaluate the given filter with the given packet as input.
+ * Create a clause filter.
  */
-BOOL WinDivertHelperEvalFilter(const char *filter, const VOID *packet,
-    UINT packet_len, const WINDIVERT_ADDRESS *addr)
+PWINDIVERT_CLAUSE_FILTER WinDivertHelperClauseFilterCreate(
+    WINDIVERT_LAYER layer, UINT64 flags)
 {
-    ERROR err;
-    DWORD error;
-    WINDIVERT_PACKET info;
-    PWINDIVERT_IPHDR ip_header = NULL;
-    PWINDIVERT_IPV6HDR ipv6_header = NULL;
-    PWINDIVERT_ICMPHDR icmp_header = NULL;
-    PWINDIVERT_ICMPV6HDR icmpv6_header = NULL;
-    PWINDIVERT_TCPHDR tcp_header = NULL;
-    PWINDIVERT_UDPHDR udp_header = NULL;
-    const WINDIVERT_DATA_NETWORK *network_data = NULL;
-    const WINDIVERT_DATA_FLOW *flow_data = NULL;
-    const WINDIVERT_DATA_SOCKET *socket_data = NULL;
-    const WINDIVERT_DATA_REFLECT *reflect_data = NULL;
-    BOOL fragment = FALSE;
-    UINT8 protocol = 0;
-    UINT header_len = 0, payload_len = 0;
-    int result;
     HANDLE pool;
-    WINDIVERT_FILTER *object;
-    UINT obj_len;
+    PWINDIVERT_CLAUSE_FILTER filter;
 
-    if (filter == NULL || addr == NULL)
-    {
-        SetLastError(ERROR_INVALID_PARAMETER);
-        return FALSE;
-    }
-    switch (addr->Layer)
+    switch (layer)
     {
         case WINDIVERT_LAYER_NETWORK:
         case WINDIVERT_LAYER_NETWORK_FORWARD:
-            if (packet == NULL)
-            {
-                SetLastError(ERROR_INVALID_PARAMETER);
-                return FALSE;
-            }
-            if (!WinDivertHelperParsePacketEx((PVOID)packet, packet_len, &info))
-            {
-                SetLastError(ERROR_INVALID_PARAMETER);
-                return FALSE;
-            }
-            protocol      = info.Protocol;
-            ip_header     = info.IPHeader;
-            ipv6_header   = info.IPv6Header;
-            icmp_header   = info.ICMPHeader;
-            icmpv6_header = info.ICMPv6Header;
-            tcp_header    = info.TCPHeader;
-            udp_header    = info.UDPHeader;
-            payload_len   = info.PayloadLength;
-            header_len    = info.HeaderLength;
-            fragment      = info.Fragment;
-            if ((addr->IPv6 && ipv6_header == NULL) ||
-                (!addr->IPv6 && ip_header == NULL))
-            {
-                SetLastError(ERROR_INVALID_PARAMETER);
-                return FALSE;
-            }
-            break;
         case WINDIVERT_LAYER_FLOW:
         case WINDIVERT_LAYER_SOCKET:
-            if (packet != NULL)
-            {
-                SetLastError(ERROR_INVALID_PARAMETER);
-                return FALSE;
-            }
-            break;
         case WINDIVERT_LAYER_REFLECT:
             break;
         default:
             SetLastError(ERROR_INVALID_PARAMETER);
-            return FALSE;
+            return NULL;
     }
-    switch (addr->Layer)
+    if ((flags & ~WINDIVERT_CLAUSE_FLAG_AND) != 0)
     {
-        case WINDIVERT_LAYER_NETWORK:
-        case WINDIVERT_LAYER_NETWORK_FORWARD:
-            network_data = &addr->Network;
-            break;
-        case WINDIVERT_LAYER_FLOW:
-            flow_data = &addr->Flow;
-            break;
-        case WINDIVERT_LAYER_SOCKET:
-            socket_data = &addr->Socket;
-            break;
-        case WINDIVERT_LAYER_REFLECT:
-            reflect_data = &addr->Reflect;
-            break;
-        default:
-            SetLastError(ERROR_INVALID_PARAMETER);
-            return FALSE;
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return NULL;
     }
 
-    pool = HeapCreate(HEAP_NO_SERIALIZE, WINDIVERT_MIN_POOL_SIZE,
-        WINDIVERT_MAX_POOL_SIZE);
+    pool = HeapCreate(HEAP_NO_SERIALIZE, WINDIVERT_MIN_POOL_SIZE, 0);
     if (pool == NULL)
     {
+        return NULL;
+    }
+    filter = (PWINDIVERT_CLAUSE_FILTER)HeapAlloc(pool, 0,
+        sizeof(struct WINDIVERT_CLAUSE_FILTER));
+    if (filter == NULL)
+    {
+        HeapDestroy(pool);
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+    filter->pool       = pool;
+    filter->layer      = layer;
+    filter->and        = ((flags & WINDIVERT_CLAUSE_FLAG_AND) != 0);
+    filter->next_id    = 1;
+    filter->count      = 0;
+    filter->max        = 0;
+    filter->clauses    = NULL;
+    filter->length     = 0;
+    filter->object_max = 0;
+    filter->object     = NULL;
+
+    return filter;
+}
+
+/*
+ * Add a clause to a clause filter.
+ */
+BOOL WinDivertHelperClauseFilterAdd(PWINDIVERT_CLAUSE_FILTER filter,
+    const char *clause_str, UINT *id_ptr, const char **error,
+    UINT *error_pos)
+{
+    WINDIVERT_CLAUSE clause;
+    PWINDIVERT_CLAUSE clauses;
+    PWINDIVERT_FILTER object;
+    PEXPR expr;
+    INT16 label;
+    UINT max, length;
+    ERROR err;
+
+    if (filter == NULL || clause_str == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
         return FALSE;
     }
-    object = HeapAlloc(pool, 0,
-        WINDIVERT_FILTER_MAXLEN * sizeof(WINDIVERT_FILTER));
-    if (object == NULL)
+
+    clause.pool = HeapCreate(HEAP_NO_SERIALIZE, WINDIVERT_MIN_POOL_SIZE, 0);
+    if (clause.pool == NULL)
     {
-        goto WinDivertHelperEvalFilterError;
+        return FALSE;
     }
-    err = WinDivertCompileFilter(filter, pool, addr->Layer, object, &obj_len);
+    SetLastError(ERROR_SUCCESS);
+
+    // Compile the clause in isolation:
+    clause.stack = (PEXPR *)HeapAlloc(clause.pool, 0,
+        WINDIVERT_FILTER_MAXLEN * sizeof(PEXPR));
+    if (clause.stack == NULL)
+    {
+        err = MAKE_ERROR(WINDIVERT_ERROR_NO_MEMORY, 0);
+        goto WinDivertHelperClauseFilterAddError;
+    }
+    err = WinDivertParseFilterString(clause_str, clause.pool, filter->layer,
+        &expr);
     if (IS_ERROR(err))
+    {
+        goto WinDivertHelperClauseFilterAddError;
+    }
+    label = 0;
+    clause.entry = WinDivertFlattenExpr(expr, &label,
+        WINDIVERT_FILTER_RESULT_ACCEPT, WINDIVERT_FILTER_RESULT_REJECT,
+        clause.stack);
+    if (clause.entry < 0)
+    {
+        err = MAKE_ERROR(WINDIVERT_ERROR_TOO_LONG, 0);
+        goto WinDivertHelperClauseFilterAddError;
+    }
+    switch ((UINT16)clause.entry)
+    {
+        case WINDIVERT_FILTER_RESULT_ACCEPT:
+        case WINDIVERT_FILTER_RESULT_REJECT:
+            length = 1;
+            break;
+        default:
+            length = (UINT)clause.entry + 1;
+            break;
+    }
+    if (filter->length + length > WINDIVERT_FILTER_MAXLEN)
+    {
+        err = MAKE_ERROR(WINDIVERT_ERROR_TOO_LONG, 0);
+        goto WinDivertHelperClauseFilterAddError;
+    }
+    clause.base   = (UINT16)filter->length;
+    clause.length = (UINT16)length;
+    clause.id     = filter->next_id;
+
+    // Append the clause:
+    if (filter->count >= filter->max)
+    {
+        max = (filter->max == 0? 16: 2 * filter->max);
+        clauses = (PWINDIVERT_CLAUSE)(filter->clauses == NULL?
+            HeapAlloc(filter->pool, 0, max * sizeof(WINDIVERT_CLAUSE)):
+            HeapReAlloc(filter->pool, 0, filter->clauses,
+                max * sizeof(WINDIVERT_CLAUSE)));
+        if (clauses == NULL)
+        {
+            err = MAKE_ERROR(WINDIVERT_ERROR_NO_MEMORY, 0);
+            goto WinDivertHelperClauseFilterAddError;
+        }
+        filter->clauses = clauses;
+        filter->max     = max;
+    }
+    if (filter->length + length > filter->object_max)
+    {
+        max = (filter->object_max == 0? 64: 2 * filter->object_max);
+        max = (max < filter->length + length? filter->length + length: max);
+        max = (max > WINDIVERT_FILTER_MAXLEN? WINDIVERT_FILTER_MAXLEN: max);
+        object = (PWINDIVERT_FILTER)(filter->object == NULL?
+            HeapAlloc(filter->pool, 0, max * sizeof(WINDIVERT_FILTER)):
+            HeapReAlloc(filter->pool, 0, filter->object,
+                max * sizeof(WINDIVERT_FILTER)));
+        if (object == NULL)
+        {
+            err = MAKE_ERROR(WINDIVERT_ERROR_NO_MEMORY, 0);
+            goto WinDivertHelperClauseFilterAddError;
+        }
+        filter->object     = object;
+        filter->object_max = max;
+    }
+    filter->clauses[filter->count++] = clause;
+    filter->length += length;
+    filter->next_id++;
+
+    // Only the new clause and its predecessor's fall-through change:
+    WinDivertEmitClause(filter, filter->count-1);
+    if (filter->count > 1)
+    {
+        WinDivertEmitClause(filter, filter->count-2);
+    }
+
+    if (id_ptr != NULL)
+    {
+        *id_ptr = clause.id;
+    }
+    if (error != NULL)
+    {
+        *error = WinDivertErrorString(WINDIVERT_ERROR_NONE);
+    }
+    if (error_pos != NULL)
+    {
+        *error_pos = 0;
+    }
+    return TRUE;
+
+WinDivertHelperClauseFilterAddError:
+    HeapDestroy(clause.pool);
+    if (GetLastError() == ERROR_SUCCESS)
     {
         SetLastError(ERROR_INVALID_PARAMETER);
-        goto WinDivertHelperEvalFilterError;
     }
+    if (error != NULL)
+    {
+        *error = WinDivertErrorString(GET_CODE(err));
+    }
+    if (error_pos != NULL)
+    {
+        *error_pos = GET_POS(err);
+    }
+    return FALSE;
+}
+
+/*
+ * Remove a clause from a clause filter.
+ */
+BOOL WinDivertHelperClauseFilterRemove(PWINDIVERT_CLAUSE_FILTER filter,
+    UINT id)
+{
+    UINT i, j, base, length;
+
+    if (filter == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    for (i = 0; i < filter->count && filter->clauses[i].id != id; i++)
+        ;
+    if (i >= filter->count)
+    {
+        SetLastError(ERROR_NOT_FOUND);
+        return FALSE;
+    }
+    base   = filter->clauses[i].base;
+    length = filter->clauses[i].length;
+    HeapDestroy(filter->clauses[i].pool);
 
-    result = WinDivertExecuteFilter(
+    // Close the gap in the clause list and object:
+    for (j = i; j+1 < filter->count; j++)
+    {
+        filter->clauses[j] = filter->clauses[j+1];
+        filter->clauses[j].base -= (UINT16)length;
+    }
+    filter->count--;
+    for (j = base; j + length < filter->length; j++)
+    {
+        filter->object[j] = filter->object[j + length];
+    }
+    filter->length -= length;
+
+    // The following clauses have moved, and the preceding clause has a
+    // new fall-through target:
+    for (j = (i == 0? 0: i-1); j < filter->count; j++)
+    {
+        WinDivertEmitClause(filter, j);
+    }
+
+    return TRUE;
+}
+
+/*
+ * Get the object representation of a clause filter.
+ */
+BOOL WinDivertHelperClauseFilterGetObject(PWINDIVERT_CLAUSE_FILTER filter,
+    char *object, UINT obj_len)
+{
+    WINDIVERT_STREAM stream;
+    WINDIVERT_FILTER empty;
+
+    if (filter == NULL || object == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    stream.data     = object;
+    stream.pos      = 0;
+    stream.max      = obj_len;
+    stream.overflow = FALSE;
+    if (filter->count == 0)
+    {
+        empty.field   = WINDIVERT_FILTER_FIELD_ZERO;
+        empty.test    = WINDIVERT_FILTER_TEST_EQ;
+        empty.neg     = 0;
+        empty.arg[0]  = 0;
+        empty.arg[1]  = 0;
+        empty.arg[2]  = 0;
+        empty.arg[3]  = 0;
+        empty.success = empty.failure = (filter->and?
+            WINDIVERT_FILTER_RESULT_ACCEPT: WINDIVERT_FILTER_RESULT_REJECT);
+        WinDivertSerializeFilter(&stream, &empty, 1);
+    }
+    else
+    {
+        WinDivertSerializeFilter(&stream, filter->object,
+            (UINT16)filter->length);
+    }
+    if (stream.overflow)
+    {
+        SetLastError(ERROR_INSUFFICIENT_BUFFER);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * Free a clause filter.
+ */
+void WinDivertHelperClauseFilterFree(PWINDIVERT_CLAUSE_FILTER filter)
+{
+    UINT i;
+
+    if (filter == NULL)
+    {
+        return;
+    }
+    for (i = 0; i < filter->count; i++)
+    {
+        HeapDestroy(filter->clauses[i].pool);
+    }
+    HeapDestroy(filter->pool);
+}
+
+/*
+ * Get packet/payload data.
+ */
+static BOOL WinDivertGetData(const VOID *packet, UINT packet_len, INT min,
+    INT max, INT idx, PVOID data, UINT size)
+{
+    idx += (idx < 0? max: min);
+    if (idx < min || idx > (max - (INT)size))
+    {
+        return FALSE;
+    }
+
+    memcpy(data, (UINT8 *)packet + idx, size);
+    return TRUE;
+}
+
+/*
+ * Get the (NT) image path of a process.
+ */
+static BOOL WinDivertGetProcessPath(UINT32 pid, UINT16 *path, UINT *len)
+{
+    HANDLE process;
+    DWORD size = WINDIVERT_PROCESS_PATH_MAX;
+    BOOL result;
+
+    process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE,
+        (DWORD)pid);
+    if (process == NULL)
+    {
+        return FALSE;
+    }
+    result = QueryFullProcessImageNameW(process, PROCESS_NAME_NATIVE,
+        (LPWSTR)path, &size);
+    CloseHandle(process);
+    *len = (UINT)size;
+    return result;
+}
+
+/*
+ * Evaluate a filter object.
+ */
+static int WinDivertEvalFilterObject(const WINDIVERT_FILTER *object,
+    UINT length, const VOID *packet, UINT packet_len,
+    const WINDIVERT_ADDRESS *addr)
+{
+    WINDIVERT_PACKET info;
+    PWINDIVERT_IPHDR ip_header = NULL;
+    PWINDIVERT_IPV6HDR ipv6_header = NULL;
+    PWINDIVERT_ICMPHDR icmp_header = NULL;
+    PWINDIVERT_ICMPV6HDR icmpv6_header = NULL;
+    PWINDIVERT_TCPHDR tcp_header = NULL;
+    PWINDIVERT_UDPHDR udp_header = NULL;
+    const WINDIVERT_DATA_NETWORK *network_data = NULL;
+    const WINDIVERT_DATA_FLOW *flow_data = NULL;
+    const WINDIVERT_DATA_SOCKET *socket_data = NULL;
+    const WINDIVERT_DATA_REFLECT *reflect_data = NULL;
+    WINDIVERT_IPV6EXT ipv6_ext;
+    BOOL fragment = FALSE;
+    UINT8 protocol = 0;
+    UINT header_len = 0, payload_len = 0;
+    UINT16 path_buf[WINDIVERT_PROCESS_PATH_MAX];
+    const UINT16 *path = NULL;
+    UINT path_len = 0, pid = 0, i;
+
+    memset(&ipv6_ext, 0, sizeof(ipv6_ext));
+    switch (addr->Layer)
+    {
+        case WINDIVERT_LAYER_NETWORK:
+        case WINDIVERT_LAYER_NETWORK_FORWARD:
+            if (packet == NULL)
+            {
+                return -1;
+            }
+            if (!WinDivertHelperParsePacketEx((PVOID)packet, packet_len, &info))
+            {
+                return -1;
+            }
+            protocol      = info.Protocol;
+            ip_header     = info.IPHeader;
+            ipv6_header   = info.IPv6Header;
+            icmp_header   = info.ICMPHeader;
+            icmpv6_header = info.ICMPv6Header;
+            tcp_header    = info.TCPHeader;
+            udp_header    = info.UDPHeader;
+            payload_len   = info.PayloadLength;
+            header_len    = info.HeaderLength;
+            fragment      = info.Fragment;
+            ipv6_ext      = info.IPv6Ext;
+            if ((addr->IPv6 && ipv6_header == NULL) ||
+                (!addr->IPv6 && ip_header == NULL))
+            {
+                return -1;
+            }
+            network_data = &addr->Network;
+            break;
+        case WINDIVERT_LAYER_FLOW:
+            if (packet != NULL)
+            {
+                return -1;
+            }
+            flow_data = &addr->Flow;
+            pid = flow_data->ProcessId;
+            break;
+        case WINDIVERT_LAYER_SOCKET:
+            if (packet != NULL)
+            {
+                return -1;
+            }
+            socket_data = &addr->Socket;
+            pid = socket_data->ProcessId;
+            break;
+        case WINDIVERT_LAYER_REFLECT:
+            reflect_data = &addr->Reflect;
+            break;
+        default:
+            return -1;
+    }
+
+    // Only look up the process image path if it is needed:
+    if (flow_data != NULL || socket_data != NULL)
+    {
+        for (i = 0; i < length; i++)
+        {
+            if (object[i].field == WINDIVERT_FILTER_FIELD_PROCESSNAME ||
+                object[i].field == WINDIVERT_FILTER_FIELD_PROCESSPATH)
+            {
+                if (WinDivertGetProcessPath(pid, path_buf, &path_len))
+                {
+                    path = path_buf;
+                }
+                break;
+            }
+        }
+    }
+
+    return WinDivertExecuteFilter(
         object,
         addr->Layer,
         addr->Timestamp,
@@ -2647,11 +3325,50 @@ BOOL WinDivertHelperEvalFilter(const char *filter, const VOID *packet,
         icmpv6_header,
         tcp_header,
         udp_header,
+        &ipv6_ext,
         protocol,
         packet,
         packet_len,
         header_len,
-        payload_len);
+        payload_len,
+        path,
+        path_len);
+}
+
+/*
+ * Evaluate the given filter with the given packet as input.
+ */
+BOOL WinDivertHelperEvalFilter(const char *filter, const VOID *packet,
+    UINT packet_len, const WINDIVERT_ADDRESS *addr)
+{
+    ERROR err;
+    DWORD error;
+    int result;
+    HANDLE pool;
+    WINDIVERT_FILTER *object;
+    UINT obj_len;
+
+    if (filter == NULL || addr == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    pool = HeapCreate(HEAP_NO_SERIALIZE, WINDIVERT_MIN_POOL_SIZE, 0);
+    if (pool == NULL)
+    {
+        return FALSE;
+    }
+    err = WinDivertCompileFilter(filter, pool, addr->Layer, &object,
+        &obj_len);
+    if (IS_ERROR(err))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        goto WinDivertHelperEvalFilterError;
+    }
+
+    result = WinDivertEvalFilterObject(object, obj_len, packet, packet_len,
+        addr);
 
     HeapDestroy(pool);
     if (result < 0)
@@ -2676,6 +3393,449 @@ WinDivertHelperEvalFilterError:
     return FALSE;
 }
 
+/*
+ * Profile-guided filter optimization.
+ *
+ * Probabilities and costs are 16.16 fixed point.  The cost of an expression
+ * is the expected number of tests executed.
+ */
+#define WINDIVERT_PROFILE_ONE                   0x10000
+
+typedef struct
+{
+    const WINDIVERT_FILTER_STATS *stats;    // Per-instruction statistics.
+    UINT count;                             // Number of statistics.
+    PEXPR *stack;                           // Flattened tests.
+    INT16 entry;                            // Entry label.
+    HANDLE pool;                            // Pool.
+} WINDIVERT_PROFILE, *PWINDIVERT_PROFILE;
+
+/*
+ * Profile a single packet against a filter object.
+ */
+static BOOL WinDivertProfileFilterObject(const WINDIVERT_FILTER *object,
+    UINT length, const VOID *packet, UINT packet_len,
+    const WINDIVERT_ADDRESS *addr, WINDIVERT_FILTER_STATS *stats)
+{
+    WINDIVERT_FILTER test[1];
+    UINT16 ip = 0;
+    UINT ttl;
+    int result;
+
+    for (ttl = length; ttl > 0; ttl--)
+    {
+        test[0] = object[ip];
+        test[0].success = WINDIVERT_FILTER_RESULT_ACCEPT;
+        test[0].failure = WINDIVERT_FILTER_RESULT_REJECT;
+        result = WinDivertEvalFilterObject(test, 1, packet, packet_len, addr);
+        if (result < 0)
+        {
+            return FALSE;
+        }
+        stats[ip].Count++;
+        stats[ip].Success += (result? 1: 0);
+        ip = (result? object[ip].success: object[ip].failure);
+        switch (ip)
+        {
+            case WINDIVERT_FILTER_RESULT_ACCEPT:
+            case WINDIVERT_FILTER_RESULT_REJECT:
+                return TRUE;
+            default:
+                if (ip >= length)
+                {
+                    return FALSE;
+                }
+                break;
+        }
+    }
+    return FALSE;
+}
+
+/*
+ * Gather per-instruction statistics for a filter.
+ */
+BOOL WinDivertHelperProfileFilter(const char *filter, WINDIVERT_LAYER layer,
+    const VOID *packet, UINT packet_len, const WINDIVERT_ADDRESS *addr,
+    UINT addr_len, WINDIVERT_FILTER_STATS *stats, UINT stats_len)
+{
+    ERROR err;
+    DWORD error;
+    HANDLE pool;
+    WINDIVERT_FILTER *object;
+    const UINT8 *data = (const UINT8 *)packet;
+    PVOID next;
+    UINT obj_len, count, len, next_len, i;
+    BOOL network;
+
+    if (filter == NULL || addr == NULL || stats == NULL ||
+        addr_len % sizeof(WINDIVERT_ADDRESS) != 0)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    switch (layer)
+    {
+        case WINDIVERT_LAYER_NETWORK:
+        case WINDIVERT_LAYER_NETWORK_FORWARD:
+            network = TRUE;
+            break;
+        default:
+            network = FALSE;
+            break;
+    }
+
+    pool = HeapCreate(HEAP_NO_SERIALIZE, WINDIVERT_MIN_POOL_SIZE, 0);
+    if (pool == NULL)
+    {
+        return FALSE;
+    }
+    err = WinDivertCompileFilter(filter, pool, layer, &object, &obj_len);
+    if (IS_ERROR(err))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        goto WinDivertHelperProfileFilterError;
+    }
+    if (stats_len / sizeof(WINDIVERT_FILTER_STATS) < obj_len)
+    {
+        SetLastError(ERROR_INSUFFICIENT_BUFFER);
+        goto WinDivertHelperProfileFilterError;
+    }
+
+    count = addr_len / sizeof(WINDIVERT_ADDRESS);
+    for (i = 0; i < count; i++)
+    {
+        if (addr[i].Layer != layer)
+        {
+            SetLastError(ERROR_INVALID_PARAMETER);
+            goto WinDivertHelperProfileFilterError;
+        }
+        len = 0;
+        if (network)
+        {
+            if (data == NULL || !WinDivertHelperParsePacket(data, packet_len,
+                    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+                    &next, &next_len))
+            {
+                SetLastError(ERROR_INVALID_PARAMETER);
+                goto WinDivertHelperProfileFilterError;
+            }
+            len = (next == NULL? packet_len: packet_len - next_len);
+        }
+        if (!WinDivertProfileFilterObject(object, obj_len,
+                (network? data: NULL), len, addr + i, stats))
+        {
+            SetLastError(ERROR_INVALID_PARAMETER);
+            goto WinDivertHelperProfileFilterError;
+        }
+        data       += len;
+        packet_len -= len;
+    }
+
+    HeapDestroy(pool);
+    return TRUE;
+
+WinDivertHelperProfileFilterError:
+    error = GetLastError();
+    HeapDestroy(pool);
+    SetLastError(error);
+    return FALSE;
+}
+
+/*
+ * Estimate the success probability of a test from its statistics.
+ */
+static UINT32 WinDivertProfileProb(const WINDIVERT_FILTER_STATS *stats)
+{
+    UINT64 count = stats->Count, success = stats->Success;
+
+    if (success > count)
+    {
+        success = count;
+    }
+    while (count > 0xFFFD)
+    {
+        count   >>= 1;
+        success >>= 1;
+    }
+
+    // Laplace smoothing (unprofiled tests are 1/2):
+    return (((UINT32)success + 1) << 16) / ((UINT32)count + 2);
+}
+
+/*
+ * Returns TRUE if operand (p1, c1) should be evaluated before (p2, c2).
+ */
+static BOOL WinDivertProfileBefore(BOOL and, UINT32 p1, UINT32 c1,
+    UINT32 p2, UINT32 c2)
+{
+    if (and)
+    {
+        return WINDIVERT_MUL64(c1, WINDIVERT_PROFILE_ONE - p2) <
+               WINDIVERT_MUL64(c2, WINDIVERT_PROFILE_ONE - p1);
+    }
+    return WINDIVERT_MUL64(c1, p2) < WINDIVERT_MUL64(c2, p1);
+}
+
+/*
+ * Count the operands of an and/or chain.
+ */
+static UINT WinDivertChainLength(PEXPR expr, UINT8 kind)
+{
+    if (expr->kind != kind)
+    {
+        return 1;
+    }
+    return WinDivertChainLength(expr->arg[0], kind) +
+        WinDivertChainLength(expr->arg[1], kind);
+}
+
+/*
+ * Collect the operands and nodes of an and/or chain.
+ */
+static void WinDivertChainCollect(PEXPR expr, UINT8 kind, PEXPR *args,
+    UINT *num_args, PEXPR *nodes, UINT *num_nodes)
+{
+    if (expr->kind != kind)
+    {
+        args[*num_args] = expr;
+        *num_args = *num_args + 1;
+        return;
+    }
+    WinDivertChainCollect(expr->arg[0], kind, args, num_args, nodes,
+        num_nodes);
+    WinDivertChainCollect(expr->arg[1], kind, args, num_args, nodes,
+        num_nodes);
+    nodes[*num_nodes] = expr;
+    *num_nodes = *num_nodes + 1;
+}
+
+/*
+ * Reorder and/or operands to minimize the expected cost of an expression.
+ */
+static BOOL WinDivertOptimizeExpr(PWINDIVERT_PROFILE profile, PEXPR expr,
+    UINT32 *prob, UINT32 *cost)
+{
+    PEXPR *args, *nodes, arg;
+    UINT32 *probs, *costs, p, c, p1, c1, p2, c2, reach;
+    UINT64 total;
+    UINT n, m, i, j;
+    INT16 k;
+    BOOL and;
+
+    switch (expr->kind)
+    {
+        case TOKEN_QUESTION:
+            if (!WinDivertOptimizeExpr(profile, expr->arg[0], &p, &c) ||
+                !WinDivertOptimizeExpr(profile, expr->arg[1], &p1, &c1) ||
+                !WinDivertOptimizeExpr(profile, expr->arg[2], &p2, &c2))
+            {
+                return FALSE;
+            }
+            *prob = (UINT32)((WINDIVERT_MUL64(p, p1) +
+                WINDIVERT_MUL64(WINDIVERT_PROFILE_ONE - p, p2)) >> 16);
+            *cost = c + (UINT32)((WINDIVERT_MUL64(p, c1) +
+                WINDIVERT_MUL64(WINDIVERT_PROFILE_ONE - p, c2)) >> 16);
+            return TRUE;
+        case TOKEN_AND:
+        case TOKEN_OR:
+            break;
+        default:
+            k = (INT16)expr->label - 1;
+            if (k < 0 || k > profile->entry || profile->stack[k] != expr)
+            {
+                // Constant tests were eliminated by WinDivertFlattenExpr():
+                *prob = (expr->kind == TOKEN_EQ &&
+                    expr->arg[0]->kind == TOKEN_TRUE &&
+                    expr->arg[1]->val[0] != 0? WINDIVERT_PROFILE_ONE: 0);
+                *cost = 0;
+                return TRUE;
+            }
+            i = (UINT)(profile->entry - k);
+            *prob = (i < profile->count?
+                WinDivertProfileProb(profile->stats + i):
+                WINDIVERT_PROFILE_ONE / 2);
+            *cost = WINDIVERT_PROFILE_ONE;
+            return TRUE;
+    }
+
+    and = (expr->kind == TOKEN_AND);
+    n = WinDivertChainLength(expr, expr->kind);
+    args  = (PEXPR *)HeapAlloc(profile->pool, 0, 2 * n * sizeof(PEXPR));
+    probs = (UINT32 *)HeapAlloc(profile->pool, 0, 2 * n * sizeof(UINT32));
+    if (args == NULL || probs == NULL)
+    {
+        return FALSE;
+    }
+    nodes = args + n;
+    costs = probs + n;
+    i = m = 0;
+    WinDivertChainCollect(expr, expr->kind, args, &i, nodes, &m);
+
+    for (i = 0; i < n; i++)
+    {
+        if (!WinDivertOptimizeExpr(profile, args[i], probs + i, costs + i))
+        {
+            return FALSE;
+        }
+    }
+
+    // Stable insertion sort (ties preserve the original order):
+    for (i = 1; i < n; i++)
+    {
+        arg = args[i];
+        p   = probs[i];
+        c   = costs[i];
+        for (j = i; j > 0 &&
+                WinDivertProfileBefore(and, p, c, probs[j-1], costs[j-1]);
+                j--)
+        {
+            args[j]  = args[j-1];
+            probs[j] = probs[j-1];
+            costs[j] = costs[j-1];
+        }
+        args[j]  = arg;
+        probs[j] = p;
+        costs[j] = c;
+    }
+
+    // Rebuild the chain (left associative) reusing the original nodes.  The
+    // last collected node is expr itself:
+    for (j = 0; j < m; j++)
+    {
+        nodes[j]->arg[0] = (j == 0? args[0]: nodes[j-1]);
+        nodes[j]->arg[1] = args[j+1];
+    }
+
+    // The chain continues while every test succeeds (and) or fails (or):
+    reach = WINDIVERT_PROFILE_ONE;
+    total = 0;
+    for (i = 0; i < n; i++)
+    {
+        total += WINDIVERT_MUL64(reach, costs[i]);
+        p = (and? probs[i]: WINDIVERT_PROFILE_ONE - probs[i]);
+        reach = (UINT32)(WINDIVERT_MUL64(reach, p) >> 16);
+    }
+    *prob = (and? reach: WINDIVERT_PROFILE_ONE - reach);
+    *cost = (UINT32)(total >> 16);
+
+    HeapFree(profile->pool, 0, args);
+    HeapFree(profile->pool, 0, probs);
+    return TRUE;
+}
+
+/*
+ * Compile the given filter string optimized for the given statistics.
+ */
+BOOL WinDivertHelperOptimizeFilter(const char *filter, WINDIVERT_LAYER layer,
+    const WINDIVERT_FILTER_STATS *stats, UINT stats_len, char *object,
+    UINT obj_len, const char **error, UINT *error_pos)
+{
+    HANDLE pool;
+    ERROR err;
+    WINDIVERT_PROFILE profile;
+    WINDIVERT_FILTER *filter_obj;
+    WINDIVERT_STREAM stream;
+    PEXPR expr;
+    INT16 label;
+    UINT32 prob, cost;
+    UINT filter_obj_len;
+
+    if (filter == NULL || filter[0] == '@' || object == NULL ||
+        (stats == NULL && stats_len != 0))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    pool = HeapCreate(HEAP_NO_SERIALIZE, WINDIVERT_MIN_POOL_SIZE, 0);
+    if (pool == NULL)
+    {
+        return FALSE;
+    }
+
+    SetLastError(ERROR_SUCCESS);
+    profile.stats = stats;
+    profile.count = stats_len / sizeof(WINDIVERT_FILTER_STATS);
+    profile.pool  = pool;
+    profile.stack = (PEXPR *)HeapAlloc(pool, 0,
+        WINDIVERT_FILTER_MAXLEN * sizeof(PEXPR));
+    if (profile.stack == NULL)
+    {
+        err = MAKE_ERROR(WINDIVERT_ERROR_NO_MEMORY, 0);
+        goto WinDivertHelperOptimizeFilterExit;
+    }
+
+    err = WinDivertParseFilterString(filter, pool, layer, &expr);
+    if (IS_ERROR(err))
+    {
+        goto WinDivertHelperOptimizeFilterExit;
+    }
+
+    // Map each test to its instruction in the unoptimized object:
+    label = 0;
+    profile.entry = WinDivertFlattenExpr(expr, &label,
+        WINDIVERT_FILTER_RESULT_ACCEPT, WINDIVERT_FILTER_RESULT_REJECT,
+        profile.stack);
+    if (profile.entry < 0)
+    {
+        err = MAKE_ERROR(WINDIVERT_ERROR_TOO_LONG, 0);
+        goto WinDivertHelperOptimizeFilterExit;
+    }
+
+    // Reorder and re-flatten:
+    if (profile.entry < WINDIVERT_FILTER_RESULT_ACCEPT)
+    {
+        if (!WinDivertOptimizeExpr(&profile, expr, &prob, &cost))
+        {
+            err = MAKE_ERROR(WINDIVERT_ERROR_NO_MEMORY, 0);
+            goto WinDivertHelperOptimizeFilterExit;
+        }
+        label = 0;
+        profile.entry = WinDivertFlattenExpr(expr, &label,
+            WINDIVERT_FILTER_RESULT_ACCEPT, WINDIVERT_FILTER_RESULT_REJECT,
+            profile.stack);
+        if (profile.entry < 0)
+        {
+            err = MAKE_ERROR(WINDIVERT_ERROR_ASSERTION_FAILED, 0);
+            goto WinDivertHelperOptimizeFilterExit;
+        }
+    }
+    filter_obj_len = (profile.entry >= WINDIVERT_FILTER_RESULT_ACCEPT? 1:
+        profile.entry + 1);
+    filter_obj = (WINDIVERT_FILTER *)HeapAlloc(pool, 0,
+        filter_obj_len * sizeof(WINDIVERT_FILTER));
+    if (filter_obj == NULL)
+    {
+        err = MAKE_ERROR(WINDIVERT_ERROR_NO_MEMORY, 0);
+        goto WinDivertHelperOptimizeFilterExit;
+    }
+    WinDivertEmitFilter(profile.stack, profile.entry, profile.entry,
+        filter_obj, &filter_obj_len);
+
+    stream.data     = object;
+    stream.pos      = 0;
+    stream.max      = obj_len;
+    stream.overflow = FALSE;
+    WinDivertSerializeFilter(&stream, filter_obj, (UINT16)filter_obj_len);
+    if (stream.overflow)
+    {
+        SetLastError(ERROR_INSUFFICIENT_BUFFER);
+        err = MAKE_ERROR(WINDIVERT_ERROR_OUTPUT_TOO_SHORT, 0);
+    }
+
+WinDivertHelperOptimizeFilterExit:
+    HeapDestroy(pool);
+    if (error != NULL)
+    {
+        *error = WinDivertErrorString(GET_CODE(err));
+    }
+    if (error_pos != NULL)
+    {
+        *error_pos = GET_POS(err);
+    }
+    return !IS_ERROR(err);
+}
+
 /*
  * Get a char from a stream.
  */
@@ -2785,7 +3945,7 @@ static BOOL WinDivertDeserializeLabel(PWINDIVERT_STREAM stream, UINT16 *label)
             *label = WINDIVERT_FILTER_RESULT_REJECT;
             return TRUE;
         case 'L':
-            if (!WinDivertDeserializeNumber(stream, 2, &val) ||
+            if (!WinDivertDeserializeNumber(stream, 3, &val) ||
                     val > WINDIVERT_FILTER_MAXLEN)
             {
                 return FALSE;
@@ -2843,6 +4003,8 @@ static BOOL WinDivertDeserializeTest(PWINDIVERT_STREAM stream,
         case WINDIVERT_FILTER_FIELD_IPV6_DSTADDR:
         case WINDIVERT_FILTER_FIELD_LOCALADDR:
         case WINDIVERT_FILTER_FIELD_REMOTEADDR:
+        case WINDIVERT_FILTER_FIELD_PROCESSNAME:
+        case WINDIVERT_FILTER_FIELD_PROCESSPATH:
             for (i = 1; i < 4; i++)
             {
                 if (!WinDivertDeserializeNumber(stream, 7, &filter->arg[i]))
@@ -2921,7 +4083,7 @@ static BOOL WinDivertDeserializeFilterHeader(PWINDIVERT_STREAM stream,
         return FALSE;
     }
 
-    if (!WinDivertDeserializeNumber(stream, 2, &length32) ||
+    if (!WinDivertDeserializeNumber(stream, 3, &length32) ||
             length32 == 0 || length32 > WINDIVERT_FILTER_MAXLEN)
     {
         return FALSE;
@@ -3036,6 +4198,8 @@ static PEXPR WinDivertDecompileTest(HANDLE pool, PWINDIVERT_FILTER test)
             kind = TOKEN_IF_IDX; break;
         case WINDIVERT_FILTER_FIELD_SUBIFIDX:
             kind = TOKEN_SUB_IF_IDX; break;
+        case WINDIVERT_FILTER_FIELD_MARK:
+            kind = TOKEN_MARK; break;
         case WINDIVERT_FILTER_FIELD_IP:
             kind = TOKEN_IP; break;
         case WINDIVERT_FILTER_FIELD_IPV6:
@@ -3082,6 +4246,24 @@ static PEXPR WinDivertDecompileTest(HANDLE pool, PWINDIVERT_FILTER test)
             kind = TOKEN_IPV6_NEXT_HDR; break;
         case WINDIVERT_FILTER_FIELD_IPV6_HOPLIMIT:
             kind = TOKEN_IPV6_HOP_LIMIT; break;
+        case WINDIVERT_FILTER_FIELD_IPV6_HOPOPTS:
+            kind = TOKEN_IPV6_HOP_OPTS; break;
+        case WINDIVERT_FILTER_FIELD_IPV6_ROUTING:
+            kind = TOKEN_IPV6_ROUTING; break;
+        case WINDIVERT_FILTER_FIELD_IPV6_FRAGHDR:
+            kind = TOKEN_IPV6_FRAG_HDR; break;
+        case WINDIVERT_FILTER_FIELD_IPV6_DSTOPTS:
+            kind = TOKEN_IPV6_DST_OPTS; break;
+        case WINDIVERT_FILTER_FIELD_IPV6_AH:
+            kind = TOKEN_IPV6_AH; break;
+        case WINDIVERT_FILTER_FIELD_IPV6_MH:
+            kind = TOKEN_IPV6_MH; break;
+        case WINDIVERT_FILTER_FIELD_IPV6_ROUTINGTYPE:
+            kind = TOKEN_IPV6_ROUTING_TYPE; break;
+        case WINDIVERT_FILTER_FIELD_IPV6_EXTHDRCOUNT:
+            kind = TOKEN_IPV6_EXT_HDR_COUNT; break;
+        case WINDIVERT_FILTER_FIELD_IPV6_EXTHDRLENGTH:
+            kind = TOKEN_IPV6_EXT_HDR_LENGTH; break;
         case WINDIVERT_FILTER_FIELD_IPV6_SRCADDR:
             kind = TOKEN_IPV6_SRC_ADDR; break;
         case WINDIVERT_FILTER_FIELD_IPV6_DSTADDR:
@@ -3148,6 +4330,10 @@ static PEXPR WinDivertDecompileTest(HANDLE pool, PWINDIVERT_FILTER test)
             kind = TOKEN_IMPOSTOR; break;
         case WINDIVERT_FILTER_FIELD_PROCESSID:
             kind = TOKEN_PROCESS_ID; break;
+        case WINDIVERT_FILTER_FIELD_PROCESSNAME:
+            kind = TOKEN_PROCESS_NAME; break;
+        case WINDIVERT_FILTER_FIELD_PROCESSPATH:
+            kind = TOKEN_PROCESS_PATH; break;
         case WINDIVERT_FILTER_FIELD_LOCALADDR:
             kind = TOKEN_LOCAL_ADDR; break;
         case WINDIVERT_FILTER_FIELD_REMOTEADDR:
@@ -3694,6 +4880,12 @@ static void WinDivertFormatTestExpr(PWINDIVERT_STREAM stream, PEXPR expr,
         case TOKEN_ICMPV6:
         case TOKEN_IP_DF:
         case TOKEN_IP_MF:
+        case TOKEN_IPV6_HOP_OPTS:
+        case TOKEN_IPV6_ROUTING:
+        case TOKEN_IPV6_FRAG_HDR:
+        case TOKEN_IPV6_DST_OPTS:
+        case TOKEN_IPV6_AH:
+        case TOKEN_IPV6_MH:
         case TOKEN_TCP_URG:
         case TOKEN_TCP_ACK:
         case TOKEN_TCP_PSH:
@@ -3754,6 +4946,8 @@ static void WinDivertFormatTestExpr(PWINDIVERT_STREAM stream, PEXPR expr,
         case TOKEN_UDP_PAYLOAD32:
         case TOKEN_ICMP_CHECKSUM:
         case TOKEN_ICMPV6_CHECKSUM:
+        case TOKEN_PROCESS_NAME:
+        case TOKEN_PROCESS_PATH:
             is_hex = TRUE;
             break;
         default:
@@ -3989,6 +5183,8 @@ static void WinDivertFormatExpr(PWINDIVERT_STREAM stream, PEXPR expr,
             WinDivertPutString(stream, "ifIdx"); return;
         case TOKEN_SUB_IF_IDX:
             WinDivertPutString(stream, "subIfIdx"); return;
+        case TOKEN_MARK:
+            WinDivertPutString(stream, "mark"); return;
         case TOKEN_IP:
             WinDivertPutString(stream, "ip"); return;
         case TOKEN_IPV6:
@@ -4035,6 +5231,24 @@ static void WinDivertFormatExpr(PWINDIVERT_STREAM stream, PEXPR expr,
             WinDivertPutString(stream, "ipv6.NextHdr"); return;
         case TOKEN_IPV6_HOP_LIMIT:
             WinDivertPutString(stream, "ipv6.HopLimit"); return;
+        case TOKEN_IPV6_HOP_OPTS:
+            WinDivertPutString(stream, "ipv6.HopOpts"); return;
+        case TOKEN_IPV6_ROUTING:
+            WinDivertPutString(stream, "ipv6.Routing"); return;
+        case TOKEN_IPV6_FRAG_HDR:
+            WinDivertPutString(stream, "ipv6.FragHdr"); return;
+        case TOKEN_IPV6_DST_OPTS:
+            WinDivertPutString(stream, "ipv6.DstOpts"); return;
+        case TOKEN_IPV6_AH:
+            WinDivertPutString(stream, "ipv6.AH"); return;
+        case TOKEN_IPV6_MH:
+            WinDivertPutString(stream, "ipv6.MH"); return;
+        case TOKEN_IPV6_ROUTING_TYPE:
+            WinDivertPutString(stream, "ipv6.RoutingType"); return;
+        case TOKEN_IPV6_EXT_HDR_COUNT:
+            WinDivertPutString(stream, "ipv6.ExtHdrCount"); return;
+        case TOKEN_IPV6_EXT_HDR_LENGTH:
+            WinDivertPutString(stream, "ipv6.ExtHdrLength"); return;
         case TOKEN_IPV6_SRC_ADDR:
             WinDivertPutString(stream, "ipv6.SrcAddr"); return;
         case TOKEN_IPV6_DST_ADDR:
@@ -4101,6 +5315,10 @@ static void WinDivertFormatExpr(PWINDIVERT_STREAM stream, PEXPR expr,
             WinDivertPutString(stream, "impostor"); return;
         case TOKEN_PROCESS_ID:
             WinDivertPutString(stream, "processId"); return;
+        case TOKEN_PROCESS_NAME:
+            WinDivertPutString(stream, "processName"); return;
+        case TOKEN_PROCESS_PATH:
+            WinDivertPutString(stream, "processPath"); return;
         case TOKEN_LOCAL_ADDR:
             WinDivertPutString(stream, "localAddr"); return;
         case TOKEN_REMOTE_ADDR:
@@ -4140,7 +5358,7 @@ static void WinDivertFormatExpr(PWINDIVERT_STREAM stream, PEXPR expr,
 BOOL WinDivertHelperFormatFilter(const char *filter, WINDIVERT_LAYER layer,
     char *buffer, UINT buflen)
 {
-    PEXPR exprs[WINDIVERT_FILTER_MAXLEN], expr;
+    PEXPR *exprs, expr;
     ERROR err;
     DWORD error;
     WINDIVERT_FILTER *object;
@@ -4155,22 +5373,20 @@ BOOL WinDivertHelperFormatFilter(const char *filter, WINDIVERT_LAYER layer,
         return FALSE;
     }
 
-    pool = HeapCreate(HEAP_NO_SERIALIZE, WINDIVERT_MIN_POOL_SIZE,
-        WINDIVERT_MAX_POOL_SIZE);
+    pool = HeapCreate(HEAP_NO_SERIALIZE, WINDIVERT_MIN_POOL_SIZE, 0);
     if (pool == NULL)
     {
         return FALSE;
     }
-    object = HeapAlloc(pool, 0,
-        WINDIVERT_FILTER_MAXLEN * sizeof(WINDIVERT_FILTER));
-    if (object == NULL)
+    err = WinDivertCompileFilter(filter, pool, layer, &object, &obj_len);
+    if (IS_ERROR(err))
     {
+        SetLastError(ERROR_INVALID_PARAMETER);
         goto WinDivertHelperFormatFilterError;
     }
-    err = WinDivertCompileFilter(filter, pool, layer, object, &obj_len);
-    if (IS_ERROR(err))
+    exprs = (PEXPR *)HeapAlloc(pool, 0, obj_len * sizeof(PEXPR));
+    if (exprs == NULL)
     {
-        SetLastError(ERROR_INVALID_PARAMETER);
         goto WinDivertHelperFormatFilterError;
     }
 
@@ -0,0 +1,546 @@
+/*
+ * windivert_merge.c
+ * (C) 2019, all rights reserved,
+ *
+ * This file is part of WinDivert.
+ *
+ * WinDivert is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * WinDivert is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * K-way merge of timestamp-ordered streams.  Each stream (e.g. one handle)
+ * is pushed in WINDIVERT_ADDRESS.Timestamp order into its own ring buffer,
+ * and packets are popped in global timestamp order using a loser tree
+ * (a tournament tree that stores the loser of each match, so replacing the
+ * winner costs one comparison per level).
+ *
+ * A packet is only popped once no stream can still deliver an earlier one:
+ * every other stream either has queued packets, or has already pushed a
+ * packet with a later (or equal) timestamp.  Otherwise the packet is held
+ * until it is older than the newest pushed timestamp minus the reorder
+ * delay.  Packets pushed after a later packet has been popped are late, and
+ * are either popped immediately (out of order) or dropped.
+ */
+
+#define WINDIVERT_MERGE_STREAMS_MAX     64
+#define WINDIVERT_MERGE_SIZE_MIN        (64 * 1024)
+#define WINDIVERT_MERGE_SIZE_MAX        (256 * 1024 * 1024)
+#define WINDIVERT_MERGE_TIME_MAX        0x7FFFFFFFFFFFFFFFll
+#define WINDIVERT_MERGE_TIME_MIN        (-WINDIVERT_MERGE_TIME_MAX - 1)
+#define WINDIVERT_MERGE_ALIGN(len)      (((len) + 7) & ~7u)
+
+/*
+ * Queued packet.  Followed by the packet data.
+ */
+typedef struct
+{
+    WINDIVERT_ADDRESS addr;         // Packet's address.
+    UINT32 len;                     // Packet length.
+    UINT32 size;                    // Record size.
+} WINDIVERT_MERGE_RECORD, *PWINDIVERT_MERGE_RECORD;
+
+/*
+ * Stream ring buffer.  Records are never split; if a record does not fit
+ * before the end of the buffer, the ring wraps and `end' marks the end of
+ * the older records.
+ */
+typedef struct
+{
+    UINT8 *buf;                     // Ring buffer.
+    UINT head;                      // Oldest record.
+    UINT tail;                      // Next free byte.
+    UINT end;                       // End of data if wrapped.
+    BOOL wrapped;                   // Data wraps around?
+    UINT count;                     // Queued packets.
+    BOOL seen;                      // Any packet pushed?
+    INT64 last;                     // Timestamp of the last pushed packet.
+} WINDIVERT_MERGE_STREAM, *PWINDIVERT_MERGE_STREAM;
+
+/*
+ * Merge.
+ */
+struct WINDIVERT_MERGE
+{
+    HANDLE pool;                    // Private heap.
+    UINT num_streams;               // Number of streams.
+    UINT leaves;                    // Tree leaves (power of 2).
+    UINT size;                      // Ring buffer size per stream.
+    UINT64 flags;                   // WINDIVERT_MERGE_FLAG_*
+    INT64 delay;                    // Max reorder delay.
+    INT64 high;                     // Newest pushed timestamp.
+    INT64 low;                      // Last popped timestamp.
+    BOOL pushed;                    // Any packet pushed?
+    BOOL popped;                    // Any packet popped?
+    BOOL rebuild;                   // Tree must be rebuilt?
+    UINT64 pending;                 // Queued packets.
+    UINT64 late;                    // Late packets.
+    UINT8 tree[2 * WINDIVERT_MERGE_STREAMS_MAX];
+                                    // [0] = winner, [1..] = losers.
+    WINDIVERT_MERGE_STREAM streams[WINDIVERT_MERGE_STREAMS_MAX];
+};
+
+/*
+ * Prototypes.
+ */
+static BOOL WinDivertMergeBeats(const struct WINDIVERT_MERGE *merge, UINT a,
+    UINT b);
+static void WinDivertMergeBuild(PWINDIVERT_MERGE merge);
+static void WinDivertMergeReplay(PWINDIVERT_MERGE merge, UINT stream);
+static PWINDIVERT_MERGE_RECORD WinDivertMergeReserve(
+    const struct WINDIVERT_MERGE *merge, PWINDIVERT_MERGE_STREAM stream,
+    UINT size);
+static void WinDivertMergeRemove(PWINDIVERT_MERGE_STREAM stream);
+static UINT WinDivertMergePacketLength(const WINDIVERT_ADDRESS *addr,
+    const UINT8 *packet, UINT packet_len);
+
+/*
+ * Stream head record, or NULL if the stream is empty.
+ */
+#define WINDIVERT_MERGE_HEAD(stream)                                    \
+    ((stream)->count == 0? NULL:                                        \
+        (PWINDIVERT_MERGE_RECORD)((stream)->buf + (stream)->head))
+
+/*
+ * Create a merge.
+ */
+PWINDIVERT_MERGE WinDivertHelperMergeCreate(UINT streams, UINT size,
+    INT64 delay, UINT64 flags)
+{
+    HANDLE pool;
+    PWINDIVERT_MERGE merge;
+    UINT i;
+
+    if (streams == 0 || streams > WINDIVERT_MERGE_STREAMS_MAX ||
+        size < WINDIVERT_MERGE_SIZE_MIN || size > WINDIVERT_MERGE_SIZE_MAX ||
+        delay < 0 || (flags & ~WINDIVERT_MERGE_FLAG_DROP_LATE) != 0)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return NULL;
+    }
+
+    pool = HeapCreate(0, WINDIVERT_MIN_POOL_SIZE, 0);
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+    merge = (PWINDIVERT_MERGE)HeapAlloc(pool, HEAP_ZERO_MEMORY,
+        sizeof(struct WINDIVERT_MERGE));
+    if (merge == NULL)
+    {
+        goto WinDivertHelperMergeCreateError;
+    }
+    merge->pool        = pool;
+    merge->num_streams = streams;
+    merge->size        = WINDIVERT_MERGE_ALIGN(size);
+    merge->flags       = flags;
+    merge->delay       = delay;
+    for (merge->leaves = 1; merge->leaves < streams; merge->leaves <<= 1)
+        ;
+    for (i = 0; i < streams; i++)
+    {
+        merge->streams[i].buf = (UINT8 *)HeapAlloc(pool, 0, merge->size);
+        if (merge->streams[i].buf == NULL)
+        {
+            goto WinDivertHelperMergeCreateError;
+        }
+    }
+    WinDivertMergeBuild(merge);
+    return merge;
+
+WinDivertHelperMergeCreateError:
+    HeapDestroy(pool);
+    SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+    return NULL;
+}
+
+/*
+ * Push a batch of packets to a stream.  Either the whole batch is queued, or
+ * nothing is.
+ */
+BOOL WinDivertHelperMergePush(PWINDIVERT_MERGE merge, UINT stream,
+    const VOID *pPacket, UINT packetLen, const WINDIVERT_ADDRESS *pAddr,
+    UINT addrLen)
+{
+    const UINT8 *packet = (const UINT8 *)pPacket;
+    PWINDIVERT_MERGE_STREAM s;
+    WINDIVERT_MERGE_STREAM saved;
+    PWINDIVERT_MERGE_RECORD record;
+    UINT count, len, late = 0, i;
+    INT64 high, timestamp;
+    BOOL empty, drop;
+
+    if (merge == NULL || stream >= merge->num_streams ||
+        (pAddr == NULL && addrLen != 0) ||
+        (pPacket == NULL && packetLen != 0) ||
+        addrLen % sizeof(WINDIVERT_ADDRESS) != 0)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    count = addrLen / sizeof(WINDIVERT_ADDRESS);
+    s = &merge->streams[stream];
+    saved = *s;
+    empty = (s->count == 0);
+    high = (merge->pushed? merge->high: WINDIVERT_MERGE_TIME_MIN);
+
+    for (i = 0; i < count; i++)
+    {
+        len = WinDivertMergePacketLength(&pAddr[i], packet, packetLen);
+        timestamp = pAddr[i].Timestamp;
+        drop = FALSE;
+        if (merge->popped && timestamp < merge->low)
+        {
+            late++;
+            drop = ((merge->flags & WINDIVERT_MERGE_FLAG_DROP_LATE) != 0);
+        }
+        if (!drop)
+        {
+            record = WinDivertMergeReserve(merge, s,
+                sizeof(WINDIVERT_MERGE_RECORD) + WINDIVERT_MERGE_ALIGN(len));
+            if (record == NULL)
+            {
+                *s = saved;
+                SetLastError(ERROR_INSUFFICIENT_BUFFER);
+                return FALSE;
+            }
+            memcpy(&record->addr, &pAddr[i], sizeof(WINDIVERT_ADDRESS));
+            record->len = len;
+            memcpy(record + 1, packet, len);
+            s->last = (!s->seen || timestamp > s->last? timestamp: s->last);
+            s->seen = TRUE;
+            high = (timestamp > high? timestamp: high);
+        }
+        packet    += len;
+        packetLen -= len;
+    }
+
+    merge->pending += s->count - saved.count;
+    merge->late    += late;
+    if (s->seen)
+    {
+        merge->high   = high;
+        merge->pushed = TRUE;
+    }
+    // A new head on an empty stream is not a winner replacement:
+    merge->rebuild = merge->rebuild || (empty && s->count != 0);
+    return TRUE;
+}
+
+/*
+ * Pop packets in timestamp order.  With `flush', the reorder delay is
+ * ignored and every queued packet may be popped.
+ */
+BOOL WinDivertHelperMergePop(PWINDIVERT_MERGE merge, VOID *pPacket,
+    UINT packetLen, UINT *pPopLen, WINDIVERT_ADDRESS *pAddr, UINT *pAddrLen,
+    UINT8 *pStreams, BOOL flush)
+{
+    UINT8 *packet = (UINT8 *)pPacket;
+    PWINDIVERT_MERGE_STREAM s;
+    PWINDIVERT_MERGE_RECORD record;
+    INT64 bound = WINDIVERT_MERGE_TIME_MAX, expired, limit;
+    UINT count = 0, max_count, pop_len = 0, winner, i;
+
+    if (merge == NULL || pAddr == NULL || pAddrLen == NULL ||
+        (pPacket == NULL && packetLen != 0))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    max_count = *pAddrLen / sizeof(WINDIVERT_ADDRESS);
+
+    if (merge->rebuild)
+    {
+        WinDivertMergeBuild(merge);
+        merge->rebuild = FALSE;
+    }
+
+    // Future packets of an empty stream are no earlier than its last
+    // pushed packet (or unknown if it never pushed one):
+    for (i = 0; i < merge->num_streams; i++)
+    {
+        s = &merge->streams[i];
+        if (s->count == 0)
+        {
+            bound = (!s->seen? WINDIVERT_MERGE_TIME_MIN:
+                (s->last < bound? s->last: bound));
+            if (bound == WINDIVERT_MERGE_TIME_MIN)
+            {
+                break;
+            }
+        }
+    }
+    expired = (!merge->pushed || (merge->high < 0 &&
+        merge->high - WINDIVERT_MERGE_TIME_MIN < merge->delay)?
+        WINDIVERT_MERGE_TIME_MIN: merge->high - merge->delay);
+    limit = (bound > expired? bound: expired);
+
+    while (count < max_count)
+    {
+        winner = merge->tree[0];
+        s = &merge->streams[winner];
+        record = WINDIVERT_MERGE_HEAD(s);
+        if (record == NULL)
+        {
+            break;          // All streams are empty.
+        }
+        if (!flush && record->addr.Timestamp > limit)
+        {
+            break;
+        }
+        if (record->len > packetLen - pop_len)
+        {
+            if (count == 0)
+            {
+                SetLastError(ERROR_INSUFFICIENT_BUFFER);
+                return FALSE;
+            }
+            break;
+        }
+        memcpy(packet + pop_len, record + 1, record->len);
+        memcpy(&pAddr[count], &record->addr, sizeof(WINDIVERT_ADDRESS));
+        if (pStreams != NULL)
+        {
+            pStreams[count] = (UINT8)winner;
+        }
+        pop_len += record->len;
+        count++;
+        if (!merge->popped || record->addr.Timestamp > merge->low)
+        {
+            merge->low    = record->addr.Timestamp;
+            merge->popped = TRUE;
+        }
+        WinDivertMergeRemove(s);
+        merge->pending--;
+        if (s->count == 0)
+        {
+            bound = (s->last < bound? s->last: bound);
+            limit = (bound > expired? bound: expired);
+        }
+        WinDivertMergeReplay(merge, winner);
+    }
+
+    *pAddrLen = count * sizeof(WINDIVERT_ADDRESS);
+    if (pPopLen != NULL)
+    {
+        *pPopLen = pop_len;
+    }
+    return TRUE;
+}
+
+/*
+ * Query merge counters.
+ */
+BOOL WinDivertHelperMergeQuery(PWINDIVERT_MERGE merge, UINT64 *pPending,
+    UINT64 *pLate)
+{
+    if (merge == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    if (pPending != NULL)
+    {
+        *pPending = merge->pending;
+    }
+    if (pLate != NULL)
+    {
+        *pLate = merge->late;
+    }
+    return TRUE;
+}
+
+/*
+ * Free a merge.
+ */
+void WinDivertHelperMergeFree(PWINDIVERT_MERGE merge)
+{
+    if (merge == NULL)
+    {
+        return;
+    }
+    HeapDestroy(merge->pool);
+}
+
+/*
+ * Returns TRUE if stream `a' should be popped before stream `b'.  Empty
+ * streams lose, and ties go to the lower stream.
+ */
+static BOOL WinDivertMergeBeats(const struct WINDIVERT_MERGE *merge, UINT a,
+    UINT b)
+{
+    const WINDIVERT_MERGE_STREAM *sa, *sb;
+    INT64 ta, tb;
+
+    sa = (a < merge->num_streams? &merge->streams[a]: NULL);
+    sb = (b < merge->num_streams? &merge->streams[b]: NULL);
+    if (sa == NULL || sa->count == 0)
+    {
+        return ((sb == NULL || sb->count == 0) && a < b);
+    }
+    if (sb == NULL || sb->count == 0)
+    {
+        return TRUE;
+    }
+    ta = WINDIVERT_MERGE_HEAD(sa)->addr.Timestamp;
+    tb = WINDIVERT_MERGE_HEAD(sb)->addr.Timestamp;
+    return (ta < tb || (ta == tb && a < b));
+}
+
+/*
+ * Rebuild the loser tree.  Leaf i is node (leaves + i).
+ */
+static void WinDivertMergeBuild(PWINDIVERT_MERGE merge)
+{
+    UINT8 winners[2 * WINDIVERT_MERGE_STREAMS_MAX];
+    UINT node, left, right;
+
+    for (node = 0; node < merge->leaves; node++)
+    {
+        winners[merge->leaves + node] = (UINT8)node;
+    }
+    for (node = merge->leaves - 1; node >= 1; node--)
+    {
+        left  = winners[2 * node];
+        right = winners[2 * node + 1];
+        if (WinDivertMergeBeats(merge, left, right))
+        {
+            winners[node]     = (UINT8)left;
+            merge->tree[node] = (UINT8)right;
+        }
+        else
+        {
+            winners[node]     = (UINT8)right;
+            merge->tree[node] = (UINT8)left;
+        }
+    }
+    merge->tree[0] = (merge->leaves == 1? 0: winners[1]);
+}
+
+/*
+ * Replay the matches from the winner's leaf after its head changed.
+ */
+static void WinDivertMergeReplay(PWINDIVERT_MERGE merge, UINT stream)
+{
+    UINT node, winner = stream, loser;
+
+    for (node = (merge->leaves + stream) / 2; node >= 1; node /= 2)
+    {
+        loser = merge->tree[node];
+        if (WinDivertMergeBeats(merge, loser, winner))
+        {
+            merge->tree[node] = (UINT8)winner;
+            winner = loser;
+        }
+    }
+    merge->tree[0] = (UINT8)winner;
+}
+
+/*
+ * Reserve space for a record at the tail of a stream, or NULL if full.
+ */
+static PWINDIVERT_MERGE_RECORD WinDivertMergeReserve(
+    const struct WINDIVERT_MERGE *merge, PWINDIVERT_MERGE_STREAM stream,
+    UINT size)
+{
+    PWINDIVERT_MERGE_RECORD record;
+    UINT pos;
+
+    if (stream->count == 0)
+    {
+        stream->head    = stream->tail = 0;
+        stream->wrapped = FALSE;
+    }
+    if (!stream->wrapped)
+    {
+        if (merge->size - stream->tail >= size)
+        {
+            pos = stream->tail;
+        }
+        else if (stream->head >= size)
+        {
+            stream->end     = stream->tail;
+            stream->wrapped = TRUE;
+            pos = 0;
+        }
+        else
+        {
+            return NULL;
+        }
+    }
+    else if (stream->head - stream->tail >= size)
+    {
+        pos = stream->tail;
+    }
+    else
+    {
+        return NULL;
+    }
+    stream->tail = pos + size;
+    stream->count++;
+    record = (PWINDIVERT_MERGE_RECORD)(stream->buf + pos);
+    record->size = size;
+    return record;
+}
+
+/*
+ * Remove the head record of a stream.
+ */
+static void WinDivertMergeRemove(PWINDIVERT_MERGE_STREAM stream)
+{
+    PWINDIVERT_MERGE_RECORD record = WINDIVERT_MERGE_HEAD(stream);
+
+    stream->head += record->size;
+    stream->count--;
+    if (stream->wrapped && stream->head == stream->end)
+    {
+        stream->head    = 0;
+        stream->wrapped = FALSE;
+    }
+}
+
+/*
+ * Length of the next packet in a batch.
+ */
+static UINT WinDivertMergePacketLength(const WINDIVERT_ADDRESS *addr,
+    const UINT8 *packet, UINT packet_len)
+{
+    switch (addr->Layer)
+    {
+        case WINDIVERT_LAYER_NETWORK:
+        case WINDIVERT_LAYER_NETWORK_FORWARD:
+            break;
+        default:
+            return 0;
+    }
+    if (packet == NULL)
+    {
+        return 0;
+    }
+    return WinDivertGetPacketLength(packet, packet_len);
+}
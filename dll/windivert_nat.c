@@ -0,0 +1,324 @@
+/*
+ * windivert_nat.c
+ * (C) 2019, all rights reserved,
+ *
+ * This file is part of WinDivert.
+ *
+ * WinDivert is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * WinDivert is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Redirect (NAT) state.  This is shared with the driver, but has no OS
+ * dependencies so that it can be tested in isolation.
+ *
+ * Redirected connections are "reflected" in the same way as the streamdump
+ * sample: an outbound packet (local:port -> remote:orig_port) is translated
+ * into an inbound packet (remote:port -> local:proxy_port), and the proxy's
+ * reply (local:proxy_port -> remote:port) is translated into an inbound
+ * packet (remote:orig_port -> local:port).  The table maps each
+ * (remote, port) pair to the connection's original destination port.
+ */
+
+#define WINDIVERT_NAT_SIZE_DEFAULT          4096
+#define WINDIVERT_NAT_MAX_PROBES            32
+
+#define WINDIVERT_NAT_STATE_FREE            0
+#define WINDIVERT_NAT_STATE_SYN             1
+#define WINDIVERT_NAT_STATE_ESTABLISHED     2
+#define WINDIVERT_NAT_STATE_CLOSING         3
+
+#define WINDIVERT_NAT_TIMEOUT_SYN           30000       // 30s
+#define WINDIVERT_NAT_TIMEOUT_ESTABLISHED   7440000     // 2h4m
+#define WINDIVERT_NAT_TIMEOUT_CLOSING       10000       // 10s
+
+#define WINDIVERT_NAT_RESULT_IGNORE         0           // Not redirected.
+#define WINDIVERT_NAT_RESULT_REFLECT        1           // Inject inbound.
+#define WINDIVERT_NAT_RESULT_DROP           2           // Drop.
+
+/*
+ * NAT table entry.
+ */
+typedef struct
+{
+    UINT32 addr[4];                 // Remote address (network order).
+    UINT16 port;                    // Local port (network order).
+    UINT16 orig_port;               // Original remote port (network order).
+    UINT8 state;                    // WINDIVERT_NAT_STATE_*
+    UINT8 ipv6;                     // Entry is IPv6?
+    UINT16 reserved;
+    UINT64 timestamp;               // Last activity (ms).
+} WINDIVERT_NAT_ENTRY, *PWINDIVERT_NAT_ENTRY;
+
+/*
+ * NAT table.
+ */
+typedef struct WINDIVERT_NAT
+{
+    PWINDIVERT_NAT_ENTRY entries;   // Entries (caller allocated).
+    UINT32 mask;                    // Number of entries - 1.
+    UINT16 proxy_port;              // Proxy port (network order).
+} WINDIVERT_NAT, *PWINDIVERT_NAT;
+
+/*
+ * Initialize a NAT table.  The size must be a power of 2.
+ */
+static void WinDivertNatInit(PWINDIVERT_NAT nat, PWINDIVERT_NAT_ENTRY entries,
+    UINT32 size, UINT16 proxy_port)
+{
+    UINT32 i;
+
+    nat->entries    = entries;
+    nat->mask       = size - 1;
+    nat->proxy_port = proxy_port;
+    for (i = 0; i < size; i++)
+    {
+        entries[i].state = WINDIVERT_NAT_STATE_FREE;
+    }
+}
+
+/*
+ * Test if an entry is live.
+ */
+static BOOL WinDivertNatLive(const WINDIVERT_NAT_ENTRY *entry, UINT64 now)
+{
+    UINT64 timeout;
+
+    switch (entry->state)
+    {
+        case WINDIVERT_NAT_STATE_SYN:
+            timeout = WINDIVERT_NAT_TIMEOUT_SYN;
+            break;
+        case WINDIVERT_NAT_STATE_ESTABLISHED:
+            timeout = WINDIVERT_NAT_TIMEOUT_ESTABLISHED;
+            break;
+        case WINDIVERT_NAT_STATE_CLOSING:
+            timeout = WINDIVERT_NAT_TIMEOUT_CLOSING;
+            break;
+        default:
+            return FALSE;
+    }
+    return (now - entry->timestamp <= timeout);
+}
+
+/*
+ * Hash a NAT key.
+ */
+static UINT32 WinDivertNatHash(const UINT32 *addr, UINT16 port)
+{
+    UINT64 h64 = WINDIVERT_PRIME64_4;
+
+    h64 = WinDivertXXH64Round(h64, (UINT64)addr[0] | ((UINT64)addr[1] << 32));
+    h64 = WinDivertXXH64Round(h64, (UINT64)addr[2] | ((UINT64)addr[3] << 32));
+    h64 = WinDivertXXH64Round(h64, (UINT64)port);
+    return (UINT32)WinDivertXXH64Avalanche(h64);
+}
+
+/*
+ * Find the entry for a key.  If `slot_ptr' is non-NULL, it is set to the
+ * first reusable slot (or NULL if the probe window is full).
+ */
+static PWINDIVERT_NAT_ENTRY WinDivertNatFind(PWINDIVERT_NAT nat,
+    BOOL ipv6, const UINT32 *addr, UINT16 port, UINT64 now,
+    PWINDIVERT_NAT_ENTRY *slot_ptr)
+{
+    PWINDIVERT_NAT_ENTRY entry, slot = NULL;
+    UINT32 idx, i;
+    BOOL live;
+
+    idx = WinDivertNatHash(addr, port);
+    for (i = 0; i < WINDIVERT_NAT_MAX_PROBES && i <= nat->mask; i++)
+    {
+        entry = &nat->entries[(idx + i) & nat->mask];
+        if (entry->state == WINDIVERT_NAT_STATE_FREE)
+        {
+            slot = (slot == NULL? entry: slot);
+            break;
+        }
+        live = WinDivertNatLive(entry, now);
+        if (live && entry->port == port && entry->ipv6 == (UINT8)ipv6 &&
+            entry->addr[0] == addr[0] && entry->addr[1] == addr[1] &&
+            entry->addr[2] == addr[2] && entry->addr[3] == addr[3])
+        {
+            return entry;
+        }
+        if (!live && slot == NULL)
+        {
+            slot = entry;
+        }
+    }
+    if (slot_ptr != NULL)
+    {
+        *slot_ptr = slot;
+    }
+    return NULL;
+}
+
+/*
+ * Incrementally update a checksum for a changed 16-bit word (RFC 1624).
+ */
+static void WinDivertNatUpdateChecksum(UINT16 *checksum, UINT16 old_word,
+    UINT16 new_word)
+{
+    UINT32 sum;
+
+    sum = (UINT16)~*checksum;
+    sum += (UINT16)~old_word;
+    sum += new_word;
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum += (sum >> 16);
+    *checksum = (UINT16)~sum;
+}
+
+/*
+ * Translate an outbound packet.  Returns WINDIVERT_NAT_RESULT_REFLECT if the
+ * packet was translated and should be injected in the inbound direction.
+ */
+static UINT WinDivertNatTranslate(PWINDIVERT_NAT nat, VOID *packet,
+    UINT packet_len, UINT64 now)
+{
+    WINDIVERT_PACKET info;
+    PWINDIVERT_TCPHDR tcp_header;
+    PWINDIVERT_NAT_ENTRY entry, slot;
+    UINT32 remote[4], tmp[4];
+    UINT16 new_port;
+    BOOL ipv6, reply, syn;
+    UINT i;
+
+    if (!WinDivertHelperParsePacketEx(packet, packet_len, &info) ||
+        info.TCPHeader == NULL || info.Fragment)
+    {
+        return WINDIVERT_NAT_RESULT_IGNORE;
+    }
+    tcp_header = info.TCPHeader;
+    ipv6 = (info.IPv6Header != NULL);
+    if (!ipv6)
+    {
+        remote[0] = info.IPHeader->DstAddr;
+        remote[1] = remote[2] = remote[3] = 0;
+    }
+    else
+    {
+        for (i = 0; i < 4; i++)
+        {
+            remote[i] = info.IPv6Header->DstAddr[i];
+        }
+    }
+
+    reply = (tcp_header->SrcPort == nat->proxy_port);
+    syn = (tcp_header->Syn && !tcp_header->Ack);
+    entry = WinDivertNatFind(nat, ipv6, remote,
+        (reply? tcp_header->DstPort: tcp_header->SrcPort), now, &slot);
+    if (entry == NULL)
+    {
+        if (reply || !syn)
+        {
+            return WINDIVERT_NAT_RESULT_IGNORE;
+        }
+        if (slot == NULL)
+        {
+            // The table is full (within the probe window).
+            return WINDIVERT_NAT_RESULT_DROP;
+        }
+        entry = slot;
+        for (i = 0; i < 4; i++)
+        {
+            entry->addr[i] = remote[i];
+        }
+        entry->port      = tcp_header->SrcPort;
+        entry->orig_port = tcp_header->DstPort;
+        entry->ipv6      = (UINT8)ipv6;
+        entry->state     = WINDIVERT_NAT_STATE_SYN;
+    }
+    else if (!reply && syn && entry->state == WINDIVERT_NAT_STATE_CLOSING)
+    {
+        // Port reuse:
+        entry->orig_port = tcp_header->DstPort;
+        entry->state     = WINDIVERT_NAT_STATE_SYN;
+    }
+
+    if (tcp_header->Fin || tcp_header->Rst)
+    {
+        entry->state = WINDIVERT_NAT_STATE_CLOSING;
+    }
+    else if (tcp_header->Ack && entry->state == WINDIVERT_NAT_STATE_SYN)
+    {
+        entry->state = WINDIVERT_NAT_STATE_ESTABLISHED;
+    }
+    entry->timestamp = now;
+
+    // Translate.  Swapping addresses does not affect the checksum.
+    if (reply)
+    {
+        new_port = entry->orig_port;
+        WinDivertNatUpdateChecksum(&tcp_header->Checksum,
+            tcp_header->SrcPort, new_port);
+        tcp_header->SrcPort = new_port;
+    }
+    else
+    {
+        new_port = nat->proxy_port;
+        WinDivertNatUpdateChecksum(&tcp_header->Checksum,
+            tcp_header->DstPort, new_port);
+        tcp_header->DstPort = new_port;
+    }
+    if (!ipv6)
+    {
+        tmp[0] = info.IPHeader->SrcAddr;
+        info.IPHeader->SrcAddr = info.IPHeader->DstAddr;
+        info.IPHeader->DstAddr = tmp[0];
+    }
+    else
+    {
+        for (i = 0; i < 4; i++)
+        {
+            tmp[i] = info.IPv6Header->SrcAddr[i];
+            info.IPv6Header->SrcAddr[i] = info.IPv6Header->DstAddr[i];
+            info.IPv6Header->DstAddr[i] = tmp[i];
+        }
+    }
+    return WINDIVERT_NAT_RESULT_REFLECT;
+}
+
+/*
+ * Query the original destination port of a redirected connection, given
+ * the (remote, port) pair seen by the proxy.
+ */
+static BOOL WinDivertNatQuery(PWINDIVERT_NAT nat, BOOL ipv6,
+    const UINT32 *addr, UINT16 port, UINT64 now, UINT16 *orig_port)
+{
+    PWINDIVERT_NAT_ENTRY entry;
+
+    entry = WinDivertNatFind(nat, ipv6, addr, port, now, NULL);
+    if (entry == NULL)
+    {
+        return FALSE;
+    }
+    *orig_port = entry->orig_port;
+    return TRUE;
+}
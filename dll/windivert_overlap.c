@@ -0,0 +1,1193 @@
+/*
+ * windivert_overlap.c
+ * (C) 2019, all rights reserved,
+ *
+ * This file is part of WinDivert.
+ *
+ * WinDivert is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * WinDivert is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Symbolic filter comparison.  A compiled filter is a DAG of tests, so the
+ * set of packets it accepts is the union over all paths to ACCEPT of the
+ * conjunction of the tests along the path (taken as true on the success
+ * branch and false on the failure branch).  Two filters are compared by
+ * enumerating their ACCEPT and REJECT paths and proving that combinations
+ * of paths are unsatisfiable, e.g. filter1 is a subset of filter2 if no
+ * ACCEPT path of filter1 is compatible with a REJECT path of filter2.
+ *
+ * A conjunction is decided with interval and disequality constraints per
+ * field, each field value being a signed 128-bit number (as compared by
+ * the filter engine), together with a few relations between fields
+ * (e.g. inbound = !outbound, tcp implies protocol == 6, and the events of
+ * each layer).  A test on a header field is false if the header (or the
+ * process path) is missing, so a false test only constrains the value once
+ * the header is known to be present.  Constraints that cannot be modeled
+ * are dropped rather than approximated, so a proven relation always holds,
+ * but a relation that holds may not be proven.
+ */
+
+#define WINDIVERT_OVERLAP_PATHS_MAX     4096        // Per filter & result.
+#define WINDIVERT_OVERLAP_WORK_MAX      (1 << 24)   // Literals processed.
+#define WINDIVERT_OVERLAP_EXTRA         16          // Implied constraints.
+
+#define WINDIVERT_OVERLAP_FIELD_PROCESS (WINDIVERT_FILTER_FIELD_MAX + 1)
+                                                    // Process path known?
+
+#define WINDIVERT_OVERLAP_SIGNED        0x01        // Field is signed.
+#define WINDIVERT_OVERLAP_BIG           0x02        // 128-bit field.
+#define WINDIVERT_OVERLAP_OPTIONAL      0x04        // May be undefined.
+
+/*
+ * Signed 128-bit value (sign and magnitude, as in WinDivertCompare128()).
+ */
+typedef struct
+{
+    BOOL neg;
+    UINT32 mag[4];
+} WINDIVERT_OVERLAP_VALUE, *PWINDIVERT_OVERLAP_VALUE;
+
+/*
+ * Constrained variable: a field (and the packet offset or process name
+ * suffix length that selects the value).
+ */
+typedef struct
+{
+    UINT32 field;                   // WINDIVERT_FILTER_FIELD_*
+    UINT32 key;                     // Field key.
+    WINDIVERT_OVERLAP_VALUE lo;     // Lower bound (inclusive).
+    WINDIVERT_OVERLAP_VALUE hi;     // Upper bound (inclusive).
+    BOOL empty;                     // No value possible.
+} WINDIVERT_OVERLAP_VAR, *PWINDIVERT_OVERLAP_VAR;
+
+/*
+ * Excluded value.
+ */
+typedef struct
+{
+    UINT var;                       // Variable index.
+    WINDIVERT_OVERLAP_VALUE value;  // Excluded value.
+} WINDIVERT_OVERLAP_NEQ, *PWINDIVERT_OVERLAP_NEQ;
+
+/*
+ * Constraint store for a conjunction.
+ */
+typedef struct
+{
+    WINDIVERT_LAYER layer;
+    PWINDIVERT_OVERLAP_VAR vars;
+    UINT num_vars;
+    PWINDIVERT_OVERLAP_NEQ neqs;
+    UINT num_neqs;
+    const WINDIVERT_FILTER **deferred;  // False tests on header fields.
+    UINT num_deferred;
+    UINT max;                       // Capacity of each array.
+} WINDIVERT_OVERLAP_STORE, *PWINDIVERT_OVERLAP_STORE;
+
+/*
+ * Paths of a filter to ACCEPT or REJECT.  A path is a sequence of literals
+ * (test index << 1 | 1 if the test is true).
+ */
+typedef struct
+{
+    const WINDIVERT_FILTER *filter;
+    UINT16 *lits;                   // All literals.
+    UINT num_lits;
+    UINT max_lits;
+    UINT *starts;                   // Path starts (num_paths + 1).
+    UINT num_paths;
+    BOOL overflow;                  // Too many paths.
+} WINDIVERT_OVERLAP_PATHS, *PWINDIVERT_OVERLAP_PATHS;
+
+/*
+ * Prototypes.
+ */
+static UINT WinDivertOverlapFieldInfo(UINT32 field, UINT *bits);
+static UINT32 WinDivertOverlapFieldHeader(UINT32 field);
+static void WinDivertOverlapConst(const WINDIVERT_FILTER *test,
+    PWINDIVERT_OVERLAP_VALUE value);
+static int WinDivertOverlapCompare(const WINDIVERT_OVERLAP_VALUE *a,
+    const WINDIVERT_OVERLAP_VALUE *b);
+static BOOL WinDivertOverlapInc(PWINDIVERT_OVERLAP_VALUE value);
+static BOOL WinDivertOverlapDec(PWINDIVERT_OVERLAP_VALUE value);
+static void WinDivertOverlapSmall(PWINDIVERT_OVERLAP_VALUE value, BOOL neg,
+    UINT32 mag);
+static BOOL WinDivertOverlapPaths(HANDLE pool, const WINDIVERT_FILTER *filter,
+    UINT length, UINT16 result, PWINDIVERT_OVERLAP_PATHS paths);
+static void WinDivertOverlapReset(PWINDIVERT_OVERLAP_STORE store);
+static UINT WinDivertOverlapVar(PWINDIVERT_OVERLAP_STORE store, UINT32 field,
+    UINT32 key);
+static void WinDivertOverlapConstrain(PWINDIVERT_OVERLAP_STORE store,
+    UINT var, UINT test, const WINDIVERT_OVERLAP_VALUE *value);
+static void WinDivertOverlapAssume(PWINDIVERT_OVERLAP_STORE store,
+    const WINDIVERT_FILTER *test, BOOL truth);
+static void WinDivertOverlapApply(PWINDIVERT_OVERLAP_STORE store,
+    const WINDIVERT_FILTER *test, BOOL truth);
+static void WinDivertOverlapAddPath(PWINDIVERT_OVERLAP_STORE store,
+    const WINDIVERT_OVERLAP_PATHS *paths, UINT path);
+static BOOL WinDivertOverlapSat(PWINDIVERT_OVERLAP_STORE store);
+static BOOL WinDivertOverlapValue(const WINDIVERT_OVERLAP_STORE *store,
+    UINT var, PWINDIVERT_OVERLAP_VALUE value);
+static BOOL WinDivertOverlapExcludes(const WINDIVERT_OVERLAP_STORE *store,
+    UINT var, UINT32 value);
+static BOOL WinDivertOverlapCheck(PWINDIVERT_OVERLAP_STORE store,
+    const WINDIVERT_OVERLAP_PATHS *a, const WINDIVERT_OVERLAP_PATHS *b,
+    UINT *work);
+
+/*
+ * Compare two filters.
+ */
+BOOL WinDivertHelperCompareFilter(const char *filter1, const char *filter2,
+    WINDIVERT_LAYER layer, UINT32 *pRelation)
+{
+    HANDLE pool;
+    PWINDIVERT_FILTER object[2];
+    UINT obj_len[2];
+    WINDIVERT_OVERLAP_PATHS accept[2], reject[2];
+    WINDIVERT_OVERLAP_STORE store;
+    const char *filters[2];
+    UINT32 relation = 0;
+    UINT work = 0, max, i;
+    DWORD error;
+    ERROR err;
+
+    if (filter1 == NULL || filter2 == NULL || pRelation == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    switch (layer)
+    {
+        case WINDIVERT_LAYER_NETWORK:
+        case WINDIVERT_LAYER_NETWORK_FORWARD:
+        case WINDIVERT_LAYER_FLOW:
+        case WINDIVERT_LAYER_SOCKET:
+        case WINDIVERT_LAYER_REFLECT:
+            break;
+        default:
+            SetLastError(ERROR_INVALID_PARAMETER);
+            return FALSE;
+    }
+
+    pool = HeapCreate(HEAP_NO_SERIALIZE, WINDIVERT_MIN_POOL_SIZE, 0);
+    if (pool == NULL)
+    {
+        return FALSE;
+    }
+    filters[0] = filter1;
+    filters[1] = filter2;
+    max = WINDIVERT_OVERLAP_EXTRA;
+    for (i = 0; i < 2; i++)
+    {
+        err = WinDivertCompileFilter(filters[i], pool, layer, &object[i],
+            &obj_len[i]);
+        if (IS_ERROR(err))
+        {
+            SetLastError(ERROR_INVALID_PARAMETER);
+            goto WinDivertHelperCompareFilterError;
+        }
+        if (!WinDivertOverlapPaths(pool, object[i], obj_len[i],
+                WINDIVERT_FILTER_RESULT_ACCEPT, &accept[i]) ||
+            !WinDivertOverlapPaths(pool, object[i], obj_len[i],
+                WINDIVERT_FILTER_RESULT_REJECT, &reject[i]))
+        {
+            SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+            goto WinDivertHelperCompareFilterError;
+        }
+        max += 2 * obj_len[i];
+    }
+
+    store.layer = layer;
+    store.max   = max;
+    store.vars  = (PWINDIVERT_OVERLAP_VAR)HeapAlloc(pool, 0,
+        max * sizeof(WINDIVERT_OVERLAP_VAR));
+    store.neqs  = (PWINDIVERT_OVERLAP_NEQ)HeapAlloc(pool, 0,
+        max * sizeof(WINDIVERT_OVERLAP_NEQ));
+    store.deferred = (const WINDIVERT_FILTER **)HeapAlloc(pool, 0,
+        max * sizeof(const WINDIVERT_FILTER *));
+    if (store.vars == NULL || store.neqs == NULL || store.deferred == NULL)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        goto WinDivertHelperCompareFilterError;
+    }
+
+    if (accept[0].overflow || accept[1].overflow || reject[0].overflow ||
+        reject[1].overflow)
+    {
+        relation |= WINDIVERT_FILTER_RELATION_INEXACT;
+    }
+    if (!accept[0].overflow && WinDivertOverlapCheck(&store, &accept[0], NULL,
+            &work))
+    {
+        relation |= WINDIVERT_FILTER_RELATION_EMPTY1 |
+            WINDIVERT_FILTER_RELATION_DISJOINT |
+            WINDIVERT_FILTER_RELATION_SUBSET;
+    }
+    if (!accept[1].overflow && WinDivertOverlapCheck(&store, &accept[1], NULL,
+            &work))
+    {
+        relation |= WINDIVERT_FILTER_RELATION_EMPTY2 |
+            WINDIVERT_FILTER_RELATION_DISJOINT |
+            WINDIVERT_FILTER_RELATION_SUPERSET;
+    }
+    if ((relation & WINDIVERT_FILTER_RELATION_DISJOINT) == 0 &&
+        !accept[0].overflow && !accept[1].overflow &&
+        WinDivertOverlapCheck(&store, &accept[0], &accept[1], &work))
+    {
+        relation |= WINDIVERT_FILTER_RELATION_DISJOINT;
+    }
+    if ((relation & WINDIVERT_FILTER_RELATION_SUBSET) == 0 &&
+        !accept[0].overflow && !reject[1].overflow &&
+        WinDivertOverlapCheck(&store, &accept[0], &reject[1], &work))
+    {
+        relation |= WINDIVERT_FILTER_RELATION_SUBSET;
+    }
+    if ((relation & WINDIVERT_FILTER_RELATION_SUPERSET) == 0 &&
+        !accept[1].overflow && !reject[0].overflow &&
+        WinDivertOverlapCheck(&store, &accept[1], &reject[0], &work))
+    {
+        relation |= WINDIVERT_FILTER_RELATION_SUPERSET;
+    }
+    if (work > WINDIVERT_OVERLAP_WORK_MAX)
+    {
+        relation |= WINDIVERT_FILTER_RELATION_INEXACT;
+    }
+
+    HeapDestroy(pool);
+    *pRelation = relation;
+    return TRUE;
+
+WinDivertHelperCompareFilterError:
+    error = GetLastError();
+    HeapDestroy(pool);
+    SetLastError(error);
+    return FALSE;
+}
+
+/*
+ * Returns TRUE if every conjunction of a path from `a' and a path from `b'
+ * (or every path from `a' if `b' is NULL) is unsatisfiable.  Gives up
+ * (FALSE) once the work limit is exceeded.
+ */
+static BOOL WinDivertOverlapCheck(PWINDIVERT_OVERLAP_STORE store,
+    const WINDIVERT_OVERLAP_PATHS *a, const WINDIVERT_OVERLAP_PATHS *b,
+    UINT *work)
+{
+    UINT i, j;
+
+    for (i = 0; i < a->num_paths; i++)
+    {
+        // Paths of `a' that are unsatisfiable on their own are skipped:
+        WinDivertOverlapReset(store);
+        WinDivertOverlapAddPath(store, a, i);
+        *work += a->starts[i + 1] - a->starts[i];
+        if (!WinDivertOverlapSat(store))
+        {
+            continue;
+        }
+        if (b == NULL)
+        {
+            return FALSE;
+        }
+        for (j = 0; j < b->num_paths; j++)
+        {
+            if (*work > WINDIVERT_OVERLAP_WORK_MAX)
+            {
+                return FALSE;
+            }
+            WinDivertOverlapReset(store);
+            WinDivertOverlapAddPath(store, a, i);
+            WinDivertOverlapAddPath(store, b, j);
+            *work += (a->starts[i + 1] - a->starts[i]) +
+                (b->starts[j + 1] - b->starts[j]);
+            if (WinDivertOverlapSat(store))
+            {
+                return FALSE;
+            }
+        }
+    }
+    return TRUE;
+}
+
+/*
+ * Enumerate the paths from the start of a filter to `result' (depth-first,
+ * with an explicit stack since tests only jump forwards).
+ */
+static BOOL WinDivertOverlapPaths(HANDLE pool, const WINDIVERT_FILTER *filter,
+    UINT length, UINT16 result, PWINDIVERT_OVERLAP_PATHS paths)
+{
+    UINT16 *stack, *lits;
+    UINT16 label, ip;
+    UINT depth = 0, i;
+
+    paths->filter    = filter;
+    paths->num_lits  = 0;
+    paths->num_paths = 0;
+    paths->overflow  = FALSE;
+    paths->max_lits  = 16 * length + 64;
+    paths->lits   = (UINT16 *)HeapAlloc(pool, 0,
+        paths->max_lits * sizeof(UINT16));
+    paths->starts = (UINT *)HeapAlloc(pool, 0,
+        (WINDIVERT_OVERLAP_PATHS_MAX + 1) * sizeof(UINT));
+    stack = (UINT16 *)HeapAlloc(pool, 0, (length + 1) * sizeof(UINT16));
+    if (paths->lits == NULL || paths->starts == NULL || stack == NULL)
+    {
+        return FALSE;
+    }
+    paths->starts[0] = 0;
+    if (length == 0)
+    {
+        return TRUE;
+    }
+
+    // stack[i] = literal taken at depth i; the next sibling of a true
+    // literal is the false literal of the same test.
+    stack[depth++] = (UINT16)(0 << 1 | 1);
+    while (depth > 0)
+    {
+        ip = stack[depth - 1] >> 1;
+        label = ((stack[depth - 1] & 1) != 0? filter[ip].success:
+            filter[ip].failure);
+        if (label == WINDIVERT_FILTER_RESULT_ACCEPT ||
+            label == WINDIVERT_FILTER_RESULT_REJECT ||
+            label <= ip || label >= length || depth > length)
+        {
+            if (label == result)
+            {
+                if (paths->num_lits + depth > paths->max_lits)
+                {
+                    lits = (UINT16 *)HeapReAlloc(pool, 0, paths->lits,
+                        2 * paths->max_lits * sizeof(UINT16));
+                    if (lits == NULL)
+                    {
+                        return FALSE;
+                    }
+                    paths->lits = lits;
+                    paths->max_lits *= 2;
+                }
+                if (paths->num_paths >= WINDIVERT_OVERLAP_PATHS_MAX)
+                {
+                    paths->overflow = TRUE;
+                    return TRUE;
+                }
+                for (i = 0; i < depth; i++)
+                {
+                    paths->lits[paths->num_lits++] = stack[i];
+                }
+                paths->num_paths++;
+                paths->starts[paths->num_paths] = paths->num_lits;
+            }
+            else if (label != WINDIVERT_FILTER_RESULT_ACCEPT &&
+                     label != WINDIVERT_FILTER_RESULT_REJECT)
+            {
+                // Malformed (backwards) jump; nothing can be proven.
+                paths->overflow = TRUE;
+                return TRUE;
+            }
+
+            // Backtrack to the next untried false branch:
+            while (depth > 0 && (stack[depth - 1] & 1) == 0)
+            {
+                depth--;
+            }
+            if (depth > 0)
+            {
+                stack[depth - 1] &= ~1;
+            }
+            continue;
+        }
+        stack[depth++] = (UINT16)(label << 1 | 1);
+    }
+    return TRUE;
+}
+
+/*
+ * Add the literals of a path to a store.
+ */
+static void WinDivertOverlapAddPath(PWINDIVERT_OVERLAP_STORE store,
+    const WINDIVERT_OVERLAP_PATHS *paths, UINT path)
+{
+    UINT i;
+
+    for (i = paths->starts[path]; i < paths->starts[path + 1]; i++)
+    {
+        WinDivertOverlapAssume(store, &paths->filter[paths->lits[i] >> 1],
+            (paths->lits[i] & 1) != 0);
+    }
+}
+
+/*
+ * Reset a store.
+ */
+static void WinDivertOverlapReset(PWINDIVERT_OVERLAP_STORE store)
+{
+    store->num_vars     = 0;
+    store->num_neqs     = 0;
+    store->num_deferred = 0;
+}
+
+/*
+ * Find or create the variable for a field.
+ */
+static UINT WinDivertOverlapVar(PWINDIVERT_OVERLAP_STORE store, UINT32 field,
+    UINT32 key)
+{
+    PWINDIVERT_OVERLAP_VAR var;
+    UINT flags, bits, i;
+
+    for (i = 0; i < store->num_vars; i++)
+    {
+        if (store->vars[i].field == field && store->vars[i].key == key)
+        {
+            return i;
+        }
+    }
+    if (store->num_vars >= store->max)
+    {
+        return UINT32_MAX;
+    }
+    var = &store->vars[store->num_vars];
+    var->field = field;
+    var->key   = key;
+    var->empty = FALSE;
+    flags = WinDivertOverlapFieldInfo(field, &bits);
+    memset(&var->hi, 0, sizeof(var->hi));
+    for (i = 0; i < 4 && bits > 0; i++)
+    {
+        var->hi.mag[i] = (bits >= 32? 0xFFFFFFFF: (1u << bits) - 1);
+        bits = (bits >= 32? bits - 32: 0);
+    }
+    var->lo = var->hi;
+    var->lo.neg = ((flags & WINDIVERT_OVERLAP_SIGNED) != 0);
+    if (!var->lo.neg)
+    {
+        memset(&var->lo, 0, sizeof(var->lo));
+    }
+
+    // Layer-dependent domains:
+    switch (field)
+    {
+        case WINDIVERT_FILTER_FIELD_EVENT:
+            switch (store->layer)
+            {
+                case WINDIVERT_LAYER_NETWORK:
+                case WINDIVERT_LAYER_NETWORK_FORWARD:
+                    WinDivertOverlapSmall(&var->lo, FALSE,
+                        WINDIVERT_EVENT_NETWORK_PACKET);
+                    WinDivertOverlapSmall(&var->hi, FALSE,
+                        WINDIVERT_EVENT_NETWORK_PACKET);
+                    break;
+                case WINDIVERT_LAYER_FLOW:
+                    WinDivertOverlapSmall(&var->lo, FALSE,
+                        WINDIVERT_EVENT_FLOW_ESTABLISHED);
+                    WinDivertOverlapSmall(&var->hi, FALSE,
+                        WINDIVERT_EVENT_FLOW_DELETED);
+                    break;
+                case WINDIVERT_LAYER_SOCKET:
+                    WinDivertOverlapSmall(&var->lo, FALSE,
+                        WINDIVERT_EVENT_SOCKET_BIND);
+                    WinDivertOverlapSmall(&var->hi, FALSE,
+                        WINDIVERT_EVENT_SOCKET_CLOSE);
+                    break;
+                default:
+                    WinDivertOverlapSmall(&var->lo, FALSE,
+                        WINDIVERT_EVENT_REFLECT_OPEN);
+                    WinDivertOverlapSmall(&var->hi, FALSE,
+                        WINDIVERT_EVENT_REFLECT_CLOSE);
+                    break;
+            }
+            break;
+        case WINDIVERT_FILTER_FIELD_LAYER:
+            WinDivertOverlapSmall(&var->hi, FALSE, WINDIVERT_LAYER_REFLECT);
+            break;
+        case WINDIVERT_FILTER_FIELD_IP_SRCADDR:
+        case WINDIVERT_FILTER_FIELD_IP_DSTADDR:
+            var->lo.mag[1] = 0x0000FFFF;
+            break;
+        case WINDIVERT_FILTER_FIELD_PRIORITY:
+            WinDivertOverlapSmall(&var->lo, TRUE, WINDIVERT_PRIORITY_MAX);
+            WinDivertOverlapSmall(&var->hi, FALSE, WINDIVERT_PRIORITY_MAX);
+            break;
+        default:
+            break;
+    }
+    return store->num_vars++;
+}
+
+/*
+ * Constrain a variable with `var <test> value'.
+ */
+static void WinDivertOverlapConstrain(PWINDIVERT_OVERLAP_STORE store,
+    UINT var, UINT test, const WINDIVERT_OVERLAP_VALUE *value)
+{
+    PWINDIVERT_OVERLAP_VAR v;
+    WINDIVERT_OVERLAP_VALUE bound = *value;
+    UINT i;
+
+    if (var >= store->num_vars)
+    {
+        return;                     // Out of space; drop the constraint.
+    }
+    v = &store->vars[var];
+    switch (test)
+    {
+        case WINDIVERT_FILTER_TEST_NEQ:
+            for (i = 0; i < store->num_neqs; i++)
+            {
+                if (store->neqs[i].var == var &&
+                    WinDivertOverlapCompare(&store->neqs[i].value,
+                        &bound) == 0)
+                {
+                    return;
+                }
+            }
+            if (store->num_neqs < store->max)
+            {
+                store->neqs[store->num_neqs].var   = var;
+                store->neqs[store->num_neqs].value = bound;
+                store->num_neqs++;
+            }
+            break;
+        case WINDIVERT_FILTER_TEST_LT:
+            if (!WinDivertOverlapDec(&bound))
+            {
+                v->empty = TRUE;
+                return;
+            }
+            // Fallthrough
+        case WINDIVERT_FILTER_TEST_LEQ:
+            if (WinDivertOverlapCompare(&bound, &v->hi) < 0)
+            {
+                v->hi = bound;
+            }
+            break;
+        case WINDIVERT_FILTER_TEST_GT:
+            if (!WinDivertOverlapInc(&bound))
+            {
+                v->empty = TRUE;
+                return;
+            }
+            // Fallthrough
+        case WINDIVERT_FILTER_TEST_GEQ:
+            if (WinDivertOverlapCompare(&bound, &v->lo) > 0)
+            {
+                v->lo = bound;
+            }
+            break;
+        case WINDIVERT_FILTER_TEST_EQ:
+            if (WinDivertOverlapCompare(&bound, &v->hi) < 0)
+            {
+                v->hi = bound;
+            }
+            if (WinDivertOverlapCompare(&bound, &v->lo) > 0)
+            {
+                v->lo = bound;
+            }
+            break;
+        default:
+            return;
+    }
+
+    // Move the bounds past excluded values, so that a variable with a
+    // single possible value has lo == hi:
+    for (i = 0; i < store->num_neqs && !v->empty; i++)
+    {
+        if (store->neqs[i].var != var)
+        {
+            continue;
+        }
+        if (WinDivertOverlapCompare(&store->neqs[i].value, &v->lo) == 0)
+        {
+            v->empty = !WinDivertOverlapInc(&v->lo);
+            i = (UINT)-1;           // Rescan.
+        }
+        else if (WinDivertOverlapCompare(&store->neqs[i].value, &v->hi) == 0)
+        {
+            v->empty = !WinDivertOverlapDec(&v->hi);
+            i = (UINT)-1;
+        }
+    }
+}
+
+/*
+ * Assume that a test is true or false.
+ */
+static void WinDivertOverlapAssume(PWINDIVERT_OVERLAP_STORE store,
+    const WINDIVERT_FILTER *test, BOOL truth)
+{
+    UINT flags, bits;
+
+    if (truth)
+    {
+        WinDivertOverlapApply(store, test, TRUE);
+        return;
+    }
+
+    // A test is false if the field is undefined (e.g. the header is
+    // missing), so the negated test only holds if the field is defined.
+    flags = WinDivertOverlapFieldInfo(test->field, &bits);
+    if ((flags & WINDIVERT_OVERLAP_OPTIONAL) != 0)
+    {
+        return;
+    }
+    if (WinDivertOverlapFieldHeader(test->field) != 0)
+    {
+        if (store->num_deferred < store->max)
+        {
+            store->deferred[store->num_deferred++] = test;
+        }
+        return;
+    }
+    WinDivertOverlapApply(store, test, FALSE);
+}
+
+/*
+ * Add the constraint for a test (or its negation) to a store.
+ */
+static void WinDivertOverlapApply(PWINDIVERT_OVERLAP_STORE store,
+    const WINDIVERT_FILTER *test, BOOL truth)
+{
+    static const UINT8 negate[] =
+    {
+        WINDIVERT_FILTER_TEST_NEQ,  // EQ
+        WINDIVERT_FILTER_TEST_EQ,   // NEQ
+        WINDIVERT_FILTER_TEST_GEQ,  // LT
+        WINDIVERT_FILTER_TEST_GT,   // LEQ
+        WINDIVERT_FILTER_TEST_LEQ,  // GT
+        WINDIVERT_FILTER_TEST_LT,   // GEQ
+    };
+    WINDIVERT_OVERLAP_VALUE value;
+    UINT32 header, key = 0;
+
+    if (test->test > WINDIVERT_FILTER_TEST_MAX)
+    {
+        return;
+    }
+    switch (test->field)
+    {
+        case WINDIVERT_FILTER_FIELD_PACKET:
+        case WINDIVERT_FILTER_FIELD_PACKET16:
+        case WINDIVERT_FILTER_FIELD_PACKET32:
+        case WINDIVERT_FILTER_FIELD_TCP_PAYLOAD:
+        case WINDIVERT_FILTER_FIELD_TCP_PAYLOAD16:
+        case WINDIVERT_FILTER_FIELD_TCP_PAYLOAD32:
+        case WINDIVERT_FILTER_FIELD_UDP_PAYLOAD:
+        case WINDIVERT_FILTER_FIELD_UDP_PAYLOAD16:
+        case WINDIVERT_FILTER_FIELD_UDP_PAYLOAD32:
+            key = test->arg[1];     // Offset.
+            break;
+        case WINDIVERT_FILTER_FIELD_PROCESSNAME:
+        case WINDIVERT_FILTER_FIELD_PROCESSPATH:
+            key = ((test->arg[3] & WINDIVERT_PROCESS_FLAG_SUFFIX) != 0?
+                test->arg[2] + 1: 0);
+            break;
+        default:
+            break;
+    }
+    header = WinDivertOverlapFieldHeader(test->field);
+    if (truth && header != 0)
+    {
+        WinDivertOverlapSmall(&value, FALSE, 1);
+        WinDivertOverlapConstrain(store,
+            WinDivertOverlapVar(store, header, 0), WINDIVERT_FILTER_TEST_EQ,
+            &value);
+    }
+    WinDivertOverlapConst(test, &value);
+    WinDivertOverlapConstrain(store,
+        WinDivertOverlapVar(store, test->field, key),
+        (truth? test->test: negate[test->test]), &value);
+}
+
+/*
+ * Decide if the constraints in a store are satisfiable.  May return TRUE
+ * for unsatisfiable constraints (but not vice versa).
+ */
+static BOOL WinDivertOverlapSat(PWINDIVERT_OVERLAP_STORE store)
+{
+    static const UINT32 protocols[][2] =
+    {
+        {WINDIVERT_FILTER_FIELD_TCP,    IPPROTO_TCP},
+        {WINDIVERT_FILTER_FIELD_UDP,    IPPROTO_UDP},
+        {WINDIVERT_FILTER_FIELD_ICMP,   IPPROTO_ICMP},
+        {WINDIVERT_FILTER_FIELD_ICMPV6, IPPROTO_ICMPV6},
+    };
+    static const UINT32 pairs[][2] =
+    {
+        {WINDIVERT_FILTER_FIELD_INBOUND, WINDIVERT_FILTER_FIELD_OUTBOUND},
+        {WINDIVERT_FILTER_FIELD_IP,      WINDIVERT_FILTER_FIELD_IPV6},
+    };
+    const UINT num_protocols = sizeof(protocols) / sizeof(protocols[0]);
+    const UINT num_pairs = sizeof(pairs) / sizeof(pairs[0]);
+    WINDIVERT_OVERLAP_VALUE value, zero, one;
+    const WINDIVERT_FILTER *test;
+    UINT protocol, var, round, i, j;
+    BOOL flow;
+
+    WinDivertOverlapSmall(&zero, FALSE, 0);
+    WinDivertOverlapSmall(&one, FALSE, 1);
+    flow = (store->layer == WINDIVERT_LAYER_FLOW ||
+            store->layer == WINDIVERT_LAYER_SOCKET);
+    for (round = 0; round < 3; round++)
+    {
+        // inbound == !outbound; ip implies !ipv6 (and vice versa):
+        for (i = 0; i < num_pairs; i++)
+        {
+            for (j = 0; j < 2; j++)
+            {
+                var = WinDivertOverlapVar(store, pairs[i][j], 0);
+                if (!WinDivertOverlapValue(store, var, &value) ||
+                    (i == 1 && value.mag[0] == 0))
+                {
+                    continue;
+                }
+                value.mag[0] = !value.mag[0];
+                WinDivertOverlapConstrain(store,
+                    WinDivertOverlapVar(store, pairs[i][!j], 0),
+                    WINDIVERT_FILTER_TEST_EQ, &value);
+            }
+        }
+
+        // Transport protocols are exclusive, and imply the protocol field.
+        // For the FLOW and SOCKET layers, tcp/udp are the protocol field.
+        protocol = WinDivertOverlapVar(store, WINDIVERT_FILTER_FIELD_PROTOCOL,
+            0);
+        for (i = 0; i < num_protocols; i++)
+        {
+            var = WinDivertOverlapVar(store, protocols[i][0], 0);
+            WinDivertOverlapSmall(&value, FALSE, protocols[i][1]);
+            if (WinDivertOverlapExcludes(store, var, 0))
+            {
+                WinDivertOverlapConstrain(store, protocol,
+                    WINDIVERT_FILTER_TEST_EQ, &value);
+                for (j = 0; j < num_protocols; j++)
+                {
+                    if (j != i)
+                    {
+                        WinDivertOverlapConstrain(store,
+                            WinDivertOverlapVar(store, protocols[j][0], 0),
+                            WINDIVERT_FILTER_TEST_EQ, &zero);
+                    }
+                }
+            }
+            if (!flow || i >= 2)
+            {
+                continue;
+            }
+            if (WinDivertOverlapExcludes(store, var, 1))
+            {
+                WinDivertOverlapConstrain(store, protocol,
+                    WINDIVERT_FILTER_TEST_NEQ, &value);
+            }
+            if (WinDivertOverlapExcludes(store, protocol, protocols[i][1]))
+            {
+                WinDivertOverlapConstrain(store, var,
+                    WINDIVERT_FILTER_TEST_EQ, &zero);
+            }
+            else if (WinDivertOverlapValue(store, protocol, &value))
+            {
+                // (The protocol can only be protocols[i][1].)
+                WinDivertOverlapConstrain(store, var,
+                    WINDIVERT_FILTER_TEST_EQ, &one);
+            }
+        }
+
+        // False tests on fields of headers that are known to be present:
+        for (i = 0; i < store->num_deferred; )
+        {
+            test = store->deferred[i];
+            var = WinDivertOverlapVar(store,
+                WinDivertOverlapFieldHeader(test->field), 0);
+            if (!WinDivertOverlapExcludes(store, var, 0))
+            {
+                i++;
+                continue;
+            }
+            store->deferred[i] = store->deferred[--store->num_deferred];
+            WinDivertOverlapApply(store, test, FALSE);
+        }
+    }
+
+    // Excluded values at the bounds have already been removed, so each
+    // variable has a possible value iff lo <= hi:
+    for (var = 0; var < store->num_vars; var++)
+    {
+        if (store->vars[var].empty ||
+            WinDivertOverlapCompare(&store->vars[var].lo,
+                &store->vars[var].hi) > 0)
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/*
+ * Returns TRUE if a variable has a single possible value.
+ */
+static BOOL WinDivertOverlapValue(const WINDIVERT_OVERLAP_STORE *store,
+    UINT var, PWINDIVERT_OVERLAP_VALUE value)
+{
+    const WINDIVERT_OVERLAP_VAR *v;
+
+    if (var >= store->num_vars)
+    {
+        return FALSE;
+    }
+    v = &store->vars[var];
+    if (v->empty || WinDivertOverlapCompare(&v->lo, &v->hi) != 0)
+    {
+        return FALSE;
+    }
+    *value = v->lo;
+    return TRUE;
+}
+
+/*
+ * Returns TRUE if a variable cannot have a (small, non-negative) value.
+ */
+static BOOL WinDivertOverlapExcludes(const WINDIVERT_OVERLAP_STORE *store,
+    UINT var, UINT32 value)
+{
+    const WINDIVERT_OVERLAP_VAR *v;
+    WINDIVERT_OVERLAP_VALUE x;
+    UINT i;
+
+    if (var >= store->num_vars)
+    {
+        return FALSE;
+    }
+    v = &store->vars[var];
+    WinDivertOverlapSmall(&x, FALSE, value);
+    if (v->empty || WinDivertOverlapCompare(&x, &v->lo) < 0 ||
+        WinDivertOverlapCompare(&x, &v->hi) > 0)
+    {
+        return TRUE;
+    }
+    for (i = 0; i < store->num_neqs; i++)
+    {
+        if (store->neqs[i].var == var &&
+            WinDivertOverlapCompare(&store->neqs[i].value, &x) == 0)
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/*
+ * Field properties and width in bits.
+ */
+static UINT WinDivertOverlapFieldInfo(UINT32 field, UINT *bits)
+{
+    switch (field)
+    {
+        case WINDIVERT_FILTER_FIELD_ZERO:
+            *bits = 0;
+            return 0;
+        case WINDIVERT_FILTER_FIELD_INBOUND:
+        case WINDIVERT_FILTER_FIELD_OUTBOUND:
+        case WINDIVERT_FILTER_FIELD_FRAGMENT:
+        case WINDIVERT_FILTER_FIELD_LOOPBACK:
+        case WINDIVERT_FILTER_FIELD_IMPOSTOR:
+        case WINDIVERT_FILTER_FIELD_IP:
+        case WINDIVERT_FILTER_FIELD_IPV6:
+        case WINDIVERT_FILTER_FIELD_ICMP:
+        case WINDIVERT_FILTER_FIELD_ICMPV6:
+        case WINDIVERT_FILTER_FIELD_TCP:
+        case WINDIVERT_FILTER_FIELD_UDP:
+        case WINDIVERT_FILTER_FIELD_IP_DF:
+        case WINDIVERT_FILTER_FIELD_IP_MF:
+        case WINDIVERT_FILTER_FIELD_TCP_URG:
+        case WINDIVERT_FILTER_FIELD_TCP_ACK:
+        case WINDIVERT_FILTER_FIELD_TCP_PSH:
+        case WINDIVERT_FILTER_FIELD_TCP_RST:
+        case WINDIVERT_FILTER_FIELD_TCP_SYN:
+        case WINDIVERT_FILTER_FIELD_TCP_FIN:
+        case WINDIVERT_FILTER_FIELD_IPV6_HOPOPTS:
+        case WINDIVERT_FILTER_FIELD_IPV6_ROUTING:
+        case WINDIVERT_FILTER_FIELD_IPV6_FRAGHDR:
+        case WINDIVERT_FILTER_FIELD_IPV6_DSTOPTS:
+        case WINDIVERT_FILTER_FIELD_IPV6_AH:
+        case WINDIVERT_FILTER_FIELD_IPV6_MH:
+            *bits = 1;
+            return 0;
+        case WINDIVERT_FILTER_FIELD_IP_HDRLENGTH:
+        case WINDIVERT_FILTER_FIELD_TCP_HDRLENGTH:
+            *bits = 4;
+            return 0;
+        case WINDIVERT_FILTER_FIELD_IP_TOS:
+        case WINDIVERT_FILTER_FIELD_IP_TTL:
+        case WINDIVERT_FILTER_FIELD_IP_PROTOCOL:
+        case WINDIVERT_FILTER_FIELD_IPV6_TRAFFICCLASS:
+        case WINDIVERT_FILTER_FIELD_IPV6_NEXTHDR:
+        case WINDIVERT_FILTER_FIELD_IPV6_HOPLIMIT:
+        case WINDIVERT_FILTER_FIELD_ICMP_TYPE:
+        case WINDIVERT_FILTER_FIELD_ICMP_CODE:
+        case WINDIVERT_FILTER_FIELD_ICMPV6_TYPE:
+        case WINDIVERT_FILTER_FIELD_ICMPV6_CODE:
+        case WINDIVERT_FILTER_FIELD_PROTOCOL:
+        case WINDIVERT_FILTER_FIELD_RANDOM8:
+            *bits = 8;
+            return 0;
+        case WINDIVERT_FILTER_FIELD_IP_FRAGOFF:
+            *bits = 13;
+            return 0;
+        case WINDIVERT_FILTER_FIELD_IP_LENGTH:
+        case WINDIVERT_FILTER_FIELD_IP_ID:
+        case WINDIVERT_FILTER_FIELD_IP_CHECKSUM:
+        case WINDIVERT_FILTER_FIELD_IPV6_LENGTH:
+        case WINDIVERT_FILTER_FIELD_ICMP_CHECKSUM:
+        case WINDIVERT_FILTER_FIELD_ICMPV6_CHECKSUM:
+        case WINDIVERT_FILTER_FIELD_TCP_SRCPORT:
+        case WINDIVERT_FILTER_FIELD_TCP_DSTPORT:
+        case WINDIVERT_FILTER_FIELD_TCP_WINDOW:
+        case WINDIVERT_FILTER_FIELD_TCP_CHECKSUM:
+        case WINDIVERT_FILTER_FIELD_TCP_URGPTR:
+        case WINDIVERT_FILTER_FIELD_UDP_SRCPORT:
+        case WINDIVERT_FILTER_FIELD_UDP_DSTPORT:
+        case WINDIVERT_FILTER_FIELD_UDP_LENGTH:
+        case WINDIVERT_FILTER_FIELD_UDP_CHECKSUM:
+        case WINDIVERT_FILTER_FIELD_LOCALPORT:
+        case WINDIVERT_FILTER_FIELD_REMOTEPORT:
+        case WINDIVERT_FILTER_FIELD_RANDOM16:
+            *bits = 16;
+            return 0;
+        case WINDIVERT_FILTER_FIELD_IPV6_FLOWLABEL:
+            *bits = 20;
+            return 0;
+        case WINDIVERT_FILTER_FIELD_PACKET:
+        case WINDIVERT_FILTER_FIELD_TCP_PAYLOAD:
+        case WINDIVERT_FILTER_FIELD_UDP_PAYLOAD:
+            *bits = 8;
+            return WINDIVERT_OVERLAP_OPTIONAL;
+        case WINDIVERT_FILTER_FIELD_PACKET16:
+        case WINDIVERT_FILTER_FIELD_TCP_PAYLOAD16:
+        case WINDIVERT_FILTER_FIELD_UDP_PAYLOAD16:
+            *bits = 16;
+            return WINDIVERT_OVERLAP_OPTIONAL;
+        case WINDIVERT_FILTER_FIELD_PACKET32:
+        case WINDIVERT_FILTER_FIELD_TCP_PAYLOAD32:
+        case WINDIVERT_FILTER_FIELD_UDP_PAYLOAD32:
+            *bits = 32;
+            return WINDIVERT_OVERLAP_OPTIONAL;
+        case WINDIVERT_FILTER_FIELD_IPV6_ROUTINGTYPE:
+            *bits = 8;
+            return WINDIVERT_OVERLAP_OPTIONAL;
+        case WINDIVERT_FILTER_FIELD_PRIORITY:
+            *bits = 32;
+            return WINDIVERT_OVERLAP_SIGNED;
+        case WINDIVERT_FILTER_FIELD_TIMESTAMP:
+            *bits = 64;
+            return WINDIVERT_OVERLAP_SIGNED | WINDIVERT_OVERLAP_BIG;
+        case WINDIVERT_FILTER_FIELD_ENDPOINTID:
+        case WINDIVERT_FILTER_FIELD_PARENTENDPOINTID:
+            *bits = 64;
+            return WINDIVERT_OVERLAP_BIG;
+        case WINDIVERT_FILTER_FIELD_IP_SRCADDR:
+        case WINDIVERT_FILTER_FIELD_IP_DSTADDR:
+            *bits = 48;             // ::ffff:a.b.c.d (see below).
+            return WINDIVERT_OVERLAP_BIG;
+        case WINDIVERT_FILTER_FIELD_IPV6_SRCADDR:
+        case WINDIVERT_FILTER_FIELD_IPV6_DSTADDR:
+        case WINDIVERT_FILTER_FIELD_LOCALADDR:
+        case WINDIVERT_FILTER_FIELD_REMOTEADDR:
+            *bits = 128;
+            return WINDIVERT_OVERLAP_BIG;
+        case WINDIVERT_FILTER_FIELD_PROCESSNAME:
+        case WINDIVERT_FILTER_FIELD_PROCESSPATH:
+            *bits = 128;
+            return WINDIVERT_OVERLAP_BIG;
+        case WINDIVERT_OVERLAP_FIELD_PROCESS:
+            *bits = 1;
+            return 0;
+        case WINDIVERT_FILTER_FIELD_EVENT:
+        case WINDIVERT_FILTER_FIELD_LAYER:
+            *bits = 8;              // (Narrowed per layer.)
+            return 0;
+        default:
+            *bits = 32;
+            return 0;
+    }
+}
+
+/*
+ * The header field that a field depends on (0 for none).  The value of a
+ * field is defined iff the header field is 1.
+ */
+static UINT32 WinDivertOverlapFieldHeader(UINT32 field)
+{
+    if (field >= WINDIVERT_FILTER_FIELD_IP_HDRLENGTH &&
+        field <= WINDIVERT_FILTER_FIELD_IP_DSTADDR)
+    {
+        return WINDIVERT_FILTER_FIELD_IP;
+    }
+    if ((field >= WINDIVERT_FILTER_FIELD_IPV6_TRAFFICCLASS &&
+         field <= WINDIVERT_FILTER_FIELD_IPV6_DSTADDR) ||
+        (field >= WINDIVERT_FILTER_FIELD_IPV6_HOPOPTS &&
+         field <= WINDIVERT_FILTER_FIELD_IPV6_EXTHDRLENGTH))
+    {
+        return WINDIVERT_FILTER_FIELD_IPV6;
+    }
+    if (field >= WINDIVERT_FILTER_FIELD_ICMP_TYPE &&
+        field <= WINDIVERT_FILTER_FIELD_ICMP_BODY)
+    {
+        return WINDIVERT_FILTER_FIELD_ICMP;
+    }
+    if (field >= WINDIVERT_FILTER_FIELD_ICMPV6_TYPE &&
+        field <= WINDIVERT_FILTER_FIELD_ICMPV6_BODY)
+    {
+        return WINDIVERT_FILTER_FIELD_ICMPV6;
+    }
+    if ((field >= WINDIVERT_FILTER_FIELD_TCP_SRCPORT &&
+         field <= WINDIVERT_FILTER_FIELD_TCP_PAYLOADLENGTH) ||
+        (field >= WINDIVERT_FILTER_FIELD_TCP_PAYLOAD &&
+         field <= WINDIVERT_FILTER_FIELD_TCP_PAYLOAD32))
+    {
+        return WINDIVERT_FILTER_FIELD_TCP;
+    }
+    if ((field >= WINDIVERT_FILTER_FIELD_UDP_SRCPORT &&
+         field <= WINDIVERT_FILTER_FIELD_UDP_PAYLOADLENGTH) ||
+        (field >= WINDIVERT_FILTER_FIELD_UDP_PAYLOAD &&
+         field <= WINDIVERT_FILTER_FIELD_UDP_PAYLOAD32))
+    {
+        return WINDIVERT_FILTER_FIELD_UDP;
+    }
+    if (field == WINDIVERT_FILTER_FIELD_PROCESSNAME ||
+        field == WINDIVERT_FILTER_FIELD_PROCESSPATH)
+    {
+        return WINDIVERT_OVERLAP_FIELD_PROCESS;
+    }
+    return 0;
+}
+
+/*
+ * The constant of a test, normalized so that it compares (as a big number)
+ * the same way as the field does.
+ */
+static void WinDivertOverlapConst(const WINDIVERT_FILTER *test,
+    PWINDIVERT_OVERLAP_VALUE value)
+{
+    UINT flags, bits;
+
+    flags = WinDivertOverlapFieldInfo(test->field, &bits);
+    value->neg    = (test->neg? TRUE: FALSE);
+    value->mag[0] = test->arg[0];
+    if ((flags & WINDIVERT_OVERLAP_BIG) != 0)
+    {
+        value->mag[1] = test->arg[1];
+        value->mag[2] = test->arg[2];
+        value->mag[3] = test->arg[3];
+    }
+    else
+    {
+        value->mag[1] = value->mag[2] = value->mag[3] = 0;
+    }
+}
+
+/*
+ * Compare two values.  As with WinDivertCompare128(), -0 is a distinct
+ * value between -1 and 0.
+ */
+static int WinDivertOverlapCompare(const WINDIVERT_OVERLAP_VALUE *a,
+    const WINDIVERT_OVERLAP_VALUE *b)
+{
+    return WinDivertCompare128(a->neg, a->mag, b->neg, b->mag, TRUE);
+}
+
+/*
+ * Increment a value.  Returns FALSE on overflow.
+ */
+static BOOL WinDivertOverlapInc(PWINDIVERT_OVERLAP_VALUE value)
+{
+    UINT i;
+
+    if (value->neg)
+    {
+        if ((value->mag[0] | value->mag[1] | value->mag[2] |
+                value->mag[3]) == 0)
+        {
+            value->neg = FALSE;     // -0 + 1 = 0
+            return TRUE;
+        }
+        for (i = 0; value->mag[i]-- == 0; i++)
+            ;
+        return TRUE;
+    }
+    for (i = 0; i < 4 && ++value->mag[i] == 0; i++)
+        ;
+    if (i == 4)
+    {
+        value->mag[3] = value->mag[2] = value->mag[1] = value->mag[0] =
+            0xFFFFFFFF;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * Decrement a value.  Returns FALSE on overflow.
+ */
+static BOOL WinDivertOverlapDec(PWINDIVERT_OVERLAP_VALUE value)
+{
+    UINT i;
+
+    if (!value->neg)
+    {
+        if ((value->mag[0] | value->mag[1] | value->mag[2] |
+                value->mag[3]) == 0)
+        {
+            value->neg = TRUE;      // 0 - 1 = -0
+            return TRUE;
+        }
+        for (i = 0; value->mag[i]-- == 0; i++)
+            ;
+        return TRUE;
+    }
+    for (i = 0; i < 4 && ++value->mag[i] == 0; i++)
+        ;
+    if (i == 4)
+    {
+        value->mag[3] = value->mag[2] = value->mag[1] = value->mag[0] =
+            0xFFFFFFFF;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * Set a small value.
+ */
+static void WinDivertOverlapSmall(PWINDIVERT_OVERLAP_VALUE value, BOOL neg,
+    UINT32 mag)
+{
+    value->neg    = neg;
+    value->mag[0] = mag;
+    value->mag[1] = value->mag[2] = value->mag[3] = 0;
+}
+
@@ -0,0 +1,268 @@
+/*
+ * windivert_pidcache.c
+ * (C) 2019, all rights reserved,
+ *
+ * This file is part of WinDivert.
+ *
+ * WinDivert is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * WinDivert is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Bounded process ID to image path cache for the processName and processPath
+ * filter fields.  This is shared with the driver, but has no OS dependencies
+ * so that it can be tested in isolation.
+ *
+ * The cache is set-associative (WINDIVERT_PIDCACHE_SETS sets of
+ * WINDIVERT_PIDCACHE_WAYS entries, indexed by process ID), and evicts the
+ * least recently used entry of a set when it is full.  Entries are reference
+ * counted, so a path can outlive its cache entry (e.g. a flow that holds the
+ * path until it is deleted).  The caller serializes all cache operations;
+ * WinDivertProcessCreate() and WinDivertProcessRelease() need no lock.
+ *
+ * The includer may override WINDIVERT_PIDCACHE_ALLOC(),
+ * WINDIVERT_PIDCACHE_FREE(), WINDIVERT_PIDCACHE_INCREMENT() and
+ * WINDIVERT_PIDCACHE_DECREMENT().
+ */
+
+#define WINDIVERT_PIDCACHE_SETS             256         // Power of 2.
+#define WINDIVERT_PIDCACHE_WAYS             4
+
+#ifndef WINDIVERT_PIDCACHE_ALLOC
+#define WINDIVERT_PIDCACHE_ALLOC(size)                                      \
+    ExAllocatePoolWithTag(NonPagedPool, (size), WINDIVERT_TAG)
+#endif
+#ifndef WINDIVERT_PIDCACHE_FREE
+#define WINDIVERT_PIDCACHE_FREE(ptr)                                        \
+    ExFreePoolWithTag((ptr), WINDIVERT_TAG)
+#endif
+#ifndef WINDIVERT_PIDCACHE_INCREMENT
+#define WINDIVERT_PIDCACHE_INCREMENT(ptr)                                   \
+    ((UINT32)InterlockedIncrement((volatile LONG *)(ptr)))
+#endif
+#ifndef WINDIVERT_PIDCACHE_DECREMENT
+#define WINDIVERT_PIDCACHE_DECREMENT(ptr)                                   \
+    ((UINT32)InterlockedDecrement((volatile LONG *)(ptr)))
+#endif
+
+/*
+ * A (reference counted) process image path.
+ */
+typedef struct WINDIVERT_PROCESS
+{
+    volatile UINT32 refs;           // Reference count.
+    UINT32 pid;                     // Process ID.
+    UINT32 len;                     // Path length (UTF-16 units).
+    UINT16 path[1];                 // Path (not NUL-terminated).
+} WINDIVERT_PROCESS, *PWINDIVERT_PROCESS;
+
+/*
+ * A cache set.
+ */
+typedef struct
+{
+    PWINDIVERT_PROCESS entries[WINDIVERT_PIDCACHE_WAYS];
+    UINT32 used[WINDIVERT_PIDCACHE_WAYS];   // Last use tick.
+} WINDIVERT_PIDCACHE_SET, *PWINDIVERT_PIDCACHE_SET;
+
+/*
+ * The cache.
+ */
+typedef struct WINDIVERT_PIDCACHE
+{
+    UINT32 tick;                    // Use counter.
+    UINT32 count;                   // Number of entries.
+    UINT64 hits;                    // Lookup hits.
+    UINT64 misses;                  // Lookup misses.
+    UINT64 evictions;               // Entries evicted by Insert().
+    WINDIVERT_PIDCACHE_SET sets[WINDIVERT_PIDCACHE_SETS];
+} WINDIVERT_PIDCACHE, *PWINDIVERT_PIDCACHE;
+
+/*
+ * Release a path reference.
+ */
+static void WinDivertProcessRelease(PWINDIVERT_PROCESS process)
+{
+    if (process != NULL &&
+            WINDIVERT_PIDCACHE_DECREMENT(&process->refs) == 0)
+    {
+        WINDIVERT_PIDCACHE_FREE(process);
+    }
+}
+
+/*
+ * Get the set for a process ID.
+ */
+static PWINDIVERT_PIDCACHE_SET WinDivertPidCacheSet(PWINDIVERT_PIDCACHE cache,
+    UINT32 pid)
+{
+    // Process IDs are multiples of 4.
+    pid = (pid >> 2) * 0x9E3779B1;
+    return cache->sets + (pid >> 24) % WINDIVERT_PIDCACHE_SETS;
+}
+
+/*
+ * Initialize the cache.
+ */
+static void WinDivertPidCacheInit(PWINDIVERT_PIDCACHE cache)
+{
+    memset(cache, 0, sizeof(WINDIVERT_PIDCACHE));
+}
+
+/*
+ * Look up a process ID.  Returns a new reference, or NULL if not found.
+ */
+static PWINDIVERT_PROCESS WinDivertPidCacheLookup(PWINDIVERT_PIDCACHE cache,
+    UINT32 pid)
+{
+    PWINDIVERT_PIDCACHE_SET set = WinDivertPidCacheSet(cache, pid);
+    PWINDIVERT_PROCESS process;
+    UINT i;
+
+    for (i = 0; i < WINDIVERT_PIDCACHE_WAYS; i++)
+    {
+        process = set->entries[i];
+        if (process != NULL && process->pid == pid)
+        {
+            set->used[i] = ++cache->tick;
+            cache->hits++;
+            WINDIVERT_PIDCACHE_INCREMENT(&process->refs);
+            return process;
+        }
+    }
+    cache->misses++;
+    return NULL;
+}
+
+/*
+ * Create a process path.  The path is truncated at the first NUL or at
+ * WINDIVERT_PROCESS_PATH_MAX units.  Returns a new reference, or NULL if out
+ * of memory.
+ */
+static PWINDIVERT_PROCESS WinDivertProcessCreate(UINT32 pid,
+    const UINT16 *path, UINT len)
+{
+    PWINDIVERT_PROCESS process;
+    UINT i;
+
+    for (i = 0; i < len && i < WINDIVERT_PROCESS_PATH_MAX && path[i] != 0;
+            i++)
+        ;
+    len = i;
+    process = (PWINDIVERT_PROCESS)WINDIVERT_PIDCACHE_ALLOC(
+        sizeof(WINDIVERT_PROCESS) + len * sizeof(UINT16));
+    if (process == NULL)
+    {
+        return NULL;
+    }
+    process->refs = 1;
+    process->pid  = pid;
+    process->len  = len;
+    memcpy(process->path, path, len * sizeof(UINT16));
+    return process;
+}
+
+/*
+ * Insert a process path, replacing any existing entry for the same process
+ * ID, else an empty or the least recently used entry of the set.  The cache
+ * takes its own reference.
+ */
+static void WinDivertPidCacheInsert(PWINDIVERT_PIDCACHE cache,
+    PWINDIVERT_PROCESS process)
+{
+    PWINDIVERT_PIDCACHE_SET set = WinDivertPidCacheSet(cache, process->pid);
+    UINT i, j = 0;
+
+    for (i = 0; i < WINDIVERT_PIDCACHE_WAYS; i++)
+    {
+        if (set->entries[i] == NULL)
+        {
+            j = i;
+            continue;
+        }
+        if (set->entries[i]->pid == process->pid)
+        {
+            j = i;
+            break;
+        }
+        if (set->entries[j] != NULL && set->used[i] < set->used[j])
+        {
+            j = i;
+        }
+    }
+    if (set->entries[j] == NULL)
+    {
+        cache->count++;
+    }
+    else if (set->entries[j]->pid != process->pid)
+    {
+        cache->evictions++;
+    }
+    WinDivertProcessRelease(set->entries[j]);
+    WINDIVERT_PIDCACHE_INCREMENT(&process->refs);
+    set->entries[j] = process;
+    set->used[j] = ++cache->tick;
+}
+
+/*
+ * Remove a process ID (e.g. on process exit).
+ */
+static void WinDivertPidCacheRemove(PWINDIVERT_PIDCACHE cache, UINT32 pid)
+{
+    PWINDIVERT_PIDCACHE_SET set = WinDivertPidCacheSet(cache, pid);
+    UINT i;
+
+    for (i = 0; i < WINDIVERT_PIDCACHE_WAYS; i++)
+    {
+        if (set->entries[i] != NULL && set->entries[i]->pid == pid)
+        {
+            WinDivertProcessRelease(set->entries[i]);
+            set->entries[i] = NULL;
+            cache->count--;
+            return;
+        }
+    }
+}
+
+/*
+ * Remove all entries.
+ */
+static void WinDivertPidCacheFlush(PWINDIVERT_PIDCACHE cache)
+{
+    UINT i, j;
+
+    for (i = 0; i < WINDIVERT_PIDCACHE_SETS; i++)
+    {
+        for (j = 0; j < WINDIVERT_PIDCACHE_WAYS; j++)
+        {
+            WinDivertProcessRelease(cache->sets[i].entries[j]);
+            cache->sets[i].entries[j] = NULL;
+        }
+    }
+    cache->count = 0;
+}
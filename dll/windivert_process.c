@@ -0,0 +1,126 @@
+/*
+ * windivert_process.c
+ * (C) 2019, all rights reserved,
+ *
+ * This file is part of WinDivert.
+ *
+ * WinDivert is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * WinDivert is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Process path matching for the processName and processPath filter fields.
+ * This is shared with the driver, but has no OS dependencies so that it can
+ * be tested in isolation.
+ *
+ * Paths are UTF-16 strings (as supplied by the OS) and are compared
+ * case-insensitively (ASCII only), with '/' treated as '\\'.  A filter string
+ * is compiled into a 128-bit constant:
+ *
+ *   arg[0], arg[1]  Two independent 32-bit hashes of the string.
+ *   arg[2]          The string length (in UTF-16 units).
+ *   arg[3]          WINDIVERT_PROCESS_FLAG_* flags.
+ *
+ * At run time the same value is computed over the matching part of the path
+ * (the whole path or name, or only its last arg[2] units for a suffix match),
+ * so that the existing 128-bit (in)equality tests can be reused unchanged.
+ */
+
+#define WINDIVERT_PROCESS_FLAG_SUFFIX       0x00000001
+#define WINDIVERT_PROCESS_PATH_MAX          1024        // UTF-16 units.
+
+/*
+ * Fold a UTF-16 unit.
+ */
+static UINT16 WinDivertProcessFold(UINT16 c)
+{
+    if (c >= 'A' && c <= 'Z')
+    {
+        return c + ('a' - 'A');
+    }
+    return (c == '/'? '\\': c);
+}
+
+/*
+ * Hash a (non-folded) UTF-16 string.
+ */
+static void WinDivertProcessHash(const UINT16 *str, UINT len, UINT32 *val)
+{
+    UINT32 h0 = 0x811C9DC5, h1 = 0x9747B28C, c;
+    UINT i;
+
+    for (i = 0; i < len; i++)
+    {
+        c = (UINT32)WinDivertProcessFold(str[i]);
+        h0 = (h0 ^ c) * 0x01000193;
+        h1 = (h1 + c) * 0x9E3779B1;
+        h1 = (h1 << 13) | (h1 >> 19);
+    }
+    h1 ^= h1 >> 16;
+    h1 *= 0x85EBCA6B;
+    h1 ^= h1 >> 13;
+    val[0] = h0;
+    val[1] = h1;
+}
+
+/*
+ * Compile a filter string.
+ */
+static void WinDivertProcessCompile(const UINT16 *str, UINT len, BOOL suffix,
+    UINT32 *arg)
+{
+    WinDivertProcessHash(str, len, arg);
+    arg[2] = (UINT32)len;
+    arg[3] = (suffix? WINDIVERT_PROCESS_FLAG_SUFFIX: 0);
+}
+
+/*
+ * Compute the value of the processName (name=TRUE) or processPath
+ * (name=FALSE) field against the compiled filter constant arg.
+ */
+static void WinDivertProcessValue(const UINT16 *path, UINT len, BOOL name,
+    const UINT32 *arg, UINT32 *val)
+{
+    UINT i;
+
+    if (name)
+    {
+        for (i = len; i > 0 && WinDivertProcessFold(path[i-1]) != '\\'; i--)
+            ;
+        path += i;
+        len  -= i;
+    }
+    if ((arg[3] & WINDIVERT_PROCESS_FLAG_SUFFIX) != 0 && len > arg[2])
+    {
+        path += len - arg[2];
+        len   = arg[2];
+    }
+    WinDivertProcessHash(path, len, val);
+    val[2] = (UINT32)len;
+    val[3] = (arg[3] & WINDIVERT_PROCESS_FLAG_SUFFIX);
+}
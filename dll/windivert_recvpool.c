@@ -0,0 +1,391 @@
+/*
+ * windivert_recvpool.c
+ * (C) 2019, all rights reserved,
+ *
+ * This file is part of WinDivert.
+ *
+ * WinDivert is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * WinDivert is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Completion-callback receive.  A pool of worker threads keeps a fixed
+ * number of overlapped WinDivertRecvEx() reads in flight using an I/O
+ * completion port, and passes each completed batch to the caller's callback.
+ * Buffers are recycled once the callback returns.  The scheduling decisions
+ * are made by windivert_recvsched.c.
+ */
+
+#include "windivert_recvsched.c"
+
+#define WINDIVERT_RECV_POOL_CANCEL_WAIT     100         // ms
+
+/*
+ * Pool buffer.
+ */
+typedef struct
+{
+    OVERLAPPED overlapped;          // Read's overlapped.
+    WINDIVERT_RECV_BUFFER buffer;   // Scheduler's buffer.
+} WINDIVERT_RECV_POOL_BUFFER, *PWINDIVERT_RECV_POOL_BUFFER;
+
+/*
+ * Receive pool.
+ */
+struct WINDIVERT_RECV_POOL
+{
+    HANDLE handle;                  // WinDivert handle.
+    HANDLE pool;                    // Private heap.
+    HANDLE port;                    // I/O completion port.
+    HANDLE done;                    // Set once the pool has stopped.
+    WINDIVERT_RECV_CALLBACK callback;
+    PVOID context;
+    CRITICAL_SECTION lock;
+    WINDIVERT_RECV_SCHED sched;
+    UINT num_buffers;
+    PWINDIVERT_RECV_POOL_BUFFER buffers;
+    UINT num_threads;
+    HANDLE threads[WINDIVERT_RECV_POOL_THREADS_MAX];
+};
+
+/*
+ * Prototypes.
+ */
+static void WinDivertRecvPoolIssue(PWINDIVERT_RECV_POOL pool);
+static DWORD WINAPI WinDivertRecvPoolWorker(LPVOID arg);
+
+/*
+ * Create a receive pool.
+ */
+PWINDIVERT_RECV_POOL WinDivertRecvPoolCreate(HANDLE handle, UINT reads,
+    UINT threads, UINT packetLen, UINT batch, UINT64 flags,
+    WINDIVERT_RECV_CALLBACK callback, PVOID context)
+{
+    HANDLE heap;
+    PWINDIVERT_RECV_POOL pool;
+    PWINDIVERT_RECV_BUFFER buffer;
+    DWORD error;
+    UINT i;
+
+    if (handle == INVALID_HANDLE_VALUE || callback == NULL || reads == 0 ||
+        reads > WINDIVERT_RECV_POOL_READS_MAX || threads == 0 ||
+        threads > WINDIVERT_RECV_POOL_THREADS_MAX || packetLen == 0 ||
+        batch == 0 || batch > WINDIVERT_BATCH_MAX || flags != 0)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return NULL;
+    }
+
+    heap = HeapCreate(0, WINDIVERT_MIN_POOL_SIZE, 0);
+    if (heap == NULL)
+    {
+        return NULL;
+    }
+    pool = (PWINDIVERT_RECV_POOL)HeapAlloc(heap, HEAP_ZERO_MEMORY,
+        sizeof(struct WINDIVERT_RECV_POOL));
+    if (pool == NULL)
+    {
+        HeapDestroy(heap);
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+    pool->handle   = handle;
+    pool->pool     = heap;
+    pool->callback = callback;
+    pool->context  = context;
+    InitializeCriticalSection(&pool->lock);
+    WinDivertRecvSchedInit(&pool->sched, reads);
+
+    // Every thread may hold a buffer in the callback while `reads' reads
+    // are in flight:
+    pool->num_buffers = reads + threads;
+    pool->buffers = (PWINDIVERT_RECV_POOL_BUFFER)HeapAlloc(heap,
+        HEAP_ZERO_MEMORY,
+        pool->num_buffers * sizeof(WINDIVERT_RECV_POOL_BUFFER));
+    if (pool->buffers == NULL)
+    {
+        error = ERROR_NOT_ENOUGH_MEMORY;
+        goto WinDivertRecvPoolCreateError;
+    }
+    for (i = 0; i < pool->num_buffers; i++)
+    {
+        buffer = &pool->buffers[i].buffer;
+        buffer->packet = (UINT8 *)HeapAlloc(heap, 0, packetLen);
+        buffer->addr = (WINDIVERT_ADDRESS *)HeapAlloc(heap, 0,
+            batch * sizeof(WINDIVERT_ADDRESS));
+        if (buffer->packet == NULL || buffer->addr == NULL)
+        {
+            error = ERROR_NOT_ENOUGH_MEMORY;
+            goto WinDivertRecvPoolCreateError;
+        }
+        buffer->packet_size = packetLen;
+        buffer->addr_size   = batch * sizeof(WINDIVERT_ADDRESS);
+        WinDivertRecvSchedPut(&pool->sched, buffer);
+    }
+
+    pool->done = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (pool->done == NULL)
+    {
+        error = GetLastError();
+        goto WinDivertRecvPoolCreateError;
+    }
+    pool->port = CreateIoCompletionPort(handle, NULL, (ULONG_PTR)pool,
+        threads);
+    if (pool->port == NULL)
+    {
+        error = GetLastError();
+        goto WinDivertRecvPoolCreateError;
+    }
+    for (i = 0; i < threads; i++)
+    {
+        pool->threads[i] = CreateThread(NULL, 0, WinDivertRecvPoolWorker,
+            (LPVOID)pool, 0, NULL);
+        if (pool->threads[i] == NULL)
+        {
+            error = GetLastError();
+            goto WinDivertRecvPoolCreateError;
+        }
+        pool->num_threads++;
+    }
+
+    WinDivertRecvPoolIssue(pool);
+    return pool;
+
+WinDivertRecvPoolCreateError:
+    WinDivertRecvPoolFree(pool);
+    SetLastError(error);
+    return NULL;
+}
+
+/*
+ * Wait for the pool to stop.
+ */
+BOOL WinDivertRecvPoolWait(PWINDIVERT_RECV_POOL pool, UINT32 timeout)
+{
+    UINT32 error;
+
+    if (pool == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    switch (WaitForSingleObject(pool->done, (DWORD)timeout))
+    {
+        case WAIT_OBJECT_0:
+            break;
+        case WAIT_TIMEOUT:
+            SetLastError(WAIT_TIMEOUT);
+            return FALSE;
+        default:
+            return FALSE;
+    }
+    EnterCriticalSection(&pool->lock);
+    error = pool->sched.error;
+    LeaveCriticalSection(&pool->lock);
+    if (error != ERROR_NO_DATA)
+    {
+        SetLastError((DWORD)error);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * Stop and free a receive pool.
+ */
+void WinDivertRecvPoolFree(PWINDIVERT_RECV_POOL pool)
+{
+    PWINDIVERT_RECV_BUFFER buffer;
+    BOOL done;
+    UINT i;
+
+    if (pool == NULL)
+    {
+        return;
+    }
+
+    // Stop issuing reads, and cancel the pending ones.  A read may be
+    // selected but not yet issued, so cancellation is retried until the
+    // pool is idle.
+    EnterCriticalSection(&pool->lock);
+    WinDivertRecvSchedStop(&pool->sched, ERROR_OPERATION_ABORTED);
+    done = WinDivertRecvSchedDone(&pool->sched);
+    LeaveCriticalSection(&pool->lock);
+    if (done && pool->done != NULL)
+    {
+        SetEvent(pool->done);
+    }
+    while (pool->done != NULL && WaitForSingleObject(pool->done,
+            WINDIVERT_RECV_POOL_CANCEL_WAIT) == WAIT_TIMEOUT)
+    {
+        EnterCriticalSection(&pool->lock);
+        for (i = 0; i < pool->num_buffers; i++)
+        {
+            buffer = &pool->buffers[i].buffer;
+            if (buffer->pending)
+            {
+                CancelIoEx(pool->handle, &pool->buffers[i].overlapped);
+            }
+        }
+        LeaveCriticalSection(&pool->lock);
+    }
+
+    for (i = 0; i < pool->num_threads; i++)
+    {
+        PostQueuedCompletionStatus(pool->port, 0, 0, NULL);
+    }
+    if (pool->num_threads != 0)
+    {
+        WaitForMultipleObjects(pool->num_threads, pool->threads, TRUE,
+            INFINITE);
+    }
+    for (i = 0; i < pool->num_threads; i++)
+    {
+        CloseHandle(pool->threads[i]);
+    }
+    if (pool->port != NULL)
+    {
+        CloseHandle(pool->port);
+    }
+    if (pool->done != NULL)
+    {
+        CloseHandle(pool->done);
+    }
+    DeleteCriticalSection(&pool->lock);
+    HeapDestroy(pool->pool);
+}
+
+/*
+ * Issue reads until the scheduler's target is reached.
+ */
+static void WinDivertRecvPoolIssue(PWINDIVERT_RECV_POOL pool)
+{
+    PWINDIVERT_RECV_BUFFER buffers[WINDIVERT_RECV_POOL_READS_MAX], buffer;
+    PWINDIVERT_RECV_POOL_BUFFER entry;
+    UINT count = 0, i;
+    DWORD error;
+    BOOL done = FALSE;
+
+    EnterCriticalSection(&pool->lock);
+    while (count < WINDIVERT_RECV_POOL_READS_MAX &&
+        (buffer = WinDivertRecvSchedIssue(&pool->sched)) != NULL)
+    {
+        buffers[count++] = buffer;
+    }
+    LeaveCriticalSection(&pool->lock);
+
+    // A read that completes immediately still queues a completion packet.
+    for (i = 0; i < count; i++)
+    {
+        buffer = buffers[i];
+        entry = CONTAINING_RECORD(buffer, WINDIVERT_RECV_POOL_BUFFER, buffer);
+        memset(&entry->overlapped, 0, sizeof(entry->overlapped));
+        if (WinDivertRecvEx(pool->handle, buffer->packet,
+                buffer->packet_size, NULL, 0, buffer->addr, &buffer->addr_len,
+                &entry->overlapped) ||
+            (error = GetLastError()) == ERROR_IO_PENDING)
+        {
+            continue;
+        }
+        EnterCriticalSection(&pool->lock);
+        (VOID)WinDivertRecvSchedComplete(&pool->sched, buffer, error);
+        done = WinDivertRecvSchedDone(&pool->sched);
+        LeaveCriticalSection(&pool->lock);
+    }
+    if (done)
+    {
+        SetEvent(pool->done);
+    }
+}
+
+/*
+ * Worker thread.
+ */
+static DWORD WINAPI WinDivertRecvPoolWorker(LPVOID arg)
+{
+    PWINDIVERT_RECV_POOL pool = (PWINDIVERT_RECV_POOL)arg;
+    PWINDIVERT_RECV_POOL_BUFFER entry;
+    PWINDIVERT_RECV_BUFFER buffer;
+    LPOVERLAPPED overlapped;
+    ULONG_PTR key;
+    DWORD len, error;
+    BOOL dispatch, done;
+
+    while (TRUE)
+    {
+        overlapped = NULL;
+        error = 0;
+        if (!GetQueuedCompletionStatus(pool->port, &len, &key, &overlapped,
+                INFINITE))
+        {
+            error = GetLastError();
+        }
+        if (overlapped == NULL)
+        {
+            return 0;
+        }
+
+        // Ignore other overlapped I/O on the same handle:
+        entry = (PWINDIVERT_RECV_POOL_BUFFER)overlapped;
+        if (entry < pool->buffers || entry >= pool->buffers + pool->num_buffers)
+        {
+            continue;
+        }
+        buffer = &entry->buffer;
+        buffer->recv_len = (UINT)len;
+
+        EnterCriticalSection(&pool->lock);
+        dispatch = WinDivertRecvSchedComplete(&pool->sched, buffer,
+            (UINT32)error);
+        done = WinDivertRecvSchedDone(&pool->sched);
+        LeaveCriticalSection(&pool->lock);
+        if (!dispatch)
+        {
+            if (done)
+            {
+                SetEvent(pool->done);
+            }
+            continue;
+        }
+
+        // Refill before the callback so the reads in flight stay constant:
+        WinDivertRecvPoolIssue(pool);
+        pool->callback(pool->context, buffer->packet, buffer->recv_len,
+            buffer->addr, buffer->addr_len / sizeof(WINDIVERT_ADDRESS));
+
+        EnterCriticalSection(&pool->lock);
+        WinDivertRecvSchedRelease(&pool->sched, buffer);
+        done = WinDivertRecvSchedDone(&pool->sched);
+        LeaveCriticalSection(&pool->lock);
+        if (done)
+        {
+            SetEvent(pool->done);
+        }
+        WinDivertRecvPoolIssue(pool);
+    }
+}
@@ -0,0 +1,193 @@
+/*
+ * windivert_recvsched.c
+ * (C) 2019, all rights reserved,
+ *
+ * This file is part of WinDivert.
+ *
+ * WinDivert is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * WinDivert is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Scheduling core for WinDivertRecvPool*.  This has no OS dependencies so
+ * that it can be driven by the user-mode simulator (test/sim.c).  The
+ * caller supplies the I/O (e.g. overlapped WinDivertRecvEx() and an I/O
+ * completion port) and serializes all calls with a lock.
+ *
+ * The pool owns more buffers than outstanding reads (reads + threads).  When
+ * a read completes, a free buffer is used to immediately re-issue a read
+ * before the completed buffer is passed to the callback, so the number of
+ * reads in flight stays constant even when every thread is busy in the
+ * callback.  The buffer is recycled once the callback returns.
+ *
+ * The first read error stops the pool: no new reads are issued, and the pool
+ * is done once every pending read has completed and every callback has
+ * returned.
+ */
+
+#define WINDIVERT_RECV_POOL_READS_MAX       64
+#define WINDIVERT_RECV_POOL_THREADS_MAX     64
+
+/*
+ * A receive buffer.  The packet and address storage are supplied by the
+ * caller.
+ */
+typedef struct WINDIVERT_RECV_BUFFER
+{
+    struct WINDIVERT_RECV_BUFFER *next; // Next free buffer.
+    UINT8 *packet;                      // Packet storage.
+    UINT packet_size;                   // Packet storage size.
+    WINDIVERT_ADDRESS *addr;            // Address storage.
+    UINT addr_size;                     // Address storage size (in bytes).
+    UINT recv_len;                      // Received packet length.
+    UINT addr_len;                      // Received address length.
+    BOOL pending;                       // Read in flight?
+} WINDIVERT_RECV_BUFFER, *PWINDIVERT_RECV_BUFFER;
+
+/*
+ * Scheduler state.
+ */
+typedef struct
+{
+    PWINDIVERT_RECV_BUFFER free;        // Free buffers.
+    UINT reads;                         // Target reads in flight.
+    UINT pending;                       // Reads in flight.
+    UINT busy;                          // Buffers held by callbacks.
+    BOOL stopping;                      // Stop issuing reads?
+    UINT32 error;                       // First read error.
+    UINT64 completions;                 // Reads completed.
+    UINT64 packets;                     // Packets dispatched.
+    UINT64 starved;                     // Re-issues without a free buffer.
+} WINDIVERT_RECV_SCHED, *PWINDIVERT_RECV_SCHED;
+
+/*
+ * Initialize the scheduler.
+ */
+static void WinDivertRecvSchedInit(PWINDIVERT_RECV_SCHED sched, UINT reads)
+{
+    sched->free        = NULL;
+    sched->reads       = reads;
+    sched->pending     = 0;
+    sched->busy        = 0;
+    sched->stopping    = FALSE;
+    sched->error       = 0;
+    sched->completions = 0;
+    sched->packets     = 0;
+    sched->starved     = 0;
+}
+
+/*
+ * Return a buffer to the free list.
+ */
+static void WinDivertRecvSchedPut(PWINDIVERT_RECV_SCHED sched,
+    PWINDIVERT_RECV_BUFFER buffer)
+{
+    buffer->pending = FALSE;
+    buffer->next    = sched->free;
+    sched->free     = buffer;
+}
+
+/*
+ * Select a buffer for a new read, or NULL if no read should be issued.  The
+ * caller issues reads until this returns NULL.
+ */
+static PWINDIVERT_RECV_BUFFER WinDivertRecvSchedIssue(
+    PWINDIVERT_RECV_SCHED sched)
+{
+    PWINDIVERT_RECV_BUFFER buffer;
+
+    if (sched->stopping || sched->pending >= sched->reads)
+    {
+        return NULL;
+    }
+    buffer = sched->free;
+    if (buffer == NULL)
+    {
+        sched->starved++;
+        return NULL;
+    }
+    sched->free      = buffer->next;
+    buffer->next     = NULL;
+    buffer->pending  = TRUE;
+    buffer->recv_len = 0;
+    buffer->addr_len = buffer->addr_size;
+    sched->pending++;
+    return buffer;
+}
+
+/*
+ * Stop issuing reads.  Records the error if it is the first.
+ */
+static void WinDivertRecvSchedStop(PWINDIVERT_RECV_SCHED sched, UINT32 error)
+{
+    if (sched->error == 0)
+    {
+        sched->error = error;
+    }
+    sched->stopping = TRUE;
+}
+
+/*
+ * A read completed (error is zero on success).  Returns TRUE if the buffer
+ * should be passed to the callback, in which case the caller must return it
+ * with WinDivertRecvSchedRelease().  Otherwise the buffer has been freed.
+ */
+static BOOL WinDivertRecvSchedComplete(PWINDIVERT_RECV_SCHED sched,
+    PWINDIVERT_RECV_BUFFER buffer, UINT32 error)
+{
+    sched->pending--;
+    sched->completions++;
+    if (error != 0)
+    {
+        WinDivertRecvSchedStop(sched, error);
+        WinDivertRecvSchedPut(sched, buffer);
+        return FALSE;
+    }
+    buffer->pending = FALSE;
+    sched->busy++;
+    sched->packets += buffer->addr_len / sizeof(WINDIVERT_ADDRESS);
+    return TRUE;
+}
+
+/*
+ * The callback has returned, so the buffer can be recycled.
+ */
+static void WinDivertRecvSchedRelease(PWINDIVERT_RECV_SCHED sched,
+    PWINDIVERT_RECV_BUFFER buffer)
+{
+    sched->busy--;
+    WinDivertRecvSchedPut(sched, buffer);
+}
+
+/*
+ * Returns TRUE if the pool has stopped and is idle.
+ */
+static BOOL WinDivertRecvSchedDone(const WINDIVERT_RECV_SCHED *sched)
+{
+    return (sched->stopping && sched->pending == 0 && sched->busy == 0);
+}
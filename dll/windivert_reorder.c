@@ -0,0 +1,457 @@
+/*
+ * windivert_reorder.c
+ * (C) 2021, all rights reserved,
+ *
+ * This file is part of WinDivert.
+ *
+ * WinDivert is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * WinDivert is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Ordering core for WinDivertSequencer*.  This has no OS dependencies so
+ * that it can be driven by the user-mode simulator (test/sim.c).  The
+ * caller supplies the clock, the packet copies and the sends (through the
+ * callbacks), and serializes all calls with a lock.
+ *
+ * Tracked packets live in a ring of slots indexed by sequence number.  Held
+ * packets are also linked into a list in the order they were held, so the
+ * oldest held packet (and hence the next timeout) is always at the head, and
+ * packets held by the current call (which still point to the caller's
+ * buffer) are always at the tail.  Releasing packets scans the window from
+ * the oldest tracked sequence, but stops at the first gap or unforced
+ * pending packet (global order), or once every held packet has been
+ * visited, so a call only touches the slots that can make progress.
+ *
+ * Tracking starts from the driver's next sequence number when the state is
+ * initialized, not from the first tracked packet, since another reader may
+ * already have received an earlier packet without having tracked it yet.
+ * Packets are sent out of order only if they are released early (by the
+ * timeout, or because the window is full), or if they are completed after
+ * their sequence number was retired (late); each case is counted.
+ */
+
+#define WINDIVERT_REORDER_SIZE          16384   // Max tracked packets.
+#define WINDIVERT_REORDER_MASK          (WINDIVERT_REORDER_SIZE - 1)
+#define WINDIVERT_REORDER_NIL           0xFFFF  // No slot.
+
+#define WINDIVERT_REORDER_STATE_FREE    0       // Slot unused.
+#define WINDIVERT_REORDER_STATE_PENDING 1       // Received, not yet sent.
+#define WINDIVERT_REORDER_STATE_HELD    2       // Sent, waiting for order.
+#define WINDIVERT_REORDER_STATE_DONE    3       // Sent/discarded.
+
+#define WINDIVERT_REORDER_BLOCKED_BITS  256     // Blocked flow bitmap size.
+
+/*
+ * Sequence number comparison.
+ */
+#define WINDIVERT_REORDER_BEFORE(a, b)  ((INT32)((a) - (b)) < 0)
+
+/*
+ * Send a packet.  If `owned' is set the packet is a copy returned by the
+ * copy callback, and is no longer referenced once this returns.
+ */
+typedef BOOL (*WINDIVERT_REORDER_EMIT)(PVOID context, const VOID *packet,
+    UINT packet_len, const WINDIVERT_ADDRESS *addr, BOOL owned);
+
+/*
+ * Copy a held packet out of the caller's buffer (or NULL on failure).
+ */
+typedef UINT8 *(*WINDIVERT_REORDER_COPY)(PVOID context, const VOID *packet,
+    UINT packet_len);
+
+/*
+ * Reorder slot.
+ */
+typedef struct
+{
+    UINT32 sequence;                    // Packet sequence number.
+    UINT8 state;                        // WINDIVERT_REORDER_STATE_*
+    UINT8 owned;                        // Packet is a private copy?
+    UINT16 prev;                        // Hold list links.
+    UINT16 next;
+    UINT16 reserved;
+    UINT32 flow;                        // Flow hash.
+    UINT32 timestamp;                   // Time held (ms).
+    UINT packet_len;
+    UINT8 *packet;                      // Held packet.
+    WINDIVERT_ADDRESS addr;             // Held packet's address.
+} WINDIVERT_REORDER_SLOT, *PWINDIVERT_REORDER_SLOT;
+
+/*
+ * Reorder state.
+ */
+typedef struct
+{
+    BOOL flow;                          // Order per flow?
+    UINT32 timeout;                     // Max hold time (ms).
+    UINT32 next;                        // Oldest unretired sequence.
+    UINT32 end;                         // Newest tracked sequence + 1.
+    UINT held;                          // Held packets.
+    UINT16 head;                        // Oldest held packet.
+    UINT16 tail;                        // Newest held packet.
+    WINDIVERT_REORDER_EMIT emit;
+    WINDIVERT_REORDER_COPY copy;
+    PVOID context;                      // Callback context.
+    UINT64 scanned;                     // Slots visited by releases.
+    UINT64 expired;                     // Packets released by timeout.
+    UINT64 overflow;                    // Packets released by a full window.
+    UINT64 late;                        // Packets sent after retirement.
+    WINDIVERT_REORDER_SLOT slots[WINDIVERT_REORDER_SIZE];
+} WINDIVERT_REORDER, *PWINDIVERT_REORDER;
+
+/*
+ * Prototypes.
+ */
+static BOOL WinDivertReorderRelease(PWINDIVERT_REORDER reorder, UINT32 limit,
+    UINT32 now, BOOL force);
+
+/*
+ * Initialize the reorder state.  The slots must be zeroed.  The `sequence'
+ * is the sequence number of the next packet the driver will queue.
+ */
+static void WinDivertReorderInit(PWINDIVERT_REORDER reorder, BOOL flow,
+    UINT32 timeout, UINT32 sequence, WINDIVERT_REORDER_EMIT emit,
+    WINDIVERT_REORDER_COPY copy, PVOID context)
+{
+    reorder->flow    = flow;
+    reorder->timeout = timeout;
+    reorder->next    = sequence;
+    reorder->end     = sequence;
+    reorder->held    = 0;
+    reorder->head    = WINDIVERT_REORDER_NIL;
+    reorder->tail    = WINDIVERT_REORDER_NIL;
+    reorder->emit    = emit;
+    reorder->copy    = copy;
+    reorder->context = context;
+    reorder->scanned  = 0;
+    reorder->expired  = 0;
+    reorder->overflow = 0;
+    reorder->late     = 0;
+}
+
+/*
+ * Find the slot for a tracked sequence number (or NULL).
+ */
+static PWINDIVERT_REORDER_SLOT WinDivertReorderLookup(
+    PWINDIVERT_REORDER reorder, UINT32 sequence)
+{
+    PWINDIVERT_REORDER_SLOT slot;
+
+    if (WINDIVERT_REORDER_BEFORE(sequence, reorder->next) ||
+        !WINDIVERT_REORDER_BEFORE(sequence, reorder->end))
+    {
+        return NULL;
+    }
+    slot = &reorder->slots[sequence & WINDIVERT_REORDER_MASK];
+    if (slot->state == WINDIVERT_REORDER_STATE_FREE ||
+        slot->sequence != sequence)
+    {
+        return NULL;
+    }
+    return slot;
+}
+
+/*
+ * Append a slot to the hold list.
+ */
+static void WinDivertReorderLink(PWINDIVERT_REORDER reorder,
+    PWINDIVERT_REORDER_SLOT slot)
+{
+    UINT16 idx = (UINT16)(slot->sequence & WINDIVERT_REORDER_MASK);
+
+    slot->prev = reorder->tail;
+    slot->next = WINDIVERT_REORDER_NIL;
+    if (reorder->tail == WINDIVERT_REORDER_NIL)
+    {
+        reorder->head = idx;
+    }
+    else
+    {
+        reorder->slots[reorder->tail].next = idx;
+    }
+    reorder->tail = idx;
+    reorder->held++;
+}
+
+/*
+ * Remove a slot from the hold list.
+ */
+static void WinDivertReorderUnlink(PWINDIVERT_REORDER reorder,
+    PWINDIVERT_REORDER_SLOT slot)
+{
+    if (slot->prev == WINDIVERT_REORDER_NIL)
+    {
+        reorder->head = slot->next;
+    }
+    else
+    {
+        reorder->slots[slot->prev].next = slot->next;
+    }
+    if (slot->next == WINDIVERT_REORDER_NIL)
+    {
+        reorder->tail = slot->prev;
+    }
+    else
+    {
+        reorder->slots[slot->next].prev = slot->prev;
+    }
+    reorder->held--;
+}
+
+/*
+ * Send a held packet and mark it done.
+ */
+static BOOL WinDivertReorderSend(PWINDIVERT_REORDER reorder,
+    PWINDIVERT_REORDER_SLOT slot)
+{
+    BOOL result;
+
+    WinDivertReorderUnlink(reorder, slot);
+    result = reorder->emit(reorder->context, slot->packet, slot->packet_len,
+        &slot->addr, slot->owned);
+    slot->packet = NULL;
+    slot->owned  = FALSE;
+    slot->state  = WINDIVERT_REORDER_STATE_DONE;
+    return result;
+}
+
+/*
+ * Returns TRUE if the oldest held packet has expired.
+ */
+static BOOL WinDivertReorderExpired(const WINDIVERT_REORDER *reorder,
+    UINT32 now)
+{
+    return (reorder->head != WINDIVERT_REORDER_NIL &&
+        now - reorder->slots[reorder->head].timestamp >= reorder->timeout);
+}
+
+/*
+ * Track a received packet.
+ */
+static BOOL WinDivertReorderTrack(PWINDIVERT_REORDER reorder,
+    UINT32 sequence, UINT32 flow, UINT32 now)
+{
+    PWINDIVERT_REORDER_SLOT slot;
+    BOOL result = TRUE;
+
+    if (WINDIVERT_REORDER_BEFORE(sequence, reorder->next))
+    {
+        return TRUE;                    // Too late; will be sent unordered.
+    }
+    if (sequence - reorder->next >= WINDIVERT_REORDER_SIZE)
+    {
+        // Window is full; force out the oldest packets.
+        result = WinDivertReorderRelease(reorder,
+            sequence - WINDIVERT_REORDER_SIZE + 1, now, FALSE);
+    }
+    if (!WINDIVERT_REORDER_BEFORE(sequence, reorder->end))
+    {
+        reorder->end = sequence + 1;
+    }
+    slot = &reorder->slots[sequence & WINDIVERT_REORDER_MASK];
+    slot->sequence = sequence;
+    slot->state    = WINDIVERT_REORDER_STATE_PENDING;
+    slot->flow     = flow;
+    slot->owned    = FALSE;
+    slot->packet   = NULL;
+    return result;
+}
+
+/*
+ * Complete a packet (send or discard if `packet' is NULL).  Untracked
+ * packets are sent immediately.  Held packets point to the caller's buffer
+ * until WinDivertReorderHold() is called.
+ */
+static BOOL WinDivertReorderComplete(PWINDIVERT_REORDER reorder,
+    const VOID *packet, UINT packet_len, const WINDIVERT_ADDRESS *addr,
+    UINT32 now)
+{
+    PWINDIVERT_REORDER_SLOT slot;
+
+    slot = WinDivertReorderLookup(reorder, addr->Sequence);
+    if (slot == NULL || slot->state != WINDIVERT_REORDER_STATE_PENDING)
+    {
+        if (packet == NULL)
+        {
+            return TRUE;
+        }
+        reorder->late++;
+        return reorder->emit(reorder->context, packet, packet_len, addr,
+            FALSE);
+    }
+    if (packet == NULL)
+    {
+        slot->state = WINDIVERT_REORDER_STATE_DONE;
+        return TRUE;
+    }
+    slot->state      = WINDIVERT_REORDER_STATE_HELD;
+    slot->packet     = (UINT8 *)packet;
+    slot->packet_len = packet_len;
+    slot->timestamp  = now;
+    slot->addr       = *addr;
+    WinDivertReorderLink(reorder, slot);
+    return TRUE;
+}
+
+/*
+ * Release held packets that are in order, or that have expired (all held
+ * packets if `force' is set).  Everything before `limit' is also forced
+ * (counted as overflow).
+ */
+static BOOL WinDivertReorderRelease(PWINDIVERT_REORDER reorder, UINT32 limit,
+    UINT32 now, BOOL force)
+{
+    PWINDIVERT_REORDER_SLOT slot;
+    UINT32 blocked[WINDIVERT_REORDER_BLOCKED_BITS / 32], sequence, bit;
+    UINT32 window = limit;
+    UINT16 idx;
+    UINT remaining;
+    BOOL gap = FALSE, result = TRUE, forced, tracked;
+
+    // (1) Everything up to the newest expired packet is forced.  Held
+    //     packets expire in hold order, so only the expired ones are
+    //     visited:
+    for (idx = reorder->head; idx != WINDIVERT_REORDER_NIL; idx = slot->next)
+    {
+        slot = &reorder->slots[idx];
+        if (!force && now - slot->timestamp < reorder->timeout)
+        {
+            break;
+        }
+        if (!WINDIVERT_REORDER_BEFORE(slot->sequence, limit))
+        {
+            limit = slot->sequence + 1;
+        }
+        reorder->expired +=
+            (force || WINDIVERT_REORDER_BEFORE(slot->sequence, window)? 0: 1);
+    }
+
+    // (2) Send in-order packets.  Past the forced prefix, stop at the first
+    //     gap, or once every held packet has been visited:
+    memset(blocked, 0, sizeof(blocked));
+    remaining = reorder->held;
+    for (sequence = reorder->next; sequence != reorder->end; sequence++)
+    {
+        forced = WINDIVERT_REORDER_BEFORE(sequence, limit);
+        if (!forced && (gap || remaining == 0))
+        {
+            break;
+        }
+        reorder->scanned++;
+        slot = &reorder->slots[sequence & WINDIVERT_REORDER_MASK];
+        if (slot->sequence != sequence ||
+            slot->state == WINDIVERT_REORDER_STATE_FREE)
+        {
+            gap = gap || !forced;
+            continue;
+        }
+        bit = slot->flow % WINDIVERT_REORDER_BLOCKED_BITS;
+        if (!force && WINDIVERT_REORDER_BEFORE(sequence, window) &&
+            slot->state != WINDIVERT_REORDER_STATE_DONE)
+        {
+            reorder->overflow++;
+        }
+        switch (slot->state)
+        {
+            case WINDIVERT_REORDER_STATE_PENDING:
+                if (!forced)
+                {
+                    gap = gap || !reorder->flow;
+                    blocked[bit / 32] |= ((UINT32)1 << (bit % 32));
+                }
+                break;
+            case WINDIVERT_REORDER_STATE_HELD:
+                remaining--;
+                if (forced || (!gap &&
+                        (blocked[bit / 32] & ((UINT32)1 << (bit % 32))) == 0))
+                {
+                    result = WinDivertReorderSend(reorder, slot) && result;
+                }
+                else
+                {
+                    blocked[bit / 32] |= ((UINT32)1 << (bit % 32));
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    // (3) Retire the completed (or forced) prefix:
+    // Forced pending packets become untracked, and will be sent unordered.
+    while (reorder->next != reorder->end)
+    {
+        slot = &reorder->slots[reorder->next & WINDIVERT_REORDER_MASK];
+        tracked = (slot->sequence == reorder->next &&
+            slot->state != WINDIVERT_REORDER_STATE_FREE);
+        if (!WINDIVERT_REORDER_BEFORE(reorder->next, limit) &&
+            (!tracked || slot->state != WINDIVERT_REORDER_STATE_DONE))
+        {
+            break;
+        }
+        if (tracked)
+        {
+            slot->state = WINDIVERT_REORDER_STATE_FREE;
+        }
+        reorder->next++;
+    }
+    return result;
+}
+
+/*
+ * Copy the packets held by this call out of the caller's buffer.  They are
+ * the tail of the hold list.  A packet that cannot be copied is sent out of
+ * order instead.
+ */
+static BOOL WinDivertReorderHold(PWINDIVERT_REORDER reorder)
+{
+    PWINDIVERT_REORDER_SLOT slot;
+    UINT16 idx, prev;
+    UINT8 *copy;
+    BOOL result = TRUE;
+
+    for (idx = reorder->tail; idx != WINDIVERT_REORDER_NIL; idx = prev)
+    {
+        slot = &reorder->slots[idx];
+        prev = slot->prev;
+        if (slot->owned)
+        {
+            break;
+        }
+        copy = reorder->copy(reorder->context, slot->packet,
+            slot->packet_len);
+        if (copy == NULL)
+        {
+            result = WinDivertReorderSend(reorder, slot) && result;
+            continue;
+        }
+        slot->packet = copy;
+        slot->owned  = TRUE;
+    }
+    return result;
+}
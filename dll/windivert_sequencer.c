@@ -0,0 +1,482 @@
+/*
+ * windivert_sequencer.c
+ * (C) 2021, all rights reserved,
+ *
+ * This file is part of WinDivert.
+ *
+ * WinDivert is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * WinDivert is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Ordered send.  Every packet received through the sequencer is tracked by
+ * its WINDIVERT_ADDRESS.Sequence number.  Packets passed to
+ * WinDivertSequencerSendEx() are held until every earlier packet (of the
+ * same flow, in flow mode) has been sent or discarded, or until the oldest
+ * held packet has waited longer than the timeout.  Sequence numbers that
+ * were never received (e.g. dropped by the driver) are treated as gaps, and
+ * are only skipped by the timeout.  Tracking starts from the driver's next
+ * sequence number (WINDIVERT_PARAM_SEQUENCE) when the sequencer is created,
+ * so packets queued earlier are sent unordered.  The ordering decisions are
+ * made by windivert_reorder.c; expired packets are released by the receive
+ * path and by a timer, so they do not wait for the next send.
+ */
+
+#include "windivert_reorder.c"
+
+#define WINDIVERT_SEQUENCER_BUFSIZE     (WINDIVERT_BATCH_MAX * 1500)
+#define WINDIVERT_SEQUENCER_TIMEOUT_MAX 16000   // 16s
+#define WINDIVERT_SEQUENCER_TIMER_MIN   10      // ms
+
+/*
+ * Sequencer.
+ */
+struct WINDIVERT_SEQUENCER
+{
+    HANDLE handle;                  // WinDivert handle.
+    HANDLE pool;                    // Private heap.
+    HANDLE timer;                   // Expiry timer.
+    CRITICAL_SECTION lock;
+    UINT8 *batch;                   // Send batch buffer.
+    UINT batch_len;
+    UINT batch_count;
+    WINDIVERT_ADDRESS batch_addr[WINDIVERT_BATCH_MAX];
+    WINDIVERT_REORDER reorder;      // Ordering state.
+};
+
+/*
+ * Prototypes.
+ */
+static BOOL WinDivertSequencerEmit(PVOID context, const VOID *packet,
+    UINT packet_len, const WINDIVERT_ADDRESS *addr, BOOL owned);
+static UINT8 *WinDivertSequencerCopy(PVOID context, const VOID *packet,
+    UINT packet_len);
+static VOID CALLBACK WinDivertSequencerTimer(PVOID context, BOOLEAN fired);
+static BOOL WinDivertSequencerBatch(PWINDIVERT_SEQUENCER seq,
+    const VOID *packet, UINT packet_len, const WINDIVERT_ADDRESS *addr);
+static BOOL WinDivertSequencerBatchFlush(PWINDIVERT_SEQUENCER seq);
+static UINT32 WinDivertSequencerFlowHash(const WINDIVERT_ADDRESS *addr,
+    const VOID *packet, UINT packet_len);
+static UINT WinDivertSequencerPacketLength(const WINDIVERT_ADDRESS *addr,
+    const VOID *packet, UINT packet_len);
+
+/*
+ * Create a sequencer.
+ */
+PWINDIVERT_SEQUENCER WinDivertSequencerCreate(HANDLE handle, UINT64 flags,
+    UINT32 timeout)
+{
+    HANDLE pool;
+    PWINDIVERT_SEQUENCER seq;
+    UINT64 sequence;
+    DWORD period;
+
+    if (handle == INVALID_HANDLE_VALUE ||
+        (flags & ~WINDIVERT_SEQUENCER_FLAG_FLOW) != 0 ||
+        timeout > WINDIVERT_SEQUENCER_TIMEOUT_MAX)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return NULL;
+    }
+    if (!WinDivertGetParam(handle, WINDIVERT_PARAM_SEQUENCE, &sequence))
+    {
+        return NULL;
+    }
+
+    pool = HeapCreate(0, WINDIVERT_MIN_POOL_SIZE, 0);
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+    seq = (PWINDIVERT_SEQUENCER)HeapAlloc(pool, HEAP_ZERO_MEMORY,
+        sizeof(struct WINDIVERT_SEQUENCER));
+    if (seq == NULL)
+    {
+        goto WinDivertSequencerCreateError;
+    }
+    seq->batch = (UINT8 *)HeapAlloc(pool, 0, WINDIVERT_SEQUENCER_BUFSIZE);
+    if (seq->batch == NULL)
+    {
+        goto WinDivertSequencerCreateError;
+    }
+    seq->handle = handle;
+    seq->pool   = pool;
+    WinDivertReorderInit(&seq->reorder,
+        ((flags & WINDIVERT_SEQUENCER_FLAG_FLOW) != 0), timeout,
+        (UINT32)sequence, WinDivertSequencerEmit, WinDivertSequencerCopy, seq);
+    InitializeCriticalSection(&seq->lock);
+
+    // Poll for expired packets a few times per timeout:
+    period = timeout / 4;
+    period = (period < WINDIVERT_SEQUENCER_TIMER_MIN?
+        WINDIVERT_SEQUENCER_TIMER_MIN: period);
+    if (!CreateTimerQueueTimer(&seq->timer, NULL, WinDivertSequencerTimer,
+            seq, period, period, WT_EXECUTEDEFAULT))
+    {
+        DeleteCriticalSection(&seq->lock);
+        HeapDestroy(pool);
+        return NULL;
+    }
+    return seq;
+
+WinDivertSequencerCreateError:
+    HeapDestroy(pool);
+    SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+    return NULL;
+}
+
+/*
+ * Receive packets and track their sequence numbers.  Expired packets are
+ * released here as well, since the receive path is the busiest caller.
+ */
+BOOL WinDivertSequencerRecvEx(PWINDIVERT_SEQUENCER seq, PVOID pPacket,
+    UINT packetLen, UINT *pRecvLen, UINT64 flags, PWINDIVERT_ADDRESS pAddr,
+    UINT *pAddrLen)
+{
+    UINT8 *packet;
+    UINT recv_len, addr_len, len, count, i;
+    UINT32 now;
+
+    if (seq == NULL || pAddr == NULL || pAddrLen == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    if (!WinDivertRecvEx(seq->handle, pPacket, packetLen, &recv_len, flags,
+            pAddr, pAddrLen, NULL))
+    {
+        return FALSE;
+    }
+    addr_len = *pAddrLen;
+    count = addr_len / sizeof(WINDIVERT_ADDRESS);
+    packet = (UINT8 *)pPacket;
+    len = recv_len;
+
+    EnterCriticalSection(&seq->lock);
+    now = (UINT32)GetTickCount();
+    for (i = 0; i < count; i++)
+    {
+        WinDivertReorderTrack(&seq->reorder, pAddr[i].Sequence,
+            WinDivertSequencerFlowHash(&pAddr[i], packet, len), now);
+        if (packet != NULL)
+        {
+            len -= WinDivertSequencerPacketLength(&pAddr[i], packet, len);
+            packet = (UINT8 *)pPacket + (recv_len - len);
+        }
+    }
+    if (WinDivertReorderExpired(&seq->reorder, now))
+    {
+        WinDivertReorderRelease(&seq->reorder, seq->reorder.next, now,
+            FALSE);
+    }
+    WinDivertSequencerBatchFlush(seq);
+    LeaveCriticalSection(&seq->lock);
+
+    if (pRecvLen != NULL)
+    {
+        *pRecvLen = recv_len;
+    }
+    return TRUE;
+}
+
+/*
+ * Send packets in sequence order.
+ */
+BOOL WinDivertSequencerSendEx(PWINDIVERT_SEQUENCER seq, const VOID *pPacket,
+    UINT packetLen, UINT64 flags, const WINDIVERT_ADDRESS *pAddr,
+    UINT addrLen)
+{
+    const UINT8 *packet = (const UINT8 *)pPacket;
+    UINT count, len, i;
+    UINT32 now;
+    BOOL result = TRUE;
+
+    if (seq == NULL || pAddr == NULL || flags != 0 ||
+        addrLen % sizeof(WINDIVERT_ADDRESS) != 0)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    count = addrLen / sizeof(WINDIVERT_ADDRESS);
+
+    EnterCriticalSection(&seq->lock);
+    now = (UINT32)GetTickCount();
+    for (i = 0; i < count; i++)
+    {
+        len = WinDivertSequencerPacketLength(&pAddr[i], packet, packetLen);
+        result = WinDivertReorderComplete(&seq->reorder, packet, len,
+            &pAddr[i], now) && result;
+        packet += len;
+        packetLen -= len;
+    }
+    result = WinDivertReorderRelease(&seq->reorder, seq->reorder.next, now,
+        FALSE) && result;
+    result = WinDivertReorderHold(&seq->reorder) && result;
+    result = WinDivertSequencerBatchFlush(seq) && result;
+    LeaveCriticalSection(&seq->lock);
+
+    return result;
+}
+
+/*
+ * Discard packets, i.e., the application has dropped them.
+ */
+BOOL WinDivertSequencerDiscard(PWINDIVERT_SEQUENCER seq,
+    const WINDIVERT_ADDRESS *pAddr, UINT addrLen)
+{
+    UINT count, i;
+    UINT32 now;
+    BOOL result;
+
+    if (seq == NULL || pAddr == NULL ||
+        addrLen % sizeof(WINDIVERT_ADDRESS) != 0)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    count = addrLen / sizeof(WINDIVERT_ADDRESS);
+
+    EnterCriticalSection(&seq->lock);
+    now = (UINT32)GetTickCount();
+    for (i = 0; i < count; i++)
+    {
+        WinDivertReorderComplete(&seq->reorder, NULL, 0, &pAddr[i], now);
+    }
+    result = WinDivertReorderRelease(&seq->reorder, seq->reorder.next, now,
+        FALSE);
+    result = WinDivertSequencerBatchFlush(seq) && result;
+    LeaveCriticalSection(&seq->lock);
+
+    return result;
+}
+
+/*
+ * Send any held packets whose wait has expired (or all held packets if
+ * `force' is set).
+ */
+BOOL WinDivertSequencerFlush(PWINDIVERT_SEQUENCER seq, BOOL force)
+{
+    BOOL result;
+
+    if (seq == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    EnterCriticalSection(&seq->lock);
+    result = WinDivertReorderRelease(&seq->reorder, seq->reorder.next,
+        (UINT32)GetTickCount(), force);
+    result = WinDivertSequencerBatchFlush(seq) && result;
+    LeaveCriticalSection(&seq->lock);
+    return result;
+}
+
+/*
+ * Free a sequencer.  Held packets are sent.
+ */
+void WinDivertSequencerFree(PWINDIVERT_SEQUENCER seq)
+{
+    if (seq == NULL)
+    {
+        return;
+    }
+    DeleteTimerQueueTimer(NULL, seq->timer, INVALID_HANDLE_VALUE);
+    WinDivertSequencerFlush(seq, TRUE);
+    DeleteCriticalSection(&seq->lock);
+    HeapDestroy(seq->pool);
+}
+
+/*
+ * Send a released packet (reorder callback).
+ */
+static BOOL WinDivertSequencerEmit(PVOID context, const VOID *packet,
+    UINT packet_len, const WINDIVERT_ADDRESS *addr, BOOL owned)
+{
+    PWINDIVERT_SEQUENCER seq = (PWINDIVERT_SEQUENCER)context;
+    BOOL result;
+
+    result = WinDivertSequencerBatch(seq, packet, packet_len, addr);
+    if (owned)
+    {
+        HeapFree(seq->pool, 0, (PVOID)packet);
+    }
+    return result;
+}
+
+/*
+ * Copy a held packet (reorder callback).
+ */
+static UINT8 *WinDivertSequencerCopy(PVOID context, const VOID *packet,
+    UINT packet_len)
+{
+    PWINDIVERT_SEQUENCER seq = (PWINDIVERT_SEQUENCER)context;
+    UINT8 *copy;
+
+    copy = (UINT8 *)HeapAlloc(seq->pool, 0,
+        (packet_len == 0? 1: packet_len));
+    if (copy != NULL)
+    {
+        memcpy(copy, packet, packet_len);
+    }
+    return copy;
+}
+
+/*
+ * Release expired packets even if the application is idle.
+ */
+static VOID CALLBACK WinDivertSequencerTimer(PVOID context, BOOLEAN fired)
+{
+    PWINDIVERT_SEQUENCER seq = (PWINDIVERT_SEQUENCER)context;
+    UINT32 now;
+
+    UNREFERENCED_PARAMETER(fired);
+
+    EnterCriticalSection(&seq->lock);
+    now = (UINT32)GetTickCount();
+    if (WinDivertReorderExpired(&seq->reorder, now))
+    {
+        WinDivertReorderRelease(&seq->reorder, seq->reorder.next, now,
+            FALSE);
+        WinDivertSequencerBatchFlush(seq);
+    }
+    LeaveCriticalSection(&seq->lock);
+}
+
+/*
+ * Append a packet to the send batch.
+ */
+static BOOL WinDivertSequencerBatch(PWINDIVERT_SEQUENCER seq,
+    const VOID *packet, UINT packet_len, const WINDIVERT_ADDRESS *addr)
+{
+    BOOL result = TRUE;
+
+    if (seq->batch_count >= WINDIVERT_BATCH_MAX ||
+        seq->batch_len + packet_len > WINDIVERT_SEQUENCER_BUFSIZE)
+    {
+        result = WinDivertSequencerBatchFlush(seq);
+    }
+    if (packet_len > WINDIVERT_SEQUENCER_BUFSIZE)
+    {
+        return WinDivertSend(seq->handle, packet, packet_len, NULL, addr) &&
+            result;
+    }
+    memcpy(seq->batch + seq->batch_len, packet, packet_len);
+    seq->batch_addr[seq->batch_count] = *addr;
+    seq->batch_len += packet_len;
+    seq->batch_count++;
+    return result;
+}
+
+/*
+ * Send the batch.
+ */
+static BOOL WinDivertSequencerBatchFlush(PWINDIVERT_SEQUENCER seq)
+{
+    BOOL result;
+
+    if (seq->batch_count == 0)
+    {
+        return TRUE;
+    }
+    result = WinDivertSendEx(seq->handle, seq->batch, seq->batch_len, NULL,
+        0, seq->batch_addr, seq->batch_count * sizeof(WINDIVERT_ADDRESS),
+        NULL);
+    seq->batch_len   = 0;
+    seq->batch_count = 0;
+    return result;
+}
+
+/*
+ * Flow hash of a packet (0 if there is no packet).  Only the addresses,
+ * protocol and ports are hashed, since WinDivertHelperHashPacket() also
+ * covers per-packet fields such as the IP ID.
+ */
+static UINT32 WinDivertSequencerFlowHash(const WINDIVERT_ADDRESS *addr,
+    const VOID *packet, UINT packet_len)
+{
+    PWINDIVERT_IPHDR ip_header;
+    PWINDIVERT_IPV6HDR ipv6_header;
+    PWINDIVERT_TCPHDR tcp_header;
+    PWINDIVERT_UDPHDR udp_header;
+    UINT8 protocol;
+    UINT64 hash = WINDIVERT_PRIME64_4, ports = 0;
+    const UINT64 *data;
+    UINT i;
+
+    packet_len = WinDivertSequencerPacketLength(addr, packet, packet_len);
+    if (packet_len == 0 ||
+        !WinDivertHelperParsePacket((PVOID)packet, packet_len, &ip_header,
+            &ipv6_header, &protocol, NULL, NULL, &tcp_header, &udp_header,
+            NULL, NULL, NULL, NULL))
+    {
+        return 0;
+    }
+    if (tcp_header != NULL)
+    {
+        ports = ((UINT64)tcp_header->SrcPort << 16) | tcp_header->DstPort;
+    }
+    else if (udp_header != NULL)
+    {
+        ports = ((UINT64)udp_header->SrcPort << 16) | udp_header->DstPort;
+    }
+    hash = WinDivertXXH64Round(hash, (ports << 8) | protocol);
+    if (ip_header != NULL)
+    {
+        hash = WinDivertXXH64Round(hash,
+            ((UINT64)ip_header->SrcAddr << 32) | ip_header->DstAddr);
+    }
+    else if (ipv6_header != NULL)
+    {
+        data = (const UINT64 *)ipv6_header->SrcAddr;
+        for (i = 0; i < 4; i++)     // SrcAddr + DstAddr
+        {
+            hash = WinDivertXXH64Round(hash, data[i]);
+        }
+    }
+    return (UINT32)WinDivertXXH64Avalanche(hash);
+}
+
+/*
+ * Length of the next packet in a batch.
+ */
+static UINT WinDivertSequencerPacketLength(const WINDIVERT_ADDRESS *addr,
+    const VOID *packet, UINT packet_len)
+{
+    switch (addr->Layer)
+    {
+        case WINDIVERT_LAYER_NETWORK:
+        case WINDIVERT_LAYER_NETWORK_FORWARD:
+            break;
+        default:
+            return 0;
+    }
+    if (packet == NULL)
+    {
+        return 0;
+    }
+    return WinDivertGetPacketLength(packet, packet_len);
+}
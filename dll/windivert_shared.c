@@ -32,8 +32,10 @@
  * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
  */
 
+#define WINDIVERT_OBJECT_LEN(length)                                    \
+    (8 + 4 + 3 + (length) * (1 + 1 + 2 + 2 + 4*7 + 4 + 4) + 1)
 #define WINDIVERT_OBJECT_MAXLEN                                         \
-    (8 + 4 + 2 + WINDIVERT_FILTER_MAXLEN * (1 + 1 + 2 + 2 + 4*7 + 3 + 3) + 1)
+    WINDIVERT_OBJECT_LEN(WINDIVERT_FILTER_MAXLEN)
 
 #define MAX(a, b)                               ((a) > (b)? (a): (b))
 
@@ -124,7 +126,26 @@ typedef struct
 #define WINDIVERT_IPV6FRAGHDR_GET_MF(hdr)                               \
     ((((hdr)->FragOff0) & 0x0100) != 0)
 
+/*
+ * IPv6 extension header summary.
+ */
+typedef struct WINDIVERT_IPV6EXT
+{
+    UINT8  Flags;                   // WINDIVERT_IPV6EXT_* headers present.
+    UINT8  RoutingType;             // Type of the first routing header.
+    UINT16 Count;                   // Number of extension headers.
+    UINT16 Length;                  // Total length of extension headers.
+    UINT16 Reserved;
+} WINDIVERT_IPV6EXT, *PWINDIVERT_IPV6EXT;
+#define WINDIVERT_IPV6EXT_HOPOPTS       0x01
+#define WINDIVERT_IPV6EXT_ROUTING       0x02
+#define WINDIVERT_IPV6EXT_FRAGMENT      0x04
+#define WINDIVERT_IPV6EXT_DSTOPTS       0x08
+#define WINDIVERT_IPV6EXT_AH            0x10
+#define WINDIVERT_IPV6EXT_MH            0x20
+
 #include "windivert_hash.c"
+#include "windivert_process.c"
 
 /*
  * IPv4/IPv6 pseudo headers.
@@ -168,6 +189,7 @@ typedef struct
     PWINDIVERT_TCPHDR TCPHeader;
     PWINDIVERT_UDPHDR UDPHeader;
     UINT8 *Payload;
+    WINDIVERT_IPV6EXT IPv6Ext;
 } WINDIVERT_PACKET, *PWINDIVERT_PACKET;
 
 /*
@@ -310,6 +332,8 @@ static void WinDivertSerializeTest(PWINDIVERT_STREAM stream,
         case WINDIVERT_FILTER_FIELD_IPV6_DSTADDR:
         case WINDIVERT_FILTER_FIELD_LOCALADDR:
         case WINDIVERT_FILTER_FIELD_REMOTEADDR:
+        case WINDIVERT_FILTER_FIELD_PROCESSNAME:
+        case WINDIVERT_FILTER_FIELD_PROCESSPATH:
             for (i = 1; i < 4; i++)
             {
                 WinDivertSerializeNumber(stream, filter->arg[i]);
@@ -344,9 +368,9 @@ static void WinDivertSerializeTest(PWINDIVERT_STREAM stream,
  * Serialize a test.
  */
 static void WinDivertSerializeFilter(PWINDIVERT_STREAM stream,
-    const WINDIVERT_FILTER *filter, UINT8 length)
+    const WINDIVERT_FILTER *filter, UINT16 length)
 {
-    UINT8 i;
+    UINT16 i;
     WinDivertPutString(stream, "@WinDiv_");     // Magic
     WinDivertSerializeNumber(stream, 0);        // Version
     WinDivertSerializeNumber(stream, length);   // Length
@@ -357,6 +381,44 @@ static void WinDivertSerializeFilter(PWINDIVERT_STREAM stream,
     WinDivertPutNul(stream);
 }
 
+/*
+ * Add an IPv6 extension header to a summary.  All extension headers are at
+ * least 8 bytes long.
+ */
+static WINDIVERT_INLINE void WinDivertIPv6ExtAdd(PWINDIVERT_IPV6EXT ext,
+    UINT8 protocol, const UINT8 *header, UINT header_len)
+{
+    switch (protocol)
+    {
+        case IPPROTO_HOPOPTS:
+            ext->Flags |= WINDIVERT_IPV6EXT_HOPOPTS;
+            break;
+        case IPPROTO_ROUTING:
+            if ((ext->Flags & WINDIVERT_IPV6EXT_ROUTING) == 0)
+            {
+                ext->RoutingType = header[2];
+            }
+            ext->Flags |= WINDIVERT_IPV6EXT_ROUTING;
+            break;
+        case IPPROTO_FRAGMENT:
+            ext->Flags |= WINDIVERT_IPV6EXT_FRAGMENT;
+            break;
+        case IPPROTO_DSTOPTS:
+            ext->Flags |= WINDIVERT_IPV6EXT_DSTOPTS;
+            break;
+        case IPPROTO_AH:
+            ext->Flags |= WINDIVERT_IPV6EXT_AH;
+            break;
+        case IPPROTO_MH:
+            ext->Flags |= WINDIVERT_IPV6EXT_MH;
+            break;
+        default:
+            return;
+    }
+    ext->Count++;
+    ext->Length = (UINT16)(ext->Length + header_len);
+}
+
 /*
  * Parse IPv4/IPv6/ICMP/ICMPv6/TCP/UDP headers from a raw packet.
  */
@@ -370,6 +432,7 @@ static BOOL WinDivertHelperParsePacketEx(const VOID *pPacket, UINT packetLen,
     PWINDIVERT_TCPHDR tcp_header = NULL;
     PWINDIVERT_UDPHDR udp_header = NULL;
     PWINDIVERT_IPV6FRAGHDR frag_header;
+    WINDIVERT_IPV6EXT ipv6_ext;
     UINT8 protocol = 0;
     UINT8 *data = NULL;
     UINT packet_len, total_len, header_len, data_len = 0, frag_off = 0;
@@ -381,6 +444,7 @@ static BOOL WinDivertHelperParsePacketEx(const VOID *pPacket, UINT packetLen,
     }
     data = (UINT8 *)pPacket;
     data_len = packetLen;
+    memset(&ipv6_ext, 0, sizeof(ipv6_ext));
 
     ip_header = (PWINDIVERT_IPHDR)data;
     switch (ip_header->Version)
@@ -458,6 +522,7 @@ static BOOL WinDivertHelperParsePacketEx(const VOID *pPacket, UINT packetLen,
                 {
                     break;
                 }
+                WinDivertIPv6ExtAdd(&ipv6_ext, protocol, data, header_len);
                 protocol  = data[0];
                 data     += header_len;
                 data_len -= header_len;
@@ -541,6 +606,7 @@ WinDivertHelperParsePacketExit:
     pInfo->TCPHeader     = tcp_header;
     pInfo->UDPHeader     = udp_header;
     pInfo->Payload       = data;
+    pInfo->IPv6Ext       = ipv6_ext;
     pInfo->HeaderLength  = (UINT32)(packet_len - data_len);
     pInfo->PayloadLength = (UINT32)data_len;
     return TRUE;
@@ -896,6 +962,18 @@ static BOOL WinDivertValidateField(WINDIVERT_LAYER layer, UINT32 field)
         LNM___,     /* WINDIVERT_FILTER_FIELD_RANDOM16 */
         LNM___,     /* WINDIVERT_FILTER_FIELD_RANDOM32 */
         LNM___,     /* WINDIVERT_FILTER_FIELD_FRAGMENT */
+        LNM___,     /* WINDIVERT_FILTER_FIELD_MARK */
+        LNM___,     /* WINDIVERT_FILTER_FIELD_IPV6_HOPOPTS */
+        LNM___,     /* WINDIVERT_FILTER_FIELD_IPV6_ROUTING */
+        LNM___,     /* WINDIVERT_FILTER_FIELD_IPV6_FRAGHDR */
+        LNM___,     /* WINDIVERT_FILTER_FIELD_IPV6_DSTOPTS */
+        LNM___,     /* WINDIVERT_FILTER_FIELD_IPV6_AH */
+        LNM___,     /* WINDIVERT_FILTER_FIELD_IPV6_MH */
+        LNM___,     /* WINDIVERT_FILTER_FIELD_IPV6_ROUTINGTYPE */
+        LNM___,     /* WINDIVERT_FILTER_FIELD_IPV6_EXTHDRCOUNT */
+        LNM___,     /* WINDIVERT_FILTER_FIELD_IPV6_EXTHDRLENGTH */
+        L__FS_,     /* WINDIVERT_FILTER_FIELD_PROCESSNAME */
+        L__FS_,     /* WINDIVERT_FILTER_FIELD_PROCESSPATH */
     };
 
     if (field > WINDIVERT_FILTER_FIELD_MAX)
@@ -982,11 +1060,14 @@ static WINDIVERT_INLINE int WinDivertExecuteFilter(
     const WINDIVERT_ICMPV6HDR *icmpv6_header,
     const WINDIVERT_TCPHDR *tcp_header,
     const WINDIVERT_UDPHDR *udp_header,
+    const WINDIVERT_IPV6EXT *ipv6_ext,
     UINT8 protocol,
     const void *packet,
     UINT packet_len,
     UINT header_len,
-    UINT payload_len)
+    UINT payload_len,
+    const UINT16 *process_path,
+    UINT process_len)
 {
     UINT64 random64 = 0;
     UINT16 ip, ttl;
@@ -1043,8 +1124,20 @@ static WINDIVERT_INLINE int WinDivertExecuteFilter(
             case WINDIVERT_FILTER_FIELD_IPV6_HOPLIMIT:
             case WINDIVERT_FILTER_FIELD_IPV6_SRCADDR:
             case WINDIVERT_FILTER_FIELD_IPV6_DSTADDR:
+            case WINDIVERT_FILTER_FIELD_IPV6_HOPOPTS:
+            case WINDIVERT_FILTER_FIELD_IPV6_ROUTING:
+            case WINDIVERT_FILTER_FIELD_IPV6_FRAGHDR:
+            case WINDIVERT_FILTER_FIELD_IPV6_DSTOPTS:
+            case WINDIVERT_FILTER_FIELD_IPV6_AH:
+            case WINDIVERT_FILTER_FIELD_IPV6_MH:
+            case WINDIVERT_FILTER_FIELD_IPV6_EXTHDRCOUNT:
+            case WINDIVERT_FILTER_FIELD_IPV6_EXTHDRLENGTH:
                 result = (ipv6_header != NULL);
                 break;
+            case WINDIVERT_FILTER_FIELD_IPV6_ROUTINGTYPE:
+                result = (ipv6_header != NULL &&
+                    (ipv6_ext->Flags & WINDIVERT_IPV6EXT_ROUTING) != 0);
+                break;
             case WINDIVERT_FILTER_FIELD_ICMP_TYPE:
             case WINDIVERT_FILTER_FIELD_ICMP_CODE:
             case WINDIVERT_FILTER_FIELD_ICMP_CHECKSUM:
@@ -1087,6 +1180,10 @@ static WINDIVERT_INLINE int WinDivertExecuteFilter(
             case WINDIVERT_FILTER_FIELD_UDP_PAYLOADLENGTH:
                 result = (udp_header != NULL);
                 break;
+            case WINDIVERT_FILTER_FIELD_PROCESSNAME:
+            case WINDIVERT_FILTER_FIELD_PROCESSPATH:
+                result = (process_path != NULL);
+                break;
             default:
                 break;
         }
@@ -1185,6 +1282,9 @@ static WINDIVERT_INLINE int WinDivertExecuteFilter(
                 case WINDIVERT_FILTER_FIELD_SUBIFIDX:
                     val[0] = network_data->SubIfIdx;
                     break;
+                case WINDIVERT_FILTER_FIELD_MARK:
+                    val[0] = network_data->Mark;
+                    break;
                 case WINDIVERT_FILTER_FIELD_LOOPBACK:
                     val[0] = (UINT32)loopback;
                     break;
@@ -1333,6 +1433,37 @@ static WINDIVERT_INLINE int WinDivertExecuteFilter(
                 case WINDIVERT_FILTER_FIELD_IPV6_HOPLIMIT:
                     val[0] = (UINT32)ipv6_header->HopLimit;
                     break;
+                case WINDIVERT_FILTER_FIELD_IPV6_HOPOPTS:
+                    val[0] = ((ipv6_ext->Flags &
+                        WINDIVERT_IPV6EXT_HOPOPTS) != 0);
+                    break;
+                case WINDIVERT_FILTER_FIELD_IPV6_ROUTING:
+                    val[0] = ((ipv6_ext->Flags &
+                        WINDIVERT_IPV6EXT_ROUTING) != 0);
+                    break;
+                case WINDIVERT_FILTER_FIELD_IPV6_FRAGHDR:
+                    val[0] = ((ipv6_ext->Flags &
+                        WINDIVERT_IPV6EXT_FRAGMENT) != 0);
+                    break;
+                case WINDIVERT_FILTER_FIELD_IPV6_DSTOPTS:
+                    val[0] = ((ipv6_ext->Flags &
+                        WINDIVERT_IPV6EXT_DSTOPTS) != 0);
+                    break;
+                case WINDIVERT_FILTER_FIELD_IPV6_AH:
+                    val[0] = ((ipv6_ext->Flags & WINDIVERT_IPV6EXT_AH) != 0);
+                    break;
+                case WINDIVERT_FILTER_FIELD_IPV6_MH:
+                    val[0] = ((ipv6_ext->Flags & WINDIVERT_IPV6EXT_MH) != 0);
+                    break;
+                case WINDIVERT_FILTER_FIELD_IPV6_ROUTINGTYPE:
+                    val[0] = (UINT32)ipv6_ext->RoutingType;
+                    break;
+                case WINDIVERT_FILTER_FIELD_IPV6_EXTHDRCOUNT:
+                    val[0] = (UINT32)ipv6_ext->Count;
+                    break;
+                case WINDIVERT_FILTER_FIELD_IPV6_EXTHDRLENGTH:
+                    val[0] = (UINT32)ipv6_ext->Length;
+                    break;
                 case WINDIVERT_FILTER_FIELD_IPV6_SRCADDR:
                     big = TRUE;
                     val[3] = (UINT32)ntohl(ipv6_header->SrcAddr[0]);
@@ -1687,6 +1818,14 @@ static WINDIVERT_INLINE int WinDivertExecuteFilter(
                     val[0] = (UINT32)(neg? -reflect_data->Priority:
                         reflect_data->Priority);
                     break;
+                case WINDIVERT_FILTER_FIELD_PROCESSNAME:
+                case WINDIVERT_FILTER_FIELD_PROCESSPATH:
+                    big = TRUE;
+                    WinDivertProcessValue(process_path, process_len,
+                        (filter[ip].field ==
+                            WINDIVERT_FILTER_FIELD_PROCESSNAME),
+                        filter[ip].arg, val);
+                    break;
                 default:
                     return -1;
             }
@@ -0,0 +1,1132 @@
+/*
+ * windivert_sketch.c
+ * (C) 2021, all rights reserved,
+ *
+ * This file is part of WinDivert.
+ *
+ * WinDivert is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * WinDivert is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Streaming sketches.  Packets are mapped to flow keys (a subset of the
+ * addresses, ports and protocol), and the keys are summarized in bounded
+ * memory:
+ *
+ * - Count-min: per-key weight estimates using conservative update.  The
+ *   estimate is never less than the true weight.
+ * - Top-K: the "space-saving" algorithm over K counters kept in a min-heap,
+ *   with an open-addressing index.  Every key with weight greater than
+ *   total/K is guaranteed to be tracked.
+ * - Distinct: HyperLogLog registers for each group key, estimating the
+ *   number of distinct item keys (e.g. sources per destination).  Groups
+ *   are hashed into a fixed number of register sets, so colliding groups
+ *   are merged.
+ *
+ * All sketches of the same shape use the same hash seeds, so they can be
+ * merged.  Packets are processed in blocks: keys are extracted, then hashed,
+ * then applied, which keeps the hashing loop free of data-dependent
+ * branches.  Estimation uses integer arithmetic only.
+ */
+
+#define WINDIVERT_SKETCH_BLOCK          64          // Packets per block.
+#define WINDIVERT_SKETCH_WIDTH_MAX      (1 << 24)
+#define WINDIVERT_SKETCH_DEPTH_MAX      16
+#define WINDIVERT_SKETCH_K_MAX          (1 << 20)
+#define WINDIVERT_SKETCH_GROUPS_MAX     (1 << 20)
+#define WINDIVERT_SKETCH_PRECISION_MIN  4
+#define WINDIVERT_SKETCH_PRECISION_MAX  16
+#define WINDIVERT_SKETCH_REGISTERS_MAX  (1 << 28)   // Bytes.
+#define WINDIVERT_SKETCH_FIELDS_ALL                                     \
+    (WINDIVERT_SKETCH_KEY_SRCADDR | WINDIVERT_SKETCH_KEY_DSTADDR |      \
+     WINDIVERT_SKETCH_KEY_SRCPORT | WINDIVERT_SKETCH_KEY_DSTPORT |      \
+     WINDIVERT_SKETCH_KEY_PROTOCOL)
+#define WINDIVERT_SKETCH_SEED_KEY       0x9E3779B97F4A7C15ull
+#define WINDIVERT_SKETCH_SEED_ITEM      0xC2B2AE3D27D4EB4Full
+#define WINDIVERT_SKETCH_EMPTY          0xFFFFFFFF
+
+/*
+ * Top-K counter.
+ */
+typedef struct
+{
+    WINDIVERT_SKETCH_ENTRY entry;   // Key, count and error.
+    UINT64 hash;                    // Key hash.
+    UINT32 slot;                    // Index slot.
+    UINT32 reserved;
+} WINDIVERT_SKETCH_COUNTER, *PWINDIVERT_SKETCH_COUNTER;
+
+/*
+ * Sketch.
+ */
+struct WINDIVERT_SKETCH
+{
+    HANDLE pool;                    // Private heap.
+    WINDIVERT_SKETCH_TYPE type;     // Sketch type.
+    UINT32 key_fields;              // WINDIVERT_SKETCH_KEY_* for keys.
+    UINT32 item_fields;             // WINDIVERT_SKETCH_KEY_* for items.
+    UINT64 flags;                   // WINDIVERT_SKETCH_FLAG_*
+    UINT size;                      // Width, K, or groups.
+    UINT depth;                     // Rows, or precision.
+    UINT64 total;                   // Total weight.
+    UINT64 *counters;               // Count-min counters.
+    UINT8 *registers;               // HyperLogLog registers.
+    PWINDIVERT_SKETCH_COUNTER heap; // Top-K min-heap.
+    UINT count;                     // Top-K heap size.
+    UINT32 *index;                  // Top-K index (heap position).
+    UINT index_mask;
+};
+
+/*
+ * Prototypes.
+ */
+static void WinDivertSketchKey(UINT32 fields, const WINDIVERT_PACKET *info,
+    PWINDIVERT_SKETCH_KEY key);
+static void WinDivertSketchMask(UINT32 fields, const WINDIVERT_SKETCH_KEY *in,
+    PWINDIVERT_SKETCH_KEY out);
+static UINT64 WinDivertSketchHash(UINT64 seed, const WINDIVERT_SKETCH_KEY *key);
+static BOOL WinDivertSketchKeyEqual(const WINDIVERT_SKETCH_KEY *a,
+    const WINDIVERT_SKETCH_KEY *b);
+static void WinDivertSketchApply(PWINDIVERT_SKETCH sketch,
+    const WINDIVERT_SKETCH_KEY *key, UINT64 key_hash, UINT64 item_hash,
+    UINT64 weight);
+static void WinDivertSketchCountMin(PWINDIVERT_SKETCH sketch, UINT64 hash,
+    UINT64 weight);
+static UINT64 WinDivertSketchCountMinQuery(const struct WINDIVERT_SKETCH *sketch,
+    UINT64 hash);
+static UINT WinDivertSketchFind(const struct WINDIVERT_SKETCH *sketch,
+    const WINDIVERT_SKETCH_KEY *key, UINT64 hash);
+static void WinDivertSketchTopK(PWINDIVERT_SKETCH sketch,
+    const WINDIVERT_SKETCH_KEY *key, UINT64 hash, UINT64 weight);
+static void WinDivertSketchOffer(PWINDIVERT_SKETCH sketch,
+    const WINDIVERT_SKETCH_COUNTER *counter);
+static void WinDivertSketchIndexInsert(PWINDIVERT_SKETCH sketch, UINT i);
+static void WinDivertSketchIndexRemove(PWINDIVERT_SKETCH sketch, UINT i);
+static void WinDivertSketchSwap(PWINDIVERT_SKETCH sketch, UINT i, UINT j);
+static void WinDivertSketchSiftUp(PWINDIVERT_SKETCH sketch, UINT i);
+static void WinDivertSketchSiftDown(PWINDIVERT_SKETCH sketch, UINT i);
+static void WinDivertSketchDistinct(PWINDIVERT_SKETCH sketch, UINT64 key_hash,
+    UINT64 item_hash);
+static UINT64 WinDivertSketchDistinctQuery(const struct WINDIVERT_SKETCH *sketch,
+    UINT64 hash);
+static UINT64 WinDivertDiv64(UINT64 a, UINT64 b);
+static UINT32 WinDivertLog2Q16(UINT32 x);
+static UINT WinDivertClz64(UINT64 x);
+
+/*
+ * Round up to a power of 2.
+ */
+static UINT WinDivertSketchPow2(UINT x)
+{
+    UINT y = 1;
+    while (y < x)
+    {
+        y <<= 1;
+    }
+    return y;
+}
+
+/*
+ * Create a sketch.
+ */
+PWINDIVERT_SKETCH WinDivertHelperSketchCreate(WINDIVERT_SKETCH_TYPE type,
+    UINT32 keyFields, UINT32 itemFields, UINT size, UINT depth, UINT64 flags)
+{
+    HANDLE pool;
+    PWINDIVERT_SKETCH sketch;
+    SIZE_T len;
+
+    if ((keyFields & ~WINDIVERT_SKETCH_FIELDS_ALL) != 0 ||
+        (itemFields & ~WINDIVERT_SKETCH_FIELDS_ALL) != 0 ||
+        (flags & ~WINDIVERT_SKETCH_FLAG_BYTES) != 0 || size == 0)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return NULL;
+    }
+    switch (type)
+    {
+        case WINDIVERT_SKETCH_COUNT_MIN:
+            if (keyFields == 0 || itemFields != 0 ||
+                size > WINDIVERT_SKETCH_WIDTH_MAX || depth == 0 ||
+                depth > WINDIVERT_SKETCH_DEPTH_MAX)
+            {
+                SetLastError(ERROR_INVALID_PARAMETER);
+                return NULL;
+            }
+            size = WinDivertSketchPow2(size);
+            len = (SIZE_T)size * depth * sizeof(UINT64);
+            break;
+        case WINDIVERT_SKETCH_TOP_K:
+            if (keyFields == 0 || itemFields != 0 ||
+                size > WINDIVERT_SKETCH_K_MAX || depth != 0)
+            {
+                SetLastError(ERROR_INVALID_PARAMETER);
+                return NULL;
+            }
+            len = (SIZE_T)size * sizeof(WINDIVERT_SKETCH_COUNTER);
+            break;
+        case WINDIVERT_SKETCH_DISTINCT:
+            if (itemFields == 0 || (flags & WINDIVERT_SKETCH_FLAG_BYTES) ||
+                size > WINDIVERT_SKETCH_GROUPS_MAX ||
+                depth < WINDIVERT_SKETCH_PRECISION_MIN ||
+                depth > WINDIVERT_SKETCH_PRECISION_MAX)
+            {
+                SetLastError(ERROR_INVALID_PARAMETER);
+                return NULL;
+            }
+            size = (keyFields == 0? 1: WinDivertSketchPow2(size));
+            len = (SIZE_T)size << depth;
+            if (len > WINDIVERT_SKETCH_REGISTERS_MAX)
+            {
+                SetLastError(ERROR_INVALID_PARAMETER);
+                return NULL;
+            }
+            break;
+        default:
+            SetLastError(ERROR_INVALID_PARAMETER);
+            return NULL;
+    }
+
+    pool = HeapCreate(0, WINDIVERT_MIN_POOL_SIZE, 0);
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+    sketch = (PWINDIVERT_SKETCH)HeapAlloc(pool, HEAP_ZERO_MEMORY,
+        sizeof(struct WINDIVERT_SKETCH));
+    if (sketch == NULL)
+    {
+        goto WinDivertHelperSketchCreateError;
+    }
+    sketch->pool        = pool;
+    sketch->type        = type;
+    sketch->key_fields  = keyFields;
+    sketch->item_fields = itemFields;
+    sketch->flags       = flags;
+    sketch->size        = size;
+    sketch->depth       = depth;
+    switch (type)
+    {
+        case WINDIVERT_SKETCH_COUNT_MIN:
+            sketch->counters = (UINT64 *)HeapAlloc(pool, HEAP_ZERO_MEMORY,
+                len);
+            if (sketch->counters == NULL)
+            {
+                goto WinDivertHelperSketchCreateError;
+            }
+            break;
+        case WINDIVERT_SKETCH_TOP_K:
+            sketch->heap = (PWINDIVERT_SKETCH_COUNTER)HeapAlloc(pool, 0, len);
+            sketch->index_mask = WinDivertSketchPow2(2 * size) - 1;
+            sketch->index = (UINT32 *)HeapAlloc(pool, 0,
+                ((SIZE_T)sketch->index_mask + 1) * sizeof(UINT32));
+            if (sketch->heap == NULL || sketch->index == NULL)
+            {
+                goto WinDivertHelperSketchCreateError;
+            }
+            memset(sketch->index, 0xFF,
+                ((SIZE_T)sketch->index_mask + 1) * sizeof(UINT32));
+            break;
+        default:
+            sketch->registers = (UINT8 *)HeapAlloc(pool, HEAP_ZERO_MEMORY,
+                len);
+            if (sketch->registers == NULL)
+            {
+                goto WinDivertHelperSketchCreateError;
+            }
+            break;
+    }
+    return sketch;
+
+WinDivertHelperSketchCreateError:
+    HeapDestroy(pool);
+    SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+    return NULL;
+}
+
+/*
+ * Update a sketch with a batch of packets.
+ */
+BOOL WinDivertHelperSketchUpdate(PWINDIVERT_SKETCH sketch,
+    const VOID *pPackets, UINT packetsLen)
+{
+    WINDIVERT_SKETCH_KEY keys[WINDIVERT_SKETCH_BLOCK];
+    WINDIVERT_SKETCH_KEY items[WINDIVERT_SKETCH_BLOCK];
+    UINT64 key_hash[WINDIVERT_SKETCH_BLOCK];
+    UINT64 item_hash[WINDIVERT_SKETCH_BLOCK];
+    UINT weight[WINDIVERT_SKETCH_BLOCK];
+    const UINT8 *packet = (const UINT8 *)pPackets;
+    WINDIVERT_PACKET info;
+    UINT packet_len, n, i;
+    BOOL bytes;
+
+    if (sketch == NULL || (pPackets == NULL && packetsLen != 0))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    bytes = ((sketch->flags & WINDIVERT_SKETCH_FLAG_BYTES) != 0);
+    while (packetsLen > 0)
+    {
+        // (1) Extract keys:
+        for (n = 0; n < WINDIVERT_SKETCH_BLOCK && packetsLen > 0; n++)
+        {
+            packet_len = WinDivertGetPacketLength(packet, packetsLen);
+            if (packet_len == 0 ||
+                !WinDivertHelperParsePacketEx(packet, packet_len, &info))
+            {
+                SetLastError(ERROR_INVALID_PARAMETER);
+                return FALSE;
+            }
+            WinDivertSketchKey(sketch->key_fields, &info, &keys[n]);
+            WinDivertSketchKey(sketch->item_fields, &info, &items[n]);
+            weight[n]   = (bytes? packet_len: 1);
+            packet     += packet_len;
+            packetsLen -= packet_len;
+        }
+
+        // (2) Hash keys:
+        for (i = 0; i < n; i++)
+        {
+            key_hash[i]  = WinDivertSketchHash(WINDIVERT_SKETCH_SEED_KEY,
+                &keys[i]);
+            item_hash[i] = WinDivertSketchHash(WINDIVERT_SKETCH_SEED_ITEM,
+                &items[i]);
+        }
+
+        // (3) Apply:
+        for (i = 0; i < n; i++)
+        {
+            WinDivertSketchApply(sketch, &keys[i], key_hash[i], item_hash[i],
+                weight[i]);
+        }
+    }
+    return TRUE;
+}
+
+/*
+ * Update a sketch with a single key.
+ */
+BOOL WinDivertHelperSketchUpdateKey(PWINDIVERT_SKETCH sketch,
+    const WINDIVERT_SKETCH_KEY *pKey, const WINDIVERT_SKETCH_KEY *pItem,
+    UINT64 weight)
+{
+    WINDIVERT_SKETCH_KEY key, item;
+
+    if (sketch == NULL || pKey == NULL ||
+        (pItem == NULL && sketch->type == WINDIVERT_SKETCH_DISTINCT))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    WinDivertSketchMask(sketch->key_fields, pKey, &key);
+    WinDivertSketchMask(sketch->item_fields, (pItem == NULL? pKey: pItem),
+        &item);
+    WinDivertSketchApply(sketch, &key,
+        WinDivertSketchHash(WINDIVERT_SKETCH_SEED_KEY, &key),
+        WinDivertSketchHash(WINDIVERT_SKETCH_SEED_ITEM, &item), weight);
+    return TRUE;
+}
+
+/*
+ * Estimate the weight (count-min, top-K) or number of distinct items
+ * (distinct) for a key.
+ */
+BOOL WinDivertHelperSketchQuery(PWINDIVERT_SKETCH sketch,
+    const WINDIVERT_SKETCH_KEY *pKey, UINT64 *pEstimate)
+{
+    WINDIVERT_SKETCH_KEY key;
+    UINT64 hash;
+    UINT i;
+
+    if (sketch == NULL || pKey == NULL || pEstimate == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    WinDivertSketchMask(sketch->key_fields, pKey, &key);
+    hash = WinDivertSketchHash(WINDIVERT_SKETCH_SEED_KEY, &key);
+    switch (sketch->type)
+    {
+        case WINDIVERT_SKETCH_COUNT_MIN:
+            *pEstimate = WinDivertSketchCountMinQuery(sketch, hash);
+            break;
+        case WINDIVERT_SKETCH_TOP_K:
+            i = WinDivertSketchFind(sketch, &key, hash);
+            if (i != WINDIVERT_SKETCH_EMPTY)
+            {
+                *pEstimate = sketch->heap[i].entry.Count;
+            }
+            else
+            {
+                // Untracked keys weigh at most the minimum counter.
+                *pEstimate = (sketch->count < sketch->size? 0:
+                    sketch->heap[0].entry.Count);
+            }
+            break;
+        default:
+            *pEstimate = WinDivertSketchDistinctQuery(sketch, hash);
+            break;
+    }
+    return TRUE;
+}
+
+/*
+ * Get the top-K entries, heaviest first.
+ */
+BOOL WinDivertHelperSketchTopK(PWINDIVERT_SKETCH sketch,
+    PWINDIVERT_SKETCH_ENTRY pEntries, UINT entriesLen, UINT *pCount)
+{
+    PWINDIVERT_SKETCH_ENTRY entries;
+    WINDIVERT_SKETCH_ENTRY entry;
+    UINT count, i, j;
+
+    if (sketch == NULL || sketch->type != WINDIVERT_SKETCH_TOP_K ||
+        (pEntries == NULL && entriesLen != 0))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    count = sketch->count;
+    entries = (PWINDIVERT_SKETCH_ENTRY)HeapAlloc(sketch->pool, 0,
+        (count + 1) * sizeof(WINDIVERT_SKETCH_ENTRY));
+    if (entries == NULL)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return FALSE;
+    }
+    for (i = 0; i < count; i++)
+    {
+        entries[i] = sketch->heap[i].entry;
+    }
+
+    // Heap sort (descending), using the min-heap order already present:
+    for (i = count; i > 1; i--)
+    {
+        entry = entries[0];
+        entries[0] = entries[i - 1];
+        entries[i - 1] = entry;
+        for (j = 0; 2 * j + 1 < i - 1; )
+        {
+            UINT c = 2 * j + 1;
+            if (c + 1 < i - 1 && entries[c + 1].Count < entries[c].Count)
+            {
+                c++;
+            }
+            if (entries[j].Count <= entries[c].Count)
+            {
+                break;
+            }
+            entry = entries[j];
+            entries[j] = entries[c];
+            entries[c] = entry;
+            j = c;
+        }
+    }
+
+    count = (count < entriesLen? count: entriesLen);
+    for (i = 0; i < count; i++)
+    {
+        pEntries[i] = entries[i];
+    }
+    HeapFree(sketch->pool, 0, entries);
+    if (pCount != NULL)
+    {
+        *pCount = count;
+    }
+    return TRUE;
+}
+
+/*
+ * Merge one sketch into another of the same shape.
+ */
+BOOL WinDivertHelperSketchMerge(PWINDIVERT_SKETCH sketch,
+    PWINDIVERT_SKETCH other)
+{
+    PWINDIVERT_SKETCH_COUNTER counters;
+    UINT64 min, other_min;
+    SIZE_T len, i;
+    UINT count, j;
+
+    if (sketch == NULL || other == NULL || sketch == other ||
+        sketch->type != other->type ||
+        sketch->key_fields != other->key_fields ||
+        sketch->item_fields != other->item_fields ||
+        sketch->flags != other->flags || sketch->size != other->size ||
+        sketch->depth != other->depth)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    switch (sketch->type)
+    {
+        case WINDIVERT_SKETCH_COUNT_MIN:
+            len = (SIZE_T)sketch->size * sketch->depth;
+            for (i = 0; i < len; i++)
+            {
+                sketch->counters[i] += other->counters[i];
+            }
+            break;
+
+        case WINDIVERT_SKETCH_TOP_K:
+            // Keys missing from one summary may have up to that summary's
+            // minimum count, which is added to both the count and error.
+            min = (sketch->count < sketch->size? 0:
+                sketch->heap[0].entry.Count);
+            other_min = (other->count < other->size? 0:
+                other->heap[0].entry.Count);
+            count = sketch->count + other->count;
+            counters = (PWINDIVERT_SKETCH_COUNTER)HeapAlloc(sketch->pool, 0,
+                (count + 1) * sizeof(WINDIVERT_SKETCH_COUNTER));
+            if (counters == NULL)
+            {
+                SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+                return FALSE;
+            }
+            count = 0;
+            for (j = 0; j < sketch->count; j++)
+            {
+                UINT k = WinDivertSketchFind(other, &sketch->heap[j].entry.Key,
+                    sketch->heap[j].hash);
+                counters[count] = sketch->heap[j];
+                if (k != WINDIVERT_SKETCH_EMPTY)
+                {
+                    counters[count].entry.Count += other->heap[k].entry.Count;
+                    counters[count].entry.Error += other->heap[k].entry.Error;
+                }
+                else
+                {
+                    counters[count].entry.Count += other_min;
+                    counters[count].entry.Error += other_min;
+                }
+                count++;
+            }
+            for (j = 0; j < other->count; j++)
+            {
+                if (WinDivertSketchFind(sketch, &other->heap[j].entry.Key,
+                        other->heap[j].hash) != WINDIVERT_SKETCH_EMPTY)
+                {
+                    continue;
+                }
+                counters[count] = other->heap[j];
+                counters[count].entry.Count += min;
+                counters[count].entry.Error += min;
+                count++;
+            }
+
+            // Rebuild, keeping the K heaviest:
+            sketch->count = 0;
+            memset(sketch->index, 0xFF,
+                ((SIZE_T)sketch->index_mask + 1) * sizeof(UINT32));
+            for (j = 0; j < count; j++)
+            {
+                WinDivertSketchOffer(sketch, &counters[j]);
+            }
+            HeapFree(sketch->pool, 0, counters);
+            break;
+
+        default:
+            len = (SIZE_T)sketch->size << sketch->depth;
+            for (i = 0; i < len; i++)
+            {
+                if (sketch->registers[i] < other->registers[i])
+                {
+                    sketch->registers[i] = other->registers[i];
+                }
+            }
+            break;
+    }
+    sketch->total += other->total;
+    return TRUE;
+}
+
+/*
+ * Reset a sketch.
+ */
+BOOL WinDivertHelperSketchReset(PWINDIVERT_SKETCH sketch)
+{
+    if (sketch == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    switch (sketch->type)
+    {
+        case WINDIVERT_SKETCH_COUNT_MIN:
+            memset(sketch->counters, 0,
+                (SIZE_T)sketch->size * sketch->depth * sizeof(UINT64));
+            break;
+        case WINDIVERT_SKETCH_TOP_K:
+            sketch->count = 0;
+            memset(sketch->index, 0xFF,
+                ((SIZE_T)sketch->index_mask + 1) * sizeof(UINT32));
+            break;
+        default:
+            memset(sketch->registers, 0, (SIZE_T)sketch->size << sketch->depth);
+            break;
+    }
+    sketch->total = 0;
+    return TRUE;
+}
+
+/*
+ * Free a sketch.
+ */
+void WinDivertHelperSketchFree(PWINDIVERT_SKETCH sketch)
+{
+    if (sketch == NULL)
+    {
+        return;
+    }
+    HeapDestroy(sketch->pool);
+}
+
+/*
+ * Extract a key from a parsed packet.
+ */
+static void WinDivertSketchKey(UINT32 fields, const WINDIVERT_PACKET *info,
+    PWINDIVERT_SKETCH_KEY key)
+{
+    UINT i;
+
+    memset(key, 0, sizeof(WINDIVERT_SKETCH_KEY));
+    if (fields == 0)
+    {
+        return;
+    }
+    if (info->IPHeader != NULL)
+    {
+        if (fields & WINDIVERT_SKETCH_KEY_SRCADDR)
+        {
+            key->SrcAddr[0] = ntohl(info->IPHeader->SrcAddr);
+            key->SrcAddr[1] = 0x0000FFFF;
+        }
+        if (fields & WINDIVERT_SKETCH_KEY_DSTADDR)
+        {
+            key->DstAddr[0] = ntohl(info->IPHeader->DstAddr);
+            key->DstAddr[1] = 0x0000FFFF;
+        }
+    }
+    else
+    {
+        for (i = 0; i < 4; i++)
+        {
+            if (fields & WINDIVERT_SKETCH_KEY_SRCADDR)
+            {
+                key->SrcAddr[i] = ntohl(info->IPv6Header->SrcAddr[3 - i]);
+            }
+            if (fields & WINDIVERT_SKETCH_KEY_DSTADDR)
+            {
+                key->DstAddr[i] = ntohl(info->IPv6Header->DstAddr[3 - i]);
+            }
+        }
+    }
+    if (info->TCPHeader != NULL)
+    {
+        key->SrcPort = ntohs(info->TCPHeader->SrcPort);
+        key->DstPort = ntohs(info->TCPHeader->DstPort);
+    }
+    else if (info->UDPHeader != NULL)
+    {
+        key->SrcPort = ntohs(info->UDPHeader->SrcPort);
+        key->DstPort = ntohs(info->UDPHeader->DstPort);
+    }
+    key->SrcPort  = ((fields & WINDIVERT_SKETCH_KEY_SRCPORT)? key->SrcPort: 0);
+    key->DstPort  = ((fields & WINDIVERT_SKETCH_KEY_DSTPORT)? key->DstPort: 0);
+    key->Protocol = ((fields & WINDIVERT_SKETCH_KEY_PROTOCOL)?
+        (UINT8)info->Protocol: 0);
+}
+
+/*
+ * Mask a user-supplied key.
+ */
+static void WinDivertSketchMask(UINT32 fields, const WINDIVERT_SKETCH_KEY *in,
+    PWINDIVERT_SKETCH_KEY out)
+{
+    memset(out, 0, sizeof(WINDIVERT_SKETCH_KEY));
+    if (fields & WINDIVERT_SKETCH_KEY_SRCADDR)
+    {
+        memcpy(out->SrcAddr, in->SrcAddr, sizeof(out->SrcAddr));
+    }
+    if (fields & WINDIVERT_SKETCH_KEY_DSTADDR)
+    {
+        memcpy(out->DstAddr, in->DstAddr, sizeof(out->DstAddr));
+    }
+    out->SrcPort  = ((fields & WINDIVERT_SKETCH_KEY_SRCPORT)? in->SrcPort: 0);
+    out->DstPort  = ((fields & WINDIVERT_SKETCH_KEY_DSTPORT)? in->DstPort: 0);
+    out->Protocol = ((fields & WINDIVERT_SKETCH_KEY_PROTOCOL)? in->Protocol: 0);
+}
+
+/*
+ * Hash a key (xxHash64 over the 40 byte key).
+ */
+static UINT64 WinDivertSketchHash(UINT64 seed, const WINDIVERT_SKETCH_KEY *key)
+{
+    UINT64 data[sizeof(WINDIVERT_SKETCH_KEY) / sizeof(UINT64)];
+    UINT64 h64 = seed + WINDIVERT_PRIME64_4 + sizeof(WINDIVERT_SKETCH_KEY);
+    UINT i;
+
+    memcpy(data, key, sizeof(data));
+    for (i = 0; i < sizeof(data) / sizeof(data[0]); i++)
+    {
+        h64 ^= WinDivertXXH64Round(0, data[i]);
+        h64  = WINDIVERT_ROTL64(h64, 27);
+        h64  = WINDIVERT_MUL64(h64, WINDIVERT_PRIME64_1) + WINDIVERT_PRIME64_4;
+    }
+    return WinDivertXXH64Avalanche(h64);
+}
+
+/*
+ * Compare two keys.
+ */
+static BOOL WinDivertSketchKeyEqual(const WINDIVERT_SKETCH_KEY *a,
+    const WINDIVERT_SKETCH_KEY *b)
+{
+    const UINT32 *x = (const UINT32 *)a, *y = (const UINT32 *)b;
+    UINT32 diff = 0;
+    UINT i;
+
+    for (i = 0; i < sizeof(WINDIVERT_SKETCH_KEY) / sizeof(UINT32); i++)
+    {
+        diff |= x[i] ^ y[i];
+    }
+    return (diff == 0);
+}
+
+/*
+ * Apply a hashed key to a sketch.
+ */
+static void WinDivertSketchApply(PWINDIVERT_SKETCH sketch,
+    const WINDIVERT_SKETCH_KEY *key, UINT64 key_hash, UINT64 item_hash,
+    UINT64 weight)
+{
+    sketch->total += weight;
+    switch (sketch->type)
+    {
+        case WINDIVERT_SKETCH_COUNT_MIN:
+            WinDivertSketchCountMin(sketch, key_hash, weight);
+            break;
+        case WINDIVERT_SKETCH_TOP_K:
+            WinDivertSketchTopK(sketch, key, key_hash, weight);
+            break;
+        default:
+            WinDivertSketchDistinct(sketch, key_hash, item_hash);
+            break;
+    }
+}
+
+/*
+ * Count-min row indices use double hashing: (h1 + row * h2) mod width.
+ */
+#define WINDIVERT_SKETCH_ROW(sketch, hash, row)                         \
+    ((UINT)(((UINT32)(hash) + (row) * ((UINT32)((hash) >> 32) | 1)) &   \
+        ((sketch)->size - 1)) + (row) * (sketch)->size)
+
+/*
+ * Count-min update (conservative): only raise counters that are below the
+ * new estimate.
+ */
+static void WinDivertSketchCountMin(PWINDIVERT_SKETCH sketch, UINT64 hash,
+    UINT64 weight)
+{
+    UINT64 estimate;
+    UINT32 row;
+    UINT64 *counter;
+
+    estimate = WinDivertSketchCountMinQuery(sketch, hash) + weight;
+    for (row = 0; row < sketch->depth; row++)
+    {
+        counter = &sketch->counters[WINDIVERT_SKETCH_ROW(sketch, hash, row)];
+        *counter = (*counter < estimate? estimate: *counter);
+    }
+}
+
+/*
+ * Count-min query.
+ */
+static UINT64 WinDivertSketchCountMinQuery(const struct WINDIVERT_SKETCH *sketch,
+    UINT64 hash)
+{
+    UINT64 estimate = 0xFFFFFFFFFFFFFFFFull, counter;
+    UINT32 row;
+
+    for (row = 0; row < sketch->depth; row++)
+    {
+        counter = sketch->counters[WINDIVERT_SKETCH_ROW(sketch, hash, row)];
+        estimate = (counter < estimate? counter: estimate);
+    }
+    return estimate;
+}
+
+/*
+ * Find a top-K key's heap position.
+ */
+static UINT WinDivertSketchFind(const struct WINDIVERT_SKETCH *sketch,
+    const WINDIVERT_SKETCH_KEY *key, UINT64 hash)
+{
+    UINT slot = (UINT)hash & sketch->index_mask, i;
+
+    while ((i = sketch->index[slot]) != WINDIVERT_SKETCH_EMPTY)
+    {
+        if (sketch->heap[i].hash == hash &&
+            WinDivertSketchKeyEqual(&sketch->heap[i].entry.Key, key))
+        {
+            return i;
+        }
+        slot = (slot + 1) & sketch->index_mask;
+    }
+    return WINDIVERT_SKETCH_EMPTY;
+}
+
+/*
+ * Top-K (space-saving) update.
+ */
+static void WinDivertSketchTopK(PWINDIVERT_SKETCH sketch,
+    const WINDIVERT_SKETCH_KEY *key, UINT64 hash, UINT64 weight)
+{
+    PWINDIVERT_SKETCH_COUNTER counter;
+    UINT i;
+
+    i = WinDivertSketchFind(sketch, key, hash);
+    if (i != WINDIVERT_SKETCH_EMPTY)
+    {
+        sketch->heap[i].entry.Count += weight;
+        WinDivertSketchSiftDown(sketch, i);
+        return;
+    }
+    if (sketch->count < sketch->size)
+    {
+        i = sketch->count++;
+        counter = &sketch->heap[i];
+        counter->entry.Key   = *key;
+        counter->entry.Count = weight;
+        counter->entry.Error = 0;
+        counter->hash        = hash;
+        WinDivertSketchIndexInsert(sketch, i);
+        WinDivertSketchSiftUp(sketch, i);
+        return;
+    }
+
+    // Replace the minimum counter:
+    counter = &sketch->heap[0];
+    WinDivertSketchIndexRemove(sketch, 0);
+    counter->entry.Key    = *key;
+    counter->entry.Error  = counter->entry.Count;
+    counter->entry.Count += weight;
+    counter->hash         = hash;
+    WinDivertSketchIndexInsert(sketch, 0);
+    WinDivertSketchSiftDown(sketch, 0);
+}
+
+/*
+ * Offer a counter to a top-K sketch, keeping the K heaviest.
+ */
+static void WinDivertSketchOffer(PWINDIVERT_SKETCH sketch,
+    const WINDIVERT_SKETCH_COUNTER *counter)
+{
+    UINT i;
+
+    if (sketch->count < sketch->size)
+    {
+        i = sketch->count++;
+        sketch->heap[i] = *counter;
+        WinDivertSketchIndexInsert(sketch, i);
+        WinDivertSketchSiftUp(sketch, i);
+        return;
+    }
+    if (counter->entry.Count <= sketch->heap[0].entry.Count)
+    {
+        return;
+    }
+    WinDivertSketchIndexRemove(sketch, 0);
+    sketch->heap[0] = *counter;
+    WinDivertSketchIndexInsert(sketch, 0);
+    WinDivertSketchSiftDown(sketch, 0);
+}
+
+/*
+ * Index a heap entry.
+ */
+static void WinDivertSketchIndexInsert(PWINDIVERT_SKETCH sketch, UINT i)
+{
+    UINT slot = (UINT)sketch->heap[i].hash & sketch->index_mask;
+
+    while (sketch->index[slot] != WINDIVERT_SKETCH_EMPTY)
+    {
+        slot = (slot + 1) & sketch->index_mask;
+    }
+    sketch->index[slot] = i;
+    sketch->heap[i].slot = slot;
+}
+
+/*
+ * Unindex a heap entry (linear probing with backward-shift deletion).
+ */
+static void WinDivertSketchIndexRemove(PWINDIVERT_SKETCH sketch, UINT i)
+{
+    UINT mask = sketch->index_mask, hole, slot, home, j;
+
+    hole = sketch->heap[i].slot;
+    sketch->index[hole] = WINDIVERT_SKETCH_EMPTY;
+    slot = hole;
+    while (TRUE)
+    {
+        slot = (slot + 1) & mask;
+        j = sketch->index[slot];
+        if (j == WINDIVERT_SKETCH_EMPTY)
+        {
+            return;
+        }
+        home = (UINT)sketch->heap[j].hash & mask;
+        if (((slot - home) & mask) < ((slot - hole) & mask))
+        {
+            continue;
+        }
+        sketch->index[hole] = j;
+        sketch->index[slot] = WINDIVERT_SKETCH_EMPTY;
+        sketch->heap[j].slot = hole;
+        hole = slot;
+    }
+}
+
+/*
+ * Swap two heap entries.
+ */
+static void WinDivertSketchSwap(PWINDIVERT_SKETCH sketch, UINT i, UINT j)
+{
+    WINDIVERT_SKETCH_COUNTER tmp;
+
+    tmp = sketch->heap[i];
+    sketch->heap[i] = sketch->heap[j];
+    sketch->heap[j] = tmp;
+    sketch->index[sketch->heap[i].slot] = i;
+    sketch->index[sketch->heap[j].slot] = j;
+}
+
+/*
+ * Min-heap sift operations.
+ */
+static void WinDivertSketchSiftUp(PWINDIVERT_SKETCH sketch, UINT i)
+{
+    UINT parent;
+
+    while (i > 0)
+    {
+        parent = (i - 1) / 2;
+        if (sketch->heap[parent].entry.Count <= sketch->heap[i].entry.Count)
+        {
+            return;
+        }
+        WinDivertSketchSwap(sketch, i, parent);
+        i = parent;
+    }
+}
+static void WinDivertSketchSiftDown(PWINDIVERT_SKETCH sketch, UINT i)
+{
+    UINT child;
+
+    while ((child = 2 * i + 1) < sketch->count)
+    {
+        if (child + 1 < sketch->count &&
+            sketch->heap[child + 1].entry.Count <
+                sketch->heap[child].entry.Count)
+        {
+            child++;
+        }
+        if (sketch->heap[i].entry.Count <= sketch->heap[child].entry.Count)
+        {
+            return;
+        }
+        WinDivertSketchSwap(sketch, i, child);
+        i = child;
+    }
+}
+
+/*
+ * HyperLogLog update.
+ */
+static void WinDivertSketchDistinct(PWINDIVERT_SKETCH sketch, UINT64 key_hash,
+    UINT64 item_hash)
+{
+    UINT8 *registers;
+    UINT p = sketch->depth, j;
+    UINT8 rank;
+
+    registers = sketch->registers +
+        (((UINT)key_hash & (sketch->size - 1)) << p);
+    j = (UINT)(item_hash >> (64 - p));
+    rank = (UINT8)(WinDivertClz64((item_hash << p) |
+        ((UINT64)1 << (p - 1))) + 1);
+    if (registers[j] < rank)
+    {
+        registers[j] = rank;
+    }
+}
+
+/*
+ * HyperLogLog estimate.  The raw estimate is alpha * m^2 / sum(2^-M[j]),
+ * with the sum kept in 2^40 fixed point.  Small cardinalities use linear
+ * counting, m * ln(m / zeros).
+ */
+static UINT64 WinDivertSketchDistinctQuery(const struct WINDIVERT_SKETCH *sketch,
+    UINT64 hash)
+{
+    const UINT8 *registers;
+    UINT p = sketch->depth, m = (1 << p), zeros = 0, shift, j;
+    UINT64 sum = 0, alpha, num, estimate;
+    UINT32 lg;
+
+    registers = sketch->registers + (((UINT)hash & (sketch->size - 1)) << p);
+    for (j = 0; j < m; j++)
+    {
+        zeros += (registers[j] == 0);
+        sum   += (registers[j] <= 40? (UINT64)1 << (40 - registers[j]): 0);
+    }
+    if (zeros == m)
+    {
+        return 0;
+    }
+
+    // alpha in 2^-16 fixed point:
+    switch (m)
+    {
+        case 16:
+            alpha = 44106;          // 0.673
+            break;
+        case 32:
+            alpha = 45679;          // 0.697
+            break;
+        case 64:
+            alpha = 46465;          // 0.709
+            break;
+        default:
+            // 0.7213 / (1 + 1.079/m):
+            alpha = WinDivertDiv64(
+                WINDIVERT_MUL64(47271ull, (UINT64)(m * 1000)),
+                m * 1000 + 1079);
+            break;
+    }
+
+    // estimate = alpha * m^2 * 2^24 / sum, normalized to keep precision:
+    num = WINDIVERT_MUL64(alpha, WINDIVERT_MUL64((UINT64)m, m));
+    shift = WinDivertClz64(num);
+    estimate = WinDivertDiv64(num << shift, (sum == 0? 1: sum));
+    estimate = (shift <= 24? estimate << (24 - shift):
+        estimate >> (shift - 24));
+
+    if (estimate <= m * 5 / 2 && zeros != 0)
+    {
+        // m * (log2(m) - log2(zeros)) * ln(2), in 2^-32 fixed point:
+        lg = ((UINT32)p << 16) - WinDivertLog2Q16(zeros);
+        estimate = WINDIVERT_MUL64(WINDIVERT_MUL64((UINT64)lg, 45426), m);
+        estimate = (estimate + 0x80000000ull) >> 32;
+    }
+    return estimate;
+}
+
+/*
+ * 64-bit unsigned division (without the CRT).
+ */
+static UINT64 WinDivertDiv64(UINT64 a, UINT64 b)
+{
+    UINT64 q = 0, r = 0;
+    INT i;
+
+    for (i = 63; i >= 0; i--)
+    {
+        r = (r << 1) | ((a >> i) & 1);
+        if (r >= b)
+        {
+            r -= b;
+            q |= ((UINT64)1 << i);
+        }
+    }
+    return q;
+}
+
+/*
+ * log2(x) in 2^-16 fixed point (x > 0).
+ */
+static UINT32 WinDivertLog2Q16(UINT32 x)
+{
+    UINT32 result, i;
+    UINT64 y;
+
+    result = (UINT32)(63 - WinDivertClz64(x)) << 16;
+    y = ((UINT64)x << 31) >> (result >> 16);    // Mantissa in [1,2), Q31.
+    for (i = 1; i <= 16; i++)
+    {
+        y = WINDIVERT_MUL64(y, y) >> 31;
+        if (y >= ((UINT64)2 << 31))
+        {
+            y >>= 1;
+            result |= (1 << (16 - i));
+        }
+    }
+    return result;
+}
+
+/*
+ * Count leading zeros (x != 0).
+ */
+static UINT WinDivertClz64(UINT64 x)
+{
+    UINT n = 0;
+
+    if ((x >> 32) == 0)
+    {
+        n += 32;
+        x <<= 32;
+    }
+    if ((x >> 48) == 0)
+    {
+        n += 16;
+        x <<= 16;
+    }
+    if ((x >> 56) == 0)
+    {
+        n += 8;
+        x <<= 8;
+    }
+    if ((x >> 60) == 0)
+    {
+        n += 4;
+        x <<= 4;
+    }
+    if ((x >> 62) == 0)
+    {
+        n += 2;
+        x <<= 2;
+    }
+    if ((x >> 63) == 0)
+    {
+        n += 1;
+    }
+    return n;
+}
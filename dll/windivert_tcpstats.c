@@ -0,0 +1,908 @@
+/*
+ * windivert_tcpstats.c
+ * (C) 2019, all rights reserved,
+ *
+ * This file is part of WinDivert.
+ *
+ * WinDivert is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * WinDivert is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Passive TCP flow statistics.  Segments from diverted or sniffed batches are
+ * matched to a flow (in either direction), and each direction keeps just
+ * enough sequence/ack state to classify segments as it goes:
+ *
+ * - RTT: Karn's algorithm.  One new segment per direction is timed until an
+ *   acknowledgement from the other direction covers it.  Retransmitting the
+ *   timed segment cancels the sample.  Timing a SYN gives the handshake RTT.
+ *   All RTTs are measured at the capture point, so the client's RTT is the
+ *   capture point to server round trip, and vice versa.
+ * - Retransmits: a segment that does not advance the highest sequence
+ *   number.  Keep-alives and repeated zero-window probes are ignored.
+ * - Out-of-order: a segment that fills a gap in the sequence space sooner
+ *   than the sender could have retransmitted it (the sum of the two
+ *   minimum RTTs).  Otherwise (including when no RTT is known yet) it is
+ *   counted as a retransmit.  Only the oldest gap is tracked.
+ * - Zero-window: transitions to a zero receive window, and the total time
+ *   spent at zero.
+ *
+ * Memory is bounded: at most `size' flows are tracked, and at most `size'
+ * completed summaries are queued (the oldest is lost when the queue is
+ * full).  Flows are completed when both FINs are acknowledged, on RST, or
+ * when idle for longer than the timeout.  Time is WINDIVERT_ADDRESS.
+ * Timestamp, so captures can be replayed at any speed.
+ *
+ * There is no LRU list, since relinking a flow would touch two more random
+ * cache lines per packet.  Instead, a clock hand sweeps the table (two
+ * entries per packet) to complete idle flows, and when the table is full
+ * the least recently used of the next few entries is evicted.
+ */
+
+#define WINDIVERT_TCPSTATS_BLOCK        32          // Packets per block.
+#define WINDIVERT_TCPSTATS_SIZE_MIN     16
+#define WINDIVERT_TCPSTATS_SIZE_MAX     (1 << 24)
+#define WINDIVERT_TCPSTATS_NIL          UINT32_MAX
+#define WINDIVERT_TCPSTATS_USED         (UINT32_MAX - 1)
+#define WINDIVERT_TCPSTATS_SWEEP        2           // Entries per packet.
+#define WINDIVERT_TCPSTATS_EVICT        8           // Eviction candidates.
+#define WINDIVERT_TCPSTATS_SEED         0x9E3779B97F4A7C15ull
+#define WINDIVERT_TCPSTATS_SEQ_LT(a, b) ((INT32)((a) - (b)) < 0)
+#define WINDIVERT_TCPSTATS_SEQ_LEQ(a, b)    ((INT32)((a) - (b)) <= 0)
+
+#define WINDIVERT_TCPSTATS_STATE_SEQ    0x01        // max_end is valid.
+#define WINDIVERT_TCPSTATS_STATE_SYN    0x02        // SYN sent.
+#define WINDIVERT_TCPSTATS_STATE_TIMING 0x04        // Timing rtt_end.
+#define WINDIVERT_TCPSTATS_STATE_TIMED_SYN  0x08    // Timing the SYN.
+#define WINDIVERT_TCPSTATS_STATE_HOLE   0x10        // Gap [hole_lo, hole_hi).
+#define WINDIVERT_TCPSTATS_STATE_ZERO   0x20        // Zero window.
+#define WINDIVERT_TCPSTATS_STATE_FIN    0x40        // FIN sent.
+#define WINDIVERT_TCPSTATS_STATE_FIN_ACKED  0x80    // FIN acknowledged.
+
+/*
+ * Per-direction sequence state.
+ */
+typedef struct
+{
+    UINT32 max_end;                 // Highest sequence number sent + 1.
+    UINT32 rtt_end;                 // End of the timed segment.
+    UINT32 hole_lo;                 // Oldest gap (start).
+    UINT32 hole_hi;                 // Oldest gap (end).
+    UINT32 fin_end;                 // Sequence number after the FIN.
+    UINT32 flags;                   // WINDIVERT_TCPSTATS_STATE_*
+    INT64 rtt_time;                 // Time the timed segment was sent.
+    INT64 hole_time;                // Time the gap was opened.
+    INT64 zero_time;                // Time the window closed.
+} WINDIVERT_TCPSTATS_STATE, *PWINDIVERT_TCPSTATS_STATE;
+
+/*
+ * Flow entry.
+ */
+typedef struct
+{
+    WINDIVERT_TCPSTATS_FLOW flow;   // Summary.
+    WINDIVERT_TCPSTATS_STATE state[2];  // Client, server.
+    UINT64 hash;                    // Flow hash.
+    UINT32 next;                    // Free list (or USED).
+} WINDIVERT_TCPSTATS_ENTRY, *PWINDIVERT_TCPSTATS_ENTRY;
+
+/*
+ * Parsed segment.
+ */
+typedef struct
+{
+    const WINDIVERT_TCPHDR *tcp;    // TCP header (NULL = ignore).
+    UINT32 src[4];                  // Source address.
+    UINT32 dst[4];                  // Destination address.
+    UINT64 hash;                    // Flow hash.
+    UINT32 len;                     // Payload length.
+    BOOL ipv6;                      // IPv6?
+} WINDIVERT_TCPSTATS_SEGMENT, *PWINDIVERT_TCPSTATS_SEGMENT;
+
+/*
+ * TCP statistics table.
+ */
+struct WINDIVERT_TCPSTATS
+{
+    HANDLE pool;                    // Private heap.
+    PWINDIVERT_TCPSTATS_ENTRY entries;  // Flow entries.
+    UINT64 *index;                  // Hash index (tag << 32 | entry + 1).
+    PWINDIVERT_TCPSTATS_FLOW done;  // Completed summaries (ring).
+    UINT32 mask;                    // Index mask.
+    UINT32 size;                    // Maximum flows.
+    UINT32 active;                  // Active flows.
+    UINT32 free;                    // Free list.
+    UINT32 hand;                    // Clock hand.
+    UINT32 done_head;               // Oldest completed summary.
+    UINT32 done_count;              // Completed summaries.
+    INT64 timeout;                  // Idle timeout (0 = none).
+    INT64 now;                      // Latest timestamp.
+    UINT64 lost;                    // Summaries lost.
+};
+
+/*
+ * Prototypes.
+ */
+static void WinDivertTcpStatsParse(const UINT8 *packet, UINT packet_len,
+    PWINDIVERT_TCPSTATS_SEGMENT seg);
+static UINT64 WinDivertTcpStatsHash(const UINT32 *addr, UINT16 port);
+static BOOL WinDivertTcpStatsAddrEqual(const UINT32 *a, const UINT32 *b);
+static UINT32 WinDivertTcpStatsFind(const struct WINDIVERT_TCPSTATS *stats,
+    const WINDIVERT_TCPSTATS_SEGMENT *seg, UINT *dir);
+static UINT32 WinDivertTcpStatsInsert(PWINDIVERT_TCPSTATS stats,
+    const WINDIVERT_TCPSTATS_SEGMENT *seg, INT64 timestamp, UINT *dir);
+static void WinDivertTcpStatsSegment(PWINDIVERT_TCPSTATS stats, UINT32 i,
+    UINT dir, const WINDIVERT_TCPSTATS_SEGMENT *seg, INT64 timestamp);
+static void WinDivertTcpStatsSample(PWINDIVERT_TCPSTATS_DIRECTION dir,
+    INT64 rtt);
+static void WinDivertTcpStatsRetire(PWINDIVERT_TCPSTATS stats, UINT32 i,
+    UINT32 reason);
+static void WinDivertTcpStatsExpire(PWINDIVERT_TCPSTATS stats, UINT count);
+static void WinDivertTcpStatsEvict(PWINDIVERT_TCPSTATS stats);
+static void WinDivertTcpStatsIndexRemove(PWINDIVERT_TCPSTATS stats,
+    UINT32 i);
+static PWINDIVERT_TCPSTATS_DIRECTION WinDivertTcpStatsDirection(
+    PWINDIVERT_TCPSTATS_FLOW flow, UINT dir);
+
+/*
+ * Create a TCP statistics table.
+ */
+PWINDIVERT_TCPSTATS WinDivertHelperTcpStatsCreate(UINT size, INT64 timeout)
+{
+    HANDLE pool;
+    PWINDIVERT_TCPSTATS stats;
+    UINT32 index_size, i;
+
+    if (size < WINDIVERT_TCPSTATS_SIZE_MIN ||
+        size > WINDIVERT_TCPSTATS_SIZE_MAX || timeout < 0)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return NULL;
+    }
+    for (index_size = 1; index_size < 2 * size; index_size <<= 1)
+        ;
+
+    pool = HeapCreate(HEAP_NO_SERIALIZE, WINDIVERT_MIN_POOL_SIZE, 0);
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+    stats = (PWINDIVERT_TCPSTATS)HeapAlloc(pool, HEAP_ZERO_MEMORY,
+        sizeof(struct WINDIVERT_TCPSTATS));
+    if (stats == NULL)
+    {
+        goto WinDivertHelperTcpStatsCreateError;
+    }
+    stats->entries = (PWINDIVERT_TCPSTATS_ENTRY)HeapAlloc(pool, 0,
+        size * sizeof(WINDIVERT_TCPSTATS_ENTRY));
+    stats->index = (UINT64 *)HeapAlloc(pool, HEAP_ZERO_MEMORY,
+        index_size * sizeof(UINT64));
+    stats->done = (PWINDIVERT_TCPSTATS_FLOW)HeapAlloc(pool, 0,
+        size * sizeof(WINDIVERT_TCPSTATS_FLOW));
+    if (stats->entries == NULL || stats->index == NULL || stats->done == NULL)
+    {
+        goto WinDivertHelperTcpStatsCreateError;
+    }
+    for (i = 0; i < size; i++)
+    {
+        stats->entries[i].next = (i + 1 < size? i + 1:
+            WINDIVERT_TCPSTATS_NIL);
+    }
+    stats->pool    = pool;
+    stats->mask    = index_size - 1;
+    stats->size    = size;
+    stats->free    = 0;
+    stats->timeout = timeout;
+    return stats;
+
+WinDivertHelperTcpStatsCreateError:
+    HeapDestroy(pool);
+    SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+    return NULL;
+}
+
+/*
+ * Update a TCP statistics table with a batch of packets.  Non-TCP packets,
+ * fragments, and non-network layer events are ignored.
+ */
+BOOL WinDivertHelperTcpStatsUpdate(PWINDIVERT_TCPSTATS stats,
+    const VOID *pPacket, UINT packetLen, const WINDIVERT_ADDRESS *pAddr,
+    UINT addrLen)
+{
+    WINDIVERT_TCPSTATS_SEGMENT segs[WINDIVERT_TCPSTATS_BLOCK];
+    const UINT8 *packet = (const UINT8 *)pPacket;
+    UINT count, packet_len, n, i, j, dir;
+    UINT32 entry;
+
+    if (stats == NULL || pAddr == NULL ||
+        (pPacket == NULL && packetLen != 0) ||
+        addrLen % sizeof(WINDIVERT_ADDRESS) != 0)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    count = addrLen / sizeof(WINDIVERT_ADDRESS);
+
+    for (i = 0; i < count; i += n)
+    {
+        n = count - i;
+        n = (n > WINDIVERT_TCPSTATS_BLOCK? WINDIVERT_TCPSTATS_BLOCK: n);
+
+        // (1) Parse & hash:
+        for (j = 0; j < n; j++)
+        {
+            segs[j].tcp = NULL;
+            switch (pAddr[i + j].Layer)
+            {
+                case WINDIVERT_LAYER_NETWORK:
+                case WINDIVERT_LAYER_NETWORK_FORWARD:
+                    break;
+                default:
+                    continue;
+            }
+            packet_len = (packet == NULL? 0:
+                WinDivertGetPacketLength(packet, packetLen));
+            if (packet_len == 0)
+            {
+                SetLastError(ERROR_INVALID_PARAMETER);
+                return FALSE;
+            }
+            WinDivertTcpStatsParse(packet, packet_len, &segs[j]);
+            packet    += packet_len;
+            packetLen -= packet_len;
+        }
+
+        // (2) Apply:
+        for (j = 0; j < n; j++)
+        {
+            if (segs[j].tcp == NULL)
+            {
+                continue;
+            }
+            if (pAddr[i + j].Timestamp > stats->now)
+            {
+                stats->now = pAddr[i + j].Timestamp;
+            }
+            entry = WinDivertTcpStatsFind(stats, &segs[j], &dir);
+            if (entry == WINDIVERT_TCPSTATS_NIL)
+            {
+                if (segs[j].tcp->Rst)
+                {
+                    continue;       // Do not resurrect a reset flow.
+                }
+                entry = WinDivertTcpStatsInsert(stats, &segs[j],
+                    pAddr[i + j].Timestamp, &dir);
+            }
+            WinDivertTcpStatsSegment(stats, entry, dir, &segs[j],
+                pAddr[i + j].Timestamp);
+        }
+        WinDivertTcpStatsExpire(stats, n * WINDIVERT_TCPSTATS_SWEEP);
+    }
+    return TRUE;
+}
+
+/*
+ * Pop completed flow summaries (oldest first).  If `flush' is set, active
+ * flows are also completed while there is room in the queue, so repeated
+ * calls drain the table.
+ */
+BOOL WinDivertHelperTcpStatsPop(PWINDIVERT_TCPSTATS stats,
+    PWINDIVERT_TCPSTATS_FLOW pFlows, UINT flowsLen, UINT *pCount,
+    BOOL flush)
+{
+    UINT count = 0;
+    UINT32 i;
+
+    if (stats == NULL || (pFlows == NULL && flowsLen != 0))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    for (i = 0; flush && i < stats->size && stats->active > 0 &&
+            stats->done_count < stats->size; i++)
+    {
+        if (stats->entries[i].next == WINDIVERT_TCPSTATS_USED)
+        {
+            WinDivertTcpStatsRetire(stats, i, WINDIVERT_TCPSTATS_FLOW_ACTIVE);
+        }
+    }
+    while (count < flowsLen && stats->done_count > 0)
+    {
+        memcpy(&pFlows[count], &stats->done[stats->done_head],
+            sizeof(WINDIVERT_TCPSTATS_FLOW));
+        stats->done_head = (stats->done_head + 1 == stats->size? 0:
+            stats->done_head + 1);
+        stats->done_count--;
+        count++;
+    }
+    if (pCount != NULL)
+    {
+        *pCount = count;
+    }
+    return TRUE;
+}
+
+/*
+ * Copy the active flows without completing them.
+ */
+BOOL WinDivertHelperTcpStatsSnapshot(PWINDIVERT_TCPSTATS stats,
+    PWINDIVERT_TCPSTATS_FLOW pFlows, UINT flowsLen, UINT *pCount)
+{
+    PWINDIVERT_TCPSTATS_ENTRY entry;
+    UINT32 i;
+    UINT count = 0;
+
+    if (stats == NULL || (pFlows == NULL && flowsLen != 0))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    for (i = 0; i < stats->size && count < flowsLen; i++)
+    {
+        entry = stats->entries + i;
+        if (entry->next != WINDIVERT_TCPSTATS_USED)
+        {
+            continue;
+        }
+        memcpy(&pFlows[count], &entry->flow, sizeof(WINDIVERT_TCPSTATS_FLOW));
+        pFlows[count].Flags |= WINDIVERT_TCPSTATS_FLOW_ACTIVE;
+        count++;
+    }
+    if (pCount != NULL)
+    {
+        *pCount = count;
+    }
+    return TRUE;
+}
+
+/*
+ * Query TCP statistics counters.
+ */
+BOOL WinDivertHelperTcpStatsQuery(PWINDIVERT_TCPSTATS stats,
+    UINT64 *pActive, UINT64 *pPending, UINT64 *pLost)
+{
+    if (stats == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    if (pActive != NULL)
+    {
+        *pActive = stats->active;
+    }
+    if (pPending != NULL)
+    {
+        *pPending = stats->done_count;
+    }
+    if (pLost != NULL)
+    {
+        *pLost = stats->lost;
+    }
+    return TRUE;
+}
+
+/*
+ * Free a TCP statistics table.
+ */
+void WinDivertHelperTcpStatsFree(PWINDIVERT_TCPSTATS stats)
+{
+    if (stats == NULL)
+    {
+        return;
+    }
+    HeapDestroy(stats->pool);
+}
+
+/*
+ * Parse a packet.  Sets seg->tcp to NULL if the packet is not a TCP segment.
+ * Addresses use the same (host order) layout as WINDIVERT_SKETCH_KEY.
+ */
+static void WinDivertTcpStatsParse(const UINT8 *packet, UINT packet_len,
+    PWINDIVERT_TCPSTATS_SEGMENT seg)
+{
+    WINDIVERT_PACKET info;
+    UINT i;
+
+    seg->tcp = NULL;
+    if (!WinDivertHelperParsePacketEx(packet, packet_len, &info) ||
+        info.TCPHeader == NULL || info.Fragment)
+    {
+        return;
+    }
+    memset(seg->src, 0, sizeof(seg->src));
+    memset(seg->dst, 0, sizeof(seg->dst));
+    if (info.IPHeader != NULL)
+    {
+        seg->src[0] = ntohl(info.IPHeader->SrcAddr);
+        seg->src[1] = 0x0000FFFF;
+        seg->dst[0] = ntohl(info.IPHeader->DstAddr);
+        seg->dst[1] = 0x0000FFFF;
+        seg->ipv6   = FALSE;
+    }
+    else
+    {
+        for (i = 0; i < 4; i++)
+        {
+            seg->src[i] = ntohl(info.IPv6Header->SrcAddr[3 - i]);
+            seg->dst[i] = ntohl(info.IPv6Header->DstAddr[3 - i]);
+        }
+        seg->ipv6 = TRUE;
+    }
+    seg->tcp  = info.TCPHeader;
+    seg->len  = info.PayloadLength;
+
+    // The hash is symmetric, so both directions find the same flow:
+    seg->hash = WinDivertXXH64Avalanche(
+        WinDivertTcpStatsHash(seg->src, ntohs(info.TCPHeader->SrcPort)) +
+        WinDivertTcpStatsHash(seg->dst, ntohs(info.TCPHeader->DstPort)));
+}
+
+/*
+ * Hash one endpoint of a flow.
+ */
+static UINT64 WinDivertTcpStatsHash(const UINT32 *addr, UINT16 port)
+{
+    UINT64 acc = WINDIVERT_TCPSTATS_SEED;
+
+    acc = WinDivertXXH64Round(acc, ((UINT64)addr[1] << 32) | addr[0]);
+    acc = WinDivertXXH64Round(acc, ((UINT64)addr[3] << 32) | addr[2]);
+    acc = WinDivertXXH64Round(acc, (UINT64)port);
+    return WinDivertXXH64Avalanche(acc);
+}
+
+/*
+ * Compare two addresses.
+ */
+static BOOL WinDivertTcpStatsAddrEqual(const UINT32 *a, const UINT32 *b)
+{
+    return (a[0] == b[0] && a[1] == b[1] && a[2] == b[2] && a[3] == b[3]);
+}
+
+/*
+ * Find the flow of a segment, and the segment's direction (0 = client to
+ * server, 1 = server to client).
+ */
+static UINT32 WinDivertTcpStatsFind(const struct WINDIVERT_TCPSTATS *stats,
+    const WINDIVERT_TCPSTATS_SEGMENT *seg, UINT *dir)
+{
+    const WINDIVERT_TCPSTATS_FLOW *flow;
+    UINT32 tag = (UINT32)(seg->hash >> 32), i, slot;
+    UINT16 src_port = ntohs(seg->tcp->SrcPort),
+        dst_port = ntohs(seg->tcp->DstPort);
+
+    for (i = (UINT32)seg->hash & stats->mask; stats->index[i] != 0;
+            i = (i + 1) & stats->mask)
+    {
+        if ((UINT32)(stats->index[i] >> 32) != tag)
+        {
+            continue;
+        }
+        slot = (UINT32)stats->index[i] - 1;
+        flow = &stats->entries[slot].flow;
+        if (flow->ClientPort == src_port && flow->ServerPort == dst_port &&
+            WinDivertTcpStatsAddrEqual(flow->ClientAddr, seg->src) &&
+            WinDivertTcpStatsAddrEqual(flow->ServerAddr, seg->dst))
+        {
+            *dir = 0;
+            return slot;
+        }
+        if (flow->ClientPort == dst_port && flow->ServerPort == src_port &&
+            WinDivertTcpStatsAddrEqual(flow->ClientAddr, seg->dst) &&
+            WinDivertTcpStatsAddrEqual(flow->ServerAddr, seg->src))
+        {
+            *dir = 1;
+            return slot;
+        }
+    }
+    return WINDIVERT_TCPSTATS_NIL;
+}
+
+/*
+ * Insert a new flow for a segment, evicting a flow if the table is full.
+ * The sender of a SYN/ACK is the server, otherwise the sender of the first
+ * segment seen is the client.
+ */
+static UINT32 WinDivertTcpStatsInsert(PWINDIVERT_TCPSTATS stats,
+    const WINDIVERT_TCPSTATS_SEGMENT *seg, INT64 timestamp, UINT *dir)
+{
+    PWINDIVERT_TCPSTATS_ENTRY entry;
+    PWINDIVERT_TCPSTATS_FLOW flow;
+    UINT32 i, j;
+
+    if (stats->free == WINDIVERT_TCPSTATS_NIL)
+    {
+        WinDivertTcpStatsEvict(stats);
+    }
+    i = stats->free;
+    entry = stats->entries + i;
+    stats->free = entry->next;
+    memset(entry, 0, sizeof(WINDIVERT_TCPSTATS_ENTRY));
+    entry->next = WINDIVERT_TCPSTATS_USED;
+
+    flow = &entry->flow;
+    *dir = (seg->tcp->Syn && seg->tcp->Ack? 1: 0);
+    if (*dir == 0)
+    {
+        memcpy(flow->ClientAddr, seg->src, sizeof(flow->ClientAddr));
+        memcpy(flow->ServerAddr, seg->dst, sizeof(flow->ServerAddr));
+        flow->ClientPort = ntohs(seg->tcp->SrcPort);
+        flow->ServerPort = ntohs(seg->tcp->DstPort);
+    }
+    else
+    {
+        memcpy(flow->ClientAddr, seg->dst, sizeof(flow->ClientAddr));
+        memcpy(flow->ServerAddr, seg->src, sizeof(flow->ServerAddr));
+        flow->ClientPort = ntohs(seg->tcp->DstPort);
+        flow->ServerPort = ntohs(seg->tcp->SrcPort);
+    }
+    flow->Flags          = (seg->ipv6? WINDIVERT_TCPSTATS_FLOW_IPV6: 0);
+    flow->FirstTimestamp = timestamp;
+    flow->LastTimestamp  = timestamp;
+    entry->hash          = seg->hash;
+
+    for (j = (UINT32)seg->hash & stats->mask; stats->index[j] != 0;
+            j = (j + 1) & stats->mask)
+        ;
+    stats->index[j] = ((seg->hash >> 32) << 32) | (UINT64)(i + 1);
+    stats->active++;
+    return i;
+}
+
+/*
+ * Apply a segment to its flow.
+ */
+static void WinDivertTcpStatsSegment(PWINDIVERT_TCPSTATS stats, UINT32 i,
+    UINT dir, const WINDIVERT_TCPSTATS_SEGMENT *seg, INT64 timestamp)
+{
+    PWINDIVERT_TCPSTATS_ENTRY entry = stats->entries + i;
+    PWINDIVERT_TCPSTATS_FLOW flow = &entry->flow;
+    PWINDIVERT_TCPSTATS_STATE state = &entry->state[dir],
+        peer = &entry->state[dir ^ 1];
+    PWINDIVERT_TCPSTATS_DIRECTION stat =
+        WinDivertTcpStatsDirection(flow, dir),
+        peer_stat = WinDivertTcpStatsDirection(flow, dir ^ 1);
+    const WINDIVERT_TCPHDR *tcp = seg->tcp;
+    UINT32 seq = ntohl(tcp->SeqNum), ack = ntohl(tcp->AckNum), len, end;
+    BOOL new_data = FALSE, retransmit = FALSE;
+    INT64 reorder, rtt;
+
+    if (timestamp > flow->LastTimestamp)
+    {
+        flow->LastTimestamp = timestamp;
+    }
+    stat->Packets++;
+    stat->Bytes += seg->len;
+    if (tcp->Syn)
+    {
+        state->flags |= WINDIVERT_TCPSTATS_STATE_SYN;
+        flow->Flags  |= (tcp->Ack? 0: WINDIVERT_TCPSTATS_FLOW_SYN);
+    }
+
+    // (1) Sequence space:
+    len = seg->len + tcp->Syn + tcp->Fin;
+    end = seq + len;
+    if (len != 0)
+    {
+        if ((state->flags & WINDIVERT_TCPSTATS_STATE_SEQ) == 0)
+        {
+            state->flags  |= WINDIVERT_TCPSTATS_STATE_SEQ;
+            state->max_end = end;
+            new_data = TRUE;
+        }
+        else if (WINDIVERT_TCPSTATS_SEQ_LEQ(state->max_end, seq))
+        {
+            if (state->max_end != seq)
+            {
+                if ((state->flags & WINDIVERT_TCPSTATS_STATE_HOLE) == 0)
+                {
+                    state->flags    |= WINDIVERT_TCPSTATS_STATE_HOLE;
+                    state->hole_lo   = state->max_end;
+                    state->hole_time = timestamp;
+                }
+                state->hole_hi = seq;
+            }
+            state->max_end = end;
+            new_data = TRUE;
+        }
+        else if (WINDIVERT_TCPSTATS_SEQ_LT(state->max_end, end))
+        {
+            state->max_end = end;   // Repacketized.
+            retransmit = TRUE;
+        }
+        else if (seg->len <= 1 && !tcp->Syn && !tcp->Fin &&
+                 end == state->max_end)
+        {
+            ;                       // Keep-alive or zero-window probe.
+        }
+        else if ((state->flags & WINDIVERT_TCPSTATS_STATE_HOLE) != 0 &&
+                 WINDIVERT_TCPSTATS_SEQ_LEQ(state->hole_lo, seq) &&
+                 WINDIVERT_TCPSTATS_SEQ_LEQ(end, state->hole_hi))
+        {
+            reorder = (stat->RttCount != 0 && peer_stat->RttCount != 0?
+                stat->RttMin + peer_stat->RttMin: 0);
+            if (timestamp - state->hole_time < reorder)
+            {
+                stat->OutOfOrder++;
+            }
+            else
+            {
+                retransmit = TRUE;
+            }
+            if (seq == state->hole_lo)
+            {
+                state->hole_lo = end;
+            }
+            else if (end == state->hole_hi)
+            {
+                state->hole_hi = seq;
+            }
+            if (WINDIVERT_TCPSTATS_SEQ_LEQ(state->hole_hi, state->hole_lo))
+            {
+                state->flags &= ~WINDIVERT_TCPSTATS_STATE_HOLE;
+            }
+        }
+        else
+        {
+            retransmit = TRUE;
+        }
+
+        if (retransmit)
+        {
+            stat->Retransmits++;
+            if ((state->flags & WINDIVERT_TCPSTATS_STATE_TIMING) != 0 &&
+                WINDIVERT_TCPSTATS_SEQ_LT(seq, state->rtt_end))
+            {
+                state->flags &= ~(WINDIVERT_TCPSTATS_STATE_TIMING |
+                    WINDIVERT_TCPSTATS_STATE_TIMED_SYN);
+            }
+        }
+        else if (new_data &&
+                 (state->flags & WINDIVERT_TCPSTATS_STATE_TIMING) == 0)
+        {
+            state->flags   |= WINDIVERT_TCPSTATS_STATE_TIMING |
+                (tcp->Syn? WINDIVERT_TCPSTATS_STATE_TIMED_SYN: 0);
+            state->rtt_end  = end;
+            state->rtt_time = timestamp;
+        }
+        if (tcp->Fin && (state->flags & WINDIVERT_TCPSTATS_STATE_FIN) == 0)
+        {
+            state->flags  |= WINDIVERT_TCPSTATS_STATE_FIN;
+            state->fin_end = end;
+        }
+    }
+
+    // (2) Acknowledgements:
+    if (tcp->Ack)
+    {
+        if ((peer->flags & WINDIVERT_TCPSTATS_STATE_TIMING) != 0 &&
+            WINDIVERT_TCPSTATS_SEQ_LEQ(peer->rtt_end, ack))
+        {
+            rtt = timestamp - peer->rtt_time;
+            if (rtt >= 0)
+            {
+                WinDivertTcpStatsSample(peer_stat, rtt);
+                if ((peer->flags & WINDIVERT_TCPSTATS_STATE_TIMED_SYN) != 0)
+                {
+                    peer_stat->HandshakeRtt = rtt;
+                }
+            }
+            peer->flags &= ~(WINDIVERT_TCPSTATS_STATE_TIMING |
+                WINDIVERT_TCPSTATS_STATE_TIMED_SYN);
+        }
+        if ((peer->flags & WINDIVERT_TCPSTATS_STATE_FIN) != 0 &&
+            WINDIVERT_TCPSTATS_SEQ_LEQ(peer->fin_end, ack))
+        {
+            peer->flags |= WINDIVERT_TCPSTATS_STATE_FIN_ACKED;
+        }
+        if (!tcp->Syn && (state->flags & WINDIVERT_TCPSTATS_STATE_SYN) != 0 &&
+            (peer->flags & WINDIVERT_TCPSTATS_STATE_SYN) != 0)
+        {
+            flow->Flags |= WINDIVERT_TCPSTATS_FLOW_ESTABLISHED;
+        }
+    }
+
+    // (3) Receive window:
+    if (!tcp->Syn && !tcp->Rst)
+    {
+        if (tcp->Window == 0)
+        {
+            if ((state->flags & WINDIVERT_TCPSTATS_STATE_ZERO) == 0)
+            {
+                state->flags    |= WINDIVERT_TCPSTATS_STATE_ZERO;
+                state->zero_time = timestamp;
+                stat->ZeroWindows++;
+            }
+        }
+        else if ((state->flags & WINDIVERT_TCPSTATS_STATE_ZERO) != 0)
+        {
+            state->flags &= ~WINDIVERT_TCPSTATS_STATE_ZERO;
+            if (timestamp > state->zero_time)
+            {
+                stat->ZeroWindowTime += timestamp - state->zero_time;
+            }
+        }
+    }
+
+    // (4) Close:
+    if (tcp->Rst)
+    {
+        WinDivertTcpStatsRetire(stats, i, WINDIVERT_TCPSTATS_FLOW_RST);
+    }
+    else if ((state->flags & WINDIVERT_TCPSTATS_STATE_FIN_ACKED) != 0 &&
+             (peer->flags & WINDIVERT_TCPSTATS_STATE_FIN_ACKED) != 0)
+    {
+        WinDivertTcpStatsRetire(stats, i, WINDIVERT_TCPSTATS_FLOW_FIN);
+    }
+}
+
+/*
+ * Add an RTT sample.  The smoothed RTT follows RFC 6298 (alpha = 1/8).
+ */
+static void WinDivertTcpStatsSample(PWINDIVERT_TCPSTATS_DIRECTION dir,
+    INT64 rtt)
+{
+    if (dir->RttCount == 0)
+    {
+        dir->RttMin = rtt;
+        dir->RttMax = rtt;
+        dir->Srtt   = rtt;
+    }
+    else
+    {
+        dir->RttMin = (rtt < dir->RttMin? rtt: dir->RttMin);
+        dir->RttMax = (rtt > dir->RttMax? rtt: dir->RttMax);
+        dir->Srtt  += (rtt - dir->Srtt) >> 3;
+    }
+    dir->RttSum += rtt;
+    dir->RttCount++;
+}
+
+/*
+ * Complete a flow: queue its summary and free its entry.
+ */
+static void WinDivertTcpStatsRetire(PWINDIVERT_TCPSTATS stats, UINT32 i,
+    UINT32 reason)
+{
+    PWINDIVERT_TCPSTATS_ENTRY entry = stats->entries + i;
+    PWINDIVERT_TCPSTATS_FLOW flow = &entry->flow;
+    PWINDIVERT_TCPSTATS_DIRECTION stat;
+    UINT32 slot, dir;
+
+    flow->Flags |= reason;
+    for (dir = 0; dir < 2; dir++)
+    {
+        stat = WinDivertTcpStatsDirection(flow, dir);
+        if ((entry->state[dir].flags & WINDIVERT_TCPSTATS_STATE_ZERO) != 0 &&
+            flow->LastTimestamp > entry->state[dir].zero_time)
+        {
+            stat->ZeroWindowTime +=
+                flow->LastTimestamp - entry->state[dir].zero_time;
+        }
+    }
+
+    if (stats->done_count == stats->size)
+    {
+        slot = stats->done_head;
+        stats->done_head = (slot + 1 == stats->size? 0: slot + 1);
+        stats->lost++;
+    }
+    else
+    {
+        slot = stats->done_head + stats->done_count;
+        slot = (slot >= stats->size? slot - stats->size: slot);
+        stats->done_count++;
+    }
+    memcpy(&stats->done[slot], flow, sizeof(WINDIVERT_TCPSTATS_FLOW));
+
+    WinDivertTcpStatsIndexRemove(stats, i);
+    entry->next = stats->free;
+    stats->free  = i;
+    stats->active--;
+}
+
+/*
+ * Advance the clock hand, completing the flows that have been idle for
+ * longer than the timeout.
+ */
+static void WinDivertTcpStatsExpire(PWINDIVERT_TCPSTATS stats, UINT count)
+{
+    PWINDIVERT_TCPSTATS_ENTRY entry;
+
+    if (stats->timeout == 0)
+    {
+        return;
+    }
+    count = (count > stats->size? stats->size: count);
+    while (count-- > 0 && stats->active > 0)
+    {
+        entry = stats->entries + stats->hand;
+        if (entry->next == WINDIVERT_TCPSTATS_USED &&
+            stats->now - entry->flow.LastTimestamp > stats->timeout)
+        {
+            WinDivertTcpStatsRetire(stats, stats->hand,
+                WINDIVERT_TCPSTATS_FLOW_IDLE);
+        }
+        stats->hand = (stats->hand + 1 == stats->size? 0: stats->hand + 1);
+    }
+}
+
+/*
+ * Evict the least recently used of the next few flows.  Only called when
+ * the table is full, so every entry is in use.
+ */
+static void WinDivertTcpStatsEvict(PWINDIVERT_TCPSTATS stats)
+{
+    UINT32 victim = stats->hand, i;
+    INT64 oldest = stats->entries[victim].flow.LastTimestamp;
+
+    for (i = 0; i < WINDIVERT_TCPSTATS_EVICT; i++)
+    {
+        if (stats->entries[stats->hand].flow.LastTimestamp < oldest)
+        {
+            victim = stats->hand;
+            oldest = stats->entries[victim].flow.LastTimestamp;
+        }
+        stats->hand = (stats->hand + 1 == stats->size? 0: stats->hand + 1);
+    }
+    WinDivertTcpStatsRetire(stats, victim, WINDIVERT_TCPSTATS_FLOW_EVICTED);
+}
+
+/*
+ * Remove a flow from the hash index.  Later entries of the probe sequence
+ * are shifted back, so no tombstones are needed.
+ */
+static void WinDivertTcpStatsIndexRemove(PWINDIVERT_TCPSTATS stats,
+    UINT32 i)
+{
+    UINT32 mask = stats->mask, j, k, home;
+
+    for (j = (UINT32)stats->entries[i].hash & mask;
+            (UINT32)stats->index[j] != i + 1; j = (j + 1) & mask)
+        ;
+    stats->index[j] = 0;
+    for (k = (j + 1) & mask; stats->index[k] != 0; k = (k + 1) & mask)
+    {
+        home = (UINT32)stats->entries[(UINT32)stats->index[k] - 1].hash &
+            mask;
+        if (((k - home) & mask) >= ((k - j) & mask))
+        {
+            stats->index[j] = stats->index[k];
+            stats->index[k] = 0;
+            j = k;
+        }
+    }
+}
+
+/*
+ * Get the statistics of a direction.
+ */
+static PWINDIVERT_TCPSTATS_DIRECTION WinDivertTcpStatsDirection(
+    PWINDIVERT_TCPSTATS_FLOW flow, UINT dir)
+{
+    return (dir == 0? &flow->Client: &flow->Server);
+}
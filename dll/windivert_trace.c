@@ -0,0 +1,150 @@
+/*
+ * windivert_trace.c
+ * (C) 2019, all rights reserved,
+ *
+ * This file is part of WinDivert.
+ *
+ * WinDivert is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * WinDivert is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Per-handle trace ("flight recorder") of recent hot-path events.  This is
+ * shared with the driver, but has no OS dependencies so that it can be
+ * tested in isolation.  The caller supplies the clock and processor number.
+ *
+ * Events are written into per-processor rings (one ring per slot), so the
+ * recorder only ever keeps the most recent WINDIVERT_TRACE_LENGTH events of
+ * each slot.  Writers claim an entry with an interlocked increment of the
+ * ring's head (a full barrier), and publish it with a release store of the
+ * entry's sequence number.  Readers never block writers: a reader loads
+ * the sequence number with acquire semantics, copies the entry, and then
+ * re-reads the head after a barrier.  If the entry was overwritten whilst
+ * being copied, the writer's increment is visible by then, so the entry is
+ * detected as stale and skipped.  This holds on weakly ordered processors
+ * (ARM64) as well as x86, and the writer needs no barrier besides the
+ * increment.
+ */
+
+#define WINDIVERT_TRACE_SLOTS               16          // Power of 2.
+#define WINDIVERT_TRACE_LENGTH              32          // Power of 2.
+#define WINDIVERT_TRACE_MAX                                                 \
+    (WINDIVERT_TRACE_SLOTS * WINDIVERT_TRACE_LENGTH)
+
+/*
+ * A trace entry.  A seq of zero means the entry is unused.
+ */
+typedef struct
+{
+    INT64 timestamp;                // Event timestamp.
+    volatile UINT32 seq;            // Entry sequence number (+1).
+    UINT32 value;                   // Event value.
+    UINT8 type;                     // Event type.
+    UINT8 reason;                   // Event reason.
+    UINT16 processor;               // Processor number.
+    UINT32 reserved;                // Pad to 24 bytes.
+} WINDIVERT_TRACE_ENTRY, *PWINDIVERT_TRACE_ENTRY;
+
+/*
+ * Per-processor ring.
+ */
+typedef struct
+{
+    volatile UINT32 head;           // Next entry sequence number.
+    UINT32 reserved[15];            // Pad to 64 bytes.
+    WINDIVERT_TRACE_ENTRY entries[WINDIVERT_TRACE_LENGTH];
+} WINDIVERT_TRACE_SLOT, *PWINDIVERT_TRACE_SLOT;
+
+/*
+ * Per-handle trace.
+ */
+typedef struct WINDIVERT_TRACE
+{
+    WINDIVERT_TRACE_SLOT slots[WINDIVERT_TRACE_SLOTS];
+} WINDIVERT_TRACE, *PWINDIVERT_TRACE;
+
+/*
+ * Record an event.
+ */
+static void WinDivertTraceRecord(PWINDIVERT_TRACE trace, UINT32 processor,
+    INT64 now, UINT8 type, UINT8 reason, UINT32 value)
+{
+    PWINDIVERT_TRACE_SLOT slot =
+        trace->slots + (processor & (WINDIVERT_TRACE_SLOTS - 1));
+    UINT32 seq = (UINT32)InterlockedIncrement((volatile LONG *)&slot->head);
+    PWINDIVERT_TRACE_ENTRY entry =
+        slot->entries + ((seq - 1) & (WINDIVERT_TRACE_LENGTH - 1));
+
+    entry->timestamp = now;
+    entry->value     = value;
+    entry->type      = type;
+    entry->reason    = reason;
+    entry->processor = (UINT16)processor;
+    WriteULongRelease((volatile ULONG *)&entry->seq, seq);
+}
+
+/*
+ * Copy the recorded events into events[max].  Events are grouped by slot
+ * (not sorted).  Returns the number of events copied.
+ */
+static UINT WinDivertTraceSnapshot(const WINDIVERT_TRACE *trace,
+    PWINDIVERT_TRACE_EVENT events, UINT max)
+{
+    const WINDIVERT_TRACE_SLOT *slot;
+    const WINDIVERT_TRACE_ENTRY *entry;
+    UINT32 head, seq;
+    UINT i, j, count = 0;
+
+    for (i = 0; i < WINDIVERT_TRACE_SLOTS; i++)
+    {
+        slot = trace->slots + i;
+        for (j = 0; j < WINDIVERT_TRACE_LENGTH && count < max; j++)
+        {
+            entry = slot->entries + j;
+            seq = ReadULongAcquire((volatile ULONG *)&entry->seq);
+            if (seq == 0)
+            {
+                continue;
+            }
+            events[count].Timestamp = entry->timestamp;
+            events[count].Type      = entry->type;
+            events[count].Reason    = entry->reason;
+            events[count].Processor = entry->processor;
+            events[count].Value     = entry->value;
+            KeMemoryBarrier();
+            head = slot->head;
+            if ((UINT32)(head - seq) >= WINDIVERT_TRACE_LENGTH)
+            {
+                // Stale, or overwritten whilst copying:
+                continue;
+            }
+            count++;
+        }
+    }
+    return count;
+}
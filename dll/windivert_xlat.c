@@ -0,0 +1,922 @@
+/*
+ * windivert_xlat.c
+ * (C) 2019, all rights reserved,
+ *
+ * This file is part of WinDivert.
+ *
+ * WinDivert is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * WinDivert is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Stateless IPv4/IPv6 header translation (SIIT, RFC 7915).  This is the
+ * per-packet half of a NAT64 or CLAT: the caller picks the new addresses
+ * and ports (e.g. from a binding table), and the helper rewrites the
+ * headers in place:
+ *
+ * - IPv4 -> IPv6: options are dropped, and fragments get a Fragment header.
+ * - IPv6 -> IPv4: Hop-by-Hop, Destination Options and (spent) Routing
+ *   headers are dropped, and the Fragment header is translated.  Unfragmented
+ *   packets of at most 1260 bytes are sent with DF=0 and a hash-derived
+ *   Identification, larger packets with DF=1.
+ * - TCP/UDP checksums are adjusted incrementally for the new pseudo-header
+ *   and ports.  Zero IPv4 UDP checksums are computed in full.
+ * - ICMP echo is mapped to ICMPv6 echo (and back) incrementally.  ICMP
+ *   errors are rebuilt: the type/code/MTU/pointer are mapped, the quoted
+ *   packet is translated with the inner addresses, and the message is
+ *   re-checksummed (truncated to 1280 bytes).
+ *
+ * The translated packet ends where the original packet ended, so the header
+ * growth is taken from the headroom in front of the packet (if there is
+ * enough), else the packet is moved in place (if bufLen allows).  Packets
+ * that must be dropped rather than translated (e.g. unknown ICMP types,
+ * fragmented ICMP, or an expired TTL) fail with ERROR_NOT_SUPPORTED.
+ */
+
+#define WINDIVERT_XLAT_HDR_MAX      48          // IPv6 + Fragment header.
+#define WINDIVERT_XLAT_ERROR_MAX    1280        // Maximum ICMP error.
+#define WINDIVERT_XLAT_DF_MAX       1260        // Largest DF=0 packet.
+#define WINDIVERT_XLAT_MTU_MIN      1280        // Minimum IPv6 MTU.
+#define WINDIVERT_XLAT_FLAGS_ALL    WINDIVERT_XLAT_FLAG_DECREMENT_TTL
+
+#define WINDIVERT_XLAT_ICMP_ECHO_REPLY          0
+#define WINDIVERT_XLAT_ICMP_UNREACH             3
+#define WINDIVERT_XLAT_ICMP_ECHO                8
+#define WINDIVERT_XLAT_ICMP_TIME_EXCEEDED       11
+#define WINDIVERT_XLAT_ICMP_PARAM_PROBLEM       12
+#define WINDIVERT_XLAT_ICMPV6_UNREACH           1
+#define WINDIVERT_XLAT_ICMPV6_PACKET_TOO_BIG    2
+#define WINDIVERT_XLAT_ICMPV6_TIME_EXCEEDED     3
+#define WINDIVERT_XLAT_ICMPV6_PARAM_PROBLEM     4
+#define WINDIVERT_XLAT_ICMPV6_ECHO              128
+#define WINDIVERT_XLAT_ICMPV6_ECHO_REPLY        129
+
+#define WINDIVERT_XLAT_ICMP_DROP    0           // Untranslatable.
+#define WINDIVERT_XLAT_ICMP_QUERY   1           // Echo request/reply.
+#define WINDIVERT_XLAT_ICMP_ERROR   2           // Error (quotes a packet).
+
+/*
+ * Parsed IP header (either version).
+ */
+typedef struct
+{
+    const UINT8 *src;               // Source address (network order).
+    const UINT8 *dst;               // Destination address (network order).
+    UINT hdr_len;                   // IP header(s) length.
+    UINT data_len;                  // Upper-layer length (per the header).
+    UINT32 id;                      // Identification.
+    UINT16 frag_off;                // Fragment offset (8-byte units).
+    UINT8 version;                  // 4 or 6.
+    UINT8 protocol;                 // Upper-layer protocol.
+    UINT8 tos;                      // TOS/Traffic Class.
+    UINT8 ttl;                      // TTL/Hop Limit.
+    BOOL fragment;                  // Fragment (or Fragment header)?
+    BOOL mf;                        // More fragments?
+} WINDIVERT_XLAT_IP, *PWINDIVERT_XLAT_IP;
+
+/*
+ * Translated addresses and ports (network order).
+ */
+typedef struct
+{
+    UINT32 src[4];                  // Source address.
+    UINT32 dst[4];                  // Destination address.
+    UINT16 src_port;                // Source port (0 = keep).
+    UINT16 dst_port;                // Destination port (0 = keep).
+} WINDIVERT_XLAT_TARGET, *PWINDIVERT_XLAT_TARGET;
+
+/*
+ * ICMPv4 to ICMPv6 Parameter Problem pointer map (RFC 7915 Figure 3).
+ * 0xFF means the pointer cannot be translated.
+ */
+static const UINT8 WinDivertXlatPointer4To6[20] =
+{
+    0, 1, 4, 4, 0xFF, 0xFF, 0xFF, 0xFF, 7, 6, 0xFF, 0xFF, 8, 8, 8, 8,
+    24, 24, 24, 24
+};
+
+/*
+ * Prototypes.
+ */
+static BOOL WinDivertXlatParse(const UINT8 *packet, UINT len,
+    PWINDIVERT_XLAT_IP ip);
+static void WinDivertXlatTarget(const WINDIVERT_XLAT_ADDR *addr, UINT version,
+    BOOL swap, PWINDIVERT_XLAT_TARGET target);
+static UINT WinDivertXlatWriteHeader(UINT8 *hdr, const WINDIVERT_XLAT_IP *ip,
+    const WINDIVERT_XLAT_TARGET *target, UINT8 protocol, UINT data_len,
+    const UINT8 *data, UINT avail);
+static UINT WinDivertXlatIcmp(const WINDIVERT_XLAT_IP *ip, const UINT8 *icmp,
+    UINT8 *out);
+static BOOL WinDivertXlatTransport(const WINDIVERT_XLAT_IP *ip, UINT8 *data,
+    UINT avail, const WINDIVERT_XLAT_TARGET *target, const UINT8 *icmp,
+    BOOL inner);
+static UINT WinDivertXlatError(const WINDIVERT_XLAT_IP *ip, const UINT8 *data,
+    UINT avail, const UINT8 *icmp, const WINDIVERT_XLAT_TARGET *outer,
+    const WINDIVERT_XLAT_TARGET *inner, UINT8 *buf);
+static UINT32 WinDivertXlatChecksumSub(UINT32 sum, UINT32 sub);
+static UINT16 WinDivertXlatChecksumAdjust(UINT16 checksum, UINT32 sum);
+static UINT32 WinDivertXlatPseudoSum(const VOID *src, const VOID *dst,
+    UINT addr_len, UINT data_len, UINT8 protocol);
+
+/*
+ * Translate an IPv4 packet to IPv6 or vice versa.
+ */
+BOOL WinDivertHelperXlat(const WINDIVERT_XLAT_ADDR *pOuter,
+    const WINDIVERT_XLAT_ADDR *pInner, UINT64 flags, PVOID pPacket,
+    UINT packetLen, UINT headroom, UINT bufLen, PVOID *ppPacket,
+    UINT *pPacketLen, WINDIVERT_ADDRESS *pAddr)
+{
+    UINT8 *packet = (UINT8 *)pPacket, *data, *out;
+    UINT8 hdr[WINDIVERT_XLAT_HDR_MAX];
+    UINT8 buf[WINDIVERT_XLAT_HDR_MAX + WINDIVERT_XLAT_ERROR_MAX];
+    UINT8 icmp[8];
+    WINDIVERT_XLAT_IP ip;
+    WINDIVERT_XLAT_TARGET outer, inner;
+    UINT packet_len, avail, hdr_len, out_len, kind = 0;
+    UINT8 version, protocol;
+
+    if (pOuter == NULL || pPacket == NULL ||
+        (flags & ~(UINT64)WINDIVERT_XLAT_FLAGS_ALL) != 0)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    packet_len = WinDivertGetPacketLength(pPacket, packetLen);
+    if (packet_len == 0 || !WinDivertXlatParse(packet, packet_len, &ip) ||
+        ip.hdr_len + ip.data_len != packet_len)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    if ((flags & WINDIVERT_XLAT_FLAG_DECREMENT_TTL) != 0)
+    {
+        if (ip.ttl <= 1)
+        {
+            SetLastError(ERROR_NOT_SUPPORTED);
+            return FALSE;
+        }
+        ip.ttl--;
+    }
+    version = (ip.version == 4? 6: 4);
+    data = packet + ip.hdr_len;
+    avail = ip.data_len;
+    protocol = ip.protocol;
+    WinDivertXlatTarget(pOuter, version, FALSE, &outer);
+    if (ip.protocol == IPPROTO_ICMP || ip.protocol == IPPROTO_ICMPV6)
+    {
+        if (ip.protocol != (ip.version == 4? IPPROTO_ICMP: IPPROTO_ICMPV6) ||
+            ip.fragment || avail < 8)
+        {
+            SetLastError(ERROR_NOT_SUPPORTED);
+            return FALSE;
+        }
+        protocol = (version == 4? IPPROTO_ICMP: IPPROTO_ICMPV6);
+        kind = WinDivertXlatIcmp(&ip, data, icmp);
+        if (kind == WINDIVERT_XLAT_ICMP_DROP)
+        {
+            SetLastError(ERROR_NOT_SUPPORTED);
+            return FALSE;
+        }
+    }
+
+    if (kind == WINDIVERT_XLAT_ICMP_ERROR)
+    {
+        // Errors are rebuilt in a bounce buffer:
+        WinDivertXlatTarget((pInner != NULL? pInner: pOuter), version,
+            (pInner == NULL), &inner);
+        out_len = WinDivertXlatError(&ip, data, avail, icmp, &outer, &inner,
+            buf + WINDIVERT_XLAT_HDR_MAX);
+        if (out_len == 0)
+        {
+            SetLastError(ERROR_NOT_SUPPORTED);
+            return FALSE;
+        }
+        hdr_len = WinDivertXlatWriteHeader(hdr, &ip, &outer, protocol,
+            out_len, buf + WINDIVERT_XLAT_HDR_MAX, out_len);
+        if (version == 6)
+        {
+            PWINDIVERT_ICMPV6HDR icmpv6_header = (PWINDIVERT_ICMPV6HDR)
+                (buf + WINDIVERT_XLAT_HDR_MAX);
+            icmpv6_header->Checksum = WinDivertChecksumFold(
+                WinDivertChecksumAdd(WinDivertXlatPseudoSum(outer.src,
+                    outer.dst, sizeof(outer.src), out_len, IPPROTO_ICMPV6),
+                    buf + WINDIVERT_XLAT_HDR_MAX, out_len));
+        }
+        memcpy(buf + WINDIVERT_XLAT_HDR_MAX - hdr_len, hdr, hdr_len);
+        out_len += hdr_len;
+    }
+    else
+    {
+        hdr_len = WinDivertXlatWriteHeader(hdr, &ip, &outer, protocol, avail,
+            data, avail);
+        if (!WinDivertXlatTransport(&ip, data, avail, &outer,
+                (kind == WINDIVERT_XLAT_ICMP_QUERY? icmp: NULL), FALSE))
+        {
+            SetLastError(ERROR_NOT_SUPPORTED);
+            return FALSE;
+        }
+        out_len = hdr_len + avail;
+    }
+    if (version == 4 && out_len > UINT16_MAX)
+    {
+        SetLastError(ERROR_NOT_SUPPORTED);
+        return FALSE;
+    }
+
+    // Keep the end of the packet in place, using the headroom if needed:
+    if (out_len <= packet_len || out_len - packet_len <= headroom)
+    {
+        out = packet + packet_len - out_len;
+    }
+    else if (bufLen >= out_len)
+    {
+        out = packet;
+    }
+    else
+    {
+        SetLastError(ERROR_INSUFFICIENT_BUFFER);
+        return FALSE;
+    }
+    if (kind == WINDIVERT_XLAT_ICMP_ERROR)
+    {
+        memcpy(out, buf + WINDIVERT_XLAT_HDR_MAX - hdr_len, out_len);
+    }
+    else
+    {
+        WinDivertMoveMemory(out + hdr_len, data, avail);
+        memcpy(out, hdr, hdr_len);
+    }
+
+    if (ppPacket != NULL)
+    {
+        *ppPacket = out;
+    }
+    if (pPacketLen != NULL)
+    {
+        *pPacketLen = out_len;
+    }
+    if (pAddr != NULL)
+    {
+        pAddr->IPv6 = (version == 6);
+        pAddr->IPChecksum = 1;
+        pAddr->TCPChecksum = 1;
+        pAddr->UDPChecksum = 1;
+    }
+    return TRUE;
+}
+
+/*
+ * Embed an IPv4 address in an IPv6 prefix (RFC 6052).
+ */
+BOOL WinDivertHelperXlatEmbedAddress(const UINT32 *pPrefix, UINT prefixLen,
+    UINT32 ipv4Addr, UINT32 *pIpv6Addr)
+{
+    UINT32 addr[4];
+    UINT8 *bytes = (UINT8 *)addr;
+    UINT i, j;
+
+    if (pPrefix == NULL || pIpv6Addr == NULL ||
+        (prefixLen != 32 && prefixLen != 40 && prefixLen != 48 &&
+         prefixLen != 56 && prefixLen != 64 && prefixLen != 96))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    WinDivertByteSwap128(pPrefix, addr);
+    for (i = prefixLen / 8; i < 16; i++)
+    {
+        bytes[i] = 0;
+    }
+    for (i = 0, j = prefixLen / 8; i < 4; i++, j++)
+    {
+        j += (j == 8? 1: 0);            // Skip the u-octet.
+        bytes[j] = (UINT8)(ipv4Addr >> (24 - 8 * i));
+    }
+    WinDivertByteSwap128(addr, pIpv6Addr);
+    return TRUE;
+}
+
+/*
+ * Extract an IPv4 address embedded in an IPv6 prefix (RFC 6052).
+ */
+BOOL WinDivertHelperXlatExtractAddress(const UINT32 *pPrefix, UINT prefixLen,
+    const UINT32 *pIpv6Addr, UINT32 *pIpv4Addr)
+{
+    UINT32 prefix[4], addr[4], ipv4_addr = 0;
+    const UINT8 *prefix_bytes = (const UINT8 *)prefix;
+    const UINT8 *bytes = (const UINT8 *)addr;
+    UINT i, j;
+
+    if (pPrefix == NULL || pIpv6Addr == NULL || pIpv4Addr == NULL ||
+        (prefixLen != 32 && prefixLen != 40 && prefixLen != 48 &&
+         prefixLen != 56 && prefixLen != 64 && prefixLen != 96))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    WinDivertByteSwap128(pPrefix, prefix);
+    WinDivertByteSwap128(pIpv6Addr, addr);
+    for (i = 0; i < prefixLen / 8; i++)
+    {
+        if (bytes[i] != prefix_bytes[i])
+        {
+            SetLastError(ERROR_NOT_FOUND);
+            return FALSE;
+        }
+    }
+    for (i = 0, j = prefixLen / 8; i < 4; i++, j++)
+    {
+        j += (j == 8? 1: 0);
+        ipv4_addr = (ipv4_addr << 8) | (UINT32)bytes[j];
+    }
+    *pIpv4Addr = ipv4_addr;
+    return TRUE;
+}
+
+/*
+ * Parse an IPv4/IPv6 header.  The upper-layer data may be truncated (e.g. a
+ * packet quoted by an ICMP error), but the IP header(s) must be complete.
+ */
+static BOOL WinDivertXlatParse(const UINT8 *packet, UINT len,
+    PWINDIVERT_XLAT_IP ip)
+{
+    const WINDIVERT_IPHDR *ip_header = (const WINDIVERT_IPHDR *)packet;
+    const WINDIVERT_IPV6HDR *ipv6_header = (const WINDIVERT_IPV6HDR *)packet;
+    const UINT8 *ext;
+    UINT total_len;
+    UINT16 frag_off;
+    UINT8 protocol;
+    BOOL frag_hdr = FALSE;
+
+    if (len < sizeof(WINDIVERT_IPHDR))
+    {
+        return FALSE;
+    }
+    switch (ip_header->Version)
+    {
+        case 4:
+            ip->hdr_len = ip_header->HdrLength * sizeof(UINT32);
+            total_len = ntohs(ip_header->Length);
+            if (ip->hdr_len < sizeof(WINDIVERT_IPHDR) || ip->hdr_len > len ||
+                total_len < ip->hdr_len)
+            {
+                return FALSE;
+            }
+            ip->src = (const UINT8 *)&ip_header->SrcAddr;
+            ip->dst = (const UINT8 *)&ip_header->DstAddr;
+            ip->data_len = total_len - ip->hdr_len;
+            ip->id = ntohs(ip_header->Id);
+            ip->frag_off = ntohs(WINDIVERT_IPHDR_GET_FRAGOFF(ip_header));
+            ip->version = 4;
+            ip->protocol = ip_header->Protocol;
+            ip->tos = ip_header->TOS;
+            ip->ttl = ip_header->TTL;
+            ip->mf = WINDIVERT_IPHDR_GET_MF(ip_header);
+            ip->fragment = (ip->frag_off != 0 || ip->mf);
+            return TRUE;
+
+        case 6:
+            if (len < sizeof(WINDIVERT_IPV6HDR))
+            {
+                return FALSE;
+            }
+            ip->src = (const UINT8 *)ipv6_header->SrcAddr;
+            ip->dst = (const UINT8 *)ipv6_header->DstAddr;
+            ip->hdr_len = sizeof(WINDIVERT_IPV6HDR);
+            ip->id = 0;
+            ip->frag_off = 0;
+            ip->version = 6;
+            ip->tos = (UINT8)WINDIVERT_IPV6HDR_GET_TRAFFICCLASS(ipv6_header);
+            ip->ttl = ipv6_header->HopLimit;
+            ip->mf = FALSE;
+            protocol = ipv6_header->NextHdr;
+            while (ip->frag_off == 0)
+            {
+                if (protocol != IPPROTO_HOPOPTS &&
+                    protocol != IPPROTO_DSTOPTS &&
+                    protocol != IPPROTO_ROUTING &&
+                    protocol != IPPROTO_FRAGMENT)
+                {
+                    break;
+                }
+                if (ip->hdr_len + 8 > len)
+                {
+                    return FALSE;
+                }
+                ext = packet + ip->hdr_len;
+                if (protocol == IPPROTO_FRAGMENT)
+                {
+                    if (frag_hdr)
+                    {
+                        return FALSE;
+                    }
+                    frag_hdr = TRUE;
+                    frag_off = ntohs(*(const UINT16 *)(ext + 2));
+                    ip->frag_off = (frag_off >> 3);
+                    ip->mf = ((frag_off & 0x0001) != 0);
+                    ip->id = ntohl(*(const UINT32 *)(ext + 4));
+                    ip->hdr_len += 8;
+                }
+                else
+                {
+                    if (protocol == IPPROTO_ROUTING && ext[3] != 0)
+                    {
+                        return FALSE;       // Segments left.
+                    }
+                    ip->hdr_len += (ext[1] + 1) * 8;
+                }
+                protocol = ext[0];
+            }
+            total_len = ntohs(ipv6_header->Length) +
+                sizeof(WINDIVERT_IPV6HDR);
+            if (ip->hdr_len > len || ip->hdr_len > total_len)
+            {
+                return FALSE;
+            }
+            ip->data_len = total_len - ip->hdr_len;
+            ip->protocol = protocol;
+            ip->fragment = (ip->frag_off != 0 || ip->mf);
+            return TRUE;
+
+        default:
+            return FALSE;
+    }
+}
+
+/*
+ * Convert translated addresses/ports to network order.
+ */
+static void WinDivertXlatTarget(const WINDIVERT_XLAT_ADDR *addr, UINT version,
+    BOOL swap, PWINDIVERT_XLAT_TARGET target)
+{
+    const UINT32 *src = (swap? addr->DstAddr: addr->SrcAddr);
+    const UINT32 *dst = (swap? addr->SrcAddr: addr->DstAddr);
+
+    if (version == 4)
+    {
+        target->src[0] = htonl(src[0]);
+        target->dst[0] = htonl(dst[0]);
+    }
+    else
+    {
+        WinDivertByteSwap128(src, target->src);
+        WinDivertByteSwap128(dst, target->dst);
+    }
+    target->src_port = htons(swap? addr->DstPort: addr->SrcPort);
+    target->dst_port = htons(swap? addr->SrcPort: addr->DstPort);
+}
+
+/*
+ * Write the translated IP header.  Returns the header length.
+ */
+static UINT WinDivertXlatWriteHeader(UINT8 *hdr, const WINDIVERT_XLAT_IP *ip,
+    const WINDIVERT_XLAT_TARGET *target, UINT8 protocol, UINT data_len,
+    const UINT8 *data, UINT avail)
+{
+    PWINDIVERT_IPHDR ip_header = (PWINDIVERT_IPHDR)hdr;
+    PWINDIVERT_IPV6HDR ipv6_header = (PWINDIVERT_IPV6HDR)hdr;
+    UINT8 *ext = hdr + sizeof(WINDIVERT_IPV6HDR);
+    UINT64 hash, value = 0;
+    UINT16 id;
+
+    if (ip->version == 4)
+    {
+        memset(ipv6_header, 0, sizeof(WINDIVERT_IPV6HDR));
+        ipv6_header->Version = 6;
+        WINDIVERT_IPV6HDR_SET_TRAFFICCLASS(ipv6_header, ip->tos);
+        ipv6_header->Length = htons((UINT16)(data_len +
+            (ip->fragment? 8: 0)));
+        ipv6_header->NextHdr = (ip->fragment? IPPROTO_FRAGMENT: protocol);
+        ipv6_header->HopLimit = ip->ttl;
+        memcpy(ipv6_header->SrcAddr, target->src, sizeof(target->src));
+        memcpy(ipv6_header->DstAddr, target->dst, sizeof(target->dst));
+        if (!ip->fragment)
+        {
+            return sizeof(WINDIVERT_IPV6HDR);
+        }
+        ext[0] = protocol;
+        ext[1] = 0;
+        *(UINT16 *)(ext + 2) = htons((UINT16)((ip->frag_off << 3) |
+            (ip->mf? 0x0001: 0x0000)));
+        *(UINT32 *)(ext + 4) = htonl(ip->id);
+        return sizeof(WINDIVERT_IPV6HDR) + 8;
+    }
+
+    memset(ip_header, 0, sizeof(WINDIVERT_IPHDR));
+    ip_header->Version = 4;
+    ip_header->HdrLength = sizeof(WINDIVERT_IPHDR) / sizeof(UINT32);
+    ip_header->TOS = ip->tos;
+    ip_header->Length = htons((UINT16)(data_len + sizeof(WINDIVERT_IPHDR)));
+    ip_header->TTL = ip->ttl;
+    ip_header->Protocol = protocol;
+    ip_header->SrcAddr = target->src[0];
+    ip_header->DstAddr = target->dst[0];
+    if (ip->fragment)
+    {
+        ip_header->Id = htons((UINT16)ip->id);
+        WINDIVERT_IPHDR_SET_FRAGOFF(ip_header, htons(ip->frag_off));
+        WINDIVERT_IPHDR_SET_MF(ip_header, ip->mf);
+    }
+    else if (data_len + sizeof(WINDIVERT_IPHDR) <= WINDIVERT_XLAT_DF_MAX)
+    {
+        // Vary the Identification with the addresses and the start of the
+        // transport header (ports, sequence number, etc.):
+        if (avail >= sizeof(value))
+        {
+            memcpy(&value, data, sizeof(value));
+        }
+        hash = ((UINT64)target->src[0] << 32) | (UINT64)target->dst[0];
+        hash = WinDivertXXH64Avalanche(WinDivertXXH64Round(hash, value));
+        id = (UINT16)(hash ^ (hash >> 16) ^ (hash >> 32) ^ (hash >> 48));
+        ip_header->Id = (id == 0? 1: id);
+    }
+    else
+    {
+        WINDIVERT_IPHDR_SET_DF(ip_header, 1);
+    }
+    ip_header->Checksum = WinDivertChecksumFold(
+        WinDivertChecksumAdd(0, ip_header, sizeof(WINDIVERT_IPHDR)));
+    return sizeof(WINDIVERT_IPHDR);
+}
+
+/*
+ * Map an ICMP header to ICMPv6 or vice versa (RFC 7915 Sections 4.2 and
+ * 5.2).  The checksum is copied unchanged.
+ */
+static UINT WinDivertXlatIcmp(const WINDIVERT_XLAT_IP *ip, const UINT8 *icmp,
+    UINT8 *out)
+{
+    UINT8 type = icmp[0], code = icmp[1];
+    UINT32 value;
+
+    memset(out, 0, 8);
+    out[2] = icmp[2];
+    out[3] = icmp[3];
+    if (ip->version == 4)
+    {
+        switch (type)
+        {
+            case WINDIVERT_XLAT_ICMP_ECHO:
+            case WINDIVERT_XLAT_ICMP_ECHO_REPLY:
+                out[0] = (type == WINDIVERT_XLAT_ICMP_ECHO?
+                    WINDIVERT_XLAT_ICMPV6_ECHO:
+                    WINDIVERT_XLAT_ICMPV6_ECHO_REPLY);
+                memcpy(out + 4, icmp + 4, 4);
+                return WINDIVERT_XLAT_ICMP_QUERY;
+            case WINDIVERT_XLAT_ICMP_UNREACH:
+                switch (code)
+                {
+                    case 0: case 1: case 5: case 6: case 7: case 8:
+                    case 11: case 12:
+                        out[0] = WINDIVERT_XLAT_ICMPV6_UNREACH;
+                        out[1] = 0;         // No route.
+                        return WINDIVERT_XLAT_ICMP_ERROR;
+                    case 2:                 // Protocol unreachable.
+                        out[0] = WINDIVERT_XLAT_ICMPV6_PARAM_PROBLEM;
+                        out[1] = 1;
+                        out[7] = 6;         // Next Header.
+                        return WINDIVERT_XLAT_ICMP_ERROR;
+                    case 3:                 // Port unreachable.
+                        out[0] = WINDIVERT_XLAT_ICMPV6_UNREACH;
+                        out[1] = 4;
+                        return WINDIVERT_XLAT_ICMP_ERROR;
+                    case 4:                 // Fragmentation needed.
+                        value = (UINT32)ntohs(*(const UINT16 *)(icmp + 6)) +
+                            (sizeof(WINDIVERT_IPV6HDR) -
+                             sizeof(WINDIVERT_IPHDR));
+                        value = (value < WINDIVERT_XLAT_MTU_MIN?
+                            WINDIVERT_XLAT_MTU_MIN: value);
+                        out[0] = WINDIVERT_XLAT_ICMPV6_PACKET_TOO_BIG;
+                        *(UINT32 *)(out + 4) = htonl(value);
+                        return WINDIVERT_XLAT_ICMP_ERROR;
+                    case 9: case 10: case 13: case 15:
+                        out[0] = WINDIVERT_XLAT_ICMPV6_UNREACH;
+                        out[1] = 1;         // Prohibited.
+                        return WINDIVERT_XLAT_ICMP_ERROR;
+                    default:
+                        return WINDIVERT_XLAT_ICMP_DROP;
+                }
+            case WINDIVERT_XLAT_ICMP_TIME_EXCEEDED:
+                if (code > 1)
+                {
+                    return WINDIVERT_XLAT_ICMP_DROP;
+                }
+                out[0] = WINDIVERT_XLAT_ICMPV6_TIME_EXCEEDED;
+                out[1] = code;
+                return WINDIVERT_XLAT_ICMP_ERROR;
+            case WINDIVERT_XLAT_ICMP_PARAM_PROBLEM:
+                if ((code != 0 && code != 2) ||
+                    icmp[4] >= sizeof(WinDivertXlatPointer4To6) ||
+                    WinDivertXlatPointer4To6[icmp[4]] == 0xFF)
+                {
+                    return WINDIVERT_XLAT_ICMP_DROP;
+                }
+                out[0] = WINDIVERT_XLAT_ICMPV6_PARAM_PROBLEM;
+                out[7] = WinDivertXlatPointer4To6[icmp[4]];
+                return WINDIVERT_XLAT_ICMP_ERROR;
+            default:
+                return WINDIVERT_XLAT_ICMP_DROP;
+        }
+    }
+
+    switch (type)
+    {
+        case WINDIVERT_XLAT_ICMPV6_ECHO:
+        case WINDIVERT_XLAT_ICMPV6_ECHO_REPLY:
+            out[0] = (type == WINDIVERT_XLAT_ICMPV6_ECHO?
+                WINDIVERT_XLAT_ICMP_ECHO: WINDIVERT_XLAT_ICMP_ECHO_REPLY);
+            memcpy(out + 4, icmp + 4, 4);
+            return WINDIVERT_XLAT_ICMP_QUERY;
+        case WINDIVERT_XLAT_ICMPV6_UNREACH:
+            out[0] = WINDIVERT_XLAT_ICMP_UNREACH;
+            switch (code)
+            {
+                case 0: case 2: case 3:
+                    out[1] = 1;             // Host unreachable.
+                    return WINDIVERT_XLAT_ICMP_ERROR;
+                case 1:
+                    out[1] = 10;            // Host prohibited.
+                    return WINDIVERT_XLAT_ICMP_ERROR;
+                case 4:
+                    out[1] = 3;             // Port unreachable.
+                    return WINDIVERT_XLAT_ICMP_ERROR;
+                default:
+                    return WINDIVERT_XLAT_ICMP_DROP;
+            }
+        case WINDIVERT_XLAT_ICMPV6_PACKET_TOO_BIG:
+            value = ntohl(*(const UINT32 *)(icmp + 4));
+            value = (value > sizeof(WINDIVERT_IPV6HDR) -
+                sizeof(WINDIVERT_IPHDR)? value - (sizeof(WINDIVERT_IPV6HDR) -
+                sizeof(WINDIVERT_IPHDR)): 0);
+            value = (value > UINT16_MAX? UINT16_MAX: value);
+            out[0] = WINDIVERT_XLAT_ICMP_UNREACH;
+            out[1] = 4;                     // Fragmentation needed.
+            *(UINT16 *)(out + 6) = htons((UINT16)value);
+            return WINDIVERT_XLAT_ICMP_ERROR;
+        case WINDIVERT_XLAT_ICMPV6_TIME_EXCEEDED:
+            if (code > 1)
+            {
+                return WINDIVERT_XLAT_ICMP_DROP;
+            }
+            out[0] = WINDIVERT_XLAT_ICMP_TIME_EXCEEDED;
+            out[1] = code;
+            return WINDIVERT_XLAT_ICMP_ERROR;
+        case WINDIVERT_XLAT_ICMPV6_PARAM_PROBLEM:
+            if (code == 1)                  // Unrecognized Next Header.
+            {
+                out[0] = WINDIVERT_XLAT_ICMP_UNREACH;
+                out[1] = 2;
+                return WINDIVERT_XLAT_ICMP_ERROR;
+            }
+            value = ntohl(*(const UINT32 *)(icmp + 4));
+            if (code != 0 || value == 2 || value == 3 || value >= 40)
+            {
+                return WINDIVERT_XLAT_ICMP_DROP;
+            }
+            out[0] = WINDIVERT_XLAT_ICMP_PARAM_PROBLEM;
+            out[4] = (UINT8)(value < 2? value:      // Version/TOS
+                value < 6? 2:                       // Payload Length
+                value == 6? 9:                      // Next Header
+                value == 7? 8:                      // Hop Limit
+                value < 24? 12: 16);                // Addresses
+            return WINDIVERT_XLAT_ICMP_ERROR;
+        default:
+            return WINDIVERT_XLAT_ICMP_DROP;
+    }
+}
+
+/*
+ * Adjust the transport header (ports and checksum) for the new addresses.
+ * Quoted (inner) packets may be truncated, in which case only the fields
+ * that are present are rewritten.
+ */
+static BOOL WinDivertXlatTransport(const WINDIVERT_XLAT_IP *ip, UINT8 *data,
+    UINT avail, const WINDIVERT_XLAT_TARGET *target, const UINT8 *icmp,
+    BOOL inner)
+{
+    UINT16 *ports = (UINT16 *)data, *checksum, id;
+    UINT addr_len = (ip->version == 4? 4: 16);
+    UINT new_len = (ip->version == 4? 16: 4);
+    UINT checksum_off, changed;
+    UINT32 sum;
+
+    if (ip->frag_off != 0)
+    {
+        return TRUE;                        // No transport header.
+    }
+    switch (ip->protocol)
+    {
+        case IPPROTO_TCP:
+        case IPPROTO_UDP:
+            checksum_off = (ip->protocol == IPPROTO_TCP? 16: 6);
+            if (avail < (inner? 2 * sizeof(UINT16):
+                    ip->protocol == IPPROTO_TCP? sizeof(WINDIVERT_TCPHDR):
+                    sizeof(WINDIVERT_UDPHDR)))
+            {
+                return inner;
+            }
+            break;
+        case IPPROTO_ICMP:
+        case IPPROTO_ICMPV6:
+            if (icmp == NULL || avail < 8)
+            {
+                return inner;
+            }
+            checksum_off = 2;
+            break;
+        default:
+            return TRUE;
+    }
+
+    checksum = (UINT16 *)(data + checksum_off);
+    changed = (icmp != NULL? 2: 4);         // Type/code, or ports.
+    sum = WinDivertXlatChecksumSub(0, WinDivertChecksumAdd(0, data, changed));
+    if (icmp != NULL)
+    {
+        // ICMPv6 covers a pseudo-header, ICMP does not:
+        if (ip->version == 4)
+        {
+            sum += WinDivertXlatPseudoSum(target->src, target->dst, new_len,
+                ip->data_len, IPPROTO_ICMPV6);
+        }
+        else
+        {
+            sum = WinDivertXlatChecksumSub(sum, WinDivertXlatPseudoSum(
+                ip->src, ip->dst, addr_len, ip->data_len, IPPROTO_ICMPV6));
+        }
+        data[0] = icmp[0];
+        data[1] = icmp[1];
+        id = (target->src_port != 0? target->src_port: target->dst_port);
+        if (id != 0)
+        {
+            sum = WinDivertXlatChecksumSub(sum, (UINT32)ports[2]);
+            ports[2] = id;
+            sum += (UINT32)id;
+        }
+    }
+    else
+    {
+        if (target->src_port != 0)
+        {
+            ports[0] = target->src_port;
+        }
+        if (target->dst_port != 0)
+        {
+            ports[1] = target->dst_port;
+        }
+        if (ip->protocol == IPPROTO_UDP && avail >= checksum_off + 2 &&
+            *checksum == 0)
+        {
+            // No IPv4 UDP checksum, but IPv6 requires one:
+            if (ip->version == 6 || (inner && avail < ip->data_len))
+            {
+                return TRUE;
+            }
+            if (ip->fragment || avail < ip->data_len)
+            {
+                return FALSE;
+            }
+            *checksum = WinDivertChecksumFold(WinDivertChecksumAdd(
+                WinDivertXlatPseudoSum(target->src, target->dst, new_len,
+                    ip->data_len, IPPROTO_UDP), data, ip->data_len));
+            *checksum = (*checksum == 0? 0xFFFF: *checksum);
+            return TRUE;
+        }
+        sum = WinDivertXlatChecksumSub(sum, WinDivertChecksumAdd(
+            WinDivertChecksumAdd(0, ip->src, addr_len), ip->dst, addr_len));
+        sum = WinDivertChecksumAdd(WinDivertChecksumAdd(sum, target->src,
+            new_len), target->dst, new_len);
+    }
+
+    if (avail < checksum_off + sizeof(UINT16))
+    {
+        return TRUE;
+    }
+    sum = WinDivertChecksumAdd(sum, data, changed);
+    *checksum = WinDivertXlatChecksumAdjust(*checksum, sum);
+    if (ip->protocol == IPPROTO_UDP && *checksum == 0)
+    {
+        *checksum = 0xFFFF;
+    }
+    return TRUE;
+}
+
+/*
+ * Rebuild an ICMP error message: the mapped ICMP header followed by the
+ * translated quoted packet.  Returns the message length (0 = drop).
+ */
+static UINT WinDivertXlatError(const WINDIVERT_XLAT_IP *ip, const UINT8 *data,
+    UINT avail, const UINT8 *icmp, const WINDIVERT_XLAT_TARGET *outer,
+    const WINDIVERT_XLAT_TARGET *inner, UINT8 *buf)
+{
+    const UINT8 *quote = data + 8;
+    UINT8 inner_icmp[8];
+    WINDIVERT_XLAT_IP inner_ip;
+    UINT quote_len = avail - 8, hdr_len, copy_len, max_len, kind = 0;
+    UINT8 protocol;
+
+    if (!WinDivertXlatParse(quote, quote_len, &inner_ip) ||
+        inner_ip.version != ip->version)
+    {
+        return 0;
+    }
+    protocol = inner_ip.protocol;
+    if (protocol == IPPROTO_ICMP || protocol == IPPROTO_ICMPV6)
+    {
+        if (protocol != (ip->version == 4? IPPROTO_ICMP: IPPROTO_ICMPV6))
+        {
+            return 0;
+        }
+        protocol = (ip->version == 4? IPPROTO_ICMPV6: IPPROTO_ICMP);
+        if (inner_ip.frag_off == 0 && quote_len >= inner_ip.hdr_len + 8)
+        {
+            // Errors about errors are never sent, so only queries remain:
+            kind = WinDivertXlatIcmp(&inner_ip, quote + inner_ip.hdr_len,
+                inner_icmp);
+            if (kind != WINDIVERT_XLAT_ICMP_QUERY)
+            {
+                return 0;
+            }
+        }
+    }
+
+    memcpy(buf, icmp, 8);
+    buf[2] = buf[3] = 0;
+    max_len = WINDIVERT_XLAT_ERROR_MAX - (ip->version == 4?
+        sizeof(WINDIVERT_IPV6HDR): sizeof(WINDIVERT_IPHDR));
+    hdr_len = WinDivertXlatWriteHeader(buf + 8, &inner_ip, inner, protocol,
+        inner_ip.data_len, quote + inner_ip.hdr_len,
+        quote_len - inner_ip.hdr_len);
+    copy_len = quote_len - inner_ip.hdr_len;
+    copy_len = (copy_len > max_len - 8 - hdr_len? max_len - 8 - hdr_len:
+        copy_len);
+    memcpy(buf + 8 + hdr_len, quote + inner_ip.hdr_len, copy_len);
+    if (!WinDivertXlatTransport(&inner_ip, buf + 8 + hdr_len, copy_len, inner,
+            (kind == WINDIVERT_XLAT_ICMP_QUERY? inner_icmp: NULL), TRUE))
+    {
+        return 0;
+    }
+    if (ip->version == 6)
+    {
+        ((PWINDIVERT_ICMPHDR)buf)->Checksum = WinDivertChecksumFold(
+            WinDivertChecksumAdd(0, buf, 8 + hdr_len + copy_len));
+    }
+    return 8 + hdr_len + copy_len;
+}
+
+/*
+ * Subtract a (non-folded) sum from a one's complement sum.
+ */
+static UINT32 WinDivertXlatChecksumSub(UINT32 sum, UINT32 sub)
+{
+    sub = (sub & 0xFFFF) + (sub >> 16);
+    sub = (sub & 0xFFFF) + (sub >> 16);
+    return sum + (0xFFFF - sub);
+}
+
+/*
+ * Apply a sum of changes to a checksum (RFC 1624).
+ */
+static UINT16 WinDivertXlatChecksumAdjust(UINT16 checksum, UINT32 sum)
+{
+    return WinDivertChecksumFold(sum + (UINT16)~checksum);
+}
+
+/*
+ * Pseudo-header sum.  The same words cover both the IPv4 and IPv6 forms.
+ */
+static UINT32 WinDivertXlatPseudoSum(const VOID *src, const VOID *dst,
+    UINT addr_len, UINT data_len, UINT8 protocol)
+{
+    UINT32 tail[2];
+
+    tail[0] = htonl(data_len);
+    tail[1] = htonl((UINT32)protocol);
+    return WinDivertChecksumAdd(WinDivertChecksumAdd(WinDivertChecksumAdd(0,
+        src, addr_len), dst, addr_len), tail, sizeof(tail));
+}
@@ -0,0 +1,1322 @@
+/*
+ * dnscache.c
+ * (C) 2019, all rights reserved,
+ *
+ * This file is part of WinDivert.
+ *
+ * WinDivert is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * WinDivert is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+
+/*
+ * DESCRIPTION:
+ * This is a simple DNS cache that answers by injection.  Outbound DNS
+ * queries (UDP port 53) are diverted in batches:
+ *
+ * - Queries for a cached name are answered immediately: the query is turned
+ *   into a response (addresses and ports reversed, the cached answer and
+ *   authority records appended with their remaining TTL), the UDP/IP
+ *   checksums are updated incrementally, and the response is injected
+ *   inbound.  The query never leaves this host.
+ * - Other queries are forwarded unchanged, and remembered (by DNS ID,
+ *   client port and server) so that the server's response can be learned.
+ * - Responses are passed to the client unchanged.  Responses that match a
+ *   forwarded query are cached until the smallest TTL expires, including
+ *   NXDOMAIN/NODATA responses (for the SOA minimum, see RFC 2308).
+ *
+ * The cache is a set-associative table of fixed-size entries (4 ways per
+ * set), keyed by the lower-cased question.  Each entry holds the answer and
+ * authority sections exactly as received (stored right after the key, so a
+ * hit touches one or two cache lines), with the TTL fields zeroed and the
+ * offsets of the TTLs and the checksum of the records precomputed, so a
+ * response costs one lookup, one copy and a few checksum updates.  The
+ * cache and the response builder never allocate memory.
+ *
+ * Cached responses do not include an EDNS OPT record, so answers that do not
+ * fit in 512 bytes are not served from the cache.  Truncated responses and
+ * responses with an error other than NXDOMAIN are not cached.
+ *
+ * usage: dnscache.exe [cache-size]
+ *        dnscache.exe --bench [num-names]
+ */
+
+#include <winsock2.h>
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "windivert.h"
+
+#define ntohs(x)            WinDivertHelperNtohs(x)
+#define ntohl(x)            WinDivertHelperNtohl(x)
+#define htons(x)            WinDivertHelperHtons(x)
+#define htonl(x)            WinDivertHelperHtonl(x)
+
+#define MTU                 1500
+#define BATCH               64
+#define DNS_PORT            53
+#define DNS_HDR_LEN         12
+#define DNS_UDP_MAX         512             // Max response without EDNS
+#define DNS_NAME_MAX        255
+#define KEY_MAX             (DNS_NAME_MAX + 4)  // QNAME + QTYPE + QCLASS
+#define ENTRY_MAX           460             // Max key + record bytes
+#define MAX_RRS             16              // Max cached records
+#define WAYS                4               // Entries per set
+#define PENDING_BITS        12
+#define PENDING_SIZE        (1 << PENDING_BITS)
+#define PENDING_TIMEOUT     10              // Seconds
+#define TTL_MAX             86400           // Seconds
+#define NEG_TTL_MAX         900             // Seconds
+
+#define DNS_QR              0x8000
+#define DNS_OPCODE          0x7800
+#define DNS_TC              0x0200
+#define DNS_RD              0x0100
+#define DNS_RA              0x0080
+#define DNS_CD              0x0010
+#define DNS_RCODE           0x000F
+#define DNS_NOERROR         0
+#define DNS_NXDOMAIN        3
+#define DNS_TYPE_SOA        6
+#define DNS_TYPE_OPT        41
+
+/*
+ * DNS header.
+ */
+typedef struct
+{
+    UINT16 Id;
+    UINT16 Flags;
+    UINT16 QdCount;
+    UINT16 AnCount;
+    UINT16 NsCount;
+    UINT16 ArCount;
+} DNSHDR, *PDNSHDR;
+
+/*
+ * Cache entry.
+ */
+typedef struct
+{
+    UINT32 expire;                          // Expiry time (seconds)
+    UINT16 key_len;                         // Key length
+    UINT16 data_len;                        // Record data length
+    UINT16 data_sum;                        // Checksum of data (no TTLs)
+    UINT16 rcode;                           // Response code
+    UINT16 an_count;                        // Answer records
+    UINT16 ns_count;                        // Authority records
+    UINT16 num_ttls;                        // Records (= TTL fields)
+    UINT16 ttl_offs[MAX_RRS];               // TTL field offsets in data
+    UINT8 key[ENTRY_MAX];                   // Key, then the records
+} ENTRY, *PENTRY;                           // 512 bytes
+
+/*
+ * Cache set: the tags and expiry times of its entries, so that a lookup
+ * touches a single entry.
+ */
+typedef struct
+{
+    UINT32 tags[WAYS];                      // Key hash tags (0 = free)
+    UINT32 expire[WAYS];                    // Expiry times (seconds)
+} SET, *PSET;
+
+/*
+ * Forwarded query awaiting a response.
+ */
+typedef struct
+{
+    UINT64 hash;                            // Key hash (0 = free)
+    UINT32 server[4];                       // Server (network order)
+    UINT32 expire;                          // Expiry time (seconds)
+    UINT16 id;                              // DNS ID
+    UINT16 port;                            // Client port (network order)
+} PENDING, *PPENDING;
+
+/*
+ * A batch of packets.
+ */
+typedef struct
+{
+    UINT8 *packet;                          // Packet data
+    UINT packet_len;                        // Packet data length
+    UINT packet_max;                        // Packet data size
+    UINT count;                             // Number of packets
+    WINDIVERT_ADDRESS addrs[BATCH];         // Packet addresses
+} PKTBATCH, *PPKTBATCH;
+
+/*
+ * DNS cache state.
+ */
+typedef struct
+{
+    PSET sets;                              // num_sets sets
+    PENTRY entries;                         // num_sets * WAYS entries
+    UINT num_sets;                          // Power of 2
+    PPENDING pending;                       // PENDING_SIZE entries
+    UINT64 hits;                            // Queries answered
+    UINT64 misses;                          // Queries forwarded
+    UINT64 learned;                         // Responses cached
+    UINT64 uncacheable;                     // Responses not cached
+    UINT64 unsolicited;                     // Responses with no query
+    UINT64 expired;                         // Entries expired
+} DNSCACHE, *PDNSCACHE;
+
+/*
+ * Prototypes.
+ */
+static BOOL cache_init(PDNSCACHE cache, UINT size);
+static PENTRY cache_lookup(PDNSCACHE cache, const UINT8 *key, UINT key_len,
+    UINT64 hash, UINT32 now);
+static PENTRY cache_insert(PDNSCACHE cache, const UINT8 *key, UINT key_len,
+    UINT64 hash, UINT32 expire, UINT32 now);
+static void cache_learn(PDNSCACHE cache, const UINT8 *dns, UINT dns_len,
+    const UINT32 *server, UINT16 port, UINT32 now);
+static PPENDING pending_slot(PDNSCACHE cache, UINT16 id, UINT16 port);
+static void dnscache_process(PDNSCACHE cache, PPKTBATCH batch,
+    PPKTBATCH replies, UINT32 now);
+static UINT dns_question(const UINT8 *dns, UINT dns_len, UINT8 *key,
+    UINT *key_len, UINT64 *hash);
+static BOOL dns_is_query(const UINT8 *dns, UINT dns_len, UINT qlen);
+static UINT dns_respond(const UINT8 *packet, UINT hdr_len, UINT dns_len,
+    UINT qlen, const ENTRY *entry, UINT32 now, UINT8 *out, UINT out_max);
+static UINT32 checksum_sum(const UINT8 *data, UINT len);
+static UINT16 checksum_fold(UINT32 sum);
+static UINT16 checksum_swap(UINT16 sum);
+static void checksum_update16(UINT16 *checksum, UINT16 old_word,
+    UINT16 new_word);
+static UINT64 random64(UINT64 *state);
+static UINT bench_query(UINT8 *packet, UINT i, BOOL upper);
+static UINT bench_response(const UINT8 *query, UINT query_len, UINT i,
+    BOOL edns, UINT8 *packet);
+static void benchmark(UINT num_names);
+
+/*
+ * Entry.
+ */
+int __cdecl main(int argc, char **argv)
+{
+    static DNSCACHE cache;
+    static PKTBATCH batch, replies;
+    HANDLE handle;
+    UINT size = 16384, addr_len;
+    UINT32 now;
+    LARGE_INTEGER freq;
+
+    if (argc >= 2 && strcmp(argv[1], "--bench") == 0)
+    {
+        benchmark(argc >= 3? (UINT)atoi(argv[2]): 100000);
+        return 0;
+    }
+    switch (argc)
+    {
+        case 1:
+            break;
+        case 2:
+            size = (UINT)atoi(argv[1]);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [cache-size]\n", argv[0]);
+            fprintf(stderr, "       %s --bench [num-names]\n", argv[0]);
+            exit(EXIT_FAILURE);
+    }
+    if (size == 0 || !cache_init(&cache, size))
+    {
+        fprintf(stderr, "error: failed to allocate cache (%d)\n",
+            GetLastError());
+        exit(EXIT_FAILURE);
+    }
+
+    // Divert outbound queries, and the responses to this host.  Loopback
+    // packets are always outbound, so loopback responses are matched by
+    // port alone.  Our own injected responses are not diverted again.
+    handle = WinDivertOpen(
+        "(outbound and udp.DstPort == 53) or "
+        "(udp.SrcPort == 53 and (inbound or loopback))",
+        WINDIVERT_LAYER_NETWORK, 0, 0);
+    if (handle == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "error: failed to open the WinDivert device (%d)\n",
+            GetLastError());
+        exit(EXIT_FAILURE);
+    }
+
+    QueryPerformanceFrequency(&freq);
+    batch.packet_max   = BATCH * MTU;
+    batch.packet       = (UINT8 *)malloc(batch.packet_max);
+    replies.packet_max = BATCH * MTU;
+    replies.packet     = (UINT8 *)malloc(replies.packet_max);
+    if (batch.packet == NULL || replies.packet == NULL)
+    {
+        fprintf(stderr, "error: failed to allocate buffer (%d)\n",
+            GetLastError());
+        exit(EXIT_FAILURE);
+    }
+
+    // Main loop:
+    while (TRUE)
+    {
+        addr_len = sizeof(batch.addrs);
+        if (!WinDivertRecvEx(handle, batch.packet, batch.packet_max,
+                &batch.packet_len, 0, batch.addrs, &addr_len, NULL))
+        {
+            fprintf(stderr, "warning: failed to read packet (%d)\n",
+                GetLastError());
+            continue;
+        }
+        batch.count = addr_len / sizeof(WINDIVERT_ADDRESS);
+
+        now = (UINT32)(batch.addrs[0].Timestamp / freq.QuadPart);
+        dnscache_process(&cache, &batch, &replies, now);
+
+        if (replies.count != 0 &&
+            !WinDivertSendEx(handle, replies.packet, replies.packet_len,
+                NULL, 0, replies.addrs,
+                replies.count * sizeof(WINDIVERT_ADDRESS), NULL))
+        {
+            fprintf(stderr, "warning: failed to inject response (%d)\n",
+                GetLastError());
+        }
+        if (batch.count != 0 &&
+            !WinDivertSendEx(handle, batch.packet, batch.packet_len, NULL, 0,
+                batch.addrs, batch.count * sizeof(WINDIVERT_ADDRESS), NULL))
+        {
+            fprintf(stderr, "warning: failed to forward packet (%d)\n",
+                GetLastError());
+        }
+    }
+}
+
+/*
+ * Initialize an empty cache with room for (at least) size entries.
+ */
+static BOOL cache_init(PDNSCACHE cache, UINT size)
+{
+    UINT num_sets = 1;
+
+    while (num_sets * WAYS < size && num_sets < (1 << 22))
+    {
+        num_sets *= 2;
+    }
+    memset(cache, 0, sizeof(DNSCACHE));
+    cache->num_sets = num_sets;
+    cache->sets     = (PSET)calloc(num_sets, sizeof(SET));
+    cache->entries  = (PENTRY)malloc(num_sets * WAYS * sizeof(ENTRY));
+    cache->pending  = (PPENDING)calloc(PENDING_SIZE, sizeof(PENDING));
+    return (cache->sets != NULL && cache->entries != NULL &&
+        cache->pending != NULL);
+}
+
+/*
+ * Look up a question key.  Expired entries are freed.
+ */
+static PENTRY cache_lookup(PDNSCACHE cache, const UINT8 *key, UINT key_len,
+    UINT64 hash, UINT32 now)
+{
+    UINT idx = (UINT)(hash >> 32) & (cache->num_sets - 1), i;
+    PSET set = cache->sets + idx;
+    PENTRY entry;
+    UINT32 tag = (UINT32)hash | 1;
+
+    for (i = 0; i < WAYS; i++)
+    {
+        if (set->tags[i] != tag)
+        {
+            continue;
+        }
+        entry = cache->entries + idx * WAYS + i;
+        if (entry->key_len != key_len ||
+            memcmp(entry->key, key, key_len) != 0)
+        {
+            continue;
+        }
+        if ((INT32)(set->expire[i] - now) <= 0)
+        {
+            set->tags[i] = 0;
+            cache->expired++;
+            return NULL;
+        }
+        return entry;
+    }
+    return NULL;
+}
+
+/*
+ * Find the entry to (re)use for a question key: the existing entry for the
+ * key, else a free or expired entry, else the entry that expires first.
+ */
+static PENTRY cache_insert(PDNSCACHE cache, const UINT8 *key, UINT key_len,
+    UINT64 hash, UINT32 expire, UINT32 now)
+{
+    UINT idx = (UINT)(hash >> 32) & (cache->num_sets - 1), i, victim = WAYS;
+    PSET set = cache->sets + idx;
+    PENTRY entry;
+    UINT32 tag = (UINT32)hash | 1;
+    BOOL victim_free = FALSE;
+
+    for (i = 0; i < WAYS; i++)
+    {
+        entry = cache->entries + idx * WAYS + i;
+        if (set->tags[i] == tag && entry->key_len == key_len &&
+            memcmp(entry->key, key, key_len) == 0)
+        {
+            victim = i;
+            break;
+        }
+        if (set->tags[i] == 0 || (INT32)(set->expire[i] - now) <= 0)
+        {
+            if (!victim_free)
+            {
+                victim      = i;
+                victim_free = TRUE;
+            }
+        }
+        else if (!victim_free && (victim == WAYS ||
+                (INT32)(set->expire[i] - set->expire[victim]) < 0))
+        {
+            victim = i;
+        }
+    }
+    set->tags[victim]   = tag;
+    set->expire[victim] = expire;
+    entry = cache->entries + idx * WAYS + victim;
+    entry->expire  = expire;
+    entry->key_len = (UINT16)key_len;
+    memcpy(entry->key, key, key_len);
+    return entry;
+}
+
+/*
+ * Learn a response from a server (network order, IPv4 in server[0]) to the
+ * given client port.  Only responses that match a forwarded query are
+ * cached.
+ */
+static void cache_learn(PDNSCACHE cache, const UINT8 *dns, UINT dns_len,
+    const UINT32 *server, UINT16 port, UINT32 now)
+{
+    const DNSHDR *dns_header = (const DNSHDR *)dns;
+    UINT8 key[KEY_MAX];
+    UINT16 ttl_offs[MAX_RRS];
+    UINT qlen, key_len, start, off, count, an_count, i, rdlen;
+    UINT32 ttl, min_ttl;
+    UINT16 flags, type;
+    UINT64 hash;
+    PPENDING pending;
+    PENTRY entry;
+    BOOL negative, have_soa = FALSE;
+    UINT8 c, *data;
+
+    if (dns_len < DNS_HDR_LEN)
+    {
+        return;
+    }
+    flags = ntohs(dns_header->Flags);
+    if ((flags & (DNS_QR | DNS_OPCODE)) != DNS_QR ||
+        ntohs(dns_header->QdCount) != 1)
+    {
+        return;
+    }
+    qlen = dns_question(dns, dns_len, key, &key_len, &hash);
+    if (qlen == 0)
+    {
+        return;
+    }
+
+    // The response must answer a query that was forwarded to this server:
+    pending = pending_slot(cache, dns_header->Id, port);
+    if (pending->hash != hash || pending->id != dns_header->Id ||
+        pending->port != port ||
+        memcmp(pending->server, server, sizeof(pending->server)) != 0 ||
+        (INT32)(pending->expire - now) < 0)
+    {
+        cache->unsolicited++;
+        return;
+    }
+    pending->hash = 0;
+    if ((flags & DNS_TC) != 0 ||
+        ((flags & DNS_RCODE) != DNS_NOERROR &&
+         (flags & DNS_RCODE) != DNS_NXDOMAIN))
+    {
+        goto uncacheable;
+    }
+
+    // Walk the answer and authority records.  Owner names may only point
+    // backwards (into the question or earlier records), which are kept.
+    an_count = ntohs(dns_header->AnCount);
+    count    = an_count + ntohs(dns_header->NsCount);
+    negative = ((flags & DNS_RCODE) == DNS_NXDOMAIN || an_count == 0);
+    min_ttl  = (negative? NEG_TTL_MAX: TTL_MAX);
+    start    = DNS_HDR_LEN + qlen;
+    off      = start;
+    if (count > MAX_RRS)
+    {
+        goto uncacheable;
+    }
+    for (i = 0; i < count; i++)
+    {
+        while (TRUE)
+        {
+            if (off >= dns_len)
+            {
+                goto uncacheable;
+            }
+            c = dns[off];
+            if ((c & 0xC0) == 0xC0)
+            {
+                if (off + 2 > dns_len ||
+                    ((UINT)(c & 0x3F) << 8 | dns[off + 1]) >= off)
+                {
+                    goto uncacheable;
+                }
+                off += 2;
+                break;
+            }
+            if (c > 63)
+            {
+                goto uncacheable;
+            }
+            off += 1 + c;
+            if (c == 0)
+            {
+                break;
+            }
+        }
+        if (off + 10 > dns_len)
+        {
+            goto uncacheable;
+        }
+        type  = (UINT16)(dns[off] << 8 | dns[off + 1]);
+        ttl   = (UINT32)dns[off + 4] << 24 | (UINT32)dns[off + 5] << 16 |
+                (UINT32)dns[off + 6] << 8 | (UINT32)dns[off + 7];
+        rdlen = (UINT)(dns[off + 8] << 8 | dns[off + 9]);
+        ttl_offs[i] = (UINT16)(off + 4 - start);
+        off += 10;
+        if (off + rdlen > dns_len)
+        {
+            goto uncacheable;
+        }
+        ttl = (ttl > 0x7FFFFFFF? 0: ttl);   // RFC 2181
+        min_ttl = (ttl < min_ttl? ttl: min_ttl);
+        if (negative && i >= an_count && type == DNS_TYPE_SOA && rdlen >= 22)
+        {
+            // The negative TTL is min(SOA TTL, SOA MINIMUM):
+            ttl = (UINT32)dns[off + rdlen - 4] << 24 |
+                  (UINT32)dns[off + rdlen - 3] << 16 |
+                  (UINT32)dns[off + rdlen - 2] << 8 |
+                  (UINT32)dns[off + rdlen - 1];
+            min_ttl = (ttl < min_ttl? ttl: min_ttl);
+            have_soa = TRUE;
+        }
+        off += rdlen;
+    }
+    if (min_ttl == 0 || key_len + (off - start) > ENTRY_MAX ||
+        (negative && !have_soa))
+    {
+        goto uncacheable;
+    }
+
+    entry = cache_insert(cache, key, key_len, hash, now + min_ttl, now);
+    entry->data_len = (UINT16)(off - start);
+    entry->rcode    = flags & DNS_RCODE;
+    entry->an_count = (UINT16)an_count;
+    entry->ns_count = (UINT16)(count - an_count);
+    entry->num_ttls = (UINT16)count;
+    memcpy(entry->ttl_offs, ttl_offs, count * sizeof(UINT16));
+    data = entry->key + key_len;
+    memcpy(data, dns + start, entry->data_len);
+    for (i = 0; i < count; i++)
+    {
+        memset(data + ttl_offs[i], 0, sizeof(UINT32));
+    }
+    entry->data_sum = checksum_fold(checksum_sum(data,
+        entry->data_len));
+    cache->learned++;
+    return;
+
+uncacheable:
+    cache->uncacheable++;
+}
+
+/*
+ * Get the pending query slot for a DNS ID and client port.
+ */
+static PPENDING pending_slot(PDNSCACHE cache, UINT16 id, UINT16 port)
+{
+    UINT32 h = ((UINT32)id << 16 | port) * 0x9E3779B1;
+
+    return &cache->pending[h >> (32 - PENDING_BITS)];
+}
+
+/*
+ * Process a batch: answer cached queries (appended to replies), and remember
+ * forwarded queries and learn responses (both kept in the batch).
+ */
+static void dnscache_process(PDNSCACHE cache, PPKTBATCH batch,
+    PPKTBATCH replies, UINT32 now)
+{
+    PWINDIVERT_IPHDR ip_header;
+    PWINDIVERT_IPV6HDR ipv6_header;
+    PWINDIVERT_UDPHDR udp_header;
+    PWINDIVERT_ADDRESS addr, reply_addr;
+    PPENDING pending;
+    PENTRY entry;
+    const DNSHDR *dns_header;
+    UINT8 *packet = batch->packet, *out = batch->packet, *dns;
+    UINT8 key[KEY_MAX];
+    UINT remaining = batch->packet_len, count = 0, i, len, dns_len, qlen,
+        key_len, hdr_len, reply_len, next_len;
+    UINT32 server[4];
+    UINT64 hash;
+    PVOID data, next;
+
+    replies->packet_len = 0;
+    replies->count      = 0;
+    for (i = 0; i < batch->count; i++, packet += len, remaining = next_len)
+    {
+        if (!WinDivertHelperParsePacket(packet, remaining, &ip_header,
+                &ipv6_header, NULL, NULL, NULL, NULL, &udp_header, &data,
+                &dns_len, &next, &next_len))
+        {
+            break;
+        }
+        len  = remaining - next_len;
+        addr = &batch->addrs[i];
+        dns  = (UINT8 *)data;
+        if (udp_header == NULL || dns == NULL ||
+            ntohs(udp_header->Length) !=
+                sizeof(WINDIVERT_UDPHDR) + dns_len ||
+            (ip_header != NULL && (WINDIVERT_IPHDR_GET_MF(ip_header) ||
+                WINDIVERT_IPHDR_GET_FRAGOFF(ip_header) != 0)))
+        {
+            goto keep;
+        }
+        memset(server, 0, sizeof(server));
+        if (udp_header->DstPort == htons(DNS_PORT) && addr->Outbound)
+        {
+            qlen = dns_question(dns, dns_len, key, &key_len, &hash);
+            if (qlen == 0 || !dns_is_query(dns, dns_len, qlen))
+            {
+                goto keep;
+            }
+            entry = cache_lookup(cache, key, key_len, hash, now);
+            hdr_len = (UINT)(dns - packet);
+            if (entry != NULL && replies->count < BATCH)
+            {
+                reply_len = dns_respond(packet, hdr_len, dns_len, qlen,
+                    entry, now, replies->packet + replies->packet_len,
+                    replies->packet_max - replies->packet_len);
+                if (reply_len != 0)
+                {
+                    reply_addr  = &replies->addrs[replies->count];
+                    *reply_addr = *addr;
+                    if (!addr->UDPChecksum ||
+                        (ip_header != NULL && !addr->IPChecksum))
+                    {
+                        // The query's checksums were left to the NIC, so
+                        // the incremental update had nothing to start from:
+                        WinDivertHelperCalcChecksums(
+                            replies->packet + replies->packet_len,
+                            reply_len, NULL, 0);
+                    }
+                    reply_addr->Outbound    = addr->Loopback;
+                    reply_addr->IPChecksum  = 1;
+                    reply_addr->UDPChecksum = 1;
+                    replies->packet_len += reply_len;
+                    replies->count++;
+                    cache->hits++;
+                    continue;
+                }
+            }
+            cache->misses++;
+
+            // Remember the query, to learn the response:
+            dns_header = (const DNSHDR *)dns;
+            pending = pending_slot(cache, dns_header->Id,
+                udp_header->SrcPort);
+            if (ip_header != NULL)
+            {
+                server[0] = ip_header->DstAddr;
+            }
+            else
+            {
+                memcpy(server, ipv6_header->DstAddr, sizeof(server));
+            }
+            memcpy(pending->server, server, sizeof(server));
+            pending->hash   = hash;
+            pending->expire = now + PENDING_TIMEOUT;
+            pending->id     = dns_header->Id;
+            pending->port   = udp_header->SrcPort;
+        }
+        else if (udp_header->SrcPort == htons(DNS_PORT))
+        {
+            if (ip_header != NULL)
+            {
+                server[0] = ip_header->SrcAddr;
+            }
+            else
+            {
+                memcpy(server, ipv6_header->SrcAddr, sizeof(server));
+            }
+            cache_learn(cache, dns, dns_len, server, udp_header->DstPort,
+                now);
+        }
+
+keep:
+        // Compact the batch over any answered queries:
+        if (out != packet)
+        {
+            memmove(out, packet, len);
+        }
+        if (count != i)
+        {
+            batch->addrs[count] = batch->addrs[i];
+        }
+        out += len;
+        count++;
+    }
+    batch->packet_len = (UINT)(out - batch->packet);
+    batch->count      = count;
+}
+
+/*
+ * Parse the question of a DNS message, and build its cache key (the
+ * lower-cased QNAME, QTYPE and QCLASS) and key hash.  Returns the question
+ * length, or 0 if the question is invalid.
+ */
+static UINT dns_question(const UINT8 *dns, UINT dns_len, UINT8 *key,
+    UINT *key_len, UINT64 *hash)
+{
+    UINT off = DNS_HDR_LEN, len, i;
+    UINT64 h = 0x9E3779B97F4A7C15ull, w;
+    UINT8 c;
+
+    // Validate the labels (no compression in questions):
+    do
+    {
+        if (off >= dns_len)
+        {
+            return 0;
+        }
+        len = dns[off];
+        off += 1 + len;
+        if (len > 63 || off - DNS_HDR_LEN > DNS_NAME_MAX)
+        {
+            return 0;
+        }
+    }
+    while (len != 0);
+    len = off - DNS_HDR_LEN + 4;
+    if (off + 4 > dns_len)
+    {
+        return 0;
+    }
+
+    // Label lengths are < 'A', so the whole name can be lower-cased at once:
+    dns += DNS_HDR_LEN;
+    for (i = 0; i < len - 4; i++)
+    {
+        c = dns[i];
+        key[i] = c | (UINT8)((c - 'A' < 26u) << 5);
+    }
+    memcpy(key + i, dns + i, 4);
+
+    // Hash 8 bytes at a time:
+    for (i = 0; i + sizeof(w) <= len; i += sizeof(w))
+    {
+        memcpy(&w, key + i, sizeof(w));
+        h = (h ^ w) * 0xFF51AFD7ED558CCDull;
+        h ^= h >> 32;
+    }
+    w = 0;
+    memcpy(&w, key + i, len - i);
+    h = (h ^ w ^ len) * 0xC4CEB9FE1A85EC53ull;
+    h ^= h >> 29;
+    *key_len = len;
+    *hash    = (h == 0? 1: h);
+    return len;
+}
+
+/*
+ * Check that a DNS message is a standard query with one question, and
+ * nothing else except (optionally) an EDNS OPT record.
+ */
+static BOOL dns_is_query(const UINT8 *dns, UINT dns_len, UINT qlen)
+{
+    const DNSHDR *dns_header = (const DNSHDR *)dns;
+    UINT off = DNS_HDR_LEN + qlen;
+
+    if ((ntohs(dns_header->Flags) & (DNS_QR | DNS_OPCODE)) != 0 ||
+        ntohs(dns_header->QdCount) != 1 || dns_header->AnCount != 0 ||
+        dns_header->NsCount != 0)
+    {
+        return FALSE;
+    }
+    switch (ntohs(dns_header->ArCount))
+    {
+        case 0:
+            return TRUE;
+        case 1:
+            return (off + 11 <= dns_len && dns[off] == 0 &&
+                (dns[off + 1] << 8 | dns[off + 2]) == DNS_TYPE_OPT);
+        default:
+            return FALSE;
+    }
+}
+
+/*
+ * Turn a query (hdr_len bytes of IP/UDP headers, then dns_len bytes of DNS
+ * message with a qlen byte question) into the response for a cache entry.
+ * The response is written to out, and its length is returned (0 if it does
+ * not fit).  The IP and UDP checksums are updated incrementally (RFC 1624):
+ * reversing the addresses and ports does not change the sums, so only the
+ * lengths, the DNS header, the removed OPT record and the appended records
+ * (whose sum is cached, except for the TTLs) need to be accounted for.
+ */
+static UINT dns_respond(const UINT8 *packet, UINT hdr_len, UINT dns_len,
+    UINT qlen, const ENTRY *entry, UINT32 now, UINT8 *out, UINT out_max)
+{
+    PWINDIVERT_IPHDR ip_header = (PWINDIVERT_IPHDR)out;
+    PWINDIVERT_IPV6HDR ipv6_header = (PWINDIVERT_IPV6HDR)out;
+    PWINDIVERT_UDPHDR udp_header;
+    PDNSHDR dns_header;
+    UINT keep_len = DNS_HDR_LEN + qlen, out_len, i;
+    UINT32 addr_tmp[4], sum = 0, ttl = entry->expire - now;
+    UINT16 old_len, new_len, old_word, new_word, port_tmp, ttl_hi, ttl_lo;
+    UINT8 *data;
+    BOOL odd = ((keep_len & 1) != 0);
+
+    out_len = hdr_len + keep_len + entry->data_len;
+    if (keep_len + entry->data_len > DNS_UDP_MAX || out_len > out_max)
+    {
+        return 0;
+    }
+    memcpy(out, packet, hdr_len + keep_len);
+    udp_header = (PWINDIVERT_UDPHDR)(out + hdr_len -
+        sizeof(WINDIVERT_UDPHDR));
+    dns_header = (PDNSHDR)(out + hdr_len);
+
+    // Reverse the addresses and ports, and fix the IP length:
+    if (ip_header->Version == 4)
+    {
+        addr_tmp[0]        = ip_header->SrcAddr;
+        ip_header->SrcAddr = ip_header->DstAddr;
+        ip_header->DstAddr = addr_tmp[0];
+        old_word           = ip_header->Length;
+        ip_header->Length  = htons((UINT16)out_len);
+        checksum_update16(&ip_header->Checksum, old_word, ip_header->Length);
+    }
+    else
+    {
+        memcpy(addr_tmp, ipv6_header->SrcAddr, sizeof(addr_tmp));
+        memcpy(ipv6_header->SrcAddr, ipv6_header->DstAddr, sizeof(addr_tmp));
+        memcpy(ipv6_header->DstAddr, addr_tmp, sizeof(addr_tmp));
+        ipv6_header->Length =
+            htons((UINT16)(out_len - sizeof(WINDIVERT_IPV6HDR)));
+    }
+    port_tmp            = udp_header->SrcPort;
+    udp_header->SrcPort = udp_header->DstPort;
+    udp_header->DstPort = port_tmp;
+
+    // The UDP length appears twice (header and pseudo-header):
+    old_len = ntohs(udp_header->Length);
+    new_len = (UINT16)(sizeof(WINDIVERT_UDPHDR) + keep_len +
+        entry->data_len);
+    udp_header->Length = htons(new_len);
+    sum += 2 * ((UINT16)~old_len + (UINT32)new_len);
+
+    // DNS header (the ID and question count are unchanged):
+    old_word = ntohs(dns_header->Flags);
+    new_word = DNS_QR | DNS_RA | (old_word & (DNS_RD | DNS_CD)) |
+        entry->rcode;
+    dns_header->Flags = htons(new_word);
+    sum += (UINT16)~old_word + (UINT32)new_word;
+    sum += (UINT16)~ntohs(dns_header->AnCount) + (UINT32)entry->an_count;
+    sum += (UINT16)~ntohs(dns_header->NsCount) + (UINT32)entry->ns_count;
+    sum += (UINT16)~ntohs(dns_header->ArCount);
+    dns_header->AnCount = htons(entry->an_count);
+    dns_header->NsCount = htons(entry->ns_count);
+    dns_header->ArCount = 0;
+
+    // Replace the query's OPT record (if any) with the cached records.  Both
+    // start at the same offset, so share the same byte alignment.
+    old_word = checksum_fold(checksum_sum(packet + hdr_len + keep_len,
+        dns_len - keep_len));
+    new_word = entry->data_sum;
+    sum += (UINT16)~(odd? checksum_swap(old_word): old_word);
+    sum += (odd? checksum_swap(new_word): new_word);
+    data = out + hdr_len + keep_len;
+    memcpy(data, entry->key + entry->key_len, entry->data_len);
+    ttl_hi = (UINT16)(ttl >> 16);
+    ttl_lo = (UINT16)ttl;
+    for (i = 0; i < entry->num_ttls; i++)
+    {
+        *(UINT32 *)(data + entry->ttl_offs[i]) = htonl(ttl);
+        if (((keep_len + entry->ttl_offs[i]) & 1) != 0)
+        {
+            sum += checksum_swap(ttl_hi) + (UINT32)checksum_swap(ttl_lo);
+        }
+        else
+        {
+            sum += ttl_hi + (UINT32)ttl_lo;
+        }
+    }
+
+    // A zero (IPv4) UDP checksum means no checksum, and stays that way:
+    if (udp_header->Checksum != 0)
+    {
+        sum = (UINT16)~ntohs(udp_header->Checksum) +
+            (UINT32)checksum_fold(sum);
+        new_word = (UINT16)~checksum_fold(sum);
+        udp_header->Checksum = htons(new_word == 0? 0xFFFF: new_word);
+    }
+    return out_len;
+}
+
+/*
+ * One's complement sum of big-endian 16-bit words (unfolded).
+ */
+static UINT32 checksum_sum(const UINT8 *data, UINT len)
+{
+    UINT32 sum = 0;
+    UINT i;
+
+    for (i = 0; i + 1 < len; i += 2)
+    {
+        sum += (UINT32)data[i] << 8 | data[i + 1];
+    }
+    if (i < len)
+    {
+        sum += (UINT32)data[i] << 8;
+    }
+    return sum;
+}
+
+/*
+ * Fold a one's complement sum to 16 bits.
+ */
+static UINT16 checksum_fold(UINT32 sum)
+{
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return (UINT16)sum;
+}
+
+/*
+ * The sum of the same bytes starting at an odd offset is byte-swapped
+ * (RFC 1071).
+ */
+static UINT16 checksum_swap(UINT16 sum)
+{
+    return (UINT16)((sum >> 8) | (sum << 8));
+}
+
+/*
+ * Incremental checksum update (RFC 1624).
+ */
+static void checksum_update16(UINT16 *checksum, UINT16 old_word,
+    UINT16 new_word)
+{
+    UINT32 sum;
+
+    sum = (UINT16)~*checksum;
+    sum += (UINT16)~old_word;
+    sum += new_word;
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum += (sum >> 16);
+    *checksum = (UINT16)~sum;
+}
+
+/*
+ * Pseudo-random number generator (xorshift64*).
+ */
+static UINT64 random64(UINT64 *state)
+{
+    UINT64 x = *state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1Dull;
+}
+
+/*
+ * Build the query for name i ("hNNNNNN.bN.example.com"): IPv4 or IPv6 (1 in
+ * 4), with an EDNS OPT record (1 in 2), from client port 10000 + i % 50000.
+ */
+static UINT bench_query(UINT8 *packet, UINT i, BOOL upper)
+{
+    static const char hex[] = "0123456789abcdef";
+    PWINDIVERT_IPHDR ip_header = (PWINDIVERT_IPHDR)packet;
+    PWINDIVERT_IPV6HDR ipv6_header = (PWINDIVERT_IPV6HDR)packet;
+    PWINDIVERT_UDPHDR udp_header;
+    PDNSHDR dns_header;
+    BOOL ipv6 = (i % 4 == 3), edns = (i % 2 == 0);
+    UINT hdr_len = (ipv6? sizeof(WINDIVERT_IPV6HDR): sizeof(WINDIVERT_IPHDR)),
+        len, j;
+    UINT8 *q;
+
+    memset(packet, 0, hdr_len + sizeof(WINDIVERT_UDPHDR) + DNS_HDR_LEN);
+    udp_header = (PWINDIVERT_UDPHDR)(packet + hdr_len);
+    dns_header = (PDNSHDR)(udp_header + 1);
+    dns_header->Id      = htons((UINT16)(i * 7919));
+    dns_header->Flags   = htons(DNS_RD);
+    dns_header->QdCount = htons(1);
+    dns_header->ArCount = htons(edns? 1: 0);
+    q = (UINT8 *)(dns_header + 1);
+    *q++ = 7;
+    *q++ = (upper? 'H': 'h');
+    for (j = 0; j < 6; j++)
+    {
+        *q++ = hex[(i >> (20 - 4 * j)) & 0xF];
+    }
+    *q++ = 2;
+    *q++ = 'b';
+    *q++ = hex[i % 16];
+    memcpy(q, "\7example\3com\0", 13);
+    q += 13;
+    *q++ = 0;
+    *q++ = (ipv6? 28: 1);                   // AAAA or A
+    *q++ = 0;
+    *q++ = 1;                               // IN
+    if (edns)
+    {
+        memcpy(q, "\0\0\x29\x10\0\0\0\0\0\0\0", 11);
+        q += 11;
+    }
+    len = (UINT)(q - packet);
+    udp_header->SrcPort = htons((UINT16)(10000 + i % 50000));
+    udp_header->DstPort = htons(DNS_PORT);
+    udp_header->Length  = htons((UINT16)(len - hdr_len));
+    if (ipv6)
+    {
+        ipv6_header->Version  = 6;
+        ipv6_header->Length   = htons((UINT16)(len - hdr_len));
+        ipv6_header->NextHdr  = IPPROTO_UDP;
+        ipv6_header->HopLimit = 128;
+        ipv6_header->SrcAddr[0] = htonl(0xFD000000);    // fd00::2
+        ipv6_header->SrcAddr[3] = htonl(2);
+        ipv6_header->DstAddr[0] = htonl(0xFD000000);    // fd00::1
+        ipv6_header->DstAddr[3] = htonl(1);
+    }
+    else
+    {
+        ip_header->Version   = 4;
+        ip_header->HdrLength = 5;
+        ip_header->Length    = htons((UINT16)len);
+        ip_header->Id        = htons((UINT16)i);
+        ip_header->TTL       = 128;
+        ip_header->Protocol  = IPPROTO_UDP;
+        ip_header->SrcAddr   = htonl(0x0A000002);       // 10.0.0.2
+        ip_header->DstAddr   = htonl(0x0A000001);       // 10.0.0.1
+    }
+    WinDivertHelperCalcChecksums(packet, len, NULL, 0);
+    return len;
+}
+
+/*
+ * Build the server's response to the query for name i: an A/AAAA record
+ * (TTL 300-899), a CNAME and A/AAAA record (1 in 8), or NXDOMAIN with an SOA
+ * record (1 in 16, negative TTL 60).  Records are compressed against the
+ * question.
+ */
+static UINT bench_response(const UINT8 *query, UINT query_len, UINT i,
+    BOOL edns, UINT8 *packet)
+{
+    static const UINT8 soa[] =
+    {
+        0xC0, 23, 0, DNS_TYPE_SOA, 0, 1, 0, 0, 0, 60, 0, 24,
+        0xC0, 23, 0xC0, 23, 0, 0, 0, 1, 0, 0, 0x0E, 0x10, 0, 0, 0x02, 0x58,
+        0, 0x09, 0x3A, 0x80, 0, 0, 0x0E, 0x10
+    };
+    PWINDIVERT_IPHDR ip_header = (PWINDIVERT_IPHDR)packet;
+    PWINDIVERT_IPV6HDR ipv6_header = (PWINDIVERT_IPV6HDR)packet;
+    PWINDIVERT_UDPHDR udp_header;
+    PDNSHDR dns_header;
+    UINT32 addr_tmp[4], ttl = 300 + i % 600;
+    UINT hdr_len, len, cname = 0, j;
+    UINT16 port_tmp, rcode = DNS_NOERROR, an_count = 1, ns_count = 0;
+    UINT8 *r, type;
+    PVOID data;
+
+    WinDivertHelperParsePacket(query, query_len, NULL, NULL, NULL, NULL,
+        NULL, NULL, &udp_header, &data, NULL, NULL, NULL);
+    hdr_len = (UINT)((const UINT8 *)data - query);
+    len = hdr_len + DNS_HDR_LEN + 24 + 4;   // Up to the end of the question
+    memcpy(packet, query, len);
+    type = packet[len - 3];
+    udp_header = (PWINDIVERT_UDPHDR)(packet + hdr_len -
+        sizeof(WINDIVERT_UDPHDR));
+    dns_header = (PDNSHDR)(packet + hdr_len);
+    r = packet + len;
+    if (i % 16 == 15)
+    {
+        rcode    = DNS_NXDOMAIN;
+        an_count = 0;
+        ns_count = 1;
+        memcpy(r, soa, sizeof(soa));
+        r += sizeof(soa);
+    }
+    else
+    {
+        if (i % 8 == 7)
+        {
+            cname = (UINT)(r - (UINT8 *)dns_header) + 12;
+            memcpy(r, "\xC0\x0C\0\5\0\1\0\0\0\0\0\4\1c\xC0\x17", 16);
+            r[8] = (UINT8)(ttl >> 8);
+            r[9] = (UINT8)ttl;
+            r += 16;
+            an_count++;
+        }
+        *r++ = (cname != 0? 0xC0 | (UINT8)(cname >> 8): 0xC0);
+        *r++ = (cname != 0? (UINT8)cname: 12);
+        memcpy(r, "\0\0\0\1\0\0\0\0\0\0", 10);
+        r[1] = type;
+        r[6] = (UINT8)(ttl >> 8);
+        r[7] = (UINT8)ttl;
+        r[9] = (type == 28? 16: 4);
+        r += 10;
+        for (j = 0; j < (type == 28? 16u: 4u); j++)
+        {
+            *r++ = (UINT8)(j == 0? 192: i >> (8 * (j % 4)));
+        }
+    }
+    if (edns)
+    {
+        memcpy(r, "\0\0\x29\x04\xD0\0\0\0\0\0\0", 11);
+        r += 11;
+    }
+    dns_header->Flags   = htons(DNS_QR | DNS_RD | DNS_RA | rcode);
+    dns_header->AnCount = htons(an_count);
+    dns_header->NsCount = htons(ns_count);
+    dns_header->ArCount = htons(edns? 1: 0);
+    len = (UINT)(r - packet);
+    port_tmp            = udp_header->SrcPort;
+    udp_header->SrcPort = udp_header->DstPort;
+    udp_header->DstPort = port_tmp;
+    udp_header->Length  = htons((UINT16)(len - hdr_len +
+        sizeof(WINDIVERT_UDPHDR)));
+    if (ip_header->Version == 4)
+    {
+        addr_tmp[0]        = ip_header->SrcAddr;
+        ip_header->SrcAddr = ip_header->DstAddr;
+        ip_header->DstAddr = addr_tmp[0];
+        ip_header->Length  = htons((UINT16)len);
+    }
+    else
+    {
+        memcpy(addr_tmp, ipv6_header->SrcAddr, sizeof(addr_tmp));
+        memcpy(ipv6_header->SrcAddr, ipv6_header->DstAddr, sizeof(addr_tmp));
+        memcpy(ipv6_header->DstAddr, addr_tmp, sizeof(addr_tmp));
+        ipv6_header->Length =
+            htons((UINT16)(len - sizeof(WINDIVERT_IPV6HDR)));
+    }
+    WinDivertHelperCalcChecksums(packet, len, NULL, 0);
+    return len;
+}
+
+/*
+ * Offline benchmark.  The cache learns the responses for num_names names,
+ * the injected responses are checked against the server's responses, and
+ * then the hit (answer by injection) and miss (forward) paths are timed.
+ */
+static void benchmark(UINT num_names)
+{
+    static DNSCACHE cache;
+    static PKTBATCH batch, replies;
+    static UINT8 expect[MTU], check[MTU];
+    const UINT slot = 128, resp_slot = 256, num_batches = 256,
+        rounds = 20000;
+    UINT8 *queries, *responses, *hit_batches, *miss_batches, *packet;
+    UINT *query_lens, *resp_lens, *hit_lens, *miss_lens, i, j, k, n, len,
+        checks = 0;
+    UINT64 state = 0x123456789ABCDEFull;
+    WINDIVERT_ADDRESS query_addr, resp_addr;
+    LARGE_INTEGER freq, start, end;
+    double secs;
+
+    if (num_names == 0 || num_names > (1 << 24) - 2 * BATCH)
+    {
+        fprintf(stderr, "error: invalid number of names\n");
+        exit(EXIT_FAILURE);
+    }
+    queries      = (UINT8 *)malloc((size_t)num_names * slot);
+    responses    = (UINT8 *)malloc((size_t)num_names * resp_slot);
+    query_lens   = (UINT *)malloc(num_names * sizeof(UINT));
+    resp_lens    = (UINT *)malloc(num_names * sizeof(UINT));
+    hit_batches  = (UINT8 *)malloc(num_batches * BATCH * slot);
+    miss_batches = (UINT8 *)malloc(num_batches * BATCH * slot);
+    hit_lens     = (UINT *)malloc(num_batches * sizeof(UINT));
+    miss_lens    = (UINT *)malloc(num_batches * sizeof(UINT));
+    batch.packet_max   = BATCH * resp_slot;
+    batch.packet       = (UINT8 *)malloc(batch.packet_max);
+    replies.packet_max = BATCH * MTU;
+    replies.packet     = (UINT8 *)malloc(replies.packet_max);
+    if (queries == NULL || responses == NULL || query_lens == NULL ||
+        resp_lens == NULL || hit_batches == NULL || miss_batches == NULL ||
+        hit_lens == NULL || miss_lens == NULL || batch.packet == NULL ||
+        replies.packet == NULL || !cache_init(&cache, 4 * num_names))
+    {
+        fprintf(stderr, "error: failed to allocate buffers\n");
+        exit(EXIT_FAILURE);
+    }
+    QueryPerformanceFrequency(&freq);
+    memset(&query_addr, 0, sizeof(query_addr));
+    query_addr.Layer       = WINDIVERT_LAYER_NETWORK;
+    query_addr.Outbound    = 1;
+    query_addr.IPChecksum  = 1;
+    query_addr.UDPChecksum = 1;
+    resp_addr          = query_addr;
+    resp_addr.Outbound = 0;
+    for (i = 0; i < num_names; i++)
+    {
+        query_lens[i] = bench_query(queries + i * slot, i, (i % 3 == 0));
+        resp_lens[i]  = bench_response(queries + i * slot, query_lens[i], i,
+            (i % 2 == 0), responses + (size_t)i * resp_slot);
+    }
+
+    // (1) Learn: each query is a miss, and is followed by its response.
+    QueryPerformanceCounter(&start);
+    for (i = 0; i < num_names; i += n)
+    {
+        n = (num_names - i < BATCH? num_names - i: BATCH);
+        for (k = 0; k < 2; k++)
+        {
+            packet = batch.packet;
+            for (j = 0; j < n; j++)
+            {
+                len = (k == 0? query_lens[i + j]: resp_lens[i + j]);
+                memcpy(packet, (k == 0? queries + (i + j) * slot:
+                    responses + (size_t)(i + j) * resp_slot), len);
+                batch.addrs[j] = (k == 0? query_addr: resp_addr);
+                batch.addrs[j].IPv6 = ((i + j) % 4 == 3);
+                packet += len;
+            }
+            batch.packet_len = (UINT)(packet - batch.packet);
+            batch.count      = n;
+            dnscache_process(&cache, &batch, &replies, /*now=*/1000);
+        }
+    }
+    QueryPerformanceCounter(&end);
+    secs = (double)(end.QuadPart - start.QuadPart) / freq.QuadPart;
+    printf("learn: %.1f ns/name (query miss + response), %llu learned, "
+        "%llu uncacheable\n", 1.0e9 * secs / num_names, cache.learned,
+        cache.uncacheable);
+
+    // (2) Verify: each injected response must be the server's response
+    // (less the OPT record), with valid checksums as the TTLs count down.
+    for (i = 0; i < num_names && i < 4096; i++)
+    {
+        for (k = 0; k < 2; k++)
+        {
+            len = bench_query(batch.packet, i, ((i % 3 == 0) != (k != 0)));
+            batch.packet_len = len;
+            batch.count      = 1;
+            batch.addrs[0]   = query_addr;
+            batch.addrs[0].IPv6 = (i % 4 == 3);
+            dnscache_process(&cache, &batch, &replies, /*now=*/1000 + 10 * k);
+            if (replies.count == 0)
+            {
+                continue;                   // Evicted
+            }
+            len = bench_response(queries + i * slot, query_lens[i], i, FALSE,
+                expect);
+            memcpy(check, replies.packet, replies.packet_len);
+            WinDivertHelperCalcChecksums(check, replies.packet_len, NULL, 0);
+            if (batch.count != 0 || replies.packet_len != len ||
+                replies.addrs[0].Outbound ||
+                memcmp(check, replies.packet, len) != 0 ||
+                (k == 0 && memcmp(expect, replies.packet, len) != 0))
+            {
+                fprintf(stderr, "error: bad response for name %u\n", i);
+                exit(EXIT_FAILURE);
+            }
+            checks++;
+        }
+    }
+    printf("verify: %u responses match the server, checksums OK\n",
+        checks);
+
+    // Batches of queries for random cached names, and for uncached names:
+    for (i = 0; i < num_batches; i++)
+    {
+        packet = hit_batches + i * BATCH * slot;
+        for (j = 0; j < BATCH; j++)
+        {
+            k = (UINT)(random64(&state) % num_names);
+            memcpy(packet, queries + k * slot, query_lens[k]);
+            packet += query_lens[k];
+        }
+        hit_lens[i] = (UINT)(packet - (hit_batches + i * BATCH * slot));
+        packet = miss_batches + i * BATCH * slot;
+        for (j = 0; j < BATCH; j++)
+        {
+            packet += bench_query(packet, num_names + (i * BATCH + j) % BATCH,
+                FALSE);
+        }
+        miss_lens[i] = (UINT)(packet - (miss_batches + i * BATCH * slot));
+    }
+    for (j = 0; j < BATCH; j++)
+    {
+        batch.addrs[j] = query_addr;
+    }
+
+    // (3) Hits (including the batch copy):
+    cache.hits = cache.misses = 0;
+    QueryPerformanceCounter(&start);
+    for (i = 0; i < rounds; i++)
+    {
+        k = i % num_batches;
+        memcpy(batch.packet, hit_batches + k * BATCH * slot, hit_lens[k]);
+        batch.packet_len = hit_lens[k];
+        batch.count      = BATCH;
+        dnscache_process(&cache, &batch, &replies, /*now=*/1000);
+    }
+    QueryPerformanceCounter(&end);
+    secs = (double)(end.QuadPart - start.QuadPart) / freq.QuadPart;
+    printf("hit: %.1f ns/query (%.2f M queries/s, %llu answered, "
+        "%llu forwarded)\n", 1.0e9 * secs / ((double)rounds * BATCH),
+        (double)rounds * BATCH / secs / 1.0e6, cache.hits, cache.misses);
+
+    // (4) Misses (forwarded unchanged):
+    cache.hits = cache.misses = 0;
+    QueryPerformanceCounter(&start);
+    for (i = 0; i < rounds; i++)
+    {
+        k = i % num_batches;
+        memcpy(batch.packet, miss_batches + k * BATCH * slot, miss_lens[k]);
+        batch.packet_len = miss_lens[k];
+        batch.count      = BATCH;
+        dnscache_process(&cache, &batch, &replies, /*now=*/1000);
+    }
+    QueryPerformanceCounter(&end);
+    secs = (double)(end.QuadPart - start.QuadPart) / freq.QuadPart;
+    printf("miss: %.1f ns/query (%.2f M queries/s, %llu answered, "
+        "%llu forwarded)\n", 1.0e9 * secs / ((double)rounds * BATCH),
+        (double)rounds * BATCH / secs / 1.0e6, cache.hits, cache.misses);
+}
@@ -0,0 +1,775 @@
+/*
+ * maglev.c
+ * (C) 2019, all rights reserved,
+ *
+ * This file is part of WinDivert.
+ *
+ * WinDivert is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * WinDivert is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * DESCRIPTION:
+ * This is a simple layer-4 load balancer.  Inbound TCP connections to a
+ * virtual address/port (the VIP) are spread across a set of backends using
+ * Maglev consistent hashing, and are translated (DNAT) to the chosen backend.
+ * Replies from the backend are translated back (SNAT) to the VIP.  A
+ * connection table keeps existing flows pinned to their backend, and the
+ * Maglev table is rebuilt whenever a backend's health changes.
+ *
+ * Backends may be local ports (use the VIP address) or remote hosts.  For
+ * remote backends, the backend's replies must be routed via this machine.
+ * Only IPv4 is supported.
+ *
+ * usage: maglev.exe vip:port backend:port [backend:port ...]
+ *        maglev.exe --bench [num-backends]
+ */
+
+#include <winsock2.h>
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "windivert.h"
+
+#define ntohs(x)            WinDivertHelperNtohs(x)
+#define ntohl(x)            WinDivertHelperNtohl(x)
+#define htons(x)            WinDivertHelperHtons(x)
+#define htonl(x)            WinDivertHelperHtonl(x)
+
+#define MTU                 1500
+#define BATCH               32
+#define MAX_BACKENDS        256
+#define NO_BACKEND          0xFFFF
+#define TABLE_SIZE          65537           // Maglev table size (prime)
+#define CONN_BUCKETS        16384           // Connection table buckets
+#define CONN_WAYS           4               // Connection table ways
+#define CONN_TIMEOUT        300             // Idle connection timeout (s)
+#define HEALTH_INTERVAL     2000            // Health check interval (ms)
+#define HEALTH_TIMEOUT      500             // Health check timeout (ms)
+
+/*
+ * Backend.
+ */
+typedef struct
+{
+    UINT32 addr;                            // Address (network order)
+    UINT16 port;                            // Port (network order)
+    BOOL local;                             // Backend is the VIP address?
+    BOOL healthy;                           // Backend is healthy?
+    UINT32 offset;                          // Maglev offset
+    UINT32 skip;                            // Maglev skip
+} BACKEND, *PBACKEND;
+
+/*
+ * Connection table entry.
+ */
+typedef struct
+{
+    UINT32 client_addr;
+    UINT16 client_port;
+    UINT16 backend;
+    UINT32 timestamp;                       // 0 = empty
+} CONN, *PCONN;
+
+/*
+ * Load balancer state.
+ */
+typedef struct
+{
+    UINT32 vip_addr;                        // VIP (network order)
+    UINT16 vip_port;                        // VIP port (network order)
+    UINT num_backends;
+    BACKEND backends[MAX_BACKENDS];
+    UINT16 *table;                          // Current Maglev table
+    UINT16 *spare;                          // Spare Maglev table
+    UINT32 *next;                           // Maglev build scratch
+    CONN *conns;                            // Connection table
+    CRITICAL_SECTION lock;                  // Protects table/spare
+} LB, *PLB;
+
+/*
+ * Prototypes.
+ */
+static UINT64 hash64(UINT64 x, UINT64 seed);
+static void lb_init(PLB lb);
+static BOOL lb_build(PLB lb, UINT16 *table);
+static BOOL lb_process(PLB lb, UINT8 *packet, UINT packet_len,
+    WINDIVERT_ADDRESS *addr, UINT32 now);
+static PCONN conn_lookup(PLB lb, UINT32 addr, UINT16 port, UINT32 now);
+static void conn_insert(PLB lb, UINT32 addr, UINT16 port, UINT16 backend,
+    UINT32 now);
+static void checksum_update16(UINT16 *checksum, UINT16 old_word,
+    UINT16 new_word);
+static void checksum_update32(UINT16 *checksum, UINT32 old_word,
+    UINT32 new_word);
+static BOOL parse_endpoint(const char *str, UINT32 *addr, UINT16 *port);
+static BOOL health_check(PBACKEND backend);
+static DWORD health_worker(LPVOID arg);
+static void benchmark(UINT num_backends);
+
+/*
+ * Entry.
+ */
+int __cdecl main(int argc, char **argv)
+{
+    static LB lb;
+    static char filter[16384];
+    HANDLE handle, thread;
+    UINT8 *packet, *batch_packet;
+    UINT packet_len, recv_len, addr_len, batch_len, i, len;
+    UINT32 addr, now;
+    UINT16 port;
+    WINDIVERT_ADDRESS addrs[BATCH];
+    WSADATA wsa_data;
+    PWINDIVERT_IPHDR ip_header;
+    LARGE_INTEGER freq;
+    char addr_str[32];
+    int j;
+
+    if (argc >= 2 && strcmp(argv[1], "--bench") == 0)
+    {
+        benchmark(argc >= 3? (UINT)atoi(argv[2]): 16);
+        return 0;
+    }
+    if (argc < 3 || argc - 2 > MAX_BACKENDS)
+    {
+        fprintf(stderr, "usage: %s vip:port backend:port "
+            "[backend:port ...]\n", argv[0]);
+        fprintf(stderr, "       %s --bench [num-backends]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    // Parse the VIP and backends:
+    if (!parse_endpoint(argv[1], &lb.vip_addr, &lb.vip_port))
+    {
+        fprintf(stderr, "error: invalid VIP \"%s\"\n", argv[1]);
+        exit(EXIT_FAILURE);
+    }
+    for (j = 2; j < argc; j++)
+    {
+        if (!parse_endpoint(argv[j], &addr, &port))
+        {
+            fprintf(stderr, "error: invalid backend \"%s\"\n", argv[j]);
+            exit(EXIT_FAILURE);
+        }
+        lb.backends[lb.num_backends].addr = addr;
+        lb.backends[lb.num_backends].port = port;
+        lb.num_backends++;
+    }
+    lb_init(&lb);
+
+    // Construct the filter:
+    WinDivertHelperFormatIPv4Address(ntohl(lb.vip_addr), addr_str,
+        sizeof(addr_str));
+    len = snprintf(filter, sizeof(filter), "tcp and ((ip.DstAddr == %s and "
+        "tcp.DstPort == %u)", addr_str, ntohs(lb.vip_port));
+    for (i = 0; i < lb.num_backends; i++)
+    {
+        WinDivertHelperFormatIPv4Address(ntohl(lb.backends[i].addr),
+            addr_str, sizeof(addr_str));
+        len += snprintf(filter + len, sizeof(filter) - len, " or "
+            "(ip.SrcAddr == %s and tcp.SrcPort == %u)", addr_str,
+            ntohs(lb.backends[i].port));
+    }
+    snprintf(filter + len, sizeof(filter) - len, ")");
+
+    handle = WinDivertOpen(filter, WINDIVERT_LAYER_NETWORK, 0, 0);
+    if (handle == INVALID_HANDLE_VALUE)
+    {
+        if (GetLastError() == ERROR_INVALID_PARAMETER)
+        {
+            fprintf(stderr, "error: filter syntax error (too many "
+                "backends?)\n");
+            exit(EXIT_FAILURE);
+        }
+        fprintf(stderr, "error: failed to open the WinDivert device (%d)\n",
+            GetLastError());
+        exit(EXIT_FAILURE);
+    }
+
+    // Start the health checker:
+    if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0)
+    {
+        fprintf(stderr, "error: failed to start WSA (%d)\n", GetLastError());
+        exit(EXIT_FAILURE);
+    }
+    thread = CreateThread(NULL, 1, (LPTHREAD_START_ROUTINE)health_worker,
+        (LPVOID)&lb, 0, NULL);
+    if (thread == NULL)
+    {
+        fprintf(stderr, "error: failed to start health thread (%d)\n",
+            GetLastError());
+        exit(EXIT_FAILURE);
+    }
+
+    QueryPerformanceFrequency(&freq);
+    packet_len = BATCH * MTU;
+    packet_len =
+        (packet_len < WINDIVERT_MTU_MAX? WINDIVERT_MTU_MAX: packet_len);
+    packet = (UINT8 *)malloc(packet_len);
+    if (packet == NULL)
+    {
+        fprintf(stderr, "error: failed to allocate buffer (%d)\n",
+            GetLastError());
+        exit(EXIT_FAILURE);
+    }
+
+    // Main loop:
+    while (TRUE)
+    {
+        addr_len = sizeof(addrs);
+        if (!WinDivertRecvEx(handle, packet, packet_len, &recv_len, 0,
+                addrs, &addr_len, NULL))
+        {
+            fprintf(stderr, "warning: failed to read packet (%d)\n",
+                GetLastError());
+            continue;
+        }
+
+        // Translate each packet in the batch:
+        now = (UINT32)(addrs[0].Timestamp / freq.QuadPart) + 1;
+        batch_packet = packet;
+        batch_len = recv_len;
+        EnterCriticalSection(&lb.lock);
+        for (i = 0; i < addr_len / sizeof(WINDIVERT_ADDRESS) &&
+                batch_len > sizeof(WINDIVERT_IPHDR); i++)
+        {
+            ip_header = (PWINDIVERT_IPHDR)batch_packet;
+            len = ntohs(ip_header->Length);
+            if (len > batch_len)
+            {
+                break;
+            }
+            lb_process(&lb, batch_packet, len, &addrs[i], now);
+            batch_packet += len;
+            batch_len -= len;
+        }
+        LeaveCriticalSection(&lb.lock);
+
+        if (!WinDivertSendEx(handle, packet, recv_len, NULL, 0, addrs,
+                addr_len, NULL))
+        {
+            fprintf(stderr, "warning: failed to reinject packet (%d)\n",
+                GetLastError());
+        }
+    }
+}
+
+/*
+ * Initialize the load balancer and build the initial Maglev table.
+ */
+static void lb_init(PLB lb)
+{
+    PBACKEND backend;
+    UINT64 key;
+    UINT i;
+
+    lb->table = (UINT16 *)malloc(TABLE_SIZE * sizeof(UINT16));
+    lb->spare = (UINT16 *)malloc(TABLE_SIZE * sizeof(UINT16));
+    lb->next  = (UINT32 *)malloc(MAX_BACKENDS * sizeof(UINT32));
+    lb->conns = (CONN *)calloc(CONN_BUCKETS * CONN_WAYS, sizeof(CONN));
+    if (lb->table == NULL || lb->spare == NULL || lb->next == NULL ||
+        lb->conns == NULL)
+    {
+        fprintf(stderr, "error: failed to allocate tables (%d)\n",
+            GetLastError());
+        exit(EXIT_FAILURE);
+    }
+    InitializeCriticalSection(&lb->lock);
+
+    // Each backend has its own permutation of the table slots, determined
+    // by (offset, skip):
+    for (i = 0; i < lb->num_backends; i++)
+    {
+        backend = &lb->backends[i];
+        key = ((UINT64)backend->addr << 16) | backend->port;
+        backend->offset  = (UINT32)(hash64(key, 0xA5A5A5A5) % TABLE_SIZE);
+        backend->skip    =
+            (UINT32)(hash64(key, 0x5A5A5A5A) % (TABLE_SIZE - 1)) + 1;
+        backend->local   = (backend->addr == lb->vip_addr);
+        backend->healthy = TRUE;
+    }
+    lb_build(lb, lb->table);
+}
+
+/*
+ * Build a Maglev lookup table from the healthy backends.  Each healthy
+ * backend takes turns claiming its next preferred free slot, so each gets
+ * an (almost) equal share, and removing a backend only moves the slots that
+ * it owned (plus a small number of others).
+ */
+static BOOL lb_build(PLB lb, UINT16 *table)
+{
+    PBACKEND backend;
+    UINT32 slot, filled = 0;
+    UINT i;
+    BOOL any = FALSE;
+
+    for (i = 0; i < TABLE_SIZE; i++)
+    {
+        table[i] = NO_BACKEND;
+    }
+    for (i = 0; i < lb->num_backends; i++)
+    {
+        lb->next[i] = 0;
+        any = (any || lb->backends[i].healthy);
+    }
+    if (!any)
+    {
+        return FALSE;
+    }
+
+    while (TRUE)
+    {
+        for (i = 0; i < lb->num_backends; i++)
+        {
+            backend = &lb->backends[i];
+            if (!backend->healthy)
+            {
+                continue;
+            }
+            do
+            {
+                slot = (UINT32)(((UINT64)backend->offset +
+                    (UINT64)lb->next[i] * backend->skip) % TABLE_SIZE);
+                lb->next[i]++;
+            }
+            while (table[slot] != NO_BACKEND);
+            table[slot] = (UINT16)i;
+            filled++;
+            if (filled == TABLE_SIZE)
+            {
+                return TRUE;
+            }
+        }
+    }
+}
+
+/*
+ * Translate a single packet.  Returns TRUE if the packet was modified.
+ */
+static BOOL lb_process(PLB lb, UINT8 *packet, UINT packet_len,
+    WINDIVERT_ADDRESS *addr, UINT32 now)
+{
+    PWINDIVERT_IPHDR ip_header;
+    PWINDIVERT_TCPHDR tcp_header;
+    PBACKEND backend;
+    PCONN conn;
+    UINT16 idx;
+    UINT i;
+
+    if (!WinDivertHelperParsePacket(packet, packet_len, &ip_header, NULL,
+            NULL, NULL, NULL, &tcp_header, NULL, NULL, NULL, NULL, NULL) ||
+        ip_header == NULL || tcp_header == NULL)
+    {
+        return FALSE;
+    }
+
+    if (ip_header->DstAddr == lb->vip_addr &&
+        tcp_header->DstPort == lb->vip_port)
+    {
+        // Client -> VIP: pick a backend (DNAT).
+        conn = conn_lookup(lb, ip_header->SrcAddr, tcp_header->SrcPort, now);
+        if (conn == NULL || (tcp_header->Syn && !tcp_header->Ack))
+        {
+            idx = lb->table[hash64(((UINT64)ip_header->SrcAddr << 16) |
+                tcp_header->SrcPort, 0) % TABLE_SIZE];
+            if (idx == NO_BACKEND)
+            {
+                return FALSE;
+            }
+            conn_insert(lb, ip_header->SrcAddr, tcp_header->SrcPort, idx,
+                now);
+        }
+        else
+        {
+            idx = conn->backend;
+            conn->timestamp = now;
+        }
+        backend = &lb->backends[idx];
+        if (addr->IPChecksum && addr->TCPChecksum)
+        {
+            checksum_update32(&ip_header->Checksum, ip_header->DstAddr,
+                backend->addr);
+            checksum_update32(&tcp_header->Checksum, ip_header->DstAddr,
+                backend->addr);
+            checksum_update16(&tcp_header->Checksum, tcp_header->DstPort,
+                backend->port);
+            ip_header->DstAddr  = backend->addr;
+            tcp_header->DstPort = backend->port;
+        }
+        else
+        {
+            ip_header->DstAddr  = backend->addr;
+            tcp_header->DstPort = backend->port;
+            WinDivertHelperCalcChecksums(packet, packet_len, addr, 0);
+        }
+        if (!backend->local)
+        {
+            addr->Outbound = 1;
+        }
+        return TRUE;
+    }
+
+    // Backend -> client: translate back to the VIP (SNAT).
+    for (i = 0; i < lb->num_backends; i++)
+    {
+        backend = &lb->backends[i];
+        if (backend->addr == ip_header->SrcAddr &&
+            backend->port == tcp_header->SrcPort)
+        {
+            break;
+        }
+    }
+    if (i >= lb->num_backends)
+    {
+        return FALSE;
+    }
+    conn = conn_lookup(lb, ip_header->DstAddr, tcp_header->DstPort, now);
+    if (conn == NULL || conn->backend != i)
+    {
+        return FALSE;
+    }
+    conn->timestamp = now;
+    if (addr->IPChecksum && addr->TCPChecksum)
+    {
+        checksum_update32(&ip_header->Checksum, ip_header->SrcAddr,
+            lb->vip_addr);
+        checksum_update32(&tcp_header->Checksum, ip_header->SrcAddr,
+            lb->vip_addr);
+        checksum_update16(&tcp_header->Checksum, tcp_header->SrcPort,
+            lb->vip_port);
+        ip_header->SrcAddr  = lb->vip_addr;
+        tcp_header->SrcPort = lb->vip_port;
+    }
+    else
+    {
+        ip_header->SrcAddr  = lb->vip_addr;
+        tcp_header->SrcPort = lb->vip_port;
+        WinDivertHelperCalcChecksums(packet, packet_len, addr, 0);
+    }
+    addr->Outbound = 1;
+    return TRUE;
+}
+
+/*
+ * Connection table lookup.
+ */
+static PCONN conn_lookup(PLB lb, UINT32 addr, UINT16 port, UINT32 now)
+{
+    PCONN bucket;
+    UINT i;
+
+    bucket = lb->conns + CONN_WAYS *
+        (hash64(((UINT64)addr << 16) | port, 1) % CONN_BUCKETS);
+    for (i = 0; i < CONN_WAYS; i++)
+    {
+        if (bucket[i].timestamp != 0 &&
+            now - bucket[i].timestamp <= CONN_TIMEOUT &&
+            bucket[i].client_addr == addr && bucket[i].client_port == port)
+        {
+            return &bucket[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Connection table insert.  Replaces the existing entry for the client (if
+ * any), else an empty/expired entry, else the least recently used entry.
+ */
+static void conn_insert(PLB lb, UINT32 addr, UINT16 port, UINT16 backend,
+    UINT32 now)
+{
+    PCONN bucket, victim = NULL;
+    UINT i;
+
+    bucket = lb->conns + CONN_WAYS *
+        (hash64(((UINT64)addr << 16) | port, 1) % CONN_BUCKETS);
+    for (i = 0; i < CONN_WAYS; i++)
+    {
+        if (bucket[i].timestamp != 0 && bucket[i].client_addr == addr &&
+            bucket[i].client_port == port)
+        {
+            victim = &bucket[i];
+            goto found;
+        }
+    }
+    for (i = 0; i < CONN_WAYS; i++)
+    {
+        if (bucket[i].timestamp == 0 ||
+            now - bucket[i].timestamp > CONN_TIMEOUT)
+        {
+            victim = &bucket[i];
+            goto found;
+        }
+    }
+    victim = &bucket[0];
+    for (i = 1; i < CONN_WAYS; i++)
+    {
+        if (bucket[i].timestamp < victim->timestamp)
+        {
+            victim = &bucket[i];
+        }
+    }
+
+found:
+    victim->client_addr = addr;
+    victim->client_port = port;
+    victim->backend     = backend;
+    victim->timestamp   = now;
+}
+
+/*
+ * Incremental checksum update (RFC 1624).
+ */
+static void checksum_update16(UINT16 *checksum, UINT16 old_word,
+    UINT16 new_word)
+{
+    UINT32 sum;
+
+    sum = (UINT16)~*checksum;
+    sum += (UINT16)~old_word;
+    sum += new_word;
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum += (sum >> 16);
+    *checksum = (UINT16)~sum;
+}
+static void checksum_update32(UINT16 *checksum, UINT32 old_word,
+    UINT32 new_word)
+{
+    checksum_update16(checksum, (UINT16)old_word, (UINT16)new_word);
+    checksum_update16(checksum, (UINT16)(old_word >> 16),
+        (UINT16)(new_word >> 16));
+}
+
+/*
+ * 64-bit hash.
+ */
+static UINT64 hash64(UINT64 x, UINT64 seed)
+{
+    x ^= seed * 0x9E3779B97F4A7C15ull;
+    x ^= x >> 33;
+    x *= 0xFF51AFD7ED558CCDull;
+    x ^= x >> 33;
+    x *= 0xC4CEB9FE1A85EC53ull;
+    x ^= x >> 33;
+    return x;
+}
+
+/*
+ * Parse an "address:port" string.  Results are in network byte order.
+ */
+static BOOL parse_endpoint(const char *str, UINT32 *addr, UINT16 *port)
+{
+    char buf[64], *sep;
+    int val;
+
+    if (strlen(str) >= sizeof(buf))
+    {
+        return FALSE;
+    }
+    strcpy(buf, str);
+    sep = strchr(buf, ':');
+    if (sep == NULL)
+    {
+        return FALSE;
+    }
+    *sep++ = '\0';
+    val = atoi(sep);
+    if (val <= 0 || val > 0xFFFF ||
+        !WinDivertHelperParseIPv4Address(buf, addr))
+    {
+        return FALSE;
+    }
+    *addr = htonl(*addr);
+    *port = htons((UINT16)val);
+    return TRUE;
+}
+
+/*
+ * Check a backend by attempting a TCP connection.
+ */
+static BOOL health_check(PBACKEND backend)
+{
+    SOCKET sock;
+    struct sockaddr_in sa;
+    u_long nonblock = 1;
+    fd_set wfds, efds;
+    struct timeval tv;
+    BOOL result = FALSE;
+
+    sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock == INVALID_SOCKET)
+    {
+        return FALSE;
+    }
+    ioctlsocket(sock, FIONBIO, &nonblock);
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family      = AF_INET;
+    sa.sin_addr.s_addr = backend->addr;
+    sa.sin_port        = backend->port;
+    connect(sock, (struct sockaddr *)&sa, sizeof(sa));
+    FD_ZERO(&wfds);
+    FD_ZERO(&efds);
+    FD_SET(sock, &wfds);
+    FD_SET(sock, &efds);
+    tv.tv_sec  = 0;
+    tv.tv_usec = HEALTH_TIMEOUT * 1000;
+    if (select(0, NULL, &wfds, &efds, &tv) > 0 && FD_ISSET(sock, &wfds))
+    {
+        result = TRUE;
+    }
+    closesocket(sock);
+    return result;
+}
+
+/*
+ * Health checker thread.  Rebuilds the Maglev table into the spare copy
+ * whenever a backend changes state, then swaps it in.  Existing connections
+ * remain pinned by the connection table.
+ */
+static DWORD health_worker(LPVOID arg)
+{
+    PLB lb = (PLB)arg;
+    PBACKEND backend;
+    UINT16 *table;
+    char addr_str[32];
+    BOOL healthy, changed;
+    UINT i;
+
+    while (TRUE)
+    {
+        Sleep(HEALTH_INTERVAL);
+        changed = FALSE;
+        for (i = 0; i < lb->num_backends; i++)
+        {
+            backend = &lb->backends[i];
+            healthy = health_check(backend);
+            if (healthy != backend->healthy)
+            {
+                WinDivertHelperFormatIPv4Address(ntohl(backend->addr),
+                    addr_str, sizeof(addr_str));
+                printf("backend %s:%u is %s\n", addr_str,
+                    ntohs(backend->port), (healthy? "up": "down"));
+                backend->healthy = healthy;
+                changed = TRUE;
+            }
+        }
+        if (!changed)
+        {
+            continue;
+        }
+        lb_build(lb, lb->spare);
+        EnterCriticalSection(&lb->lock);
+        table = lb->table;
+        lb->table = lb->spare;
+        lb->spare = table;
+        LeaveCriticalSection(&lb->lock);
+    }
+}
+
+/*
+ * Offline benchmark of the table build time, per-packet cost, and the
+ * fraction of table slots moved when a backend fails.
+ */
+static void benchmark(UINT num_backends)
+{
+    static LB lb;
+    static UINT8 packet[40] =
+    {
+        0x45, 0x00, 0x00, 0x28, 0x00, 0x00, 0x40, 0x00, 0x40, 0x06, 0x00,
+        0x00, 0x0A, 0x00, 0x00, 0x01, 0xC0, 0xA8, 0x00, 0x01, 0x00, 0x00,
+        0x00, 0x50, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x50,
+        0x02, 0x20, 0x00, 0x00, 0x00, 0x00, 0x00
+    };
+    const UINT builds = 10, packets = 1000000;
+    PWINDIVERT_IPHDR ip_header = (PWINDIVERT_IPHDR)packet;
+    PWINDIVERT_TCPHDR tcp_header = (PWINDIVERT_TCPHDR)(packet + 20);
+    WINDIVERT_ADDRESS addr;
+    LARGE_INTEGER freq, start, end;
+    UINT i, moved = 0;
+    double secs;
+
+    if (num_backends == 0 || num_backends > MAX_BACKENDS)
+    {
+        fprintf(stderr, "error: invalid number of backends\n");
+        exit(EXIT_FAILURE);
+    }
+    lb.vip_addr = ip_header->DstAddr;
+    lb.vip_port = tcp_header->DstPort;
+    lb.num_backends = num_backends;
+    for (i = 0; i < num_backends; i++)
+    {
+        lb.backends[i].addr = htonl(0x0A010000 + i);
+        lb.backends[i].port = htons(8080);
+    }
+    lb_init(&lb);
+    QueryPerformanceFrequency(&freq);
+
+    // (1) Table build time:
+    QueryPerformanceCounter(&start);
+    for (i = 0; i < builds; i++)
+    {
+        lb_build(&lb, lb.spare);
+    }
+    QueryPerformanceCounter(&end);
+    secs = (double)(end.QuadPart - start.QuadPart) / freq.QuadPart;
+    printf("build: %u backends, %u slots, %.3f ms\n", num_backends,
+        TABLE_SIZE, 1000.0 * secs / builds);
+
+    // (2) Slots moved when backend 0 fails:
+    lb.backends[0].healthy = FALSE;
+    lb_build(&lb, lb.spare);
+    lb.backends[0].healthy = TRUE;
+    for (i = 0; i < TABLE_SIZE; i++)
+    {
+        moved += (lb.table[i] != lb.spare[i]);
+    }
+    printf("disruption: %.2f%% of slots moved (ideal %.2f%%)\n",
+        100.0 * moved / TABLE_SIZE, 100.0 / num_backends);
+
+    // (3) Per-packet cost (new flows, lookup + connection insert + DNAT):
+    WinDivertHelperCalcChecksums(packet, sizeof(packet), NULL, 0);
+    memset(&addr, 0, sizeof(addr));
+    QueryPerformanceCounter(&start);
+    for (i = 0; i < packets; i++)
+    {
+        ip_header->SrcAddr  = htonl(0x0A000000 + (i >> 8));
+        tcp_header->SrcPort = htons((UINT16)(1024 + (i & 0xFF)));
+        ip_header->DstAddr  = lb.vip_addr;
+        tcp_header->DstPort = lb.vip_port;
+        addr.IPChecksum  = 1;
+        addr.TCPChecksum = 1;
+        lb_process(&lb, packet, sizeof(packet), &addr, 1);
+    }
+    QueryPerformanceCounter(&end);
+    secs = (double)(end.QuadPart - start.QuadPart) / freq.QuadPart;
+    printf("packet: %.1f ns/packet\n", 1.0e9 * secs / packets);
+}
@@ -0,0 +1,1254 @@
+/*
+ * nat64.c
+ * (C) 2019, all rights reserved,
+ *
+ * This file is part of WinDivert.
+ *
+ * WinDivert is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * WinDivert is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+
+
+/*
+ * DESCRIPTION:
+ * This is a simple stateful NAT64 (RFC 6146).  IPv6-only clients reach IPv4
+ * servers via IPv6 addresses that embed the server's IPv4 address in the
+ * NAT64 prefix (default 64:ff9b::/96, see RFC 6052), e.g. as synthesized by
+ * a DNS64 resolver:
+ *
+ * - Forwarded IPv6 packets to the prefix are captured in batches at the
+ *   WINDIVERT_LAYER_NETWORK_FORWARD layer, given a binding (client address
+ *   and port -> pool port), translated with WinDivertHelperXlat(), and sent
+ *   from the IPv4 pool address at the WINDIVERT_LAYER_NETWORK layer.
+ * - Inbound IPv4 packets to the pool address are matched to a binding by
+ *   destination port (or ICMP identifier), translated back, and forwarded
+ *   to the client via the interface the client was last seen on.  IPv4
+ *   packets with no binding are passed to this host unchanged.
+ *
+ * Bindings are endpoint-independent (RFC 4787): one pool port per client
+ * address/port and protocol (TCP, UDP or ICMP echo identifier), reachable
+ * from any IPv4 host.  Pool ports are allocated from a bitmap with a
+ * rotating cursor, bindings are found via a hash table (IPv6 side) or a
+ * direct array indexed by pool port (IPv4 side), and expired bindings are
+ * reclaimed by a clock sweep.  The timeouts are the RFC 6146 defaults (UDP 5
+ * minutes, TCP established 2 hours 4 minutes, TCP transitory 4 minutes,
+ * ICMP 60 seconds).  ICMP/ICMPv6 errors are translated for the binding of
+ * the packet they quote.
+ *
+ * Since all IPv4 traffic to the pool address is diverted, the pool address
+ * should be dedicated to the NAT64 (assigned to this host but not otherwise
+ * used).  IP forwarding must be enabled for the IPv6 clients' interface.
+ *
+ * usage: nat64.exe pool-address [prefix/len]
+ *        nat64.exe --bench [num-clients]
+ */
+
+#include <winsock2.h>
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "windivert.h"
+
+#define ntohs(x)            WinDivertHelperNtohs(x)
+#define ntohl(x)            WinDivertHelperNtohl(x)
+#define htons(x)            WinDivertHelperHtons(x)
+#define htonl(x)            WinDivertHelperHtonl(x)
+
+#define MTU                 1500
+#define BATCH               64
+#define XLAT_GROWTH         48              // Max header growth
+#define PORT_MIN            1024            // First pool port
+#define NUM_PORTS           65536
+#define PROTO_TCP           0
+#define PROTO_UDP           1
+#define PROTO_ICMP          2
+#define NUM_PROTOS          3
+#define MAX_BINDINGS        (NUM_PROTOS * (NUM_PORTS - PORT_MIN))
+#define NUM_BUCKETS         (1 << 18)       // Power of 2 >= MAX_BINDINGS
+#define NIL                 0xFFFFFFFF
+#define SWEEP               1               // Bindings swept per packet
+#define UDP_TIMEOUT         300             // Seconds
+#define TCP_EST_TIMEOUT     7440
+#define TCP_TRANS_TIMEOUT   240
+#define ICMP_TIMEOUT        60
+
+#define TCP_SYN6            0x01            // SYN seen from IPv6 side
+#define TCP_SYN4            0x02            // SYN seen from IPv4 side
+#define TCP_FIN6            0x04            // FIN seen from IPv6 side
+#define TCP_FIN4            0x08            // FIN seen from IPv4 side
+#define TCP_RST             0x10            // RST seen
+
+#define ICMP_ECHO_REPLY     0
+#define ICMP_UNREACH        3
+#define ICMP_ECHO           8
+#define ICMP_TIME_EXCEEDED  11
+#define ICMP_PARAM_PROBLEM  12
+#define ICMPV6_ECHO         128
+
+/*
+ * Binding.
+ */
+typedef struct
+{
+    UINT32 addr6[4];                        // Client address (host order)
+    UINT32 if_idx;                          // Client interface
+    UINT32 sub_if_idx;                      // Client sub-interface
+    UINT32 expire;                          // Expiry time (seconds)
+    UINT32 next;                            // Hash chain (or free list)
+    UINT16 port6;                           // Client port/identifier
+    UINT16 port4;                           // Pool port (0 = free)
+    UINT8 proto;                            // PROTO_*
+    UINT8 tcp_state;                        // TCP_*
+} BINDING, *PBINDING;
+
+/*
+ * A batch of packets.
+ */
+typedef struct
+{
+    UINT8 *packet;                          // Packet data
+    UINT packet_len;                        // Packet data length
+    UINT packet_max;                        // Packet data size
+    UINT count;                             // Number of packets
+    WINDIVERT_ADDRESS addrs[BATCH];         // Packet addresses
+} PKTBATCH, *PPKTBATCH;
+
+/*
+ * NAT64 state.
+ */
+typedef struct
+{
+    BINDING *bindings;                      // MAX_BINDINGS entries
+    UINT32 *buckets;                        // Hash table (IPv6 side)
+    UINT32 *ports[NUM_PROTOS];              // Pool port -> binding
+    UINT64 *bitmap[NUM_PROTOS];             // Allocated pool ports
+    UINT cursor[NUM_PROTOS];                // Next bitmap word to try
+    UINT32 free;                            // Free binding list
+    UINT32 hand;                            // Sweep position
+    UINT32 pool4;                           // Pool address (host order)
+    UINT32 prefix[4];                       // NAT64 prefix (host order)
+    UINT prefix_len;                        // NAT64 prefix length
+    UINT32 active;                          // Active bindings
+    CRITICAL_SECTION lock;                  // Protects everything
+    HANDLE handle6;                         // IPv6 (forward) handle
+    HANDLE handle4;                         // IPv4 (network) handle
+    UINT64 translated6;                     // IPv6 -> IPv4 packets
+    UINT64 translated4;                     // IPv4 -> IPv6 packets
+    UINT64 passed;                          // IPv4 packets passed
+    UINT64 dropped;                         // Untranslatable packets
+    UINT64 exhausted;                       // No free pool port
+} NAT64, *PNAT64;
+
+/*
+ * Prototypes.
+ */
+static BOOL nat64_init(PNAT64 nat, UINT32 pool4, const UINT32 *prefix,
+    UINT prefix_len);
+static UINT32 binding_hash(UINT proto, const UINT32 *addr6, UINT16 port6);
+static PBINDING binding_lookup(PNAT64 nat, UINT proto, const UINT32 *addr6,
+    UINT16 port6);
+static PBINDING binding_create(PNAT64 nat, UINT proto, const UINT32 *addr6,
+    UINT16 port6);
+static void binding_free(PNAT64 nat, UINT32 idx);
+static void binding_touch(PBINDING binding, const WINDIVERT_TCPHDR *tcp,
+    BOOL from6, UINT32 now);
+static UINT16 port_alloc(PNAT64 nat, UINT proto);
+static void nat64_sweep(PNAT64 nat, UINT count, UINT32 now);
+static void nat64_out(PNAT64 nat, const PKTBATCH *batch, PPKTBATCH out,
+    UINT32 now);
+static void nat64_in(PNAT64 nat, const PKTBATCH *batch, PPKTBATCH out,
+    PPKTBATCH pass, UINT32 now);
+static BOOL quote_ports(const UINT8 *quote, UINT quote_len, UINT *proto,
+    UINT16 *src_port, UINT16 *dst_port);
+static BOOL batch_xlat(PPKTBATCH batch, const UINT8 *packet, UINT len,
+    const WINDIVERT_XLAT_ADDR *outer, const WINDIVERT_XLAT_ADDR *inner,
+    const WINDIVERT_ADDRESS *addr);
+static BOOL batch_append(PPKTBATCH batch, const UINT8 *packet, UINT len,
+    const WINDIVERT_ADDRESS *addr);
+static BOOL batch_alloc(PPKTBATCH batch, UINT packet_max);
+static BOOL parse_prefix(const char *str, UINT32 *prefix, UINT *len);
+static DWORD nat64_worker6(LPVOID arg);
+static void benchmark(UINT num_clients);
+
+/*
+ * Entry.
+ */
+int __cdecl main(int argc, char **argv)
+{
+    static NAT64 nat;
+    static PKTBATCH batch, out, pass;
+    UINT32 pool4, prefix[4], prefix_hi[4], now;
+    UINT prefix_len = 96, addr_len, i;
+    char filter[256], lo_str[64], hi_str[64], pool_str[32];
+    HANDLE thread;
+    LARGE_INTEGER freq;
+
+    if (argc >= 2 && strcmp(argv[1], "--bench") == 0)
+    {
+        benchmark(argc >= 3? (UINT)atoi(argv[2]): 10000);
+        return 0;
+    }
+    WinDivertHelperParseIPv6Address("64:ff9b::", prefix);
+    if ((argc != 2 && argc != 3) ||
+        !WinDivertHelperParseIPv4Address(argv[1], &pool4) ||
+        (argc == 3 && !parse_prefix(argv[2], prefix, &prefix_len)))
+    {
+        fprintf(stderr, "usage: %s pool-address [prefix/len]\n", argv[0]);
+        fprintf(stderr, "       %s --bench [num-clients]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (!nat64_init(&nat, pool4, prefix, prefix_len))
+    {
+        fprintf(stderr, "error: failed to allocate bindings (%d)\n",
+            GetLastError());
+        exit(EXIT_FAILURE);
+    }
+
+    // Divert IPv6 packets to the prefix, and IPv4 packets to the pool:
+    memcpy(prefix_hi, prefix, sizeof(prefix_hi));
+    for (i = prefix_len; i < 128; i++)
+    {
+        prefix_hi[3 - i / 32] |= 0x80000000 >> (i % 32);
+    }
+    WinDivertHelperFormatIPv6Address(prefix, lo_str, sizeof(lo_str));
+    WinDivertHelperFormatIPv6Address(prefix_hi, hi_str, sizeof(hi_str));
+    WinDivertHelperFormatIPv4Address(pool4, pool_str, sizeof(pool_str));
+    snprintf(filter, sizeof(filter), "ipv6 and ipv6.DstAddr >= %s and "
+        "ipv6.DstAddr <= %s", lo_str, hi_str);
+    nat.handle6 = WinDivertOpen(filter, WINDIVERT_LAYER_NETWORK_FORWARD, 0,
+        0);
+    snprintf(filter, sizeof(filter), "inbound and ip.DstAddr == %s",
+        pool_str);
+    nat.handle4 = WinDivertOpen(filter, WINDIVERT_LAYER_NETWORK, 0, 0);
+    if (nat.handle6 == INVALID_HANDLE_VALUE ||
+        nat.handle4 == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "error: failed to open the WinDivert device (%d)\n",
+            GetLastError());
+        exit(EXIT_FAILURE);
+    }
+    printf("NAT64 %s/%u <-> %s\n", lo_str, prefix_len, pool_str);
+
+    // IPv6 -> IPv4 runs in a worker thread, IPv4 -> IPv6 in this one:
+    thread = CreateThread(NULL, 1, (LPTHREAD_START_ROUTINE)nat64_worker6,
+        (LPVOID)&nat, 0, NULL);
+    if (thread == NULL ||
+        !batch_alloc(&batch, BATCH * MTU) ||
+        !batch_alloc(&out, BATCH * (MTU + 2 * XLAT_GROWTH)) ||
+        !batch_alloc(&pass, BATCH * MTU))
+    {
+        fprintf(stderr, "error: failed to start (%d)\n", GetLastError());
+        exit(EXIT_FAILURE);
+    }
+    QueryPerformanceFrequency(&freq);
+
+    // Main loop:
+    while (TRUE)
+    {
+        addr_len = sizeof(batch.addrs);
+        if (!WinDivertRecvEx(nat.handle4, batch.packet, batch.packet_max,
+                &batch.packet_len, 0, batch.addrs, &addr_len, NULL))
+        {
+            fprintf(stderr, "warning: failed to read packet (%d)\n",
+                GetLastError());
+            continue;
+        }
+        batch.count = addr_len / sizeof(WINDIVERT_ADDRESS);
+        now = (UINT32)(batch.addrs[0].Timestamp / freq.QuadPart);
+
+        EnterCriticalSection(&nat.lock);
+        nat64_in(&nat, &batch, &out, &pass, now);
+        LeaveCriticalSection(&nat.lock);
+
+        if (out.count != 0 &&
+            !WinDivertSendEx(nat.handle6, out.packet, out.packet_len, NULL,
+                0, out.addrs, out.count * sizeof(WINDIVERT_ADDRESS), NULL))
+        {
+            fprintf(stderr, "warning: failed to send IPv6 packet (%d)\n",
+                GetLastError());
+        }
+        if (pass.count != 0 &&
+            !WinDivertSendEx(nat.handle4, pass.packet, pass.packet_len, NULL,
+                0, pass.addrs, pass.count * sizeof(WINDIVERT_ADDRESS), NULL))
+        {
+            fprintf(stderr, "warning: failed to reinject packet (%d)\n",
+                GetLastError());
+        }
+    }
+}
+
+/*
+ * IPv6 -> IPv4 worker.
+ */
+static DWORD nat64_worker6(LPVOID arg)
+{
+    static PKTBATCH batch, out;
+    PNAT64 nat = (PNAT64)arg;
+    UINT addr_len;
+    UINT32 now;
+    LARGE_INTEGER freq;
+
+    if (!batch_alloc(&batch, BATCH * MTU) ||
+        !batch_alloc(&out, BATCH * (MTU + 2 * XLAT_GROWTH)))
+    {
+        fprintf(stderr, "error: failed to allocate buffer (%d)\n",
+            GetLastError());
+        exit(EXIT_FAILURE);
+    }
+    QueryPerformanceFrequency(&freq);
+    while (TRUE)
+    {
+        addr_len = sizeof(batch.addrs);
+        if (!WinDivertRecvEx(nat->handle6, batch.packet, batch.packet_max,
+                &batch.packet_len, 0, batch.addrs, &addr_len, NULL))
+        {
+            fprintf(stderr, "warning: failed to read packet (%d)\n",
+                GetLastError());
+            continue;
+        }
+        batch.count = addr_len / sizeof(WINDIVERT_ADDRESS);
+        now = (UINT32)(batch.addrs[0].Timestamp / freq.QuadPart);
+
+        EnterCriticalSection(&nat->lock);
+        nat64_out(nat, &batch, &out, now);
+        LeaveCriticalSection(&nat->lock);
+
+        if (out.count != 0 &&
+            !WinDivertSendEx(nat->handle4, out.packet, out.packet_len, NULL,
+                0, out.addrs, out.count * sizeof(WINDIVERT_ADDRESS), NULL))
+        {
+            fprintf(stderr, "warning: failed to send IPv4 packet (%d)\n",
+                GetLastError());
+        }
+    }
+    return 0;
+}
+
+/*
+ * Initialize the NAT64 state.
+ */
+static BOOL nat64_init(PNAT64 nat, UINT32 pool4, const UINT32 *prefix,
+    UINT prefix_len)
+{
+    UINT32 i;
+    UINT p;
+
+    nat->bindings = (BINDING *)malloc(MAX_BINDINGS * sizeof(BINDING));
+    nat->buckets  = (UINT32 *)malloc(NUM_BUCKETS * sizeof(UINT32));
+    if (nat->bindings == NULL || nat->buckets == NULL)
+    {
+        return FALSE;
+    }
+    for (p = 0; p < NUM_PROTOS; p++)
+    {
+        nat->ports[p]  = (UINT32 *)malloc(NUM_PORTS * sizeof(UINT32));
+        nat->bitmap[p] = (UINT64 *)calloc(NUM_PORTS / 64, sizeof(UINT64));
+        if (nat->ports[p] == NULL || nat->bitmap[p] == NULL)
+        {
+            return FALSE;
+        }
+        for (i = 0; i < NUM_PORTS; i++)
+        {
+            nat->ports[p][i] = NIL;
+        }
+        for (i = 0; i < PORT_MIN / 64; i++)
+        {
+            nat->bitmap[p][i] = ~0ull;      // Reserved ports
+        }
+        nat->cursor[p] = PORT_MIN / 64;
+    }
+    for (i = 0; i < NUM_BUCKETS; i++)
+    {
+        nat->buckets[i] = NIL;
+    }
+    for (i = 0; i < MAX_BINDINGS; i++)
+    {
+        nat->bindings[i].port4 = 0;
+        nat->bindings[i].next  = (i + 1 < MAX_BINDINGS? i + 1: NIL);
+    }
+    nat->free       = 0;
+    nat->hand       = 0;
+    nat->active     = 0;
+    nat->pool4      = pool4;
+    nat->prefix_len = prefix_len;
+    memcpy(nat->prefix, prefix, sizeof(nat->prefix));
+    InitializeCriticalSection(&nat->lock);
+    return TRUE;
+}
+
+/*
+ * Hash a binding key.
+ */
+static UINT32 binding_hash(UINT proto, const UINT32 *addr6, UINT16 port6)
+{
+    UINT64 h = ((UINT64)addr6[0] << 32 | addr6[1]) ^
+        ((UINT64)addr6[2] << 29) ^ ((UINT64)addr6[3] << 7) ^
+        ((UINT64)port6 << 48) ^ proto;
+
+    h *= 0x9E3779B97F4A7C15ull;
+    h ^= h >> 29;
+    h *= 0xBF58476D1CE4E5B9ull;
+    return (UINT32)(h >> 32) & (NUM_BUCKETS - 1);
+}
+
+/*
+ * Find the binding for a client address/port.
+ */
+static PBINDING binding_lookup(PNAT64 nat, UINT proto, const UINT32 *addr6,
+    UINT16 port6)
+{
+    PBINDING binding;
+    UINT32 idx = nat->buckets[binding_hash(proto, addr6, port6)];
+
+    for (; idx != NIL; idx = binding->next)
+    {
+        binding = nat->bindings + idx;
+        if (binding->port6 == port6 && binding->proto == proto &&
+            binding->addr6[0] == addr6[0] && binding->addr6[1] == addr6[1] &&
+            binding->addr6[2] == addr6[2] && binding->addr6[3] == addr6[3])
+        {
+            return binding;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Create a binding.  Returns NULL if there is no free pool port.
+ */
+static PBINDING binding_create(PNAT64 nat, UINT proto, const UINT32 *addr6,
+    UINT16 port6)
+{
+    PBINDING binding;
+    UINT32 idx = nat->free, hash;
+    UINT16 port4;
+
+    if (idx == NIL || (port4 = port_alloc(nat, proto)) == 0)
+    {
+        nat->exhausted++;
+        return NULL;
+    }
+    binding = nat->bindings + idx;
+    nat->free = binding->next;
+    hash = binding_hash(proto, addr6, port6);
+    memcpy(binding->addr6, addr6, sizeof(binding->addr6));
+    binding->port6     = port6;
+    binding->port4     = port4;
+    binding->proto     = (UINT8)proto;
+    binding->tcp_state = 0;
+    binding->next      = nat->buckets[hash];
+    nat->buckets[hash] = idx;
+    nat->ports[proto][port4] = idx;
+    nat->active++;
+    return binding;
+}
+
+/*
+ * Free a binding (and its pool port).
+ */
+static void binding_free(PNAT64 nat, UINT32 idx)
+{
+    PBINDING binding = nat->bindings + idx;
+    UINT32 *link = &nat->buckets[binding_hash(binding->proto,
+        binding->addr6, binding->port6)];
+
+    while (*link != idx)
+    {
+        link = &nat->bindings[*link].next;
+    }
+    *link = binding->next;
+    nat->ports[binding->proto][binding->port4] = NIL;
+    nat->bitmap[binding->proto][binding->port4 / 64] &=
+        ~(1ull << (binding->port4 % 64));
+    binding->port4 = 0;
+    binding->next  = nat->free;
+    nat->free      = idx;
+    nat->active--;
+}
+
+/*
+ * Refresh a binding's timeout (RFC 6146 Section 3.5).  TCP bindings are
+ * established once both sides have sent a SYN, and transitory before then,
+ * after a RST, or once both sides have sent a FIN.
+ */
+static void binding_touch(PBINDING binding, const WINDIVERT_TCPHDR *tcp,
+    BOOL from6, UINT32 now)
+{
+    UINT8 state;
+
+    switch (binding->proto)
+    {
+        case PROTO_TCP:
+            state = binding->tcp_state;
+            if (tcp->Rst)
+            {
+                state |= TCP_RST;
+            }
+            else if (tcp->Syn)
+            {
+                state = (state & ~TCP_RST) | (from6? TCP_SYN6: TCP_SYN4);
+            }
+            if (tcp->Fin)
+            {
+                state |= (from6? TCP_FIN6: TCP_FIN4);
+            }
+            binding->tcp_state = state;
+            binding->expire = now +
+                ((state & (TCP_SYN6 | TCP_SYN4)) == (TCP_SYN6 | TCP_SYN4) &&
+                 (state & TCP_RST) == 0 &&
+                 (state & (TCP_FIN6 | TCP_FIN4)) != (TCP_FIN6 | TCP_FIN4)?
+                    TCP_EST_TIMEOUT: TCP_TRANS_TIMEOUT);
+            break;
+        case PROTO_UDP:
+            binding->expire = now + UDP_TIMEOUT;
+            break;
+        default:
+            binding->expire = now + ICMP_TIMEOUT;
+            break;
+    }
+}
+
+/*
+ * Allocate a pool port.  The bitmap is scanned a word (64 ports) at a time
+ * from a rotating cursor, so allocation is fast until the pool is nearly
+ * full.  Returns 0 if there is no free port.
+ */
+static UINT16 port_alloc(PNAT64 nat, UINT proto)
+{
+    UINT64 *bitmap = nat->bitmap[proto], word;
+    UINT i, w = nat->cursor[proto], bit;
+
+    for (i = 0; i < NUM_PORTS / 64; i++, w = (w + 1) % (NUM_PORTS / 64))
+    {
+        word = bitmap[w];
+        if (word == ~0ull)
+        {
+            continue;
+        }
+        for (bit = 0; (word & (1ull << bit)) != 0; bit++)
+            ;
+        bitmap[w] |= (1ull << bit);
+        nat->cursor[proto] = w;
+        return (UINT16)(w * 64 + bit);
+    }
+    return 0;
+}
+
+/*
+ * Reclaim expired bindings (a few per call).
+ */
+static void nat64_sweep(PNAT64 nat, UINT count, UINT32 now)
+{
+    PBINDING binding;
+    UINT i;
+
+    for (i = 0; i < count; i++)
+    {
+        binding = nat->bindings + nat->hand;
+        if (binding->port4 != 0 && (INT32)(now - binding->expire) >= 0)
+        {
+            binding_free(nat, nat->hand);
+        }
+        nat->hand = (nat->hand + 1 < MAX_BINDINGS? nat->hand + 1: 0);
+    }
+}
+
+/*
+ * Translate a batch of IPv6 packets (from clients) to IPv4.
+ */
+static void nat64_out(PNAT64 nat, const PKTBATCH *batch, PPKTBATCH out,
+    UINT32 now)
+{
+    PWINDIVERT_IPV6HDR ipv6_header;
+    PWINDIVERT_ICMPV6HDR icmpv6_header;
+    PWINDIVERT_TCPHDR tcp_header;
+    PWINDIVERT_UDPHDR udp_header;
+    PBINDING binding;
+    WINDIVERT_XLAT_ADDR outer, inner;
+    WINDIVERT_ADDRESS addr;
+    UINT8 *packet = batch->packet, *quote;
+    UINT remaining = batch->packet_len, i, len, proto, quote_len;
+    UINT16 port6, src_port, dst_port;
+    UINT32 client[4], server4;
+    BOOL error;
+
+    out->packet_len = 0;
+    out->count      = 0;
+    memset(&addr, 0, sizeof(addr));
+    addr.Layer    = WINDIVERT_LAYER_NETWORK;
+    addr.Outbound = 1;
+    nat64_sweep(nat, SWEEP * batch->count, now);
+    for (i = 0; i < batch->count && remaining >= sizeof(WINDIVERT_IPV6HDR);
+            i++, packet += len, remaining -= len)
+    {
+        ipv6_header = (PWINDIVERT_IPV6HDR)packet;
+        len = sizeof(WINDIVERT_IPV6HDR) + ntohs(ipv6_header->Length);
+        if (ipv6_header->Version != 6 || len > remaining)
+        {
+            break;
+        }
+        if (!WinDivertHelperParsePacket(packet, len, NULL, NULL, NULL, NULL,
+                &icmpv6_header, &tcp_header, &udp_header, NULL, NULL, NULL,
+                NULL))
+        {
+            nat->dropped++;
+            continue;
+        }
+        WinDivertHelperNtohIPv6Address(ipv6_header->SrcAddr, client);
+        memset(&outer, 0, sizeof(outer));
+        memset(&inner, 0, sizeof(inner));
+        error = FALSE;
+        if (tcp_header != NULL)
+        {
+            proto = PROTO_TCP;
+            port6 = ntohs(tcp_header->SrcPort);
+        }
+        else if (udp_header != NULL)
+        {
+            proto = PROTO_UDP;
+            port6 = ntohs(udp_header->SrcPort);
+        }
+        else if (icmpv6_header != NULL && icmpv6_header->Type == ICMPV6_ECHO)
+        {
+            proto = PROTO_ICMP;
+            port6 = ntohs(((UINT16 *)icmpv6_header)[2]);
+        }
+        else if (icmpv6_header != NULL && icmpv6_header->Type < 128)
+        {
+            // An error about a packet sent to the client (client port is
+            // the quoted destination port):
+            quote = (UINT8 *)icmpv6_header + 8;
+            quote_len = len - (UINT)(quote - packet);
+            if (!quote_ports(quote, quote_len, &proto, &src_port, &dst_port))
+            {
+                nat->dropped++;
+                continue;
+            }
+            port6 = dst_port;
+            error = TRUE;
+        }
+        else
+        {
+            nat->dropped++;
+            continue;
+        }
+
+        // The server address must be in the prefix:
+        WinDivertHelperNtohIPv6Address(ipv6_header->DstAddr, outer.DstAddr);
+        if (!WinDivertHelperXlatExtractAddress(nat->prefix, nat->prefix_len,
+                outer.DstAddr, &server4))
+        {
+            nat->dropped++;
+            continue;
+        }
+        binding = binding_lookup(nat, proto, client, port6);
+        if (binding == NULL && !error)
+        {
+            binding = binding_create(nat, proto, client, port6);
+        }
+        if (binding == NULL)
+        {
+            nat->dropped++;
+            continue;
+        }
+        binding->if_idx     = batch->addrs[i].Network.IfIdx;
+        binding->sub_if_idx = batch->addrs[i].Network.SubIfIdx;
+
+        memset(outer.DstAddr, 0, sizeof(outer.DstAddr));
+        outer.SrcAddr[0] = nat->pool4;
+        outer.DstAddr[0] = server4;
+        if (error)
+        {
+            WinDivertHelperNtohIPv6Address(
+                ((PWINDIVERT_IPV6HDR)quote)->SrcAddr, client);
+            if (!WinDivertHelperXlatExtractAddress(nat->prefix,
+                    nat->prefix_len, client, &server4))
+            {
+                nat->dropped++;
+                continue;
+            }
+            inner.SrcAddr[0] = server4;
+            inner.DstAddr[0] = nat->pool4;
+            inner.DstPort    = binding->port4;
+        }
+        else
+        {
+            outer.SrcPort = binding->port4;
+            binding_touch(binding, tcp_header, /*from6=*/TRUE, now);
+        }
+        if (batch_xlat(out, packet, len, &outer, (error? &inner: NULL),
+                &addr))
+        {
+            nat->translated6++;
+        }
+        else
+        {
+            nat->dropped++;
+        }
+    }
+}
+
+/*
+ * Translate a batch of IPv4 packets (to the pool address) to IPv6.  Packets
+ * without a binding are appended to the pass batch.
+ */
+static void nat64_in(PNAT64 nat, const PKTBATCH *batch, PPKTBATCH out,
+    PPKTBATCH pass, UINT32 now)
+{
+    PWINDIVERT_IPHDR ip_header;
+    PWINDIVERT_ICMPHDR icmp_header;
+    PWINDIVERT_TCPHDR tcp_header;
+    PWINDIVERT_UDPHDR udp_header;
+    PBINDING binding;
+    WINDIVERT_XLAT_ADDR outer, inner;
+    WINDIVERT_ADDRESS addr;
+    UINT8 *packet = batch->packet, *quote;
+    UINT remaining = batch->packet_len, i, len, proto, quote_len;
+    UINT16 port4, src_port, dst_port;
+    UINT32 idx, server4;
+    BOOL error;
+
+    out->packet_len  = 0;
+    out->count       = 0;
+    pass->packet_len = 0;
+    pass->count      = 0;
+    memset(&addr, 0, sizeof(addr));
+    addr.Layer    = WINDIVERT_LAYER_NETWORK_FORWARD;
+    addr.Outbound = 1;
+    nat64_sweep(nat, SWEEP * batch->count, now);
+    for (i = 0; i < batch->count && remaining >= sizeof(WINDIVERT_IPHDR);
+            i++, packet += len, remaining -= len)
+    {
+        ip_header = (PWINDIVERT_IPHDR)packet;
+        len = ntohs(ip_header->Length);
+        if (ip_header->Version != 4 || len > remaining ||
+            len < sizeof(WINDIVERT_IPHDR))
+        {
+            break;
+        }
+        error = FALSE;
+        idx   = NIL;
+        if (WinDivertHelperParsePacket(packet, len, NULL, NULL, NULL,
+                &icmp_header, NULL, &tcp_header, &udp_header, NULL, NULL,
+                NULL, NULL))
+        {
+            if (tcp_header != NULL)
+            {
+                proto = PROTO_TCP;
+                port4 = ntohs(tcp_header->DstPort);
+            }
+            else if (udp_header != NULL)
+            {
+                proto = PROTO_UDP;
+                port4 = ntohs(udp_header->DstPort);
+            }
+            else if (icmp_header != NULL &&
+                     icmp_header->Type == ICMP_ECHO_REPLY)
+            {
+                proto = PROTO_ICMP;
+                port4 = ntohs(((UINT16 *)icmp_header)[2]);
+            }
+            else if (icmp_header != NULL &&
+                     (icmp_header->Type == ICMP_UNREACH ||
+                      icmp_header->Type == ICMP_TIME_EXCEEDED ||
+                      icmp_header->Type == ICMP_PARAM_PROBLEM))
+            {
+                // An error about a packet sent from the pool (pool port is
+                // the quoted source port):
+                quote = (UINT8 *)icmp_header + 8;
+                quote_len = len - (UINT)(quote - packet);
+                error = quote_ports(quote, quote_len, &proto, &port4,
+                    &dst_port);
+            }
+            if ((tcp_header != NULL || udp_header != NULL || error ||
+                    (icmp_header != NULL &&
+                     icmp_header->Type == ICMP_ECHO_REPLY)))
+            {
+                idx = nat->ports[proto][port4];
+            }
+        }
+        if (idx == NIL)
+        {
+            // Not ours (e.g. a ping to the pool address):
+            batch_append(pass, packet, len, &batch->addrs[i]);
+            nat->passed++;
+            continue;
+        }
+        binding = nat->bindings + idx;
+
+        memset(&outer, 0, sizeof(outer));
+        memset(&inner, 0, sizeof(inner));
+        server4 = ntohl(ip_header->SrcAddr);
+        WinDivertHelperXlatEmbedAddress(nat->prefix, nat->prefix_len,
+            server4, outer.SrcAddr);
+        memcpy(outer.DstAddr, binding->addr6, sizeof(outer.DstAddr));
+        if (error)
+        {
+            memcpy(inner.SrcAddr, binding->addr6, sizeof(inner.SrcAddr));
+            WinDivertHelperXlatEmbedAddress(nat->prefix, nat->prefix_len,
+                ntohl(((PWINDIVERT_IPHDR)quote)->DstAddr), inner.DstAddr);
+            inner.SrcPort = binding->port6;
+        }
+        else
+        {
+            outer.DstPort = binding->port6;
+            binding_touch(binding, tcp_header, /*from6=*/FALSE, now);
+        }
+        addr.Network.IfIdx    = binding->if_idx;
+        addr.Network.SubIfIdx = binding->sub_if_idx;
+        if (batch_xlat(out, packet, len, &outer, (error? &inner: NULL),
+                &addr))
+        {
+            nat->translated4++;
+        }
+        else
+        {
+            nat->dropped++;
+        }
+    }
+}
+
+/*
+ * Get the protocol and ports (or ICMP echo identifier) of a packet quoted
+ * by an ICMP/ICMPv6 error.  The quote may be truncated.
+ */
+static BOOL quote_ports(const UINT8 *quote, UINT quote_len, UINT *proto,
+    UINT16 *src_port, UINT16 *dst_port)
+{
+    const WINDIVERT_IPHDR *ip_header = (const WINDIVERT_IPHDR *)quote;
+    const WINDIVERT_IPV6HDR *ipv6_header = (const WINDIVERT_IPV6HDR *)quote;
+    const UINT8 *data;
+    UINT hdr_len;
+    UINT8 protocol;
+
+    if (quote_len < sizeof(WINDIVERT_IPHDR))
+    {
+        return FALSE;
+    }
+    if (ip_header->Version == 4)
+    {
+        hdr_len  = ip_header->HdrLength * sizeof(UINT32);
+        protocol = ip_header->Protocol;
+        if (WINDIVERT_IPHDR_GET_FRAGOFF(ip_header) != 0)
+        {
+            return FALSE;
+        }
+    }
+    else
+    {
+        hdr_len  = sizeof(WINDIVERT_IPV6HDR);
+        protocol = ipv6_header->NextHdr;
+    }
+    if (quote_len < hdr_len + 8)
+    {
+        return FALSE;
+    }
+    data = quote + hdr_len;
+    switch (protocol)
+    {
+        case IPPROTO_TCP:
+            *proto = PROTO_TCP;
+            break;
+        case IPPROTO_UDP:
+            *proto = PROTO_UDP;
+            break;
+        case IPPROTO_ICMP:
+        case IPPROTO_ICMPV6:
+            // Echo requests only (the identifier is the "port"):
+            if (data[0] != ICMP_ECHO && data[0] != ICMPV6_ECHO)
+            {
+                return FALSE;
+            }
+            *proto    = PROTO_ICMP;
+            *src_port = *dst_port = ntohs(*(const UINT16 *)(data + 4));
+            return TRUE;
+        default:
+            return FALSE;
+    }
+    *src_port = ntohs(*(const UINT16 *)data);
+    *dst_port = ntohs(*(const UINT16 *)(data + 2));
+    return TRUE;
+}
+
+/*
+ * Append a translated copy of a packet to a batch.  The copy is made with
+ * XLAT_GROWTH bytes of headroom, then moved down to close the gap.
+ */
+static BOOL batch_xlat(PPKTBATCH batch, const UINT8 *packet, UINT len,
+    const WINDIVERT_XLAT_ADDR *outer, const WINDIVERT_XLAT_ADDR *inner,
+    const WINDIVERT_ADDRESS *addr)
+{
+    UINT8 *dst = batch->packet + batch->packet_len;
+    PWINDIVERT_ADDRESS xlat_addr;
+    PVOID xlat;
+    UINT xlat_len;
+
+    if (batch->count >= BATCH ||
+        batch->packet_max - batch->packet_len < len + 2 * XLAT_GROWTH)
+    {
+        return FALSE;
+    }
+    xlat_addr  = &batch->addrs[batch->count];
+    *xlat_addr = *addr;
+    memcpy(dst + XLAT_GROWTH, packet, len);
+    if (!WinDivertHelperXlat(outer, inner, WINDIVERT_XLAT_FLAG_DECREMENT_TTL,
+            dst + XLAT_GROWTH, len, XLAT_GROWTH, len + XLAT_GROWTH, &xlat,
+            &xlat_len, xlat_addr))
+    {
+        return FALSE;
+    }
+    if (xlat != dst)
+    {
+        memmove(dst, xlat, xlat_len);
+    }
+    batch->packet_len += xlat_len;
+    batch->count++;
+    return TRUE;
+}
+
+/*
+ * Append a packet to a batch unchanged.
+ */
+static BOOL batch_append(PPKTBATCH batch, const UINT8 *packet, UINT len,
+    const WINDIVERT_ADDRESS *addr)
+{
+    if (batch->count >= BATCH || batch->packet_max - batch->packet_len < len)
+    {
+        return FALSE;
+    }
+    memcpy(batch->packet + batch->packet_len, packet, len);
+    batch->addrs[batch->count++] = *addr;
+    batch->packet_len += len;
+    return TRUE;
+}
+
+/*
+ * Allocate a batch.
+ */
+static BOOL batch_alloc(PPKTBATCH batch, UINT packet_max)
+{
+    batch->packet_max = packet_max;
+    batch->packet_len = 0;
+    batch->count      = 0;
+    batch->packet     = (UINT8 *)malloc(packet_max);
+    return (batch->packet != NULL);
+}
+
+/*
+ * Parse an IPv6 prefix "addr/len" (len must be 32, 40, 48, 56, 64 or 96).
+ */
+static BOOL parse_prefix(const char *str, UINT32 *prefix, UINT *len)
+{
+    char buf[64];
+    const char *slash = strchr(str, '/');
+    UINT32 addr6[4];
+
+    if (slash == NULL || (size_t)(slash - str) >= sizeof(buf))
+    {
+        return FALSE;
+    }
+    memcpy(buf, str, slash - str);
+    buf[slash - str] = '\0';
+    *len = (UINT)atoi(slash + 1);
+    return WinDivertHelperParseIPv6Address(buf, prefix) &&
+        WinDivertHelperXlatEmbedAddress(prefix, *len, 0, addr6);
+}
+
+/*
+ * Simple xorshift PRNG.
+ */
+static UINT64 random64(UINT64 *state)
+{
+    UINT64 x = *state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1Dull;
+}
+
+/*
+ * Build a batch of client (IPv6) packets: TCP, UDP and ICMPv6 echo to random
+ * servers in the prefix.  If num_clients is 0, every packet is from a new
+ * client (starting at *client), else from one of num_clients clients.
+ */
+static void bench_batch(PNAT64 nat, PPKTBATCH batch, UINT *client,
+    UINT num_clients, UINT64 *state)
+{
+    PWINDIVERT_IPV6HDR ipv6_header;
+    UINT8 *packet;
+    UINT32 client6[4], server6[4];
+    UINT i, len, hdr_len, payload;
+    UINT64 r;
+
+    batch->packet_len = 0;
+    batch->count      = 0;
+    for (i = 0; i < BATCH; i++)
+    {
+        r = random64(state);
+        packet  = batch->packet + batch->packet_len;
+        payload = (UINT)(r >> 56) % 3 == 0? 512: 64;
+        memset(packet, 0, 128);
+        ipv6_header = (PWINDIVERT_IPV6HDR)packet;
+        ipv6_header->Version  = 6;
+        ipv6_header->HopLimit = 64;
+        client6[3] = 0x20010DB8;            // 2001:db8::/64 clients
+        client6[2] = 0;
+        client6[1] = 0;
+        client6[0] = 1 + (num_clients == 0? (*client)++:
+            (UINT32)(r % num_clients));
+        WinDivertHelperXlatEmbedAddress(nat->prefix, nat->prefix_len,
+            0xC6120000 | (UINT32)((r >> 32) & 0xFFFF), server6);
+        WinDivertHelperHtonIPv6Address(client6, ipv6_header->SrcAddr);
+        WinDivertHelperHtonIPv6Address(server6, ipv6_header->DstAddr);
+        switch (i % 4)
+        {
+            case 0: case 1:
+                ipv6_header->NextHdr = IPPROTO_TCP;
+                hdr_len = sizeof(WINDIVERT_TCPHDR);
+                packet[40 + 12] = 0x50;     // TCP data offset
+                packet[40 + 13] = 0x10;     // ACK
+                break;
+            case 2:
+                ipv6_header->NextHdr = IPPROTO_UDP;
+                hdr_len = sizeof(WINDIVERT_UDPHDR);
+                *(UINT16 *)(packet + 40 + 4) =
+                    htons((UINT16)(hdr_len + payload));
+                break;
+            default:
+                ipv6_header->NextHdr = IPPROTO_ICMPV6;
+                hdr_len = 8;
+                packet[40] = ICMPV6_ECHO;
+                break;
+        }
+        if (ipv6_header->NextHdr == IPPROTO_ICMPV6)
+        {
+            *(UINT16 *)(packet + 44) = htons((UINT16)(10000 + (r >> 48) % 4));
+        }
+        else
+        {
+            *(UINT16 *)(packet + 40) = htons((UINT16)(10000 + (r >> 48) % 4));
+            *(UINT16 *)(packet + 42) = htons(80);
+        }
+        len = sizeof(WINDIVERT_IPV6HDR) + hdr_len + payload;
+        memset(packet + 40 + hdr_len, (int)(r & 0xFF), payload);
+        ipv6_header->Length = htons((UINT16)(len - 40));
+        WinDivertHelperCalcChecksums(packet, len, NULL, 0);
+        memset(&batch->addrs[i], 0, sizeof(WINDIVERT_ADDRESS));
+        batch->addrs[i].Layer = WINDIVERT_LAYER_NETWORK_FORWARD;
+        batch->addrs[i].IPv6  = 1;
+        batch->addrs[i].Network.IfIdx = 7;
+        batch->packet_len += len;
+        batch->count++;
+    }
+}
+
+/*
+ * Turn translated IPv4 packets into server replies (swap the addresses and
+ * ports, and recompute the checksums).
+ */
+static void bench_reply(PPKTBATCH batch)
+{
+    PWINDIVERT_IPHDR ip_header;
+    UINT8 *packet = batch->packet, *data;
+    UINT i, len;
+    UINT32 addr;
+    UINT16 port;
+
+    for (i = 0; i < batch->count; i++, packet += len)
+    {
+        ip_header = (PWINDIVERT_IPHDR)packet;
+        len  = ntohs(ip_header->Length);
+        data = packet + ip_header->HdrLength * 4;
+        addr = ip_header->SrcAddr;
+        ip_header->SrcAddr = ip_header->DstAddr;
+        ip_header->DstAddr = addr;
+        ip_header->TTL     = 64;
+        if (ip_header->Protocol == IPPROTO_ICMP)
+        {
+            data[0] = ICMP_ECHO_REPLY;
+        }
+        else
+        {
+            port = ((UINT16 *)data)[0];
+            ((UINT16 *)data)[0] = ((UINT16 *)data)[1];
+            ((UINT16 *)data)[1] = port;
+        }
+        WinDivertHelperCalcChecksums(packet, len, NULL, 0);
+        batch->addrs[i].Layer    = WINDIVERT_LAYER_NETWORK;
+        batch->addrs[i].Outbound = 0;
+    }
+}
+
+/*
+ * Check a round trip: each reply must be a valid IPv6 packet from the
+ * server the request was sent to, back to the client address and port (or
+ * identifier) it came from, via the client's interface.
+ */
+static BOOL bench_check(const PKTBATCH *requests, const PKTBATCH *replies)
+{
+    UINT8 copy[MTU + 2 * XLAT_GROWTH];
+    const UINT8 *request = requests->packet, *reply = replies->packet;
+    const WINDIVERT_IPV6HDR *req_header, *rep_header;
+    UINT i, req_len, rep_len, port_off;
+
+    if (requests->count != replies->count)
+    {
+        return FALSE;
+    }
+    for (i = 0; i < replies->count; i++, request += req_len, reply += rep_len)
+    {
+        req_header = (const WINDIVERT_IPV6HDR *)request;
+        rep_header = (const WINDIVERT_IPV6HDR *)reply;
+        req_len = 40 + ntohs(req_header->Length);
+        rep_len = 40 + ntohs(rep_header->Length);
+        port_off = (req_header->NextHdr == IPPROTO_ICMPV6? 4: 0);
+        memcpy(copy, reply, rep_len);
+        WinDivertHelperCalcChecksums(copy, rep_len, NULL, 0);
+        if (rep_header->Version != 6 || rep_len != req_len ||
+            memcmp(copy, reply, rep_len) != 0 ||
+            memcmp(rep_header->SrcAddr, req_header->DstAddr, 16) != 0 ||
+            memcmp(rep_header->DstAddr, req_header->SrcAddr, 16) != 0 ||
+            *(const UINT16 *)(reply + 40 + (port_off == 0? 2: 4)) !=
+                *(const UINT16 *)(request + 40 + port_off) ||
+            rep_header->HopLimit != 63 ||
+            !replies->addrs[i].IPv6 ||
+            replies->addrs[i].Network.IfIdx != 7)
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/*
+ * Offline benchmark.  Batches of client packets are translated to IPv4
+ * (creating the bindings), turned into server replies, and translated back,
+ * and the round trip is checked.  Then binding creation and each direction
+ * of the steady state are timed.
+ */
+static void benchmark(UINT num_clients)
+{
+    static NAT64 nat, nat2;
+    static PKTBATCH requests[256], replies[256], out, pass;
+    const UINT num_batches = 256, rounds = 20000, new_batches = 1500;
+    UINT i, client = 0;
+    UINT64 state = 0x123456789ABCDEFull;
+    UINT32 prefix[4];
+    PPKTBATCH fresh;
+    LARGE_INTEGER freq, start, end;
+    double secs;
+
+    if (num_clients == 0)
+    {
+        fprintf(stderr, "error: invalid number of clients\n");
+        exit(EXIT_FAILURE);
+    }
+    WinDivertHelperParseIPv6Address("64:ff9b::", prefix);
+    fresh = (PPKTBATCH)malloc(new_batches * sizeof(PKTBATCH));
+    if (fresh == NULL ||
+        !nat64_init(&nat, 0xC6336401, prefix, 96) ||    // 198.51.100.1
+        !nat64_init(&nat2, 0xC6336401, prefix, 96) ||
+        !batch_alloc(&out, BATCH * (MTU + 2 * XLAT_GROWTH)) ||
+        !batch_alloc(&pass, BATCH * MTU))
+    {
+        fprintf(stderr, "error: failed to allocate bindings\n");
+        exit(EXIT_FAILURE);
+    }
+    QueryPerformanceFrequency(&freq);
+
+    // (1) Verify the round trip:
+    for (i = 0; i < num_batches; i++)
+    {
+        if (!batch_alloc(&requests[i], BATCH * MTU) ||
+            !batch_alloc(&replies[i], BATCH * (MTU + 2 * XLAT_GROWTH)))
+        {
+            fprintf(stderr, "error: failed to allocate buffer\n");
+            exit(EXIT_FAILURE);
+        }
+        bench_batch(&nat, &requests[i], &client, num_clients, &state);
+        nat64_out(&nat, &requests[i], &replies[i], /*now=*/0);
+        bench_reply(&replies[i]);
+        nat64_in(&nat, &replies[i], &out, &pass, /*now=*/0);
+        if (!bench_check(&requests[i], &out))
+        {
+            fprintf(stderr, "error: round trip mismatch in batch %u\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    printf("verify: %u round trips OK (%u bindings for %u clients)\n",
+        num_batches * BATCH, nat.active, num_clients);
+
+    // (2) Binding creation (every packet from a new client):
+    for (i = 0; i < new_batches; i++)
+    {
+        if (!batch_alloc(&fresh[i], BATCH * MTU))
+        {
+            fprintf(stderr, "error: failed to allocate buffer\n");
+            exit(EXIT_FAILURE);
+        }
+        bench_batch(&nat2, &fresh[i], &client, 0, &state);
+    }
+    QueryPerformanceCounter(&start);
+    for (i = 0; i < new_batches; i++)
+    {
+        nat64_out(&nat2, &fresh[i], &out, /*now=*/0);
+    }
+    QueryPerformanceCounter(&end);
+    secs = (double)(end.QuadPart - start.QuadPart) / freq.QuadPart;
+    printf("create: %.1f ns/packet (%u new bindings)\n",
+        1.0e9 * secs / ((double)new_batches * BATCH), nat2.active);
+
+    // (3) Steady state, both directions:
+    QueryPerformanceCounter(&start);
+    for (i = 0; i < rounds; i++)
+    {
+        nat64_out(&nat, &requests[i % num_batches], &out, /*now=*/1);
+    }
+    QueryPerformanceCounter(&end);
+    secs = (double)(end.QuadPart - start.QuadPart) / freq.QuadPart;
+    printf("IPv6->IPv4: %.1f ns/packet (%.2f Mpps)\n",
+        1.0e9 * secs / ((double)rounds * BATCH),
+        (double)rounds * BATCH / secs / 1.0e6);
+    QueryPerformanceCounter(&start);
+    for (i = 0; i < rounds; i++)
+    {
+        nat64_in(&nat, &replies[i % num_batches], &out, &pass, /*now=*/1);
+    }
+    QueryPerformanceCounter(&end);
+    secs = (double)(end.QuadPart - start.QuadPart) / freq.QuadPart;
+    printf("IPv4->IPv6: %.1f ns/packet (%.2f Mpps)\n",
+        1.0e9 * secs / ((double)rounds * BATCH),
+        (double)rounds * BATCH / secs / 1.0e6);
+    printf("packets: %llu translated out, %llu translated in, %llu passed, "
+        "%llu dropped, %llu port exhaustion\n", nat.translated6,
+        nat.translated4, nat.passed, nat.dropped, nat.exhausted);
+}
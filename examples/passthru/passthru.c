@@ -37,25 +37,39 @@
  * This program does nothing except divert packets and re-inject them.  This is
  * useful for performance testing.
  *
+ * With multiple threads, packets may be re-injected out-of-order.  The
+ * optional "order" argument ("global" or "flow") uses a sequencer to restore
+ * the original order (globally or per flow) before re-injection.
+ *
+ * The optional "reads" argument instead uses a receive pool
+ * (WinDivertRecvPool*) that keeps that many reads in flight, and re-injects
+ * packets from the pool's callback.  This cannot be combined with an order.
+ *
  * usage: passthru.exe [windivert-filter] [num-threads] [batch-size] [priority]
+ *        [order] [reads]
  */
 
 #include <winsock2.h>
 #include <windows.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "windivert.h"
 
 #define MTU 1500
+#define ORDER_TIMEOUT 50        // Max reorder wait (ms)
 
 typedef struct
 {
     HANDLE handle;
+    PWINDIVERT_SEQUENCER sequencer;
     int batch;
 } CONFIG, *PCONFIG;
 
 static DWORD passthru(LPVOID arg);
+static void passthru_batch(PVOID context, const VOID *packet, UINT packet_len,
+    const WINDIVERT_ADDRESS *addr, UINT count);
 
 /*
  * Entry.
@@ -63,15 +77,19 @@ static DWORD passthru(LPVOID arg);
 int __cdecl main(int argc, char **argv)
 {
     const char *filter = "true";
-    int threads = 1, batch = 1, priority = 0;
+    int threads = 1, batch = 1, priority = 0, reads = 0;
     int i;
     HANDLE handle, thread;
     CONFIG config;
+    PWINDIVERT_RECV_POOL pool;
+    UINT packet_len;
+    UINT64 order = 0;
+    BOOL ordered = FALSE;
 
-    if (argc > 5)
+    if (argc > 7)
     {
         fprintf(stderr, "usage: %s [filter] [num-threads] [batch-size] "
-            "[priority]\n", argv[0]);
+            "[priority] [order] [reads]\n", argv[0]);
         exit(EXIT_FAILURE);
     }
     if (argc >= 2)
@@ -106,6 +124,33 @@ int __cdecl main(int argc, char **argv)
             exit(EXIT_FAILURE);
         }
     }
+    if (argc >= 6)
+    {
+        ordered = TRUE;
+        if (strcmp(argv[5], "flow") == 0)
+        {
+            order = WINDIVERT_SEQUENCER_FLAG_FLOW;
+        }
+        else if (strcmp(argv[5], "none") == 0)
+        {
+            ordered = FALSE;
+        }
+        else if (strcmp(argv[5], "global") != 0)
+        {
+            fprintf(stderr, "error: invalid order (expected \"global\", "
+                "\"flow\" or \"none\")\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (argc >= 7)
+    {
+        reads = atoi(argv[6]);
+        if (reads < 1 || reads > 64 || ordered)
+        {
+            fprintf(stderr, "error: invalid number of reads\n");
+            exit(EXIT_FAILURE);
+        }
+    }
 
     // Divert traffic matching the filter:
     handle = WinDivertOpen(filter, WINDIVERT_LAYER_NETWORK, (INT16)priority,
@@ -122,9 +167,44 @@ int __cdecl main(int argc, char **argv)
         exit(EXIT_FAILURE);
     }
 
+    // Use a receive pool:
+    if (reads != 0)
+    {
+        packet_len = batch * MTU;
+        packet_len =
+            (packet_len < WINDIVERT_MTU_MAX? WINDIVERT_MTU_MAX: packet_len);
+        pool = WinDivertRecvPoolCreate(handle, (UINT)reads, (UINT)threads,
+            packet_len, (UINT)batch, 0, passthru_batch, (PVOID)handle);
+        if (pool == NULL)
+        {
+            fprintf(stderr, "error: failed to create receive pool (%d)\n",
+                GetLastError());
+            exit(EXIT_FAILURE);
+        }
+        if (!WinDivertRecvPoolWait(pool, INFINITE))
+        {
+            fprintf(stderr, "error: failed to read packet (%d)\n",
+                GetLastError());
+        }
+        WinDivertRecvPoolFree(pool);
+        return 0;
+    }
+
     // Start the threads
     config.handle = handle;
+    config.sequencer = NULL;
     config.batch = batch;
+    if (ordered)
+    {
+        config.sequencer = WinDivertSequencerCreate(handle, order,
+            ORDER_TIMEOUT);
+        if (config.sequencer == NULL)
+        {
+            fprintf(stderr, "error: failed to create sequencer (%d)\n",
+                GetLastError());
+            exit(EXIT_FAILURE);
+        }
+    }
     for (i = 1; i < threads; i++)
     {
         thread = CreateThread(NULL, 1, (LPTHREAD_START_ROUTINE)passthru,
@@ -151,9 +231,12 @@ static DWORD passthru(LPVOID arg)
     WINDIVERT_ADDRESS *addr;
     PCONFIG config = (PCONFIG)arg;
     HANDLE handle;
+    PWINDIVERT_SEQUENCER sequencer;
+    BOOL result;
     int batch;
 
     handle = config->handle;
+    sequencer = config->sequencer;
     batch = config->batch;
 
     packet_len = batch * MTU;
@@ -173,8 +256,17 @@ static DWORD passthru(LPVOID arg)
     {
         // Read a matching packet.
         addr_len = batch * sizeof(WINDIVERT_ADDRESS);
-        if (!WinDivertRecvEx(handle, packet, packet_len, &recv_len, 0,
-                addr, &addr_len, NULL))
+        if (sequencer != NULL)
+        {
+            result = WinDivertSequencerRecvEx(sequencer, packet, packet_len,
+                &recv_len, 0, addr, &addr_len);
+        }
+        else
+        {
+            result = WinDivertRecvEx(handle, packet, packet_len, &recv_len,
+                0, addr, &addr_len, NULL);
+        }
+        if (!result)
         {
             fprintf(stderr, "warning: failed to read packet (%d)\n",
                 GetLastError());
@@ -182,8 +274,17 @@ static DWORD passthru(LPVOID arg)
         }
 
         // Re-inject the matching packet.
-        if (!WinDivertSendEx(handle, packet, recv_len, NULL, 0, addr,
-                addr_len, NULL))
+        if (sequencer != NULL)
+        {
+            result = WinDivertSequencerSendEx(sequencer, packet, recv_len, 0,
+                addr, addr_len);
+        }
+        else
+        {
+            result = WinDivertSendEx(handle, packet, recv_len, NULL, 0, addr,
+                addr_len, NULL);
+        }
+        if (!result)
         {
             fprintf(stderr, "warning: failed to reinject packet (%d)\n",
                 GetLastError());
@@ -191,3 +292,17 @@ static DWORD passthru(LPVOID arg)
     }
 }
 
+
+// Receive pool callback.
+static void passthru_batch(PVOID context, const VOID *packet, UINT packet_len,
+    const WINDIVERT_ADDRESS *addr, UINT count)
+{
+    HANDLE handle = (HANDLE)context;
+
+    if (!WinDivertSendEx(handle, packet, packet_len, NULL, 0, addr,
+            count * sizeof(WINDIVERT_ADDRESS), NULL))
+    {
+        fprintf(stderr, "warning: failed to reinject packet (%d)\n",
+            GetLastError());
+    }
+}
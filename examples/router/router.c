@@ -0,0 +1,1301 @@
+/*
+ * router.c
+ * (C) 2019, all rights reserved,
+ *
+ * This file is part of WinDivert.
+ *
+ * WinDivert is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * WinDivert is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+
+/*
+ * DESCRIPTION:
+ * This is a simple user-mode policy router.  Forwarded IPv4/IPv6 packets are
+ * captured at the WINDIVERT_LAYER_NETWORK_FORWARD layer in batches, looked up
+ * in a forwarding information base (FIB), and reinjected on the interface
+ * selected by the longest matching route (by rewriting Network.IfIdx).  The
+ * TTL/HopLimit is decremented with an incremental checksum update, and
+ * packets that expire are answered with an ICMP/ICMPv6 time exceeded error.
+ *
+ * The IPv4 FIB is a DIR-24-8 table (one memory access for prefixes up to /24,
+ * two otherwise).  The IPv6 FIB is a multibit trie with a 16-bit first stride
+ * followed by 8-bit strides.  Both use leaf pushing, so a lookup never needs
+ * to backtrack.  Packets that match no route are forwarded unchanged.
+ *
+ * The routes file contains one entry per line:
+ *
+ *     10.0.0.0/8 12           # Forward via interface 12
+ *     2001:db8::/32 7.1       # Forward via interface 7, sub-interface 1
+ *     192.168.0.0/16 drop     # Drop
+ *     source 192.0.2.1        # Source address for ICMP errors
+ *     source 2001:db8::1      # Source address for ICMPv6 errors
+ *
+ * usage: router.exe routes-file [filter]
+ *        router.exe --bench [num-routes]
+ */
+
+#include <winsock2.h>
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "windivert.h"
+
+#define ntohs(x)            WinDivertHelperNtohs(x)
+#define ntohl(x)            WinDivertHelperNtohl(x)
+#define htons(x)            WinDivertHelperHtons(x)
+#define htonl(x)            WinDivertHelperHtonl(x)
+
+#define MTU                 1500
+#define BATCH               64
+#define MAX_NEXTHOPS        1024
+#define NH_NONE             0               // No route
+#define NH_DROP             1               // Drop route
+#define TBL8_FLAG           0x8000          // tbl24 entry is a tbl8 group
+#define TBL8_MAX            0x7FFF          // Max tbl8 groups
+#define GROUP6_FLAG         0x80000000      // Trie entry is a group
+#define GROUP6_MAX          0x40000         // Max IPv6 trie groups
+#define ICMP_RATE           100             // Max ICMP errors per second
+#define ICMP_MAX            576             // Max ICMP error length
+#define ICMPV6_MAX          1280            // Max ICMPv6 error length
+
+/*
+ * Next hop.
+ */
+typedef struct
+{
+    UINT32 if_idx;                          // Outbound interface
+    UINT32 sub_if_idx;                      // Outbound sub-interface
+} NEXTHOP, *PNEXTHOP;
+
+/*
+ * IPv4 FIB (DIR-24-8).
+ */
+typedef struct
+{
+    UINT16 *tbl24;                          // 2^24 entries
+    UINT16 *tbl8;                           // Groups of 256 entries
+    UINT num_tbl8;
+    UINT max_tbl8;
+} FIB4, *PFIB4;
+
+/*
+ * IPv6 FIB (16-8-8-...-8 multibit trie).
+ */
+typedef struct
+{
+    UINT32 *root;                           // 2^16 entries
+    UINT32 *groups;                         // Groups of 256 entries
+    UINT num_groups;
+    UINT max_groups;
+} FIB6, *PFIB6;
+
+/*
+ * Route (as parsed from the routes file).
+ */
+typedef struct
+{
+    UINT8 addr[16];                         // Prefix (network order)
+    UINT8 len;                              // Prefix length
+    BOOL ipv6;                              // IPv6 route?
+    UINT16 nh;                              // Next hop
+    UINT seq;                               // Line order
+} ROUTE, *PROUTE;
+
+/*
+ * A batch of packets.
+ */
+typedef struct
+{
+    UINT8 *packet;                          // Packet data
+    UINT packet_len;                        // Packet data length
+    UINT packet_max;                        // Packet data size
+    UINT count;                             // Number of packets
+    WINDIVERT_ADDRESS addrs[BATCH];         // Packet addresses
+} PKTBATCH, *PPKTBATCH;
+
+/*
+ * Router state.
+ */
+typedef struct
+{
+    FIB4 fib4;
+    FIB6 fib6;
+    NEXTHOP nexthops[MAX_NEXTHOPS];         // Indexed by next hop
+    UINT num_nexthops;
+    UINT32 src4;                            // ICMP source (network order)
+    UINT8 src6[16];                         // ICMPv6 source (network order)
+    BOOL have_src4;
+    BOOL have_src6;
+    UINT32 icmp_time;                       // ICMP rate limit second
+    UINT icmp_count;                        // ICMP errors sent this second
+    UINT64 forwarded;                       // Packets forwarded via route
+    UINT64 unrouted;                        // Packets with no route
+    UINT64 dropped;                         // Packets dropped by route
+    UINT64 expired;                         // Packets with expired TTL
+} ROUTER, *PROUTER;
+
+/*
+ * Prototypes.
+ */
+static BOOL fib4_init(PFIB4 fib);
+static BOOL fib4_insert(PFIB4 fib, UINT32 addr, UINT len, UINT16 nh);
+static UINT16 fib4_lookup(const FIB4 *fib, UINT32 addr);
+static BOOL fib6_init(PFIB6 fib);
+static BOOL fib6_insert(PFIB6 fib, const UINT8 *addr, UINT len, UINT16 nh);
+static UINT16 fib6_lookup(const FIB6 *fib, const UINT8 *addr);
+static BOOL router_build(PROUTER router, PROUTE routes, UINT num_routes);
+static UINT16 router_nexthop(PROUTER router, UINT32 if_idx,
+    UINT32 sub_if_idx);
+static void router_forward(PROUTER router, PPKTBATCH batch,
+    PPKTBATCH errors, UINT32 now);
+static UINT icmp_time_exceeded(PROUTER router, const UINT8 *packet,
+    UINT packet_len, UINT8 *error, UINT error_max, UINT32 now);
+static void checksum_update16(UINT16 *checksum, UINT16 old_word,
+    UINT16 new_word);
+static BOOL parse_prefix(const char *str, PROUTE route);
+static PROUTE load_routes(PROUTER router, const char *filename,
+    UINT *num_routes);
+static int __cdecl route_compare(const void *a, const void *b);
+static void benchmark(UINT num_routes);
+
+/*
+ * Entry.
+ */
+int __cdecl main(int argc, char **argv)
+{
+    static ROUTER router;
+    static PKTBATCH batch, errors;
+    HANDLE handle, send_handle;
+    const char *filter = "true", *err_str;
+    PROUTE routes;
+    UINT num_routes, addr_len;
+    UINT32 now;
+    LARGE_INTEGER freq;
+
+    if (argc >= 2 && strcmp(argv[1], "--bench") == 0)
+    {
+        benchmark(argc >= 3? (UINT)atoi(argv[2]): 500000);
+        return 0;
+    }
+    switch (argc)
+    {
+        case 2:
+            break;
+        case 3:
+            filter = argv[2];
+            break;
+        default:
+            fprintf(stderr, "usage: %s routes-file [filter]\n", argv[0]);
+            fprintf(stderr, "       %s --bench [num-routes]\n", argv[0]);
+            exit(EXIT_FAILURE);
+    }
+
+    // Load the routes and build the FIB:
+    routes = load_routes(&router, argv[1], &num_routes);
+    if (routes == NULL)
+    {
+        exit(EXIT_FAILURE);
+    }
+    if (!router_build(&router, routes, num_routes))
+    {
+        fprintf(stderr, "error: failed to build FIB (too many routes?)\n");
+        exit(EXIT_FAILURE);
+    }
+    free(routes);
+    printf("loaded %u routes (%u tbl8 groups, %u IPv6 groups)\n",
+        num_routes, router.fib4.num_tbl8, router.fib6.num_groups);
+
+    // Open the handles.  ICMP errors originate from this host, so they are
+    // sent via a separate send-only network layer handle.
+    if (!WinDivertHelperCompileFilter(filter, WINDIVERT_LAYER_NETWORK_FORWARD,
+            NULL, 0, &err_str, NULL))
+    {
+        fprintf(stderr, "error: invalid filter \"%s\"\n", err_str);
+        exit(EXIT_FAILURE);
+    }
+    handle = WinDivertOpen(filter, WINDIVERT_LAYER_NETWORK_FORWARD, 0, 0);
+    send_handle = WinDivertOpen("false", WINDIVERT_LAYER_NETWORK, 0,
+        WINDIVERT_FLAG_SEND_ONLY);
+    if (handle == INVALID_HANDLE_VALUE || send_handle == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "error: failed to open the WinDivert device (%d)\n",
+            GetLastError());
+        exit(EXIT_FAILURE);
+    }
+
+    QueryPerformanceFrequency(&freq);
+    batch.packet_max  = BATCH * MTU;
+    batch.packet      = (UINT8 *)malloc(batch.packet_max);
+    errors.packet_max = BATCH * ICMPV6_MAX;
+    errors.packet     = (UINT8 *)malloc(errors.packet_max);
+    if (batch.packet == NULL || errors.packet == NULL)
+    {
+        fprintf(stderr, "error: failed to allocate buffer (%d)\n",
+            GetLastError());
+        exit(EXIT_FAILURE);
+    }
+
+    // Main loop:
+    while (TRUE)
+    {
+        addr_len = sizeof(batch.addrs);
+        if (!WinDivertRecvEx(handle, batch.packet, batch.packet_max,
+                &batch.packet_len, 0, batch.addrs, &addr_len, NULL))
+        {
+            fprintf(stderr, "warning: failed to read packet (%d)\n",
+                GetLastError());
+            continue;
+        }
+        batch.count = addr_len / sizeof(WINDIVERT_ADDRESS);
+
+        now = (UINT32)(batch.addrs[0].Timestamp / freq.QuadPart);
+        router_forward(&router, &batch, &errors, now);
+
+        if (batch.count != 0 &&
+            !WinDivertSendEx(handle, batch.packet, batch.packet_len, NULL, 0,
+                batch.addrs, batch.count * sizeof(WINDIVERT_ADDRESS), NULL))
+        {
+            fprintf(stderr, "warning: failed to forward packet (%d)\n",
+                GetLastError());
+        }
+        if (errors.count != 0 &&
+            !WinDivertSendEx(send_handle, errors.packet, errors.packet_len,
+                NULL, 0, errors.addrs,
+                errors.count * sizeof(WINDIVERT_ADDRESS), NULL))
+        {
+            fprintf(stderr, "warning: failed to send ICMP error (%d)\n",
+                GetLastError());
+        }
+    }
+}
+
+/*
+ * Initialize an empty IPv4 FIB.
+ */
+static BOOL fib4_init(PFIB4 fib)
+{
+    fib->tbl24    = (UINT16 *)calloc(1 << 24, sizeof(UINT16));
+    fib->max_tbl8 = 256;
+    fib->num_tbl8 = 0;
+    fib->tbl8     = (UINT16 *)malloc(fib->max_tbl8 * 256 * sizeof(UINT16));
+    return (fib->tbl24 != NULL && fib->tbl8 != NULL);
+}
+
+/*
+ * Insert an IPv4 route (addr in host order).  Routes must be inserted in
+ * order of increasing prefix length, so that a longer prefix always
+ * overwrites the entries of the shorter prefixes that cover it, and a tbl8
+ * group can be seeded from the tbl24 entry it replaces.
+ */
+static BOOL fib4_insert(PFIB4 fib, UINT32 addr, UINT len, UINT16 nh)
+{
+    UINT16 entry, *tbl8;
+    UINT32 start, count, i, group;
+
+    addr &= (len == 0? 0: 0xFFFFFFFF << (32 - len));
+    if (len <= 24)
+    {
+        start = addr >> 8;
+        count = 1 << (24 - len);
+        for (i = 0; i < count; i++)
+        {
+            fib->tbl24[start + i] = nh;
+        }
+        return TRUE;
+    }
+
+    entry = fib->tbl24[addr >> 8];
+    if ((entry & TBL8_FLAG) != 0)
+    {
+        group = entry & ~TBL8_FLAG;
+    }
+    else
+    {
+        if (fib->num_tbl8 >= fib->max_tbl8)
+        {
+            if (fib->max_tbl8 >= TBL8_MAX)
+            {
+                return FALSE;
+            }
+            i = fib->max_tbl8 * 2;
+            i = (i > TBL8_MAX? TBL8_MAX: i);
+            tbl8 = (UINT16 *)realloc(fib->tbl8, i * 256 * sizeof(UINT16));
+            if (tbl8 == NULL)
+            {
+                return FALSE;
+            }
+            fib->tbl8     = tbl8;
+            fib->max_tbl8 = i;
+        }
+        group = fib->num_tbl8++;
+        for (i = 0; i < 256; i++)
+        {
+            fib->tbl8[group * 256 + i] = entry;
+        }
+        fib->tbl24[addr >> 8] = (UINT16)(TBL8_FLAG | group);
+    }
+    start = addr & 0xFF;
+    count = 1 << (32 - len);
+    for (i = 0; i < count; i++)
+    {
+        fib->tbl8[group * 256 + start + i] = nh;
+    }
+    return TRUE;
+}
+
+/*
+ * Look up an IPv4 address (host order).
+ */
+static UINT16 fib4_lookup(const FIB4 *fib, UINT32 addr)
+{
+    UINT16 entry = fib->tbl24[addr >> 8];
+
+    if ((entry & TBL8_FLAG) != 0)
+    {
+        entry = fib->tbl8[((UINT32)(entry & ~TBL8_FLAG) << 8) |
+            (addr & 0xFF)];
+    }
+    return entry;
+}
+
+/*
+ * Initialize an empty IPv6 FIB.
+ */
+static BOOL fib6_init(PFIB6 fib)
+{
+    fib->root       = (UINT32 *)calloc(1 << 16, sizeof(UINT32));
+    fib->max_groups = 256;
+    fib->num_groups = 0;
+    fib->groups     =
+        (UINT32 *)malloc(fib->max_groups * 256 * sizeof(UINT32));
+    return (fib->root != NULL && fib->groups != NULL);
+}
+
+/*
+ * Get the group that an IPv6 trie entry points to, converting the entry
+ * into a group (seeded with its next hop) if necessary.  Returns
+ * GROUP6_FLAG on failure.
+ */
+static UINT32 fib6_group(PFIB6 fib, BOOL root, UINT32 idx)
+{
+    UINT32 entry, group, i, *groups;
+
+    entry = (root? fib->root[idx]: fib->groups[idx]);
+    if ((entry & GROUP6_FLAG) != 0)
+    {
+        return entry & ~GROUP6_FLAG;
+    }
+    if (fib->num_groups >= fib->max_groups)
+    {
+        if (fib->max_groups >= GROUP6_MAX)
+        {
+            return GROUP6_FLAG;
+        }
+        i = fib->max_groups * 2;
+        i = (i > GROUP6_MAX? GROUP6_MAX: i);
+        groups = (UINT32 *)realloc(fib->groups, i * 256 * sizeof(UINT32));
+        if (groups == NULL)
+        {
+            return GROUP6_FLAG;
+        }
+        fib->groups     = groups;
+        fib->max_groups = i;
+    }
+    group = fib->num_groups++;
+    for (i = 0; i < 256; i++)
+    {
+        fib->groups[group * 256 + i] = entry;
+    }
+    if (root)
+    {
+        fib->root[idx] = GROUP6_FLAG | group;
+    }
+    else
+    {
+        fib->groups[idx] = GROUP6_FLAG | group;
+    }
+    return group;
+}
+
+/*
+ * Insert an IPv6 route (addr in network order).  As with fib4_insert(),
+ * routes must be inserted in order of increasing prefix length.
+ */
+static BOOL fib6_insert(PFIB6 fib, const UINT8 *addr, UINT len, UINT16 nh)
+{
+    UINT32 start, count, i, group;
+    UINT k;
+
+    start = ((UINT32)addr[0] << 8) | addr[1];
+    if (len <= 16)
+    {
+        count = 1 << (16 - len);
+        start &= ~(count - 1);
+        for (i = 0; i < count; i++)
+        {
+            fib->root[start + i] = nh;
+        }
+        return TRUE;
+    }
+
+    group = fib6_group(fib, /*root=*/TRUE, start);
+    for (k = 2; group != GROUP6_FLAG && len > 8 * (k + 1); k++)
+    {
+        group = fib6_group(fib, /*root=*/FALSE, group * 256 + addr[k]);
+    }
+    if (group == GROUP6_FLAG)
+    {
+        return FALSE;
+    }
+    count = 1 << (8 * (k + 1) - len);
+    start = addr[k] & ~(count - 1);
+    for (i = 0; i < count; i++)
+    {
+        fib->groups[group * 256 + start + i] = nh;
+    }
+    return TRUE;
+}
+
+/*
+ * Look up an IPv6 address (network order).
+ */
+static UINT16 fib6_lookup(const FIB6 *fib, const UINT8 *addr)
+{
+    UINT32 entry;
+    UINT k;
+
+    entry = fib->root[((UINT32)addr[0] << 8) | addr[1]];
+    for (k = 2; (entry & GROUP6_FLAG) != 0; k++)
+    {
+        entry = fib->groups[((entry & ~GROUP6_FLAG) << 8) | addr[k]];
+    }
+    return (UINT16)entry;
+}
+
+/*
+ * Build the FIBs from a set of routes.  The routes are sorted by prefix
+ * length (and line order for duplicates) as required by the insert
+ * functions.
+ */
+static BOOL router_build(PROUTER router, PROUTE routes, UINT num_routes)
+{
+    UINT32 addr;
+    UINT i;
+
+    if (!fib4_init(&router->fib4) || !fib6_init(&router->fib6))
+    {
+        return FALSE;
+    }
+    qsort(routes, num_routes, sizeof(ROUTE), route_compare);
+    for (i = 0; i < num_routes; i++)
+    {
+        if (routes[i].ipv6)
+        {
+            if (!fib6_insert(&router->fib6, routes[i].addr, routes[i].len,
+                    routes[i].nh))
+            {
+                return FALSE;
+            }
+            continue;
+        }
+        memcpy(&addr, routes[i].addr, sizeof(addr));
+        if (!fib4_insert(&router->fib4, ntohl(addr), routes[i].len,
+                routes[i].nh))
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/*
+ * Get (or allocate) the next hop for an interface.  Returns NH_NONE if
+ * there are too many next hops.
+ */
+static UINT16 router_nexthop(PROUTER router, UINT32 if_idx,
+    UINT32 sub_if_idx)
+{
+    PNEXTHOP nexthop;
+    UINT i;
+
+    if (router->num_nexthops == 0)
+    {
+        router->num_nexthops = NH_DROP + 1;
+    }
+    for (i = NH_DROP + 1; i < router->num_nexthops; i++)
+    {
+        nexthop = &router->nexthops[i];
+        if (nexthop->if_idx == if_idx && nexthop->sub_if_idx == sub_if_idx)
+        {
+            return (UINT16)i;
+        }
+    }
+    if (i >= MAX_NEXTHOPS)
+    {
+        return NH_NONE;
+    }
+    router->nexthops[i].if_idx     = if_idx;
+    router->nexthops[i].sub_if_idx = sub_if_idx;
+    router->num_nexthops++;
+    return (UINT16)i;
+}
+
+/*
+ * Route a batch of forwarded packets.  Routed packets have their interface
+ * rewritten and their TTL/HopLimit decremented.  Dropped and expired packets
+ * are removed from the batch, and any ICMP errors are appended to the errors
+ * batch.
+ */
+static void router_forward(PROUTER router, PPKTBATCH batch,
+    PPKTBATCH errors, UINT32 now)
+{
+    PWINDIVERT_IPHDR ip_header;
+    PWINDIVERT_IPV6HDR ipv6_header;
+    PWINDIVERT_ADDRESS addr;
+    PNEXTHOP nexthop;
+    UINT8 *packet = batch->packet, *out = batch->packet;
+    UINT remaining = batch->packet_len, count = 0, i, len, error_len;
+    UINT16 nh, old_word;
+    BOOL ipv6;
+
+    errors->packet_len = 0;
+    errors->count      = 0;
+    for (i = 0; i < batch->count && remaining >= sizeof(WINDIVERT_IPHDR);
+            i++, packet += len, remaining -= len)
+    {
+        ip_header   = (PWINDIVERT_IPHDR)packet;
+        ipv6_header = (PWINDIVERT_IPV6HDR)packet;
+        switch (ip_header->Version)
+        {
+            case 4:
+                len = ntohs(ip_header->Length);
+                if (len > remaining || len < sizeof(WINDIVERT_IPHDR))
+                {
+                    goto truncated;
+                }
+                nh = fib4_lookup(&router->fib4, ntohl(ip_header->DstAddr));
+                ipv6 = FALSE;
+                break;
+            case 6:
+                if (remaining < sizeof(WINDIVERT_IPV6HDR))
+                {
+                    goto truncated;
+                }
+                len = sizeof(WINDIVERT_IPV6HDR) + ntohs(ipv6_header->Length);
+                if (len > remaining)
+                {
+                    goto truncated;
+                }
+                nh = fib6_lookup(&router->fib6,
+                    (const UINT8 *)ipv6_header->DstAddr);
+                ipv6 = TRUE;
+                break;
+            default:
+                goto truncated;
+        }
+
+        if (nh == NH_DROP)
+        {
+            router->dropped++;
+            continue;
+        }
+        if (ipv6? ipv6_header->HopLimit <= 1: ip_header->TTL <= 1)
+        {
+            router->expired++;
+            error_len = 0;
+            if (errors->count < BATCH)
+            {
+                error_len = icmp_time_exceeded(router, packet, len,
+                    errors->packet + errors->packet_len,
+                    errors->packet_max - errors->packet_len, now);
+            }
+            if (error_len != 0)
+            {
+                addr = &errors->addrs[errors->count];
+                memset(addr, 0, sizeof(WINDIVERT_ADDRESS));
+                addr->Layer    = WINDIVERT_LAYER_NETWORK;
+                addr->Outbound = 1;
+                addr->IPv6     = ipv6;
+                errors->packet_len += error_len;
+                errors->count++;
+            }
+            continue;
+        }
+
+        // Decrement the TTL/HopLimit.  The IPv4 checksum is updated
+        // incrementally (the TTL shares a 16-bit word with the protocol).
+        if (ipv6)
+        {
+            ipv6_header->HopLimit--;
+        }
+        else
+        {
+            old_word = *(UINT16 *)&ip_header->TTL;
+            ip_header->TTL--;
+            checksum_update16(&ip_header->Checksum, old_word,
+                *(UINT16 *)&ip_header->TTL);
+        }
+
+        if (nh == NH_NONE)
+        {
+            router->unrouted++;
+        }
+        else
+        {
+            nexthop = &router->nexthops[nh];
+            batch->addrs[i].Network.IfIdx    = nexthop->if_idx;
+            batch->addrs[i].Network.SubIfIdx = nexthop->sub_if_idx;
+            router->forwarded++;
+        }
+
+        // Compact the batch over any removed packets:
+        if (out != packet)
+        {
+            memmove(out, packet, len);
+        }
+        if (count != i)
+        {
+            batch->addrs[count] = batch->addrs[i];
+        }
+        out += len;
+        count++;
+    }
+
+truncated:
+    batch->packet_len = (UINT)(out - batch->packet);
+    batch->count      = count;
+}
+
+/*
+ * Construct an ICMP/ICMPv6 time exceeded error for an expired packet.
+ * Returns the error length, or 0 if no error should be sent.  As required
+ * by RFC 1812 and RFC 4443, no error is sent for ICMP errors, non-initial
+ * fragments, or multicast/unspecified sources, and errors are rate limited.
+ */
+static UINT icmp_time_exceeded(PROUTER router, const UINT8 *packet,
+    UINT packet_len, UINT8 *error, UINT error_max, UINT32 now)
+{
+    PWINDIVERT_IPHDR ip_header, error_ip_header;
+    PWINDIVERT_IPV6HDR ipv6_header, error_ipv6_header;
+    PWINDIVERT_ICMPHDR icmp_header, error_icmp_header;
+    PWINDIVERT_ICMPV6HDR icmpv6_header, error_icmpv6_header;
+    UINT8 type;
+    UINT hdr_len, data_len, error_len;
+
+    if (!WinDivertHelperParsePacket(packet, packet_len, &ip_header,
+            &ipv6_header, NULL, &icmp_header, &icmpv6_header, NULL, NULL,
+            NULL, NULL, NULL, NULL))
+    {
+        return 0;
+    }
+    if (ip_header != NULL)
+    {
+        if (!router->have_src4 || WINDIVERT_IPHDR_GET_FRAGOFF(ip_header) != 0
+            || ip_header->SrcAddr == 0 ||
+            (ntohl(ip_header->SrcAddr) >> 28) == 0xE)
+        {
+            return 0;
+        }
+        type = (icmp_header == NULL? 0: icmp_header->Type);
+        if (type == 3 || type == 4 || type == 5 || type == 11 || type == 12)
+        {
+            return 0;
+        }
+        hdr_len   = sizeof(WINDIVERT_IPHDR) + sizeof(WINDIVERT_ICMPHDR);
+        data_len  = (packet_len > ICMP_MAX - hdr_len? ICMP_MAX - hdr_len:
+            packet_len);
+    }
+    else if (ipv6_header != NULL)
+    {
+        if (!router->have_src6 ||
+            ((const UINT8 *)ipv6_header->SrcAddr)[0] == 0xFF ||
+            (ipv6_header->SrcAddr[0] | ipv6_header->SrcAddr[1] |
+             ipv6_header->SrcAddr[2] | ipv6_header->SrcAddr[3]) == 0)
+        {
+            return 0;
+        }
+        if (icmpv6_header != NULL && icmpv6_header->Type < 128)
+        {
+            return 0;
+        }
+        hdr_len   = sizeof(WINDIVERT_IPV6HDR) + sizeof(WINDIVERT_ICMPV6HDR);
+        data_len  = (packet_len > ICMPV6_MAX - hdr_len?
+            ICMPV6_MAX - hdr_len: packet_len);
+    }
+    else
+    {
+        return 0;
+    }
+    error_len = hdr_len + data_len;
+    if (error_len > error_max)
+    {
+        return 0;
+    }
+    if (router->icmp_time != now)
+    {
+        router->icmp_time  = now;
+        router->icmp_count = 0;
+    }
+    if (router->icmp_count >= ICMP_RATE)
+    {
+        return 0;
+    }
+    router->icmp_count++;
+
+    memset(error, 0, hdr_len);
+    memcpy(error + hdr_len, packet, data_len);
+    if (ip_header != NULL)
+    {
+        error_ip_header = (PWINDIVERT_IPHDR)error;
+        error_ip_header->Version   = 4;
+        error_ip_header->HdrLength = sizeof(WINDIVERT_IPHDR) / sizeof(UINT32);
+        error_ip_header->Length    = htons((UINT16)error_len);
+        error_ip_header->TTL       = 64;
+        error_ip_header->Protocol  = IPPROTO_ICMP;
+        error_ip_header->SrcAddr   = router->src4;
+        error_ip_header->DstAddr   = ip_header->SrcAddr;
+        error_icmp_header =
+            (PWINDIVERT_ICMPHDR)(error + sizeof(WINDIVERT_IPHDR));
+        error_icmp_header->Type    = 11;    // Time exceeded
+        error_icmp_header->Code    = 0;     // TTL exceeded in transit
+    }
+    else
+    {
+        error_ipv6_header = (PWINDIVERT_IPV6HDR)error;
+        error_ipv6_header->Version  = 6;
+        error_ipv6_header->Length   =
+            htons((UINT16)(error_len - sizeof(WINDIVERT_IPV6HDR)));
+        error_ipv6_header->NextHdr  = IPPROTO_ICMPV6;
+        error_ipv6_header->HopLimit = 64;
+        memcpy(error_ipv6_header->SrcAddr, router->src6,
+            sizeof(router->src6));
+        memcpy(error_ipv6_header->DstAddr, ipv6_header->SrcAddr,
+            sizeof(ipv6_header->SrcAddr));
+        error_icmpv6_header =
+            (PWINDIVERT_ICMPV6HDR)(error + sizeof(WINDIVERT_IPV6HDR));
+        error_icmpv6_header->Type   = 3;    // Time exceeded
+        error_icmpv6_header->Code   = 0;    // Hop limit exceeded in transit
+    }
+    WinDivertHelperCalcChecksums(error, error_len, NULL, 0);
+    return error_len;
+}
+
+/*
+ * Incremental checksum update (RFC 1624).
+ */
+static void checksum_update16(UINT16 *checksum, UINT16 old_word,
+    UINT16 new_word)
+{
+    UINT32 sum;
+
+    sum = (UINT16)~*checksum;
+    sum += (UINT16)~old_word;
+    sum += new_word;
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum += (sum >> 16);
+    *checksum = (UINT16)~sum;
+}
+
+/*
+ * Parse an "address/length" prefix into a route.
+ */
+static BOOL parse_prefix(const char *str, PROUTE route)
+{
+    char buf[64], *sep;
+    UINT32 addr[4];
+    int len;
+
+    if (strlen(str) >= sizeof(buf))
+    {
+        return FALSE;
+    }
+    strcpy(buf, str);
+    sep = strchr(buf, '/');
+    if (sep == NULL)
+    {
+        return FALSE;
+    }
+    *sep++ = '\0';
+    len = atoi(sep);
+    memset(route->addr, 0, sizeof(route->addr));
+    if (WinDivertHelperParseIPv4Address(buf, addr))
+    {
+        if (len < 0 || len > 32)
+        {
+            return FALSE;
+        }
+        addr[0] = htonl(addr[0]);
+        memcpy(route->addr, addr, sizeof(UINT32));
+        route->ipv6 = FALSE;
+    }
+    else if (WinDivertHelperParseIPv6Address(buf, addr))
+    {
+        if (len < 0 || len > 128)
+        {
+            return FALSE;
+        }
+        WinDivertHelperHtonIPv6Address(addr, (UINT32 *)route->addr);
+        route->ipv6 = TRUE;
+    }
+    else
+    {
+        return FALSE;
+    }
+    route->len = (UINT8)len;
+    return TRUE;
+}
+
+/*
+ * Load the routes file.  Returns an array of routes (to be freed by the
+ * caller), or NULL on error.
+ */
+static PROUTE load_routes(PROUTER router, const char *filename,
+    UINT *num_routes)
+{
+    FILE *file;
+    PROUTE routes = NULL, new_routes;
+    ROUTE *route;
+    UINT max_routes = 0, line_num = 0, if_idx, sub_if_idx;
+    UINT32 addr[4];
+    char line[256], prefix_str[128], nh_str[128];
+
+    file = fopen(filename, "r");
+    if (file == NULL)
+    {
+        fprintf(stderr, "error: failed to open \"%s\"\n", filename);
+        return NULL;
+    }
+    *num_routes = 0;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        line_num++;
+        if (strchr(line, '#') != NULL)
+        {
+            *strchr(line, '#') = '\0';
+        }
+        switch (sscanf(line, "%127s %127s", prefix_str, nh_str))
+        {
+            case EOF: case 0:
+                continue;
+            case 2:
+                break;
+            default:
+                goto error;
+        }
+
+        if (strcmp(prefix_str, "source") == 0)
+        {
+            if (WinDivertHelperParseIPv4Address(nh_str, addr))
+            {
+                router->src4      = htonl(addr[0]);
+                router->have_src4 = TRUE;
+            }
+            else if (WinDivertHelperParseIPv6Address(nh_str, addr))
+            {
+                WinDivertHelperHtonIPv6Address(addr,
+                    (UINT32 *)router->src6);
+                router->have_src6 = TRUE;
+            }
+            else
+            {
+                goto error;
+            }
+            continue;
+        }
+
+        if (*num_routes >= max_routes)
+        {
+            max_routes = (max_routes == 0? 64: 2 * max_routes);
+            new_routes = (PROUTE)realloc(routes, max_routes * sizeof(ROUTE));
+            if (new_routes == NULL)
+            {
+                fprintf(stderr, "error: failed to allocate routes (%d)\n",
+                    GetLastError());
+                goto failed;
+            }
+            routes = new_routes;
+        }
+        route = &routes[*num_routes];
+        if (!parse_prefix(prefix_str, route))
+        {
+            goto error;
+        }
+        route->seq = *num_routes;
+        sub_if_idx = 0;
+        if (strcmp(nh_str, "drop") == 0)
+        {
+            route->nh = NH_DROP;
+        }
+        else if (sscanf(nh_str, "%u.%u", &if_idx, &sub_if_idx) >= 1)
+        {
+            route->nh = router_nexthop(router, if_idx, sub_if_idx);
+            if (route->nh == NH_NONE)
+            {
+                fprintf(stderr, "error: too many interfaces (max %u)\n",
+                    MAX_NEXTHOPS - NH_DROP - 1);
+                goto failed;
+            }
+        }
+        else
+        {
+            goto error;
+        }
+        (*num_routes)++;
+    }
+    fclose(file);
+    return routes;
+
+error:
+    fprintf(stderr, "error: %s:%u: invalid route\n", filename, line_num);
+failed:
+    fclose(file);
+    free(routes);
+    return NULL;
+}
+
+/*
+ * Route order for FIB construction.
+ */
+static int __cdecl route_compare(const void *a, const void *b)
+{
+    const ROUTE *route_a = (const ROUTE *)a, *route_b = (const ROUTE *)b;
+
+    if (route_a->len != route_b->len)
+    {
+        return (route_a->len < route_b->len? -1: 1);
+    }
+    return (route_a->seq < route_b->seq? -1:
+        (route_a->seq > route_b->seq? 1: 0));
+}
+
+/*
+ * Pseudo-random number generator (xorshift64*).
+ */
+static UINT64 random64(UINT64 *state)
+{
+    UINT64 x = *state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1Dull;
+}
+
+/*
+ * Reference (linear scan) longest prefix match.
+ */
+static UINT16 slow_lookup(const ROUTE *routes, UINT num_routes, BOOL ipv6,
+    const UINT8 *addr)
+{
+    UINT i, j, bits;
+    UINT16 nh = NH_NONE;
+
+    // Routes are sorted, so the last match is the longest:
+    for (i = 0; i < num_routes; i++)
+    {
+        if (routes[i].ipv6 != ipv6)
+        {
+            continue;
+        }
+        for (j = 0; j < routes[i].len; j += 8)
+        {
+            bits = routes[i].len - j;
+            bits = (bits > 8? 8: bits);
+            if (((addr[j / 8] ^ routes[i].addr[j / 8]) &
+                    (0xFF00 >> bits)) != 0)
+            {
+                break;
+            }
+        }
+        if (j >= routes[i].len)
+        {
+            nh = routes[i].nh;
+        }
+    }
+    return nh;
+}
+
+/*
+ * Offline benchmark of the FIB build and lookup times, and the batch
+ * forwarding path, using a synthetic table with an Internet-like prefix
+ * length distribution.
+ */
+static void benchmark(UINT num_routes)
+{
+    static ROUTER router;
+    static PKTBATCH batch, errors;
+    static UINT8 template[BATCH * 60];
+    static WINDIVERT_ADDRESS template_addrs[BATCH];
+    const UINT num_addrs = 1 << 20, rounds = 10, batches = 200000,
+        checks = 500;
+    PROUTE routes;
+    UINT8 *addrs, *packet;
+    UINT num_routes6 = num_routes / 4, i, j, p, len, errors_total = 0;
+    UINT32 addr;
+    UINT64 state = 0x123456789ABCDEFull, sum = 0, r;
+    PWINDIVERT_IPHDR ip_header;
+    PWINDIVERT_IPV6HDR ipv6_header;
+    LARGE_INTEGER freq, start, end;
+    double secs;
+
+    if (num_routes == 0)
+    {
+        fprintf(stderr, "error: invalid number of routes\n");
+        exit(EXIT_FAILURE);
+    }
+    routes = (PROUTE)malloc((num_routes + num_routes6) * sizeof(ROUTE));
+    addrs  = (UINT8 *)malloc(num_addrs * 16);
+    if (routes == NULL || addrs == NULL)
+    {
+        fprintf(stderr, "error: failed to allocate routes (%d)\n",
+            GetLastError());
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < 16; i++)
+    {
+        router_nexthop(&router, i + 1, 0);
+    }
+
+    // IPv4: mostly /24s, with shorter aggregates and some /25-/32s.
+    for (i = 0; i < num_routes; i++)
+    {
+        r = random64(&state);
+        p = (UINT)(r % 100);
+        routes[i].len = (UINT8)(p < 55? 24: p < 70? 22 + (p & 1):
+            p < 90? 16 + p % 6: p < 97? 8 + p % 8: 25 + p % 8);
+        addr = htonl((UINT32)(r >> 32));
+        memset(routes[i].addr, 0, sizeof(routes[i].addr));
+        memcpy(routes[i].addr, &addr, sizeof(addr));
+        routes[i].ipv6 = FALSE;
+        routes[i].nh   = (UINT16)(r % 64 == 0? NH_DROP: NH_DROP + 1 +
+            (r >> 8) % 16);
+        routes[i].seq  = i;
+    }
+
+    // IPv6: /32 allocations within a few /12s, with /48 more-specifics.
+    for (j = 0; j < num_routes6; j++, i++)
+    {
+        r = random64(&state);
+        memset(routes[i].addr, 0, sizeof(routes[i].addr));
+        routes[i].addr[0] = (UINT8)(0x20 + (r & 0x3) * 2);
+        routes[i].addr[1] = (UINT8)((r >> 2) & 0x0F);
+        routes[i].addr[2] = (UINT8)((r >> 8) % 64);
+        routes[i].addr[3] = (UINT8)(r >> 16);
+        routes[i].addr[4] = (UINT8)(r >> 24);
+        routes[i].addr[5] = (UINT8)(r >> 32);
+        routes[i].len  = (UINT8)(r % 8 == 0? 32: r % 8 == 1? 40: 48);
+        routes[i].ipv6 = TRUE;
+        routes[i].nh   = (UINT16)(NH_DROP + 1 + (r >> 40) % 16);
+        routes[i].seq  = i;
+    }
+    router.have_src4 = TRUE;
+    router.src4      = htonl(0xC0000201);   // 192.0.2.1
+    router.have_src6 = TRUE;
+    router.src6[0]   = 0x20;                // 2001:db8::1
+    router.src6[1]   = 0x01;
+    router.src6[2]   = 0x0D;
+    router.src6[3]   = 0xB8;
+    router.src6[15]  = 0x01;
+    QueryPerformanceFrequency(&freq);
+
+    // (1) FIB build time:
+    QueryPerformanceCounter(&start);
+    if (!router_build(&router, routes, num_routes + num_routes6))
+    {
+        fprintf(stderr, "error: failed to build FIB\n");
+        exit(EXIT_FAILURE);
+    }
+    QueryPerformanceCounter(&end);
+    secs = (double)(end.QuadPart - start.QuadPart) / freq.QuadPart;
+    printf("build: %u IPv4 + %u IPv6 routes, %.1f ms\n", num_routes,
+        num_routes6, 1000.0 * secs);
+    printf("memory: IPv4 %.1f MB (%u tbl8 groups), IPv6 %.1f MB "
+        "(%u groups)\n",
+        ((1 << 24) + router.fib4.num_tbl8 * 256) * sizeof(UINT16) / 1.0e6,
+        router.fib4.num_tbl8,
+        ((1 << 16) + router.fib6.num_groups * 256) * sizeof(UINT32) / 1.0e6,
+        router.fib6.num_groups);
+
+    // Lookup keys: half random, half within a random route.
+    for (i = 0; i < num_addrs; i++)
+    {
+        r = random64(&state);
+        j = (UINT)((r >> 1) % (num_routes + num_routes6));
+        memcpy(addrs + 16 * i, &r, sizeof(r));
+        r = random64(&state);
+        memcpy(addrs + 16 * i + 8, &r, sizeof(r));
+        if ((r & 1) != 0)
+        {
+            p = (routes[j].ipv6? 16: 4) - 1;
+            memcpy(addrs + 16 * i, routes[j].addr, p);
+        }
+    }
+
+    // (2) Verify against a linear scan:
+    for (i = 0; i < checks; i++)
+    {
+        memcpy(&addr, addrs + 16 * i, sizeof(addr));
+        if (fib4_lookup(&router.fib4, ntohl(addr)) !=
+                slow_lookup(routes, num_routes + num_routes6, FALSE,
+                    addrs + 16 * i) ||
+            fib6_lookup(&router.fib6, addrs + 16 * i) !=
+                slow_lookup(routes, num_routes + num_routes6, TRUE,
+                    addrs + 16 * i))
+        {
+            fprintf(stderr, "error: lookup mismatch for key %u\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    printf("verify: %u IPv4 + %u IPv6 lookups match linear scan\n", checks,
+        checks);
+
+    // (3) Lookup times:
+    QueryPerformanceCounter(&start);
+    for (j = 0; j < rounds; j++)
+    {
+        for (i = 0; i < num_addrs; i++)
+        {
+            memcpy(&addr, addrs + 16 * i, sizeof(addr));
+            sum += fib4_lookup(&router.fib4, ntohl(addr));
+        }
+    }
+    QueryPerformanceCounter(&end);
+    secs = (double)(end.QuadPart - start.QuadPart) / freq.QuadPart;
+    printf("lookup4: %.1f ns/lookup\n", 1.0e9 * secs / (rounds * num_addrs));
+    QueryPerformanceCounter(&start);
+    for (j = 0; j < rounds; j++)
+    {
+        for (i = 0; i < num_addrs; i++)
+        {
+            sum += fib6_lookup(&router.fib6, addrs + 16 * i);
+        }
+    }
+    QueryPerformanceCounter(&end);
+    secs = (double)(end.QuadPart - start.QuadPart) / freq.QuadPart;
+    printf("lookup6: %.1f ns/lookup\n", 1.0e9 * secs / (rounds * num_addrs));
+
+    // (4) Batch path: a mix of IPv4 (40 bytes) and IPv6 (60 bytes) TCP
+    // packets, with 1 in 16 having an expired TTL.
+    memset(template, 0, sizeof(template));
+    memset(template_addrs, 0, sizeof(template_addrs));
+    packet = template;
+    for (i = 0; i < BATCH; i++)
+    {
+        template_addrs[i].Layer    = WINDIVERT_LAYER_NETWORK_FORWARD;
+        template_addrs[i].Outbound = 1;
+        if (i % 4 == 3)
+        {
+            ipv6_header = (PWINDIVERT_IPV6HDR)packet;
+            ipv6_header->Version  = 6;
+            ipv6_header->Length   = htons(20);
+            ipv6_header->NextHdr  = IPPROTO_TCP;
+            ipv6_header->HopLimit = (i % 16 == 15? 1: 64);
+            memcpy(ipv6_header->SrcAddr, router.src6, 16);
+            memcpy(ipv6_header->DstAddr, addrs + 16 * (2 * i + 1), 16);
+            len = sizeof(WINDIVERT_IPV6HDR) + 20;
+            template_addrs[i].IPv6 = 1;
+        }
+        else
+        {
+            ip_header = (PWINDIVERT_IPHDR)packet;
+            ip_header->Version   = 4;
+            ip_header->HdrLength = 5;
+            ip_header->Length    = htons(40);
+            ip_header->TTL       = (i % 16 == 0? 1: 64);
+            ip_header->Protocol  = IPPROTO_TCP;
+            ip_header->SrcAddr   = htonl(0x0A000001);
+            memcpy(&ip_header->DstAddr, addrs + 16 * (2 * i + 1), 4);
+            len = sizeof(WINDIVERT_IPHDR) + 20;
+        }
+        packet[len - 20 + 12] = 0x50;       // TCP data offset
+        WinDivertHelperCalcChecksums(packet, len, &template_addrs[i], 0);
+        template_addrs[i].IPChecksum  = 1;
+        template_addrs[i].TCPChecksum = 1;
+        packet += len;
+    }
+    batch.packet_max  = sizeof(template);
+    batch.packet      = (UINT8 *)malloc(batch.packet_max);
+    errors.packet_max = BATCH * ICMPV6_MAX;
+    errors.packet     = (UINT8 *)malloc(errors.packet_max);
+    if (batch.packet == NULL || errors.packet == NULL)
+    {
+        fprintf(stderr, "error: failed to allocate buffer (%d)\n",
+            GetLastError());
+        exit(EXIT_FAILURE);
+    }
+    router.forwarded = router.unrouted = router.dropped = router.expired = 0;
+    QueryPerformanceCounter(&start);
+    for (i = 0; i < batches; i++)
+    {
+        batch.packet_len = (UINT)(packet - template);
+        batch.count      = BATCH;
+        memcpy(batch.packet, template, batch.packet_len);
+        memcpy(batch.addrs, template_addrs, sizeof(template_addrs));
+        router_forward(&router, &batch, &errors, /*now=*/i);
+        errors_total += errors.count;
+    }
+    QueryPerformanceCounter(&end);
+    secs = (double)(end.QuadPart - start.QuadPart) / freq.QuadPart;
+    printf("batch: %.1f ns/packet (%u packets/batch, including batch "
+        "copy)\n", 1.0e9 * secs / ((double)batches * BATCH), BATCH);
+    printf("packets: %llu forwarded, %llu unrouted, %llu dropped, "
+        "%llu expired, %u ICMP errors (%llu)\n", router.forwarded,
+        router.unrouted, router.dropped, router.expired, errors_total,
+        sum & 1);
+
+    // Check the first batch result is valid:
+    batch.packet_len = (UINT)(packet - template);
+    batch.count      = BATCH;
+    memcpy(batch.packet, template, batch.packet_len);
+    memcpy(batch.addrs, template_addrs, sizeof(template_addrs));
+    router_forward(&router, &batch, &errors, batches);
+    packet = batch.packet;
+    for (i = 0; i < batch.count; i++)
+    {
+        ip_header = (PWINDIVERT_IPHDR)packet;
+        len = (ip_header->Version == 4? ntohs(ip_header->Length):
+            40 + ntohs(((PWINDIVERT_IPV6HDR)packet)->Length));
+        if (!batch.addrs[i].IPv6)
+        {
+            p = ip_header->Checksum;
+            WinDivertHelperCalcChecksums(packet, len, NULL,
+                WINDIVERT_HELPER_NO_TCP_CHECKSUM);
+            if (p != ip_header->Checksum || ip_header->TTL != 63)
+            {
+                fprintf(stderr, "error: bad TTL update for packet %u\n", i);
+                exit(EXIT_FAILURE);
+            }
+        }
+        packet += len;
+    }
+    printf("verify: %u packets forwarded, %u ICMP errors, checksums OK\n",
+        batch.count, errors.count);
+}
@@ -0,0 +1,898 @@
+/*
+ * synguard.c
+ * (C) 2019, all rights reserved,
+ *
+ * This file is part of WinDivert.
+ *
+ * WinDivert is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * WinDivert is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * DESCRIPTION:
+ * This is a simple SYN-flood guard for a local TCP server.  Inbound SYNs are
+ * never seen by the server.  Instead, synguard answers each SYN itself with a
+ * SYN-ACK whose sequence number is a SYN cookie, and keeps no state.  When
+ * the client's ACK returns with a valid cookie, synguard replays the
+ * handshake to the real server (SYN, then the client's ACK once the server
+ * has replied), and from then on translates the sequence numbers between the
+ * cookie and the server's ISN.  Spoofed SYNs therefore cost the server
+ * nothing.
+ *
+ * Cookies are generated and validated a whole WinDivertRecvEx() batch at a
+ * time.  The cookie hash is written over arrays (one lane per packet) using
+ * only 32-bit operations, so that the compiler can vectorize it.
+ *
+ * The cookie encodes the client's MSS (approximately), but not window
+ * scaling or SACK, so neither is negotiated for guarded connections.  Only
+ * IPv4 is supported.
+ *
+ * usage: synguard.exe address:port
+ *        synguard.exe --bench
+ */
+
+#include <winsock2.h>
+#include <windows.h>
+#include <wincrypt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "windivert.h"
+
+#define ntohs(x)            WinDivertHelperNtohs(x)
+#define ntohl(x)            WinDivertHelperNtohl(x)
+#define htons(x)            WinDivertHelperHtons(x)
+#define htonl(x)            WinDivertHelperHtonl(x)
+
+#define MTU                 1500
+#define BATCH               64
+#define SYN_LEN             44              // IPv4 + TCP + MSS option
+#define CONN_BUCKETS        16384           // Connection table buckets
+#define CONN_WAYS           4               // Connection table ways
+#define CONN_TIMEOUT        300             // Idle connection timeout (s)
+#define HANDSHAKE_TIMEOUT   5               // Server handshake timeout (s)
+#define COOKIE_PERIOD_SHIFT 6               // Cookie counter period (64s)
+#define COOKIE_MAX_AGE      1               // Cookie lifetime (periods)
+
+#define CONN_FREE           0
+#define CONN_HANDSHAKE      1               // Waiting for server SYN-ACK
+#define CONN_ESTABLISHED    2
+
+#define KIND_PASS           0               // Reinject unmodified
+#define KIND_DROP           1               // Drop
+#define KIND_SYN            2               // Client SYN
+#define KIND_ACK            3               // Client ACK (cookie check)
+#define KIND_CONN           4               // Part of a tracked connection
+
+/*
+ * MSS values that can be encoded in a cookie.
+ */
+static const UINT16 mss_table[8] =
+{
+    536, 1200, 1300, 1360, 1400, 1440, 1452, 1460
+};
+
+/*
+ * Connection table entry.
+ */
+typedef struct
+{
+    UINT32 client_addr;
+    UINT16 client_port;
+    UINT8 state;                            // CONN_*
+    UINT32 cookie;                          // Our ISN
+    UINT32 delta;                           // Cookie - server ISN
+    UINT32 timestamp;                       // Last activity (s)
+    UINT8 *ack;                             // Held client ACK
+    UINT ack_len;
+    WINDIVERT_ADDRESS ack_addr;
+} CONN, *PCONN;
+
+/*
+ * Cookie batch (one lane per packet).
+ */
+typedef struct
+{
+    UINT32 saddr[BATCH];
+    UINT32 daddr[BATCH];
+    UINT32 ports[BATCH];
+    UINT32 isn[BATCH];
+    UINT32 t[BATCH];
+    UINT32 hash[BATCH];
+} COOKIE_BATCH, *PCOOKIE_BATCH;
+
+/*
+ * A packet to be sent.  If `owned' is non-NULL it must be freed after the
+ * packet is sent.
+ */
+typedef struct
+{
+    UINT8 *packet;
+    UINT packet_len;
+    WINDIVERT_ADDRESS addr;
+    UINT8 *owned;
+} OUTPUT, *POUTPUT;
+
+/*
+ * Guard state.
+ */
+typedef struct
+{
+    UINT32 addr;                            // Server address (network order)
+    UINT16 port;                            // Server port (network order)
+    UINT32 secret[2];                       // Cookie secret
+    CONN *conns;                            // Connection table
+    COOKIE_BATCH lanes;                     // Cookie batch scratch
+    UINT8 scratch[BATCH][SYN_LEN];          // Generated packets
+    UINT64 syns;                            // SYN-ACKs sent
+    UINT64 accepted;                        // Valid cookies
+    UINT64 rejected;                        // Invalid cookies
+} GUARD, *PGUARD;
+
+/*
+ * Prototypes.
+ */
+static void guard_init(PGUARD guard);
+static UINT guard_process(PGUARD guard, UINT8 *packet, UINT packet_len,
+    WINDIVERT_ADDRESS *addrs, UINT num_addrs, UINT32 now, POUTPUT outputs);
+static void cookie_hash_batch(const UINT32 *secret, PCOOKIE_BATCH lanes,
+    UINT n);
+static UINT16 syn_mss(PWINDIVERT_TCPHDR tcp_header, UINT tcp_len);
+static UINT build_syn(UINT8 *buf, UINT32 src_addr, UINT32 dst_addr,
+    UINT16 src_port, UINT16 dst_port, UINT32 seq, UINT32 ack, UINT16 window,
+    UINT16 mss);
+static PCONN conn_bucket(PGUARD guard, UINT32 addr, UINT16 port);
+static PCONN conn_lookup(PGUARD guard, UINT32 addr, UINT16 port, UINT32 now);
+static PCONN conn_insert(PGUARD guard, UINT32 addr, UINT16 port, UINT32 now);
+static void conn_free(PCONN conn);
+static BOOL conn_live(PCONN conn, UINT32 now);
+static void checksum_update16(UINT16 *checksum, UINT16 old_word,
+    UINT16 new_word);
+static void checksum_update32(UINT16 *checksum, UINT32 old_word,
+    UINT32 new_word);
+static BOOL parse_endpoint(const char *str, UINT32 *addr, UINT16 *port);
+static void benchmark(void);
+
+/*
+ * Entry.
+ */
+int __cdecl main(int argc, char **argv)
+{
+    static GUARD guard;
+    static OUTPUT outputs[BATCH];
+    HANDLE handle;
+    UINT8 *packet;
+    UINT packet_len, recv_len, addr_len, num_outputs, i;
+    UINT32 now;
+    WINDIVERT_ADDRESS addrs[BATCH];
+    LARGE_INTEGER freq;
+    char filter[256], addr_str[32];
+
+    if (argc == 2 && strcmp(argv[1], "--bench") == 0)
+    {
+        benchmark();
+        return 0;
+    }
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: %s address:port\n", argv[0]);
+        fprintf(stderr, "       %s --bench\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (!parse_endpoint(argv[1], &guard.addr, &guard.port))
+    {
+        fprintf(stderr, "error: invalid address \"%s\"\n", argv[1]);
+        exit(EXIT_FAILURE);
+    }
+    guard_init(&guard);
+
+    WinDivertHelperFormatIPv4Address(ntohl(guard.addr), addr_str,
+        sizeof(addr_str));
+    snprintf(filter, sizeof(filter), "tcp and ((inbound and "
+        "ip.DstAddr == %s and tcp.DstPort == %u) or (outbound and "
+        "ip.SrcAddr == %s and tcp.SrcPort == %u))", addr_str,
+        ntohs(guard.port), addr_str, ntohs(guard.port));
+    handle = WinDivertOpen(filter, WINDIVERT_LAYER_NETWORK, 0, 0);
+    if (handle == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "error: failed to open the WinDivert device (%d)\n",
+            GetLastError());
+        exit(EXIT_FAILURE);
+    }
+
+    QueryPerformanceFrequency(&freq);
+    packet_len = BATCH * MTU;
+    packet_len =
+        (packet_len < WINDIVERT_MTU_MAX? WINDIVERT_MTU_MAX: packet_len);
+    packet = (UINT8 *)malloc(packet_len);
+    if (packet == NULL)
+    {
+        fprintf(stderr, "error: failed to allocate buffer (%d)\n",
+            GetLastError());
+        exit(EXIT_FAILURE);
+    }
+
+    // Main loop:
+    while (TRUE)
+    {
+        addr_len = sizeof(addrs);
+        if (!WinDivertRecvEx(handle, packet, packet_len, &recv_len, 0,
+                addrs, &addr_len, NULL))
+        {
+            fprintf(stderr, "warning: failed to read packet (%d)\n",
+                GetLastError());
+            continue;
+        }
+        now = (UINT32)(addrs[0].Timestamp / freq.QuadPart) + 1;
+        num_outputs = guard_process(&guard, packet, recv_len, addrs,
+            addr_len / sizeof(WINDIVERT_ADDRESS), now, outputs);
+        for (i = 0; i < num_outputs; i++)
+        {
+            if (!WinDivertSend(handle, outputs[i].packet,
+                    outputs[i].packet_len, NULL, &outputs[i].addr))
+            {
+                fprintf(stderr, "warning: failed to send packet (%d)\n",
+                    GetLastError());
+            }
+            free(outputs[i].owned);
+        }
+    }
+}
+
+/*
+ * Initialize the guard.
+ */
+static void guard_init(PGUARD guard)
+{
+    HCRYPTPROV prov;
+
+    guard->conns = (CONN *)calloc(CONN_BUCKETS * CONN_WAYS, sizeof(CONN));
+    if (guard->conns == NULL)
+    {
+        fprintf(stderr, "error: failed to allocate connection table (%d)\n",
+            GetLastError());
+        exit(EXIT_FAILURE);
+    }
+    if (!CryptAcquireContext(&prov, NULL, NULL, PROV_RSA_FULL,
+            CRYPT_VERIFYCONTEXT) ||
+        !CryptGenRandom(prov, sizeof(guard->secret), (BYTE *)guard->secret))
+    {
+        fprintf(stderr, "error: failed to generate cookie secret (%d)\n",
+            GetLastError());
+        exit(EXIT_FAILURE);
+    }
+    CryptReleaseContext(prov, 0);
+}
+
+/*
+ * Process a batch of packets.  Returns the number of packets to be sent,
+ * which are written to `outputs' (at most one per input packet).
+ *
+ * This is done in three passes: (1) classify each packet, and copy the
+ * cookie inputs of SYNs and candidate ACKs into the batch lanes, (2) hash
+ * all lanes at once, and (3) act on each packet.
+ */
+static UINT guard_process(PGUARD guard, UINT8 *packet, UINT packet_len,
+    WINDIVERT_ADDRESS *addrs, UINT num_addrs, UINT32 now, POUTPUT outputs)
+{
+    PCOOKIE_BATCH lanes = &guard->lanes;
+    PWINDIVERT_IPHDR ip_headers[BATCH], ip_header;
+    PWINDIVERT_TCPHDR tcp_headers[BATCH], tcp_header;
+    UINT8 kinds[BATCH], lane_idx[BATCH];
+    UINT lens[BATCH], tcp_lens[BATCH];
+    UINT8 *packets[BATCH], *ack;
+    PCONN conns[BATCH], conn;
+    POUTPUT output;
+    PVOID next;
+    UINT32 cookie, t_now, seq, new_seq;
+    UINT16 mss;
+    UINT i, n = 0, num_outputs = 0, next_len, mss_idx;
+
+    t_now = (now >> COOKIE_PERIOD_SHIFT) & 0x1F;
+    num_addrs = (num_addrs > BATCH? BATCH: num_addrs);
+
+    // (1) Classify:
+    for (i = 0; i < num_addrs && packet_len > 0; i++)
+    {
+        kinds[i] = KIND_PASS;
+        packets[i] = packet;
+        if (!WinDivertHelperParsePacket(packet, packet_len, &ip_header, NULL,
+                NULL, NULL, NULL, &tcp_header, NULL, NULL, NULL, &next,
+                &next_len))
+        {
+            break;
+        }
+        lens[i] = packet_len - next_len;
+        packet = (UINT8 *)next;
+        packet_len = next_len;
+        ip_headers[i] = ip_header;
+        tcp_headers[i] = tcp_header;
+        if (ip_header == NULL || tcp_header == NULL ||
+            (ntohs(ip_header->FragOff0) & 0x3FFF) != 0)
+        {
+            continue;
+        }
+        tcp_lens[i] = lens[i] - (UINT)((UINT8 *)tcp_header - packets[i]);
+        if (!addrs[i].Outbound)
+        {
+            conns[i] = conn_lookup(guard, ip_header->SrcAddr,
+                tcp_header->SrcPort, now);
+            if (tcp_header->Syn && !tcp_header->Ack)
+            {
+                kinds[i] = KIND_SYN;
+                lanes->isn[n] = ntohl(tcp_header->SeqNum);
+                lanes->t[n] = t_now;
+            }
+            else if (conns[i] != NULL)
+            {
+                kinds[i] = KIND_CONN;
+                continue;
+            }
+            else if (tcp_header->Ack && !tcp_header->Syn &&
+                     !tcp_header->Rst)
+            {
+                kinds[i] = KIND_ACK;
+                lanes->isn[n] = ntohl(tcp_header->SeqNum) - 1;
+                lanes->t[n] = (ntohl(tcp_header->AckNum) - 1) >> 27;
+            }
+            else
+            {
+                kinds[i] = KIND_DROP;
+                continue;
+            }
+            lanes->saddr[n] = ip_header->SrcAddr;
+            lanes->daddr[n] = ip_header->DstAddr;
+            lanes->ports[n] = ((UINT32)tcp_header->SrcPort << 16) |
+                tcp_header->DstPort;
+            lane_idx[i] = (UINT8)n++;
+        }
+        else
+        {
+            conns[i] = conn_lookup(guard, ip_header->DstAddr,
+                tcp_header->DstPort, now);
+            kinds[i] = (conns[i] != NULL? KIND_CONN: KIND_PASS);
+        }
+    }
+    num_addrs = i;
+
+    // (2) Hash:
+    cookie_hash_batch(guard->secret, lanes, n);
+
+    // (3) Act:
+    for (i = 0; i < num_addrs; i++)
+    {
+        ip_header = ip_headers[i];
+        tcp_header = tcp_headers[i];
+        output = &outputs[num_outputs];
+        output->packet = packets[i];
+        output->packet_len = lens[i];
+        output->addr = addrs[i];
+        output->owned = NULL;
+        switch (kinds[i])
+        {
+            case KIND_PASS:
+                num_outputs++;
+                continue;
+
+            case KIND_DROP:
+                continue;
+
+            case KIND_SYN:
+                // Reply with a SYN-ACK carrying the cookie:
+                mss = syn_mss(tcp_header, tcp_lens[i]);
+                for (mss_idx = 7; mss_idx > 0 && mss_table[mss_idx] > mss;
+                        mss_idx--)
+                    ;
+                cookie = (t_now << 27) | (mss_idx << 24) |
+                    (lanes->hash[lane_idx[i]] & 0x00FFFFFF);
+                output->packet = guard->scratch[i];
+                output->packet_len = build_syn(output->packet,
+                    ip_header->DstAddr, ip_header->SrcAddr,
+                    tcp_header->DstPort, tcp_header->SrcPort, cookie,
+                    ntohl(tcp_header->SeqNum) + 1, 0xFFFF,
+                    mss_table[mss_idx]);
+                output->addr.Outbound = 1;
+                guard->syns++;
+                num_outputs++;
+                continue;
+
+            case KIND_ACK:
+                // Validate the cookie, then replay the SYN to the server:
+                cookie = ntohl(tcp_header->AckNum) - 1;
+                if (((cookie ^ lanes->hash[lane_idx[i]]) & 0x00FFFFFF) != 0 ||
+                    ((t_now - (cookie >> 27)) & 0x1F) > COOKIE_MAX_AGE)
+                {
+                    guard->rejected++;
+                    continue;
+                }
+                conn = conn_lookup(guard, ip_header->SrcAddr,
+                    tcp_header->SrcPort, now);
+                if (conn != NULL)
+                {
+                    continue;           // Duplicate within this batch.
+                }
+                ack = (UINT8 *)malloc(lens[i]);
+                if (ack == NULL)
+                {
+                    continue;
+                }
+                conn = conn_insert(guard, ip_header->SrcAddr,
+                    tcp_header->SrcPort, now);
+                memcpy(ack, packets[i], lens[i]);
+                conn->state    = CONN_HANDSHAKE;
+                conn->cookie   = cookie;
+                conn->ack      = ack;
+                conn->ack_len  = lens[i];
+                conn->ack_addr = addrs[i];
+                output->packet = guard->scratch[i];
+                output->packet_len = build_syn(output->packet,
+                    ip_header->SrcAddr, ip_header->DstAddr,
+                    tcp_header->SrcPort, tcp_header->DstPort,
+                    ntohl(tcp_header->SeqNum) - 1, 0,
+                    ntohs(tcp_header->Window),
+                    mss_table[(cookie >> 24) & 0x07]);
+                guard->accepted++;
+                num_outputs++;
+                continue;
+
+            case KIND_CONN:
+                break;
+        }
+
+        // Tracked connection:
+        conn = conns[i];
+        conn->timestamp = now;
+        if (conn->state == CONN_HANDSHAKE)
+        {
+            if (!addrs[i].Outbound)
+            {
+                continue;               // Client must wait.
+            }
+            if (tcp_header->Rst)
+            {
+                // Server refused; pass the RST to the client.
+                new_seq = htonl(conn->cookie + 1);
+                if (addrs[i].TCPChecksum)
+                {
+                    checksum_update32(&tcp_header->Checksum,
+                        tcp_header->SeqNum, new_seq);
+                }
+                tcp_header->SeqNum = new_seq;
+                conn_free(conn);
+                num_outputs++;
+                continue;
+            }
+            if (!tcp_header->Syn || !tcp_header->Ack)
+            {
+                continue;
+            }
+
+            // Server SYN-ACK: drop it, and release the held client ACK.
+            conn->delta = conn->cookie - ntohl(tcp_header->SeqNum);
+            conn->state = CONN_ESTABLISHED;
+            ack = conn->ack;
+            conn->ack = NULL;
+            if (!WinDivertHelperParsePacket(ack, conn->ack_len, NULL, NULL,
+                    NULL, NULL, NULL, &tcp_header, NULL, NULL, NULL, NULL,
+                    NULL) || tcp_header == NULL)
+            {
+                free(ack);
+                continue;
+            }
+            seq = htonl(ntohl(tcp_header->AckNum) - conn->delta);
+            tcp_header->AckNum = seq;
+            WinDivertHelperCalcChecksums(ack, conn->ack_len, NULL, 0);
+            output->packet = output->owned = ack;
+            output->packet_len = conn->ack_len;
+            output->addr = conn->ack_addr;
+            num_outputs++;
+            continue;
+        }
+
+        // Established: translate between the cookie and the server's ISN.
+        if (!addrs[i].Outbound)
+        {
+            if (tcp_header->Ack)
+            {
+                seq = htonl(ntohl(tcp_header->AckNum) - conn->delta);
+                if (addrs[i].TCPChecksum)
+                {
+                    checksum_update32(&tcp_header->Checksum,
+                        tcp_header->AckNum, seq);
+                }
+                tcp_header->AckNum = seq;
+            }
+        }
+        else
+        {
+            if (tcp_header->Syn)
+            {
+                continue;               // Retransmitted server SYN-ACK.
+            }
+            seq = htonl(ntohl(tcp_header->SeqNum) + conn->delta);
+            if (addrs[i].TCPChecksum)
+            {
+                checksum_update32(&tcp_header->Checksum,
+                    tcp_header->SeqNum, seq);
+            }
+            tcp_header->SeqNum = seq;
+        }
+        if (tcp_header->Rst)
+        {
+            conn_free(conn);
+        }
+        num_outputs++;
+    }
+    return num_outputs;
+}
+
+/*
+ * Compute the cookie hash for `n' lanes.  Every step is a 32-bit lane-wise
+ * operation with no branches, so this loop is vectorizable.  This is a keyed
+ * mix, not a cryptographic MAC; an attacker that can observe many cookies
+ * for chosen inputs may eventually learn enough to forge them, which is why
+ * the time counter is included and cookies expire.
+ */
+#define COOKIE_MIX(h)                                                       \
+    do                                                                      \
+    {                                                                       \
+        (h) ^= (h) >> 16;                                                   \
+        (h) *= 0x7FEB352Du;                                                 \
+        (h) ^= (h) >> 15;                                                   \
+        (h) *= 0x846CA68Bu;                                                 \
+        (h) ^= (h) >> 16;                                                   \
+    }                                                                       \
+    while (FALSE)
+static void cookie_hash_batch(const UINT32 *secret, PCOOKIE_BATCH lanes,
+    UINT n)
+{
+    UINT32 s0 = secret[0], s1 = secret[1], h;
+    UINT i;
+
+    for (i = 0; i < n; i++)
+    {
+        h = s0 ^ lanes->saddr[i];
+        COOKIE_MIX(h);
+        h ^= lanes->daddr[i];
+        COOKIE_MIX(h);
+        h ^= lanes->ports[i];
+        COOKIE_MIX(h);
+        h ^= lanes->isn[i];
+        COOKIE_MIX(h);
+        h ^= lanes->t[i] ^ s1;
+        COOKIE_MIX(h);
+        lanes->hash[i] = h;
+    }
+}
+
+/*
+ * Get the MSS option from a SYN (or the default of 536).
+ */
+static UINT16 syn_mss(PWINDIVERT_TCPHDR tcp_header, UINT tcp_len)
+{
+    UINT8 *opt = (UINT8 *)(tcp_header + 1);
+    UINT8 *end = (UINT8 *)tcp_header + tcp_header->HdrLength * 4;
+    UINT16 mss = 536;
+
+    end = ((UINT8 *)tcp_header + tcp_len < end?
+        (UINT8 *)tcp_header + tcp_len: end);
+    while (opt < end)
+    {
+        switch (opt[0])
+        {
+            case 0:
+                return mss;
+            case 1:
+                opt++;
+                continue;
+            default:
+                if (opt + 1 >= end || opt[1] < 2 || opt + opt[1] > end)
+                {
+                    return mss;
+                }
+                if (opt[0] == 2 && opt[1] == 4)
+                {
+                    mss = (UINT16)((opt[2] << 8) | opt[3]);
+                }
+                opt += opt[1];
+                continue;
+        }
+    }
+    return mss;
+}
+
+/*
+ * Build a SYN (ack == 0) or SYN-ACK with a single MSS option.  Addresses and
+ * ports are in network order, everything else is in host order.
+ */
+static UINT build_syn(UINT8 *buf, UINT32 src_addr, UINT32 dst_addr,
+    UINT16 src_port, UINT16 dst_port, UINT32 seq, UINT32 ack, UINT16 window,
+    UINT16 mss)
+{
+    PWINDIVERT_IPHDR ip_header = (PWINDIVERT_IPHDR)buf;
+    PWINDIVERT_TCPHDR tcp_header = (PWINDIVERT_TCPHDR)(ip_header + 1);
+    UINT8 *opt = (UINT8 *)(tcp_header + 1);
+
+    memset(buf, 0, SYN_LEN);
+    ip_header->Version   = 4;
+    ip_header->HdrLength = sizeof(WINDIVERT_IPHDR) / sizeof(UINT32);
+    ip_header->Length    = htons(SYN_LEN);
+    ip_header->TTL       = 64;
+    ip_header->Protocol  = IPPROTO_TCP;
+    ip_header->SrcAddr   = src_addr;
+    ip_header->DstAddr   = dst_addr;
+    WINDIVERT_IPHDR_SET_DF(ip_header, 1);
+    tcp_header->SrcPort   = src_port;
+    tcp_header->DstPort   = dst_port;
+    tcp_header->SeqNum    = htonl(seq);
+    tcp_header->AckNum    = htonl(ack);
+    tcp_header->HdrLength = (sizeof(WINDIVERT_TCPHDR) + 4) / sizeof(UINT32);
+    tcp_header->Syn       = 1;
+    tcp_header->Ack       = (ack != 0);
+    tcp_header->Window    = htons(window);
+    opt[0] = 2;
+    opt[1] = 4;
+    opt[2] = (UINT8)(mss >> 8);
+    opt[3] = (UINT8)mss;
+    WinDivertHelperCalcChecksums(buf, SYN_LEN, NULL, 0);
+    return SYN_LEN;
+}
+
+/*
+ * Connection table.
+ */
+static BOOL conn_live(PCONN conn, UINT32 now)
+{
+    switch (conn->state)
+    {
+        case CONN_HANDSHAKE:
+            return (now - conn->timestamp <= HANDSHAKE_TIMEOUT);
+        case CONN_ESTABLISHED:
+            return (now - conn->timestamp <= CONN_TIMEOUT);
+        default:
+            return FALSE;
+    }
+}
+static PCONN conn_bucket(PGUARD guard, UINT32 addr, UINT16 port)
+{
+    UINT32 h = addr ^ ((UINT32)port << 16) ^ guard->secret[1];
+
+    COOKIE_MIX(h);
+    return guard->conns + CONN_WAYS * (h % CONN_BUCKETS);
+}
+static PCONN conn_lookup(PGUARD guard, UINT32 addr, UINT16 port, UINT32 now)
+{
+    PCONN bucket = conn_bucket(guard, addr, port);
+    UINT i;
+
+    for (i = 0; i < CONN_WAYS; i++)
+    {
+        if (bucket[i].client_addr == addr && bucket[i].client_port == port &&
+            conn_live(&bucket[i], now))
+        {
+            return &bucket[i];
+        }
+    }
+    return NULL;
+}
+static PCONN conn_insert(PGUARD guard, UINT32 addr, UINT16 port, UINT32 now)
+{
+    PCONN bucket = conn_bucket(guard, addr, port), victim;
+    UINT i;
+
+    victim = &bucket[0];
+    for (i = 0; i < CONN_WAYS; i++)
+    {
+        if (!conn_live(&bucket[i], now))
+        {
+            victim = &bucket[i];
+            break;
+        }
+        if (bucket[i].timestamp < victim->timestamp)
+        {
+            victim = &bucket[i];
+        }
+    }
+    conn_free(victim);
+    victim->client_addr = addr;
+    victim->client_port = port;
+    victim->timestamp   = now;
+    return victim;
+}
+static void conn_free(PCONN conn)
+{
+    free(conn->ack);
+    conn->ack   = NULL;
+    conn->state = CONN_FREE;
+}
+
+/*
+ * Incremental checksum update (RFC 1624).
+ */
+static void checksum_update16(UINT16 *checksum, UINT16 old_word,
+    UINT16 new_word)
+{
+    UINT32 sum;
+
+    sum = (UINT16)~*checksum;
+    sum += (UINT16)~old_word;
+    sum += new_word;
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum += (sum >> 16);
+    *checksum = (UINT16)~sum;
+}
+static void checksum_update32(UINT16 *checksum, UINT32 old_word,
+    UINT32 new_word)
+{
+    checksum_update16(checksum, (UINT16)old_word, (UINT16)new_word);
+    checksum_update16(checksum, (UINT16)(old_word >> 16),
+        (UINT16)(new_word >> 16));
+}
+
+/*
+ * Parse an "address:port" string.  Results are in network byte order.
+ */
+static BOOL parse_endpoint(const char *str, UINT32 *addr, UINT16 *port)
+{
+    char buf[64], *sep;
+    int val;
+
+    if (strlen(str) >= sizeof(buf))
+    {
+        return FALSE;
+    }
+    strcpy(buf, str);
+    sep = strchr(buf, ':');
+    if (sep == NULL)
+    {
+        return FALSE;
+    }
+    *sep++ = '\0';
+    val = atoi(sep);
+    if (val <= 0 || val > 0xFFFF ||
+        !WinDivertHelperParseIPv4Address(buf, addr))
+    {
+        return FALSE;
+    }
+    *addr = htonl(*addr);
+    *port = htons((UINT16)val);
+    return TRUE;
+}
+
+/*
+ * Offline benchmark: a spoofed SYN flood, a spoofed ACK flood, and a batch
+ * of legitimate handshakes (which must all be accepted).
+ */
+static void benchmark(void)
+{
+    static GUARD guard;
+    static OUTPUT outputs[BATCH];
+    static UINT8 packets[BATCH * SYN_LEN];
+    const UINT rounds = 100000;
+    WINDIVERT_ADDRESS addrs[BATCH];
+    PWINDIVERT_IPHDR ip_header;
+    PWINDIVERT_TCPHDR tcp_header;
+    LARGE_INTEGER freq, start, end;
+    UINT32 rng = 0x12345678, client, cookie;
+    UINT i, j, num_outputs;
+    UINT64 bad = 0, forged = 0;
+    double secs;
+
+    guard.addr = htonl(0xC0A80001);
+    guard.port = htons(80);
+    guard_init(&guard);
+    memset(addrs, 0, sizeof(addrs));
+    for (i = 0; i < BATCH; i++)
+    {
+        addrs[i].IPChecksum = addrs[i].TCPChecksum = 1;
+    }
+    QueryPerformanceFrequency(&freq);
+
+    // (1) SYN flood (random sources):
+    QueryPerformanceCounter(&start);
+    for (i = 0; i < rounds; i++)
+    {
+        for (j = 0; j < BATCH; j++)
+        {
+            rng = rng * 1664525 + 1013904223;
+            build_syn(packets + j * SYN_LEN, htonl(rng), guard.addr,
+                (UINT16)rng, guard.port, rng ^ 0x5A5A5A5A, 0, 0xFFFF, 1460);
+        }
+        num_outputs = guard_process(&guard, packets, sizeof(packets), addrs,
+            BATCH, 1000, outputs);
+        bad += (num_outputs != BATCH);
+    }
+    QueryPerformanceCounter(&end);
+    secs = (double)(end.QuadPart - start.QuadPart) / freq.QuadPart;
+    printf("syn flood: %.2f Mpps (including packet construction)\n",
+        (double)rounds * BATCH / secs / 1.0e6);
+
+    // (2) ACK flood (random cookies), all of which must be rejected:
+    for (j = 0; j < BATCH; j++)
+    {
+        build_syn(packets + j * SYN_LEN, 0, guard.addr, 0, guard.port, 0, 0,
+            0xFFFF, 1460);
+        tcp_header = (PWINDIVERT_TCPHDR)(packets + j * SYN_LEN +
+            sizeof(WINDIVERT_IPHDR));
+        tcp_header->Syn = 0;
+        tcp_header->Ack = 1;
+    }
+    QueryPerformanceCounter(&start);
+    for (i = 0; i < rounds; i++)
+    {
+        for (j = 0; j < BATCH; j++)
+        {
+            ip_header = (PWINDIVERT_IPHDR)(packets + j * SYN_LEN);
+            tcp_header = (PWINDIVERT_TCPHDR)(ip_header + 1);
+            rng = rng * 1664525 + 1013904223;
+            ip_header->SrcAddr  = htonl(rng);
+            tcp_header->SrcPort = (UINT16)rng;
+            tcp_header->AckNum  = rng ^ 0xA5A5A5A5;
+        }
+        forged += guard_process(&guard, packets, sizeof(packets), addrs,
+            BATCH, 1000, outputs);
+    }
+    QueryPerformanceCounter(&end);
+    secs = (double)(end.QuadPart - start.QuadPart) / freq.QuadPart;
+    printf("ack flood: %.2f Mpps (%u forged cookies accepted, expected "
+        "~%.2f)\n", (double)rounds * BATCH / secs / 1.0e6, (UINT)forged,
+        (double)rounds * BATCH * (COOKIE_MAX_AGE + 1) / 32.0 / 16777216.0);
+
+    // (3) Legitimate handshakes:
+    for (j = 0; j < BATCH; j++)
+    {
+        client = htonl(0x0A000000 + j);
+        build_syn(packets + j * SYN_LEN, client, guard.addr, htons(4000),
+            guard.port, 1000 * j, 0, 0xFFFF, 1460);
+    }
+    num_outputs = guard_process(&guard, packets, sizeof(packets), addrs,
+        BATCH, 2000, outputs);
+    for (j = 0; j < num_outputs; j++)
+    {
+        tcp_header = (PWINDIVERT_TCPHDR)(outputs[j].packet +
+            sizeof(WINDIVERT_IPHDR));
+        cookie = ntohl(tcp_header->SeqNum);
+        build_syn(packets + j * SYN_LEN, htonl(0x0A000000 + j), guard.addr,
+            htons(4000), guard.port, 1000 * j + 1, cookie + 1, 0xFFFF, 1460);
+        tcp_header = (PWINDIVERT_TCPHDR)(packets + j * SYN_LEN +
+            sizeof(WINDIVERT_IPHDR));
+        tcp_header->Syn = 0;
+    }
+    num_outputs = guard_process(&guard, packets, sizeof(packets), addrs,
+        BATCH, 2000 + (1 << COOKIE_PERIOD_SHIFT), outputs);
+    for (j = 0; j < num_outputs; j++)
+    {
+        tcp_header = (PWINDIVERT_TCPHDR)(outputs[j].packet +
+            sizeof(WINDIVERT_IPHDR));
+        bad += (!tcp_header->Syn || tcp_header->Ack ||
+            ntohl(tcp_header->SeqNum) != 1000 * j);
+    }
+    bad += (num_outputs != BATCH);
+    printf("handshakes: %u/%u accepted\n", num_outputs, BATCH);
+    printf("errors: %u\n", (UINT)bad);
+}
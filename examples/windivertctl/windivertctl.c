@@ -36,6 +36,12 @@
  * DESCRIPTION:
  *
  * usage: windivertctl.exe list
+ *        windivertctl.exe trace [filter]
+ *        windivertctl.exe analyze [filter]
+ *
+ * The analyze mode compares the filters of all open handles, and reports
+ * handles that can never match, duplicate filters, handles that are
+ * shadowed by a higher priority DROP handle, and overlapping filters.
  */
 
 #include <winsock2.h>
@@ -47,8 +53,11 @@
 
 #include "windivert.h"
 
-#define MAX_PACKET          0xFFFF
-#define MAX_FILTER_LEN      30000
+#define MAX_PACKET          0x30000
+#define MAX_FILTER_LEN      0x40000
+#define MAX_TRACE           4096
+#define MAX_HANDLES         256
+#define NO_HANDLE           ((UINT)-1)
 
 /*
  * Modes.
@@ -58,9 +67,265 @@ typedef enum
     LIST,
     WATCH,
     KILL,
+    TRACE,
+    ANALYZE,
     UNINSTALL
 } MODE;
 
+/*
+ * An open handle (for analysis).
+ */
+typedef struct
+{
+    UINT32 process_id;
+    WINDIVERT_LAYER layer;
+    INT16 priority;
+    UINT64 flags;
+    char *filter;
+} HANDLE_INFO;
+
+/*
+ * Print the recent trace events of a handle.
+ */
+static void trace(HANDLE handle, HANDLE console, UINT32 process_id,
+    INT64 timestamp, ULONGLONG freq)
+{
+    static WINDIVERT_TRACE_EVENT events[MAX_TRACE];
+    static const char * const types[] =
+    {
+        "???", "MATCH", "NO_MATCH", "FAST_PATH", "QUEUE", "DROP", "READ",
+        "INJECT"
+    };
+    static const char * const reasons[] =
+    {
+        "???", "work_queue_full", "packet_queue_full", "timeout",
+        "oversize", "no_memory", "closed", "redirect"
+    };
+    const char *type;
+    UINT events_len, i, count;
+    INT64 last;
+
+    if (!WinDivertTraceQuery(handle, process_id, timestamp, events,
+            sizeof(events), &events_len))
+    {
+        fprintf(stderr, "error: failed to query trace (%d)\n",
+            GetLastError());
+        return;
+    }
+    count = events_len / sizeof(WINDIVERT_TRACE_EVENT);
+    last = (count == 0? 0: events[count-1].Timestamp);
+    for (i = 0; i < count; i++)
+    {
+        type = (events[i].Type < sizeof(types) / sizeof(types[0])?
+            types[events[i].Type]: types[0]);
+        SetConsoleTextAttribute(console, FOREGROUND_RED | FOREGROUND_GREEN);
+        printf("    %+.6fs", (double)(events[i].Timestamp - last) /
+            (double)freq);
+        SetConsoleTextAttribute(console,
+            FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE);
+        printf(" cpu=%u %s", events[i].Processor, type);
+        switch (events[i].Type)
+        {
+            case WINDIVERT_TRACE_MATCH:
+            case WINDIVERT_TRACE_NO_MATCH:
+            case WINDIVERT_TRACE_FAST_PATH:
+                printf(" len=%u\n", events[i].Value);
+                break;
+            case WINDIVERT_TRACE_QUEUE:
+                printf(" queue_length=%u\n", events[i].Value);
+                break;
+            case WINDIVERT_TRACE_DROP:
+                printf(" reason=%s len=%u\n",
+                    (events[i].Reason < sizeof(reasons) / sizeof(reasons[0])?
+                        reasons[events[i].Reason]: reasons[0]),
+                    events[i].Value);
+                break;
+            case WINDIVERT_TRACE_READ:
+                printf(" batch=%u len=%u\n", events[i].Reason,
+                    events[i].Value);
+                break;
+            case WINDIVERT_TRACE_INJECT:
+                printf(" batch=%u status=0x%.8X\n", events[i].Reason,
+                    events[i].Value);
+                break;
+            default:
+                putchar('\n');
+                break;
+        }
+    }
+}
+
+/*
+ * Layer name.
+ */
+static const char *layer_name(WINDIVERT_LAYER layer)
+{
+    switch (layer)
+    {
+        case WINDIVERT_LAYER_NETWORK:
+            return "NETWORK";
+        case WINDIVERT_LAYER_NETWORK_FORWARD:
+            return "NETWORK_FORWARD";
+        case WINDIVERT_LAYER_FLOW:
+            return "FLOW";
+        case WINDIVERT_LAYER_SOCKET:
+            return "SOCKET";
+        case WINDIVERT_LAYER_REFLECT:
+            return "REFLECT";
+        default:
+            return "???";
+    }
+}
+
+/*
+ * Print a handle.
+ */
+static void print_handle(HANDLE console, UINT idx, const HANDLE_INFO *info)
+{
+    static char filter_str[MAX_FILTER_LEN];
+
+    SetConsoleTextAttribute(console, FOREGROUND_RED | FOREGROUND_GREEN);
+    printf("#%u", idx);
+    SetConsoleTextAttribute(console,
+        FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE);
+    printf(" pid=%u layer=%s priority=%d%s filter=", info->process_id,
+        layer_name(info->layer), info->priority,
+        ((info->flags & WINDIVERT_FLAG_DROP) != 0? " DROP":
+         (info->flags & WINDIVERT_FLAG_SNIFF) != 0? " SNIFF": ""));
+    if (WinDivertHelperFormatFilter(info->filter, info->layer, filter_str,
+            sizeof(filter_str)))
+    {
+        printf("\"%s\"\n", filter_str);
+    }
+    else
+    {
+        printf("\"%s\"\n", info->filter);
+    }
+}
+
+/*
+ * Print an analysis finding.
+ */
+static void print_finding(HANDLE console, WORD color, const char *kind,
+    UINT i, const char *what, UINT j, UINT32 relation)
+{
+    SetConsoleTextAttribute(console, color);
+    fputs(kind, stdout);
+    SetConsoleTextAttribute(console,
+        FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE);
+    printf(" #%u %s", i, what);
+    if (j != NO_HANDLE)
+    {
+        printf(" #%u", j);
+    }
+    if ((relation & WINDIVERT_FILTER_RELATION_INEXACT) != 0)
+    {
+        fputs(" (inexact)", stdout);
+    }
+    putchar('\n');
+}
+
+/*
+ * Compare the filters of all open handles.  Handles at the same layer see
+ * the same events; packets are diverted to higher priority handles first,
+ * so a higher priority DROP handle hides every packet that it matches.
+ */
+static void analyze(HANDLE console, const HANDLE_INFO *handles, UINT count)
+{
+    static BOOL empty[MAX_HANDLES];
+    const HANDLE_INFO *hi, *lo;
+    UINT32 relation;
+    UINT i, j, findings = 0;
+
+    for (i = 0; i < count; i++)
+    {
+        print_handle(console, i, &handles[i]);
+    }
+    for (i = 0; i < count; i++)
+    {
+        empty[i] = FALSE;
+        if (!WinDivertHelperCompareFilter(handles[i].filter,
+                handles[i].filter, handles[i].layer, &relation))
+        {
+            continue;
+        }
+        if ((relation & WINDIVERT_FILTER_RELATION_EMPTY1) != 0)
+        {
+            empty[i] = TRUE;
+            print_finding(console, FOREGROUND_RED, "DEAD", i,
+                "never matches", NO_HANDLE, relation);
+            findings++;
+        }
+    }
+    for (i = 0; i < count; i++)
+    {
+        for (j = i + 1; j < count; j++)
+        {
+            if (handles[i].layer != handles[j].layer || empty[i] ||
+                empty[j] ||
+                !WinDivertHelperCompareFilter(handles[i].filter,
+                    handles[j].filter, handles[i].layer, &relation) ||
+                (relation & WINDIVERT_FILTER_RELATION_DISJOINT) != 0)
+            {
+                continue;
+            }
+            findings++;
+
+            // Order the pair by priority (i is the higher if equal):
+            if (handles[j].priority > handles[i].priority)
+            {
+                hi = &handles[j];
+                lo = &handles[i];
+                relation = (relation & ~(WINDIVERT_FILTER_RELATION_SUBSET |
+                        WINDIVERT_FILTER_RELATION_SUPERSET)) |
+                    ((relation & WINDIVERT_FILTER_RELATION_SUBSET) != 0?
+                        WINDIVERT_FILTER_RELATION_SUPERSET: 0) |
+                    ((relation & WINDIVERT_FILTER_RELATION_SUPERSET) != 0?
+                        WINDIVERT_FILTER_RELATION_SUBSET: 0);
+            }
+            else
+            {
+                hi = &handles[i];
+                lo = &handles[j];
+            }
+            if ((hi->flags & WINDIVERT_FLAG_DROP) != 0 &&
+                (relation & WINDIVERT_FILTER_RELATION_SUPERSET) != 0)
+            {
+                print_finding(console, FOREGROUND_RED, "SHADOWED",
+                    (UINT)(lo - handles), "is hidden by", (UINT)(hi - handles),
+                    relation);
+            }
+            else if ((relation & WINDIVERT_FILTER_RELATION_SUBSET) != 0 &&
+                     (relation & WINDIVERT_FILTER_RELATION_SUPERSET) != 0)
+            {
+                print_finding(console, FOREGROUND_RED | FOREGROUND_GREEN,
+                    "DUPLICATE", i, "has the same filter as", j, relation);
+            }
+            else if ((relation & WINDIVERT_FILTER_RELATION_SUBSET) != 0)
+            {
+                print_finding(console, FOREGROUND_RED | FOREGROUND_GREEN,
+                    "SUBSET", (UINT)(hi - handles), "is contained in",
+                    (UINT)(lo - handles), relation);
+            }
+            else if ((relation & WINDIVERT_FILTER_RELATION_SUPERSET) != 0)
+            {
+                print_finding(console, FOREGROUND_RED | FOREGROUND_GREEN,
+                    "SUBSET", (UINT)(lo - handles), "is contained in",
+                    (UINT)(hi - handles), relation);
+            }
+            else
+            {
+                print_finding(console, FOREGROUND_GREEN, "OVERLAP", i,
+                    "may overlap", j, relation);
+            }
+        }
+    }
+    if (findings == 0)
+    {
+        puts("no overlapping filters");
+    }
+}
+
 /*
  * Entry.
  */
@@ -75,18 +340,21 @@ int __cdecl main(int argc, char **argv)
     DWORD path_len;
     BOOL or;
     WINDIVERT_ADDRESS addr;
-    ULONGLONG freq, start_count;
+    ULONGLONG freq, start_count, cpu_time;
     LARGE_INTEGER li;
     MODE mode;
     SC_HANDLE manager = NULL, service = NULL;
     SERVICE_STATUS status;
+    static HANDLE_INFO handles[MAX_HANDLES];
+    UINT handles_len = 0;
     const char *filter = "true";
     const char *err_str = NULL;
 
     if (argc != 2 && argc != 3)
     {
 usage:
-        fprintf(stderr, "usage: %s (list|watch|kill) [filter]\n", argv[0]);
+        fprintf(stderr, "usage: %s (list|watch|kill|trace|analyze) "
+            "[filter]\n", argv[0]);
         fprintf(stderr, "       %s uninstall\n", argv[0]);
         exit(EXIT_FAILURE);
     }
@@ -102,6 +370,14 @@ usage:
     {
         mode = KILL;
     }
+    else if (strcmp(argv[1], "trace") == 0)
+    {
+        mode = TRACE;
+    }
+    else if (strcmp(argv[1], "analyze") == 0)
+    {
+        mode = ANALYZE;
+    }
     else if (strcmp(argv[1], "uninstall") == 0)
     {
         if (argc != 2)
@@ -179,6 +455,36 @@ usage:
             continue;
         }
 
+        if (mode == ANALYZE)
+        {
+            if (addr.Event != WINDIVERT_EVENT_REFLECT_OPEN ||
+                addr.Reflect.ProcessId == GetCurrentProcessId())
+            {
+                continue;
+            }
+            if (handles_len >= MAX_HANDLES)
+            {
+                fprintf(stderr, "warning: too many handles (max %u)\n",
+                    MAX_HANDLES);
+                continue;
+            }
+            packet[sizeof(packet) - 1] = '\0';
+            handles[handles_len].filter =
+                (char *)malloc(strlen((char *)packet) + 1);
+            if (handles[handles_len].filter == NULL)
+            {
+                fprintf(stderr, "error: failed to allocate memory\n");
+                exit(EXIT_FAILURE);
+            }
+            strcpy(handles[handles_len].filter, (char *)packet);
+            handles[handles_len].process_id = addr.Reflect.ProcessId;
+            handles[handles_len].layer      = addr.Reflect.Layer;
+            handles[handles_len].priority   = addr.Reflect.Priority;
+            handles[handles_len].flags      = addr.Reflect.Flags;
+            handles_len++;
+            continue;
+        }
+
         switch (addr.Event)
         {
             case WINDIVERT_EVENT_REFLECT_OPEN:
@@ -305,6 +611,18 @@ usage:
         fputs(" priority=", stdout);
         SetConsoleTextAttribute(console, FOREGROUND_RED | FOREGROUND_GREEN);
         printf("%d", addr.Reflect.Priority);
+        SetConsoleTextAttribute(console,
+            FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE);
+        fputs(" cpu=", stdout);
+        SetConsoleTextAttribute(console, FOREGROUND_RED | FOREGROUND_GREEN);
+        cpu_time = addr.Reflect.ParseTime + addr.Reflect.FilterTime +
+            addr.Reflect.QueueTime + addr.Reflect.CopyTime;
+        printf("%.3fms(parse=%.3f,filter=%.3f,queue=%.3f,copy=%.3f)",
+            (double)cpu_time * 1000.0 / (double)freq,
+            (double)addr.Reflect.ParseTime * 1000.0 / (double)freq,
+            (double)addr.Reflect.FilterTime * 1000.0 / (double)freq,
+            (double)addr.Reflect.QueueTime * 1000.0 / (double)freq,
+            (double)addr.Reflect.CopyTime * 1000.0 / (double)freq);
         SetConsoleTextAttribute(console,
             FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE);
         fputs(" filter=", stdout);
@@ -321,6 +639,11 @@ usage:
         SetConsoleTextAttribute(console,
             FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE);
         putchar('\n');
+        if (mode == TRACE && addr.Reflect.Layer != WINDIVERT_LAYER_REFLECT)
+        {
+            trace(handle, console, addr.Reflect.ProcessId,
+                addr.Reflect.Timestamp, freq);
+        }
     }
 
     if (!WinDivertClose(handle))
@@ -330,6 +653,11 @@ usage:
         return EXIT_FAILURE;
     }
 
+    if (mode == ANALYZE)
+    {
+        analyze(console, handles, handles_len);
+    }
+
     if (mode == UNINSTALL)
     {
         // Stop & delete the WinDivert service:
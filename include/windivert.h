@@ -88,6 +88,7 @@ typedef struct
 {
     UINT32 IfIdx;                       /* Packet's interface index. */
     UINT32 SubIfIdx;                    /* Packet's sub-interface index. */
+    UINT32 Mark;                        /* Packet's mark. */
 } WINDIVERT_DATA_NETWORK, *PWINDIVERT_DATA_NETWORK;
 
 /*
@@ -130,6 +131,13 @@ typedef struct
     WINDIVERT_LAYER Layer;              /* Handle layer. */
     UINT64 Flags;                       /* Handle flags. */
     INT16  Priority;                    /* Handle priority. */
+    UINT16 Truncated:1;                 /* Filter object truncated? */
+    UINT16 Reserved1:15;
+    UINT32 Reserved2;
+    UINT64 ParseTime;                   /* Handle header parsing time. */
+    UINT64 FilterTime;                  /* Handle filter evaluation time. */
+    UINT64 QueueTime;                   /* Handle queueing time. */
+    UINT64 CopyTime;                    /* Handle packet copying time. */
 } WINDIVERT_DATA_REFLECT, *PWINDIVERT_DATA_REFLECT;
 
 /*
@@ -153,7 +161,7 @@ typedef struct
     UINT32 TCPChecksum:1;               /* Packet has valid TCP checksum? */
     UINT32 UDPChecksum:1;               /* Packet has valid UDP checksum? */
     UINT32 Reserved1:8;
-    UINT32 Reserved2;
+    UINT32 Sequence;                    /* Packet's sequence number. */
     union
     {
         WINDIVERT_DATA_NETWORK Network; /* Network layer data. */
@@ -207,8 +215,15 @@ typedef enum
     WINDIVERT_PARAM_QUEUE_SIZE = 2,     /* Packet queue size. */
     WINDIVERT_PARAM_VERSION_MAJOR = 3,  /* Driver version (major). */
     WINDIVERT_PARAM_VERSION_MINOR = 4,  /* Driver version (minor). */
+    WINDIVERT_PARAM_REDIRECT_PORT = 5,  /* Redirect to local proxy port. */
+    WINDIVERT_PARAM_CPU_EVENTS = 6,     /* Events classified. */
+    WINDIVERT_PARAM_CPU_PARSE = 7,      /* Header parsing time. */
+    WINDIVERT_PARAM_CPU_FILTER = 8,     /* Filter evaluation time. */
+    WINDIVERT_PARAM_CPU_QUEUE = 9,      /* Queueing time. */
+    WINDIVERT_PARAM_CPU_COPY = 10,      /* Packet copying time. */
+    WINDIVERT_PARAM_SEQUENCE = 11,      /* Next packet sequence number. */
 } WINDIVERT_PARAM, *PWINDIVERT_PARAM;
-#define WINDIVERT_PARAM_MAX             WINDIVERT_PARAM_VERSION_MINOR
+#define WINDIVERT_PARAM_MAX             WINDIVERT_PARAM_SEQUENCE
 
 /*
  * WinDivert shutdown parameter.
@@ -221,6 +236,37 @@ typedef enum
 } WINDIVERT_SHUTDOWN, *PWINDIVERT_SHUTDOWN;
 #define WINDIVERT_SHUTDOWN_MAX          WINDIVERT_SHUTDOWN_BOTH
 
+/*
+ * WinDivert trace (flight recorder) events.
+ */
+typedef enum
+{
+    WINDIVERT_TRACE_MATCH = 1,          /* Filter matched. */
+    WINDIVERT_TRACE_NO_MATCH = 2,       /* Filter did not match. */
+    WINDIVERT_TRACE_FAST_PATH = 3,      /* Completed a pending recv. */
+    WINDIVERT_TRACE_QUEUE = 4,          /* Packet queued. */
+    WINDIVERT_TRACE_DROP = 5,           /* Packet dropped. */
+    WINDIVERT_TRACE_READ = 6,           /* Recv completed. */
+    WINDIVERT_TRACE_INJECT = 7,         /* Send completed. */
+} WINDIVERT_TRACE_TYPE, *PWINDIVERT_TRACE_TYPE;
+
+#define WINDIVERT_TRACE_DROP_WORK_QUEUE_FULL    1
+#define WINDIVERT_TRACE_DROP_PACKET_QUEUE_FULL  2
+#define WINDIVERT_TRACE_DROP_TIMEOUT            3
+#define WINDIVERT_TRACE_DROP_OVERSIZE           4
+#define WINDIVERT_TRACE_DROP_NO_MEMORY          5
+#define WINDIVERT_TRACE_DROP_CLOSED             6
+#define WINDIVERT_TRACE_DROP_REDIRECT           7
+
+typedef struct
+{
+    INT64  Timestamp;                   /* Event timestamp. */
+    UINT8  Type;                        /* WINDIVERT_TRACE_* */
+    UINT8  Reason;                      /* Drop reason or batch size. */
+    UINT16 Processor;                   /* Processor number. */
+    UINT32 Value;                       /* Length, queue length or status. */
+} WINDIVERT_TRACE_EVENT, *PWINDIVERT_TRACE_EVENT;
+
 #ifndef WINDIVERT_KERNEL
 
 /*
@@ -307,6 +353,89 @@ WINDIVERTEXPORT BOOL WinDivertGetParam(
     __in        WINDIVERT_PARAM param,
     __out       UINT64 *pValue);
 
+/*
+ * Ordered send.
+ */
+typedef struct WINDIVERT_SEQUENCER *PWINDIVERT_SEQUENCER;
+
+#define WINDIVERT_SEQUENCER_FLAG_FLOW                       0x0001
+
+WINDIVERTEXPORT PWINDIVERT_SEQUENCER WinDivertSequencerCreate(
+    __in        HANDLE handle,
+    __in        UINT64 flags,
+    __in        UINT32 timeout);
+WINDIVERTEXPORT BOOL WinDivertSequencerRecvEx(
+    __in        PWINDIVERT_SEQUENCER sequencer,
+    __out_opt   VOID *pPacket,
+    __in        UINT packetLen,
+    __out_opt   UINT *pRecvLen,
+    __in        UINT64 flags,
+    __out       WINDIVERT_ADDRESS *pAddr,
+    __inout     UINT *pAddrLen);
+WINDIVERTEXPORT BOOL WinDivertSequencerSendEx(
+    __in        PWINDIVERT_SEQUENCER sequencer,
+    __in        const VOID *pPacket,
+    __in        UINT packetLen,
+    __in        UINT64 flags,
+    __in        const WINDIVERT_ADDRESS *pAddr,
+    __in        UINT addrLen);
+WINDIVERTEXPORT BOOL WinDivertSequencerDiscard(
+    __in        PWINDIVERT_SEQUENCER sequencer,
+    __in        const WINDIVERT_ADDRESS *pAddr,
+    __in        UINT addrLen);
+WINDIVERTEXPORT BOOL WinDivertSequencerFlush(
+    __in        PWINDIVERT_SEQUENCER sequencer,
+    __in        BOOL force);
+WINDIVERTEXPORT void WinDivertSequencerFree(
+    __in        PWINDIVERT_SEQUENCER sequencer);
+
+/*
+ * Completion-callback receive.
+ */
+typedef struct WINDIVERT_RECV_POOL *PWINDIVERT_RECV_POOL;
+typedef VOID (*WINDIVERT_RECV_CALLBACK)(
+    __in        PVOID context,
+    __in        const VOID *pPacket,
+    __in        UINT packetLen,
+    __in        const WINDIVERT_ADDRESS *pAddr,
+    __in        UINT addrCount);
+
+WINDIVERTEXPORT PWINDIVERT_RECV_POOL WinDivertRecvPoolCreate(
+    __in        HANDLE handle,
+    __in        UINT reads,
+    __in        UINT threads,
+    __in        UINT packetLen,
+    __in        UINT batch,
+    __in        UINT64 flags,
+    __in        WINDIVERT_RECV_CALLBACK callback,
+    __in_opt    PVOID context);
+WINDIVERTEXPORT BOOL WinDivertRecvPoolWait(
+    __in        PWINDIVERT_RECV_POOL pool,
+    __in        UINT32 timeout);
+WINDIVERTEXPORT void WinDivertRecvPoolFree(
+    __in        PWINDIVERT_RECV_POOL pool);
+
+/*
+ * Query the original destination of a redirected connection.
+ */
+WINDIVERTEXPORT BOOL WinDivertRedirectQuery(
+    __in        HANDLE handle,
+    __in        const UINT32 *pRemoteAddr,
+    __in        UINT16 remotePort,
+    __out_opt   UINT32 *pOrigAddr,
+    __out       UINT16 *pOrigPort);
+
+/*
+ * Get the recent trace events of a WinDivert handle.
+ */
+WINDIVERTEXPORT BOOL WinDivertTraceQuery(
+    __in        HANDLE handle,
+    __in        UINT32 processId,
+    __in        INT64 timestamp,
+    __out       WINDIVERT_TRACE_EVENT *pEvents,
+    __in        UINT eventsLen,
+    __out_opt   UINT *pEventsLen);
+
 #endif      /* WINDIVERT_KERNEL */
 
 /*
@@ -323,6 +452,7 @@ WINDIVERTEXPORT BOOL WinDivertGetParam(
 #define WINDIVERT_PARAM_QUEUE_SIZE_DEFAULT      4194304     /* 4MB */
 #define WINDIVERT_PARAM_QUEUE_SIZE_MIN          65535       /* 64KB */
 #define WINDIVERT_PARAM_QUEUE_SIZE_MAX          33554432    /* 32MB */
+#define WINDIVERT_PARAM_REDIRECT_PORT_MAX       0xFFFF
 #define WINDIVERT_BATCH_MAX                     0xFF        /* 255 */
 #define WINDIVERT_MTU_MAX                       (40 + 0xFFFF)
 
@@ -589,6 +719,457 @@ WINDIVERTEXPORT BOOL WinDivertHelperFormatFilter(
     __out       char *buffer,
     __in        UINT bufLen);
 
+/*
+ * Incremental (clause-level) filter compilation.
+ */
+typedef struct WINDIVERT_CLAUSE_FILTER *PWINDIVERT_CLAUSE_FILTER;
+
+#define WINDIVERT_CLAUSE_FLAG_AND                           0x0001
+
+WINDIVERTEXPORT PWINDIVERT_CLAUSE_FILTER WinDivertHelperClauseFilterCreate(
+    __in        WINDIVERT_LAYER layer,
+    __in        UINT64 flags);
+WINDIVERTEXPORT BOOL WinDivertHelperClauseFilterAdd(
+    __in        PWINDIVERT_CLAUSE_FILTER filter,
+    __in        const char *clause,
+    __out_opt   UINT *pId,
+    __out_opt   const char **errorStr,
+    __out_opt   UINT *errorPos);
+WINDIVERTEXPORT BOOL WinDivertHelperClauseFilterRemove(
+    __in        PWINDIVERT_CLAUSE_FILTER filter,
+    __in        UINT id);
+WINDIVERTEXPORT BOOL WinDivertHelperClauseFilterGetObject(
+    __in        PWINDIVERT_CLAUSE_FILTER filter,
+    __out       char *object,
+    __in        UINT objLen);
+WINDIVERTEXPORT void WinDivertHelperClauseFilterFree(
+    __in        PWINDIVERT_CLAUSE_FILTER filter);
+
+/*
+ * Profile-guided filter optimization.
+ */
+typedef struct
+{
+    UINT64 Count;                       /* Times the test was executed. */
+    UINT64 Success;                     /* Times the test succeeded. */
+} WINDIVERT_FILTER_STATS, *PWINDIVERT_FILTER_STATS;
+
+WINDIVERTEXPORT BOOL WinDivertHelperProfileFilter(
+    __in        const char *filter,
+    __in        WINDIVERT_LAYER layer,
+    __in_opt    const VOID *pPacket,
+    __in        UINT packetLen,
+    __in        const WINDIVERT_ADDRESS *pAddr,
+    __in        UINT addrLen,
+    __inout     WINDIVERT_FILTER_STATS *pStats,
+    __in        UINT statsLen);
+WINDIVERTEXPORT BOOL WinDivertHelperOptimizeFilter(
+    __in        const char *filter,
+    __in        WINDIVERT_LAYER layer,
+    __in_opt    const WINDIVERT_FILTER_STATS *pStats,
+    __in        UINT statsLen,
+    __out       char *object,
+    __in        UINT objLen,
+    __out_opt   const char **errorStr,
+    __out_opt   UINT *errorPos);
+
+/*
+ * Tunnel encapsulation/decapsulation.
+ */
+typedef enum
+{
+    WINDIVERT_ENCAP_IPIP = 0,           /* IPv4/IPv6-in-IP. */
+    WINDIVERT_ENCAP_GRE = 1,            /* GRE. */
+    WINDIVERT_ENCAP_UDP = 2,            /* IP-in-UDP. */
+    WINDIVERT_ENCAP_VXLAN = 3,          /* VXLAN. */
+} WINDIVERT_ENCAP_TYPE;
+
+#define WINDIVERT_ENCAP_HDR_MAXLEN                          72
+
+typedef struct
+{
+    UINT8 Type;                         /* WINDIVERT_ENCAP_TYPE. */
+    UINT8 IPv6;                         /* Outer header is IPv6? */
+    UINT8 Length;                       /* Outer header(s) length. */
+    UINT8 Reserved1;
+    UINT32 Sum;                         /* Pre-computed partial checksum. */
+    UINT8 Header[WINDIVERT_ENCAP_HDR_MAXLEN];
+} WINDIVERT_ENCAP, *PWINDIVERT_ENCAP;
+
+WINDIVERTEXPORT BOOL WinDivertHelperEncapInit(
+    __out       PWINDIVERT_ENCAP pEncap,
+    __in        WINDIVERT_ENCAP_TYPE type,
+    __in        BOOL ipv6,
+    __in        const UINT32 *pSrcAddr,
+    __in        const UINT32 *pDstAddr,
+    __in        UINT16 srcPort,
+    __in        UINT16 dstPort,
+    __in        UINT32 key);
+WINDIVERTEXPORT BOOL WinDivertHelperEncap(
+    __in        const WINDIVERT_ENCAP *pEncap,
+    __inout     PVOID pPacket,
+    __in        UINT packetLen,
+    __in        UINT headroom,
+    __in        UINT bufLen,
+    __out_opt   PVOID *ppPacket,
+    __out_opt   UINT *pPacketLen,
+    __inout_opt WINDIVERT_ADDRESS *pAddr);
+WINDIVERTEXPORT BOOL WinDivertHelperDecap(
+    __in        const WINDIVERT_ENCAP *pEncap,
+    __in        PVOID pPacket,
+    __in        UINT packetLen,
+    __out_opt   PVOID *ppPacket,
+    __out_opt   UINT *pPacketLen,
+    __inout_opt WINDIVERT_ADDRESS *pAddr);
+WINDIVERTEXPORT BOOL WinDivertHelperEncapBatch(
+    __in        const WINDIVERT_ENCAP *pEncap,
+    __in        const VOID *pPackets,
+    __in        UINT packetsLen,
+    __out       PVOID pOutput,
+    __in        UINT outputLen,
+    __out_opt   UINT *pOutputLen,
+    __inout_opt WINDIVERT_ADDRESS *pAddr,
+    __in        UINT addrLen);
+WINDIVERTEXPORT BOOL WinDivertHelperDecapBatch(
+    __in        const WINDIVERT_ENCAP *pEncap,
+    __inout     PVOID pPackets,
+    __in        UINT packetsLen,
+    __out_opt   UINT *pPacketsLen,
+    __inout_opt WINDIVERT_ADDRESS *pAddr,
+    __in        UINT addrLen);
+
+/*
+ * Streaming sketches.
+ */
+typedef struct WINDIVERT_SKETCH *PWINDIVERT_SKETCH;
+
+typedef enum
+{
+    WINDIVERT_SKETCH_COUNT_MIN = 0,     /* Per-key weight (count-min). */
+    WINDIVERT_SKETCH_TOP_K = 1,         /* Heavy hitters (space-saving). */
+    WINDIVERT_SKETCH_DISTINCT = 2,      /* Distinct items (HyperLogLog). */
+} WINDIVERT_SKETCH_TYPE;
+
+#define WINDIVERT_SKETCH_KEY_SRCADDR                        0x0001
+#define WINDIVERT_SKETCH_KEY_DSTADDR                        0x0002
+#define WINDIVERT_SKETCH_KEY_SRCPORT                        0x0004
+#define WINDIVERT_SKETCH_KEY_DSTPORT                        0x0008
+#define WINDIVERT_SKETCH_KEY_PROTOCOL                       0x0010
+
+#define WINDIVERT_SKETCH_FLAG_BYTES                         0x0001
+
+typedef struct
+{
+    UINT32 SrcAddr[4];                  /* Source address. */
+    UINT32 DstAddr[4];                  /* Destination address. */
+    UINT16 SrcPort;                     /* Source port. */
+    UINT16 DstPort;                     /* Destination port. */
+    UINT8 Protocol;                     /* Protocol. */
+    UINT8 Reserved1[3];
+} WINDIVERT_SKETCH_KEY, *PWINDIVERT_SKETCH_KEY;
+
+typedef struct
+{
+    WINDIVERT_SKETCH_KEY Key;           /* Key. */
+    UINT64 Count;                       /* Estimated weight. */
+    UINT64 Error;                       /* Maximum over-estimation. */
+} WINDIVERT_SKETCH_ENTRY, *PWINDIVERT_SKETCH_ENTRY;
+
+WINDIVERTEXPORT PWINDIVERT_SKETCH WinDivertHelperSketchCreate(
+    __in        WINDIVERT_SKETCH_TYPE type,
+    __in        UINT32 keyFields,
+    __in        UINT32 itemFields,
+    __in        UINT size,
+    __in        UINT depth,
+    __in        UINT64 flags);
+WINDIVERTEXPORT BOOL WinDivertHelperSketchUpdate(
+    __in        PWINDIVERT_SKETCH sketch,
+    __in        const VOID *pPackets,
+    __in        UINT packetsLen);
+WINDIVERTEXPORT BOOL WinDivertHelperSketchUpdateKey(
+    __in        PWINDIVERT_SKETCH sketch,
+    __in        const WINDIVERT_SKETCH_KEY *pKey,
+    __in_opt    const WINDIVERT_SKETCH_KEY *pItem,
+    __in        UINT64 weight);
+WINDIVERTEXPORT BOOL WinDivertHelperSketchQuery(
+    __in        PWINDIVERT_SKETCH sketch,
+    __in        const WINDIVERT_SKETCH_KEY *pKey,
+    __out       UINT64 *pEstimate);
+WINDIVERTEXPORT BOOL WinDivertHelperSketchTopK(
+    __in        PWINDIVERT_SKETCH sketch,
+    __out       PWINDIVERT_SKETCH_ENTRY pEntries,
+    __in        UINT entriesLen,
+    __out_opt   UINT *pCount);
+WINDIVERTEXPORT BOOL WinDivertHelperSketchMerge(
+    __inout     PWINDIVERT_SKETCH sketch,
+    __in        PWINDIVERT_SKETCH other);
+WINDIVERTEXPORT BOOL WinDivertHelperSketchReset(
+    __inout     PWINDIVERT_SKETCH sketch);
+WINDIVERTEXPORT void WinDivertHelperSketchFree(
+    __in        PWINDIVERT_SKETCH sketch);
+
+/*
+ * API latency statistics.
+ */
+typedef enum
+{
+    WINDIVERT_API_RECV = 0,             /* WinDivertRecv[Ex](). */
+    WINDIVERT_API_SEND = 1,             /* WinDivertSend[Ex](). */
+    WINDIVERT_API_SET_PARAM = 2,        /* WinDivertSetParam(). */
+    WINDIVERT_API_SHUTDOWN = 3,         /* WinDivertShutdown(). */
+} WINDIVERT_API;
+#define WINDIVERT_API_MAX               WINDIVERT_API_SHUTDOWN
+
+#define WINDIVERT_API_STATS_BUCKETS                         32
+#define WINDIVERT_API_STATS_ERRORS                          4
+
+typedef struct
+{
+    UINT64 Calls;                       /* Completed calls. */
+    UINT64 Errors;                      /* Failed calls. */
+    UINT64 Pending;                     /* Overlapped calls left pending. */
+    UINT64 TotalTime;                   /* Total call time (ns). */
+    UINT64 MaxTime;                     /* Max call time (ns). */
+    UINT64 MedianTime;                  /* Median call time (ns, bound). */
+    UINT64 P99Time;                     /* 99th percentile (ns, bound). */
+    UINT64 Packets;                     /* Packets received/sent. */
+    UINT64 Slots;                       /* Packets requested. */
+    UINT64 Histogram[WINDIVERT_API_STATS_BUCKETS];
+                                        /* Calls with time < 2^i ns. */
+    UINT32 ErrorCode[WINDIVERT_API_STATS_ERRORS];
+                                        /* First distinct error codes. */
+    UINT64 ErrorCount[WINDIVERT_API_STATS_ERRORS];
+                                        /* Count per error code. */
+} WINDIVERT_API_STATS, *PWINDIVERT_API_STATS;
+
+WINDIVERTEXPORT BOOL WinDivertHelperApiStatsEnable(
+    __in        HANDLE handle,
+    __in        BOOL enable);
+WINDIVERTEXPORT BOOL WinDivertHelperApiStatsQuery(
+    __in_opt    HANDLE handle,
+    __in        WINDIVERT_API api,
+    __out       PWINDIVERT_API_STATS pStats);
+
+/*
+ * Timestamp-ordered merge of multiple packet streams.
+ */
+typedef struct WINDIVERT_MERGE *PWINDIVERT_MERGE;
+
+#define WINDIVERT_MERGE_FLAG_DROP_LATE                      0x0001
+
+WINDIVERTEXPORT PWINDIVERT_MERGE WinDivertHelperMergeCreate(
+    __in        UINT streams,
+    __in        UINT size,
+    __in        INT64 delay,
+    __in        UINT64 flags);
+WINDIVERTEXPORT BOOL WinDivertHelperMergePush(
+    __inout     PWINDIVERT_MERGE merge,
+    __in        UINT stream,
+    __in_opt    const VOID *pPacket,
+    __in        UINT packetLen,
+    __in_opt    const WINDIVERT_ADDRESS *pAddr,
+    __in        UINT addrLen);
+WINDIVERTEXPORT BOOL WinDivertHelperMergePop(
+    __inout     PWINDIVERT_MERGE merge,
+    __out_opt   VOID *pPacket,
+    __in        UINT packetLen,
+    __out_opt   UINT *pPopLen,
+    __out       WINDIVERT_ADDRESS *pAddr,
+    __inout     UINT *pAddrLen,
+    __out_opt   UINT8 *pStreams,
+    __in        BOOL flush);
+WINDIVERTEXPORT BOOL WinDivertHelperMergeQuery(
+    __in        PWINDIVERT_MERGE merge,
+    __out_opt   UINT64 *pPending,
+    __out_opt   UINT64 *pLate);
+WINDIVERTEXPORT void WinDivertHelperMergeFree(
+    __in        PWINDIVERT_MERGE merge);
+
+/*
+ * Duplicate packet suppression.
+ */
+typedef struct WINDIVERT_DEDUP *PWINDIVERT_DEDUP;
+
+#define WINDIVERT_DEDUP_FLAG_STRICT                         0x0001
+
+WINDIVERTEXPORT PWINDIVERT_DEDUP WinDivertHelperDedupCreate(
+    __in        UINT size,
+    __in        INT64 window,
+    __in        UINT64 flags);
+WINDIVERTEXPORT BOOL WinDivertHelperDedupCheck(
+    __in        PWINDIVERT_DEDUP dedup,
+    __in_opt    const VOID *pPacket,
+    __in        UINT packetLen,
+    __in        const WINDIVERT_ADDRESS *pAddr,
+    __in        UINT addrLen,
+    __out_opt   UINT8 *pDuplicate,
+    __out_opt   UINT *pDupCount);
+WINDIVERTEXPORT BOOL WinDivertHelperDedupFilter(
+    __in        PWINDIVERT_DEDUP dedup,
+    __inout_opt VOID *pPacket,
+    __inout     UINT *pPacketLen,
+    __inout     WINDIVERT_ADDRESS *pAddr,
+    __inout     UINT *pAddrLen);
+WINDIVERTEXPORT BOOL WinDivertHelperDedupQuery(
+    __in        PWINDIVERT_DEDUP dedup,
+    __out_opt   UINT64 *pChecked,
+    __out_opt   UINT64 *pDuplicates);
+WINDIVERTEXPORT void WinDivertHelperDedupFree(
+    __in        PWINDIVERT_DEDUP dedup);
+
+/*
+ * Filter comparison.
+ */
+#define WINDIVERT_FILTER_RELATION_EMPTY1                    0x0001
+#define WINDIVERT_FILTER_RELATION_EMPTY2                    0x0002
+#define WINDIVERT_FILTER_RELATION_DISJOINT                  0x0004
+#define WINDIVERT_FILTER_RELATION_SUBSET                    0x0008
+#define WINDIVERT_FILTER_RELATION_SUPERSET                  0x0010
+#define WINDIVERT_FILTER_RELATION_INEXACT                   0x0020
+
+WINDIVERTEXPORT BOOL WinDivertHelperCompareFilter(
+    __in        const char *filter1,
+    __in        const char *filter2,
+    __in        WINDIVERT_LAYER layer,
+    __out       UINT32 *pRelation);
+
+/*
+ * Passive TCP flow statistics.
+ */
+typedef struct WINDIVERT_TCPSTATS *PWINDIVERT_TCPSTATS;
+
+#define WINDIVERT_TCPSTATS_FLOW_SYN                         0x0001
+#define WINDIVERT_TCPSTATS_FLOW_ESTABLISHED                 0x0002
+#define WINDIVERT_TCPSTATS_FLOW_FIN                         0x0004
+#define WINDIVERT_TCPSTATS_FLOW_RST                         0x0008
+#define WINDIVERT_TCPSTATS_FLOW_IDLE                        0x0010
+#define WINDIVERT_TCPSTATS_FLOW_EVICTED                     0x0020
+#define WINDIVERT_TCPSTATS_FLOW_ACTIVE                      0x0040
+#define WINDIVERT_TCPSTATS_FLOW_IPV6                        0x0080
+
+typedef struct
+{
+    UINT64 Packets;                     /* Segments sent. */
+    UINT64 Bytes;                       /* Payload bytes sent. */
+    UINT32 Retransmits;                 /* Retransmitted segments. */
+    UINT32 OutOfOrder;                  /* Out-of-order segments. */
+    UINT32 ZeroWindows;                 /* Zero windows advertised. */
+    UINT32 RttCount;                    /* RTT samples. */
+    INT64 HandshakeRtt;                 /* SYN RTT (0 = unknown). */
+    INT64 RttMin;                       /* Minimum RTT. */
+    INT64 RttMax;                       /* Maximum RTT. */
+    INT64 RttSum;                       /* Sum of RTT samples. */
+    INT64 Srtt;                         /* Smoothed RTT. */
+    INT64 ZeroWindowTime;               /* Time at zero window. */
+} WINDIVERT_TCPSTATS_DIRECTION, *PWINDIVERT_TCPSTATS_DIRECTION;
+
+typedef struct
+{
+    UINT32 ClientAddr[4];               /* Client address. */
+    UINT32 ServerAddr[4];               /* Server address. */
+    UINT16 ClientPort;                  /* Client port. */
+    UINT16 ServerPort;                  /* Server port. */
+    UINT32 Flags;                       /* WINDIVERT_TCPSTATS_FLOW_* */
+    INT64 FirstTimestamp;               /* First segment. */
+    INT64 LastTimestamp;                /* Last segment. */
+    WINDIVERT_TCPSTATS_DIRECTION Client;/* Client to server. */
+    WINDIVERT_TCPSTATS_DIRECTION Server;/* Server to client. */
+} WINDIVERT_TCPSTATS_FLOW, *PWINDIVERT_TCPSTATS_FLOW;
+
+WINDIVERTEXPORT PWINDIVERT_TCPSTATS WinDivertHelperTcpStatsCreate(
+    __in        UINT size,
+    __in        INT64 timeout);
+WINDIVERTEXPORT BOOL WinDivertHelperTcpStatsUpdate(
+    __in        PWINDIVERT_TCPSTATS stats,
+    __in_opt    const VOID *pPacket,
+    __in        UINT packetLen,
+    __in        const WINDIVERT_ADDRESS *pAddr,
+    __in        UINT addrLen);
+WINDIVERTEXPORT BOOL WinDivertHelperTcpStatsPop(
+    __in        PWINDIVERT_TCPSTATS stats,
+    __out       PWINDIVERT_TCPSTATS_FLOW pFlows,
+    __in        UINT flowsLen,
+    __out_opt   UINT *pCount,
+    __in        BOOL flush);
+WINDIVERTEXPORT BOOL WinDivertHelperTcpStatsSnapshot(
+    __in        PWINDIVERT_TCPSTATS stats,
+    __out       PWINDIVERT_TCPSTATS_FLOW pFlows,
+    __in        UINT flowsLen,
+    __out_opt   UINT *pCount);
+WINDIVERTEXPORT BOOL WinDivertHelperTcpStatsQuery(
+    __in        PWINDIVERT_TCPSTATS stats,
+    __out_opt   UINT64 *pActive,
+    __out_opt   UINT64 *pPending,
+    __out_opt   UINT64 *pLost);
+WINDIVERTEXPORT void WinDivertHelperTcpStatsFree(
+    __in        PWINDIVERT_TCPSTATS stats);
+
+/*
+ * Stateless IPv4/IPv6 translation.
+ */
+#define WINDIVERT_XLAT_FLAG_DECREMENT_TTL                   0x0001
+
+typedef struct
+{
+    UINT32 SrcAddr[4];                  /* New source address. */
+    UINT32 DstAddr[4];                  /* New destination address. */
+    UINT16 SrcPort;                     /* New source port (0 = keep). */
+    UINT16 DstPort;                     /* New dest. port (0 = keep). */
+} WINDIVERT_XLAT_ADDR, *PWINDIVERT_XLAT_ADDR;
+
+WINDIVERTEXPORT BOOL WinDivertHelperXlat(
+    __in        const WINDIVERT_XLAT_ADDR *pOuter,
+    __in_opt    const WINDIVERT_XLAT_ADDR *pInner,
+    __in        UINT64 flags,
+    __inout     PVOID pPacket,
+    __in        UINT packetLen,
+    __in        UINT headroom,
+    __in        UINT bufLen,
+    __out_opt   PVOID *ppPacket,
+    __out_opt   UINT *pPacketLen,
+    __inout_opt WINDIVERT_ADDRESS *pAddr);
+WINDIVERTEXPORT BOOL WinDivertHelperXlatEmbedAddress(
+    __in        const UINT32 *pPrefix,
+    __in        UINT prefixLen,
+    __in        UINT32 ipv4Addr,
+    __out       UINT32 *pIpv6Addr);
+WINDIVERTEXPORT BOOL WinDivertHelperXlatExtractAddress(
+    __in        const UINT32 *pPrefix,
+    __in        UINT prefixLen,
+    __in        const UINT32 *pIpv6Addr,
+    __out       UINT32 *pIpv4Addr);
+
+/*
+ * Prefix-preserving address anonymization.
+ */
+typedef struct WINDIVERT_ANON *PWINDIVERT_ANON;
+
+#define WINDIVERT_ANON_KEY_SIZE                             32
+#define WINDIVERT_ANON_FLAG_NO_AESNI                        0x0001
+
+WINDIVERTEXPORT PWINDIVERT_ANON WinDivertHelperAnonCreate(
+    __in        const UINT8 *pKey,
+    __in        UINT size,
+    __in        UINT64 flags);
+WINDIVERTEXPORT BOOL WinDivertHelperAnonAddress(
+    __in        PWINDIVERT_ANON anon,
+    __in        const UINT32 *pAddr,
+    __out       UINT32 *pAnonAddr,
+    __in        BOOL ipv6);
+WINDIVERTEXPORT BOOL WinDivertHelperAnonPacket(
+    __in        PWINDIVERT_ANON anon,
+    __inout_opt VOID *pPacket,
+    __in        UINT packetLen,
+    __in_opt    const WINDIVERT_ADDRESS *pAddr,
+    __in        UINT addrLen);
+WINDIVERTEXPORT BOOL WinDivertHelperAnonQuery(
+    __in        PWINDIVERT_ANON anon,
+    __out_opt   UINT64 *pAddresses,
+    __out_opt   UINT64 *pHits,
+    __out_opt   UINT64 *pBlocks);
+WINDIVERTEXPORT void WinDivertHelperAnonFree(
+    __in        PWINDIVERT_ANON anon);
+
 /*
  * Byte ordering.
  */
@@ -150,8 +150,20 @@
 #define WINDIVERT_FILTER_FIELD_RANDOM16             83
 #define WINDIVERT_FILTER_FIELD_RANDOM32             84
 #define WINDIVERT_FILTER_FIELD_FRAGMENT             85
+#define WINDIVERT_FILTER_FIELD_MARK                 86
+#define WINDIVERT_FILTER_FIELD_IPV6_HOPOPTS         87
+#define WINDIVERT_FILTER_FIELD_IPV6_ROUTING         88
+#define WINDIVERT_FILTER_FIELD_IPV6_FRAGHDR         89
+#define WINDIVERT_FILTER_FIELD_IPV6_DSTOPTS         90
+#define WINDIVERT_FILTER_FIELD_IPV6_AH              91
+#define WINDIVERT_FILTER_FIELD_IPV6_MH              92
+#define WINDIVERT_FILTER_FIELD_IPV6_ROUTINGTYPE     93
+#define WINDIVERT_FILTER_FIELD_IPV6_EXTHDRCOUNT     94
+#define WINDIVERT_FILTER_FIELD_IPV6_EXTHDRLENGTH    95
+#define WINDIVERT_FILTER_FIELD_PROCESSNAME          96
+#define WINDIVERT_FILTER_FIELD_PROCESSPATH          97
 #define WINDIVERT_FILTER_FIELD_MAX                  \
-    WINDIVERT_FILTER_FIELD_FRAGMENT
+    WINDIVERT_FILTER_FIELD_PROCESSPATH
 
 #define WINDIVERT_FILTER_TEST_EQ                    0
 #define WINDIVERT_FILTER_TEST_NEQ                   1
@@ -161,7 +173,7 @@
 #define WINDIVERT_FILTER_TEST_GEQ                   5
 #define WINDIVERT_FILTER_TEST_MAX                   WINDIVERT_FILTER_TEST_GEQ
 
-#define WINDIVERT_FILTER_MAXLEN                     256
+#define WINDIVERT_FILTER_MAXLEN                     4096
 
 #define WINDIVERT_FILTER_RESULT_ACCEPT              0x7FFE
 #define WINDIVERT_FILTER_RESULT_REJECT              0x7FFF
@@ -269,8 +281,27 @@ typedef union
         UINT64 val;                 // Value pointer.
         UINT32 param;               // WINDIVERT_PARAM_*
     } set_param;
+    struct
+    {
+        UINT32 process_id;          // Target process ID (or 0 for self).
+        UINT32 reserved;
+        INT64 timestamp;            // Target open timestamp.
+    } trace;
+    struct
+    {
+        UINT32 addr[4];             // Remote address (network order).
+        UINT16 port;                // Local port (network order).
+        UINT8 ipv6;                 // Address is IPv6?
+        UINT8 reserved;
+    } redirect_query;
 } WINDIVERT_IOCTL, *PWINDIVERT_IOCTL;
 
+/*
+ * The redirect_query member made WINDIVERT_IOCTL larger.  Other requests
+ * only use the first 16 bytes, which is all that older callers pass.
+ */
+#define WINDIVERT_IOCTL_MINLEN      16
+
 /*
  * WinDivert initialization structure.
  */
@@ -297,6 +328,7 @@ typedef struct
     UINT32 reserved:15;
     UINT32 arg[4];                  // Argument.
 } WINDIVERT_FILTER, *PWINDIVERT_FILTER;
+
 #pragma pack(pop)
 
 /*
@@ -321,5 +353,9 @@ typedef struct
 #define IOCTL_WINDIVERT_SHUTDOWN                                            \
     CTL_CODE(FILE_DEVICE_NETWORK, 0x927, METHOD_IN_DIRECT, FILE_READ_DATA | \
         FILE_WRITE_DATA)
+#define IOCTL_WINDIVERT_REDIRECT_QUERY                                      \
+    CTL_CODE(FILE_DEVICE_NETWORK, 0x928, METHOD_OUT_DIRECT, FILE_READ_DATA)
+#define IOCTL_WINDIVERT_TRACE                                               \
+    CTL_CODE(FILE_DEVICE_NETWORK, 0x929, METHOD_OUT_DIRECT, FILE_READ_DATA)
 
 #endif      /* __WINDIVERT_DEVICE_H */
@@ -114,6 +114,26 @@ do
         $CC -s -O2 -Iinclude/ examples/socketdump/socketdump.c \
             -o "install/MINGW/$CPU/socketdump.exe" -lWinDivert \
             -lpsapi -lshlwapi -L"install/MINGW/$CPU/"
+        echo "\tbuild install/MINGW/$CPU/maglev.exe..."
+        $CC -s -O2 -Iinclude/ examples/maglev/maglev.c \
+            -o "install/MINGW/$CPU/maglev.exe" -lWinDivert -lws2_32 \
+            -L"install/MINGW/$CPU/"
+        echo "\tbuild install/MINGW/$CPU/synguard.exe..."
+        $CC -s -O2 -Iinclude/ examples/synguard/synguard.c \
+            -o "install/MINGW/$CPU/synguard.exe" -lWinDivert -ladvapi32 \
+            -L"install/MINGW/$CPU/"
+        echo "\tbuild install/MINGW/$CPU/router.exe..."
+        $CC -s -O2 -Iinclude/ examples/router/router.c \
+            -o "install/MINGW/$CPU/router.exe" -lWinDivert \
+            -L"install/MINGW/$CPU/"
+        echo "\tbuild install/MINGW/$CPU/nat64.exe..."
+        $CC -s -O2 -Iinclude/ examples/nat64/nat64.c \
+            -o "install/MINGW/$CPU/nat64.exe" -lWinDivert \
+            -L"install/MINGW/$CPU/"
+        echo "\tbuild install/MINGW/$CPU/dnscache.exe..."
+        $CC -s -O2 -Iinclude/ examples/dnscache/dnscache.c \
+            -o "install/MINGW/$CPU/dnscache.exe" -lWinDivert \
+            -L"install/MINGW/$CPU/"
         echo "\tbuild install/MINGW/$CPU/test.exe..."
         $CC -s -O2 -Iinclude/ test/test.c \
             -o "install/MINGW/$CPU/test.exe" -lWinDivert \
@@ -68,6 +68,56 @@ msbuild examples\flowtrack\flowtrack.vcxproj ^
     /p:Platform=x64 ^
     /p:OutDir=..\..\install\MSVC\amd64\
 
+msbuild examples\maglev\maglev.vcxproj ^
+    /p:Configuration=Release ^
+    /p:Platform=Win32 ^
+    /p:OutDir=..\..\install\MSVC\i386\
+
+msbuild examples\maglev\maglev.vcxproj ^
+    /p:Configuration=Release ^
+    /p:Platform=x64 ^
+    /p:OutDir=..\..\install\MSVC\amd64\
+
+msbuild examples\synguard\synguard.vcxproj ^
+    /p:Configuration=Release ^
+    /p:Platform=Win32 ^
+    /p:OutDir=..\..\install\MSVC\i386\
+
+msbuild examples\synguard\synguard.vcxproj ^
+    /p:Configuration=Release ^
+    /p:Platform=x64 ^
+    /p:OutDir=..\..\install\MSVC\amd64\
+
+msbuild examples\router\router.vcxproj ^
+    /p:Configuration=Release ^
+    /p:Platform=Win32 ^
+    /p:OutDir=..\..\install\MSVC\i386\
+
+msbuild examples\router\router.vcxproj ^
+    /p:Configuration=Release ^
+    /p:Platform=x64 ^
+    /p:OutDir=..\..\install\MSVC\amd64\
+
+msbuild examples\nat64\nat64.vcxproj ^
+    /p:Configuration=Release ^
+    /p:Platform=Win32 ^
+    /p:OutDir=..\..\install\MSVC\i386\
+
+msbuild examples\nat64\nat64.vcxproj ^
+    /p:Configuration=Release ^
+    /p:Platform=x64 ^
+    /p:OutDir=..\..\install\MSVC\amd64\
+
+msbuild examples\dnscache\dnscache.vcxproj ^
+    /p:Configuration=Release ^
+    /p:Platform=Win32 ^
+    /p:OutDir=..\..\install\MSVC\i386\
+
+msbuild examples\dnscache\dnscache.vcxproj ^
+    /p:Configuration=Release ^
+    /p:Platform=x64 ^
+    /p:OutDir=..\..\install\MSVC\amd64\
+
 msbuild examples\netdump\netdump.vcxproj ^
     /p:Configuration=Release ^
     /p:Platform=Win32 ^
@@ -162,15 +162,16 @@ struct context_s
     const WINDIVERT_FILTER *filter;             // Packet filter.
     UINT16 filter_len;                          // Length of filter.
     UINT64 filter_flags;                        // Filter flags.
+    BOOL process_filter;                        // Filter uses process path?
     struct reflect_context_s reflect;           // Reflection info.
+    struct WINDIVERT_NAT *nat;                  // Redirect state (or NULL).
+    struct WINDIVERT_CPU *cpu;                  // CPU accounting.
+    struct WINDIVERT_TRACE *trace;              // Recent event trace.
+    UINT32 sequence;                            // Next packet sequence.
 };
 typedef struct context_s context_s;
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(context_s, windivert_context_get);
 
-#define WINDIVERT_TIMEOUT(context, t0, t1)                                  \
-     (((t1) >= (t0)? (t1) - (t0): (t0) - (t1)) >                            \
-        (context)->packet_queue_maxcounts)
-
 /*
  * WinDivert Layer information.
  */
@@ -249,6 +250,7 @@ struct packet_s
     PVOID object;                           // Object associated with packet.
     UINT32 priority;                        // Packet priority.
     UINT32 packet_len;                      // Length of the packet.
+    UINT32 sequence;                        // Packet sequence number.
     WINDIVERT_DATA_ALIGN UINT8 data[1];     // Packet/layer data.
 };
 typedef struct packet_s *packet_t;
@@ -280,6 +282,7 @@ struct flow_s
     BOOL loopback:1;                        // Flow is loopback?
     BOOL ipv6:1;                            // Flow is ipv6?
     WINDIVERT_DATA_FLOW data;               // Flow data.
+    struct WINDIVERT_PROCESS *process;      // Process path (or NULL).
 };
 typedef struct flow_s *flow_t;
 
@@ -322,6 +325,29 @@ static UINT32 windivert_context_priority(UINT32 priority)
     return priority;
 }
 
+/*
+ * Injection contexts.  The context carries the injecting handle's priority
+ * and, on 64-bit Windows, the packet's mark.
+ */
+static HANDLE windivert_inject_context(UINT32 priority, UINT32 mark)
+{
+#ifdef _WIN64
+    return (HANDLE)(((ULONG_PTR)mark << 32) | (ULONG_PTR)priority);
+#else
+    UNREFERENCED_PARAMETER(mark);
+    return (HANDLE)(ULONG_PTR)priority;
+#endif
+}
+static UINT32 windivert_inject_context_mark(HANDLE inject_context)
+{
+#ifdef _WIN64
+    return (UINT32)((ULONG_PTR)inject_context >> 32);
+#else
+    UNREFERENCED_PARAMETER(inject_context);
+    return 0;
+#endif
+}
+
 /*
  * Prototypes.
  */
@@ -331,6 +357,8 @@ extern VOID windivert_ioctl(IN WDFQUEUE queue, IN WDFREQUEST request,
 static NTSTATUS windivert_read(context_t context, WDFREQUEST request);
 extern VOID windivert_worker(IN WDFWORKITEM item);
 static void windivert_read_service(context_t context);
+static void windivert_read_service_request(context_t context, packet_t packet,
+    LONGLONG timestamp, WDFREQUEST request);
 extern VOID windivert_create(IN WDFDEVICE device, IN WDFREQUEST request,
     IN WDFFILEOBJECT object);
 static NTSTATUS windivert_install_provider(void);
@@ -452,11 +480,14 @@ static void windivert_auth_recv_accept_v6_classify(
     const FWPS_FILTER0 *filter, IN UINT64 flow_context,
     OUT FWPS_CLASSIFY_OUT0 *result);
 static void windivert_flow_established_classify(context_t context, 
-    IN UINT64 flow_id, IN PWINDIVERT_DATA_FLOW flow_data, IN BOOL ipv4,
-    IN BOOL outbound, IN BOOL loopback, OUT FWPS_CLASSIFY_OUT0 *result);
+    IN const FWPS_INCOMING_METADATA_VALUES0 *meta_vals, IN UINT64 flow_id,
+    IN PWINDIVERT_DATA_FLOW flow_data, IN BOOL ipv4, IN BOOL outbound,
+    IN BOOL loopback, OUT FWPS_CLASSIFY_OUT0 *result);
 static void windivert_flow_delete_notify(UINT16 layer_id, UINT32 callout_id,
     UINT64 flow_context);
+static void windivert_free_flow(flow_t flow);
 static void windivert_socket_classify(context_t context,
+    const FWPS_INCOMING_METADATA_VALUES0 *meta_vals,
     PWINDIVERT_DATA_SOCKET socket_data, WINDIVERT_EVENT event, BOOL ipv4,
     BOOL outbound, BOOL loopback, FWPS_CLASSIFY_OUT0 *result);
 static void windivert_network_classify(context_t context,
@@ -467,8 +498,10 @@ static BOOL windivert_queue_work(context_t context, PVOID packet,
     ULONG packet_len, PNET_BUFFER_LIST buffers, PVOID object,
     WINDIVERT_LAYER layer, PVOID layer_data, WINDIVERT_EVENT event,
     UINT64 flags, UINT32 priority, BOOL ipv4, BOOL outbound, BOOL loopback,
-    BOOL impostor, BOOL match, LONGLONG timestamp);
+    BOOL impostor, BOOL match, LONGLONG timestamp,
+    struct WINDIVERT_CPU_SAMPLE *sample);
 static void windivert_queue_packet(context_t context, packet_t packet);
+static UINT windivert_redirect(context_t context, packet_t packet);
 static NTSTATUS windivert_inject_packet(packet_t packet);
 static void windivert_free_packet(packet_t packet);
 static BOOL windivert_copy_data(PNET_BUFFER buffer, PVOID data, UINT size);
@@ -478,12 +511,19 @@ static BOOL windivert_parse_headers(PNET_BUFFER buffer, BOOL ipv4,
     BOOL *fragment_ptr, PWINDIVERT_IPHDR *ip_header_ptr,
     PWINDIVERT_IPV6HDR *ipv6_header_ptr, PWINDIVERT_ICMPHDR *icmp_header_ptr,
     PWINDIVERT_ICMPV6HDR *icmpv6_header_ptr, PWINDIVERT_TCPHDR *tcp_header_ptr,
-    PWINDIVERT_UDPHDR *udp_header_ptr, UINT8 *proto_ptr, UINT *header_len_ptr,
-    UINT *payload_len_ptr);
+    PWINDIVERT_UDPHDR *udp_header_ptr, struct WINDIVERT_IPV6EXT *ipv6_ext_ptr,
+    UINT8 *proto_ptr, UINT *header_len_ptr, UINT *payload_len_ptr);
 static BOOL windivert_filter(PNET_BUFFER buffer, WINDIVERT_LAYER layer,
     const VOID *layer_data, LONGLONG timestamp, WINDIVERT_EVENT event,
     BOOL ipv4, BOOL outbound, BOOL loopback, BOOL impostor, BOOL frag_mode,
-    const WINDIVERT_FILTER *filter);
+    const WINDIVERT_FILTER *filter, const struct WINDIVERT_PROCESS *process,
+    struct WINDIVERT_CPU_SAMPLE *sample);
+static BOOL windivert_filter_process(const WINDIVERT_FILTER *filter,
+    UINT filter_len);
+static struct WINDIVERT_PROCESS *windivert_process_get(
+    const FWPS_INCOMING_METADATA_VALUES0 *meta_vals);
+static VOID windivert_process_notify(HANDLE parent_id, HANDLE process_id,
+    BOOLEAN create);
 static const WINDIVERT_FILTER *windivert_filter_compile(
     const WINDIVERT_FILTER *ioctl_filter, size_t ioctl_filter_len,
     WINDIVERT_LAYER layer);
@@ -491,6 +531,9 @@ static NTSTATUS windivert_reflect_init(WDFOBJECT parent);
 static void windivert_reflect_close(void);
 static void windivert_reflect_open_event(context_t context);
 static void windivert_reflect_close_event(context_t context);
+static void windivert_reflect_cpu(context_t context);
+static UINT windivert_reflect_trace(UINT32 process_id, INT64 timestamp,
+    PWINDIVERT_TRACE_EVENT events, UINT max, NTSTATUS *status_ptr);
 static void windivert_reflect_event_notify(context_t context,
     LONGLONG timestamp, WINDIVERT_EVENT event);
 static void windivert_reflect_established_notify(context_t context,
@@ -927,6 +970,26 @@ static const struct layer_s windivert_layer_flow_established_ipv6 =
  * Shared functions.
  */
 #include "windivert_shared.c"
+#include "windivert_nat.c"
+#include "windivert_cpu.c"
+#include "windivert_trace.c"
+
+#define WINDIVERT_TRACE(context, timestamp, type, reason, value)            \
+    WinDivertTraceRecord((context)->trace, KeGetCurrentProcessorNumber(),   \
+        (timestamp), (type), (reason), (value))
+
+#include "windivert_queue.c"
+
+#define WINDIVERT_CPU_PHASE(sample, phase)                                  \
+    do                                                                      \
+    {                                                                       \
+        if ((sample) != NULL)                                               \
+        {                                                                   \
+            WinDivertCpuPhase((sample), (phase),                            \
+                KeQueryPerformanceCounter(NULL).QuadPart);                  \
+        }                                                                   \
+    }                                                                       \
+    while (FALSE)
 
 /*
  * WinDivert malloc/free.
@@ -948,6 +1011,18 @@ static VOID windivert_free(PVOID ptr)
     }
 }
 
+/*
+ * Process image path cache (for the processName/processPath fields).
+ */
+#define WINDIVERT_PIDCACHE_ALLOC(size)      windivert_malloc((size), FALSE)
+#define WINDIVERT_PIDCACHE_FREE(ptr)        windivert_free(ptr)
+
+#include "windivert_pidcache.c"
+
+static WINDIVERT_PIDCACHE pidcache;
+static KSPIN_LOCK pidcache_lock;
+static BOOL pidcache_enabled = FALSE;
+
 /*
  * WinDivert driver entry routine.
  */
@@ -1294,6 +1369,22 @@ driver_entry_sublayer_error:
         goto driver_entry_exit;
     }
 
+    // The process path cache can only be used if process exits are notified;
+    // otherwise paths are taken from the WFP metadata for every event.
+    KeInitializeSpinLock(&pidcache_lock);
+    WinDivertPidCacheInit(&pidcache);
+    status = PsSetCreateProcessNotifyRoutine(windivert_process_notify,
+        FALSE);
+    if (!NT_SUCCESS(status))
+    {
+        DEBUG_ERROR("failed to register process notify routine", status);
+        status = STATUS_SUCCESS;
+    }
+    else
+    {
+        pidcache_enabled = TRUE;
+    }
+
 driver_entry_exit:
 
     if (!NT_SUCCESS(status))
@@ -1323,6 +1414,13 @@ static void windivert_driver_unload(void)
 
     DEBUG("UNLOAD: unloading the WinDivert driver");
 
+    if (pidcache_enabled)
+    {
+        PsSetCreateProcessNotifyRoutine(windivert_process_notify, TRUE);
+        pidcache_enabled = FALSE;
+    }
+    WinDivertPidCacheFlush(&pidcache);
+
     if (inject_handle_forward != NULL)
     {
         FwpsInjectionHandleDestroy0(inject_handle_forward);
@@ -1502,6 +1600,10 @@ extern VOID windivert_create(IN WDFDEVICE device, IN WDFREQUEST request,
     context->filter = NULL;
     context->filter_len = 0;
     context->filter_flags = 0;
+    context->nat = NULL;
+    context->cpu = NULL;
+    context->trace = NULL;
+    context->sequence = 0;
     context->worker = NULL;
     context->process = NULL;
     for (i = 0; i < WINDIVERT_CONTEXT_MAXLAYERS; i++)
@@ -1557,6 +1659,24 @@ extern VOID windivert_create(IN WDFDEVICE device, IN WDFREQUEST request,
         goto windivert_create_exit;
     }
     RtlZeroMemory(&context->reflect, sizeof(context->reflect));
+    context->cpu = (PWINDIVERT_CPU)windivert_malloc(sizeof(WINDIVERT_CPU),
+        FALSE);
+    if (context->cpu == NULL)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        DEBUG_ERROR("failed to allocate CPU accounting", status);
+        goto windivert_create_exit;
+    }
+    RtlZeroMemory(context->cpu, sizeof(WINDIVERT_CPU));
+    context->trace = (PWINDIVERT_TRACE)windivert_malloc(
+        sizeof(WINDIVERT_TRACE), FALSE);
+    if (context->trace == NULL)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        DEBUG_ERROR("failed to allocate event trace", status);
+        goto windivert_create_exit;
+    }
+    RtlZeroMemory(context->trace, sizeof(WINDIVERT_TRACE));
     irp = WdfRequestWdmGetIrp(request);
     context->process = IoGetRequestorProcess(irp);
     if (context->process == NULL)
@@ -1581,7 +1701,7 @@ windivert_create_exit:
         {
             WdfObjectDelete(context->worker);
         }
-        // process/engine_handle handled by windivert_destroy()
+        // process/engine_handle/cpu/trace handled by windivert_destroy()
     }
 
     WdfRequestComplete(request, status);
@@ -1991,7 +2111,7 @@ windivert_cleanup_error:
             flow->callout_id);
         if (!NT_SUCCESS(status))
         {
-            windivert_free(flow);
+            windivert_free_flow(flow);
         }
         KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
     }
@@ -2086,6 +2206,7 @@ extern VOID windivert_destroy(IN WDFOBJECT object)
     KLOCK_QUEUE_HANDLE lock_handle;
     context_t context = windivert_context_get((WDFFILEOBJECT)object);
     const WINDIVERT_FILTER *filter;
+    PWINDIVERT_NAT nat;
     NTSTATUS status;
 
     DEBUG("DESTROY: destroying WinDivert context (context=%p)", context);
@@ -2099,6 +2220,8 @@ extern VOID windivert_destroy(IN WDFOBJECT object)
         return;
     }
     filter = context->filter;
+    nat = context->nat;
+    context->nat = NULL;
     KeReleaseInStackQueuedSpinLock(&lock_handle);
     windivert_uninstall_callouts(context, WINDIVERT_CONTEXT_STATE_CLOSED);
     if (context->engine_handle != NULL)
@@ -2106,73 +2229,36 @@ extern VOID windivert_destroy(IN WDFOBJECT object)
         FwpmEngineClose0(context->engine_handle);
     }
     windivert_free((PVOID)filter);
+    windivert_free((PVOID)nat);
+    windivert_free((PVOID)context->cpu);
+    windivert_free((PVOID)context->trace);
     if (context->process != NULL)
     {
         ObDereferenceObject(context->process);
     }
 }
 
-/*
- * WinDivert read routine.
- */
-static NTSTATUS windivert_read(context_t context, WDFREQUEST request)
-{
-    KLOCK_QUEUE_HANDLE lock_handle;
-    NTSTATUS status = STATUS_SUCCESS;
-
-    DEBUG("READ: reading diverted packet (context=%p, request=%p)", context,
-        request);
-
-    // Forward the request to the pending read queue:
-    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
-    if (context->state != WINDIVERT_CONTEXT_STATE_OPEN)
-    {
-        KeReleaseInStackQueuedSpinLock(&lock_handle);
-        return STATUS_INVALID_DEVICE_STATE;
-    }
-    if ((context->flags & WINDIVERT_FLAG_SEND_ONLY) != 0)
-    {
-        KeReleaseInStackQueuedSpinLock(&lock_handle);
-        status = STATUS_INVALID_PARAMETER;
-        DEBUG_ERROR("failed to inject; send-only flag is set", status);
-        return status;
-    }
-    status = WdfRequestForwardToIoQueue(request, context->read_queue);
-    KeReleaseInStackQueuedSpinLock(&lock_handle);
-    if (!NT_SUCCESS(status))
-    {
-        DEBUG_ERROR("failed to forward I/O request to read queue", status);
-        return status;
-    }
-
-    // Service the read request:
-    windivert_read_service(context);
-
-    return STATUS_SUCCESS;
-}
-
 /*
  * WinDivert service a single read request.
  */
 static void windivert_read_service_request(context_t context, packet_t packet,
     LONGLONG timestamp, WDFREQUEST request)
 {
-    KLOCK_QUEUE_HANDLE lock_handle;
-    PLIST_ENTRY entry;
     PMDL dst_mdl;
     UINT8 *layer_data, *src, *dst;
     ULONG dst_len, src_len, read_len = 0;
-    BOOL timeout;
     packet_t new_packet;
     req_context_t req_context;
     PWINDIVERT_ADDRESS addr;
-    UINT i, addr_len, addr_len_max;
+    UINT i = 0, addr_len, addr_len_max;
     UINT *addr_len_ptr;
     NTSTATUS status;
 
     if (request == NULL)
     {
         // This occurs if the packet timed out.
+        WINDIVERT_TRACE(context, timestamp, WINDIVERT_TRACE_DROP,
+            WINDIVERT_TRACE_DROP_TIMEOUT, packet->packet_len);
         windivert_free_packet(packet);
         return;
     }
@@ -2277,7 +2363,7 @@ static void windivert_read_service_request(context_t context, packet_t packet,
             addr[i].TCPChecksum = packet->tcp_checksum;
             addr[i].UDPChecksum = packet->udp_checksum;
             addr[i].Reserved1   = 0;
-            addr[i].Reserved2   = 0;
+            addr[i].Sequence    = packet->sequence;
             layer_data = (PVOID)packet->data;
             switch (packet->layer)
             {
@@ -2317,28 +2403,7 @@ static void windivert_read_service_request(context_t context, packet_t packet,
         }
 
         // Attempt to fill the buffer with more packets:
-        new_packet = NULL;
-        KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
-        if (context->state == WINDIVERT_CONTEXT_STATE_OPEN &&
-                !IsListEmpty(&context->packet_queue))
-        {
-            entry = RemoveHeadList(&context->packet_queue);
-            new_packet = CONTAINING_RECORD(entry, struct packet_s, entry);
-            timeout = WINDIVERT_TIMEOUT(context, new_packet->timestamp,
-                timestamp);
-            if (new_packet->packet_len > dst_len || timeout)
-            {
-                // Note: timeouts to be handled elsewhere.
-                InsertHeadList(&context->packet_queue, entry);
-                new_packet = NULL;
-            }
-            else
-            {
-                context->packet_queue_length--;
-                context->packet_queue_size -= new_packet->packet_size;
-            }
-        }
-        KeReleaseInStackQueuedSpinLock(&lock_handle);
+        new_packet = windivert_read_service_next(context, dst_len, timestamp);
         if (new_packet == NULL)
         {
             // No suitable packet:
@@ -2356,6 +2421,8 @@ static void windivert_read_service_request(context_t context, packet_t packet,
 
 windivert_read_service_request_exit:
 
+    WINDIVERT_TRACE(context, timestamp, WINDIVERT_TRACE_READ, (UINT8)i,
+        read_len);
     windivert_free_packet(packet);
     WdfRequestCompleteWithInformation(request, status, read_len);
 }
@@ -2366,7 +2433,8 @@ windivert_read_service_request_exit:
 static void windivert_fast_read_service_request(PVOID packet, ULONG packet_len,
     PNET_BUFFER_LIST buffers, WINDIVERT_LAYER layer, PVOID layer_data,
     WINDIVERT_EVENT event, UINT64 flags, BOOL ipv4, BOOL outbound,
-    BOOL loopback, BOOL impostor, LONGLONG timestamp, WDFREQUEST request)
+    BOOL loopback, BOOL impostor, LONGLONG timestamp, UINT32 sequence,
+    WDFREQUEST request)
 {
     PNET_BUFFER buffer;
     PMDL dst_mdl;
@@ -2481,7 +2549,7 @@ static void windivert_fast_read_service_request(PVOID packet, ULONG packet_len,
         addr->TCPChecksum = (tcp_checksum? 1: 0);
         addr->UDPChecksum = (udp_checksum? 1: 0);
         addr->Reserved1   = 0;
-        addr->Reserved2   = 0;
+        addr->Sequence    = sequence;
         switch (layer)
         {
             case WINDIVERT_LAYER_NETWORK:
@@ -2519,70 +2587,6 @@ windivert_fast_read_service_request_exit:
     WdfRequestCompleteWithInformation(request, status, read_len);
 }
 
-/*
- * WinDivert read request service.
- */
-static void windivert_read_service(context_t context)
-{
-    KLOCK_QUEUE_HANDLE lock_handle;
-    WDFREQUEST request;
-    PLIST_ENTRY entry;
-    LONGLONG timestamp;
-    BOOL timeout;
-    NTSTATUS status;
-    packet_t packet;
-
-    timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
-    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
-    while (context->state == WINDIVERT_CONTEXT_STATE_OPEN &&
-           !IsListEmpty(&context->packet_queue))
-    {
-        entry = RemoveHeadList(&context->packet_queue);
-        packet = CONTAINING_RECORD(entry, struct packet_s, entry);
-        timeout = WINDIVERT_TIMEOUT(context, packet->timestamp, timestamp);
-        request = NULL;
-        if (!timeout)
-        {
-            status = WdfIoQueueRetrieveNextRequest(context->read_queue,
-                &request);
-            if (!NT_SUCCESS(status))
-            {
-                InsertHeadList(&context->packet_queue, entry);
-                break;
-            }
-        }
-        context->packet_queue_length--;
-        context->packet_queue_size -= packet->packet_size;
-        KeReleaseInStackQueuedSpinLock(&lock_handle);
-
-        windivert_read_service_request(context, packet, timestamp, request);
-
-        timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
-        KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
-    }
-
-    if (context->shutdown_recv && context->shutdown_recv_enabled &&
-            IsListEmpty(&context->packet_queue) &&
-            IsListEmpty(&context->work_queue))
-    {
-        // The handle has shutdown, the queue is empty, and no more packets
-        // will be queued.  Notify any remaining requests.
-        while (context->state == WINDIVERT_CONTEXT_STATE_OPEN)
-        {
-            status = WdfIoQueueRetrieveNextRequest(context->read_queue,
-                &request);
-            if (!NT_SUCCESS(status))
-            {
-                break;
-            }
-            KeReleaseInStackQueuedSpinLock(&lock_handle);
-            WdfRequestComplete(request, STATUS_PIPE_EMPTY);
-            KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
-        }
-    }
-    KeReleaseInStackQueuedSpinLock(&lock_handle);
-}
-
 /*
  * WinDivert write routine.
  */
@@ -2603,7 +2607,7 @@ static NTSTATUS windivert_write(context_t context, WDFREQUEST request,
     HANDLE handle;
     PNET_BUFFER_LIST buffers = NULL;
     PWINDIVERT_ADDRESS addr;
-    UINT i, addr_len, addr_len_max, version;
+    UINT i = 0, addr_len, addr_len_max, version;
     NTSTATUS status = STATUS_SUCCESS, status_soft_error = STATUS_SUCCESS;
 
     DEBUG("WRITE: writing/injecting a packet (context=%p, request=%p)",
@@ -2741,7 +2745,8 @@ windivert_write_invalid_packet:
         packet->object        = NULL;
         network_data =
             (PWINDIVERT_DATA_NETWORK)WINDIVERT_LAYER_DATA_PTR(packet);
-        RtlCopyMemory(network_data, &addr[i].Network, sizeof(network_data));
+        RtlCopyMemory(network_data, &addr[i].Network,
+            sizeof(WINDIVERT_DATA_NETWORK));
         data_copy = WINDIVERT_PACKET_DATA_PTR(WINDIVERT_DATA_NETWORK, packet);
         RtlCopyMemory(data_copy, data, packet_len);
         switch (version)
@@ -2790,12 +2795,16 @@ windivert_write_invalid_packet:
 
     // Note: status_soft_error is for "soft" errors that do not prevent other
     //       batched packets from being injected.
+    WINDIVERT_TRACE(context, KeQueryPerformanceCounter(NULL).QuadPart,
+        WINDIVERT_TRACE_INJECT, (UINT8)i, (UINT32)status_soft_error);
     WdfRequestCompleteWithInformation(request, status_soft_error, inject_len);
     return STATUS_SUCCESS;
 
 windivert_write_hard_error:
 
     // Request to be completed in windivert_ioctl()
+    WINDIVERT_TRACE(context, KeQueryPerformanceCounter(NULL).QuadPart,
+        WINDIVERT_TRACE_INJECT, (UINT8)i, (UINT32)status);
     return status;
 }
 
@@ -2832,7 +2841,7 @@ VOID windivert_caller_context(IN WDFDEVICE device, IN WDFREQUEST request)
         DEBUG_ERROR("failed to retrieve input buffer", status);
         goto windivert_caller_context_error;
     }
-    if (inbuflen < sizeof(WINDIVERT_IOCTL))
+    if (inbuflen < WINDIVERT_IOCTL_MINLEN)
     {
         status = STATUS_INVALID_PARAMETER;
         DEBUG_ERROR("input buffer not an ioctl message header", status);
@@ -2927,6 +2936,8 @@ VOID windivert_caller_context(IN WDFDEVICE device, IN WDFREQUEST request)
         case IOCTL_WINDIVERT_SHUTDOWN:
         case IOCTL_WINDIVERT_SET_PARAM:
         case IOCTL_WINDIVERT_GET_PARAM:
+        case IOCTL_WINDIVERT_REDIRECT_QUERY:
+        case IOCTL_WINDIVERT_TRACE:
             break;
         
         default:
@@ -2984,6 +2995,8 @@ extern VOID windivert_ioctl(IN WDFQUEUE queue, IN WDFREQUEST request,
         case IOCTL_WINDIVERT_SHUTDOWN:
         case IOCTL_WINDIVERT_SET_PARAM:
         case IOCTL_WINDIVERT_GET_PARAM:
+        case IOCTL_WINDIVERT_REDIRECT_QUERY:
+        case IOCTL_WINDIVERT_TRACE:
             status = WdfRequestRetrieveInputBuffer(request, 0, &inbuf,
                 &inbuflen);
             if (!NT_SUCCESS(status))
@@ -2991,7 +3004,8 @@ extern VOID windivert_ioctl(IN WDFQUEUE queue, IN WDFREQUEST request,
                 DEBUG_ERROR("failed to retrieve input buffer", status);
                 goto windivert_ioctl_exit;
             }
-            if (inbuflen < sizeof(WINDIVERT_IOCTL))
+            if (inbuflen < (code == IOCTL_WINDIVERT_REDIRECT_QUERY?
+                    sizeof(WINDIVERT_IOCTL): WINDIVERT_IOCTL_MINLEN))
             {
                 status = STATUS_INVALID_PARAMETER;
                 DEBUG_ERROR("input buffer too small", status);
@@ -3008,6 +3022,8 @@ extern VOID windivert_ioctl(IN WDFQUEUE queue, IN WDFREQUEST request,
         case IOCTL_WINDIVERT_INITIALIZE:
         case IOCTL_WINDIVERT_STARTUP:
         case IOCTL_WINDIVERT_GET_PARAM:
+        case IOCTL_WINDIVERT_REDIRECT_QUERY:
+        case IOCTL_WINDIVERT_TRACE:
             status = WdfRequestRetrieveOutputBuffer(request, 0, &outbuf,
                 &outbuflen);
             if (!NT_SUCCESS(status))
@@ -3152,7 +3168,8 @@ windivert_ioctl_bad_flags:
             UINT64 filter_flags;
             UINT32 process_id;
             WINDIVERT_LAYER layer;
-            UINT8 filter_len;
+            UINT16 filter_len;
+            BOOL process_filter;
             WDFDEVICE device;
 
             ioctl = (PWINDIVERT_IOCTL)inbuf;
@@ -3187,7 +3204,8 @@ windivert_ioctl_bad_flags:
                 DEBUG_ERROR("failed to compile filter", status);
                 goto windivert_ioctl_exit;
             }
-            filter_len = (UINT8)(ioctl_filter_len / sizeof(WINDIVERT_FILTER));
+            filter_len = (UINT16)(ioctl_filter_len / sizeof(WINDIVERT_FILTER));
+            process_filter = windivert_filter_process(filter, filter_len);
             process_id = (UINT32)(ULONG_PTR)PsGetProcessId(process);
             timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
 
@@ -3202,6 +3220,7 @@ windivert_ioctl_bad_flags:
             context->filter                 = filter;
             context->filter_len             = filter_len;
             context->filter_flags           = filter_flags;
+            context->process_filter         = process_filter;
             context->reflect.data.Timestamp = timestamp;
             context->reflect.data.ProcessId = process_id;
             context->reflect.data.Layer     = context->layer;
@@ -3266,10 +3285,25 @@ windivert_ioctl_bad_flags:
         {
             WINDIVERT_PARAM param;
             UINT64 value;
+            PWINDIVERT_NAT nat = NULL;
+            PWINDIVERT_NAT_ENTRY entries;
 
             ioctl = (PWINDIVERT_IOCTL)inbuf;
             param = (WINDIVERT_PARAM)ioctl->set_param.param;
             value = ioctl->set_param.val;
+            if (param == WINDIVERT_PARAM_REDIRECT_PORT && value != 0)
+            {
+                nat = (PWINDIVERT_NAT)windivert_malloc(
+                    WINDIVERT_DATA_SIZE(sizeof(WINDIVERT_NAT)) +
+                    WINDIVERT_NAT_SIZE_DEFAULT * sizeof(WINDIVERT_NAT_ENTRY),
+                    FALSE);
+                if (nat == NULL)
+                {
+                    status = STATUS_INSUFFICIENT_RESOURCES;
+                    DEBUG_ERROR("failed to allocate redirect table", status);
+                    goto windivert_ioctl_exit;
+                }
+            }
             KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
             if (context->state != WINDIVERT_CONTEXT_STATE_OPEN)
             {
@@ -3320,6 +3354,39 @@ windivert_ioctl_bad_flags:
                     context->packet_queue_maxsize = (ULONG)value;
                     break;
 
+                case WINDIVERT_PARAM_REDIRECT_PORT:
+                    if (value > WINDIVERT_PARAM_REDIRECT_PORT_MAX ||
+                        context->layer != WINDIVERT_LAYER_NETWORK)
+                    {
+                        KeReleaseInStackQueuedSpinLock(&lock_handle);
+                        status = STATUS_INVALID_PARAMETER;
+                        DEBUG_ERROR("failed to set redirect port; invalid "
+                            "value or layer", status);
+                        goto windivert_ioctl_exit;
+                    }
+                    if (value == 0)
+                    {
+                        // Detach the table; freed below.
+                        nat = context->nat;
+                        context->nat = NULL;
+                    }
+                    else if (context->nat == NULL)
+                    {
+                        entries = (PWINDIVERT_NAT_ENTRY)((UINT8 *)nat +
+                            WINDIVERT_DATA_SIZE(sizeof(WINDIVERT_NAT)));
+                        WinDivertNatInit(nat, entries,
+                            WINDIVERT_NAT_SIZE_DEFAULT,
+                            RtlUshortByteSwap((UINT16)value));
+                        context->nat = nat;
+                        nat = NULL;
+                    }
+                    else
+                    {
+                        context->nat->proxy_port =
+                            RtlUshortByteSwap((UINT16)value);
+                    }
+                    break;
+
                 default:
                     KeReleaseInStackQueuedSpinLock(&lock_handle);
                     status = STATUS_INVALID_PARAMETER;
@@ -3328,12 +3395,14 @@ windivert_ioctl_bad_flags:
                     goto windivert_ioctl_exit;
             }
             KeReleaseInStackQueuedSpinLock(&lock_handle);
+            windivert_free((PVOID)nat);
             break;
         }
 
         case IOCTL_WINDIVERT_GET_PARAM:
         {
             WINDIVERT_PARAM param;
+            UINT64 events, cpu_time[WINDIVERT_CPU_MAX];
 
             ioctl = (PWINDIVERT_IOCTL)inbuf;
             param = (WINDIVERT_PARAM)ioctl->get_param.param;
@@ -3369,6 +3438,22 @@ windivert_ioctl_bad_flags:
                 case WINDIVERT_PARAM_VERSION_MINOR:
                     *valptr = WINDIVERT_VERSION_MINOR;
                     break;
+                case WINDIVERT_PARAM_REDIRECT_PORT:
+                    *valptr = (context->nat == NULL? 0:
+                        RtlUshortByteSwap(context->nat->proxy_port));
+                    break;
+                case WINDIVERT_PARAM_CPU_EVENTS:
+                case WINDIVERT_PARAM_CPU_PARSE:
+                case WINDIVERT_PARAM_CPU_FILTER:
+                case WINDIVERT_PARAM_CPU_QUEUE:
+                case WINDIVERT_PARAM_CPU_COPY:
+                    WinDivertCpuQuery(context->cpu, &events, cpu_time);
+                    *valptr = (param == WINDIVERT_PARAM_CPU_EVENTS? events:
+                        cpu_time[param - WINDIVERT_PARAM_CPU_PARSE]);
+                    break;
+                case WINDIVERT_PARAM_SEQUENCE:
+                    *valptr = context->sequence;
+                    break;
                 default:
                     KeReleaseInStackQueuedSpinLock(&lock_handle);
                     status = STATUS_INVALID_PARAMETER;
@@ -3380,6 +3465,89 @@ windivert_ioctl_bad_flags:
             break;
         }
 
+        case IOCTL_WINDIVERT_REDIRECT_QUERY:
+        {
+            LARGE_INTEGER timestamp;
+            UINT64 now;
+            UINT16 orig_port;
+            BOOL found;
+
+            ioctl = (PWINDIVERT_IOCTL)inbuf;
+            if (outbuflen != sizeof(UINT16))
+            {
+                status = STATUS_INVALID_PARAMETER;
+                DEBUG_ERROR("failed to query redirect; invalid output "
+                    "buffer size", status);
+                goto windivert_ioctl_exit;
+            }
+            timestamp = KeQueryPerformanceCounter(NULL);
+            now = (UINT64)timestamp.QuadPart / (UINT64)counts_per_ms;
+            KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+            if (context->state != WINDIVERT_CONTEXT_STATE_OPEN ||
+                context->nat == NULL)
+            {
+                KeReleaseInStackQueuedSpinLock(&lock_handle);
+                status = STATUS_INVALID_DEVICE_STATE;
+                goto windivert_ioctl_exit;
+            }
+            found = WinDivertNatQuery(context->nat,
+                (BOOL)ioctl->redirect_query.ipv6, ioctl->redirect_query.addr,
+                ioctl->redirect_query.port, now, &orig_port);
+            KeReleaseInStackQueuedSpinLock(&lock_handle);
+            if (!found)
+            {
+                status = STATUS_NOT_FOUND;
+                goto windivert_ioctl_exit;
+            }
+            *(UINT16 *)outbuf = orig_port;
+            WdfRequestSetInformation(request, sizeof(UINT16));
+            break;
+        }
+
+        case IOCTL_WINDIVERT_TRACE:
+        {
+            WINDIVERT_LAYER layer;
+            UINT count;
+
+            ioctl = (PWINDIVERT_IOCTL)inbuf;
+            KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+            if (context->state != WINDIVERT_CONTEXT_STATE_OPEN)
+            {
+                KeReleaseInStackQueuedSpinLock(&lock_handle);
+                status = STATUS_INVALID_DEVICE_STATE;
+                goto windivert_ioctl_exit;
+            }
+            layer = context->layer;
+            KeReleaseInStackQueuedSpinLock(&lock_handle);
+            if (ioctl->trace.process_id == 0 && ioctl->trace.timestamp == 0)
+            {
+                count = WinDivertTraceSnapshot(context->trace,
+                    (PWINDIVERT_TRACE_EVENT)outbuf,
+                    (UINT)(outbuflen / sizeof(WINDIVERT_TRACE_EVENT)));
+            }
+            else if (layer == WINDIVERT_LAYER_REFLECT)
+            {
+                count = windivert_reflect_trace(ioctl->trace.process_id,
+                    ioctl->trace.timestamp, (PWINDIVERT_TRACE_EVENT)outbuf,
+                    (UINT)(outbuflen / sizeof(WINDIVERT_TRACE_EVENT)),
+                    &status);
+                if (!NT_SUCCESS(status))
+                {
+                    goto windivert_ioctl_exit;
+                }
+            }
+            else
+            {
+                status = STATUS_INVALID_PARAMETER;
+                DEBUG_ERROR("failed to query trace; not a REFLECT handle",
+                    status);
+                goto windivert_ioctl_exit;
+            }
+            WdfRequestSetInformation(request,
+                count * sizeof(WINDIVERT_TRACE_EVENT));
+            break;
+        }
+
         default:
             status = STATUS_INVALID_DEVICE_REQUEST;
             DEBUG_ERROR("failed to complete I/O control; invalid request",
@@ -3722,9 +3890,12 @@ static void windivert_network_classify(context_t context,
     WDFOBJECT object;
     const WINDIVERT_FILTER *filter;
     LONGLONG timestamp;
+    WINDIVERT_CPU_SAMPLE sample_data;
+    PWINDIVERT_CPU_SAMPLE sample;
     NTSTATUS status;
 
     result->actionType = FWP_ACTION_CONTINUE;
+    network_data->Mark = 0;
     buffers = (PNET_BUFFER_LIST)data;
     buffer = NET_BUFFER_LIST_FIRST_NB(buffers);
     if (NET_BUFFER_LIST_NEXT_NBL(buffers) != NULL)
@@ -3795,6 +3966,7 @@ static void windivert_network_classify(context_t context,
             WdfObjectDereference(object);
             return;
         }
+        network_data->Mark = windivert_inject_context_mark(packet_context);
     }
     else if (packet_state == FWPS_PACKET_INJECTED_BY_OTHER)
     {
@@ -3806,6 +3978,8 @@ static void windivert_network_classify(context_t context,
 
     // Get the timestamp.
     timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+    sample = WinDivertCpuSample(context->cpu, KeGetCurrentProcessorNumber(),
+        timestamp, &sample_data);
 
     // Filter fragments or reassembled packets.
     frag_mode =
@@ -3846,7 +4020,8 @@ static void windivert_network_classify(context_t context,
     {
         BOOL match = windivert_filter(buffer_fst, layer, (PVOID)network_data,
             timestamp, /*event=*/WINDIVERT_EVENT_NETWORK_PACKET, ipv4,
-            outbound, loopback, impostor, frag_mode, filter);
+            outbound, loopback, impostor, frag_mode, filter,
+            /*process=*/NULL, sample);
         if (match)
         {
             break;
@@ -3878,7 +4053,7 @@ static void windivert_network_classify(context_t context,
             NET_BUFFER_DATA_LENGTH(buffer_itr), buffers, /*object=*/NULL, layer,
             (PVOID)network_data, /*event=*/WINDIVERT_EVENT_NETWORK_PACKET,
             flags, priority, ipv4, outbound, loopback, impostor,
-            /*match=*/FALSE, timestamp);
+            /*match=*/FALSE, timestamp, sample);
         if (!ok)
         {
             goto windivert_network_classify_exit;
@@ -3891,7 +4066,7 @@ static void windivert_network_classify(context_t context,
         NET_BUFFER_DATA_LENGTH(buffer_itr), buffers, /*object=*/NULL, layer,
         (PVOID)network_data, /*event=*/WINDIVERT_EVENT_NETWORK_PACKET,
         flags, priority, ipv4, outbound, loopback, impostor, /*match=*/TRUE,
-        timestamp);
+        timestamp, sample);
     if (advance != 0)
     {
         // Advance the NET_BUFFER to its original position.  Note that we can
@@ -3911,12 +4086,13 @@ static void windivert_network_classify(context_t context,
     {
         BOOL match = windivert_filter(buffer_itr, layer, (PVOID)network_data,
             timestamp, /*event=*/WINDIVERT_EVENT_NETWORK_PACKET, ipv4,
-            outbound, loopback, impostor, frag_mode, filter);
+            outbound, loopback, impostor, frag_mode, filter,
+            /*process=*/NULL, sample);
         ok = windivert_queue_work(context, (PVOID)buffer_itr,
             NET_BUFFER_DATA_LENGTH(buffer_itr), buffers, /*object=*/NULL, layer,
             (PVOID)network_data, /*event=*/WINDIVERT_EVENT_NETWORK_PACKET,
             flags, priority, ipv4, outbound, loopback, impostor, match,
-            timestamp);
+            timestamp, sample);
         if (!ok)
         {
             goto windivert_network_classify_exit;
@@ -3976,8 +4152,8 @@ static void windivert_flow_established_v4_classify(
         FWP_CONDITION_FLAG_IS_LOOPBACK) != 0);
     flow_id = meta_vals->flowHandle;
 
-    windivert_flow_established_classify(context, flow_id, &flow_data,
-        /*ipv4=*/TRUE, outbound, loopback, result);
+    windivert_flow_established_classify(context, meta_vals, flow_id,
+        &flow_data, /*ipv4=*/TRUE, outbound, loopback, result);
 }
 
 /*
@@ -4021,25 +4197,29 @@ static void windivert_flow_established_v6_classify(
         FWP_CONDITION_FLAG_IS_LOOPBACK) != 0);
     flow_id = meta_vals->flowHandle;
     
-    windivert_flow_established_classify(context, flow_id, &flow_data,
-        /*ipv4=*/FALSE, outbound, loopback, result);
+    windivert_flow_established_classify(context, meta_vals, flow_id,
+        &flow_data, /*ipv4=*/FALSE, outbound, loopback, result);
 }
 
 /*
  * WinDivert flow established classify function.
  */
 static void windivert_flow_established_classify(context_t context,
-    IN UINT64 flow_id, IN PWINDIVERT_DATA_FLOW flow_data, IN BOOL ipv4,
-    IN BOOL outbound, IN BOOL loopback, OUT FWPS_CLASSIFY_OUT0 *result)
+    IN const FWPS_INCOMING_METADATA_VALUES0 *meta_vals, IN UINT64 flow_id,
+    IN PWINDIVERT_DATA_FLOW flow_data, IN BOOL ipv4, IN BOOL outbound,
+    IN BOOL loopback, OUT FWPS_CLASSIFY_OUT0 *result)
 {
     KLOCK_QUEUE_HANDLE lock_handle;
     UINT64 flags, filter_flags;
     UINT32 callout_id;
     UINT16 layer_id;
-    BOOL match, ok;
+    BOOL match, ok, process_filter;
     WDFOBJECT object;
     const WINDIVERT_FILTER *filter;
+    PWINDIVERT_PROCESS process;
     LONGLONG timestamp;
+    WINDIVERT_CPU_SAMPLE sample_data;
+    PWINDIVERT_CPU_SAMPLE sample;
     flow_t flow;
     NTSTATUS status;
 
@@ -4064,6 +4244,7 @@ static void windivert_flow_established_classify(context_t context,
     filter = context->filter;
     flags = context->flags;
     filter_flags = context->filter_flags;
+    process_filter = context->process_filter;
     callout_id = (ipv4? context->flow_v4_callout_id:
         context->flow_v6_callout_id);
     object = (WDFOBJECT)context->object;
@@ -4074,19 +4255,23 @@ static void windivert_flow_established_classify(context_t context,
     WdfObjectReference(object);
     KeReleaseInStackQueuedSpinLock(&lock_handle);
 
+    sample = WinDivertCpuSample(context->cpu, KeGetCurrentProcessorNumber(),
+        timestamp, &sample_data);
+    process = (process_filter? windivert_process_get(meta_vals): NULL);
     match = windivert_filter(/*buffer=*/NULL, /*layer=*/WINDIVERT_LAYER_FLOW,
         (PVOID)flow_data, timestamp,
         /*event=*/WINDIVERT_EVENT_FLOW_ESTABLISHED, ipv4, outbound, loopback,
-        /*impostor=*/FALSE, /*frag_mode=*/FALSE, filter);
+        /*impostor=*/FALSE, /*frag_mode=*/FALSE, filter, process, sample);
     if (match)
     {
         ok = windivert_queue_work(context, /*packet=*/NULL, /*packet_len=*/0,
             /*buffers=*/NULL, /*object=*/NULL, /*layer=*/WINDIVERT_LAYER_FLOW,
             (PVOID)flow_data, /*event=*/WINDIVERT_EVENT_FLOW_ESTABLISHED,
             flags, /*priority=*/0, ipv4, outbound, loopback, /*impostor=*/FALSE,
-            match, timestamp);
+            match, timestamp, sample);
         if (!ok)
         {
+            WinDivertProcessRelease(process);
             WdfObjectDereference(object);
             return;
         }
@@ -4097,12 +4282,14 @@ static void windivert_flow_established_classify(context_t context,
     if ((filter_flags & WINDIVERT_FILTER_FLAG_EVENT_FLOW_DELETED) == 0)
     {
         // We don't care about FLOW_DELETED.
+        WinDivertProcessRelease(process);
         WdfObjectDereference(object);
         return;
     }
     flow = windivert_malloc(sizeof(struct flow_s), FALSE);
     if (flow == NULL)
     {
+        WinDivertProcessRelease(process);
         WdfObjectDereference(object);
         return;
     }
@@ -4118,12 +4305,13 @@ static void windivert_flow_established_classify(context_t context,
     flow->loopback = loopback;
     flow->ipv6 = !ipv4;
     RtlCopyMemory(&flow->data, flow_data, sizeof(flow->data));
+    flow->process = process;        // Reference released with the flow.
 
     status = FwpsFlowAssociateContext0(flow_id, layer_id, callout_id,
         (UINT64)flow);
     if (!NT_SUCCESS(status))
     {
-        windivert_free(flow);
+        windivert_free_flow(flow);
         WdfObjectDereference(object);
         return;
     }
@@ -4133,7 +4321,7 @@ static void windivert_flow_established_classify(context_t context,
         context->shutdown_recv)
     {
         KeReleaseInStackQueuedSpinLock(&lock_handle);
-        windivert_free(flow);
+        windivert_free_flow(flow);
         WdfObjectDereference(object);
         return;
     }
@@ -4146,7 +4334,7 @@ static void windivert_flow_established_classify(context_t context,
     {
         // Flow was deleted before insertion; we are responsible for cleanup.
         KeReleaseInStackQueuedSpinLock(&lock_handle);
-        windivert_free(flow);
+        windivert_free_flow(flow);
         WdfObjectDereference(object);
         return;
     }
@@ -4166,6 +4354,8 @@ static void windivert_flow_delete_notify(UINT16 layer_id, UINT32 callout_id,
     context_t context;
     const WINDIVERT_FILTER *filter;
     LONGLONG timestamp;
+    WINDIVERT_CPU_SAMPLE sample_data;
+    PWINDIVERT_CPU_SAMPLE sample;
     flow_t flow;
 
     UNREFERENCED_PARAMETER(layer_id);
@@ -4198,28 +4388,39 @@ static void windivert_flow_delete_notify(UINT16 layer_id, UINT32 callout_id,
     flags = context->flags;
     KeReleaseInStackQueuedSpinLock(&lock_handle);
 
+    sample = WinDivertCpuSample(context->cpu, KeGetCurrentProcessorNumber(),
+        timestamp, &sample_data);
     match = windivert_filter(/*buffer=*/NULL, /*layer=*/WINDIVERT_LAYER_FLOW,
         (PVOID)&flow->data, timestamp, /*event=*/WINDIVERT_EVENT_FLOW_DELETED,
         !flow->ipv6, flow->outbound, flow->loopback, /*impostor=*/FALSE,
-        /*frag_mode=*/FALSE, filter);
+        /*frag_mode=*/FALSE, filter, flow->process, sample);
     if (match)
     {
         (VOID)windivert_queue_work(context, /*packet=*/NULL, /*packet_len=*/0,
             /*buffers=*/NULL, /*object=*/NULL, /*layer=*/WINDIVERT_LAYER_FLOW,
             (PVOID)&flow->data, /*event=*/WINDIVERT_EVENT_FLOW_DELETED, flags,
             /*priority=*/0, !flow->ipv6, flow->outbound, flow->loopback,
-            /*impostor=*/FALSE, match, timestamp);
+            /*impostor=*/FALSE, match, timestamp, sample);
     }
 
 windivert_flow_delete_notify_exit:
 
     if (cleanup)
     {
-        windivert_free(flow);
+        windivert_free_flow(flow);
         WdfObjectDereference(object);
     }
 }
 
+/*
+ * Free a flow.
+ */
+static void windivert_free_flow(flow_t flow)
+{
+    WinDivertProcessRelease(flow->process);
+    windivert_free(flow);
+}
+
 /*
  * WinDivert classify resource assignment IPv4 function.
  */
@@ -4258,7 +4459,7 @@ static void windivert_resource_assignment_v4_classify(
         FWPS_FIELD_ALE_RESOURCE_ASSIGNMENT_V4_FLAGS) &
         FWP_CONDITION_FLAG_IS_LOOPBACK) != 0);
 
-    windivert_socket_classify(context, &socket_data,
+    windivert_socket_classify(context, meta_vals, &socket_data,
         /*event=*/WINDIVERT_EVENT_SOCKET_BIND, /*ipv4=*/TRUE,
         /*outbound=*/TRUE, loopback, result);
 }
@@ -4301,7 +4502,7 @@ static void windivert_resource_assignment_v6_classify(
         FWPS_FIELD_ALE_RESOURCE_ASSIGNMENT_V6_FLAGS) &
         FWP_CONDITION_FLAG_IS_LOOPBACK) != 0);
 
-    windivert_socket_classify(context, &socket_data,
+    windivert_socket_classify(context, meta_vals, &socket_data,
         /*event=*/WINDIVERT_EVENT_SOCKET_BIND, /*ipv4=*/FALSE,
         /*outbound=*/TRUE, loopback, result);
 }
@@ -4339,7 +4540,7 @@ static void windivert_resource_release_v4_classify(
         FWPS_FIELD_ALE_RESOURCE_RELEASE_V4_FLAGS) &
         FWP_CONDITION_FLAG_IS_LOOPBACK) != 0);
 
-    windivert_socket_classify(context, &socket_data,
+    windivert_socket_classify(context, meta_vals, &socket_data,
         /*event=*/WINDIVERT_EVENT_SOCKET_CLOSE, /*ipv4=*/TRUE,
         /*outbound=*/TRUE, loopback, result);
 }
@@ -4377,7 +4578,7 @@ static void windivert_resource_release_v6_classify(
         FWPS_FIELD_ALE_RESOURCE_RELEASE_V6_FLAGS) &
         FWP_CONDITION_FLAG_IS_LOOPBACK) != 0);
 
-    windivert_socket_classify(context, &socket_data,
+    windivert_socket_classify(context, meta_vals, &socket_data,
         /*event=*/WINDIVERT_EVENT_SOCKET_CLOSE, /*ipv4=*/FALSE,
         /*outbound=*/TRUE, loopback, result);
 }
@@ -4429,7 +4630,7 @@ static void windivert_auth_connect_v4_classify(
 
     loopback = ((flags & FWP_CONDITION_FLAG_IS_LOOPBACK) != 0);
 
-    windivert_socket_classify(context, &socket_data,
+    windivert_socket_classify(context, meta_vals, &socket_data,
         /*event=*/WINDIVERT_EVENT_SOCKET_CONNECT, /*ipv4=*/TRUE,
         /*outbound=*/TRUE, loopback, result);
 }
@@ -4481,7 +4682,7 @@ static void windivert_auth_connect_v6_classify(
 
     loopback = ((flags & FWP_CONDITION_FLAG_IS_LOOPBACK) != 0);
 
-    windivert_socket_classify(context, &socket_data,
+    windivert_socket_classify(context, meta_vals, &socket_data,
         /*event=*/WINDIVERT_EVENT_SOCKET_CONNECT, /*ipv4=*/FALSE,
         /*outbound=*/TRUE, loopback, result);
 }
@@ -4522,7 +4723,7 @@ static void windivert_endpoint_closure_v4_classify(
         FWPS_FIELD_ALE_ENDPOINT_CLOSURE_V4_FLAGS) &
         FWP_CONDITION_FLAG_IS_LOOPBACK) != 0);
 
-    windivert_socket_classify(context, &socket_data,
+    windivert_socket_classify(context, meta_vals, &socket_data,
         /*event=*/WINDIVERT_EVENT_SOCKET_CLOSE, /*ipv4=*/TRUE,
         /*outbound=*/TRUE, loopback, result);
 }
@@ -4563,7 +4764,7 @@ static void windivert_endpoint_closure_v6_classify(
         FWPS_FIELD_ALE_ENDPOINT_CLOSURE_V6_FLAGS) &
         FWP_CONDITION_FLAG_IS_LOOPBACK) != 0);
 
-    windivert_socket_classify(context, &socket_data,
+    windivert_socket_classify(context, meta_vals, &socket_data,
         /*event=*/WINDIVERT_EVENT_SOCKET_CLOSE, /*ipv4=*/FALSE,
         /*outbound=*/TRUE, loopback, result);
 }
@@ -4605,7 +4806,7 @@ static void windivert_auth_listen_v4_classify(
         FWPS_FIELD_ALE_AUTH_LISTEN_V4_FLAGS) &
         FWP_CONDITION_FLAG_IS_LOOPBACK) != 0);
 
-    windivert_socket_classify(context, &socket_data,
+    windivert_socket_classify(context, meta_vals, &socket_data,
         /*event=*/WINDIVERT_EVENT_SOCKET_LISTEN, /*ipv4=*/TRUE,
         /*outbound=*/TRUE, loopback, result);
 }
@@ -4647,7 +4848,7 @@ static void windivert_auth_listen_v6_classify(
         FWPS_FIELD_ALE_AUTH_LISTEN_V6_FLAGS) &
         FWP_CONDITION_FLAG_IS_LOOPBACK) != 0);
 
-    windivert_socket_classify(context, &socket_data,
+    windivert_socket_classify(context, meta_vals, &socket_data,
         /*event=*/WINDIVERT_EVENT_SOCKET_LISTEN, /*ipv4=*/FALSE,
         /*outbound=*/TRUE, loopback, result);
 }
@@ -4699,7 +4900,7 @@ static void windivert_auth_recv_accept_v4_classify(
 
     loopback = ((flags & FWP_CONDITION_FLAG_IS_LOOPBACK) != 0);
 
-    windivert_socket_classify(context, &socket_data,
+    windivert_socket_classify(context, meta_vals, &socket_data,
         /*event=*/WINDIVERT_EVENT_SOCKET_ACCEPT, /*ipv4=*/TRUE,
         /*outbound=*/FALSE, loopback, result);
 }
@@ -4751,7 +4952,7 @@ static void windivert_auth_recv_accept_v6_classify(
 
     loopback = ((flags & FWP_CONDITION_FLAG_IS_LOOPBACK) != 0);
 
-    windivert_socket_classify(context, &socket_data,
+    windivert_socket_classify(context, meta_vals, &socket_data,
         /*event=*/WINDIVERT_EVENT_SOCKET_ACCEPT, /*ipv4=*/FALSE,
         /*outbound=*/FALSE, loopback, result);
 }
@@ -4760,15 +4961,19 @@ static void windivert_auth_recv_accept_v6_classify(
  * WinDivert socket classify function.
  */
 static void windivert_socket_classify(context_t context,
+    const FWPS_INCOMING_METADATA_VALUES0 *meta_vals,
     PWINDIVERT_DATA_SOCKET socket_data, WINDIVERT_EVENT event, BOOL ipv4,
     BOOL outbound, BOOL loopback, FWPS_CLASSIFY_OUT0 *result)
 {
     KLOCK_QUEUE_HANDLE lock_handle;
     UINT64 flags;
-    BOOL match, ok;
+    BOOL match, ok, process_filter;
     WDFOBJECT object;
     const WINDIVERT_FILTER *filter;
+    PWINDIVERT_PROCESS process;
     LONGLONG timestamp;
+    WINDIVERT_CPU_SAMPLE sample_data;
+    PWINDIVERT_CPU_SAMPLE sample;
 
     // Get the timestamp.
     timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
@@ -4787,19 +4992,24 @@ static void windivert_socket_classify(context_t context,
     }
     filter = context->filter;
     flags = context->flags;
+    process_filter = context->process_filter;
     object = (WDFOBJECT)context->object;
     WdfObjectReference(object);
     KeReleaseInStackQueuedSpinLock(&lock_handle);
 
+    sample = WinDivertCpuSample(context->cpu, KeGetCurrentProcessorNumber(),
+        timestamp, &sample_data);
+    process = (process_filter? windivert_process_get(meta_vals): NULL);
     match = windivert_filter(/*buffer=*/NULL, /*layer=*/WINDIVERT_LAYER_SOCKET,
         (PVOID)socket_data, timestamp, event, ipv4, outbound, loopback,
-        /*impostor=*/FALSE, /*frag_mode=*/FALSE, filter);
+        /*impostor=*/FALSE, /*frag_mode=*/FALSE, filter, process, sample);
+    WinDivertProcessRelease(process);
     if (match)
     {
         ok = windivert_queue_work(context, /*packet=*/NULL, /*packet_len=*/0,
             /*buffers=*/NULL, /*object=*/NULL, /*layer=*/WINDIVERT_LAYER_SOCKET,
             (PVOID)socket_data, event, flags, /*priority=*/0, ipv4, outbound,
-            loopback, /*impostor=*/FALSE, match, timestamp);
+            loopback, /*impostor=*/FALSE, match, timestamp, sample);
         if (!ok)
         {
             WdfObjectDereference(object);
@@ -4823,35 +5033,35 @@ static void windivert_socket_classify(context_t context,
  */
 VOID windivert_worker(IN WDFWORKITEM item)
 {
-    KLOCK_QUEUE_HANDLE lock_handle;
     WDFFILEOBJECT object = (WDFFILEOBJECT)WdfWorkItemGetParentObject(item);
     context_t context = windivert_context_get(object);
-    PLIST_ENTRY entry;
-    packet_t work;
 
-    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
-    while (context->state == WINDIVERT_CONTEXT_STATE_OPEN &&
-            !IsListEmpty(&context->work_queue))
-    {
-        entry = RemoveHeadList(&context->work_queue);
-        context->work_queue_length--;
-        KeReleaseInStackQueuedSpinLock(&lock_handle);
+    windivert_queue_service(context);
+}
 
-        work = CONTAINING_RECORD(entry, struct packet_s, entry);
-        if (work->match)
-        {
-            windivert_queue_packet(context, work);
-        }
-        else
-        {
-            windivert_inject_packet(work);
-        }
+/*
+ * Redirect a matching outbound packet to the local proxy.  Must be called
+ * with the context lock held.
+ */
+static UINT windivert_redirect(context_t context, packet_t packet)
+{
+    UINT8 *packet_data;
+    UINT64 now;
+    UINT result;
 
-        KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+    if (packet->layer != WINDIVERT_LAYER_NETWORK || packet->sniffed)
+    {
+        return WINDIVERT_NAT_RESULT_IGNORE;
     }
-    KeReleaseInStackQueuedSpinLock(&lock_handle);
-
-    windivert_read_service(context);
+    packet_data = WINDIVERT_PACKET_DATA_PTR(WINDIVERT_DATA_NETWORK, packet);
+    now = (UINT64)packet->timestamp / (UINT64)counts_per_ms;
+    result = WinDivertNatTranslate(context->nat, packet_data,
+        packet->packet_len, now);
+    if (result == WINDIVERT_NAT_RESULT_REFLECT)
+    {
+        packet->outbound = 0;
+    }
+    return result;
 }
 
 /*
@@ -4861,14 +5071,13 @@ static BOOL windivert_queue_work(context_t context, PVOID packet,
     ULONG packet_len, PNET_BUFFER_LIST buffers, PVOID object,
     WINDIVERT_LAYER layer, PVOID layer_data, WINDIVERT_EVENT event,
     UINT64 flags, UINT32 priority, BOOL ipv4, BOOL outbound, BOOL loopback,
-    BOOL impostor, BOOL match, LONGLONG timestamp)
+    BOOL impostor, BOOL match, LONGLONG timestamp,
+    PWINDIVERT_CPU_SAMPLE sample)
 {
-    KLOCK_QUEUE_HANDLE lock_handle;
     PNET_BUFFER buffer;
     packet_t work;
     ULONG packet_size;
     UINT8 *data;
-    PLIST_ENTRY old_entry;
     NDIS_TCP_IP_CHECKSUM_NET_BUFFER_LIST_INFO checksums;
     PWINDIVERT_DATA_NETWORK network_data;
     PWINDIVERT_DATA_FLOW flow_data;
@@ -4876,11 +5085,14 @@ static BOOL windivert_queue_work(context_t context, PVOID packet,
     PWINDIVERT_DATA_REFLECT reflect_data;
     BOOL sniffed, ip_checksum, tcp_checksum, udp_checksum;
     WDFREQUEST request = NULL;
-    NTSTATUS status;
+    UINT32 sequence = 0;
 
     sniffed = ((flags & WINDIVERT_FLAG_SNIFF) != 0 ||
         event == WINDIVERT_EVENT_SOCKET_CLOSE);
 
+    WINDIVERT_TRACE(context, timestamp,
+        (match? WINDIVERT_TRACE_MATCH: WINDIVERT_TRACE_NO_MATCH), 0,
+        packet_len);
     if (!match && sniffed)
     {
         return TRUE;
@@ -4893,21 +5105,16 @@ static BOOL windivert_queue_work(context_t context, PVOID packet,
     // Check for fast-path:
     if (match)
     {
-        KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
-        if (context->state == WINDIVERT_CONTEXT_STATE_OPEN &&
-            !context->shutdown_recv && IsListEmpty(&context->packet_queue) &&
-            IsListEmpty(&context->work_queue))
-        {
-            status = WdfIoQueueRetrieveNextRequest(context->read_queue,
-                &request);
-            request = (!NT_SUCCESS(status)? NULL: request);
-        }
-        KeReleaseInStackQueuedSpinLock(&lock_handle);
+        request = windivert_queue_fast_request(context, outbound, &sequence);
         if (request != NULL)
         {
+            WINDIVERT_TRACE(context, timestamp, WINDIVERT_TRACE_FAST_PATH, 0,
+                packet_len);
+            WINDIVERT_CPU_PHASE(sample, WINDIVERT_CPU_QUEUE);
             windivert_fast_read_service_request(packet, packet_len, buffers,
                 layer, layer_data, event, flags, ipv4, outbound, loopback,
-                impostor, timestamp, request);
+                impostor, timestamp, sequence, request);
+            WINDIVERT_CPU_PHASE(sample, WINDIVERT_CPU_COPY);
             return TRUE;
         }
     }
@@ -4922,6 +5129,8 @@ static BOOL windivert_queue_work(context_t context, PVOID packet,
             if (packet_len > WINDIVERT_MTU_MAX)
             {
                 // Cannot handle oversized packet
+                WINDIVERT_TRACE(context, timestamp, WINDIVERT_TRACE_DROP,
+                    WINDIVERT_TRACE_DROP_OVERSIZE, packet_len);
                 return TRUE;
             }
             packet_size = WINDIVERT_PACKET_SIZE(WINDIVERT_DATA_NETWORK,
@@ -4929,17 +5138,19 @@ static BOOL windivert_queue_work(context_t context, PVOID packet,
             work = (packet_t)windivert_malloc(packet_size, FALSE);
             if (work == NULL)
             {
-                return TRUE;
+                goto windivert_queue_work_no_memory;
             }
             work->packet_len = (UINT32)packet_len;
             data = WINDIVERT_LAYER_DATA_PTR(work);
             RtlCopyMemory(data, network_data, sizeof(WINDIVERT_DATA_NETWORK));
             data = WINDIVERT_PACKET_DATA_PTR(WINDIVERT_DATA_NETWORK, work);
+            WINDIVERT_CPU_PHASE(sample, WINDIVERT_CPU_QUEUE);
             if (!windivert_copy_data(buffer, data, packet_len))
             {
                 windivert_free(work);
                 return TRUE;
             }
+            WINDIVERT_CPU_PHASE(sample, WINDIVERT_CPU_COPY);
             checksums.Value = NET_BUFFER_LIST_INFO(buffers,
                 TcpIpChecksumNetBufferListInfo);
             if (outbound)
@@ -4962,7 +5173,7 @@ static BOOL windivert_queue_work(context_t context, PVOID packet,
             work = (packet_t)windivert_malloc(packet_size, FALSE);
             if (work == NULL)
             {
-                return TRUE;
+                goto windivert_queue_work_no_memory;
             }
             work->packet_len = 0;
             data = WINDIVERT_LAYER_DATA_PTR(work);
@@ -4976,7 +5187,7 @@ static BOOL windivert_queue_work(context_t context, PVOID packet,
             work = (packet_t)windivert_malloc(packet_size, FALSE);
             if (work == NULL)
             {
-                return TRUE;
+                goto windivert_queue_work_no_memory;
             }
             work->packet_len = 0;
             data = WINDIVERT_LAYER_DATA_PTR(work);
@@ -4991,7 +5202,7 @@ static BOOL windivert_queue_work(context_t context, PVOID packet,
             work = (packet_t)windivert_malloc(packet_size, FALSE);
             if (work == NULL)
             {
-                return TRUE;
+                goto windivert_queue_work_no_memory;
             }
             work->packet_len = packet_len;
             data = WINDIVERT_LAYER_DATA_PTR(work);
@@ -5026,111 +5237,18 @@ static BOOL windivert_queue_work(context_t context, PVOID packet,
         ObfReferenceObject(object);
     }
 
-    old_entry = NULL;
-    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
-    if (context->state != WINDIVERT_CONTEXT_STATE_OPEN)
+    if (!windivert_queue_work_packet(context, work, flags))
     {
-        KeReleaseInStackQueuedSpinLock(&lock_handle);
-        windivert_free_packet(work);
         return FALSE;
     }
-    if (context->shutdown_recv && context->shutdown_recv_enabled)
-    {
-        if ((flags & WINDIVERT_FLAG_SNIFF) != 0)
-        {
-            KeReleaseInStackQueuedSpinLock(&lock_handle);
-            windivert_free_packet(work);
-            return FALSE;
-        }
-        work->match = FALSE;
-    }
-    context->work_queue_length++;
-    if (context->work_queue_length > WINDIVERT_WORK_QUEUE_LENGTH_MAX)
-    {
-        // The work queue is full; as an emergency we drop packets.
-        old_entry = RemoveHeadList(&context->work_queue);
-        context->work_queue_length--;
-    }
-    InsertTailList(&context->work_queue, &work->entry);
-    WdfWorkItemEnqueue(context->worker);
-    KeReleaseInStackQueuedSpinLock(&lock_handle);
-    
-    if (old_entry != NULL)
-    {
-        work = CONTAINING_RECORD(old_entry, struct packet_s, entry);
-        windivert_free_packet(work);
-    }
+    WINDIVERT_CPU_PHASE(sample, WINDIVERT_CPU_QUEUE);
 
     return TRUE;
-}
-
-/*
- * Queue a packet.
- */
-static void windivert_queue_packet(context_t context, packet_t packet)
-{
-    KLOCK_QUEUE_HANDLE lock_handle;
-    PLIST_ENTRY old_entry;
-    packet_t old_packet;
-    LONGLONG timestamp;
-    BOOL timeout;
-
-    timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
-    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
-    while (TRUE)
-    {
-        if (context->state != WINDIVERT_CONTEXT_STATE_OPEN)
-        {
-            KeReleaseInStackQueuedSpinLock(&lock_handle);
-            windivert_inject_packet(packet);
-            return;
-        }
-        if (packet->packet_size > context->packet_queue_maxsize)
-        {
-            // (Corner case) the packet is larger than the max queue size:
-            KeReleaseInStackQueuedSpinLock(&lock_handle);
-            windivert_free_packet(packet);
-            return;
-        }
-        timeout = WINDIVERT_TIMEOUT(context, packet->timestamp, timestamp);
-        if (timeout)
-        {
-            // (Corner case) the packet has already expired:
-            KeReleaseInStackQueuedSpinLock(&lock_handle);
-            windivert_free_packet(packet);
-            return;
-        }
-
-        if (context->packet_queue_size + packet->packet_size >
-                context->packet_queue_maxsize ||
-            context->packet_queue_length + 1 > context->packet_queue_maxlength)
-        {
-            // The queue is full; drop a packet & try again:
-            old_entry = RemoveHeadList(&context->packet_queue);
-            old_packet = CONTAINING_RECORD(old_entry, struct packet_s, entry);
-            context->packet_queue_length--;
-            context->packet_queue_size -= old_packet->packet_size;
-            KeReleaseInStackQueuedSpinLock(&lock_handle);
-            DEBUG("DROP: packet queue is full, dropping packet");
-            windivert_free_packet(old_packet);
-            timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
-            KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
-            continue;
-        }
-        else
-        {
-            // Queue the packet:
-            InsertTailList(&context->packet_queue, &packet->entry);
-            context->packet_queue_length++;
-            context->packet_queue_size += packet->packet_size;
-            break;
-        }
-    }
-    KeReleaseInStackQueuedSpinLock(&lock_handle);
-
-    DEBUG("PACKET: queued packet (packet=%p)", packet);
 
-    return;
+windivert_queue_work_no_memory:
+    WINDIVERT_TRACE(context, timestamp, WINDIVERT_TRACE_DROP,
+        WINDIVERT_TRACE_DROP_NO_MEMORY, packet_len);
+    return TRUE;
 }
 
 /*
@@ -5144,8 +5262,7 @@ static NTSTATUS windivert_inject_packet(packet_t packet)
     PWINDIVERT_DATA_NETWORK network_data;
     PMDL mdl;
     PNET_BUFFER_LIST buffers;
-    HANDLE handle;
-    UINT32 priority;
+    HANDLE handle, inject_context;
     NTSTATUS status;
 
     if (packet->layer != WINDIVERT_LAYER_NETWORK &&
@@ -5198,11 +5315,12 @@ static NTSTATUS windivert_inject_packet(packet_t packet)
         windivert_free_packet(packet);
         return status;
     }
-    priority = packet->priority;
+    inject_context = windivert_inject_context(packet->priority,
+        network_data->Mark);
     if (packet->layer == WINDIVERT_LAYER_NETWORK_FORWARD)
     {
         handle = (packet->ipv6? injectv6_handle_forward: inject_handle_forward);
-        status = FwpsInjectForwardAsync0(handle, (HANDLE)priority, 0,
+        status = FwpsInjectForwardAsync0(handle, inject_context, 0,
             (packet->ipv6? AF_INET6: AF_INET), UNSPECIFIED_COMPARTMENT_ID,
             network_data->IfIdx, buffers, windivert_inject_complete,
             (HANDLE)packet);
@@ -5210,14 +5328,14 @@ static NTSTATUS windivert_inject_packet(packet_t packet)
     else if (packet->outbound)
     {
         handle = (packet->ipv6? injectv6_handle_out: inject_handle_out);
-        status = FwpsInjectNetworkSendAsync0(handle, (HANDLE)priority, 0,
+        status = FwpsInjectNetworkSendAsync0(handle, inject_context, 0,
             UNSPECIFIED_COMPARTMENT_ID, buffers, windivert_inject_complete,
             (HANDLE)packet);
     }
     else
     {
         handle = (packet->ipv6? injectv6_handle_in: inject_handle_in);
-        status = FwpsInjectNetworkReceiveAsync0(handle, (HANDLE)priority, 0,
+        status = FwpsInjectNetworkReceiveAsync0(handle, inject_context, 0,
             UNSPECIFIED_COMPARTMENT_ID, network_data->IfIdx,
             network_data->SubIfIdx, buffers, windivert_inject_complete,
             (HANDLE)packet);
@@ -5471,8 +5589,8 @@ static WINDIVERT_INLINE BOOL windivert_parse_headers(PNET_BUFFER buffer,
     BOOL ipv4, BOOL *fragment_ptr, PWINDIVERT_IPHDR *ip_header_ptr,
     PWINDIVERT_IPV6HDR *ipv6_header_ptr, PWINDIVERT_ICMPHDR *icmp_header_ptr,
     PWINDIVERT_ICMPV6HDR *icmpv6_header_ptr, PWINDIVERT_TCPHDR *tcp_header_ptr,
-    PWINDIVERT_UDPHDR *udp_header_ptr, UINT8 *proto_ptr, UINT *header_len_ptr,
-    UINT *payload_len_ptr)
+    PWINDIVERT_UDPHDR *udp_header_ptr, PWINDIVERT_IPV6EXT ipv6_ext_ptr,
+    UINT8 *proto_ptr, UINT *header_len_ptr, UINT *payload_len_ptr)
 {
     UINT total_len, ip_header_len = 0;
     PWINDIVERT_IPHDR ip_header = NULL;
@@ -5484,10 +5602,13 @@ static WINDIVERT_INLINE BOOL windivert_parse_headers(PNET_BUFFER buffer,
     PWINDIVERT_IPV6FRAGHDR frag_header;
     BOOL fragment = FALSE;
     UINT8 protocol = 0;
+    UINT8 ext_storage[8];
     UINT16 frag_off = 0;
     UINT header_len = 0;
     NTSTATUS status;
 
+    RtlZeroMemory(ipv6_ext_ptr, sizeof(WINDIVERT_IPV6EXT));
+
     // Parse the headers:
     if (buffer == NULL)
     {
@@ -5587,8 +5708,9 @@ static WINDIVERT_INLINE BOOL windivert_parse_headers(PNET_BUFFER buffer,
                 case IPPROTO_DSTOPTS:
                 case IPPROTO_ROUTING:
                 case IPPROTO_MH:
-                    ext_header = (UINT8 *)NdisGetDataBuffer(buffer, 2, NULL,
-                        1, 0);
+                    // All extension headers are at least 8 bytes long.
+                    ext_header = (UINT8 *)NdisGetDataBuffer(buffer,
+                        sizeof(ext_storage), ext_storage, 1, 0);
                     if (ext_header == NULL)
                     {
                         is_ext_header = FALSE;
@@ -5617,6 +5739,8 @@ static WINDIVERT_INLINE BOOL windivert_parse_headers(PNET_BUFFER buffer,
             {
                 break;
             }
+            WinDivertIPv6ExtAdd(ipv6_ext_ptr, protocol, ext_header,
+                ext_header_len);
             protocol = ext_header[0];
             ip_header_len += ext_header_len;
             NdisAdvanceNetBufferDataStart(buffer, ext_header_len, FALSE,
@@ -5711,7 +5835,8 @@ static WINDIVERT_INLINE BOOL windivert_parse_headers(PNET_BUFFER buffer,
 static BOOL windivert_filter(PNET_BUFFER buffer, WINDIVERT_LAYER layer,
     const VOID *layer_data, LONGLONG timestamp, WINDIVERT_EVENT event,
     BOOL ipv4, BOOL outbound, BOOL loopback, BOOL impostor, BOOL frag_mode,
-    const WINDIVERT_FILTER *filter)
+    const WINDIVERT_FILTER *filter, const WINDIVERT_PROCESS *process,
+    PWINDIVERT_CPU_SAMPLE sample)
 {
     PWINDIVERT_IPHDR ip_header = NULL;
     PWINDIVERT_IPV6HDR ipv6_header = NULL;
@@ -5719,6 +5844,7 @@ static BOOL windivert_filter(PNET_BUFFER buffer, WINDIVERT_LAYER layer,
     PWINDIVERT_ICMPV6HDR icmpv6_header = NULL;
     PWINDIVERT_TCPHDR tcp_header = NULL;
     PWINDIVERT_UDPHDR udp_header = NULL;
+    WINDIVERT_IPV6EXT ipv6_ext;
     BOOL fragment = FALSE;
     UINT8 protocol = 0;
     UINT header_len = 0, payload_len = 0, total_len = 0;
@@ -5734,7 +5860,8 @@ static BOOL windivert_filter(PNET_BUFFER buffer, WINDIVERT_LAYER layer,
         case WINDIVERT_LAYER_NETWORK_FORWARD:
             if (!windivert_parse_headers(buffer, ipv4, &fragment, &ip_header,
                     &ipv6_header, &icmp_header, &icmpv6_header, &tcp_header,
-                    &udp_header, &protocol, &header_len, &payload_len))
+                    &udp_header, &ipv6_ext, &protocol, &header_len,
+                    &payload_len))
             {
                 return FALSE;
             }
@@ -5757,6 +5884,7 @@ static BOOL windivert_filter(PNET_BUFFER buffer, WINDIVERT_LAYER layer,
             DEBUG("FILTER: REJECT (invalid parameter)");
             return FALSE;
     }
+    WINDIVERT_CPU_PHASE(sample, WINDIVERT_CPU_PARSE);
 
     result = WinDivertExecuteFilter(
         filter,
@@ -5778,15 +5906,107 @@ static BOOL windivert_filter(PNET_BUFFER buffer, WINDIVERT_LAYER layer,
         icmpv6_header,
         tcp_header,
         udp_header,
+        &ipv6_ext,
         protocol,
         (const VOID *)buffer,
         header_len + payload_len,
         header_len,
-        payload_len);
+        payload_len,
+        (process != NULL? process->path: NULL),
+        (process != NULL? process->len: 0));
+    WINDIVERT_CPU_PHASE(sample, WINDIVERT_CPU_FILTER);
 
     return (result == 1);
 }
 
+/*
+ * Check if a filter uses the processName/processPath fields.
+ */
+static BOOL windivert_filter_process(const WINDIVERT_FILTER *filter,
+    UINT filter_len)
+{
+    UINT i;
+
+    for (i = 0; i < filter_len; i++)
+    {
+        if (filter[i].field == WINDIVERT_FILTER_FIELD_PROCESSNAME ||
+            filter[i].field == WINDIVERT_FILTER_FIELD_PROCESSPATH)
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/*
+ * Get the image path of the process associated with a FLOW/SOCKET event.
+ * Returns a reference to be released with WinDivertProcessRelease(), or NULL
+ * if the path is not known.
+ */
+static PWINDIVERT_PROCESS windivert_process_get(
+    const FWPS_INCOMING_METADATA_VALUES0 *meta_vals)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    PWINDIVERT_PROCESS process;
+    const FWP_BYTE_BLOB *path;
+    UINT32 pid;
+
+    if (!FWPS_IS_METADATA_FIELD_PRESENT(meta_vals,
+            FWPS_METADATA_FIELD_PROCESS_ID))
+    {
+        return NULL;
+    }
+    pid = (UINT32)meta_vals->processId;
+    if (pidcache_enabled)
+    {
+        KeAcquireInStackQueuedSpinLock(&pidcache_lock, &lock_handle);
+        process = WinDivertPidCacheLookup(&pidcache, pid);
+        KeReleaseInStackQueuedSpinLock(&lock_handle);
+        if (process != NULL)
+        {
+            return process;
+        }
+    }
+
+    // Cache miss; fall back to the path supplied by WFP:
+    if (!FWPS_IS_METADATA_FIELD_PRESENT(meta_vals,
+            FWPS_METADATA_FIELD_PROCESS_PATH) ||
+        meta_vals->processPath == NULL ||
+        meta_vals->processPath->data == NULL)
+    {
+        return NULL;
+    }
+    path = meta_vals->processPath;
+    process = WinDivertProcessCreate(pid, (const UINT16 *)path->data,
+        path->size / sizeof(UINT16));
+    if (process == NULL || !pidcache_enabled)
+    {
+        return process;
+    }
+    KeAcquireInStackQueuedSpinLock(&pidcache_lock, &lock_handle);
+    WinDivertPidCacheInsert(&pidcache, process);
+    KeReleaseInStackQueuedSpinLock(&lock_handle);
+    return process;
+}
+
+/*
+ * Process create/exit notification.  Cache entries are dropped when a process
+ * exits, and also when a process is created in case the exit raced with an
+ * insert of the (now reused) process ID.
+ */
+static VOID windivert_process_notify(HANDLE parent_id, HANDLE process_id,
+    BOOLEAN create)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+
+    UNREFERENCED_PARAMETER(parent_id);
+    UNREFERENCED_PARAMETER(create);
+
+    KeAcquireInStackQueuedSpinLock(&pidcache_lock, &lock_handle);
+    WinDivertPidCacheRemove(&pidcache, (UINT32)(ULONG_PTR)process_id);
+    KeReleaseInStackQueuedSpinLock(&lock_handle);
+}
+
 /*
  * Compile a WinDivert filter from an IOCTL.
  */
@@ -5807,7 +6027,7 @@ static const WINDIVERT_FILTER *windivert_filter_compile(
         goto windivert_filter_compile_error;
     }
     length = ioctl_filter_len / sizeof(WINDIVERT_FILTER);
-    if (length >= WINDIVERT_FILTER_MAXLEN || length == 0)
+    if (length > WINDIVERT_FILTER_MAXLEN || length == 0)
     {
         goto windivert_filter_compile_error;
     }
@@ -5910,6 +6130,12 @@ static const WINDIVERT_FILTER *windivert_filter_compile(
             case WINDIVERT_FILTER_FIELD_TCP_RST:
             case WINDIVERT_FILTER_FIELD_TCP_SYN:
             case WINDIVERT_FILTER_FIELD_TCP_FIN:
+            case WINDIVERT_FILTER_FIELD_IPV6_HOPOPTS:
+            case WINDIVERT_FILTER_FIELD_IPV6_ROUTING:
+            case WINDIVERT_FILTER_FIELD_IPV6_FRAGHDR:
+            case WINDIVERT_FILTER_FIELD_IPV6_DSTOPTS:
+            case WINDIVERT_FILTER_FIELD_IPV6_AH:
+            case WINDIVERT_FILTER_FIELD_IPV6_MH:
                 ub[0] = 1;
                 break;
             case WINDIVERT_FILTER_FIELD_LAYER:
@@ -5969,6 +6195,7 @@ static const WINDIVERT_FILTER *windivert_filter_compile(
             case WINDIVERT_FILTER_FIELD_IPV6_TRAFFICCLASS:
             case WINDIVERT_FILTER_FIELD_IPV6_NEXTHDR:
             case WINDIVERT_FILTER_FIELD_IPV6_HOPLIMIT:
+            case WINDIVERT_FILTER_FIELD_IPV6_ROUTINGTYPE:
             case WINDIVERT_FILTER_FIELD_ICMP_TYPE:
             case WINDIVERT_FILTER_FIELD_ICMP_CODE:
             case WINDIVERT_FILTER_FIELD_ICMPV6_TYPE:
@@ -5987,6 +6214,8 @@ static const WINDIVERT_FILTER *windivert_filter_compile(
             case WINDIVERT_FILTER_FIELD_IP_ID:
             case WINDIVERT_FILTER_FIELD_IP_CHECKSUM:
             case WINDIVERT_FILTER_FIELD_IPV6_LENGTH:
+            case WINDIVERT_FILTER_FIELD_IPV6_EXTHDRCOUNT:
+            case WINDIVERT_FILTER_FIELD_IPV6_EXTHDRLENGTH:
             case WINDIVERT_FILTER_FIELD_ICMP_CHECKSUM:
             case WINDIVERT_FILTER_FIELD_ICMPV6_CHECKSUM:
             case WINDIVERT_FILTER_FIELD_TCP_SRCPORT:
@@ -6036,6 +6265,11 @@ static const WINDIVERT_FILTER *windivert_filter_compile(
             case WINDIVERT_FILTER_FIELD_REMOTEADDR:
                 ub[0] = ub[1] = ub[2] = ub[3] = 0xFFFFFFFF;
                 break;
+            case WINDIVERT_FILTER_FIELD_PROCESSNAME:
+            case WINDIVERT_FILTER_FIELD_PROCESSPATH:
+                ub[0] = ub[1] = ub[2] = 0xFFFFFFFF;
+                ub[3] = WINDIVERT_PROCESS_FLAG_SUFFIX;
+                break;
             default:
                 ub[0] = 0xFFFFFFFF;
                 break;
@@ -6085,8 +6319,6 @@ windivert_filter_compile_error:
 /* WINDIVERT REFLECT MANAGER IMPLEMENTATION                                 */
 /****************************************************************************/
 
-#define WINDIVERT_REFLECT_PACKET_MAX        12288
-
 /*
  * WinDivert reflect state.
  */
@@ -6097,9 +6329,6 @@ static LIST_ENTRY reflect_event_queue;      // Reflect event queue.
 static LIST_ENTRY reflect_contexts;         // All open (non-REFLECT) contexts.
 static LIST_ENTRY reflect_waiters;          // All open REFLECT contexts.
 static WDFWORKITEM reflect_worker;          // Reflect work item.
-#pragma data_seg(push, stack, "PAGE")
-static char reflect_packet[WINDIVERT_REFLECT_PACKET_MAX];
-#pragma data_seg(pop, stack)
 
 /*
  * Initialize the reflection layer implementation.
@@ -6204,7 +6433,55 @@ static void windivert_reflect_close_event(context_t context)
 }
 
 /*
- * Create REFLECT layer packet to pass the filter.
+ * Copy the trace of the open handle identified by (process_id, timestamp).
+ */
+static UINT windivert_reflect_trace(UINT32 process_id, INT64 timestamp,
+    PWINDIVERT_TRACE_EVENT events, UINT max, NTSTATUS *status_ptr)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    PLIST_ENTRY entry;
+    context_t context;
+    UINT count = 0;
+
+    // Contexts in reflect_contexts remain referenced (and their traces
+    // allocated) until they are removed by the reflect worker.
+    *status_ptr = STATUS_NOT_FOUND;
+    KeAcquireInStackQueuedSpinLock(&reflect_lock, &lock_handle);
+    entry = reflect_contexts.Flink;
+    while (entry != &reflect_contexts)
+    {
+        context = CONTAINING_RECORD(entry, struct context_s, reflect.entry);
+        entry = entry->Flink;
+        if (context->reflect.data.ProcessId == process_id &&
+            context->reflect.data.Timestamp == timestamp)
+        {
+            count = WinDivertTraceSnapshot(context->trace, events, max);
+            *status_ptr = STATUS_SUCCESS;
+            break;
+        }
+    }
+    KeReleaseInStackQueuedSpinLock(&lock_handle);
+    return count;
+}
+
+/*
+ * Refresh the CPU accounting in the REFLECT layer data.
+ */
+static void windivert_reflect_cpu(context_t context)
+{
+    UINT64 events, cpu_time[WINDIVERT_CPU_MAX];
+
+    WinDivertCpuQuery(context->cpu, &events, cpu_time);
+    context->reflect.data.ParseTime  = cpu_time[WINDIVERT_CPU_PARSE];
+    context->reflect.data.FilterTime = cpu_time[WINDIVERT_CPU_FILTER];
+    context->reflect.data.QueueTime  = cpu_time[WINDIVERT_CPU_QUEUE];
+    context->reflect.data.CopyTime   = cpu_time[WINDIVERT_CPU_COPY];
+}
+
+/*
+ * Create REFLECT layer packet to pass the filter.  The packet is sized to
+ * the filter (capped at WINDIVERT_MTU_MAX, truncating the object), and must
+ * be freed with windivert_free().  Returns NULL if out of memory.
  */
 static PVOID windivert_reflect_packet(context_t context, ULONG *len_ptr)
 {
@@ -6212,18 +6489,27 @@ static PVOID windivert_reflect_packet(context_t context, ULONG *len_ptr)
     const WINDIVERT_FILTER *filter;
     UINT16 filter_len;
     WINDIVERT_STREAM stream;
-
-    stream.data     = reflect_packet;
-    stream.pos      = 0;
-    stream.max      = sizeof(reflect_packet) - 1;
-    stream.overflow = FALSE;
+    ULONG packet_size;
 
     KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
     filter = context->filter;
     filter_len = context->filter_len;
     KeReleaseInStackQueuedSpinLock(&lock_handle);
+
+    packet_size = WINDIVERT_OBJECT_LEN(filter_len);
+    packet_size = (packet_size > WINDIVERT_MTU_MAX? WINDIVERT_MTU_MAX:
+        packet_size);
+    stream.data     = (char *)windivert_malloc(packet_size, TRUE);
+    stream.pos      = 0;
+    stream.max      = packet_size - 1;
+    stream.overflow = FALSE;
+    if (stream.data == NULL)
+    {
+        return NULL;
+    }
     
-    WinDivertSerializeFilter(&stream, filter, (UINT8)filter_len);
+    WinDivertSerializeFilter(&stream, filter, filter_len);
+    context->reflect.data.Truncated = (stream.overflow? 1: 0);
     *len_ptr = stream.pos;
     return (PVOID)stream.data;
 }
@@ -6246,6 +6532,7 @@ static void windivert_reflect_event_notify(context_t context,
     KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
     process = (PVOID)context->process;
     KeReleaseInStackQueuedSpinLock(&lock_handle);
+    windivert_reflect_cpu(context);
 
     entry = reflect_waiters.Flink;
     while (entry != &reflect_waiters)
@@ -6260,7 +6547,7 @@ static void windivert_reflect_event_notify(context_t context,
             /*layer=*/WINDIVERT_LAYER_REFLECT, (PVOID)&context->reflect.data,
             timestamp, event, /*ipv4=*/TRUE, /*outbound=*/FALSE,
             /*loopback=*/FALSE, /*impostor=*/FALSE, /*frag_mode=*/FALSE,
-            filter);
+            filter, /*process=*/NULL, /*sample=*/NULL);
         if (!match)
         {
             continue;
@@ -6268,13 +6555,18 @@ static void windivert_reflect_event_notify(context_t context,
         if (packet == NULL)
         {
             packet = windivert_reflect_packet(context, &packet_len);
+            if (packet == NULL)
+            {
+                break;
+            }
         }
         (VOID)windivert_queue_work(waiter, packet, packet_len,
             /*buffers=*/NULL, process, /*layer=*/WINDIVERT_LAYER_REFLECT,
             (PVOID)&context->reflect.data, event, flags, /*priority=*/0,
             /*ipv4=*/TRUE, /*outbound=*/FALSE, /*loopback=*/FALSE,
-            /*impostor=*/FALSE, /*match=*/TRUE, timestamp);
+            /*impostor=*/FALSE, /*match=*/TRUE, timestamp, /*sample=*/NULL);
     }
+    windivert_free(packet);
 }
 
 /*
@@ -6307,16 +6599,22 @@ static void windivert_reflect_established_notify(context_t context,
     {
         waiter = CONTAINING_RECORD(entry, struct context_s, reflect.entry);
         entry = entry->Flink;
+        windivert_reflect_cpu(waiter);
         match = windivert_filter(/*buffer=*/NULL,
             /*layer=*/WINDIVERT_LAYER_REFLECT, (PVOID)&waiter->reflect.data,
             timestamp, /*event=*/WINDIVERT_EVENT_REFLECT_OPEN, /*ipv4=*/TRUE,
             /*outbound=*/FALSE, /*loopback=*/FALSE, /*impostor=*/FALSE,
-            /*frag_mode=*/FALSE, filter);
+            /*frag_mode=*/FALSE, filter, /*process=*/NULL,
+            /*sample=*/NULL);
         if (!match)
         {
             continue;
         }
         packet = windivert_reflect_packet(waiter, &packet_len);
+        if (packet == NULL)
+        {
+            break;
+        }
         KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
         process = (PVOID)waiter->process;
         KeReleaseInStackQueuedSpinLock(&lock_handle);
@@ -6325,7 +6623,8 @@ static void windivert_reflect_established_notify(context_t context,
             (PVOID)&waiter->reflect.data,
             /*event=*/WINDIVERT_EVENT_REFLECT_OPEN, flags, /*priority=*/0,
             /*ipv4=*/TRUE, /*outbound=*/FALSE, /*loopback=*/FALSE,
-            /*impostor=*/FALSE, /*match=*/TRUE, timestamp);
+            /*impostor=*/FALSE, /*match=*/TRUE, timestamp, /*sample=*/NULL);
+        windivert_free(packet);
         if (!ok)
         {
             break;
@@ -6364,7 +6663,8 @@ void windivert_reflect_worker(IN WDFWORKITEM item)
     // All reflection events are serialized and handled by this worker.
     // This ensures that we are always operating on a consistent "snapshot"
     // of the WinDivert handle state.  This worker also has exclusive control 
-    // over reflect_contexts/reflect_waiters, so locking is not required.
+    // over reflect_contexts/reflect_waiters, so locking is not required,
+    // except to modify reflect_contexts (see windivert_reflect_trace()).
 
     KeAcquireInStackQueuedSpinLock(&reflect_lock, &lock_handle);
     while (!IsListEmpty(&reflect_event_queue))
@@ -6390,7 +6690,10 @@ void windivert_reflect_worker(IN WDFWORKITEM item)
             case WINDIVERT_EVENT_REFLECT_OPEN:
                 if (layer != WINDIVERT_LAYER_REFLECT)
                 {
+                    KeAcquireInStackQueuedSpinLock(&reflect_lock,
+                        &lock_handle);
                     InsertTailList(&reflect_contexts, &context->reflect.entry);
+                    KeReleaseInStackQueuedSpinLock(&lock_handle);
                 }
                 else
                 {
@@ -6400,7 +6703,9 @@ void windivert_reflect_worker(IN WDFWORKITEM item)
                 break;
 
             case WINDIVERT_EVENT_REFLECT_CLOSE:
+                KeAcquireInStackQueuedSpinLock(&reflect_lock, &lock_handle);
                 RemoveEntryList(&context->reflect.entry);
+                KeReleaseInStackQueuedSpinLock(&lock_handle);
                 break;
         }
 
@@ -0,0 +1,402 @@
+/*
+ * windivert_queue.c
+ * (C) 2019, all rights reserved,
+ *
+ * This file is part of WinDivert.
+ *
+ * WinDivert is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * WinDivert is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Packet queueing core.  Packets flow from the classify callouts into the
+ * work queue (or directly into a pending read request via the fast-path),
+ * from the work queue into the packet queue (worker), and from the packet
+ * queue into read requests (read service).
+ *
+ * This code only uses spin locks, LIST_ENTRY lists, the WDF read queue and
+ * work item, and KeQueryPerformanceCounter(), so that it can also be built
+ * against the user-mode shim in test/sim.c.  The includer provides the
+ * context_s and packet_s structures, windivert_read_service_request(),
+ * windivert_redirect(), windivert_inject_packet(),
+ * windivert_free_packet() and WINDIVERT_TRACE().
+ */
+
+#define WINDIVERT_TIMEOUT(context, t0, t1)                                  \
+     (((t1) >= (t0)? (t1) - (t0): (t0) - (t1)) >                            \
+        (context)->packet_queue_maxcounts)
+
+/*
+ * WinDivert read routine.
+ */
+static NTSTATUS windivert_read(context_t context, WDFREQUEST request)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    DEBUG("READ: reading diverted packet (context=%p, request=%p)", context,
+        request);
+
+    // Forward the request to the pending read queue:
+    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+    if (context->state != WINDIVERT_CONTEXT_STATE_OPEN)
+    {
+        KeReleaseInStackQueuedSpinLock(&lock_handle);
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+    if ((context->flags & WINDIVERT_FLAG_SEND_ONLY) != 0)
+    {
+        KeReleaseInStackQueuedSpinLock(&lock_handle);
+        status = STATUS_INVALID_PARAMETER;
+        DEBUG_ERROR("failed to inject; send-only flag is set", status);
+        return status;
+    }
+    status = WdfRequestForwardToIoQueue(request, context->read_queue);
+    KeReleaseInStackQueuedSpinLock(&lock_handle);
+    if (!NT_SUCCESS(status))
+    {
+        DEBUG_ERROR("failed to forward I/O request to read queue", status);
+        return status;
+    }
+
+    // Service the read request:
+    windivert_read_service(context);
+
+    return STATUS_SUCCESS;
+}
+
+/*
+ * Dequeue the next packet for a read request that has already been given a
+ * packet, or NULL if there is no suitable packet.
+ */
+static packet_t windivert_read_service_next(context_t context, ULONG dst_len,
+    LONGLONG timestamp)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    PLIST_ENTRY entry;
+    packet_t packet = NULL;
+    BOOL timeout;
+
+    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+    if (context->state == WINDIVERT_CONTEXT_STATE_OPEN &&
+            !IsListEmpty(&context->packet_queue))
+    {
+        entry = RemoveHeadList(&context->packet_queue);
+        packet = CONTAINING_RECORD(entry, struct packet_s, entry);
+        timeout = WINDIVERT_TIMEOUT(context, packet->timestamp, timestamp);
+        if (packet->packet_len > dst_len || timeout)
+        {
+            // Note: timeouts to be handled elsewhere.
+            InsertHeadList(&context->packet_queue, entry);
+            packet = NULL;
+        }
+        else
+        {
+            context->packet_queue_length--;
+            context->packet_queue_size -= packet->packet_size;
+        }
+    }
+    KeReleaseInStackQueuedSpinLock(&lock_handle);
+    return packet;
+}
+
+/*
+ * WinDivert read request service.
+ */
+static void windivert_read_service(context_t context)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    WDFREQUEST request;
+    PLIST_ENTRY entry;
+    LONGLONG timestamp;
+    BOOL timeout;
+    NTSTATUS status;
+    packet_t packet;
+
+    timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+    while (context->state == WINDIVERT_CONTEXT_STATE_OPEN &&
+           !IsListEmpty(&context->packet_queue))
+    {
+        entry = RemoveHeadList(&context->packet_queue);
+        packet = CONTAINING_RECORD(entry, struct packet_s, entry);
+        timeout = WINDIVERT_TIMEOUT(context, packet->timestamp, timestamp);
+        request = NULL;
+        if (!timeout)
+        {
+            status = WdfIoQueueRetrieveNextRequest(context->read_queue,
+                &request);
+            if (!NT_SUCCESS(status))
+            {
+                InsertHeadList(&context->packet_queue, entry);
+                break;
+            }
+        }
+        context->packet_queue_length--;
+        context->packet_queue_size -= packet->packet_size;
+        KeReleaseInStackQueuedSpinLock(&lock_handle);
+
+        windivert_read_service_request(context, packet, timestamp, request);
+
+        timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+        KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+    }
+
+    if (context->shutdown_recv && context->shutdown_recv_enabled &&
+            IsListEmpty(&context->packet_queue) &&
+            IsListEmpty(&context->work_queue))
+    {
+        // The handle has shutdown, the queue is empty, and no more packets
+        // will be queued.  Notify any remaining requests.
+        while (context->state == WINDIVERT_CONTEXT_STATE_OPEN)
+        {
+            status = WdfIoQueueRetrieveNextRequest(context->read_queue,
+                &request);
+            if (!NT_SUCCESS(status))
+            {
+                break;
+            }
+            KeReleaseInStackQueuedSpinLock(&lock_handle);
+            WdfRequestComplete(request, STATUS_PIPE_EMPTY);
+            KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+        }
+    }
+    KeReleaseInStackQueuedSpinLock(&lock_handle);
+}
+
+/*
+ * Check for the fast-path: if nothing is queued and a read request is
+ * pending, then the request can be completed directly from the classify
+ * callout.  Returns the request (and its sequence number), or NULL.
+ */
+static WDFREQUEST windivert_queue_fast_request(context_t context,
+    BOOL outbound, UINT32 *sequence_ptr)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    WDFREQUEST request = NULL;
+    NTSTATUS status;
+
+    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+    if (context->state == WINDIVERT_CONTEXT_STATE_OPEN &&
+        !context->shutdown_recv && IsListEmpty(&context->packet_queue) &&
+        IsListEmpty(&context->work_queue) &&
+        (!outbound || context->nat == NULL))
+    {
+        status = WdfIoQueueRetrieveNextRequest(context->read_queue,
+            &request);
+        request = (!NT_SUCCESS(status)? NULL: request);
+        *sequence_ptr = (request != NULL? context->sequence++: 0);
+    }
+    KeReleaseInStackQueuedSpinLock(&lock_handle);
+    return request;
+}
+
+/*
+ * Append a packet to the work queue and schedule the worker.  Returns FALSE
+ * (and frees the packet) if the context is no longer accepting packets.
+ */
+static BOOL windivert_queue_work_packet(context_t context, packet_t work,
+    UINT64 flags)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    PLIST_ENTRY old_entry = NULL;
+
+    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+    if (context->state != WINDIVERT_CONTEXT_STATE_OPEN)
+    {
+        KeReleaseInStackQueuedSpinLock(&lock_handle);
+        windivert_free_packet(work);
+        return FALSE;
+    }
+    if (context->shutdown_recv && context->shutdown_recv_enabled)
+    {
+        if ((flags & WINDIVERT_FLAG_SNIFF) != 0)
+        {
+            KeReleaseInStackQueuedSpinLock(&lock_handle);
+            WINDIVERT_TRACE(context, work->timestamp, WINDIVERT_TRACE_DROP,
+                WINDIVERT_TRACE_DROP_CLOSED, work->packet_len);
+            windivert_free_packet(work);
+            return FALSE;
+        }
+        work->match = FALSE;
+    }
+    context->work_queue_length++;
+    if (context->work_queue_length > WINDIVERT_WORK_QUEUE_LENGTH_MAX)
+    {
+        // The work queue is full; as an emergency we drop packets.
+        old_entry = RemoveHeadList(&context->work_queue);
+        context->work_queue_length--;
+    }
+    InsertTailList(&context->work_queue, &work->entry);
+    WdfWorkItemEnqueue(context->worker);
+    KeReleaseInStackQueuedSpinLock(&lock_handle);
+    
+    if (old_entry != NULL)
+    {
+        work = CONTAINING_RECORD(old_entry, struct packet_s, entry);
+        WINDIVERT_TRACE(context, work->timestamp, WINDIVERT_TRACE_DROP,
+            WINDIVERT_TRACE_DROP_WORK_QUEUE_FULL, work->packet_len);
+        windivert_free_packet(work);
+    }
+    return TRUE;
+}
+
+/*
+ * Queue a packet.
+ */
+static void windivert_queue_packet(context_t context, packet_t packet)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    PLIST_ENTRY old_entry;
+    packet_t old_packet;
+    ULONGLONG length;
+    LONGLONG timestamp;
+    BOOL timeout;
+
+    timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+    while (TRUE)
+    {
+        if (context->state != WINDIVERT_CONTEXT_STATE_OPEN)
+        {
+            KeReleaseInStackQueuedSpinLock(&lock_handle);
+            windivert_inject_packet(packet);
+            return;
+        }
+        if (packet->packet_size > context->packet_queue_maxsize)
+        {
+            // (Corner case) the packet is larger than the max queue size:
+            KeReleaseInStackQueuedSpinLock(&lock_handle);
+            WINDIVERT_TRACE(context, timestamp, WINDIVERT_TRACE_DROP,
+                WINDIVERT_TRACE_DROP_OVERSIZE, packet->packet_len);
+            windivert_free_packet(packet);
+            return;
+        }
+        timeout = WINDIVERT_TIMEOUT(context, packet->timestamp, timestamp);
+        if (timeout)
+        {
+            // (Corner case) the packet has already expired:
+            KeReleaseInStackQueuedSpinLock(&lock_handle);
+            WINDIVERT_TRACE(context, timestamp, WINDIVERT_TRACE_DROP,
+                WINDIVERT_TRACE_DROP_TIMEOUT, packet->packet_len);
+            windivert_free_packet(packet);
+            return;
+        }
+
+        if (context->packet_queue_size + packet->packet_size >
+                context->packet_queue_maxsize ||
+            context->packet_queue_length + 1 > context->packet_queue_maxlength)
+        {
+            // The queue is full; drop a packet & try again:
+            old_entry = RemoveHeadList(&context->packet_queue);
+            old_packet = CONTAINING_RECORD(old_entry, struct packet_s, entry);
+            context->packet_queue_length--;
+            context->packet_queue_size -= old_packet->packet_size;
+            KeReleaseInStackQueuedSpinLock(&lock_handle);
+            DEBUG("DROP: packet queue is full, dropping packet");
+            WINDIVERT_TRACE(context, timestamp, WINDIVERT_TRACE_DROP,
+                WINDIVERT_TRACE_DROP_PACKET_QUEUE_FULL,
+                old_packet->packet_len);
+            windivert_free_packet(old_packet);
+            timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+            KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+            continue;
+        }
+        else
+        {
+            // Queue the packet:
+            packet->sequence = context->sequence++;
+            InsertTailList(&context->packet_queue, &packet->entry);
+            context->packet_queue_length++;
+            context->packet_queue_size += packet->packet_size;
+            length = context->packet_queue_length;
+            break;
+        }
+    }
+    KeReleaseInStackQueuedSpinLock(&lock_handle);
+    WINDIVERT_TRACE(context, timestamp, WINDIVERT_TRACE_QUEUE, 0,
+        (UINT32)length);
+
+    DEBUG("PACKET: queued packet (packet=%p)", packet);
+
+    return;
+}
+
+/*
+ * Move packets from the work queue to the packet queue, then service any
+ * pending read requests.
+ */
+static void windivert_queue_service(context_t context)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    PLIST_ENTRY entry;
+    packet_t work;
+    UINT redirect;
+
+    KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+    while (context->state == WINDIVERT_CONTEXT_STATE_OPEN &&
+            !IsListEmpty(&context->work_queue))
+    {
+        entry = RemoveHeadList(&context->work_queue);
+        context->work_queue_length--;
+        work = CONTAINING_RECORD(entry, struct packet_s, entry);
+        redirect = WINDIVERT_NAT_RESULT_IGNORE;
+        if (work->match && work->outbound && context->nat != NULL)
+        {
+            redirect = windivert_redirect(context, work);
+        }
+        KeReleaseInStackQueuedSpinLock(&lock_handle);
+
+        switch (redirect)
+        {
+            case WINDIVERT_NAT_RESULT_REFLECT:
+                windivert_inject_packet(work);
+                break;
+            case WINDIVERT_NAT_RESULT_DROP:
+                WINDIVERT_TRACE(context, work->timestamp, WINDIVERT_TRACE_DROP,
+                    WINDIVERT_TRACE_DROP_REDIRECT, work->packet_len);
+                windivert_free_packet(work);
+                break;
+            default:
+                if (work->match)
+                {
+                    windivert_queue_packet(context, work);
+                }
+                else
+                {
+                    windivert_inject_packet(work);
+                }
+                break;
+        }
+
+        KeAcquireInStackQueuedSpinLock(&context->lock, &lock_handle);
+    }
+    KeReleaseInStackQueuedSpinLock(&lock_handle);
+
+    windivert_read_service(context);
+}
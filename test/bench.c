@@ -0,0 +1,1676 @@
+/*
+ * bench.c
+ * (C) 2021, all rights reserved,
+ *
+ * This file is part of WinDivert.
+ *
+ * WinDivert is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * WinDivert is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * WinDivert helper benchmarks.
+ *
+ * None of the benchmarks open a WinDivert handle, so the driver does not
+ * need to be installed.  Usage:
+ *
+ *     bench.exe [name ...]
+ *
+ * runs the named benchmarks (default all).
+ *
+ * Build (Linux):
+ *
+ *     gcc -O2 -fno-strict-aliasing -pthread -Ishim -I../include -I../dll \
+ *         bench.c -o bench
+ *
+ * On Linux the DLL (dll/windivert.c) is built into the benchmark against the
+ * Win32 shim in test/shim/, which has no driver, so only the helper
+ * functions work.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+
+#ifdef _WIN32
+#include "windivert.h"
+#else
+#include "windivert.c"
+#endif
+
+/*
+ * Benchmark entry.
+ */
+struct bench
+{
+    const char *name;
+    BOOL (*func)(void);
+};
+
+/*
+ * Prototypes.
+ */
+static BOOL bench_clause(void);
+static BOOL bench_encap(void);
+static BOOL bench_optimize(void);
+static BOOL bench_scale(void);
+static BOOL bench_sketch(void);
+static BOOL bench_apistats(void);
+static BOOL bench_merge(void);
+static BOOL bench_dedup(void);
+static BOOL bench_compare(void);
+static BOOL bench_tcpstats(void);
+static BOOL bench_xlat(void);
+static BOOL bench_anon(void);
+
+/*
+ * Benchmarks.
+ */
+static const struct bench benches[] =
+{
+    {"clause",      bench_clause},
+    {"encap",       bench_encap},
+    {"optimize",    bench_optimize},
+    {"scale",       bench_scale},
+    {"sketch",      bench_sketch},
+    {"apistats",    bench_apistats},
+    {"merge",       bench_merge},
+    {"dedup",       bench_dedup},
+    {"compare",     bench_compare},
+    {"tcpstats",    bench_tcpstats},
+    {"xlat",        bench_xlat},
+    {"anon",        bench_anon},
+};
+
+/*
+ * Timer.
+ */
+static double bench_freq;
+
+static double bench_now(void)
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart / bench_freq;
+}
+
+/*
+ * Synthetic IPv4 TCP/UDP packet (no payload).  Returns the length.
+ */
+#define BENCH_TCP           6
+#define BENCH_UDP           17
+
+static UINT bench_packet(UINT8 *packet, UINT8 protocol, UINT32 src,
+    UINT32 dst, UINT16 src_port, UINT16 dst_port)
+{
+    UINT len = 20 + (protocol == BENCH_TCP? 20: 8);
+
+    memset(packet, 0, len);
+    packet[0]  = 0x45;                      // IPv4, 20 byte header
+    packet[2]  = (UINT8)(len >> 8);
+    packet[3]  = (UINT8)len;
+    packet[8]  = 64;                        // TTL
+    packet[9]  = protocol;
+    packet[12] = (UINT8)(src >> 24);
+    packet[13] = (UINT8)(src >> 16);
+    packet[14] = (UINT8)(src >> 8);
+    packet[15] = (UINT8)src;
+    packet[16] = (UINT8)(dst >> 24);
+    packet[17] = (UINT8)(dst >> 16);
+    packet[18] = (UINT8)(dst >> 8);
+    packet[19] = (UINT8)dst;
+    packet[20] = (UINT8)(src_port >> 8);
+    packet[21] = (UINT8)src_port;
+    packet[22] = (UINT8)(dst_port >> 8);
+    packet[23] = (UINT8)dst_port;
+    if (protocol == BENCH_TCP)
+    {
+        packet[32] = 0x50;                  // 20 byte header
+        packet[33] = 0x10;                  // ACK
+    }
+    else
+    {
+        packet[25] = 8;                     // UDP length
+    }
+    return len;
+}
+
+/*
+ * Main.
+ */
+int main(int argc, char **argv)
+{
+    const size_t num_benches = sizeof(benches) / sizeof(benches[0]);
+    LARGE_INTEGER freq;
+    size_t i;
+    int j;
+    BOOL found;
+
+#ifndef _WIN32
+    WinDivertDllEntry(NULL, DLL_PROCESS_ATTACH, NULL);
+#endif
+    QueryPerformanceFrequency(&freq);
+    bench_freq = (double)freq.QuadPart;
+
+    for (j = 1; j < argc; j++)
+    {
+        found = FALSE;
+        for (i = 0; !found && i < num_benches; i++)
+        {
+            found = (strcmp(argv[j], benches[i].name) == 0);
+        }
+        if (!found)
+        {
+            fprintf(stderr, "usage: %s [", argv[0]);
+            for (i = 0; i < num_benches; i++)
+            {
+                fprintf(stderr, "%s%s", (i == 0? "": "|"), benches[i].name);
+            }
+            fprintf(stderr, "] ...\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (i = 0; i < num_benches; i++)
+    {
+        found = (argc == 1);
+        for (j = 1; !found && j < argc; j++)
+        {
+            found = (strcmp(argv[j], benches[i].name) == 0);
+        }
+        if (!found)
+        {
+            continue;
+        }
+        printf("%s:\n", benches[i].name);
+        if (!benches[i].func())
+        {
+            fprintf(stderr, "error: benchmark \"%s\" failed (err = %d)\n",
+                benches[i].name, GetLastError());
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Clause filter update latency.  Each update removes one clause and adds a
+ * replacement, then gets the object; it is compared with compiling the
+ * equivalent filter string from scratch.
+ */
+static BOOL bench_clause(void)
+{
+    static const UINT sizes[] = {50, 150, 250};
+    static char object[65536], filter[32768];
+    const UINT reps = 2000;
+    PWINDIVERT_CLAUSE_FILTER clause_filter;
+    UINT ids[250], i, j, k;
+    char clause[64];
+    double start, update, compile;
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        clause_filter = WinDivertHelperClauseFilterCreate(
+            WINDIVERT_LAYER_NETWORK, 0);
+        if (clause_filter == NULL)
+        {
+            return FALSE;
+        }
+        filter[0] = '\0';
+        for (j = 0; j < sizes[i]; j++)
+        {
+            snprintf(clause, sizeof(clause),
+                "ip.DstAddr == 10.0.%u.%u and tcp.DstPort == %u",
+                j / 256, j % 256, 1000 + j);
+            if (!WinDivertHelperClauseFilterAdd(clause_filter, clause,
+                    &ids[j], NULL, NULL))
+            {
+                goto failed;
+            }
+            snprintf(filter + strlen(filter), sizeof(filter) - strlen(filter),
+                "%s(%s)", (j == 0? "": " or "), clause);
+        }
+
+        // Replace clauses round-robin, so on average half of the object
+        // moves:
+        start = bench_now();
+        for (j = 0; j < reps; j++)
+        {
+            k = j % sizes[i];
+            snprintf(clause, sizeof(clause),
+                "ip.DstAddr == 10.1.%u.%u and tcp.DstPort == %u",
+                k / 256, k % 256, 2000 + k);
+            if (!WinDivertHelperClauseFilterRemove(clause_filter, ids[k]) ||
+                !WinDivertHelperClauseFilterAdd(clause_filter, clause,
+                    &ids[k], NULL, NULL) ||
+                !WinDivertHelperClauseFilterGetObject(clause_filter, object,
+                    sizeof(object)))
+            {
+                goto failed;
+            }
+        }
+        update = (bench_now() - start) / reps;
+
+        start = bench_now();
+        for (j = 0; j < reps; j++)
+        {
+            if (!WinDivertHelperCompileFilter(filter,
+                    WINDIVERT_LAYER_NETWORK, object, sizeof(object), NULL,
+                    NULL))
+            {
+                goto failed;
+            }
+        }
+        compile = (bench_now() - start) / reps;
+
+        printf("    %u clauses: update %.1fus, recompile %.1fus (%.1fx)\n",
+            sizes[i], update * 1e6, compile * 1e6, compile / update);
+        WinDivertHelperClauseFilterFree(clause_filter);
+    }
+    return TRUE;
+
+failed:
+    WinDivertHelperClauseFilterFree(clause_filter);
+    return FALSE;
+}
+
+/*
+ * Tunnel encapsulation cost.  A 512B TCP packet is encapsulated into the
+ * headroom and decapsulated again, one packet at a time and as a batch of
+ * 64, for each tunnel type and outer IP version.  The first round trip is
+ * checked to end where it started.
+ */
+static BOOL bench_encap(void)
+{
+    static const char *names[] = {"IPIP", "GRE", "UDP", "VXLAN"};
+    static const UINT32 src_addr[4] = {0x0A000001, 0, 0, 0x20010DB8};
+    static const UINT32 dst_addr[4] = {0x0A000002, 0, 0, 0x20010DB8};
+    static UINT8 buf[WINDIVERT_ENCAP_HDR_MAXLEN + 512], original[512];
+    static UINT8 batch[64 * 512],
+        output[64 * (WINDIVERT_ENCAP_HDR_MAXLEN + 512)];
+    static WINDIVERT_ADDRESS addr[64];
+    const UINT reps = 500000, batch_reps = 5000, len = 512, count = 64;
+    const UINT headroom = WINDIVERT_ENCAP_HDR_MAXLEN;
+    WINDIVERT_ENCAP encap;
+    UINT8 *packet = buf + headroom;
+    PVOID out, back;
+    UINT out_len, back_len, output_len, batch_len, i;
+    double start, single, batched;
+    int type, ipv6;
+
+    (VOID)bench_packet(original, BENCH_TCP, 0x0A0000AA, 0x0A0000BB, 1024,
+        80);
+    memset(original + 40, 0xAA, len - 40);
+    original[2] = (UINT8)(len >> 8);
+    original[3] = (UINT8)len;
+    WinDivertHelperCalcChecksums(original, len, NULL, 0);
+    for (i = 0; i < count; i++)
+    {
+        memcpy(batch + i * len, original, len);
+    }
+    batch_len = count * len;
+
+    for (type = WINDIVERT_ENCAP_IPIP; type <= WINDIVERT_ENCAP_VXLAN; type++)
+    {
+        for (ipv6 = 0; ipv6 <= 1; ipv6++)
+        {
+            if (!WinDivertHelperEncapInit(&encap, (WINDIVERT_ENCAP_TYPE)type,
+                    ipv6, src_addr, dst_addr, 1234, 4789, 42))
+            {
+                return FALSE;
+            }
+
+            memcpy(packet, original, len);
+            start = 0.0;
+            for (i = 0; i <= reps; i++)
+            {
+                if (!WinDivertHelperEncap(&encap, packet, len, headroom, len,
+                        &out, &out_len, NULL) ||
+                    !WinDivertHelperDecap(&encap, out, out_len, &back,
+                        &back_len, NULL))
+                {
+                    return FALSE;
+                }
+                if (i == 0)
+                {
+                    if (back != packet || back_len != len ||
+                        memcmp(back, original, len) != 0)
+                    {
+                        fprintf(stderr, "error: bad %s round trip\n",
+                            names[type]);
+                        return FALSE;
+                    }
+                    start = bench_now();    // The first round trip is untimed.
+                }
+            }
+            single = bench_now() - start;
+
+            start = 0.0;
+            for (i = 0; i <= batch_reps; i++)
+            {
+                if (!WinDivertHelperEncapBatch(&encap, batch, batch_len,
+                        output, sizeof(output), &output_len, addr,
+                        sizeof(addr)) ||
+                    !WinDivertHelperDecapBatch(&encap, output, output_len,
+                        &output_len, addr, sizeof(addr)))
+                {
+                    return FALSE;
+                }
+                if (i == 0)
+                {
+                    if (output_len != batch_len ||
+                        memcmp(output, batch, batch_len) != 0)
+                    {
+                        fprintf(stderr, "error: bad %s batch round trip\n",
+                            names[type]);
+                        return FALSE;
+                    }
+                    start = bench_now();
+                }
+            }
+            batched = bench_now() - start;
+
+            printf("    %-5s/IPv%c +%2uB %.1fns/packet, batch %.1fns/packet\n",
+                names[type], (ipv6? '6': '4'), (UINT)encap.Length,
+                single * 1e9 / reps, batched * 1e9 / (batch_reps * count));
+        }
+    }
+    return TRUE;
+}
+
+/*
+ * Profile-guided filter optimization.  A filter whose common case is its
+ * last operand is profiled on a synthetic mix (70% DNS, 20% HTTPS, 10%
+ * other TCP).  The optimized object is formatted back to a string and
+ * profiled again, so the tests executed per packet can be compared.  The
+ * original and optimized objects must agree on every packet, and
+ * WinDivertHelperEvalFilter() is timed with each.
+ */
+static BOOL bench_optimize(void)
+{
+    static const char filter[] =
+        "(tcp and tcp.DstPort == 8080) or (tcp and tcp.DstPort == 22) or "
+        "(udp and udp.DstPort == 123) or tcp.DstPort == 443 or "
+        "udp.DstPort == 53";
+    static WINDIVERT_FILTER_STATS stats[4096];
+    static UINT8 packets[256 * 40];
+    static char original[4096], optimized[4096], formatted[4096];
+    WINDIVERT_ADDRESS addr[256];
+    UINT64 tests[2] = {0};
+    UINT lens[256], len = 0, i, j, k, pos;
+    const UINT count = 256, reps = 20;
+    const char *objects[2] = {original, optimized};
+    double start, optimize, eval[2];
+
+    memset(addr, 0, sizeof(addr));
+    for (i = 0; i < count; i++)
+    {
+        k = i % 10;
+        lens[i] = bench_packet(packets + len, (k < 7? BENCH_UDP: BENCH_TCP),
+            0x0A000001 + i, 0x0A000002, (UINT16)(40000 + i),
+            (UINT16)(k < 7? 53: k < 9? 443: 5000 + i));
+        len += lens[i];
+        addr[i].Layer    = WINDIVERT_LAYER_NETWORK;
+        addr[i].Outbound = 1;
+    }
+
+    memset(stats, 0, sizeof(stats));
+    if (!WinDivertHelperProfileFilter(filter, WINDIVERT_LAYER_NETWORK,
+            packets, len, addr, count * sizeof(WINDIVERT_ADDRESS), stats,
+            sizeof(stats)))
+    {
+        return FALSE;
+    }
+    for (i = 0; i < sizeof(stats) / sizeof(stats[0]); i++)
+    {
+        tests[0] += stats[i].Count;
+    }
+    start = bench_now();
+    if (!WinDivertHelperOptimizeFilter(filter, WINDIVERT_LAYER_NETWORK,
+            stats, sizeof(stats), optimized, sizeof(optimized), NULL, NULL))
+    {
+        return FALSE;
+    }
+    optimize = bench_now() - start;
+
+    memset(stats, 0, sizeof(stats));
+    if (!WinDivertHelperFormatFilter(optimized, WINDIVERT_LAYER_NETWORK,
+            formatted, sizeof(formatted)) ||
+        !WinDivertHelperProfileFilter(formatted, WINDIVERT_LAYER_NETWORK,
+            packets, len, addr, count * sizeof(WINDIVERT_ADDRESS), stats,
+            sizeof(stats)))
+    {
+        return FALSE;
+    }
+    for (i = 0; i < sizeof(stats) / sizeof(stats[0]); i++)
+    {
+        tests[1] += stats[i].Count;
+    }
+
+    if (!WinDivertHelperCompileFilter(filter, WINDIVERT_LAYER_NETWORK,
+            original, sizeof(original), NULL, NULL))
+    {
+        return FALSE;
+    }
+    for (i = 0, pos = 0; i < count; pos += lens[i], i++)
+    {
+        if (WinDivertHelperEvalFilter(original, packets + pos, lens[i],
+                &addr[i]) !=
+            WinDivertHelperEvalFilter(optimized, packets + pos, lens[i],
+                &addr[i]))
+        {
+            fprintf(stderr, "error: optimized filter does not match the "
+                "original filter for packet %u\n", i);
+            return FALSE;
+        }
+    }
+    for (k = 0; k < 2; k++)
+    {
+        start = bench_now();
+        for (j = 0; j < reps; j++)
+        {
+            for (i = 0, pos = 0; i < count; pos += lens[i], i++)
+            {
+                (VOID)WinDivertHelperEvalFilter(objects[k], packets + pos,
+                    lens[i], &addr[i]);
+            }
+        }
+        eval[k] = (bench_now() - start) / (reps * count);
+    }
+
+    printf("    %.2f tests/packet, optimized %.2f tests/packet "
+        "(optimize %.1fus)\n", (double)tests[0] / count,
+        (double)tests[1] / count, optimize * 1e6);
+    printf("    eval %.1fns/packet, optimized %.1fns/packet\n",
+        eval[0] * 1e9, eval[1] * 1e9);
+    return TRUE;
+}
+
+/*
+ * Filter compile and evaluation cost against filter length.  Filters of
+ * 64, 1024 and 4096 tests are disjunctions of (address, port) clauses.
+ * Evaluation is of the compiled object (so includes decoding it) on a
+ * packet that matches the last clause and on one that matches none.  Also
+ * reports whether the object still fits in a (REFLECT layer) packet.
+ */
+static BOOL bench_scale(void)
+{
+    static const UINT sizes[] = {64, 1024, 4096};
+    static char filter[160000], object[200000];
+    WINDIVERT_ADDRESS addr;
+    UINT8 packet[2][40];
+    UINT reps, clauses, len, i, j, k;
+    double start, compile, eval[2];
+
+    memset(&addr, 0, sizeof(addr));
+    addr.Layer = WINDIVERT_LAYER_NETWORK;
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        clauses = sizes[i] / 2;
+        for (j = 0, len = 0; j < clauses; j++)
+        {
+            len += snprintf(filter + len, sizeof(filter) - len,
+                "%s(ip.DstAddr == 10.0.%u.%u and tcp.DstPort == %u)",
+                (j == 0? "": " or "), j / 256, j % 256, 1000 + j);
+        }
+        j = clauses - 1;
+        (VOID)bench_packet(packet[0], BENCH_TCP, 0x0A0000FF,
+            0x0A000000 | j, 1024, 1000 + j);
+        (VOID)bench_packet(packet[1], BENCH_TCP, 0x0A0000FF,
+            0x0A000000 | j, 1024, 999);
+
+        reps = 65536 / sizes[i];
+        start = bench_now();
+        for (j = 0; j < reps; j++)
+        {
+            if (!WinDivertHelperCompileFilter(filter,
+                    WINDIVERT_LAYER_NETWORK, object, sizeof(object), NULL,
+                    NULL))
+            {
+                fprintf(stderr, "error: failed to compile %u tests "
+                    "(err = %d)\n", sizes[i], GetLastError());
+                return FALSE;
+            }
+        }
+        compile = (bench_now() - start) / reps;
+
+        for (k = 0; k < 2; k++)
+        {
+            start = bench_now();
+            for (j = 0; j < reps; j++)
+            {
+                if (WinDivertHelperEvalFilter(object, packet[k],
+                        sizeof(packet[k]), &addr) != (k == 0))
+                {
+                    fprintf(stderr, "error: bad result for %u tests\n",
+                        sizes[i]);
+                    return FALSE;
+                }
+            }
+            eval[k] = (bench_now() - start) / reps;
+        }
+
+        len = (UINT)strlen(object) + 1;
+        printf("    %4u tests: compile %.1fus, eval %.1fus (match) "
+            "%.1fus (no match), object %uB%s\n", sizes[i], compile * 1e6,
+            eval[0] * 1e6, eval[1] * 1e6, len,
+            (len > WINDIVERT_MTU_MAX? " (REFLECT truncated)": ""));
+    }
+    return TRUE;
+}
+
+/*
+ * Streaming sketch update cost.  256 packet batches from 50000 sources to
+ * 16 destinations are fed to each sketch type; the distinct sketch counts
+ * sources per destination, and its error against the exact count is
+ * reported.
+ */
+static BOOL bench_sketch(void)
+{
+    static const char *names[] = {"count-min", "top-k", "distinct"};
+    static UINT8 packets[64][256 * 40], seen[16][50000];
+    static UINT lens[64];
+    const UINT batches = 64, count = 256, reps = 20;
+    PWINDIVERT_SKETCH sketch;
+    WINDIVERT_SKETCH_KEY key;
+    UINT32 rng = 1, src, dst, exact[16];
+    UINT64 estimate;
+    UINT i, j, k;
+    double start, update, error;
+
+    memset(seen, 0, sizeof(seen));
+    memset(exact, 0, sizeof(exact));
+    for (i = 0; i < batches; i++)
+    {
+        lens[i] = 0;
+        for (j = 0; j < count; j++)
+        {
+            rng = rng * 1103515245 + 12345;
+            src = (rng >> 8) % 50000;
+            dst = (rng >> 4) % 16;
+            exact[dst] += (seen[dst][src] == 0);
+            seen[dst][src] = 1;
+            lens[i] += bench_packet(packets[i] + lens[i], BENCH_UDP,
+                0x0A000000 + src, 0xC0A80000 + dst, (UINT16)(1024 + j),
+                53);
+        }
+    }
+
+    for (k = 0; k < 3; k++)
+    {
+        sketch = (k == 0?
+            WinDivertHelperSketchCreate(WINDIVERT_SKETCH_COUNT_MIN,
+                WINDIVERT_SKETCH_KEY_SRCADDR, 0, 4096, 4, 0):
+                  k == 1?
+            WinDivertHelperSketchCreate(WINDIVERT_SKETCH_TOP_K,
+                WINDIVERT_SKETCH_KEY_SRCADDR, 0, 256, 0, 0):
+            WinDivertHelperSketchCreate(WINDIVERT_SKETCH_DISTINCT,
+                WINDIVERT_SKETCH_KEY_DSTADDR, WINDIVERT_SKETCH_KEY_SRCADDR,
+                1024, 12, 0));
+        if (sketch == NULL)
+        {
+            return FALSE;
+        }
+        start = bench_now();
+        for (i = 0; i < reps; i++)
+        {
+            for (j = 0; j < batches; j++)
+            {
+                if (!WinDivertHelperSketchUpdate(sketch, packets[j],
+                        lens[j]))
+                {
+                    WinDivertHelperSketchFree(sketch);
+                    return FALSE;
+                }
+            }
+        }
+        update = (bench_now() - start) / (reps * batches * count);
+        printf("    %-9s %.1fns/packet", names[k], update * 1e9);
+
+        if (k == 2)
+        {
+            error = 0.0;
+            for (dst = 0; dst < 16; dst++)
+            {
+                memset(&key, 0, sizeof(key));
+                key.DstAddr[0] = 0xC0A80000 + dst;
+                key.DstAddr[1] = 0x0000FFFF;    // IPv4-mapped
+                if (!WinDivertHelperSketchQuery(sketch, &key, &estimate))
+                {
+                    WinDivertHelperSketchFree(sketch);
+                    return FALSE;
+                }
+                error += (estimate > exact[dst]?
+                    (double)(estimate - exact[dst]):
+                    (double)(exact[dst] - estimate)) / exact[dst];
+            }
+            printf(", %.1f%% mean error", 100.0 * error / 16);
+        }
+        printf("\n");
+        WinDivertHelperSketchFree(sketch);
+    }
+    return TRUE;
+}
+
+#ifndef _WIN32
+/*
+ * API statistics unit checks.  The Linux build compiles the DLL into the
+ * benchmark, so calls can be recorded directly with exact durations (the
+ * shim's performance counter ticks in ns).  Checks the histogram bucket
+ * boundaries, error code slot saturation, and the aggregation over all
+ * enabled handles for a NULL handle.
+ */
+static BOOL bench_apistats_check(void)
+{
+    static const struct
+    {
+        UINT64 ns;
+        UINT bucket;
+    } buckets[] =
+    {
+        {0, 0}, {1, 1}, {2, 2}, {3, 2}, {4, 3}, {1023, 10}, {1024, 11},
+        {((UINT64)1 << 30) - 1, 30}, {(UINT64)1 << 30, 31},
+        {((UINT64)1 << 31) - 1, 31}, {(UINT64)1 << 31, 31},
+        {~(UINT64)0, 31},
+    };
+    HANDLE handle[3] = {(HANDLE)0x1000, (HANDLE)0x2004, (HANDLE)0x3008};
+    PWINDIVERT_API_COUNTERS counters[3];
+    WINDIVERT_API_STATS stats;
+    PWINDIVERT_API_ENTRY entry;
+    UINT i;
+    BOOL result = FALSE;
+
+    for (i = 0; i < sizeof(buckets) / sizeof(buckets[0]); i++)
+    {
+        if (WinDivertApiStatsBucket(buckets[i].ns) != buckets[i].bucket)
+        {
+            fprintf(stderr, "error: %llu ns in bucket %u, expected %u\n",
+                buckets[i].ns, WinDivertApiStatsBucket(buckets[i].ns),
+                buckets[i].bucket);
+            return FALSE;
+        }
+    }
+
+    for (i = 0; i < 3; i++)
+    {
+        if (!WinDivertHelperApiStatsEnable(handle[i], TRUE) ||
+            (entry = WinDivertApiStatsLookup(handle[i])) == NULL)
+        {
+            goto exit;
+        }
+        counters[i] = &entry->counters[WINDIVERT_API_RECV];
+    }
+
+    // Handle 0: one call per bucket boundary (bar the clamped one), then
+    // six distinct errors; only the first four get a slot.
+    for (i = 0; i < sizeof(buckets) / sizeof(buckets[0]) - 1; i++)
+    {
+        WinDivertApiStatsRecord(counters[0], buckets[i].ns, TRUE, 0, 2, 4);
+    }
+    for (i = 1; i <= 6; i++)
+    {
+        WinDivertApiStatsRecord(counters[0], 100, FALSE, i, 0, 4);
+    }
+    WinDivertApiStatsRecord(counters[0], 100, FALSE, 1, 0, 4);
+    WinDivertApiStatsRecord(counters[0], 100, FALSE, ERROR_IO_PENDING, 0,
+        4);
+    if (!WinDivertHelperApiStatsQuery(handle[0], WINDIVERT_API_RECV,
+            &stats) ||
+        stats.Calls != 18 || stats.Errors != 7 || stats.Pending != 1 ||
+        stats.Packets != 22 || stats.Slots != 44 ||
+        stats.MaxTime != (UINT64)1 << 31 || stats.Histogram[0] != 1 ||
+        stats.Histogram[2] != 2 || stats.Histogram[7] != 8 ||
+        stats.Histogram[31] != 3 ||
+        stats.ErrorCode[0] != 1 || stats.ErrorCount[0] != 2 ||
+        stats.ErrorCode[3] != 4 || stats.ErrorCount[3] != 1)
+    {
+        fprintf(stderr, "error: bad single handle API statistics\n");
+        goto exit;
+    }
+
+    // Handle 1: errors 5 and 1; handle 2 is disabled before the query.
+    WinDivertApiStatsRecord(counters[1], 50, FALSE, 5, 0, 1);
+    WinDivertApiStatsRecord(counters[1], 50, FALSE, 1, 0, 1);
+    WinDivertApiStatsRecord(counters[1], ~(UINT64)0, TRUE, 0, 1, 1);
+    WinDivertApiStatsRecord(counters[2], 10, TRUE, 0, 1, 1);
+    if (!WinDivertHelperApiStatsEnable(handle[2], FALSE))
+    {
+        goto exit;
+    }
+    if (!WinDivertHelperApiStatsQuery(NULL, WINDIVERT_API_RECV, &stats) ||
+        stats.Calls != 21 || stats.Errors != 9 || stats.Pending != 1 ||
+        stats.Packets != 23 || stats.Slots != 45 ||
+        stats.MaxTime != windivert_api_max_ticks ||
+        stats.Histogram[31] != 4 || stats.Histogram[4] != 0 ||
+        stats.ErrorCode[0] != 1 || stats.ErrorCount[0] != 3 ||
+        stats.ErrorCode[3] != 4 || stats.ErrorCount[3] != 1 ||
+        stats.P99Time != (UINT64)1 << 31)
+    {
+        fprintf(stderr, "error: bad aggregated API statistics\n");
+        goto exit;
+    }
+    if (WinDivertHelperApiStatsQuery(handle[2], WINDIVERT_API_RECV,
+            &stats) || GetLastError() != ERROR_NOT_FOUND)
+    {
+        fprintf(stderr, "error: disabled handle still has statistics\n");
+        goto exit;
+    }
+    result = TRUE;
+
+exit:
+    (VOID)WinDivertHelperApiStatsEnable(handle[0], FALSE);
+    (VOID)WinDivertHelperApiStatsEnable(handle[1], FALSE);
+    (VOID)WinDivertHelperApiStatsEnable(handle[2], FALSE);
+    return result;
+}
+#endif
+
+/*
+ * API statistics overhead.  WinDivertSendEx() is called on an event handle
+ * (so the ioctl fails immediately) with statistics disabled, enabled for
+ * another handle, and enabled for the handle itself.  Each case is the
+ * best of several rounds.
+ */
+static BOOL bench_apistats(void)
+{
+    static const char *names[] = {"disabled", "other handle enabled",
+        "enabled"};
+    WINDIVERT_ADDRESS addr;
+    WINDIVERT_API_STATS stats;
+    HANDLE handle, other;
+    UINT8 packet[64];
+    const UINT reps = 200000, rounds = 5;
+    UINT i, j, k;
+    double start, best[3];
+    BOOL result = FALSE;
+
+#ifndef _WIN32
+    if (!bench_apistats_check())
+    {
+        return FALSE;
+    }
+#endif
+    handle = CreateEvent(NULL, FALSE, FALSE, NULL);
+    other  = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (handle == NULL || other == NULL)
+    {
+        goto exit;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.Layer = WINDIVERT_LAYER_NETWORK;
+    (VOID)bench_packet(packet, BENCH_UDP, 0x0A000001, 0x0A000002, 1024, 53);
+
+    for (k = 0; k < 3; k++)
+    {
+        best[k] = 1e9;
+    }
+    for (i = 0; i < rounds; i++)
+    {
+        for (k = 0; k < 3; k++)
+        {
+            if ((k == 1 && !WinDivertHelperApiStatsEnable(other, TRUE)) ||
+                (k == 2 && !WinDivertHelperApiStatsEnable(handle, TRUE)))
+            {
+                goto exit;
+            }
+            start = bench_now();
+            for (j = 0; j < reps; j++)
+            {
+                (VOID)WinDivertSendEx(handle, packet, 28, NULL, 0, &addr,
+                    sizeof(addr), NULL);
+            }
+            start = (bench_now() - start) / reps;
+            best[k] = (start < best[k]? start: best[k]);
+            if (k == 2)
+            {
+                if (!WinDivertHelperApiStatsQuery(handle, WINDIVERT_API_SEND,
+                        &stats) ||
+                    stats.Calls + stats.Pending != reps)
+                {
+                    goto exit;
+                }
+                (VOID)WinDivertHelperApiStatsEnable(handle, FALSE);
+                (VOID)WinDivertHelperApiStatsEnable(other, FALSE);
+            }
+        }
+    }
+    for (k = 0; k < 3; k++)
+    {
+        printf("    %-20s %.1fns/call", names[k], best[k] * 1e9);
+        if (k != 0)
+        {
+            printf(" (%+.1fns)", (best[k] - best[0]) * 1e9);
+        }
+        printf("\n");
+    }
+    result = TRUE;
+
+exit:
+    if (handle != NULL)
+    {
+        CloseHandle(handle);
+    }
+    if (other != NULL)
+    {
+        CloseHandle(other);
+    }
+    return result;
+}
+
+/*
+ * Timestamp merge throughput.  Random batches of 1..64 packets are pushed
+ * to random streams with increasing timestamps, and popped after each
+ * push.  The output is checked to be complete and in timestamp order.
+ */
+static BOOL bench_merge(void)
+{
+    static const UINT sizes[] = {2, 8, 32};
+    static UINT8 batch[64 * 28], buf[256 * 28];
+    static WINDIVERT_ADDRESS addr[64], out[256];
+    const UINT per_stream = 200000;
+    PWINDIVERT_MERGE merge;
+    UINT32 rng = 1;
+    UINT pushed[32], total, popped, count, addr_len, pop_len, i, j, k, n;
+    INT64 clock, last;
+    double start, elapsed;
+
+    for (i = 0; i < 64; i++)
+    {
+        (VOID)bench_packet(batch + i * 28, BENCH_UDP, 0x0A000001 + i,
+            0x0A000002, (UINT16)(1024 + i), 53);
+        memset(&addr[i], 0, sizeof(addr[i]));
+        addr[i].Layer = WINDIVERT_LAYER_NETWORK;
+    }
+
+    for (k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++)
+    {
+        merge = WinDivertHelperMergeCreate(sizes[k], 4 * 1024 * 1024, 0, 0);
+        if (merge == NULL)
+        {
+            return FALSE;
+        }
+        memset(pushed, 0, sizeof(pushed));
+        total = sizes[k] * per_stream;
+        popped = 0;
+        clock = 0;
+        last = 0;
+        start = bench_now();
+        for (n = 0; popped < total; n++)
+        {
+            if (n < sizes[k])
+            {
+                i = n;                      // Every stream pushes first.
+                count = 1;
+            }
+            else
+            {
+                rng = rng * 1103515245 + 12345;
+                i = (rng >> 8) % sizes[k];
+                count = 1 + (rng >> 20) % 64;
+            }
+            if (pushed[i] + count > per_stream)
+            {
+                count = per_stream - pushed[i];
+            }
+            for (j = 0; j < count; j++)
+            {
+                addr[j].Timestamp = ++clock;
+            }
+            if (!WinDivertHelperMergePush(merge, i, batch, count * 28, addr,
+                    count * sizeof(WINDIVERT_ADDRESS)))
+            {
+                WinDivertHelperMergeFree(merge);
+                return FALSE;
+            }
+            pushed[i] += count;
+            do
+            {
+                addr_len = sizeof(out);
+                if (!WinDivertHelperMergePop(merge, buf, sizeof(buf),
+                        &pop_len, out, &addr_len, NULL,
+                        /*flush=*/(clock == (INT64)total)))
+                {
+                    WinDivertHelperMergeFree(merge);
+                    return FALSE;
+                }
+                count = addr_len / sizeof(WINDIVERT_ADDRESS);
+                for (j = 0; j < count; j++)
+                {
+                    if (out[j].Timestamp <= last)
+                    {
+                        fprintf(stderr, "error: merge output out of "
+                            "order\n");
+                        WinDivertHelperMergeFree(merge);
+                        return FALSE;
+                    }
+                    last = out[j].Timestamp;
+                }
+                popped += count;
+            }
+            while (count != 0);
+        }
+        elapsed = bench_now() - start;
+        WinDivertHelperMergeFree(merge);
+        if (popped != total)
+        {
+            fprintf(stderr, "error: merge lost packets\n");
+            return FALSE;
+        }
+        printf("    %2u streams %.1fMpps (%.1fns/packet)\n", sizes[k],
+            total / elapsed / 1e6, elapsed * 1e9 / total);
+    }
+    return TRUE;
+}
+
+/*
+ * Duplicate suppression throughput and accuracy.  Batches of 64 UDP packets
+ * hold 32 unique packets and a copy of each with a lower TTL (as if
+ * captured again after forwarding); every duplicate must be found.  Then
+ * N unique packets are checked twice against a 65536 entry table, and the
+ * duplicates missed due to eviction are reported for several N/size.
+ */
+static BOOL bench_dedup(void)
+{
+    static const UINT lens[] = {64, 512, 1500}, loads[] = {8, 4, 2, 1};
+    static UINT8 batch[64 * 1500];
+    static WINDIVERT_ADDRESS addr[64];
+    const UINT reps = 2000, table = 65536;
+    PWINDIVERT_DEDUP dedup;
+    UINT32 id = 0;
+    UINT len, dup_count, dups, i, j, k, n;
+    INT64 clock = 0;
+    double start, elapsed;
+
+    for (i = 0; i < 64; i++)
+    {
+        memset(&addr[i], 0, sizeof(addr[i]));
+        addr[i].Layer = WINDIVERT_LAYER_NETWORK;
+    }
+
+    for (k = 0; k < sizeof(lens) / sizeof(lens[0]); k++)
+    {
+        len = lens[k];
+        memset(batch, 0, sizeof(batch));
+        for (i = 0; i < 64; i++)
+        {
+            (VOID)bench_packet(batch + i * len, BENCH_UDP,
+                0x0A000000 + i % 32, 0x0A0000FF, 1024, 53);
+            batch[i * len + 2]  = (UINT8)(len >> 8);
+            batch[i * len + 3]  = (UINT8)len;
+            batch[i * len + 24] = (UINT8)((len - 20) >> 8);
+            batch[i * len + 25] = (UINT8)(len - 20);
+            batch[i * len + 8]  = (i < 32? 64: 63);
+        }
+        dedup = WinDivertHelperDedupCreate(1 << 20, 1 << 30, 0);
+        if (dedup == NULL)
+        {
+            return FALSE;
+        }
+        dups = 0;
+        start = bench_now();
+        for (n = 0; n < reps; n++)
+        {
+            for (i = 0; i < 64; i++)
+            {
+                *(UINT32 *)(batch + i * len + 28) = id + i % 32;
+                addr[i].Timestamp = ++clock;
+            }
+            id += 32;
+            if (!WinDivertHelperDedupCheck(dedup, batch, 64 * len, addr,
+                    sizeof(addr), NULL, &dup_count))
+            {
+                WinDivertHelperDedupFree(dedup);
+                return FALSE;
+            }
+            dups += dup_count;
+        }
+        elapsed = bench_now() - start;
+        WinDivertHelperDedupFree(dedup);
+        if (dups != reps * 32)
+        {
+            fprintf(stderr, "error: dedup found %u of %u duplicates\n",
+                dups, reps * 32);
+            return FALSE;
+        }
+        printf("    %4uB %.1fMpps (%.1fGbit/s)\n", len,
+            reps * 64 / elapsed / 1e6, reps * 64 * len * 8 / elapsed / 1e9);
+    }
+
+    // Missed duplicates: N unique packets are checked twice.
+    for (k = 0; k < sizeof(loads) / sizeof(loads[0]); k++)
+    {
+        dedup = WinDivertHelperDedupCreate(table, 1 << 30, 0);
+        if (dedup == NULL)
+        {
+            return FALSE;
+        }
+        for (i = 0; i < 64; i++)
+        {
+            (VOID)bench_packet(batch + i * 64, BENCH_UDP, 0x0A000001,
+                0x0A000002, 1024, 53);
+            batch[i * 64 + 3]  = 64;
+            batch[i * 64 + 25] = 44;
+        }
+        dups = 0;
+        for (j = 0; j < 2; j++)
+        {
+            for (n = 0; n < table / loads[k]; n += 64)
+            {
+                for (i = 0; i < 64; i++)
+                {
+                    *(UINT32 *)(batch + i * 64 + 28) = n + i;
+                    addr[i].Timestamp = ++clock;
+                }
+                if (!WinDivertHelperDedupCheck(dedup, batch, 64 * 64, addr,
+                        sizeof(addr), NULL, &dup_count))
+                {
+                    WinDivertHelperDedupFree(dedup);
+                    return FALSE;
+                }
+                dups += dup_count;
+            }
+        }
+        printf("    N/size=%.3f %.2f%% duplicates missed\n", 1.0 / loads[k],
+            100.0 - 100.0 * dups * loads[k] / table);
+        WinDivertHelperDedupFree(dedup);
+    }
+    return TRUE;
+}
+
+/*
+ * Random filter for bench_compare().
+ */
+static UINT32 bench_rng = 1;
+
+static UINT bench_random(UINT n)
+{
+    bench_rng = bench_rng * 1103515245 + 12345;
+    return (bench_rng >> 8) % n;
+}
+
+static void bench_filter(char *filter, size_t size, UINT depth)
+{
+    static const char *atoms[] = {"tcp", "udp", "outbound", "inbound",
+        "ip", "ipv6", "tcp.DstPort == %u", "tcp.DstPort < %u",
+        "udp.DstPort >= %u", "tcp.SrcPort != %u", "ip.TTL > %u",
+        "ip.SrcAddr == 10.0.0.%u", "ip.DstAddr >= 10.0.0.%u"};
+    static const UINT values[] = {1, 4, 53, 64, 80, 443};
+    const UINT num_atoms = sizeof(atoms) / sizeof(atoms[0]);
+    char left[512], right[512];
+    UINT atom, value;
+
+    if (depth == 0 || bench_random(4) == 0)
+    {
+        // The parser only negates tests, not bracketed expressions.
+        atom  = bench_random(num_atoms);
+        value = (atom >= num_atoms - 2? bench_random(9):
+            values[bench_random(sizeof(values) / sizeof(values[0]))]);
+        snprintf(left, sizeof(left), atoms[atom], value);
+        snprintf(filter, size, "%s%s", (bench_random(3) == 0? "!": ""),
+            left);
+        return;
+    }
+    bench_filter(left, sizeof(left), depth - 1);
+    bench_filter(right, sizeof(right), depth - 1);
+    snprintf(filter, size, "(%s) %s (%s)", left,
+        (bench_random(2) == 0? "and": "or"), right);
+}
+
+/*
+ * Filter comparison cost and soundness.  Random filter pairs at the NETWORK
+ * layer are compared, and each reported relation is checked against the
+ * filter engine on random packets.  Relations are sound if no packet
+ * contradicts them.
+ */
+static BOOL bench_compare(void)
+{
+    static const UINT16 ports[] = {1, 4, 52, 53, 54, 64, 80, 443, 444};
+    static UINT8 packets[400][40];
+    static UINT lens[400];
+    static WINDIVERT_ADDRESS addr[400];
+    static char filter[2][512], object[2][8192];
+    const char *error;
+    const UINT pairs = 10000, count = 400;
+    UINT32 relation, relations[6] = {0};
+    UINT unsound = 0, i, j;
+    BOOL match[2];
+    double start, elapsed = 0.0;
+
+    for (i = 0; i < count; i++)
+    {
+        lens[i] = bench_packet(packets[i],
+            (bench_random(2) == 0? BENCH_TCP: BENCH_UDP),
+            0x0A000000 + bench_random(9), 0x0A000000 + bench_random(9),
+            ports[bench_random(sizeof(ports) / sizeof(ports[0]))],
+            ports[bench_random(sizeof(ports) / sizeof(ports[0]))]);
+        packets[i][8] = (UINT8)bench_random(128);
+        memset(&addr[i], 0, sizeof(addr[i]));
+        addr[i].Layer    = WINDIVERT_LAYER_NETWORK;
+        addr[i].Outbound = bench_random(2);
+        addr[i].IPChecksum = addr[i].TCPChecksum = addr[i].UDPChecksum = 1;
+    }
+
+    for (i = 0; i < pairs; i++)
+    {
+        for (j = 0; j < 2; j++)
+        {
+            bench_filter(filter[j], sizeof(filter[j]), 3);
+            if (!WinDivertHelperCompileFilter(filter[j],
+                    WINDIVERT_LAYER_NETWORK, object[j], sizeof(object[j]),
+                    &error, NULL))
+            {
+                fprintf(stderr, "error: %s: %s\n", filter[j], error);
+                return FALSE;
+            }
+        }
+        start = bench_now();
+        if (!WinDivertHelperCompareFilter(object[0], object[1],
+                WINDIVERT_LAYER_NETWORK, &relation))
+        {
+            return FALSE;
+        }
+        elapsed += bench_now() - start;
+        for (j = 0; j < 6; j++)
+        {
+            relations[j] += ((relation & (1 << j)) != 0);
+        }
+
+        for (j = 0; j < count; j++)
+        {
+            match[0] = WinDivertHelperEvalFilter(object[0], packets[j],
+                lens[j], &addr[j]);
+            match[1] = WinDivertHelperEvalFilter(object[1], packets[j],
+                lens[j], &addr[j]);
+            if (((relation & WINDIVERT_FILTER_RELATION_EMPTY1) &&
+                    match[0]) ||
+                ((relation & WINDIVERT_FILTER_RELATION_EMPTY2) &&
+                    match[1]) ||
+                ((relation & WINDIVERT_FILTER_RELATION_DISJOINT) &&
+                    match[0] && match[1]) ||
+                ((relation & WINDIVERT_FILTER_RELATION_SUBSET) &&
+                    match[0] && !match[1]) ||
+                ((relation & WINDIVERT_FILTER_RELATION_SUPERSET) &&
+                    !match[0] && match[1]))
+            {
+                fprintf(stderr, "error: unsound relation 0x%x:\n"
+                    "    %s\n    %s\n", relation, filter[0], filter[1]);
+                unsound++;
+                break;
+            }
+        }
+    }
+
+    printf("    %u pairs, %.1fus/comparison, %u unsound\n", pairs,
+        elapsed * 1e6 / pairs, unsound);
+    printf("    empty1 %u, empty2 %u, disjoint %u, subset %u, superset %u, "
+        "inexact %u\n", relations[0], relations[1], relations[2],
+        relations[3], relations[4], relations[5]);
+    return (unsound == 0);
+}
+
+/*
+ * Synthetic TCP flow for bench_tcpstats().
+ */
+struct bench_flow
+{
+    UINT32 client;                  // Client address.
+    UINT32 cseq;                    // Client sequence number.
+    UINT32 sseq;                    // Server sequence number.
+    UINT step;                      // Next segment.
+    BOOL zero;                      // Last server ACK was a zero window.
+};
+
+#define BENCH_FLOW_DATA     8       // Data segments per flow.
+#define BENCH_FLOW_MSS      100
+
+#define BENCH_TCP_FIN       0x01
+#define BENCH_TCP_SYN       0x02
+#define BENCH_TCP_ACK       0x10
+
+static UINT bench_segment(UINT8 *packet, const struct bench_flow *flow,
+    BOOL client, UINT32 seq, UINT32 ack, UINT8 flags, UINT16 window,
+    UINT len)
+{
+    UINT32 addr = (client? flow->client: 0xC0A80001);
+    UINT16 port = (UINT16)(1024 + flow->client % 60000);
+    UINT total;
+
+    total = bench_packet(packet, BENCH_TCP, addr,
+        (client? 0xC0A80001: flow->client), (client? port: 80),
+        (client? 80: port)) + len;
+    memset(packet + 40, 0, len);
+    packet[2]  = (UINT8)(total >> 8);
+    packet[3]  = (UINT8)total;
+    packet[24] = (UINT8)(seq >> 24);
+    packet[25] = (UINT8)(seq >> 16);
+    packet[26] = (UINT8)(seq >> 8);
+    packet[27] = (UINT8)seq;
+    packet[28] = (UINT8)(ack >> 24);
+    packet[29] = (UINT8)(ack >> 16);
+    packet[30] = (UINT8)(ack >> 8);
+    packet[31] = (UINT8)ack;
+    packet[33] = flags;
+    packet[34] = (UINT8)(window >> 8);
+    packet[35] = (UINT8)window;
+    return total;
+}
+
+/*
+ * TCP statistics throughput.  A fixed number of concurrent synthetic flows
+ * are interleaved at random.  Each flow is a handshake, BENCH_FLOW_DATA
+ * acknowledged data segments, and a FIN exchange, with 5% retransmitted
+ * segments, 5% swapped segment pairs, and 2% zero window ACKs.  The
+ * summaries are checked against these counts, and only the update and pop
+ * calls are timed.
+ */
+static BOOL bench_tcpstats(void)
+{
+    static const UINT sizes[] = {1000, 10000, 100000};
+    static UINT8 batch[64 * (40 + BENCH_FLOW_MSS)];
+    static WINDIVERT_ADDRESS addr[64];
+    static WINDIVERT_TCPSTATS_FLOW summaries[256];
+    const UINT total = 4000000;
+    struct bench_flow *flows, *flow;
+    PWINDIVERT_TCPSTATS stats;
+    UINT32 next_client = 0;
+    UINT64 expect[4], found[4], lost;
+    UINT packets, count, len, pop_count, data, i, j, k;
+    INT64 clock = 0;
+    double start, elapsed;
+    BOOL flush, done;
+
+    for (i = 0; i < 64; i++)
+    {
+        memset(&addr[i], 0, sizeof(addr[i]));
+        addr[i].Layer = WINDIVERT_LAYER_NETWORK;
+    }
+
+    for (k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++)
+    {
+        flows = (struct bench_flow *)calloc(sizes[k], sizeof(*flows));
+        stats = WinDivertHelperTcpStatsCreate(sizes[k] + sizes[k] / 4,
+            (INT64)1 << 40);
+        if (flows == NULL || stats == NULL)
+        {
+            goto exit;
+        }
+        for (i = 0; i < sizes[k]; i++)
+        {
+            flows[i].client = 0x0A000000 + next_client++;
+        }
+        memset(expect, 0, sizeof(expect));
+        memset(found, 0, sizeof(found));
+        elapsed = 0.0;
+        flush = FALSE;
+
+        for (packets = 0; !flush; packets += count)
+        {
+            flush = (packets >= total);
+            for (count = 0, len = 0; !flush && count < 62; )
+            {
+                flow = &flows[bench_random(sizes[k])];
+                data = (flow->step < 3? 0: (flow->step - 3) / 2);
+                done = FALSE;
+                if (flow->step == 0)
+                {
+                    flow->cseq = bench_random(0xFFFFFFFF);
+                    flow->sseq = bench_random(0xFFFFFFFF);
+                    len += bench_segment(batch + len, flow, TRUE,
+                        flow->cseq++, 0, BENCH_TCP_SYN, 65535, 0);
+                }
+                else if (flow->step == 1)
+                {
+                    len += bench_segment(batch + len, flow, FALSE,
+                        flow->sseq++, flow->cseq, BENCH_TCP_SYN |
+                        BENCH_TCP_ACK, 65535, 0);
+                }
+                else if (flow->step == 2)
+                {
+                    len += bench_segment(batch + len, flow, TRUE,
+                        flow->cseq, flow->sseq, BENCH_TCP_ACK, 65535, 0);
+                }
+                else if (data < BENCH_FLOW_DATA && flow->step % 2 != 0)
+                {
+                    j = bench_random(100);
+                    if (j < 5 && data + 1 < BENCH_FLOW_DATA)
+                    {
+                        // Swapped pair: the first segment fills a gap.
+                        len += bench_segment(batch + len, flow, TRUE,
+                            flow->cseq + BENCH_FLOW_MSS, flow->sseq,
+                            BENCH_TCP_ACK, 65535, BENCH_FLOW_MSS);
+                        addr[count++].Timestamp = ++clock;
+                        len += bench_segment(batch + len, flow, TRUE,
+                            flow->cseq, flow->sseq, BENCH_TCP_ACK, 65535,
+                            BENCH_FLOW_MSS);
+                        flow->cseq += 2 * BENCH_FLOW_MSS;
+                        flow->step += 2;
+                        expect[1]++;
+                    }
+                    else
+                    {
+                        len += bench_segment(batch + len, flow, TRUE,
+                            flow->cseq, flow->sseq, BENCH_TCP_ACK, 65535,
+                            BENCH_FLOW_MSS);
+                        if (j < 10)
+                        {
+                            addr[count++].Timestamp = ++clock;
+                            len += bench_segment(batch + len, flow, TRUE,
+                                flow->cseq, flow->sseq, BENCH_TCP_ACK,
+                                65535, BENCH_FLOW_MSS);
+                            expect[0]++;
+                        }
+                        flow->cseq += BENCH_FLOW_MSS;
+                    }
+                }
+                else if (data < BENCH_FLOW_DATA)
+                {
+                    j = (!flow->zero && bench_random(100) < 2);
+                    len += bench_segment(batch + len, flow, FALSE,
+                        flow->sseq, flow->cseq, BENCH_TCP_ACK,
+                        (j? 0: 65535), 0);
+                    flow->zero = j;
+                    expect[2] += j;
+                }
+                else if (data == BENCH_FLOW_DATA && flow->step % 2 != 0)
+                {
+                    len += bench_segment(batch + len, flow, TRUE,
+                        flow->cseq++, flow->sseq, BENCH_TCP_FIN |
+                        BENCH_TCP_ACK, 65535, 0);
+                }
+                else if (data == BENCH_FLOW_DATA)
+                {
+                    len += bench_segment(batch + len, flow, FALSE,
+                        flow->sseq++, flow->cseq, BENCH_TCP_FIN |
+                        BENCH_TCP_ACK, 65535, 0);
+                }
+                else
+                {
+                    len += bench_segment(batch + len, flow, TRUE,
+                        flow->cseq, flow->sseq, BENCH_TCP_ACK, 65535, 0);
+                    done = TRUE;
+                    expect[3]++;
+                }
+                flow->step++;
+                addr[count++].Timestamp = ++clock;
+                if (done)
+                {
+                    memset(flow, 0, sizeof(*flow));
+                    flow->client = 0x0A000000 + next_client++;
+                }
+            }
+
+            start = bench_now();
+            if (!WinDivertHelperTcpStatsUpdate(stats, batch, len, addr,
+                    count * sizeof(WINDIVERT_ADDRESS)))
+            {
+                goto exit;
+            }
+            do
+            {
+                if (!WinDivertHelperTcpStatsPop(stats, summaries,
+                        sizeof(summaries) / sizeof(summaries[0]),
+                        &pop_count, flush))
+                {
+                    goto exit;
+                }
+                for (i = 0; i < pop_count; i++)
+                {
+                    found[0] += summaries[i].Client.Retransmits;
+                    found[1] += summaries[i].Client.OutOfOrder;
+                    found[2] += summaries[i].Server.ZeroWindows;
+                    found[3] += ((summaries[i].Flags &
+                        WINDIVERT_TCPSTATS_FLOW_FIN) != 0);
+                }
+            }
+            while (pop_count != 0);
+            elapsed += bench_now() - start;
+        }
+
+        if (!WinDivertHelperTcpStatsQuery(stats, NULL, NULL, &lost))
+        {
+            goto exit;
+        }
+        if (lost != 0 || memcmp(expect, found, sizeof(expect)) != 0)
+        {
+            fprintf(stderr, "error: tcpstats counts differ (retransmits "
+                "%llu/%llu, out-of-order %llu/%llu, zero windows %llu/%llu, "
+                "closed %llu/%llu, lost %llu)\n", found[0], expect[0],
+                found[1], expect[1], found[2], expect[2], found[3],
+                expect[3], lost);
+            goto exit;
+        }
+        printf("    %6u flows %.1fMpps (%.1fns/packet), %llu closed\n",
+            sizes[k], packets / elapsed / 1e6, elapsed * 1e9 / packets,
+            expect[3]);
+        free(flows);
+        WinDivertHelperTcpStatsFree(stats);
+    }
+    return TRUE;
+
+exit:
+    free(flows);
+    WinDivertHelperTcpStatsFree(stats);
+    return FALSE;
+}
+
+/*
+ * Stateless IPv4/IPv6 translation cost.  TCP packets and ICMP errors are
+ * translated to IPv6 (growing into the headroom) and back again in place.
+ * The first round trip is checked to give valid checksums and to end where
+ * it started.
+ */
+static BOOL bench_xlat(void)
+{
+    static const UINT lens[] = {64, 512, 1400, 0};
+    static UINT8 buf[64 + 1500], check[1500];
+    const UINT reps = 500000, headroom = 64;
+    WINDIVERT_XLAT_ADDR to6, to4;
+    UINT8 *packet = buf + headroom;
+    UINT32 prefix[4];
+    PVOID out, back;
+    UINT len, out_len, back_len, i, k;
+    double start, elapsed;
+
+    memset(&to4, 0, sizeof(to4));
+    to4.SrcAddr[0] = 0x0A000001;
+    to4.DstAddr[0] = 0x0A000002;
+    memset(&to6, 0, sizeof(to6));
+    if (!WinDivertHelperParseIPv6Address("64:ff9b::", prefix) ||
+        !WinDivertHelperXlatEmbedAddress(prefix, 96, to4.SrcAddr[0],
+            to6.SrcAddr) ||
+        !WinDivertHelperXlatEmbedAddress(prefix, 96, to4.DstAddr[0],
+            to6.DstAddr))
+    {
+        return FALSE;
+    }
+
+    for (k = 0; k < sizeof(lens) / sizeof(lens[0]); k++)
+    {
+        len = lens[k];
+        if (len != 0)
+        {
+            (VOID)bench_packet(packet, BENCH_TCP, to4.SrcAddr[0],
+                to4.DstAddr[0], 1024, 80);
+            memset(packet + 40, 0xAA, len - 40);
+        }
+        else
+        {
+            // Port unreachable, quoting the first 8 bytes of the UDP packet
+            // the destination sent:
+            len = 20 + 8 + 28;
+            (VOID)bench_packet(packet + 28, BENCH_UDP, to4.DstAddr[0],
+                to4.SrcAddr[0], 53, 1024);
+            (VOID)bench_packet(packet, BENCH_UDP, to4.SrcAddr[0],
+                to4.DstAddr[0], 0, 0);
+            packet[9]  = 1;                 // ICMP
+            packet[20] = 3;                 // Destination unreachable
+            packet[21] = 3;                 // Port unreachable
+            packet[22] = packet[23] = 0;
+        }
+        packet[2] = (UINT8)(len >> 8);
+        packet[3] = (UINT8)len;
+        WinDivertHelperCalcChecksums(packet, len, NULL, 0);
+
+        start = 0.0;
+        for (i = 0; i <= reps; i++)
+        {
+            if (!WinDivertHelperXlat(&to6, NULL, 0, packet, len, headroom,
+                    len, &out, &out_len, NULL))
+            {
+                return FALSE;
+            }
+            if (i == 0)
+            {
+                memcpy(check, out, out_len);
+                WinDivertHelperCalcChecksums(check, out_len, NULL, 0);
+                if (memcmp(check, out, out_len) != 0)
+                {
+                    fprintf(stderr, "error: bad IPv6 checksums\n");
+                    return FALSE;
+                }
+            }
+            if (!WinDivertHelperXlat(&to4, NULL, 0, out, out_len, 0,
+                    out_len, &back, &back_len, NULL))
+            {
+                return FALSE;
+            }
+            if (i == 0)
+            {
+                memcpy(check, back, back_len);
+                WinDivertHelperCalcChecksums(check, back_len, NULL, 0);
+                if (back != packet || back_len != len ||
+                    memcmp(check, back, back_len) != 0)
+                {
+                    fprintf(stderr, "error: bad IPv4 round trip\n");
+                    return FALSE;
+                }
+                start = bench_now();    // The first round trip is untimed.
+            }
+        }
+        elapsed = bench_now() - start;
+        if (lens[k] != 0)
+        {
+            printf("    %4uB TCP", len);
+        }
+        else
+        {
+            printf("    ICMP error");
+        }
+        printf(" %.1fns/translation\n", elapsed * 1e9 / (2 * reps));
+    }
+    return TRUE;
+}
+
+/*
+ * Address anonymization throughput.  Random (uncached) IPv4/IPv6 addresses
+ * use a minimal cache, and the traces draw 1M lookups from 100000 hosts in
+ * 1024 subnets (/24 or /64).  Each workload is run with and without AES-NI
+ * (if the CPU has it), and both must give the same addresses.
+ */
+static BOOL bench_anon(void)
+{
+    static const char *names[] = {"IPv4 uncached", "IPv6 uncached",
+        "IPv4 trace", "IPv6 trace"};
+    static UINT32 hosts[100000][4];
+    const UINT num_hosts = 100000, uncached = 20000, trace = 1000000;
+    UINT8 key[WINDIVERT_ANON_KEY_SIZE];
+    PWINDIVERT_ANON anon;
+    UINT32 out[4], rng;
+    UINT64 digest[2][4], addresses, hits;
+    UINT count, i, j, k, w;
+    BOOL ipv6;
+    double start, elapsed[2];
+
+    for (i = 0; i < sizeof(key); i++)
+    {
+        key[i] = (UINT8)bench_random(256);
+    }
+    for (w = 0; w < 4; w++)
+    {
+        ipv6  = (w % 2 != 0);
+        count = (w < 2? uncached: trace);
+        for (i = 0; i < num_hosts; i++)
+        {
+            for (j = 0; j < 4; j++)
+            {
+                hosts[i][j] = bench_random(0x10000) << 16 |
+                    bench_random(0x10000);
+            }
+            if (w == 2)
+            {
+                hosts[i][0] = 0x0A000000 | bench_random(1024) << 8 |
+                    (hosts[i][0] & 0xFF);
+            }
+            else if (w == 3)
+            {
+                hosts[i][3] = 0x20010DB8;   // 2001:db8:x::/64
+                hosts[i][2] = bench_random(1024);
+            }
+        }
+        rng = bench_rng;
+        for (k = 0; k < 2; k++)
+        {
+            bench_rng = rng;                // Same trace for both.
+            anon = WinDivertHelperAnonCreate(key, (w < 2? 3: 1 << 18),
+                (k == 0? 0: WINDIVERT_ANON_FLAG_NO_AESNI));
+            if (anon == NULL)
+            {
+                return FALSE;
+            }
+            digest[k][w] = 0;
+            start = bench_now();
+            for (i = 0; i < count; i++)
+            {
+                j = (w < 2? i: bench_random(num_hosts));
+                if (!WinDivertHelperAnonAddress(anon, hosts[j], out, ipv6))
+                {
+                    WinDivertHelperAnonFree(anon);
+                    return FALSE;
+                }
+                digest[k][w] = digest[k][w] * 31 + out[0] + out[3];
+            }
+            elapsed[k] = bench_now() - start;
+            (VOID)WinDivertHelperAnonQuery(anon, &addresses, &hits, NULL);
+            WinDivertHelperAnonFree(anon);
+        }
+        if (digest[0][w] != digest[1][w])
+        {
+            fprintf(stderr, "error: AES-NI and table mappings differ\n");
+            return FALSE;
+        }
+        printf("    %-13s %.2fM vs %.2fM addr/s (AES-NI vs table)", names[w],
+            count / elapsed[0] / 1e6, count / elapsed[1] / 1e6);
+        if (w >= 2)
+        {
+            printf(", %.0f%% cache hits", 100.0 * hits / addresses);
+        }
+        printf("\n");
+    }
+    return TRUE;
+}
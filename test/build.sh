@@ -38,8 +38,12 @@
 CC=i686-w64-mingw32-gcc
 $CC -fno-ident -s -O2 -I../include/ test.c \
     -o ../install/MINGW/i386/test.exe -lWinDivert -L"../install/MINGW/i386/" 
+$CC -fno-ident -s -O2 -I../include/ bench.c \
+    -o ../install/MINGW/i386/bench.exe -lWinDivert -L"../install/MINGW/i386/"
 
 CC=x86_64-w64-mingw32-gcc
 $CC -fno-ident -s -O2 -I../include/ test.c -o ../install/MINGW/amd64/test.exe \
     -lWinDivert -L"../install/MINGW/amd64/"
+$CC -fno-ident -s -O2 -I../include/ bench.c \
+    -o ../install/MINGW/amd64/bench.exe -lWinDivert -L"../install/MINGW/amd64/"
 
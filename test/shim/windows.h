@@ -0,0 +1,1007 @@
+/*
+ * windows.h
+ * (C) 2021, all rights reserved,
+ *
+ * This file is part of WinDivert.
+ *
+ * WinDivert is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * WinDivert is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Minimal Win32 shim (POSIX) for building the DLL helpers on Linux, so that
+ * the helper benchmarks (test/bench.c) can run without Windows.  The DLL
+ * sources are built into the same translation unit, so the shim functions
+ * are static.
+ *
+ * Heaps, critical sections, events, TLS, timers, Interlocked* and the
+ * performance counter are implemented.  There is no driver: opening the
+ * device fails with ERROR_FILE_NOT_FOUND, DeviceIoControl() fails with
+ * ERROR_INVALID_HANDLE, and the service, registry, process and I/O
+ * completion port functions fail with ERROR_NOT_SUPPORTED.
+ */
+
+#ifndef __WINDIVERT_SHIM_WINDOWS_H
+#define __WINDIVERT_SHIM_WINDOWS_H
+
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <wchar.h>
+
+#define __in
+#define __in_opt
+#define __out
+#define __out_opt
+#define __inout
+#define __inout_opt
+#define __declspec(x)
+#define WINAPI
+#define APIENTRY
+#define CALLBACK
+
+#define UNREFERENCED_PARAMETER(x)       ((void)(x))
+#define CONTAINING_RECORD(address, type, field)                         \
+    ((type *)((char *)(address) - offsetof(type, field)))
+
+/*
+ * Types.
+ */
+typedef int8_t INT8;
+typedef uint8_t UINT8, BYTE, BOOLEAN, *PUINT8, *PBYTE, *LPBYTE, *PBOOLEAN;
+typedef int16_t INT16, SHORT;
+typedef uint16_t UINT16, WORD, USHORT, *PUINT16;
+typedef int32_t INT32, LONG, *PLONG;
+typedef uint32_t UINT32, DWORD, ULONG, *PUINT32, *PDWORD, *LPDWORD, *PULONG;
+typedef long long INT64, LONG64, LONGLONG;
+typedef unsigned long long UINT64, ULONG64, ULONGLONG, *PUINT64;
+typedef int BOOL, INT, *PBOOL;
+typedef unsigned int UINT, *PUINT;
+typedef intptr_t INT_PTR, LONG_PTR;
+typedef uintptr_t UINT_PTR, ULONG_PTR, *PULONG_PTR;
+typedef size_t SIZE_T;
+typedef char CHAR, *LPSTR;
+typedef const char *LPCSTR;
+typedef wchar_t WCHAR, *LPWSTR, *PWSTR;
+typedef const wchar_t *LPCWSTR;
+typedef void VOID, *PVOID, *LPVOID;
+typedef const void *LPCVOID;
+typedef void *HANDLE, *HMODULE, *HKEY, *SC_HANDLE;
+typedef LONG LSTATUS;
+
+typedef union
+{
+    struct
+    {
+        DWORD LowPart;
+        LONG HighPart;
+    };
+    LONGLONG QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER;
+
+typedef union
+{
+    struct
+    {
+        DWORD LowPart;
+        DWORD HighPart;
+    };
+    ULONGLONG QuadPart;
+} ULARGE_INTEGER, *PULARGE_INTEGER;
+
+typedef struct
+{
+    ULONG_PTR Internal;
+    ULONG_PTR InternalHigh;
+    DWORD Offset;
+    DWORD OffsetHigh;
+    HANDLE hEvent;
+} OVERLAPPED, *LPOVERLAPPED;
+
+typedef struct
+{
+    DWORD nLength;
+    LPVOID lpSecurityDescriptor;
+    BOOL bInheritHandle;
+} SECURITY_ATTRIBUTES, *LPSECURITY_ATTRIBUTES;
+
+typedef struct
+{
+    pthread_mutex_t mutex;
+} CRITICAL_SECTION, *LPCRITICAL_SECTION;
+
+typedef struct
+{
+    DWORD dwServiceType;
+    DWORD dwCurrentState;
+    DWORD dwControlsAccepted;
+    DWORD dwWin32ExitCode;
+    DWORD dwServiceSpecificExitCode;
+    DWORD dwCheckPoint;
+    DWORD dwWaitHint;
+} SERVICE_STATUS;
+
+typedef DWORD (*LPTHREAD_START_ROUTINE)(LPVOID);
+typedef VOID (*WAITORTIMERCALLBACK)(PVOID, BOOLEAN);
+
+/*
+ * Constants.
+ */
+#define TRUE                            1
+#define FALSE                           0
+#define INVALID_HANDLE_VALUE            ((HANDLE)(LONG_PTR)-1)
+#define INFINITE                        0xFFFFFFFF
+#define MAX_PATH                        260
+
+#define ERROR_SUCCESS                   0
+#define NO_ERROR                        0
+#define ERROR_INVALID_FUNCTION          1
+#define ERROR_FILE_NOT_FOUND            2
+#define ERROR_PATH_NOT_FOUND            3
+#define ERROR_ACCESS_DENIED             5
+#define ERROR_INVALID_HANDLE            6
+#define ERROR_NOT_ENOUGH_MEMORY         8
+#define ERROR_INVALID_DATA              13
+#define ERROR_OUTOFMEMORY               14
+#define ERROR_NOT_SUPPORTED             50
+#define ERROR_OPEN_FAILED               110
+#define ERROR_BAD_PATHNAME              161
+#define ERROR_INVALID_PARAMETER         87
+#define ERROR_INSUFFICIENT_BUFFER       122
+#define ERROR_NO_DATA                   232
+#define ERROR_MORE_DATA                 234
+#define ERROR_INVALID_IMAGE_HASH        577
+#define ERROR_OPERATION_ABORTED         995
+#define ERROR_IO_PENDING                997
+#define ERROR_SERVICE_ALREADY_RUNNING   1056
+#define ERROR_SERVICE_DOES_NOT_EXIST    1060
+#define ERROR_SERVICE_MARKED_FOR_DELETE 1072
+#define ERROR_SERVICE_EXISTS            1073
+#define ERROR_NOT_FOUND                 1168
+#define ERROR_HOST_UNREACHABLE          1232
+#define ERROR_TIMEOUT                   1460
+
+#define WAIT_OBJECT_0                   0
+#define WAIT_ABANDONED                  0x80
+#define WAIT_TIMEOUT                    258
+#define WAIT_FAILED                     0xFFFFFFFF
+
+#define HEAP_NO_SERIALIZE               0x00000001
+#define HEAP_ZERO_MEMORY                0x00000008
+#define TLS_OUT_OF_INDEXES              0xFFFFFFFF
+#define WT_EXECUTEDEFAULT               0x00000000
+
+#define DLL_PROCESS_DETACH              0
+#define DLL_PROCESS_ATTACH              1
+#define DLL_THREAD_ATTACH               2
+#define DLL_THREAD_DETACH               3
+
+#define GENERIC_READ                    0x80000000
+#define GENERIC_WRITE                   0x40000000
+#define OPEN_EXISTING                   3
+#define FILE_ATTRIBUTE_NORMAL           0x00000080
+#define FILE_FLAG_OVERLAPPED            0x40000000
+#define DELETE                          0x00010000
+#define KEY_ALL_ACCESS                  0x000F003F
+#define KEY_SET_VALUE                   0x00000002
+#define HKEY_LOCAL_MACHINE              ((HKEY)(ULONG_PTR)0x80000002)
+#define REG_OPTION_VOLATILE             0x00000001
+#define REG_SZ                          1
+#define REG_DWORD                       4
+#define SC_MANAGER_ALL_ACCESS           0x000F003F
+#define SERVICE_ALL_ACCESS              0x000F01FF
+#define SERVICE_KERNEL_DRIVER           0x00000001
+#define SERVICE_DEMAND_START            0x00000003
+#define SERVICE_ERROR_NORMAL            0x00000001
+
+/*
+ * Last error.
+ */
+static __thread DWORD shim_last_error;
+
+static inline DWORD GetLastError(void)
+{
+    return shim_last_error;
+}
+
+static inline void SetLastError(DWORD error)
+{
+    shim_last_error = error;
+}
+
+/*
+ * Heaps.  Blocks are linked into their heap, so that HeapDestroy() frees
+ * every block, as the helpers rely on.
+ */
+typedef struct shim_block
+{
+    struct shim_block *prev;
+    struct shim_block *next;
+    struct shim_heap *heap;
+    SIZE_T size;
+} SHIM_BLOCK;
+
+typedef struct shim_heap
+{
+    pthread_mutex_t lock;
+    SHIM_BLOCK head;
+} SHIM_HEAP;
+
+#define SHIM_BLOCK_SIZE                                                 \
+    ((sizeof(SHIM_BLOCK) + 15) & ~(SIZE_T)15)
+
+static inline HANDLE HeapCreate(DWORD options, SIZE_T initial, SIZE_T max)
+{
+    SHIM_HEAP *heap = (SHIM_HEAP *)malloc(sizeof(SHIM_HEAP));
+
+    UNREFERENCED_PARAMETER(options);
+    UNREFERENCED_PARAMETER(initial);
+    UNREFERENCED_PARAMETER(max);
+    if (heap == NULL)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+    pthread_mutex_init(&heap->lock, NULL);
+    heap->head.prev = heap->head.next = &heap->head;
+    return (HANDLE)heap;
+}
+
+static inline void shim_link(SHIM_HEAP *heap, SHIM_BLOCK *block)
+{
+    pthread_mutex_lock(&heap->lock);
+    block->heap       = heap;
+    block->prev       = &heap->head;
+    block->next       = heap->head.next;
+    block->next->prev = block;
+    heap->head.next   = block;
+    pthread_mutex_unlock(&heap->lock);
+}
+
+static inline void shim_unlink(SHIM_BLOCK *block)
+{
+    SHIM_HEAP *heap = block->heap;
+
+    pthread_mutex_lock(&heap->lock);
+    block->prev->next = block->next;
+    block->next->prev = block->prev;
+    pthread_mutex_unlock(&heap->lock);
+}
+
+static inline LPVOID HeapAlloc(HANDLE heap, DWORD flags, SIZE_T size)
+{
+    SHIM_BLOCK *block;
+
+    block = (SHIM_BLOCK *)((flags & HEAP_ZERO_MEMORY) != 0?
+        calloc(1, SHIM_BLOCK_SIZE + size): malloc(SHIM_BLOCK_SIZE + size));
+    if (block == NULL)
+    {
+        return NULL;
+    }
+    block->size = size;
+    shim_link((SHIM_HEAP *)heap, block);
+    return (LPVOID)((UINT8 *)block + SHIM_BLOCK_SIZE);
+}
+
+static inline LPVOID HeapReAlloc(HANDLE heap, DWORD flags, LPVOID ptr,
+    SIZE_T size)
+{
+    SHIM_BLOCK *block = (SHIM_BLOCK *)((UINT8 *)ptr - SHIM_BLOCK_SIZE),
+        *new_block;
+    SIZE_T old_size = block->size;
+
+    shim_unlink(block);
+    new_block = (SHIM_BLOCK *)realloc(block, SHIM_BLOCK_SIZE + size);
+    if (new_block == NULL)
+    {
+        shim_link((SHIM_HEAP *)heap, block);
+        return NULL;
+    }
+    if ((flags & HEAP_ZERO_MEMORY) != 0 && size > old_size)
+    {
+        memset((UINT8 *)new_block + SHIM_BLOCK_SIZE + old_size, 0,
+            size - old_size);
+    }
+    new_block->size = size;
+    shim_link((SHIM_HEAP *)heap, new_block);
+    return (LPVOID)((UINT8 *)new_block + SHIM_BLOCK_SIZE);
+}
+
+static inline BOOL HeapFree(HANDLE heap, DWORD flags, LPVOID ptr)
+{
+    SHIM_BLOCK *block;
+
+    UNREFERENCED_PARAMETER(heap);
+    UNREFERENCED_PARAMETER(flags);
+    if (ptr == NULL)
+    {
+        return TRUE;
+    }
+    block = (SHIM_BLOCK *)((UINT8 *)ptr - SHIM_BLOCK_SIZE);
+    shim_unlink(block);
+    free(block);
+    return TRUE;
+}
+
+static inline BOOL HeapDestroy(HANDLE heap0)
+{
+    SHIM_HEAP *heap = (SHIM_HEAP *)heap0;
+    SHIM_BLOCK *block, *next;
+
+    for (block = heap->head.next; block != &heap->head; block = next)
+    {
+        next = block->next;
+        free(block);
+    }
+    pthread_mutex_destroy(&heap->lock);
+    free(heap);
+    return TRUE;
+}
+
+static inline HANDLE GetProcessHeap(void)
+{
+    static SHIM_HEAP *heap = NULL;
+
+    if (heap == NULL)
+    {
+        heap = (SHIM_HEAP *)HeapCreate(0, 0, 0);
+    }
+    return (HANDLE)heap;
+}
+
+/*
+ * Processes.
+ */
+static inline HANDLE GetCurrentProcess(void)
+{
+    return (HANDLE)(LONG_PTR)-1;
+}
+
+static inline BOOL IsWow64Process(HANDLE process, PBOOL result)
+{
+    UNREFERENCED_PARAMETER(process);
+    *result = FALSE;
+    return TRUE;
+}
+
+/*
+ * Time.
+ */
+static inline BOOL QueryPerformanceCounter(LARGE_INTEGER *count)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    count->QuadPart = (LONGLONG)now.tv_sec * 1000000000 + now.tv_nsec;
+    return TRUE;
+}
+
+static inline BOOL QueryPerformanceFrequency(LARGE_INTEGER *freq)
+{
+    freq->QuadPart = 1000000000;
+    return TRUE;
+}
+
+static inline DWORD GetTickCount(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (DWORD)(now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+static inline void Sleep(DWORD ms)
+{
+    usleep((useconds_t)ms * 1000);
+}
+
+/*
+ * Interlocked operations (full barriers, as on Windows).
+ */
+static inline LONG InterlockedIncrement(LONG volatile *p)
+{
+    return __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST);
+}
+
+static inline LONG InterlockedDecrement(LONG volatile *p)
+{
+    return __atomic_sub_fetch(p, 1, __ATOMIC_SEQ_CST);
+}
+
+static inline LONG64 InterlockedIncrement64(LONG64 volatile *p)
+{
+    return __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST);
+}
+
+static inline LONG InterlockedExchange(LONG volatile *p, LONG v)
+{
+    return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST);
+}
+
+static inline PVOID InterlockedExchangePointer(PVOID volatile *p, PVOID v)
+{
+    return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST);
+}
+
+static inline LONG64 InterlockedExchangeAdd64(LONG64 volatile *p, LONG64 v)
+{
+    return __atomic_fetch_add(p, v, __ATOMIC_SEQ_CST);
+}
+
+static inline LONG InterlockedCompareExchange(LONG volatile *p, LONG v,
+    LONG c)
+{
+    __atomic_compare_exchange_n(p, &c, v, FALSE, __ATOMIC_SEQ_CST,
+        __ATOMIC_SEQ_CST);
+    return c;
+}
+
+static inline LONG64 InterlockedCompareExchange64(LONG64 volatile *p,
+    LONG64 v, LONG64 c)
+{
+    __atomic_compare_exchange_n(p, &c, v, FALSE, __ATOMIC_SEQ_CST,
+        __ATOMIC_SEQ_CST);
+    return c;
+}
+
+#define MemoryBarrier()                 __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+/*
+ * Critical sections (recursive, as on Windows).
+ */
+static inline void InitializeCriticalSection(LPCRITICAL_SECTION cs)
+{
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&cs->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+static inline void EnterCriticalSection(LPCRITICAL_SECTION cs)
+{
+    pthread_mutex_lock(&cs->mutex);
+}
+
+static inline void LeaveCriticalSection(LPCRITICAL_SECTION cs)
+{
+    pthread_mutex_unlock(&cs->mutex);
+}
+
+static inline void DeleteCriticalSection(LPCRITICAL_SECTION cs)
+{
+    pthread_mutex_destroy(&cs->mutex);
+}
+
+/*
+ * Events.
+ */
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    BOOL manual;
+    BOOL signaled;
+} SHIM_EVENT;
+
+static inline HANDLE CreateEvent(LPSECURITY_ATTRIBUTES attrs, BOOL manual,
+    BOOL initial, LPCWSTR name)
+{
+    SHIM_EVENT *event = (SHIM_EVENT *)malloc(sizeof(SHIM_EVENT));
+
+    UNREFERENCED_PARAMETER(attrs);
+    UNREFERENCED_PARAMETER(name);
+    if (event == NULL)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+    pthread_mutex_init(&event->lock, NULL);
+    pthread_cond_init(&event->cond, NULL);
+    event->manual   = manual;
+    event->signaled = initial;
+    return (HANDLE)event;
+}
+
+static inline BOOL SetEvent(HANDLE handle)
+{
+    SHIM_EVENT *event = (SHIM_EVENT *)handle;
+
+    pthread_mutex_lock(&event->lock);
+    event->signaled = TRUE;
+    pthread_cond_broadcast(&event->cond);
+    pthread_mutex_unlock(&event->lock);
+    return TRUE;
+}
+
+static inline DWORD WaitForSingleObject(HANDLE handle, DWORD timeout)
+{
+    SHIM_EVENT *event = (SHIM_EVENT *)handle;
+    struct timespec deadline;
+    DWORD result = WAIT_OBJECT_0;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec  += timeout / 1000;
+    deadline.tv_nsec += (long)(timeout % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&event->lock);
+    while (!event->signaled)
+    {
+        if (timeout == INFINITE)
+        {
+            pthread_cond_wait(&event->cond, &event->lock);
+        }
+        else if (pthread_cond_timedwait(&event->cond, &event->lock,
+                &deadline) != 0)
+        {
+            result = WAIT_TIMEOUT;
+            break;
+        }
+    }
+    if (result == WAIT_OBJECT_0 && !event->manual)
+    {
+        event->signaled = FALSE;
+    }
+    pthread_mutex_unlock(&event->lock);
+    return result;
+}
+
+static inline DWORD WaitForMultipleObjects(DWORD count,
+    const HANDLE *handles, BOOL all, DWORD timeout)
+{
+    UNREFERENCED_PARAMETER(count);
+    UNREFERENCED_PARAMETER(handles);
+    UNREFERENCED_PARAMETER(all);
+    UNREFERENCED_PARAMETER(timeout);
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return WAIT_FAILED;
+}
+
+static inline BOOL CloseHandle(HANDLE handle)
+{
+    SHIM_EVENT *event = (SHIM_EVENT *)handle;
+
+    if (handle == NULL || handle == INVALID_HANDLE_VALUE)
+    {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return FALSE;
+    }
+    pthread_cond_destroy(&event->cond);
+    pthread_mutex_destroy(&event->lock);
+    free(event);
+    return TRUE;
+}
+
+/*
+ * Thread local storage.
+ */
+#define SHIM_TLS_MAX                    64
+
+static __thread LPVOID shim_tls[SHIM_TLS_MAX];
+static DWORD shim_tls_count;
+
+static inline DWORD TlsAlloc(void)
+{
+    DWORD idx = __atomic_fetch_add(&shim_tls_count, 1, __ATOMIC_SEQ_CST);
+    return (idx < SHIM_TLS_MAX? idx: TLS_OUT_OF_INDEXES);
+}
+
+static inline BOOL TlsFree(DWORD idx)
+{
+    return (idx < SHIM_TLS_MAX);
+}
+
+static inline LPVOID TlsGetValue(DWORD idx)
+{
+    return (idx < SHIM_TLS_MAX? shim_tls[idx]: NULL);
+}
+
+static inline BOOL TlsSetValue(DWORD idx, LPVOID value)
+{
+    if (idx >= SHIM_TLS_MAX)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    shim_tls[idx] = value;
+    return TRUE;
+}
+
+/*
+ * Timer queue timers (default timer queue only).
+ */
+typedef struct
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    WAITORTIMERCALLBACK callback;
+    PVOID context;
+    DWORD due;
+    DWORD period;
+    BOOL stop;
+} SHIM_TIMER;
+
+static inline BOOL shim_timer_wait(SHIM_TIMER *timer, DWORD ms)
+{
+    struct timespec deadline;
+    BOOL stop;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec  += ms / 1000;
+    deadline.tv_nsec += (long)(ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&timer->lock);
+    while (!timer->stop &&
+           pthread_cond_timedwait(&timer->cond, &timer->lock, &deadline) == 0)
+        ;
+    stop = timer->stop;
+    pthread_mutex_unlock(&timer->lock);
+    return !stop;
+}
+
+static inline void *shim_timer_thread(void *arg)
+{
+    SHIM_TIMER *timer = (SHIM_TIMER *)arg;
+
+    if (!shim_timer_wait(timer, timer->due))
+    {
+        return NULL;
+    }
+    do
+    {
+        timer->callback(timer->context, TRUE);
+    }
+    while (timer->period != 0 && shim_timer_wait(timer, timer->period));
+    return NULL;
+}
+
+static inline BOOL CreateTimerQueueTimer(HANDLE *handle, HANDLE queue,
+    WAITORTIMERCALLBACK callback, PVOID context, DWORD due, DWORD period,
+    ULONG flags)
+{
+    SHIM_TIMER *timer;
+
+    UNREFERENCED_PARAMETER(flags);
+    if (queue != NULL)
+    {
+        SetLastError(ERROR_NOT_SUPPORTED);
+        return FALSE;
+    }
+    timer = (SHIM_TIMER *)calloc(1, sizeof(SHIM_TIMER));
+    if (timer == NULL)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return FALSE;
+    }
+    pthread_mutex_init(&timer->lock, NULL);
+    pthread_cond_init(&timer->cond, NULL);
+    timer->callback = callback;
+    timer->context  = context;
+    timer->due      = due;
+    timer->period   = period;
+    if (pthread_create(&timer->thread, NULL, shim_timer_thread, timer) != 0)
+    {
+        free(timer);
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return FALSE;
+    }
+    *handle = (HANDLE)timer;
+    return TRUE;
+}
+
+/*
+ * Only the blocking (INVALID_HANDLE_VALUE) completion event is supported.
+ */
+static inline BOOL DeleteTimerQueueTimer(HANDLE queue, HANDLE handle,
+    HANDLE event)
+{
+    SHIM_TIMER *timer = (SHIM_TIMER *)handle;
+
+    UNREFERENCED_PARAMETER(queue);
+    UNREFERENCED_PARAMETER(event);
+    pthread_mutex_lock(&timer->lock);
+    timer->stop = TRUE;
+    pthread_cond_broadcast(&timer->cond);
+    pthread_mutex_unlock(&timer->lock);
+    pthread_join(timer->thread, NULL);
+    pthread_cond_destroy(&timer->cond);
+    pthread_mutex_destroy(&timer->lock);
+    free(timer);
+    return TRUE;
+}
+
+/*
+ * No driver.
+ */
+static inline HANDLE CreateFile(LPCWSTR name, DWORD access, DWORD share,
+    LPSECURITY_ATTRIBUTES attrs, DWORD disposition, DWORD flags,
+    HANDLE template_file)
+{
+    UNREFERENCED_PARAMETER(name);
+    UNREFERENCED_PARAMETER(access);
+    UNREFERENCED_PARAMETER(share);
+    UNREFERENCED_PARAMETER(attrs);
+    UNREFERENCED_PARAMETER(disposition);
+    UNREFERENCED_PARAMETER(flags);
+    UNREFERENCED_PARAMETER(template_file);
+    SetLastError(ERROR_FILE_NOT_FOUND);
+    return INVALID_HANDLE_VALUE;
+}
+
+static inline BOOL DeviceIoControl(HANDLE handle, DWORD code, LPVOID in,
+    DWORD in_len, LPVOID out, DWORD out_len, LPDWORD ret_len,
+    LPOVERLAPPED overlapped)
+{
+    UNREFERENCED_PARAMETER(handle);
+    UNREFERENCED_PARAMETER(code);
+    UNREFERENCED_PARAMETER(in);
+    UNREFERENCED_PARAMETER(in_len);
+    UNREFERENCED_PARAMETER(out);
+    UNREFERENCED_PARAMETER(out_len);
+    UNREFERENCED_PARAMETER(ret_len);
+    UNREFERENCED_PARAMETER(overlapped);
+    SetLastError(ERROR_INVALID_HANDLE);
+    return FALSE;
+}
+
+static inline BOOL GetOverlappedResult(HANDLE handle,
+    LPOVERLAPPED overlapped, LPDWORD len, BOOL wait)
+{
+    UNREFERENCED_PARAMETER(handle);
+    UNREFERENCED_PARAMETER(overlapped);
+    UNREFERENCED_PARAMETER(len);
+    UNREFERENCED_PARAMETER(wait);
+    SetLastError(ERROR_INVALID_HANDLE);
+    return FALSE;
+}
+
+static inline BOOL CancelIoEx(HANDLE handle, LPOVERLAPPED overlapped)
+{
+    UNREFERENCED_PARAMETER(handle);
+    UNREFERENCED_PARAMETER(overlapped);
+    SetLastError(ERROR_INVALID_HANDLE);
+    return FALSE;
+}
+
+/*
+ * Unsupported: driver install, process names and completion ports.
+ */
+#define SHIM_UNSUPPORTED(result)                                        \
+    do                                                                  \
+    {                                                                   \
+        SetLastError(ERROR_NOT_SUPPORTED);                              \
+        return (result);                                                \
+    }                                                                   \
+    while (FALSE)
+
+static inline HANDLE CreateMutex(LPSECURITY_ATTRIBUTES attrs, BOOL owner,
+    LPCWSTR name)
+{
+    UNREFERENCED_PARAMETER(attrs);
+    UNREFERENCED_PARAMETER(owner);
+    UNREFERENCED_PARAMETER(name);
+    SHIM_UNSUPPORTED(NULL);
+}
+
+static inline BOOL ReleaseMutex(HANDLE mutex)
+{
+    UNREFERENCED_PARAMETER(mutex);
+    SHIM_UNSUPPORTED(FALSE);
+}
+
+static inline DWORD GetModuleFileName(HMODULE module, LPWSTR name, DWORD size)
+{
+    UNREFERENCED_PARAMETER(module);
+    UNREFERENCED_PARAMETER(name);
+    UNREFERENCED_PARAMETER(size);
+    SHIM_UNSUPPORTED(0);
+}
+
+static inline SC_HANDLE OpenSCManager(LPCWSTR machine, LPCWSTR database,
+    DWORD access)
+{
+    UNREFERENCED_PARAMETER(machine);
+    UNREFERENCED_PARAMETER(database);
+    UNREFERENCED_PARAMETER(access);
+    SHIM_UNSUPPORTED(NULL);
+}
+
+static inline SC_HANDLE OpenService(SC_HANDLE manager, LPCWSTR name,
+    DWORD access)
+{
+    UNREFERENCED_PARAMETER(manager);
+    UNREFERENCED_PARAMETER(name);
+    UNREFERENCED_PARAMETER(access);
+    SHIM_UNSUPPORTED(NULL);
+}
+
+static inline SC_HANDLE CreateService(SC_HANDLE manager, LPCWSTR name,
+    LPCWSTR display_name, DWORD access, DWORD type, DWORD start,
+    DWORD error, LPCWSTR path, LPCWSTR group, LPDWORD tag,
+    LPCWSTR dependencies, LPCWSTR user, LPCWSTR password)
+{
+    UNREFERENCED_PARAMETER(manager);
+    UNREFERENCED_PARAMETER(name);
+    UNREFERENCED_PARAMETER(display_name);
+    UNREFERENCED_PARAMETER(access);
+    UNREFERENCED_PARAMETER(type);
+    UNREFERENCED_PARAMETER(start);
+    UNREFERENCED_PARAMETER(error);
+    UNREFERENCED_PARAMETER(path);
+    UNREFERENCED_PARAMETER(group);
+    UNREFERENCED_PARAMETER(tag);
+    UNREFERENCED_PARAMETER(dependencies);
+    UNREFERENCED_PARAMETER(user);
+    UNREFERENCED_PARAMETER(password);
+    SHIM_UNSUPPORTED(NULL);
+}
+
+static inline BOOL StartService(SC_HANDLE service, DWORD argc,
+    LPCWSTR *argv)
+{
+    UNREFERENCED_PARAMETER(service);
+    UNREFERENCED_PARAMETER(argc);
+    UNREFERENCED_PARAMETER(argv);
+    SHIM_UNSUPPORTED(FALSE);
+}
+
+static inline BOOL DeleteService(SC_HANDLE service)
+{
+    UNREFERENCED_PARAMETER(service);
+    SHIM_UNSUPPORTED(FALSE);
+}
+
+static inline BOOL CloseServiceHandle(SC_HANDLE handle)
+{
+    UNREFERENCED_PARAMETER(handle);
+    SHIM_UNSUPPORTED(FALSE);
+}
+
+static inline LSTATUS RegCreateKeyExA(HKEY key, LPCSTR subkey,
+    DWORD reserved, LPSTR class_name, DWORD options, DWORD access,
+    LPSECURITY_ATTRIBUTES attrs, HKEY *result, LPDWORD disposition)
+{
+    UNREFERENCED_PARAMETER(key);
+    UNREFERENCED_PARAMETER(subkey);
+    UNREFERENCED_PARAMETER(reserved);
+    UNREFERENCED_PARAMETER(class_name);
+    UNREFERENCED_PARAMETER(options);
+    UNREFERENCED_PARAMETER(access);
+    UNREFERENCED_PARAMETER(attrs);
+    UNREFERENCED_PARAMETER(result);
+    UNREFERENCED_PARAMETER(disposition);
+    return ERROR_NOT_SUPPORTED;
+}
+
+static inline LSTATUS RegSetValueExA(HKEY key, LPCSTR name, DWORD reserved,
+    DWORD type, const BYTE *data, DWORD size)
+{
+    UNREFERENCED_PARAMETER(key);
+    UNREFERENCED_PARAMETER(name);
+    UNREFERENCED_PARAMETER(reserved);
+    UNREFERENCED_PARAMETER(type);
+    UNREFERENCED_PARAMETER(data);
+    UNREFERENCED_PARAMETER(size);
+    return ERROR_NOT_SUPPORTED;
+}
+
+static inline LSTATUS RegSetValueExW(HKEY key, LPCWSTR name, DWORD reserved,
+    DWORD type, const BYTE *data, DWORD size)
+{
+    UNREFERENCED_PARAMETER(key);
+    UNREFERENCED_PARAMETER(name);
+    UNREFERENCED_PARAMETER(reserved);
+    UNREFERENCED_PARAMETER(type);
+    UNREFERENCED_PARAMETER(data);
+    UNREFERENCED_PARAMETER(size);
+    return ERROR_NOT_SUPPORTED;
+}
+
+static inline LSTATUS RegCloseKey(HKEY key)
+{
+    UNREFERENCED_PARAMETER(key);
+    return ERROR_NOT_SUPPORTED;
+}
+
+static inline HANDLE OpenProcess(DWORD access, BOOL inherit, DWORD pid)
+{
+    UNREFERENCED_PARAMETER(access);
+    UNREFERENCED_PARAMETER(inherit);
+    UNREFERENCED_PARAMETER(pid);
+    SHIM_UNSUPPORTED(NULL);
+}
+
+static inline BOOL QueryFullProcessImageNameW(HANDLE process, DWORD flags,
+    LPWSTR name, PDWORD size)
+{
+    UNREFERENCED_PARAMETER(process);
+    UNREFERENCED_PARAMETER(flags);
+    UNREFERENCED_PARAMETER(name);
+    UNREFERENCED_PARAMETER(size);
+    SHIM_UNSUPPORTED(FALSE);
+}
+
+static inline HANDLE CreateThread(LPSECURITY_ATTRIBUTES attrs,
+    SIZE_T stack_size, LPTHREAD_START_ROUTINE start, LPVOID arg,
+    DWORD flags, LPDWORD id)
+{
+    UNREFERENCED_PARAMETER(attrs);
+    UNREFERENCED_PARAMETER(stack_size);
+    UNREFERENCED_PARAMETER(start);
+    UNREFERENCED_PARAMETER(arg);
+    UNREFERENCED_PARAMETER(flags);
+    UNREFERENCED_PARAMETER(id);
+    SHIM_UNSUPPORTED(NULL);
+}
+
+static inline HANDLE CreateIoCompletionPort(HANDLE handle, HANDLE port,
+    ULONG_PTR key, DWORD threads)
+{
+    UNREFERENCED_PARAMETER(handle);
+    UNREFERENCED_PARAMETER(port);
+    UNREFERENCED_PARAMETER(key);
+    UNREFERENCED_PARAMETER(threads);
+    SHIM_UNSUPPORTED(NULL);
+}
+
+static inline BOOL GetQueuedCompletionStatus(HANDLE port, LPDWORD len,
+    PULONG_PTR key, LPOVERLAPPED *overlapped, DWORD timeout)
+{
+    UNREFERENCED_PARAMETER(port);
+    UNREFERENCED_PARAMETER(len);
+    UNREFERENCED_PARAMETER(key);
+    UNREFERENCED_PARAMETER(overlapped);
+    UNREFERENCED_PARAMETER(timeout);
+    SHIM_UNSUPPORTED(FALSE);
+}
+
+static inline BOOL PostQueuedCompletionStatus(HANDLE port, DWORD len,
+    ULONG_PTR key, LPOVERLAPPED overlapped)
+{
+    UNREFERENCED_PARAMETER(port);
+    UNREFERENCED_PARAMETER(len);
+    UNREFERENCED_PARAMETER(key);
+    UNREFERENCED_PARAMETER(overlapped);
+    SHIM_UNSUPPORTED(FALSE);
+}
+
+#endif      /* __WINDIVERT_SHIM_WINDOWS_H */
@@ -0,0 +1,53 @@
+/*
+ * winioctl.h
+ * (C) 2021, all rights reserved,
+ *
+ * This file is part of WinDivert.
+ *
+ * WinDivert is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * WinDivert is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Win32 shim (POSIX), see windows.h.
+ */
+
+#ifndef __WINDIVERT_SHIM_WINIOCTL_H
+#define __WINDIVERT_SHIM_WINIOCTL_H
+
+#define CTL_CODE(type, function, method, access)                        \
+    (((type) << 16) | ((access) << 14) | ((function) << 2) | (method))
+
+#define FILE_DEVICE_NETWORK             0x00000012
+#define METHOD_BUFFERED                 0
+#define METHOD_IN_DIRECT                1
+#define METHOD_OUT_DIRECT               2
+#define FILE_ANY_ACCESS                 0
+#define FILE_READ_DATA                  0x0001
+#define FILE_WRITE_DATA                 0x0002
+
+#endif      /* __WINDIVERT_SHIM_WINIOCTL_H */
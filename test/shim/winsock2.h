@@ -0,0 +1,82 @@
+/*
+ * winsock2.h
+ * (C) 2021, all rights reserved,
+ *
+ * This file is part of WinDivert.
+ *
+ * WinDivert is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * WinDivert is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Win32 shim (POSIX), see windows.h.
+ */
+
+#ifndef __WINDIVERT_SHIM_WINSOCK2_H
+#define __WINDIVERT_SHIM_WINSOCK2_H
+
+#include <windows.h>
+
+#define IPPROTO_HOPOPTS                 0
+#define IPPROTO_ICMP                    1
+#define IPPROTO_IPIP                    4
+#define IPPROTO_TCP                     6
+#define IPPROTO_UDP                     17
+#define IPPROTO_IPV6                    41
+#define IPPROTO_ROUTING                 43
+#define IPPROTO_FRAGMENT                44
+#define IPPROTO_GRE                     47
+#define IPPROTO_AH                      51
+#define IPPROTO_ICMPV6                  58
+#define IPPROTO_NONE                    59
+#define IPPROTO_DSTOPTS                 60
+
+#define AF_INET                         2
+#define AF_INET6                        23
+
+static inline UINT16 htons(UINT16 x)
+{
+    return (UINT16)((x << 8) | (x >> 8));
+}
+
+static inline UINT32 htonl(UINT32 x)
+{
+    return ((x & 0xFF) << 24) | ((x & 0xFF00) << 8) | ((x >> 8) & 0xFF00) |
+        (x >> 24);
+}
+
+static inline UINT16 ntohs(UINT16 x)
+{
+    return htons(x);
+}
+
+static inline UINT32 ntohl(UINT32 x)
+{
+    return htonl(x);
+}
+
+#endif      /* __WINDIVERT_SHIM_WINSOCK2_H */
@@ -0,0 +1,2271 @@
+/*
+ * sim.c
+ * (C) 2021, all rights reserved,
+ *
+ * This file is part of WinDivert.
+ *
+ * WinDivert is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * WinDivert is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * User-mode simulator for the driver's packet queueing core
+ * (sys/windivert_queue.c).  The core is built against a thin shim over the
+ * kernel/WDF primitives it uses, and driven by producer threads (standing in
+ * for the classify callouts) and reader threads (standing in for
+ * WinDivertRecvEx() callers).  Reports throughput, drops, timeouts and
+ * queueing latency.  "dropped" counts every packet the core freed and
+ * "timeouts" the packets that expired before a read; "drops" breaks down
+ * every traced drop by reason (timeouts included), whereas the "trace"
+ * line only summarizes the last WINDIVERT_TRACE_MAX events in the ring.
+ *
+ * The producers also run the sampled CPU accounting (dll/windivert_cpu.c)
+ * as the classify callouts do, and their CPU time per packet is reported;
+ * -C disables the accounting, so its cost can be compared.
+ *
+ * With -k, the readers are replaced by the WinDivertRecvPool* scheduling
+ * core (dll/windivert_recvsched.c): -r worker threads keep -k reads in
+ * flight, and -w is the time spent in the callback.
+ *
+ * With -P, instead tests the processName/processPath matching and the
+ * driver's process path cache (dll/windivert_process.c and
+ * dll/windivert_pidcache.c).
+ *
+ * With -N, instead tests the redirect (NAT) table (dll/windivert_nat.c),
+ * both directly and through the queueing core.
+ *
+ * With -O, instead benchmarks the WinDivertSequencer* ordering core
+ * (dll/windivert_reorder.c): -r threads receive -b packet batches, work on
+ * them for a random 0..2*-w us, then send them through the core in global
+ * or per-flow order (or unordered with "none").
+ *
+ * With -T, instead benchmarks the flight recorder (dll/windivert_trace.c)
+ * with -r recording threads.
+ *
+ * Build (Linux):
+ *
+ *     gcc -O2 -fno-strict-aliasing -pthread -I../include -I../sys -I../dll \
+ *         sim.c -o sim
+ *
+ * The shared packet code (dll/windivert_shared.c) reads headers through
+ * differently typed pointers, as the driver and DLL do.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/****************************************************************************/
+/* SHIM                                                                     */
+/****************************************************************************/
+
+#define __in
+#define __in_opt
+#define __out
+#define __out_opt
+#define __inout
+#define __inout_opt
+
+#define UNREFERENCED_PARAMETER(x)       ((void)(x))
+
+typedef int8_t INT8;
+typedef uint8_t UINT8;
+typedef int16_t INT16;
+typedef uint16_t UINT16;
+typedef int32_t INT32;
+typedef uint32_t UINT32;
+typedef int64_t INT64;
+typedef uint64_t UINT64;
+typedef int BOOL;
+typedef int INT;
+typedef unsigned int UINT;
+typedef int32_t LONG;
+typedef uint32_t ULONG;
+typedef int64_t LONGLONG;
+typedef uint64_t ULONGLONG;
+typedef int32_t NTSTATUS;
+typedef char CHAR;
+typedef void VOID;
+typedef void *PVOID;
+typedef void *HANDLE;
+
+#define TRUE                            1
+#define FALSE                           0
+
+#define WINDIVERT_KERNEL
+#define WINDIVERTEXPORT                 extern
+#include "windivert.h"
+
+#define STATUS_SUCCESS                  ((NTSTATUS)0x00000000)
+#define STATUS_NO_MORE_ENTRIES          ((NTSTATUS)0x8000001A)
+#define STATUS_INVALID_PARAMETER        ((NTSTATUS)0xC000000D)
+#define STATUS_BUFFER_TOO_SMALL         ((NTSTATUS)0xC0000023)
+#define STATUS_PIPE_EMPTY               ((NTSTATUS)0xC00000D9)
+#define STATUS_INVALID_DEVICE_STATE     ((NTSTATUS)0xC0000184)
+#define NT_SUCCESS(status)              ((NTSTATUS)(status) >= 0)
+
+#define DEBUG(format, ...)
+#define DEBUG_ERROR(format, status, ...)
+
+#define IPPROTO_HOPOPTS                 0
+#define IPPROTO_ICMP                    1
+#define IPPROTO_TCP                     6
+#define IPPROTO_UDP                     17
+#define IPPROTO_ROUTING                 43
+#define IPPROTO_FRAGMENT                44
+#define IPPROTO_AH                      51
+#define IPPROTO_ICMPV6                  58
+#define IPPROTO_NONE                    59
+#define IPPROTO_DSTOPTS                 60
+#define IPPROTO_MH                      135
+
+/*
+ * Doubly linked lists.
+ */
+typedef struct _LIST_ENTRY
+{
+    struct _LIST_ENTRY *Flink;
+    struct _LIST_ENTRY *Blink;
+} LIST_ENTRY, *PLIST_ENTRY;
+
+#define CONTAINING_RECORD(address, type, field)                             \
+    ((type *)((char *)(address) - offsetof(type, field)))
+
+static void InitializeListHead(PLIST_ENTRY head)
+{
+    head->Flink = head->Blink = head;
+}
+static BOOL IsListEmpty(const LIST_ENTRY *head)
+{
+    return (head->Flink == head);
+}
+static PLIST_ENTRY RemoveHeadList(PLIST_ENTRY head)
+{
+    PLIST_ENTRY entry = head->Flink;
+
+    head->Flink = entry->Flink;
+    entry->Flink->Blink = head;
+    return entry;
+}
+static void InsertHeadList(PLIST_ENTRY head, PLIST_ENTRY entry)
+{
+    entry->Flink = head->Flink;
+    entry->Blink = head;
+    head->Flink->Blink = entry;
+    head->Flink = entry;
+}
+static void InsertTailList(PLIST_ENTRY head, PLIST_ENTRY entry)
+{
+    entry->Flink = head;
+    entry->Blink = head->Blink;
+    head->Blink->Flink = entry;
+    head->Blink = entry;
+}
+
+/*
+ * Spin locks.
+ */
+typedef pthread_spinlock_t KSPIN_LOCK;
+typedef struct
+{
+    KSPIN_LOCK *lock;
+} KLOCK_QUEUE_HANDLE;
+
+static void KeAcquireInStackQueuedSpinLock(KSPIN_LOCK *lock,
+    KLOCK_QUEUE_HANDLE *lock_handle)
+{
+    lock_handle->lock = lock;
+    pthread_spin_lock(lock);
+}
+static void KeReleaseInStackQueuedSpinLock(KLOCK_QUEUE_HANDLE *lock_handle)
+{
+    pthread_spin_unlock(lock_handle->lock);
+}
+
+/*
+ * Timestamps (nanoseconds).
+ */
+typedef union
+{
+    LONGLONG QuadPart;
+} LARGE_INTEGER;
+typedef union
+{
+    struct
+    {
+        UINT32 LowPart;
+        UINT32 HighPart;
+    };
+    ULONGLONG QuadPart;
+} ULARGE_INTEGER;
+
+static LARGE_INTEGER KeQueryPerformanceCounter(LARGE_INTEGER *freq)
+{
+    struct timespec ts;
+    LARGE_INTEGER now;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now.QuadPart = (LONGLONG)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    if (freq != NULL)
+    {
+        freq->QuadPart = 1000000000;
+    }
+    return now;
+}
+
+/*
+ * Processors.
+ */
+static UINT32 KeGetCurrentProcessorNumber(void)
+{
+    int cpu = sched_getcpu();
+
+    return (cpu < 0? 0: (UINT32)cpu);
+}
+
+/*
+ * Interlocked operations (full barriers) and memory ordering.
+ */
+#define InterlockedIncrement(ptr)                                           \
+    __atomic_add_fetch((ptr), 1, __ATOMIC_SEQ_CST)
+#define ReadULongAcquire(ptr)                                               \
+    __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define WriteULongRelease(ptr, value)                                       \
+    __atomic_store_n((ptr), (value), __ATOMIC_RELEASE)
+#define KeMemoryBarrier()                                                   \
+    __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+/*
+ * Requests and request queues.
+ */
+struct stats_s;
+struct request_s
+{
+    LIST_ENTRY entry;                       // Entry for queue.
+    pthread_mutex_t lock;                   // Completion lock.
+    pthread_cond_t cond;                    // Completion condition.
+    BOOL done;                              // Request completed?
+    NTSTATUS status;                        // Completion status.
+    ULONG information;                      // Completion length.
+    UINT8 *buf;                             // Packet buffer.
+    ULONG buf_len;                          // Packet buffer length.
+    UINT addr_max;                          // Max packets per request.
+    UINT addr_len;                          // Packets returned.
+    struct stats_s *stats;                  // Owner's statistics.
+    struct port_s *port;                    // Completion port (or NULL).
+};
+typedef struct request_s *WDFREQUEST;
+
+/*
+ * Completion ports (cf. I/O completion ports).
+ */
+struct port_s
+{
+    pthread_mutex_t lock;                   // Port lock.
+    pthread_cond_t cond;                    // Port condition.
+    LIST_ENTRY completions;                 // Completed requests.
+    BOOL closed;                            // Port closed?
+};
+
+static void sim_port_post(struct port_s *port, WDFREQUEST request)
+{
+    pthread_mutex_lock(&port->lock);
+    InsertTailList(&port->completions, &request->entry);
+    pthread_cond_signal(&port->cond);
+    pthread_mutex_unlock(&port->lock);
+}
+static void sim_port_close(struct port_s *port)
+{
+    pthread_mutex_lock(&port->lock);
+    port->closed = TRUE;
+    pthread_cond_broadcast(&port->cond);
+    pthread_mutex_unlock(&port->lock);
+}
+static WDFREQUEST sim_port_get(struct port_s *port)
+{
+    PLIST_ENTRY entry;
+
+    pthread_mutex_lock(&port->lock);
+    while (IsListEmpty(&port->completions) && !port->closed)
+    {
+        pthread_cond_wait(&port->cond, &port->lock);
+    }
+    if (IsListEmpty(&port->completions))
+    {
+        pthread_mutex_unlock(&port->lock);
+        return NULL;
+    }
+    entry = RemoveHeadList(&port->completions);
+    pthread_mutex_unlock(&port->lock);
+    return CONTAINING_RECORD(entry, struct request_s, entry);
+}
+
+struct queue_s
+{
+    pthread_mutex_t lock;                   // Queue lock.
+    LIST_ENTRY requests;                    // Pending requests.
+};
+typedef struct queue_s *WDFQUEUE;
+
+static NTSTATUS WdfRequestForwardToIoQueue(WDFREQUEST request, WDFQUEUE queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    InsertTailList(&queue->requests, &request->entry);
+    pthread_mutex_unlock(&queue->lock);
+    return STATUS_SUCCESS;
+}
+static NTSTATUS WdfIoQueueRetrieveNextRequest(WDFQUEUE queue,
+    WDFREQUEST *request)
+{
+    NTSTATUS status = STATUS_NO_MORE_ENTRIES;
+
+    pthread_mutex_lock(&queue->lock);
+    if (!IsListEmpty(&queue->requests))
+    {
+        *request = CONTAINING_RECORD(RemoveHeadList(&queue->requests),
+            struct request_s, entry);
+        status = STATUS_SUCCESS;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return status;
+}
+static void WdfRequestCompleteWithInformation(WDFREQUEST request,
+    NTSTATUS status, ULONG information)
+{
+    if (request->port != NULL)
+    {
+        request->status      = status;
+        request->information = information;
+        sim_port_post(request->port, request);
+        return;
+    }
+    pthread_mutex_lock(&request->lock);
+    request->status      = status;
+    request->information = information;
+    request->done        = TRUE;
+    pthread_cond_signal(&request->cond);
+    pthread_mutex_unlock(&request->lock);
+}
+static void WdfRequestComplete(WDFREQUEST request, NTSTATUS status)
+{
+    WdfRequestCompleteWithInformation(request, status, 0);
+}
+
+/*
+ * Work items.  Like WDF, enqueueing an already queued item does nothing.
+ */
+struct context_s;
+struct worker_s
+{
+    pthread_mutex_t lock;                   // Worker lock.
+    pthread_cond_t cond;                    // Worker condition.
+    BOOL queued;                            // Work item queued?
+    BOOL stop;                              // Worker should exit?
+    pthread_t thread;                       // Worker thread.
+    struct context_s *context;              // Worker's context.
+};
+typedef struct worker_s *WDFWORKITEM;
+
+static void WdfWorkItemEnqueue(WDFWORKITEM worker)
+{
+    pthread_mutex_lock(&worker->lock);
+    if (!worker->queued)
+    {
+        worker->queued = TRUE;
+        pthread_cond_signal(&worker->cond);
+    }
+    pthread_mutex_unlock(&worker->lock);
+}
+
+/****************************************************************************/
+/* QUEUEING CORE                                                            */
+/****************************************************************************/
+
+#define WINDIVERT_WORK_QUEUE_LENGTH_MAX     4096
+
+/*
+ * Shared functions (packet parsing and the redirect table).  Packets are
+ * flat buffers, as in the DLL.
+ */
+#define WINDIVERT_INLINE                    inline
+#define WINDIVERT_GET_DATA(packet, packet_len, min, max, index, data, size) \
+    sim_get_data((packet), (packet_len), (min), (max), (index), (data),     \
+        (size))
+
+static BOOL sim_get_data(const VOID *packet, UINT packet_len, INT min,
+    INT max, INT idx, PVOID data, UINT size)
+{
+    UNREFERENCED_PARAMETER(packet_len);
+
+    idx += (idx < 0? max: min);
+    if (idx < min || idx > (max - (INT)size))
+    {
+        return FALSE;
+    }
+    memcpy(data, (UINT8 *)packet + idx, size);
+    return TRUE;
+}
+
+#include "windivert_device.h"
+#include "windivert_shared.c"
+#include "windivert_nat.c"
+
+/*
+ * Context (the subset of the driver's context_s used by the core).
+ */
+typedef enum
+{
+    WINDIVERT_CONTEXT_STATE_OPENING = 0xA0,
+    WINDIVERT_CONTEXT_STATE_OPEN    = 0xB1,
+    WINDIVERT_CONTEXT_STATE_CLOSING = 0xC2,
+    WINDIVERT_CONTEXT_STATE_CLOSED  = 0xD3,
+} context_state_t;
+struct context_s
+{
+    context_state_t state;                      // Context's state.
+    KSPIN_LOCK lock;                            // Context-wide lock.
+    LIST_ENTRY work_queue;                      // Work queue.
+    LIST_ENTRY packet_queue;                    // Packet queue.
+    ULONGLONG work_queue_length;                // Work queue length.
+    ULONGLONG packet_queue_length;              // Packet queue length.
+    ULONGLONG packet_queue_maxlength;           // Packet queue max length.
+    ULONGLONG packet_queue_size;                // Packet queue size (in bytes).
+    ULONGLONG packet_queue_maxsize;             // Packet queue max size.
+    LONGLONG packet_queue_maxcounts;            // Packet queue max counts.
+    WDFQUEUE read_queue;                        // Read queue.
+    WDFWORKITEM worker;                         // Read worker.
+    UINT64 flags;                               // Context's flags.
+    BOOL shutdown_recv;                         // Shutdown recv.
+    BOOL shutdown_recv_enabled;                 // Shutdown recv enabled?
+    PWINDIVERT_NAT nat;                         // Redirect state (or NULL).
+    struct WINDIVERT_TRACE *trace;              // Recent event trace.
+    struct WINDIVERT_CPU *cpu;                  // CPU accounting (or NULL).
+    UINT32 sequence;                            // Next packet sequence.
+};
+typedef struct context_s *context_t;
+
+/*
+ * Packet.
+ */
+struct packet_s
+{
+    LIST_ENTRY entry;                       // Entry for queue.
+    LONGLONG timestamp;                     // Packet timestamp.
+    UINT32 match:1;                         // Packet matched filter?
+    UINT32 outbound:1;                      // Packet is outound?
+    UINT32 packet_len;                      // Length of the packet.
+    UINT32 packet_size;                     // Size of the packet struct.
+    UINT32 sequence;                        // Packet sequence number.
+};
+typedef struct packet_s *packet_t;
+
+#define SIM_PACKET_DATA(packet)             ((UINT8 *)((packet) + 1))
+
+/*
+ * Global counters.
+ */
+static volatile UINT64 num_dropped   = 0;  // Packets freed by the core.
+static volatile UINT64 num_timeout   = 0;  // Packets timed out.
+static volatile UINT64 num_injected  = 0;  // Packets reinjected.
+static volatile UINT64 num_drops[8]  = {0}; // Drop events by reason.
+
+#include "windivert_cpu.c"
+#include "windivert_trace.c"
+
+#define WINDIVERT_CPU_PHASE(sample, phase)                                  \
+    do                                                                      \
+    {                                                                       \
+        if ((sample) != NULL)                                               \
+        {                                                                   \
+            WinDivertCpuPhase((sample), (phase),                            \
+                KeQueryPerformanceCounter(NULL).QuadPart);                  \
+        }                                                                   \
+    }                                                                       \
+    while (FALSE)
+
+/*
+ * Drop events are also counted by reason, since the trace only keeps the
+ * last WINDIVERT_TRACE_MAX events.
+ */
+#define WINDIVERT_TRACE(context, timestamp, type, reason, value)            \
+    do                                                                      \
+    {                                                                       \
+        if ((type) == WINDIVERT_TRACE_DROP)                                 \
+        {                                                                   \
+            __atomic_add_fetch(&num_drops[(reason) & 0x7], 1,               \
+                __ATOMIC_RELAXED);                                          \
+        }                                                                   \
+        WinDivertTraceRecord((context)->trace,                              \
+            KeGetCurrentProcessorNumber(), (timestamp), (type), (reason),   \
+            (value));                                                       \
+    }                                                                       \
+    while (FALSE)
+
+static void windivert_read_service(context_t context);
+static void windivert_read_service_request(context_t context, packet_t packet,
+    LONGLONG timestamp, WDFREQUEST request);
+
+static UINT windivert_redirect(context_t context, packet_t packet)
+{
+    UINT result;
+
+    result = WinDivertNatTranslate(context->nat, SIM_PACKET_DATA(packet),
+        packet->packet_len, (UINT64)packet->timestamp / 1000000);
+    if (result == WINDIVERT_NAT_RESULT_REFLECT)
+    {
+        packet->outbound = 0;
+    }
+    return result;
+}
+static NTSTATUS windivert_inject_packet(packet_t packet)
+{
+    __atomic_add_fetch(&num_injected, 1, __ATOMIC_RELAXED);
+    free(packet);
+    return STATUS_SUCCESS;
+}
+/*
+ * Every packet freed by the core is a drop, whether or not it was traced
+ * (e.g. packets queued after the handle closed are not).
+ */
+static void windivert_free_packet(packet_t packet)
+{
+    __atomic_add_fetch(&num_dropped, 1, __ATOMIC_RELAXED);
+    free(packet);
+}
+
+#include "windivert_queue.c"
+
+#define WINDIVERT_PIDCACHE_ALLOC(size)      malloc(size)
+#define WINDIVERT_PIDCACHE_FREE(ptr)        free(ptr)
+#define WINDIVERT_PIDCACHE_INCREMENT(ptr)                                   \
+    __atomic_add_fetch((ptr), 1, __ATOMIC_RELAXED)
+#define WINDIVERT_PIDCACHE_DECREMENT(ptr)                                   \
+    __atomic_sub_fetch((ptr), 1, __ATOMIC_ACQ_REL)
+#include "windivert_pidcache.c"
+#include "windivert_recvsched.c"
+#include "windivert_reorder.c"
+
+/****************************************************************************/
+/* PROCESS PATHS                                                            */
+/****************************************************************************/
+
+#define SIM_PROCESS_PATH_MAX                256
+
+static UINT sim_checks = 0;
+static UINT sim_failures = 0;
+
+#define SIM_CHECK(cond)                                                     \
+    do                                                                      \
+    {                                                                       \
+        sim_checks++;                                                       \
+        if (!(cond))                                                        \
+        {                                                                   \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);          \
+            sim_failures++;                                                 \
+        }                                                                   \
+    }                                                                       \
+    while (FALSE)
+
+/*
+ * Convert an ASCII string to UTF-16.
+ */
+static UINT sim_utf16(const char *str, UINT16 *buf)
+{
+    UINT i;
+
+    for (i = 0; str[i] != '\0' && i < SIM_PROCESS_PATH_MAX; i++)
+    {
+        buf[i] = (UINT16)(UINT8)str[i];
+    }
+    return i;
+}
+
+/*
+ * Match a path against a filter string (as the filter would).
+ */
+static BOOL sim_process_match(const char *path, BOOL name, const char *str)
+{
+    UINT16 path16[SIM_PROCESS_PATH_MAX], str16[SIM_PROCESS_PATH_MAX];
+    UINT32 arg[4], val[4];
+    UINT path_len, str_len;
+    BOOL suffix = (str[0] == '*');
+
+    path_len = sim_utf16(path, path16);
+    str_len  = sim_utf16(str + (suffix? 1: 0), str16);
+    WinDivertProcessCompile(str16, str_len, suffix, arg);
+    WinDivertProcessValue(path16, path_len, name, arg, val);
+    return (val[0] == arg[0] && val[1] == arg[1] && val[2] == arg[2] &&
+        val[3] == arg[3]);
+}
+
+/*
+ * Process path matching and cache tests.
+ */
+static int sim_process(UINT seconds)
+{
+    static const char *path =
+        "\\device\\harddiskvolume3\\Program Files\\App\\App.EXE";
+    static WINDIVERT_PIDCACHE cache;
+    UINT16 path16[SIM_PROCESS_PATH_MAX];
+    PWINDIVERT_PROCESS process, old, procs[4 * WINDIVERT_PIDCACHE_WAYS];
+    UINT path_len, i, j, count, set;
+    UINT32 pid, arg[4], val[4];
+    UINT64 lookups = 0, hits = 0, matches = 0;
+    LONGLONG start, end;
+
+    // Matching:
+    SIM_CHECK(sim_process_match(path, TRUE, "app.exe"));
+    SIM_CHECK(sim_process_match(path, TRUE, "APP.EXE"));
+    SIM_CHECK(!sim_process_match(path, TRUE, "app"));
+    SIM_CHECK(!sim_process_match(path, TRUE, "xapp.exe"));
+    SIM_CHECK(sim_process_match(path, TRUE, "*.exe"));
+    SIM_CHECK(sim_process_match(path, TRUE, "*"));
+    SIM_CHECK(!sim_process_match(path, TRUE, "*\\app.exe"));
+    SIM_CHECK(sim_process_match(path, FALSE, "*\\app.exe"));
+    SIM_CHECK(sim_process_match(path, FALSE, "*/App/app.exe"));
+    SIM_CHECK(sim_process_match(path, FALSE,
+        "/Device/HarddiskVolume3/program files/app/app.exe"));
+    SIM_CHECK(!sim_process_match(path, FALSE, "app.exe"));
+    SIM_CHECK(!sim_process_match(path, FALSE,
+        "*x\\device\\harddiskvolume3\\Program Files\\App\\App.EXE"));
+    SIM_CHECK(sim_process_match("app.exe", TRUE, "app.exe"));
+    SIM_CHECK(!sim_process_match("", TRUE, "app.exe"));
+    SIM_CHECK(sim_process_match("", FALSE, ""));
+    SIM_CHECK(!sim_process_match(path, FALSE, ""));
+
+    // Cache: insert/lookup/replace/remove:
+    WinDivertPidCacheInit(&cache);
+    path_len = sim_utf16(path, path16);
+    process = WinDivertProcessCreate(1000, path16, path_len);
+    SIM_CHECK(process != NULL && process->len == path_len);
+    WinDivertPidCacheInsert(&cache, process);
+    SIM_CHECK(cache.count == 1 && process->refs == 2);
+    old = process;
+    process = WinDivertPidCacheLookup(&cache, 1000);
+    SIM_CHECK(process == old && process->refs == 3);
+    WinDivertProcessRelease(process);
+    SIM_CHECK(WinDivertPidCacheLookup(&cache, 1004) == NULL);
+    process = WinDivertProcessCreate(1000, path16, 5);
+    WinDivertPidCacheInsert(&cache, process);
+    SIM_CHECK(cache.count == 1 && old->refs == 1);
+    WinDivertProcessRelease(process);
+    process = WinDivertPidCacheLookup(&cache, 1000);
+    SIM_CHECK(process != NULL && process->len == 5);
+    WinDivertPidCacheRemove(&cache, 1000);
+    SIM_CHECK(cache.count == 0 && process->refs == 1);
+    SIM_CHECK(WinDivertPidCacheLookup(&cache, 1000) == NULL);
+    SIM_CHECK(process->path[0] == path16[0]);   // Still valid.
+    WinDivertProcessRelease(process);
+    WinDivertProcessRelease(old);
+
+    // Truncation at NUL:
+    path16[7] = 0;
+    process = WinDivertProcessCreate(8, path16, path_len);
+    SIM_CHECK(process != NULL && process->len == 7);
+    WinDivertProcessRelease(process);
+    path_len = sim_utf16(path, path16);
+
+    // Cache: LRU eviction within a set:
+    set = (UINT)(WinDivertPidCacheSet(&cache, 4) - cache.sets);
+    for (i = 0, pid = 4; i < sizeof(procs) / sizeof(procs[0]); pid += 4)
+    {
+        if ((UINT)(WinDivertPidCacheSet(&cache, pid) - cache.sets) == set)
+        {
+            procs[i++] = WinDivertProcessCreate(pid, path16, path_len);
+        }
+    }
+    for (i = 0; i < WINDIVERT_PIDCACHE_WAYS; i++)
+    {
+        WinDivertPidCacheInsert(&cache, procs[i]);
+    }
+    process = WinDivertPidCacheLookup(&cache, procs[0]->pid);
+    WinDivertProcessRelease(process);
+    WinDivertPidCacheInsert(&cache, procs[WINDIVERT_PIDCACHE_WAYS]);
+    SIM_CHECK(cache.count == WINDIVERT_PIDCACHE_WAYS && cache.evictions == 1);
+    SIM_CHECK(procs[1]->refs == 1);             // Evicted (LRU).
+    process = WinDivertPidCacheLookup(&cache, procs[0]->pid);
+    SIM_CHECK(process == procs[0]);
+    WinDivertProcessRelease(process);
+    SIM_CHECK(WinDivertPidCacheLookup(&cache, procs[1]->pid) == NULL);
+    WinDivertPidCacheFlush(&cache);
+    SIM_CHECK(cache.count == 0);
+    for (i = 0; i < sizeof(procs) / sizeof(procs[0]); i++)
+    {
+        SIM_CHECK(procs[i]->refs == 1);
+        WinDivertProcessRelease(procs[i]);
+    }
+
+    // Benchmark: lookups (inserting on miss) + matching, with a working set
+    // of 2x the cache capacity, and 15/16 of lookups to a hot 1/8th of it:
+    count = 2 * WINDIVERT_PIDCACHE_SETS * WINDIVERT_PIDCACHE_WAYS;
+    WinDivertProcessCompile(path16 + path_len - 7, 7, TRUE, arg);
+    WinDivertPidCacheInit(&cache);
+    start = KeQueryPerformanceCounter(NULL).QuadPart;
+    end   = start + (LONGLONG)seconds * 1000000000;
+    for (j = 1; KeQueryPerformanceCounter(NULL).QuadPart < end; )
+    {
+        for (i = 0; i < 4096; i++)
+        {
+            j = j * 1103515245 + 12345;
+            pid = (j >> 16) % ((j & 0xF) == 0? count: count / 8);
+            pid = 4 * (pid + 1);
+            process = WinDivertPidCacheLookup(&cache, pid);
+            if (process == NULL)
+            {
+                process = WinDivertProcessCreate(pid, path16, path_len);
+                WinDivertPidCacheInsert(&cache, process);
+            }
+            else
+            {
+                hits++;
+            }
+            WinDivertProcessValue(process->path, process->len, TRUE, arg,
+                val);
+            matches += (val[0] == arg[0] && val[1] == arg[1] &&
+                val[2] == arg[2] && val[3] == arg[3]);
+            WinDivertProcessRelease(process);
+        }
+        lookups += i;
+    }
+    end = KeQueryPerformanceCounter(NULL).QuadPart;
+    SIM_CHECK(matches == lookups);
+    SIM_CHECK(cache.count <= WINDIVERT_PIDCACHE_SETS * WINDIVERT_PIDCACHE_WAYS);
+    WinDivertPidCacheFlush(&cache);
+
+    printf("process   %llu lookups+matches (%.1f ns each), hit rate %.1f%%, "
+        "%llu evictions\n", (unsigned long long)lookups,
+        (double)(end - start) / lookups, 100.0 * hits / lookups,
+        (unsigned long long)cache.evictions);
+    if (sim_failures != 0)
+    {
+        printf("error: %u process test(s) failed\n", sim_failures);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/****************************************************************************/
+/* REDIRECT                                                                 */
+/****************************************************************************/
+
+#define SIM_NAT_PROXY_PORT                  8080
+
+/*
+ * Build an outbound TCP packet with valid checksums.
+ */
+static UINT sim_nat_packet(UINT8 *buf, BOOL ipv6, const UINT32 *src_addr,
+    const UINT32 *dst_addr, UINT16 src_port, UINT16 dst_port, BOOL syn,
+    BOOL ack, BOOL fin)
+{
+    PWINDIVERT_IPHDR ip_header;
+    PWINDIVERT_IPV6HDR ipv6_header;
+    PWINDIVERT_TCPHDR tcp_header;
+    UINT hdr_len, i;
+
+    memset(buf, 0, 64);
+    if (!ipv6)
+    {
+        ip_header = (PWINDIVERT_IPHDR)buf;
+        hdr_len = sizeof(WINDIVERT_IPHDR);
+        ip_header->Version   = 4;
+        ip_header->HdrLength = 5;
+        ip_header->Length    = htons(hdr_len + sizeof(WINDIVERT_TCPHDR));
+        ip_header->TTL       = 64;
+        ip_header->Protocol  = IPPROTO_TCP;
+        ip_header->SrcAddr   = htonl(src_addr[0]);
+        ip_header->DstAddr   = htonl(dst_addr[0]);
+    }
+    else
+    {
+        ipv6_header = (PWINDIVERT_IPV6HDR)buf;
+        hdr_len = sizeof(WINDIVERT_IPV6HDR);
+        ipv6_header->Version  = 6;
+        ipv6_header->Length   = htons(sizeof(WINDIVERT_TCPHDR));
+        ipv6_header->NextHdr  = IPPROTO_TCP;
+        ipv6_header->HopLimit = 64;
+        for (i = 0; i < 4; i++)
+        {
+            ipv6_header->SrcAddr[i] = htonl(src_addr[i]);
+            ipv6_header->DstAddr[i] = htonl(dst_addr[i]);
+        }
+    }
+    tcp_header = (PWINDIVERT_TCPHDR)(buf + hdr_len);
+    tcp_header->SrcPort   = htons(src_port);
+    tcp_header->DstPort   = htons(dst_port);
+    tcp_header->SeqNum    = htonl((UINT32)1000);
+    tcp_header->HdrLength = 5;
+    tcp_header->Syn       = (syn? 1: 0);
+    tcp_header->Ack       = (ack? 1: 0);
+    tcp_header->Fin       = (fin? 1: 0);
+    tcp_header->Window    = htons(8192);
+    WinDivertHelperCalcChecksums(buf, hdr_len + sizeof(WINDIVERT_TCPHDR),
+        NULL, 0);
+    return hdr_len + sizeof(WINDIVERT_TCPHDR);
+}
+
+/*
+ * Check a translated packet: ports, swapped addresses and checksums.
+ */
+static BOOL sim_nat_check(const UINT8 *buf, UINT len, BOOL ipv6,
+    const UINT32 *src_addr, const UINT32 *dst_addr, UINT16 src_port,
+    UINT16 dst_port)
+{
+    UINT8 check[64];
+    const WINDIVERT_IPHDR *ip_header = (const WINDIVERT_IPHDR *)buf;
+    const WINDIVERT_IPV6HDR *ipv6_header = (const WINDIVERT_IPV6HDR *)buf;
+    const WINDIVERT_TCPHDR *tcp_header;
+    UINT i;
+
+    memcpy(check, buf, len);
+    WinDivertHelperCalcChecksums(check, len, NULL, 0);
+    if (memcmp(check, buf, len) != 0)
+    {
+        return FALSE;
+    }
+    if (!ipv6)
+    {
+        if (ip_header->SrcAddr != htonl(src_addr[0]) ||
+            ip_header->DstAddr != htonl(dst_addr[0]))
+        {
+            return FALSE;
+        }
+        tcp_header = (const WINDIVERT_TCPHDR *)(ip_header + 1);
+    }
+    else
+    {
+        for (i = 0; i < 4; i++)
+        {
+            if (ipv6_header->SrcAddr[i] != htonl(src_addr[i]) ||
+                ipv6_header->DstAddr[i] != htonl(dst_addr[i]))
+            {
+                return FALSE;
+            }
+        }
+        tcp_header = (const WINDIVERT_TCPHDR *)(ipv6_header + 1);
+    }
+    return (tcp_header->SrcPort == htons(src_port) &&
+        tcp_header->DstPort == htons(dst_port));
+}
+
+/*
+ * Query the table as the proxy would (WinDivertRedirectQuery).
+ */
+static BOOL sim_nat_query(PWINDIVERT_NAT nat, BOOL ipv6,
+    const UINT32 *remote, UINT16 port, UINT64 now, UINT16 *orig_port)
+{
+    UINT32 addr[4];
+    UINT16 port16;
+    UINT i;
+
+    memset(addr, 0, sizeof(addr));
+    for (i = 0; i < (ipv6? 4: 1); i++)
+    {
+        addr[i] = htonl(remote[i]);
+    }
+    if (!WinDivertNatQuery(nat, ipv6, addr, htons(port), now, &port16))
+    {
+        return FALSE;
+    }
+    *orig_port = ntohs(port16);
+    return TRUE;
+}
+
+/*
+ * Redirect table tests.  Entries are never freed; a slot is reused only
+ * after its entry has timed out, so the tests advance `now' explicitly.
+ */
+static int sim_nat(context_t context)
+{
+    static const UINT32 local4[4]  = {0x0A000001};
+    static const UINT32 remote4[4] = {0x5DB8D822};
+    static const UINT32 local6[4]  = {0x20010DB8, 0, 0, 1};
+    static const UINT32 remote6[4] = {0x20010DB8, 0, 0, 2};
+    static WINDIVERT_NAT_ENTRY entries[64], small_entries[8];
+    WINDIVERT_NAT nat, small_nat;
+    UINT8 buf[64], orig[64];
+    const UINT32 *local, *remote;
+    UINT len, i;
+    UINT16 orig_port;
+    UINT64 now = 1000, injected, dropped;
+    BOOL ipv6;
+    packet_t work;
+
+    WinDivertNatInit(&nat, entries, 64, htons(SIM_NAT_PROXY_PORT));
+    for (ipv6 = FALSE; ipv6 <= TRUE; ipv6++)
+    {
+        local  = (ipv6? local6: local4);
+        remote = (ipv6? remote6: remote4);
+
+        // Only an outbound SYN creates an entry:
+        len = sim_nat_packet(buf, ipv6, local, remote, 40000, 80, FALSE,
+            TRUE, FALSE);
+        memcpy(orig, buf, len);
+        SIM_CHECK(WinDivertNatTranslate(&nat, buf, len, now) ==
+            WINDIVERT_NAT_RESULT_IGNORE);
+        SIM_CHECK(memcmp(buf, orig, len) == 0);
+        SIM_CHECK(!sim_nat_query(&nat, ipv6, remote, 40000, now,
+            &orig_port));
+
+        // SYN: reflected to the proxy port.
+        len = sim_nat_packet(buf, ipv6, local, remote, 40000, 80, TRUE,
+            FALSE, FALSE);
+        SIM_CHECK(WinDivertNatTranslate(&nat, buf, len, now) ==
+            WINDIVERT_NAT_RESULT_REFLECT);
+        SIM_CHECK(sim_nat_check(buf, len, ipv6, remote, local, 40000,
+            SIM_NAT_PROXY_PORT));
+
+        // A SYN-only entry expires after WINDIVERT_NAT_TIMEOUT_SYN:
+        SIM_CHECK(sim_nat_query(&nat, ipv6, remote, 40000,
+            now + WINDIVERT_NAT_TIMEOUT_SYN, &orig_port));
+        SIM_CHECK(!sim_nat_query(&nat, ipv6, remote, 40000,
+            now + WINDIVERT_NAT_TIMEOUT_SYN + 1, &orig_port));
+
+        // Reverse lookup (the proxy's view), and the proxy's reply:
+        SIM_CHECK(sim_nat_query(&nat, ipv6, remote, 40000, now,
+                &orig_port) &&
+            orig_port == 80);
+        SIM_CHECK(!sim_nat_query(&nat, ipv6, remote, 40001, now,
+            &orig_port));
+        SIM_CHECK(!sim_nat_query(&nat, !ipv6, remote, 40000, now,
+            &orig_port));
+        len = sim_nat_packet(buf, ipv6, local, remote, SIM_NAT_PROXY_PORT,
+            40000, TRUE, TRUE, FALSE);
+        SIM_CHECK(WinDivertNatTranslate(&nat, buf, len, now) ==
+            WINDIVERT_NAT_RESULT_REFLECT);
+        SIM_CHECK(sim_nat_check(buf, len, ipv6, remote, local, 80, 40000));
+
+        // The handshake establishes the connection, which lasts longer:
+        len = sim_nat_packet(buf, ipv6, local, remote, 40000, 80, FALSE,
+            TRUE, FALSE);
+        SIM_CHECK(WinDivertNatTranslate(&nat, buf, len, now) ==
+            WINDIVERT_NAT_RESULT_REFLECT);
+        SIM_CHECK(sim_nat_check(buf, len, ipv6, remote, local, 40000,
+            SIM_NAT_PROXY_PORT));
+        SIM_CHECK(sim_nat_query(&nat, ipv6, remote, 40000,
+            now + WINDIVERT_NAT_TIMEOUT_SYN + 1, &orig_port));
+        SIM_CHECK(!sim_nat_query(&nat, ipv6, remote, 40000,
+            now + WINDIVERT_NAT_TIMEOUT_ESTABLISHED + 1, &orig_port));
+
+        // FIN: the entry lingers for WINDIVERT_NAT_TIMEOUT_CLOSING:
+        now += 1000;
+        len = sim_nat_packet(buf, ipv6, local, remote, 40000, 80, FALSE,
+            TRUE, TRUE);
+        SIM_CHECK(WinDivertNatTranslate(&nat, buf, len, now) ==
+            WINDIVERT_NAT_RESULT_REFLECT);
+        SIM_CHECK(sim_nat_query(&nat, ipv6, remote, 40000,
+            now + WINDIVERT_NAT_TIMEOUT_CLOSING, &orig_port));
+        SIM_CHECK(!sim_nat_query(&nat, ipv6, remote, 40000,
+            now + WINDIVERT_NAT_TIMEOUT_CLOSING + 1, &orig_port));
+
+        // Reusing the port while closing replaces the original port:
+        len = sim_nat_packet(buf, ipv6, local, remote, 40000, 443, TRUE,
+            FALSE, FALSE);
+        SIM_CHECK(WinDivertNatTranslate(&nat, buf, len, now) ==
+            WINDIVERT_NAT_RESULT_REFLECT);
+        SIM_CHECK(sim_nat_query(&nat, ipv6, remote, 40000, now,
+                &orig_port) &&
+            orig_port == 443);
+
+        // Once expired, the proxy's reply is no longer translated:
+        now += WINDIVERT_NAT_TIMEOUT_SYN + 1;
+        len = sim_nat_packet(buf, ipv6, local, remote, SIM_NAT_PROXY_PORT,
+            40000, FALSE, TRUE, FALSE);
+        SIM_CHECK(WinDivertNatTranslate(&nat, buf, len, now) ==
+            WINDIVERT_NAT_RESULT_IGNORE);
+    }
+
+    // Full table: 8 entries, half of them 20s younger than the rest.
+    WinDivertNatInit(&small_nat, small_entries, 8,
+        htons(SIM_NAT_PROXY_PORT));
+    for (i = 0; i < 8; i++)
+    {
+        len = sim_nat_packet(buf, FALSE, local4, remote4, 41000 + i, 80,
+            TRUE, FALSE, FALSE);
+        SIM_CHECK(WinDivertNatTranslate(&small_nat, buf, len,
+                now + (i < 4? 0: 20000)) ==
+            WINDIVERT_NAT_RESULT_REFLECT);
+    }
+    now += 20000;
+    len = sim_nat_packet(buf, FALSE, local4, remote4, 42000, 80, TRUE, FALSE,
+        FALSE);
+    SIM_CHECK(WinDivertNatTranslate(&small_nat, buf, len, now) ==
+        WINDIVERT_NAT_RESULT_DROP);
+    for (i = 0; i < 8; i++)
+    {
+        SIM_CHECK(sim_nat_query(&small_nat, FALSE, remote4, 41000 + i, now,
+                &orig_port) &&
+            orig_port == 80);
+    }
+
+    // The older half expires, so exactly 4 new connections fit:
+    now += WINDIVERT_NAT_TIMEOUT_SYN - 20000 + 1;
+    for (i = 0; i < 5; i++)
+    {
+        len = sim_nat_packet(buf, FALSE, local4, remote4, 42000 + i, 80,
+            TRUE, FALSE, FALSE);
+        SIM_CHECK(WinDivertNatTranslate(&small_nat, buf, len, now) ==
+            (i < 4? WINDIVERT_NAT_RESULT_REFLECT: WINDIVERT_NAT_RESULT_DROP));
+    }
+    for (i = 0; i < 8; i++)
+    {
+        SIM_CHECK(sim_nat_query(&small_nat, FALSE, remote4, 41000 + i, now,
+                &orig_port) == (i >= 4));
+        SIM_CHECK(sim_nat_query(&small_nat, FALSE, remote4, 42000 + i, now,
+                &orig_port) == (i < 4));
+    }
+
+    // Through the queueing core, which timestamps with the real clock: a
+    // reflected SYN is injected, a packet for an unknown connection is
+    // queued, and a SYN that does not fit is dropped.
+    now = (UINT64)KeQueryPerformanceCounter(NULL).QuadPart / 1000000;
+    WinDivertNatInit(&small_nat, small_entries, 8,
+        htons(SIM_NAT_PROXY_PORT));
+    for (i = 0; i < 8; i++)
+    {
+        len = sim_nat_packet(buf, FALSE, local4, remote4, 44000 + i, 80,
+            TRUE, FALSE, FALSE);
+        SIM_CHECK(WinDivertNatTranslate(&small_nat, buf, len, now) ==
+            WINDIVERT_NAT_RESULT_REFLECT);
+    }
+    context->nat = &small_nat;
+    injected = num_injected;
+    dropped  = num_dropped;
+    for (i = 0; i < 3; i++)
+    {
+        work = (packet_t)malloc(sizeof(struct packet_s) + 64);
+        if (work == NULL)
+        {
+            fprintf(stderr, "error: failed to allocate packet\n");
+            exit(EXIT_FAILURE);
+        }
+        len = sim_nat_packet(SIM_PACKET_DATA(work), FALSE, local4, remote4,
+            (i == 0? 44000: 43000 + i), 80, (i != 1), (i == 1), FALSE);
+        work->timestamp   = KeQueryPerformanceCounter(NULL).QuadPart;
+        work->match       = 1;
+        work->outbound    = 1;
+        work->packet_len  = len;
+        work->packet_size = sizeof(struct packet_s) + len;
+        work->sequence    = 0;
+        windivert_queue_work_packet(context, work, 0);
+    }
+    windivert_queue_service(context);
+    SIM_CHECK(num_injected == injected + 1);
+    SIM_CHECK(num_dropped == dropped + 1);
+    SIM_CHECK(context->packet_queue_length == 1);
+    context->nat = NULL;
+
+    printf("nat       %u checks\n", sim_checks);
+    if (sim_failures != 0)
+    {
+        printf("error: %u redirect test(s) failed\n", sim_failures);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/****************************************************************************/
+/* SIMULATOR                                                                */
+/****************************************************************************/
+
+#define SIM_HIST_BUCKETS                    (64 * 4)
+#define SIM_PRODUCERS_MAX                   64
+#define SIM_READERS_MAX                     64
+
+/*
+ * Per-thread statistics.
+ */
+struct stats_s
+{
+    UINT64 packets;                         // Packets produced/received.
+    UINT64 bytes;                           // Bytes produced/received.
+    UINT64 fast;                            // Fast-path packets.
+    UINT64 requests;                        // Requests completed.
+    UINT64 latency_sum;                     // Total latency (ns).
+    UINT64 latency_max;                     // Max latency (ns).
+    UINT64 cpu_time;                        // Producer CPU time (ns).
+    UINT64 hist[SIM_HIST_BUCKETS];          // Latency histogram.
+};
+
+/*
+ * Simulator configuration.
+ */
+static struct context_s context;
+static struct queue_s read_queue;
+static struct worker_s worker;
+static volatile BOOL stop = FALSE;
+static UINT packet_len  = 64;
+static UINT batch       = 1;
+static UINT reader_work = 0;                // Reader processing time (us).
+static UINT rate        = 0;                // Packets/s per producer (0=max).
+
+/*
+ * Latency histogram (4 buckets per power of 2).  Values are reported as the
+ * bucket's upper bound.
+ */
+static UINT sim_hist_bucket(UINT64 ns)
+{
+    UINT msb;
+
+    if (ns < 4)
+    {
+        return (UINT)ns;
+    }
+    msb = 63 - __builtin_clzll(ns);
+    return msb * 4 + (UINT)((ns >> (msb - 2)) & 0x3);
+}
+static UINT64 sim_hist_value(UINT bucket)
+{
+    UINT msb = bucket / 4;
+
+    if (bucket < 4)
+    {
+        return bucket + 1;
+    }
+    return ((UINT64)(4 + bucket % 4 + 1) << (msb - 2));
+}
+static void sim_record(struct stats_s *stats, LONGLONG timestamp,
+    LONGLONG now, UINT len)
+{
+    UINT64 latency = (UINT64)(now > timestamp? now - timestamp: 0);
+
+    stats->packets++;
+    stats->bytes += len;
+    stats->latency_sum += latency;
+    stats->latency_max = (latency > stats->latency_max? latency:
+        stats->latency_max);
+    stats->hist[sim_hist_bucket(latency)]++;
+}
+
+/*
+ * Service a single read request (cf. the driver's version, which copies
+ * the layer data into WINDIVERT_ADDRESS).
+ */
+static void windivert_read_service_request(context_t context, packet_t packet,
+    LONGLONG timestamp, WDFREQUEST request)
+{
+    UINT8 *dst;
+    ULONG dst_len, src_len, read_len = 0;
+    NTSTATUS status = STATUS_SUCCESS;
+    packet_t new_packet;
+    LONGLONG now;
+
+    if (request == NULL)
+    {
+        // This occurs if the packet timed out.
+        WINDIVERT_TRACE(context, timestamp, WINDIVERT_TRACE_DROP,
+            WINDIVERT_TRACE_DROP_TIMEOUT, packet->packet_len);
+        __atomic_add_fetch(&num_timeout, 1, __ATOMIC_RELAXED);
+        free(packet);
+        return;
+    }
+
+    dst = request->buf;
+    dst_len = request->buf_len;
+    request->addr_len = 0;
+    while (TRUE)
+    {
+        src_len = packet->packet_len;
+        if (src_len > dst_len)
+        {
+            status = STATUS_BUFFER_TOO_SMALL;
+        }
+        src_len = (src_len < dst_len? src_len: dst_len);
+        memcpy(dst, SIM_PACKET_DATA(packet), src_len);
+        dst += src_len;
+        dst_len -= src_len;
+        read_len += src_len;
+        now = KeQueryPerformanceCounter(NULL).QuadPart;
+        sim_record(request->stats, packet->timestamp, now, src_len);
+
+        request->addr_len++;
+        if (request->addr_len >= request->addr_max ||
+            request->addr_len >= WINDIVERT_BATCH_MAX)
+        {
+            break;
+        }
+        new_packet = windivert_read_service_next(context, dst_len, timestamp);
+        if (new_packet == NULL)
+        {
+            break;
+        }
+        free(packet);
+        packet = new_packet;
+    }
+    WINDIVERT_TRACE(context, timestamp, WINDIVERT_TRACE_READ,
+        (UINT8)request->addr_len, read_len);
+    free(packet);
+    WdfRequestCompleteWithInformation(request, status, read_len);
+}
+
+/*
+ * Fast-path read service request (cf. windivert_fast_read_service_request).
+ */
+static void sim_fast_read_service_request(const UINT8 *data, UINT len,
+    LONGLONG timestamp, WDFREQUEST request)
+{
+    ULONG read_len = (len < request->buf_len? len: request->buf_len);
+
+    memcpy(request->buf, data, read_len);
+    request->addr_len = 1;
+    sim_record(request->stats, timestamp,
+        KeQueryPerformanceCounter(NULL).QuadPart, read_len);
+    WdfRequestCompleteWithInformation(request,
+        (read_len < len? STATUS_BUFFER_TOO_SMALL: STATUS_SUCCESS), read_len);
+}
+
+/*
+ * Producer thread (cf. windivert_queue_work).
+ */
+static void *sim_producer(void *arg)
+{
+    struct stats_s *stats = (struct stats_s *)arg;
+    UINT8 data[WINDIVERT_MTU_MAX];
+    WDFREQUEST request;
+    packet_t work;
+    UINT32 sequence;
+    LONGLONG timestamp, start, next;
+    WINDIVERT_CPU_SAMPLE sample_data;
+    PWINDIVERT_CPU_SAMPLE sample = NULL;
+    struct timespec ts, cpu_start, cpu_end;
+    UINT size;
+
+    memset(data, 0xAB, packet_len);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+    start = KeQueryPerformanceCounter(NULL).QuadPart;
+    while (!stop)
+    {
+        timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+        if (rate != 0)
+        {
+            next = start + (LONGLONG)(stats->packets * 1000000000 / rate);
+            if (next > timestamp)
+            {
+                ts.tv_sec  = (next - timestamp) / 1000000000;
+                ts.tv_nsec = (next - timestamp) % 1000000000;
+                nanosleep(&ts, NULL);
+                timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+            }
+        }
+        stats->packets++;
+        stats->bytes += packet_len;
+        if (context.cpu != NULL)
+        {
+            sample = WinDivertCpuSample(context.cpu,
+                KeGetCurrentProcessorNumber(), timestamp, &sample_data);
+        }
+
+        WINDIVERT_TRACE(&context, timestamp, WINDIVERT_TRACE_MATCH, 0,
+            packet_len);
+        request = windivert_queue_fast_request(&context, FALSE, &sequence);
+        if (request != NULL)
+        {
+            WINDIVERT_TRACE(&context, timestamp, WINDIVERT_TRACE_FAST_PATH, 0,
+                packet_len);
+            WINDIVERT_CPU_PHASE(sample, WINDIVERT_CPU_QUEUE);
+            stats->fast++;
+            sim_fast_read_service_request(data, packet_len, timestamp,
+                request);
+            WINDIVERT_CPU_PHASE(sample, WINDIVERT_CPU_COPY);
+            continue;
+        }
+
+        size = sizeof(struct packet_s) + packet_len;
+        work = (packet_t)malloc(size);
+        if (work == NULL)
+        {
+            WINDIVERT_TRACE(&context, timestamp, WINDIVERT_TRACE_DROP,
+                WINDIVERT_TRACE_DROP_NO_MEMORY, packet_len);
+            __atomic_add_fetch(&num_dropped, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        WINDIVERT_CPU_PHASE(sample, WINDIVERT_CPU_QUEUE);
+        memcpy(SIM_PACKET_DATA(work), data, packet_len);
+        WINDIVERT_CPU_PHASE(sample, WINDIVERT_CPU_COPY);
+        work->timestamp   = timestamp;
+        work->match       = 1;
+        work->outbound    = 0;
+        work->packet_len  = packet_len;
+        work->packet_size = size;
+        work->sequence    = 0;
+        windivert_queue_work_packet(&context, work, 0);
+        WINDIVERT_CPU_PHASE(sample, WINDIVERT_CPU_QUEUE);
+    }
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+    stats->cpu_time = (UINT64)((cpu_end.tv_sec - cpu_start.tv_sec) *
+        1000000000 + (cpu_end.tv_nsec - cpu_start.tv_nsec));
+    return NULL;
+}
+
+/*
+ * Reader thread (cf. WinDivertRecvEx).
+ */
+static void *sim_reader(void *arg)
+{
+    struct stats_s *stats = (struct stats_s *)arg;
+    struct request_s request;
+    struct timespec ts;
+    NTSTATUS status;
+
+    memset(&request, 0, sizeof(request));
+    pthread_mutex_init(&request.lock, NULL);
+    pthread_cond_init(&request.cond, NULL);
+    request.buf_len  = batch * WINDIVERT_MTU_MAX;
+    request.buf      = (UINT8 *)malloc(request.buf_len);
+    request.addr_max = batch;
+    request.stats    = stats;
+    if (request.buf == NULL)
+    {
+        fprintf(stderr, "error: failed to allocate read buffer\n");
+        exit(EXIT_FAILURE);
+    }
+    while (TRUE)
+    {
+        request.done = FALSE;
+        status = windivert_read(&context, &request);
+        if (!NT_SUCCESS(status))
+        {
+            break;
+        }
+        pthread_mutex_lock(&request.lock);
+        while (!request.done)
+        {
+            pthread_cond_wait(&request.cond, &request.lock);
+        }
+        pthread_mutex_unlock(&request.lock);
+        if (request.status == STATUS_PIPE_EMPTY)
+        {
+            break;
+        }
+        stats->requests++;
+        if (reader_work != 0)
+        {
+            ts.tv_sec  = reader_work / 1000000;
+            ts.tv_nsec = (reader_work % 1000000) * 1000;
+            nanosleep(&ts, NULL);
+        }
+    }
+    free(request.buf);
+    return NULL;
+}
+
+/*
+ * Receive pool buffer (cf. dll/windivert_recvpool.c).
+ */
+struct sim_buffer_s
+{
+    struct request_s request;               // Read request.
+    WINDIVERT_RECV_BUFFER buffer;           // Scheduler's buffer.
+    struct stats_s stats;                   // Buffer's statistics.
+};
+
+static struct port_s pool_port;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static WINDIVERT_RECV_SCHED pool_sched;
+static struct sim_buffer_s *pool_buffers = NULL;
+static UINT pool_num_buffers = 0;
+
+/*
+ * Issue reads until the scheduler's target is reached (cf.
+ * WinDivertRecvPoolIssue).
+ */
+static void sim_pool_issue(void)
+{
+    PWINDIVERT_RECV_BUFFER buffers[WINDIVERT_RECV_POOL_READS_MAX], buffer;
+    struct sim_buffer_s *entry;
+    UINT count = 0, i;
+    NTSTATUS status;
+    BOOL done = FALSE;
+
+    pthread_mutex_lock(&pool_lock);
+    while (count < WINDIVERT_RECV_POOL_READS_MAX &&
+        (buffer = WinDivertRecvSchedIssue(&pool_sched)) != NULL)
+    {
+        buffers[count++] = buffer;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    for (i = 0; i < count; i++)
+    {
+        entry = CONTAINING_RECORD(buffers[i], struct sim_buffer_s, buffer);
+        status = windivert_read(&context, &entry->request);
+        if (NT_SUCCESS(status))
+        {
+            continue;
+        }
+        pthread_mutex_lock(&pool_lock);
+        (void)WinDivertRecvSchedComplete(&pool_sched, buffers[i],
+            (UINT32)status);
+        done = WinDivertRecvSchedDone(&pool_sched);
+        pthread_mutex_unlock(&pool_lock);
+    }
+    if (done)
+    {
+        sim_port_close(&pool_port);
+    }
+}
+
+/*
+ * Receive pool worker thread (cf. WinDivertRecvPoolWorker).
+ */
+static void *sim_pool_worker(void *arg)
+{
+    struct sim_buffer_s *entry;
+    WDFREQUEST request;
+    struct timespec ts;
+    UINT32 error;
+    BOOL dispatch, done;
+
+    UNREFERENCED_PARAMETER(arg);
+
+    while ((request = sim_port_get(&pool_port)) != NULL)
+    {
+        entry = CONTAINING_RECORD(request, struct sim_buffer_s, request);
+        entry->buffer.recv_len = request->information;
+        entry->buffer.addr_len = request->addr_len * sizeof(WINDIVERT_ADDRESS);
+        error = (NT_SUCCESS(request->status)? 0: (UINT32)request->status);
+
+        pthread_mutex_lock(&pool_lock);
+        dispatch = WinDivertRecvSchedComplete(&pool_sched, &entry->buffer,
+            error);
+        done = WinDivertRecvSchedDone(&pool_sched);
+        pthread_mutex_unlock(&pool_lock);
+        if (!dispatch)
+        {
+            if (done)
+            {
+                sim_port_close(&pool_port);
+            }
+            continue;
+        }
+
+        sim_pool_issue();
+        entry->stats.requests++;
+        if (reader_work != 0)
+        {
+            ts.tv_sec  = reader_work / 1000000;
+            ts.tv_nsec = (reader_work % 1000000) * 1000;
+            nanosleep(&ts, NULL);
+        }
+
+        pthread_mutex_lock(&pool_lock);
+        WinDivertRecvSchedRelease(&pool_sched, &entry->buffer);
+        done = WinDivertRecvSchedDone(&pool_sched);
+        pthread_mutex_unlock(&pool_lock);
+        if (done)
+        {
+            sim_port_close(&pool_port);
+        }
+        sim_pool_issue();
+    }
+    return NULL;
+}
+
+/*
+ * Initialize the receive pool (cf. WinDivertRecvPoolCreate).
+ */
+static void sim_pool_init(UINT reads, UINT threads)
+{
+    struct sim_buffer_s *entry;
+    UINT i;
+
+    pthread_mutex_init(&pool_port.lock, NULL);
+    pthread_cond_init(&pool_port.cond, NULL);
+    InitializeListHead(&pool_port.completions);
+    WinDivertRecvSchedInit(&pool_sched, reads);
+    pool_num_buffers = reads + threads;
+    pool_buffers = (struct sim_buffer_s *)calloc(pool_num_buffers,
+        sizeof(struct sim_buffer_s));
+    if (pool_buffers == NULL)
+    {
+        fprintf(stderr, "error: failed to allocate receive pool\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < pool_num_buffers; i++)
+    {
+        entry = &pool_buffers[i];
+        entry->request.buf_len  = batch * WINDIVERT_MTU_MAX;
+        entry->request.buf      = (UINT8 *)malloc(entry->request.buf_len);
+        entry->request.addr_max = batch;
+        entry->request.stats    = &entry->stats;
+        entry->request.port     = &pool_port;
+        if (entry->request.buf == NULL)
+        {
+            fprintf(stderr, "error: failed to allocate read buffer\n");
+            exit(EXIT_FAILURE);
+        }
+        entry->buffer.packet      = entry->request.buf;
+        entry->buffer.packet_size = entry->request.buf_len;
+        entry->buffer.addr_size   = batch * sizeof(WINDIVERT_ADDRESS);
+        WinDivertRecvSchedPut(&pool_sched, &entry->buffer);
+    }
+}
+
+/*
+ * Ordered send (cf. dll/windivert_sequencer.c).  Each thread receives a
+ * batch of sequence numbers from the "driver" and tracks them, works on
+ * them for a random time (so batches complete out of order), then sends or
+ * discards them through the reorder core.  Sent packets are checked for
+ * global and per-flow order.
+ */
+#define SIM_ORDER_FLOWS                     64
+#define SIM_ORDER_TIMEOUT                   100     // ms
+#define SIM_ORDER_DISCARD                   100     // 1 in N is discarded.
+
+#define SIM_ORDER_FLOW(sequence)                                            \
+    (((UINT32)(sequence) * 0x9E3779B1) >> 26)
+
+/*
+ * Ordered send thread statistics.
+ */
+struct sim_order_s
+{
+    UINT64 packets;                         // Packets completed.
+    UINT64 calls;                           // Send calls.
+    UINT64 call_ns;                         // Time in send calls (ns).
+    UINT64 held_ns;                         // Time holding the lock (ns).
+    UINT32 seed;                            // Work time PRNG.
+};
+
+static pthread_mutex_t order_recv_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t order_lock = PTHREAD_MUTEX_INITIALIZER;
+static PWINDIVERT_REORDER order = NULL;     // NULL = send unordered.
+static UINT32 order_sequence = 0;           // Driver's next sequence.
+static UINT32 order_last[SIM_ORDER_FLOWS + 1];
+static BOOL order_started[SIM_ORDER_FLOWS + 1];
+static UINT64 order_sent = 0;
+static UINT64 order_violations[2] = {0};    // Global, per-flow.
+
+/*
+ * Clock (ms).
+ */
+static UINT32 sim_order_now(void)
+{
+    return (UINT32)(KeQueryPerformanceCounter(NULL).QuadPart / 1000000);
+}
+
+/*
+ * Check the order of a sent packet (cf. WinDivertSequencerEmit).
+ */
+static BOOL sim_order_emit(PVOID context, const VOID *packet,
+    UINT packet_len, const WINDIVERT_ADDRESS *addr, BOOL owned)
+{
+    UINT32 sequence = addr->Sequence;
+    UINT i, idx;
+
+    UNREFERENCED_PARAMETER(context);
+    UNREFERENCED_PARAMETER(packet_len);
+
+    for (i = 0; i < 2; i++)
+    {
+        idx = (i == 0? SIM_ORDER_FLOWS: SIM_ORDER_FLOW(sequence));
+        if (order_started[idx] &&
+            WINDIVERT_REORDER_BEFORE(sequence, order_last[idx]))
+        {
+            order_violations[i]++;
+        }
+        order_started[idx] = TRUE;
+        order_last[idx]    = sequence;
+    }
+    order_sent++;
+    if (owned)
+    {
+        free((PVOID)packet);
+    }
+    return TRUE;
+}
+
+/*
+ * Copy a held packet (cf. WinDivertSequencerCopy).
+ */
+static UINT8 *sim_order_copy(PVOID context, const VOID *packet,
+    UINT packet_len)
+{
+    UINT8 *copy;
+
+    UNREFERENCED_PARAMETER(context);
+
+    copy = (UINT8 *)malloc(packet_len == 0? 1: packet_len);
+    if (copy != NULL)
+    {
+        memcpy(copy, packet, packet_len);
+    }
+    return copy;
+}
+
+/*
+ * Ordered send thread (cf. WinDivertSequencerRecvEx and
+ * WinDivertSequencerSendEx).
+ */
+static void *sim_order_thread(void *arg)
+{
+    struct sim_order_s *stats = (struct sim_order_s *)arg;
+    static UINT8 data[WINDIVERT_MTU_MAX];
+    WINDIVERT_ADDRESS addr[WINDIVERT_BATCH_MAX];
+    struct timespec ts;
+    LONGLONG start, locked, end;
+    UINT32 sequence, now, work;
+    UINT i;
+
+    memset(addr, 0, sizeof(addr));
+    while (!stop)
+    {
+        pthread_mutex_lock(&order_recv_lock);
+        sequence = order_sequence;
+        order_sequence += batch;
+        pthread_mutex_unlock(&order_recv_lock);
+
+        pthread_mutex_lock(&order_lock);
+        now = sim_order_now();
+        for (i = 0; i < batch; i++)
+        {
+            addr[i].Sequence = sequence + i;
+            if (order != NULL)
+            {
+                WinDivertReorderTrack(order, sequence + i,
+                    SIM_ORDER_FLOW(sequence + i), now);
+            }
+        }
+        if (order != NULL && WinDivertReorderExpired(order, now))
+        {
+            WinDivertReorderRelease(order, order->next, now, FALSE);
+        }
+        pthread_mutex_unlock(&order_lock);
+
+        if (reader_work != 0)
+        {
+            stats->seed = stats->seed * 1103515245 + 12345;
+            work = (stats->seed >> 8) % (2 * reader_work + 1);
+            ts.tv_sec  = work / 1000000;
+            ts.tv_nsec = (work % 1000000) * 1000;
+            nanosleep(&ts, NULL);
+        }
+
+        start = KeQueryPerformanceCounter(NULL).QuadPart;
+        pthread_mutex_lock(&order_lock);
+        locked = KeQueryPerformanceCounter(NULL).QuadPart;
+        now = (UINT32)(locked / 1000000);
+        for (i = 0; i < batch; i++)
+        {
+            if ((sequence + i) % SIM_ORDER_DISCARD == 0)
+            {
+                if (order != NULL)
+                {
+                    WinDivertReorderComplete(order, NULL, 0, &addr[i], now);
+                }
+            }
+            else if (order != NULL)
+            {
+                WinDivertReorderComplete(order, data, packet_len, &addr[i],
+                    now);
+            }
+            else
+            {
+                sim_order_emit(NULL, data, packet_len, &addr[i], FALSE);
+            }
+        }
+        if (order != NULL)
+        {
+            WinDivertReorderRelease(order, order->next, now, FALSE);
+            WinDivertReorderHold(order);
+        }
+        end = KeQueryPerformanceCounter(NULL).QuadPart;
+        pthread_mutex_unlock(&order_lock);
+        stats->packets += batch;
+        stats->calls++;
+        stats->call_ns += (UINT64)(end - start);
+        stats->held_ns += (UINT64)(end - locked);
+    }
+    return NULL;
+}
+
+/*
+ * Run the ordered send benchmark.
+ */
+static int sim_order(const char *mode, UINT threads, UINT seconds)
+{
+    static struct sim_order_s stats[SIM_READERS_MAX];
+    pthread_t handles[SIM_READERS_MAX];
+    UINT64 packets = 0, calls = 0, call_ns = 0, held_ns = 0;
+    UINT i;
+
+    if (strcmp(mode, "none") != 0)
+    {
+        order = (PWINDIVERT_REORDER)calloc(1, sizeof(WINDIVERT_REORDER));
+        if (order == NULL)
+        {
+            fprintf(stderr, "error: failed to allocate reorder state\n");
+            exit(EXIT_FAILURE);
+        }
+        WinDivertReorderInit(order, (strcmp(mode, "flow") == 0),
+            SIM_ORDER_TIMEOUT, order_sequence, sim_order_emit,
+            sim_order_copy, NULL);
+    }
+    for (i = 0; i < threads; i++)
+    {
+        stats[i].seed = i + 1;
+        if (pthread_create(&handles[i], NULL, sim_order_thread,
+                &stats[i]) != 0)
+        {
+            fprintf(stderr, "error: failed to create thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    sleep(seconds);
+    stop = TRUE;
+    for (i = 0; i < threads; i++)
+    {
+        pthread_join(handles[i], NULL);
+        packets += stats[i].packets;
+        calls   += stats[i].calls;
+        call_ns += stats[i].call_ns;
+        held_ns += stats[i].held_ns;
+    }
+    if (order != NULL)
+    {
+        WinDivertReorderRelease(order, order->next, sim_order_now(), TRUE);
+    }
+
+    printf("order=%s threads=%u batch=%u work=%uus timeout=%ums\n", mode,
+        threads, batch, reader_work, SIM_ORDER_TIMEOUT);
+    printf("sent      %llu of %llu (%.2f Mpps)\n",
+        (unsigned long long)order_sent, (unsigned long long)packets,
+        (double)order_sent / seconds / 1e6);
+    printf("send      %.0fns/call, %.0fns holding the lock\n",
+        (calls == 0? 0.0: (double)call_ns / calls),
+        (calls == 0? 0.0: (double)held_ns / calls));
+    if (order != NULL)
+    {
+        printf("release   %.1f slots scanned/call, %llu expired, "
+            "%llu overflow, %llu late\n",
+            (double)order->scanned / calls,
+            (unsigned long long)order->expired,
+            (unsigned long long)order->overflow,
+            (unsigned long long)order->late);
+    }
+    printf("reordered %llu global, %llu per-flow\n",
+        (unsigned long long)order_violations[0],
+        (unsigned long long)order_violations[1]);
+    if (order == NULL)
+    {
+        return EXIT_SUCCESS;
+    }
+
+    // Only late packets (sent after an early release) may be out of order,
+    // and packets are only late after an early release:
+    if (order_violations[order->flow? 1: 0] > order->late ||
+        (order->late != 0 && order->expired == 0 && order->overflow == 0))
+    {
+        printf("error: packets sent out of order\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Flight recorder overhead (dll/windivert_trace.c).  Each thread records
+ * events for half of the run, first to its own slot (as on distinct
+ * processors), then all threads to slot 0 (as when they share one).  The
+ * cost is measured in thread CPU time, so it does not include time spent
+ * preempted when there are more threads than processors.  Meanwhile, the
+ * main thread takes snapshots, and checks that no torn entries are copied
+ * (each event's timestamp and value are the same counter).
+ */
+#define SIM_TRACE_BATCH                     1024
+
+struct sim_trace_s
+{
+    PWINDIVERT_TRACE trace;                 // Recorder.
+    UINT32 processor;                       // Slot to record to.
+    UINT64 events;                          // Events recorded.
+    UINT64 ns;                              // Time recording (ns).
+};
+
+/*
+ * Trace thread.
+ */
+static void *sim_trace_thread(void *arg)
+{
+    struct sim_trace_s *stats = (struct sim_trace_s *)arg;
+    struct timespec start, end;
+    UINT32 n = 0;
+    UINT i;
+
+    while (!stop)
+    {
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+        for (i = 0; i < SIM_TRACE_BATCH; i++, n++)
+        {
+            WinDivertTraceRecord(stats->trace, stats->processor, (INT64)n,
+                WINDIVERT_TRACE_QUEUE, 0, n);
+        }
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+        stats->ns += (UINT64)((end.tv_sec - start.tv_sec) * 1000000000 +
+            (end.tv_nsec - start.tv_nsec));
+        stats->events += SIM_TRACE_BATCH;
+    }
+    return NULL;
+}
+
+/*
+ * Run the flight recorder benchmark.
+ */
+static int sim_trace(UINT threads, UINT seconds)
+{
+    static struct sim_trace_s stats[SIM_READERS_MAX];
+    static WINDIVERT_TRACE_EVENT events[WINDIVERT_TRACE_MAX];
+    pthread_t handles[SIM_READERS_MAX];
+    PWINDIVERT_TRACE trace;
+    UINT64 events_sum, ns, snapshots, torn;
+    LONGLONG deadline;
+    UINT shared, count, i;
+    int result = EXIT_SUCCESS;
+
+    trace = (PWINDIVERT_TRACE)calloc(1, sizeof(WINDIVERT_TRACE));
+    if (trace == NULL)
+    {
+        fprintf(stderr, "error: failed to allocate trace\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("threads=%u\n", threads);
+    for (shared = 0; shared < 2; shared++)
+    {
+        stop = FALSE;
+        memset(trace, 0, sizeof(WINDIVERT_TRACE));
+        memset(stats, 0, sizeof(stats));
+        for (i = 0; i < threads; i++)
+        {
+            stats[i].trace     = trace;
+            stats[i].processor = (shared? 0: i);
+            if (pthread_create(&handles[i], NULL, sim_trace_thread,
+                    &stats[i]) != 0)
+            {
+                fprintf(stderr, "error: failed to create thread\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        deadline = KeQueryPerformanceCounter(NULL).QuadPart +
+            (LONGLONG)seconds * 500000000;
+        snapshots = torn = 0;
+        while (KeQueryPerformanceCounter(NULL).QuadPart < deadline)
+        {
+            count = WinDivertTraceSnapshot(trace, events,
+                WINDIVERT_TRACE_MAX);
+            for (i = 0; i < count; i++)
+            {
+                torn += (events[i].Timestamp != (INT64)events[i].Value);
+            }
+            snapshots++;
+            usleep(1000);
+        }
+        stop = TRUE;
+        events_sum = ns = 0;
+        for (i = 0; i < threads; i++)
+        {
+            pthread_join(handles[i], NULL);
+            events_sum += stats[i].events;
+            ns         += stats[i].ns;
+        }
+        count = WinDivertTraceSnapshot(trace, events, WINDIVERT_TRACE_MAX);
+        printf("%-9s %.1fns/event, %.1fM events/s, snapshot %u events, "
+            "%llu torn in %llu snapshots\n",
+            (shared? "shared": "per-cpu"),
+            (events_sum == 0? 0.0: (double)ns / events_sum),
+            (double)events_sum / (seconds * 0.5) / 1e6, count,
+            (unsigned long long)torn, (unsigned long long)snapshots);
+        if (torn != 0)
+        {
+            printf("error: torn trace entries copied\n");
+            result = EXIT_FAILURE;
+        }
+    }
+    return result;
+}
+
+/*
+ * Worker thread (cf. windivert_worker).
+ */
+static void *sim_worker(void *arg)
+{
+    struct worker_s *worker = (struct worker_s *)arg;
+
+    while (TRUE)
+    {
+        pthread_mutex_lock(&worker->lock);
+        while (!worker->queued && !worker->stop)
+        {
+            pthread_cond_wait(&worker->cond, &worker->lock);
+        }
+        if (worker->stop)
+        {
+            pthread_mutex_unlock(&worker->lock);
+            return NULL;
+        }
+        worker->queued = FALSE;
+        pthread_mutex_unlock(&worker->lock);
+        windivert_queue_service(worker->context);
+    }
+}
+
+/*
+ * Entry.
+ */
+int main(int argc, char **argv)
+{
+    static struct stats_s producer_stats[SIM_PRODUCERS_MAX];
+    static struct stats_s reader_stats[SIM_READERS_MAX];
+    struct stats_s total_in, total_out;
+    pthread_t producers[SIM_PRODUCERS_MAX], readers[SIM_READERS_MAX];
+    KLOCK_QUEUE_HANDLE lock_handle;
+    struct stats_s *stats;
+    UINT num_producers = 4, num_readers = 1, seconds = 5, reads = 0, i, j;
+    UINT queue_length = WINDIVERT_PARAM_QUEUE_LENGTH_DEFAULT;
+    UINT queue_size = WINDIVERT_PARAM_QUEUE_SIZE_DEFAULT;
+    UINT queue_time = WINDIVERT_PARAM_QUEUE_TIME_DEFAULT;
+    UINT64 count, accounted, p50 = 0, p99 = 0;
+    static WINDIVERT_TRACE_EVENT trace[WINDIVERT_TRACE_MAX];
+    UINT trace_len, trace_types[8] = {0};
+    UINT64 cpu_events = 0, cpu_time[WINDIVERT_CPU_MAX] = {0};
+    BOOL empty, process = FALSE, nat = FALSE, cpu = TRUE;
+    const char *order_mode = NULL;
+    BOOL trace_bench = FALSE;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:r:t:b:l:s:q:n:w:R:k:O:CTPN")) != -1)
+    {
+        switch (opt)
+        {
+            case 'p':
+                num_producers = (UINT)atoi(optarg);
+                break;
+            case 'r':
+                num_readers = (UINT)atoi(optarg);
+                break;
+            case 't':
+                seconds = (UINT)atoi(optarg);
+                break;
+            case 'b':
+                batch = (UINT)atoi(optarg);
+                break;
+            case 'l':
+                queue_length = (UINT)atoi(optarg);
+                break;
+            case 's':
+                queue_size = (UINT)atoi(optarg);
+                break;
+            case 'q':
+                queue_time = (UINT)atoi(optarg);
+                break;
+            case 'n':
+                packet_len = (UINT)atoi(optarg);
+                break;
+            case 'w':
+                reader_work = (UINT)atoi(optarg);
+                break;
+            case 'R':
+                rate = (UINT)atoi(optarg);
+                break;
+            case 'k':
+                reads = (UINT)atoi(optarg);
+                break;
+            case 'O':
+                order_mode = optarg;
+                break;
+            case 'C':
+                cpu = FALSE;
+                break;
+            case 'T':
+                trace_bench = TRUE;
+                break;
+            case 'P':
+                process = TRUE;
+                break;
+            case 'N':
+                nat = TRUE;
+                break;
+            default:
+usage:
+                fprintf(stderr, "usage: %s [-p producers] [-r readers] "
+                    "[-t seconds] [-b batch] [-l queue-length] "
+                    "[-s queue-size] [-q queue-time-ms] [-n packet-len] "
+                    "[-w reader-work-us] [-R rate-pps] [-k pool-reads] "
+                    "[-O none|global|flow] [-C] [-T] [-P] [-N]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (num_producers == 0 || num_producers > SIM_PRODUCERS_MAX ||
+        num_readers == 0 || num_readers > SIM_READERS_MAX ||
+        batch == 0 || batch > WINDIVERT_BATCH_MAX || packet_len == 0 ||
+        packet_len > WINDIVERT_MTU_MAX || queue_length == 0 ||
+        reads > WINDIVERT_RECV_POOL_READS_MAX ||
+        (order_mode != NULL && strcmp(order_mode, "none") != 0 &&
+            strcmp(order_mode, "global") != 0 &&
+            strcmp(order_mode, "flow") != 0))
+    {
+        goto usage;
+    }
+    if (process)
+    {
+        return sim_process(seconds);
+    }
+    if (order_mode != NULL)
+    {
+        return sim_order(order_mode, num_readers, seconds);
+    }
+    if (trace_bench)
+    {
+        return sim_trace(num_readers, seconds);
+    }
+
+    // Initialize the context (cf. windivert_create):
+    memset(&context, 0, sizeof(context));
+    pthread_spin_init(&context.lock, PTHREAD_PROCESS_PRIVATE);
+    InitializeListHead(&context.work_queue);
+    InitializeListHead(&context.packet_queue);
+    context.packet_queue_maxlength = queue_length;
+    context.packet_queue_maxsize   = queue_size;
+    context.packet_queue_maxcounts = (LONGLONG)queue_time * 1000000;
+    pthread_mutex_init(&read_queue.lock, NULL);
+    InitializeListHead(&read_queue.requests);
+    context.read_queue = &read_queue;
+    context.trace = (struct WINDIVERT_TRACE *)calloc(1,
+        sizeof(struct WINDIVERT_TRACE));
+    if (context.trace == NULL)
+    {
+        fprintf(stderr, "error: failed to allocate trace\n");
+        exit(EXIT_FAILURE);
+    }
+    if (cpu)
+    {
+        context.cpu = (struct WINDIVERT_CPU *)calloc(1,
+            sizeof(struct WINDIVERT_CPU));
+        if (context.cpu == NULL)
+        {
+            fprintf(stderr, "error: failed to allocate CPU accounting\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_mutex_init(&worker.lock, NULL);
+    pthread_cond_init(&worker.cond, NULL);
+    worker.context = &context;
+    context.worker = &worker;
+    context.state = WINDIVERT_CONTEXT_STATE_OPEN;
+    if (nat)
+    {
+        return sim_nat(&context);
+    }
+
+    // Run:
+    if (pthread_create(&worker.thread, NULL, sim_worker, &worker) != 0)
+    {
+        fprintf(stderr, "error: failed to create worker thread\n");
+        exit(EXIT_FAILURE);
+    }
+    if (reads != 0)
+    {
+        sim_pool_init(reads, num_readers);
+    }
+    for (i = 0; i < num_readers; i++)
+    {
+        if (pthread_create(&readers[i], NULL,
+                (reads != 0? sim_pool_worker: sim_reader),
+                &reader_stats[i]) != 0)
+        {
+            fprintf(stderr, "error: failed to create reader thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (reads != 0)
+    {
+        sim_pool_issue();
+    }
+    for (i = 0; i < num_producers; i++)
+    {
+        if (pthread_create(&producers[i], NULL, sim_producer,
+                &producer_stats[i]) != 0)
+        {
+            fprintf(stderr, "error: failed to create producer thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    sleep(seconds);
+    stop = TRUE;
+    for (i = 0; i < num_producers; i++)
+    {
+        pthread_join(producers[i], NULL);
+    }
+
+    // Drain the work queue, then shutdown recv (cf. WinDivertShutdown) so
+    // that the readers drain the packet queue and exit:
+    do
+    {
+        WdfWorkItemEnqueue(&worker);
+        usleep(1000);
+        KeAcquireInStackQueuedSpinLock(&context.lock, &lock_handle);
+        empty = IsListEmpty(&context.work_queue);
+        KeReleaseInStackQueuedSpinLock(&lock_handle);
+    }
+    while (!empty);
+    KeAcquireInStackQueuedSpinLock(&context.lock, &lock_handle);
+    context.shutdown_recv = TRUE;
+    context.shutdown_recv_enabled = TRUE;
+    KeReleaseInStackQueuedSpinLock(&lock_handle);
+    windivert_read_service(&context);
+    for (i = 0; i < num_readers; i++)
+    {
+        pthread_join(readers[i], NULL);
+    }
+    pthread_mutex_lock(&worker.lock);
+    worker.stop = TRUE;
+    pthread_cond_signal(&worker.cond);
+    pthread_mutex_unlock(&worker.lock);
+    pthread_join(worker.thread, NULL);
+    context.state = WINDIVERT_CONTEXT_STATE_CLOSED;
+
+    // Report:
+    memset(&total_in, 0, sizeof(total_in));
+    memset(&total_out, 0, sizeof(total_out));
+    for (i = 0; i < num_producers; i++)
+    {
+        total_in.packets  += producer_stats[i].packets;
+        total_in.fast     += producer_stats[i].fast;
+        total_in.cpu_time += producer_stats[i].cpu_time;
+    }
+    for (i = 0; i < (reads != 0? pool_num_buffers: num_readers); i++)
+    {
+        stats = (reads != 0? &pool_buffers[i].stats: &reader_stats[i]);
+        total_out.packets     += stats->packets;
+        total_out.bytes       += stats->bytes;
+        total_out.requests    += stats->requests;
+        total_out.latency_sum += stats->latency_sum;
+        total_out.latency_max  = (stats->latency_max > total_out.latency_max?
+            stats->latency_max: total_out.latency_max);
+        for (j = 0; j < SIM_HIST_BUCKETS; j++)
+        {
+            total_out.hist[j] += stats->hist[j];
+        }
+    }
+    for (count = 0, j = 0; j < SIM_HIST_BUCKETS; j++)
+    {
+        count += total_out.hist[j];
+        if (p50 == 0 && count * 2 >= total_out.packets)
+        {
+            p50 = sim_hist_value(j);
+        }
+        if (p99 == 0 && count * 100 >= total_out.packets * 99)
+        {
+            p99 = sim_hist_value(j);
+        }
+    }
+    accounted = total_out.packets + num_dropped + num_timeout + num_injected;
+    trace_len = WinDivertTraceSnapshot(context.trace, trace,
+        WINDIVERT_TRACE_MAX);
+    for (i = 0; i < trace_len; i++)
+    {
+        trace_types[trace[i].Type & 0x7]++;
+    }
+    if (context.cpu != NULL)
+    {
+        WinDivertCpuQuery(context.cpu, &cpu_events, cpu_time);
+    }
+
+    printf("producers=%u readers=%u batch=%u packet_len=%u queue=%u/%u/%ums "
+        "reader_work=%uus rate=%u pool_reads=%u\n", num_producers,
+        num_readers, batch, packet_len, queue_length, queue_size, queue_time,
+        reader_work, rate, reads);
+    printf("produced  %llu (%.2f Mpps)\n",
+        (unsigned long long)total_in.packets,
+        (double)total_in.packets / seconds / 1e6);
+    printf("received  %llu (%.2f Mpps, %.1f MB/s)\n",
+        (unsigned long long)total_out.packets,
+        (double)total_out.packets / seconds / 1e6,
+        (double)total_out.bytes / seconds / 1e6);
+    printf("cpu       %.1fns/packet producer, accounting ",
+        (total_in.packets == 0? 0.0:
+            (double)total_in.cpu_time / total_in.packets));
+    if (context.cpu == NULL)
+    {
+        printf("disabled\n");
+    }
+    else
+    {
+        printf("%llu events (1/%u sampled), queue=%.1fns copy=%.1fns "
+            "per packet\n", (unsigned long long)cpu_events,
+            WINDIVERT_CPU_SAMPLE_RATE,
+            (cpu_events == 0? 0.0:
+                (double)cpu_time[WINDIVERT_CPU_QUEUE] / cpu_events),
+            (cpu_events == 0? 0.0:
+                (double)cpu_time[WINDIVERT_CPU_COPY] / cpu_events));
+    }
+    printf("fast-path %llu (%.1f%%)\n", (unsigned long long)total_in.fast,
+        (total_in.packets == 0? 0.0:
+            100.0 * total_in.fast / total_in.packets));
+    printf("batch     %.2f packets/request\n",
+        (total_out.requests == 0? 0.0:
+            (double)total_out.packets / total_out.requests));
+    if (reads != 0)
+    {
+        printf("pool      %llu completions, %llu starved\n",
+            (unsigned long long)pool_sched.completions,
+            (unsigned long long)pool_sched.starved);
+    }
+    printf("dropped   %llu\n", (unsigned long long)num_dropped);
+    printf("timeouts  %llu\n", (unsigned long long)num_timeout);
+    printf("drops     work-queue=%llu packet-queue=%llu timeout=%llu "
+        "oversize=%llu no-memory=%llu closed=%llu redirect=%llu\n",
+        (unsigned long long)num_drops[WINDIVERT_TRACE_DROP_WORK_QUEUE_FULL],
+        (unsigned long long)num_drops[WINDIVERT_TRACE_DROP_PACKET_QUEUE_FULL],
+        (unsigned long long)num_drops[WINDIVERT_TRACE_DROP_TIMEOUT],
+        (unsigned long long)num_drops[WINDIVERT_TRACE_DROP_OVERSIZE],
+        (unsigned long long)num_drops[WINDIVERT_TRACE_DROP_NO_MEMORY],
+        (unsigned long long)num_drops[WINDIVERT_TRACE_DROP_CLOSED],
+        (unsigned long long)num_drops[WINDIVERT_TRACE_DROP_REDIRECT]);
+    printf("latency   avg=%.1fus p50<=%.1fus p99<=%.1fus max=%.1fus\n",
+        (total_out.packets == 0? 0.0:
+            total_out.latency_sum / 1e3 / total_out.packets),
+        p50 / 1e3, p99 / 1e3, total_out.latency_max / 1e3);
+    printf("trace     last %u events (match=%u fast=%u queue=%u drop=%u "
+        "read=%u)\n", trace_len, trace_types[WINDIVERT_TRACE_MATCH],
+        trace_types[WINDIVERT_TRACE_FAST_PATH],
+        trace_types[WINDIVERT_TRACE_QUEUE], trace_types[WINDIVERT_TRACE_DROP],
+        trace_types[WINDIVERT_TRACE_READ]);
+    if (accounted != total_in.packets)
+    {
+        printf("error: %llu packets unaccounted for\n",
+            (unsigned long long)(total_in.packets - accounted));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
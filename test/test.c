@@ -72,6 +72,21 @@ struct test
  */
 static BOOL run_test(HANDLE inject_handle, const char *filter,
     const char *packet, const size_t packet_len, BOOL match, INT64 *diff);
+static BOOL run_clause_test(BOOL and);
+static BOOL run_clause_max_test(void);
+static BOOL run_encap_test(const struct packet *packet);
+static BOOL run_encap_batch_test(void);
+static BOOL run_optimize_test(const struct test *test);
+static BOOL run_large_filter_test(void);
+static BOOL run_sketch_test(void);
+static BOOL run_merge_test(void);
+static BOOL run_dedup_test(void);
+static BOOL run_compare_filter_test(void);
+static BOOL run_tcp_stats_test(void);
+static BOOL run_xlat_test(void);
+static BOOL run_anon_test(void);
+static BOOL run_process_filter_test(void);
+static BOOL run_recv_pool_test(HANDLE inject_handle);
 static DWORD monitor_worker(LPVOID arg);
 
 /*
@@ -173,6 +188,8 @@ static const struct test tests[] =
     {"outbound and inbound",                   &pkt_echo_request, FALSE},
     {"loopback",                               &pkt_echo_request, FALSE},
     {"impostor",                               &pkt_echo_request, FALSE},
+    {"mark == 0",                              &pkt_echo_request, TRUE},
+    {"mark != 0 or mark > 0x7FFFFFFF",         &pkt_echo_request, FALSE},
     {"icmp",                                   &pkt_echo_request, TRUE},
     {"not icmp",                               &pkt_echo_request, FALSE},
     {"ip or ipv6",                             &pkt_echo_request, TRUE},
@@ -236,8 +253,13 @@ static const struct test tests[] =
      "ipv6.DstAddr or ipv6.FlowLabel or "
      "ipv6.HopLimit or ipv6.Length or "
      "ipv6.NextHdr or ipv6.SrcAddr or "
-     "ipv6.TrafficClass or not outbound or "
-     "subIfIdx == 888 or tcp or tcp.Ack or "
+     "ipv6.TrafficClass or ipv6.HopOpts or "
+     "ipv6.Routing or ipv6.RoutingType == 0 or "
+     "ipv6.FragHdr or ipv6.DstOpts or ipv6.AH or "
+     "ipv6.MH or ipv6.ExtHdrCount or "
+     "ipv6.ExtHdrLength or not outbound or "
+     "subIfIdx == 888 or mark == 777 or "
+     "tcp or tcp.Ack or "
      "tcp.AckNum or tcp.Checksum or "
      "tcp.DstPort or tcp.Fin or "
      "tcp.HdrLength or tcp.PayloadLength or "
@@ -888,6 +910,18 @@ static const struct test tests[] =
                                                &pkt_ipv6_exthdrs_udp, FALSE},
     {"localAddr == ::1 and remoteAddr == 1 and localPort == 4660 and "
      "remotePort == 43690 and protocol == 17", &pkt_ipv6_exthdrs_udp, TRUE},
+    {"ipv6.HopOpts and ipv6.DstOpts and not ipv6.Routing and "
+     "not ipv6.FragHdr and not ipv6.AH and not ipv6.MH",
+                                               &pkt_ipv6_exthdrs_udp, TRUE},
+    {"ipv6.ExtHdrCount == 3 and ipv6.ExtHdrLength == 24",
+                                               &pkt_ipv6_exthdrs_udp, TRUE},
+    {"ipv6.RoutingType == 0 or ipv6.RoutingType != 0",
+                                               &pkt_ipv6_exthdrs_udp, FALSE},
+    {"ipv6 and not ipv6.Routing",              &pkt_ipv6_exthdrs_udp, TRUE},
+    {"ipv6.ExtHdrCount == 0 and not ipv6.HopOpts",
+                                               &pkt_ipv6_tcp_syn, TRUE},
+    {"ipv6.ExtHdrLength > 0 or ipv6.FragHdr",  &pkt_ipv6_tcp_syn, FALSE},
+    {"ipv6.ExtHdrCount == 0",                  &pkt_echo_request, FALSE},
     {"fragment",                               &pkt_ipv4_fragment_0, TRUE},
     {"ip.MF or ip.FragOff != 0",               &pkt_ipv4_fragment_0, TRUE},
     {"icmp",                                   &pkt_ipv4_fragment_0, TRUE},
@@ -922,6 +956,22 @@ static const struct test tests[] =
      "ipv6.Length == 48 and ipv6.NextHdr == 44 and ipv6.HopLimit == 31 and "
      "ipv6.SrcAddr == 0:0:0:0:0:0:0:1 and ipv6.DstAddr == 0:0:0:0:0:0:0:1",
                                                &pkt_ipv6_fragment_1, TRUE},
+    {"ipv6.FragHdr and ipv6.ExtHdrCount == 1 and ipv6.ExtHdrLength == 8",
+                                               &pkt_ipv6_fragment_1, TRUE},
+    {"ipv6.FragHdr and not ipv6.HopOpts",      &pkt_ipv6_fragment_0, TRUE},
+};
+
+/*
+ * Clause filter test data.
+ */
+static const char *clauses[] =
+{
+    "tcp.DstPort == 80",
+    "udp and udp.DstPort == 53",
+    "(icmp? icmp.Type == 8: outbound)",
+    "ip.TTL < 5 or ipv6",
+    "tcp.Syn and not tcp.Ack",
+    "localPort == 8 or remoteAddr == 8.8.8.8",
 };
 
 /*
@@ -979,6 +1029,90 @@ int main(int argc, char **argv)
     console = GetStdHandle(STD_OUTPUT_HANDLE);
     QueryPerformanceFrequency(&freq);
 
+    // Verify incremental filter compilation:
+    if (!run_clause_test(FALSE) || !run_clause_test(TRUE) ||
+        !run_clause_max_test())
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    // Verify tunnel encapsulation/decapsulation:
+    if (!run_encap_test(&pkt_dns_request) ||
+        !run_encap_test(&pkt_ipv6_tcp_syn) ||
+        !run_encap_batch_test())
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    // Verify streaming sketches:
+    if (!run_sketch_test())
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    // Verify timestamp-ordered merging:
+    if (!run_merge_test())
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    // Verify duplicate suppression:
+    if (!run_dedup_test())
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    // Verify filter comparison:
+    if (!run_compare_filter_test())
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    // Verify passive TCP statistics:
+    if (!run_tcp_stats_test())
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    // Verify stateless IPv4/IPv6 translation:
+    if (!run_xlat_test())
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    // Verify prefix-preserving anonymization:
+    if (!run_anon_test())
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    // Verify profile-guided filter optimization:
+    for (i = lo; i < hi; i++)
+    {
+        if (!run_optimize_test(tests + i))
+        {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Verify filters longer than 256 instructions:
+    if (!run_large_filter_test())
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    // Verify the processName/processPath fields:
+    if (!run_process_filter_test())
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    // Verify completion-callback receive:
+    if (!run_recv_pool_test(upper_handle))
+    {
+        exit(EXIT_FAILURE);
+    }
+
     // Spawn monitor thread:
     monitor = CreateThread(NULL, 1, (LPTHREAD_START_ROUTINE)monitor_worker,
         NULL, 0, NULL);
@@ -1114,6 +1248,9 @@ static BOOL run_test(HANDLE inject_handle, const char *filter,
     BOOL random, result, ipv4;
     LARGE_INTEGER end;
     UINT64 val;
+    static WINDIVERT_TRACE_EVENT trace[1024];
+    UINT trace_len;
+    WINDIVERT_API_STATS stats;
 
     *diff = 0;
 
@@ -1141,6 +1278,12 @@ static BOOL run_test(HANDLE inject_handle, const char *filter,
             "(err = %d)\n", GetLastError());
         goto failed;
     }
+    if (!WinDivertHelperApiStatsEnable(handle[0], TRUE))
+    {
+        fprintf(stderr, "error: failed to enable API statistics (err = %d)\n",
+            GetLastError());
+        goto failed;
+    }
     if (!WinDivertSetParam(handle[0], WINDIVERT_PARAM_QUEUE_LENGTH,
             WINDIVERT_PARAM_QUEUE_LENGTH_MAX) ||
         !WinDivertGetParam(handle[0], WINDIVERT_PARAM_QUEUE_LENGTH, &val) ||
@@ -1292,7 +1435,25 @@ static BOOL run_test(HANDLE inject_handle, const char *filter,
         goto failed;
     }
 
-    // (5) Clean-up:
+    // (5) Verify that the pended recv was traced:
+    if (!WinDivertTraceQuery(handle[idx], 0, 0, trace, sizeof(trace),
+            &trace_len))
+    {
+        fprintf(stderr, "error: failed to query WinDivert trace (err = %d)\n",
+            GetLastError());
+        goto failed;
+    }
+    for (i = 0; i < trace_len / sizeof(WINDIVERT_TRACE_EVENT) &&
+            (trace[i].Type != WINDIVERT_TRACE_FAST_PATH ||
+             trace[i].Value != packet_len); i++)
+        ;
+    if (i >= trace_len / sizeof(WINDIVERT_TRACE_EVENT))
+    {
+        fprintf(stderr, "error: failed to find fast-path trace event\n");
+        goto failed;
+    }
+
+    // (6) Clean-up:
     if (!WinDivertShutdown(handle[0], WINDIVERT_SHUTDOWN_BOTH) ||
         !WinDivertShutdown(handle[1], WINDIVERT_SHUTDOWN_BOTH))
     {
@@ -1316,6 +1477,14 @@ static BOOL run_test(HANDLE inject_handle, const char *filter,
             "WinDivert handle (err = %d)\n", GetLastError());
         goto failed;
     }
+    if (!WinDivertHelperApiStatsQuery(handle[0], WINDIVERT_API_RECV,
+            &stats) || stats.Pending == 0 || stats.Errors == 0 ||
+        stats.ErrorCode[0] != ERROR_NO_DATA)
+    {
+        fprintf(stderr, "error: failed to verify API statistics (err = %d)\n",
+            GetLastError());
+        goto failed;
+    }
     if (!WinDivertClose(handle[0]) || !WinDivertClose(handle[1]))
     {
         fprintf(stderr, "error: failed to close WinDivert handle (err = %d)\n",
@@ -1342,6 +1511,1293 @@ failed:
     return FALSE;
 }
 
+/*
+ * Run the clause filter test.  Each incremental update must produce the same
+ * object as compiling the equivalent filter string from scratch.
+ */
+static BOOL run_clause_test(BOOL and)
+{
+    static char object_1[8192], object_2[8192], filter[1024];
+    const size_t num_clauses = sizeof(clauses) / sizeof(clauses[0]);
+    PWINDIVERT_CLAUSE_FILTER clause_filter;
+    UINT ids[sizeof(clauses) / sizeof(clauses[0])];
+    const char *err_str;
+    UINT err_pos;
+    size_t i, j;
+    BOOL result = FALSE;
+
+    clause_filter = WinDivertHelperClauseFilterCreate(WINDIVERT_LAYER_NETWORK,
+        (and? WINDIVERT_CLAUSE_FLAG_AND: 0));
+    if (clause_filter == NULL)
+    {
+        fprintf(stderr, "error: failed to create clause filter (err = %d)\n",
+            GetLastError());
+        return FALSE;
+    }
+
+    // (1) Add clauses one at a time:
+    for (i = 0; i < num_clauses; i++)
+    {
+        if (!WinDivertHelperClauseFilterAdd(clause_filter, clauses[i],
+                &ids[i], &err_str, &err_pos))
+        {
+            fprintf(stderr, "error: failed to add clause \"%s\" with error "
+                "\"%s\" (position=%u)\n", clauses[i], err_str, err_pos);
+            goto failed;
+        }
+        filter[0] = '\0';
+        for (j = 0; j <= i; j++)
+        {
+            snprintf(filter + strlen(filter), sizeof(filter) - strlen(filter),
+                "%s(%s)", (j == 0? "": (and? " and ": " or ")), clauses[j]);
+        }
+        if (!WinDivertHelperClauseFilterGetObject(clause_filter, object_1,
+                sizeof(object_1)) ||
+            !WinDivertHelperCompileFilter(filter, WINDIVERT_LAYER_NETWORK,
+                object_2, sizeof(object_2), NULL, NULL) ||
+            strcmp(object_1, object_2) != 0)
+        {
+            fprintf(stderr, "error: clause filter mismatch for \"%s\" "
+                "(%s vs %s)\n", filter, object_1, object_2);
+            goto failed;
+        }
+    }
+
+    // (2) Remove the first, middle and last clauses:
+    if (!WinDivertHelperClauseFilterRemove(clause_filter, ids[0]) ||
+        !WinDivertHelperClauseFilterRemove(clause_filter, ids[2]) ||
+        !WinDivertHelperClauseFilterRemove(clause_filter,
+            ids[num_clauses-1]))
+    {
+        fprintf(stderr, "error: failed to remove clause (err = %d)\n",
+            GetLastError());
+        goto failed;
+    }
+    snprintf(filter, sizeof(filter), "(%s)%s(%s)%s(%s)", clauses[1],
+        (and? " and ": " or "), clauses[3], (and? " and ": " or "),
+        clauses[4]);
+    if (!WinDivertHelperClauseFilterGetObject(clause_filter, object_1,
+            sizeof(object_1)) ||
+        !WinDivertHelperCompileFilter(filter, WINDIVERT_LAYER_NETWORK,
+            object_2, sizeof(object_2), NULL, NULL) ||
+        strcmp(object_1, object_2) != 0)
+    {
+        fprintf(stderr, "error: clause filter mismatch for \"%s\" "
+            "(%s vs %s)\n", filter, object_1, object_2);
+        goto failed;
+    }
+    result = TRUE;
+
+failed:
+    WinDivertHelperClauseFilterFree(clause_filter);
+    return result;
+}
+
+/*
+ * Run the clause filter test with a 256 instruction filter, whose length
+ * does not fit in 8 bits.  The last clause must still be part of the
+ * object.
+ */
+static BOOL run_clause_max_test(void)
+{
+    static char object[16384];
+    PWINDIVERT_CLAUSE_FILTER clause_filter;
+    WINDIVERT_ADDRESS addr;
+    char clause[64];
+    UINT i;
+    BOOL result = FALSE;
+
+    clause_filter = WinDivertHelperClauseFilterCreate(WINDIVERT_LAYER_NETWORK,
+        0);
+    if (clause_filter == NULL)
+    {
+        fprintf(stderr, "error: failed to create clause filter (err = %d)\n",
+            GetLastError());
+        return FALSE;
+    }
+
+    // One instruction per clause; only the last clause matches the HTTP
+    // request:
+    for (i = 0; i < 256; i++)
+    {
+        snprintf(clause, sizeof(clause), "tcp.DstPort == %u",
+            (i == 255? 80: 1000 + i));
+        if (!WinDivertHelperClauseFilterAdd(clause_filter, clause, NULL,
+                NULL, NULL))
+        {
+            fprintf(stderr, "error: failed to add clause %u (err = %d)\n",
+                i, GetLastError());
+            goto failed;
+        }
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.Outbound = 1;
+    if (!WinDivertHelperClauseFilterGetObject(clause_filter, object,
+            sizeof(object)) ||
+        !WinDivertHelperEvalFilter(object, pkt_http_request.packet,
+            (UINT)pkt_http_request.packet_len, &addr) ||
+        WinDivertHelperEvalFilter(object, pkt_dns_request.packet,
+            (UINT)pkt_dns_request.packet_len, &addr))
+    {
+        fprintf(stderr, "error: clause filter of 256 instructions does not "
+            "match (err = %d)\n", GetLastError());
+        goto failed;
+    }
+    result = TRUE;
+
+failed:
+    WinDivertHelperClauseFilterFree(clause_filter);
+    return result;
+}
+
+/*
+ * Run the encapsulation test.  Each encapsulated packet must have valid
+ * checksums, and decapsulation must recover the original packet.
+ */
+static BOOL run_encap_test(const struct packet *packet)
+{
+    static const UINT32 src_addr[4] = {0x20010DB8, 0, 0, 1};
+    static const UINT32 dst_addr[4] = {0x20010DB8, 0, 0, 2};
+    char buf[MAX_PACKET], check[MAX_PACKET];
+    WINDIVERT_ENCAP encap;
+    WINDIVERT_ADDRESS addr;
+    PVOID outer, inner;
+    UINT outer_len, inner_len, headroom = WINDIVERT_ENCAP_HDR_MAXLEN;
+    int type, ipv6;
+
+    for (type = WINDIVERT_ENCAP_IPIP; type <= WINDIVERT_ENCAP_VXLAN; type++)
+    {
+        for (ipv6 = 0; ipv6 <= 1; ipv6++)
+        {
+            if (!WinDivertHelperEncapInit(&encap, (WINDIVERT_ENCAP_TYPE)type,
+                    ipv6, (ipv6? src_addr: src_addr + 3),
+                    (ipv6? dst_addr: dst_addr + 3), 1234, 5678, 42))
+            {
+                fprintf(stderr, "error: failed to initialize encapsulation "
+                    "(err = %d)\n", GetLastError());
+                return FALSE;
+            }
+            memcpy(buf + headroom, packet->packet, packet->packet_len);
+            memset(&addr, 0, sizeof(addr));
+            if (!WinDivertHelperEncap(&encap, buf + headroom,
+                    (UINT)packet->packet_len, headroom, sizeof(buf) - headroom,
+                    &outer, &outer_len, &addr))
+            {
+                fprintf(stderr, "error: failed to encapsulate packet %s "
+                    "(err = %d)\n", packet->name, GetLastError());
+                return FALSE;
+            }
+
+            // IPv4 UDP tunnels use a zero UDP checksum:
+            memcpy(check, outer, outer_len);
+            WinDivertHelperCalcChecksums(check, outer_len, NULL,
+                (ipv6? 0: WINDIVERT_HELPER_NO_UDP_CHECKSUM));
+            if (memcmp(check, outer, outer_len) != 0)
+            {
+                fprintf(stderr, "error: encapsulation checksum mismatch for "
+                    "packet %s (type=%d, ipv6=%d)\n", packet->name, type,
+                    ipv6);
+                return FALSE;
+            }
+
+            if (!WinDivertHelperDecap(&encap, outer, outer_len, &inner,
+                    &inner_len, &addr) ||
+                inner_len != packet->packet_len ||
+                memcmp(inner, packet->packet, inner_len) != 0)
+            {
+                fprintf(stderr, "error: decapsulation mismatch for packet %s "
+                    "(type=%d, ipv6=%d)\n", packet->name, type, ipv6);
+                return FALSE;
+            }
+        }
+    }
+    return TRUE;
+}
+
+/*
+ * Run the batch encapsulation test.  A mixed IPv4/IPv6 batch must round-trip
+ * through WinDivertHelperEncapBatch() and WinDivertHelperDecapBatch(), with
+ * a trailing unencapsulated packet passed through unchanged.  VXLAN packets
+ * must carry a valid inner Ethernet header, and must not decapsulate with a
+ * different VNI.
+ */
+static BOOL run_encap_batch_test(void)
+{
+    static const struct packet *packets[] =
+    {
+        &pkt_echo_request,
+        &pkt_dns_request,
+        &pkt_ipv6_tcp_syn,
+        &pkt_ipv6_echo_reply,
+    };
+    const UINT num_packets = sizeof(packets) / sizeof(packets[0]);
+    static const UINT32 src_addr[4] = {0x0A000001, 0, 0, 0x20010DB8};
+    static const UINT32 dst_addr[4] = {0x0A000002, 0, 0, 0x20010DB8};
+    static char batch[4 * MAX_PACKET], output[5 * MAX_PACKET],
+        check[MAX_PACKET];
+    WINDIVERT_ENCAP encap, other;
+    WINDIVERT_ADDRESS addr[5];
+    const UINT8 *eth;
+    UINT batch_len = 0, output_len, len, pos, i;
+    UINT16 ethertype;
+    int type, ipv6;
+
+    for (i = 0; i < num_packets; i++)
+    {
+        memcpy(batch + batch_len, packets[i]->packet,
+            packets[i]->packet_len);
+        batch_len += (UINT)packets[i]->packet_len;
+    }
+
+    for (type = WINDIVERT_ENCAP_IPIP; type <= WINDIVERT_ENCAP_VXLAN; type++)
+    {
+        for (ipv6 = 0; ipv6 <= 1; ipv6++)
+        {
+            if (!WinDivertHelperEncapInit(&encap, (WINDIVERT_ENCAP_TYPE)type,
+                    ipv6, src_addr, dst_addr, 1234, 5678, 42) ||
+                !WinDivertHelperEncapInit(&other, (WINDIVERT_ENCAP_TYPE)type,
+                    ipv6, src_addr, dst_addr, 1234, 5678, 43))
+            {
+                fprintf(stderr, "error: failed to initialize encapsulation "
+                    "(err = %d)\n", GetLastError());
+                return FALSE;
+            }
+            memset(addr, 0, sizeof(addr));
+            if (!WinDivertHelperEncapBatch(&encap, batch, batch_len, output,
+                    sizeof(output), &output_len, addr, sizeof(addr)) ||
+                output_len != batch_len + num_packets * encap.Length)
+            {
+                fprintf(stderr, "error: failed to encapsulate batch "
+                    "(type=%d, ipv6=%d, err = %d)\n", type, ipv6,
+                    GetLastError());
+                return FALSE;
+            }
+
+            for (i = 0, pos = 0; i < num_packets; i++)
+            {
+                len = encap.Length + (UINT)packets[i]->packet_len;
+                memcpy(check, output + pos, len);
+                WinDivertHelperCalcChecksums(check, len, NULL,
+                    (ipv6? 0: WINDIVERT_HELPER_NO_UDP_CHECKSUM));
+                if (memcmp(check, output + pos, len) != 0 ||
+                    addr[i].IPv6 != (UINT32)ipv6)
+                {
+                    fprintf(stderr, "error: batch encapsulation mismatch "
+                        "for packet %s (type=%d, ipv6=%d)\n",
+                        packets[i]->name, type, ipv6);
+                    return FALSE;
+                }
+                if (type == WINDIVERT_ENCAP_VXLAN)
+                {
+                    eth = (const UINT8 *)output + pos + encap.Length - 14;
+                    ethertype = (UINT16)((eth[12] << 8) | eth[13]);
+                    if (eth[0] != 0x02 || eth[2] != 0x0A || eth[5] != 0x02 ||
+                        eth[6] != 0x02 || eth[8] != 0x0A || eth[11] != 0x01 ||
+                        ethertype != ((packets[i]->packet[0] & 0xF0) == 0x60?
+                            0x86DD: 0x0800))
+                    {
+                        fprintf(stderr, "error: invalid VXLAN Ethernet "
+                            "header for packet %s (ipv6=%d)\n",
+                            packets[i]->name, ipv6);
+                        return FALSE;
+                    }
+                    if (WinDivertHelperDecap(&other, output + pos, len, NULL,
+                            NULL, NULL) ||
+                        GetLastError() != ERROR_INVALID_DATA)
+                    {
+                        fprintf(stderr, "error: VXLAN packet %s "
+                            "decapsulated with the wrong VNI (ipv6=%d)\n",
+                            packets[i]->name, ipv6);
+                        return FALSE;
+                    }
+                }
+                pos += len;
+            }
+
+            // Unencapsulated packets pass through:
+            memcpy(output + output_len, pkt_http_request.packet,
+                pkt_http_request.packet_len);
+            output_len += (UINT)pkt_http_request.packet_len;
+            memset(addr, 0, sizeof(addr));
+            if (!WinDivertHelperDecapBatch(&encap, output, output_len,
+                    &output_len, addr, sizeof(addr)) ||
+                output_len != batch_len + pkt_http_request.packet_len ||
+                memcmp(output, batch, batch_len) != 0 ||
+                memcmp(output + batch_len, pkt_http_request.packet,
+                    pkt_http_request.packet_len) != 0)
+            {
+                fprintf(stderr, "error: batch decapsulation mismatch "
+                    "(type=%d, ipv6=%d)\n", type, ipv6);
+                return FALSE;
+            }
+            for (i = 0; i < num_packets; i++)
+            {
+                if (addr[i].IPv6 !=
+                        (UINT32)((packets[i]->packet[0] & 0xF0) == 0x60))
+                {
+                    fprintf(stderr, "error: batch decapsulation address "
+                        "mismatch for packet %s (type=%d, ipv6=%d)\n",
+                        packets[i]->name, type, ipv6);
+                    return FALSE;
+                }
+            }
+        }
+    }
+    return TRUE;
+}
+
+/*
+ * Run the filter optimization test.  The filter is profiled on all test
+ * packets, and the optimized filter must give the same result as the
+ * original filter for each of them.
+ */
+static BOOL run_optimize_test(const struct test *test)
+{
+    static const struct packet *packets[] =
+    {
+        &pkt_echo_request,
+        &pkt_http_request,
+        &pkt_dns_request,
+        &pkt_ipv6_tcp_syn,
+        &pkt_ipv6_echo_reply,
+        &pkt_ipv6_exthdrs_udp,
+        &pkt_ipv4_fragment_0,
+        &pkt_ipv4_fragment_1,
+        &pkt_ipv6_fragment_0,
+        &pkt_ipv6_fragment_1,
+    };
+    const UINT num_packets = sizeof(packets) / sizeof(packets[0]);
+    static WINDIVERT_FILTER_STATS stats[4096];
+    static char object[8192], batch[10 * MAX_PACKET];
+    WINDIVERT_ADDRESS addr[10];
+    const char *err_str;
+    UINT err_pos, batch_len = 0, i;
+    BOOL result;
+
+    memset(addr, 0, sizeof(addr));
+    for (i = 0; i < num_packets; i++)
+    {
+        memcpy(batch + batch_len, packets[i]->packet,
+            packets[i]->packet_len);
+        batch_len += (UINT)packets[i]->packet_len;
+        addr[i].Layer    = WINDIVERT_LAYER_NETWORK;
+        addr[i].Outbound = 1;
+        addr[i].IPv6     = ((packets[i]->packet[0] & 0xF0) == 0x60);
+    }
+    memset(stats, 0, sizeof(stats));
+    if (!WinDivertHelperProfileFilter(test->filter, WINDIVERT_LAYER_NETWORK,
+            batch, batch_len, addr, sizeof(addr), stats, sizeof(stats)))
+    {
+        fprintf(stderr, "error: failed to profile filter \"%s\" (err = %d)\n",
+            test->filter, GetLastError());
+        return FALSE;
+    }
+    if (!WinDivertHelperOptimizeFilter(test->filter, WINDIVERT_LAYER_NETWORK,
+            stats, sizeof(stats), object, sizeof(object), &err_str, &err_pos))
+    {
+        fprintf(stderr, "error: failed to optimize filter \"%s\" with error "
+            "\"%s\" (position=%u)\n", test->filter, err_str, err_pos);
+        return FALSE;
+    }
+    for (i = 0; i < num_packets; i++)
+    {
+        result = WinDivertHelperEvalFilter(test->filter, packets[i]->packet,
+            (UINT)packets[i]->packet_len, &addr[i]);
+        if (WinDivertHelperEvalFilter(object, packets[i]->packet,
+                (UINT)packets[i]->packet_len, &addr[i]) != result)
+        {
+            fprintf(stderr, "error: optimized filter \"%s\" does not match "
+                "the original filter for packet %s\n", test->filter,
+                packets[i]->name);
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/*
+ * Run the large filter test.  A filter of 3000 instructions must compile,
+ * round-trip through WinDivertHelperFormatFilter(), evaluate correctly, and
+ * be accepted by the driver.
+ */
+static BOOL run_large_filter_test(void)
+{
+    static char filter[131072], object_1[131072], object_2[131072];
+    static char format[131072];
+    const UINT num_clauses = 1500;
+    WINDIVERT_ADDRESS addr;
+    const char *err_str;
+    UINT err_pos, i;
+    size_t len = 0;
+    HANDLE handle;
+
+    // The last clause matches pkt_http_request:
+    for (i = 0; i < num_clauses; i++)
+    {
+        len += snprintf(filter + len, sizeof(filter) - len,
+            "%s(ip.DstAddr == %u.%u.%u.%u and tcp.DstPort == %u)",
+            (i == 0? "": " or "),
+            (i+1 == num_clauses? 93: 10), (i+1 == num_clauses? 184: 0),
+            (i+1 == num_clauses? 216: i >> 8),
+            (i+1 == num_clauses? 119: i & 0xFF),
+            (i+1 == num_clauses? 80: 1000 + i));
+    }
+    if (!WinDivertHelperCompileFilter(filter, WINDIVERT_LAYER_NETWORK,
+            object_1, sizeof(object_1), &err_str, &err_pos))
+    {
+        fprintf(stderr, "error: failed to compile large filter with error "
+            "\"%s\" (position=%u)\n", err_str, err_pos);
+        return FALSE;
+    }
+    if (!WinDivertHelperFormatFilter(object_1, WINDIVERT_LAYER_NETWORK,
+            format, sizeof(format)) ||
+        !WinDivertHelperCompileFilter(format, WINDIVERT_LAYER_NETWORK,
+            object_2, sizeof(object_2), NULL, NULL) ||
+        strcmp(object_1, object_2) != 0)
+    {
+        fprintf(stderr, "error: large filter does not round-trip\n");
+        return FALSE;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.Layer    = WINDIVERT_LAYER_NETWORK;
+    addr.Outbound = 1;
+    if (!WinDivertHelperEvalFilter(object_1, pkt_http_request.packet,
+            (UINT)pkt_http_request.packet_len, &addr) ||
+        WinDivertHelperEvalFilter(object_1, pkt_dns_request.packet,
+            (UINT)pkt_dns_request.packet_len, &addr))
+    {
+        fprintf(stderr, "error: large filter does not match the expected "
+            "result\n");
+        return FALSE;
+    }
+
+    handle = WinDivertOpen(object_1, WINDIVERT_LAYER_NETWORK, 0,
+        WINDIVERT_FLAG_SNIFF | WINDIVERT_FLAG_RECV_ONLY);
+    if (handle == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "error: failed to open WinDivert handle for large "
+            "filter (err = %d)\n", GetLastError());
+        return FALSE;
+    }
+    WinDivertClose(handle);
+    return TRUE;
+}
+
+/*
+ * Run the streaming sketch test.
+ */
+static BOOL run_sketch_test(void)
+{
+    static const struct packet *packets[] =
+    {
+        &pkt_dns_request, &pkt_echo_request, &pkt_dns_request,
+        &pkt_http_request, &pkt_dns_request, &pkt_ipv6_tcp_syn,
+        &pkt_echo_request
+    };
+    static const UINT32 fields =
+        WINDIVERT_SKETCH_KEY_SRCADDR | WINDIVERT_SKETCH_KEY_DSTADDR |
+        WINDIVERT_SKETCH_KEY_SRCPORT | WINDIVERT_SKETCH_KEY_DSTPORT |
+        WINDIVERT_SKETCH_KEY_PROTOCOL;
+    char buf[8 * MAX_PACKET];
+    PWINDIVERT_SKETCH top_k = NULL, count_min = NULL, distinct = NULL;
+    WINDIVERT_SKETCH_ENTRY entries[2];
+    UINT buf_len = 0, count, i;
+    UINT64 estimate;
+    BOOL result = FALSE;
+
+    for (i = 0; i < sizeof(packets) / sizeof(packets[0]); i++)
+    {
+        memcpy(buf + buf_len, packets[i]->packet, packets[i]->packet_len);
+        buf_len += (UINT)packets[i]->packet_len;
+    }
+    top_k = WinDivertHelperSketchCreate(WINDIVERT_SKETCH_TOP_K, fields, 0,
+        4, 0, 0);
+    count_min = WinDivertHelperSketchCreate(WINDIVERT_SKETCH_COUNT_MIN,
+        fields, 0, 64, 4, 0);
+    distinct = WinDivertHelperSketchCreate(WINDIVERT_SKETCH_DISTINCT, 0,
+        fields, 1, 8, 0);
+    if (top_k == NULL || count_min == NULL || distinct == NULL ||
+        !WinDivertHelperSketchUpdate(top_k, buf, buf_len) ||
+        !WinDivertHelperSketchUpdate(count_min, buf, buf_len) ||
+        !WinDivertHelperSketchUpdate(distinct, buf, buf_len))
+    {
+        fprintf(stderr, "error: failed to update sketch (err = %d)\n",
+            GetLastError());
+        goto failed;
+    }
+
+    // The DNS request is the heaviest flow, followed by the echo request:
+    if (!WinDivertHelperSketchTopK(top_k, entries, 2, &count) ||
+        count != 2 || entries[0].Count != 3 || entries[0].Error != 0 ||
+        entries[0].Key.Protocol != IPPROTO_UDP || entries[1].Count != 2 ||
+        entries[1].Key.Protocol != IPPROTO_ICMP)
+    {
+        fprintf(stderr, "error: top-K sketch mismatch\n");
+        goto failed;
+    }
+    if (!WinDivertHelperSketchQuery(count_min, &entries[0].Key, &estimate) ||
+        estimate != 3)
+    {
+        fprintf(stderr, "error: count-min sketch mismatch\n");
+        goto failed;
+    }
+    if (!WinDivertHelperSketchQuery(distinct, &entries[0].Key, &estimate) ||
+        estimate != 4)
+    {
+        fprintf(stderr, "error: distinct sketch mismatch\n");
+        goto failed;
+    }
+    result = TRUE;
+
+failed:
+    WinDivertHelperSketchFree(top_k);
+    WinDivertHelperSketchFree(count_min);
+    WinDivertHelperSketchFree(distinct);
+    return result;
+}
+
+/*
+ * Run the timestamp merge test.
+ */
+static BOOL run_merge_test(void)
+{
+    static const struct packet *packets[] =
+    {
+        &pkt_dns_request, &pkt_echo_request, &pkt_http_request
+    };
+    static const UINT streams[] = {0, 1, 0};
+    static const INT64 timestamps[] = {10, 20, 30};
+    char buf[4 * MAX_PACKET];
+    PWINDIVERT_MERGE merge;
+    WINDIVERT_ADDRESS addr[4];
+    UINT8 stream[4];
+    UINT addr_len, pop_len, i;
+    BOOL result = FALSE;
+
+    merge = WinDivertHelperMergeCreate(2, 65536, 1000, 0);
+    if (merge == NULL)
+    {
+        fprintf(stderr, "error: failed to create merge (err = %d)\n",
+            GetLastError());
+        return FALSE;
+    }
+    for (i = 0; i < sizeof(packets) / sizeof(packets[0]); i++)
+    {
+        memset(&addr[0], 0, sizeof(addr[0]));
+        addr[0].Layer = WINDIVERT_LAYER_NETWORK;
+        addr[0].Timestamp = timestamps[i];
+        if (!WinDivertHelperMergePush(merge, streams[i], packets[i]->packet,
+                (UINT)packets[i]->packet_len, &addr[0], sizeof(addr[0])))
+        {
+            fprintf(stderr, "error: failed to push packet (err = %d)\n",
+                GetLastError());
+            goto failed;
+        }
+    }
+
+    // Stream 1 may still deliver a packet before the HTTP request:
+    addr_len = sizeof(addr);
+    if (!WinDivertHelperMergePop(merge, buf, sizeof(buf), &pop_len, addr,
+            &addr_len, stream, FALSE) ||
+        addr_len != 2 * sizeof(WINDIVERT_ADDRESS) ||
+        addr[0].Timestamp != 10 || stream[0] != 0 ||
+        addr[1].Timestamp != 20 || stream[1] != 1 ||
+        pop_len != pkt_dns_request.packet_len + pkt_echo_request.packet_len ||
+        memcmp(buf, pkt_dns_request.packet, pkt_dns_request.packet_len) != 0)
+    {
+        fprintf(stderr, "error: merge pop mismatch\n");
+        goto failed;
+    }
+
+    // Flushing ignores the other streams:
+    addr_len = sizeof(addr);
+    if (!WinDivertHelperMergePop(merge, buf, sizeof(buf), &pop_len, addr,
+            &addr_len, stream, TRUE) ||
+        addr_len != sizeof(WINDIVERT_ADDRESS) || addr[0].Timestamp != 30 ||
+        pop_len != pkt_http_request.packet_len)
+    {
+        fprintf(stderr, "error: merge flush mismatch\n");
+        goto failed;
+    }
+    result = TRUE;
+
+failed:
+    WinDivertHelperMergeFree(merge);
+    return result;
+}
+
+/*
+ * Run the duplicate suppression test.
+ */
+static BOOL run_dedup_test(void)
+{
+    char buf[3 * MAX_PACKET];
+    PWINDIVERT_DEDUP dedup;
+    PWINDIVERT_IPHDR ip_header;
+    WINDIVERT_ADDRESS addr[3];
+    UINT8 duplicate[3];
+    UINT dns_len = (UINT)pkt_dns_request.packet_len;
+    UINT buf_len, addr_len, count, i;
+    BOOL result = FALSE;
+
+    dedup = WinDivertHelperDedupCreate(1024, 1000, 0);
+    if (dedup == NULL)
+    {
+        fprintf(stderr, "error: failed to create dedup (err = %d)\n",
+            GetLastError());
+        return FALSE;
+    }
+
+    // DNS request, the same request after forwarding, and an echo request:
+    memcpy(buf, pkt_dns_request.packet, dns_len);
+    memcpy(buf + dns_len, pkt_dns_request.packet, dns_len);
+    ip_header = (PWINDIVERT_IPHDR)(buf + dns_len);
+    ip_header->TTL--;
+    WinDivertHelperCalcChecksums(ip_header, dns_len, NULL, 0);
+    memcpy(buf + 2 * dns_len, pkt_echo_request.packet,
+        pkt_echo_request.packet_len);
+    buf_len = 2 * dns_len + (UINT)pkt_echo_request.packet_len;
+    memset(addr, 0, sizeof(addr));
+    for (i = 0; i < 3; i++)
+    {
+        addr[i].Layer = WINDIVERT_LAYER_NETWORK;
+        addr[i].Timestamp = 100 + i;
+    }
+    if (!WinDivertHelperDedupCheck(dedup, buf, buf_len, addr, sizeof(addr),
+            duplicate, &count) ||
+        count != 1 || duplicate[0] || !duplicate[1] || duplicate[2])
+    {
+        fprintf(stderr, "error: dedup check mismatch\n");
+        goto failed;
+    }
+
+    // After the window, only the forwarded copy is removed:
+    addr_len = sizeof(addr);
+    for (i = 0; i < 3; i++)
+    {
+        addr[i].Timestamp = 2000 + i;
+    }
+    if (!WinDivertHelperDedupFilter(dedup, buf, &buf_len, addr, &addr_len) ||
+        addr_len != 2 * sizeof(WINDIVERT_ADDRESS) ||
+        buf_len != dns_len + pkt_echo_request.packet_len ||
+        memcmp(buf + dns_len, pkt_echo_request.packet,
+            pkt_echo_request.packet_len) != 0 ||
+        addr[1].Timestamp != 2002)
+    {
+        fprintf(stderr, "error: dedup filter mismatch\n");
+        goto failed;
+    }
+    result = TRUE;
+
+failed:
+    WinDivertHelperDedupFree(dedup);
+    return result;
+}
+
+/*
+ * Run the filter comparison test.
+ */
+static BOOL run_compare_filter_test(void)
+{
+    static const struct
+    {
+        const char *filter1;
+        const char *filter2;
+        WINDIVERT_LAYER layer;
+        UINT32 relation;
+    } tests[] =
+    {
+        {"tcp and udp", "true", WINDIVERT_LAYER_NETWORK,
+            WINDIVERT_FILTER_RELATION_EMPTY1 |
+            WINDIVERT_FILTER_RELATION_DISJOINT |
+            WINDIVERT_FILTER_RELATION_SUBSET},
+        {"tcp.DstPort == 80", "tcp", WINDIVERT_LAYER_NETWORK,
+            WINDIVERT_FILTER_RELATION_SUBSET},
+        {"tcp.DstPort < 80", "tcp.DstPort >= 80", WINDIVERT_LAYER_NETWORK,
+            WINDIVERT_FILTER_RELATION_DISJOINT},
+        {"inbound", "not outbound", WINDIVERT_LAYER_NETWORK,
+            WINDIVERT_FILTER_RELATION_SUBSET |
+            WINDIVERT_FILTER_RELATION_SUPERSET},
+        {"outbound and tcp", "tcp.DstPort == 80", WINDIVERT_LAYER_NETWORK,
+            0},
+        {"protocol == 17", "udp", WINDIVERT_LAYER_FLOW,
+            WINDIVERT_FILTER_RELATION_SUBSET |
+            WINDIVERT_FILTER_RELATION_SUPERSET},
+        {"event == BIND", "event == CLOSE", WINDIVERT_LAYER_SOCKET,
+            WINDIVERT_FILTER_RELATION_DISJOINT},
+    };
+    UINT32 relation;
+    UINT i;
+
+    for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+    {
+        if (!WinDivertHelperCompareFilter(tests[i].filter1, tests[i].filter2,
+                tests[i].layer, &relation))
+        {
+            fprintf(stderr, "error: failed to compare filters \"%s\" and "
+                "\"%s\" (err = %d)\n", tests[i].filter1, tests[i].filter2,
+                GetLastError());
+            return FALSE;
+        }
+        if (relation != tests[i].relation)
+        {
+            fprintf(stderr, "error: filter relation mismatch for \"%s\" and "
+                "\"%s\" (expected 0x%x, got 0x%x)\n", tests[i].filter1,
+                tests[i].filter2, tests[i].relation, relation);
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/*
+ * Run the passive TCP statistics test.
+ */
+static BOOL run_tcp_stats_test(void)
+{
+    static const struct
+    {
+        BOOL server;                    // Sent by the server?
+        BOOL syn;
+        BOOL rst;
+        UINT16 window;
+        INT64 timestamp;
+    } segs[] =
+    {
+        {FALSE, TRUE,  FALSE, 1024, 0},     // SYN
+        {TRUE,  TRUE,  FALSE, 1024, 100},   // SYN/ACK
+        {FALSE, FALSE, FALSE, 0,    150},   // ACK (zero window)
+        {FALSE, FALSE, FALSE, 1024, 250},   // Window update
+        {TRUE,  FALSE, TRUE,  0,    300},   // RST
+    };
+    char buf[5 * MAX_PACKET];
+    UINT syn_len = (UINT)pkt_ipv6_tcp_syn.packet_len;
+    PWINDIVERT_TCPSTATS stats;
+    PWINDIVERT_IPV6HDR ipv6_header;
+    PWINDIVERT_TCPHDR tcp_header;
+    WINDIVERT_ADDRESS addr[5];
+    WINDIVERT_TCPSTATS_FLOW flow;
+    UINT32 addr_tmp[4], seq[2];
+    UINT16 port_tmp;
+    UINT64 active;
+    UINT count, i;
+    BOOL result = FALSE;
+
+    stats = WinDivertHelperTcpStatsCreate(1024, 0);
+    if (stats == NULL)
+    {
+        fprintf(stderr, "error: failed to create TCP stats (err = %d)\n",
+            GetLastError());
+        return FALSE;
+    }
+
+    memset(addr, 0, sizeof(addr));
+    for (i = 0; i < 5; i++)
+    {
+        memcpy(buf + i * syn_len, pkt_ipv6_tcp_syn.packet, syn_len);
+        WinDivertHelperParsePacket(buf + i * syn_len, syn_len, NULL,
+            &ipv6_header, NULL, NULL, NULL, &tcp_header, NULL, NULL, NULL,
+            NULL, NULL);
+        if (i == 0)
+        {
+            seq[0] = WinDivertHelperNtohl(tcp_header->SeqNum);
+            seq[1] = 0x12345678;
+        }
+        if (segs[i].server)
+        {
+            memcpy(addr_tmp, ipv6_header->SrcAddr, sizeof(addr_tmp));
+            memcpy(ipv6_header->SrcAddr, ipv6_header->DstAddr,
+                sizeof(addr_tmp));
+            memcpy(ipv6_header->DstAddr, addr_tmp, sizeof(addr_tmp));
+            port_tmp = tcp_header->SrcPort;
+            tcp_header->SrcPort = tcp_header->DstPort;
+            tcp_header->DstPort = port_tmp;
+        }
+        tcp_header->SeqNum = WinDivertHelperHtonl(seq[segs[i].server] +
+            (segs[i].syn? 0: 1));
+        tcp_header->AckNum = WinDivertHelperHtonl(seq[!segs[i].server] + 1);
+        tcp_header->Syn    = (segs[i].syn? 1: 0);
+        tcp_header->Ack    = (i == 0? 0: 1);
+        tcp_header->Rst    = (segs[i].rst? 1: 0);
+        tcp_header->Window = WinDivertHelperHtons(segs[i].window);
+        addr[i].Layer      = WINDIVERT_LAYER_NETWORK;
+        addr[i].Timestamp  = segs[i].timestamp;
+    }
+
+    // The handshake is tracked, and the RST completes the flow:
+    if (!WinDivertHelperTcpStatsUpdate(stats, buf, 5 * syn_len, addr,
+            sizeof(addr)) ||
+        !WinDivertHelperTcpStatsQuery(stats, &active, NULL, NULL) ||
+        active != 0 ||
+        !WinDivertHelperTcpStatsPop(stats, &flow, 1, &count, FALSE) ||
+        count != 1)
+    {
+        fprintf(stderr, "error: TCP stats update mismatch\n");
+        goto failed;
+    }
+    if (flow.Flags != (WINDIVERT_TCPSTATS_FLOW_SYN |
+            WINDIVERT_TCPSTATS_FLOW_ESTABLISHED | WINDIVERT_TCPSTATS_FLOW_RST |
+            WINDIVERT_TCPSTATS_FLOW_IPV6) ||
+        flow.ClientPort != WinDivertHelperNtohs(tcp_header->DstPort) ||
+        flow.Client.HandshakeRtt != 100 || flow.Server.HandshakeRtt != 50 ||
+        flow.Client.Packets != 3 || flow.Server.Packets != 2 ||
+        flow.Client.Retransmits != 0 || flow.Client.ZeroWindows != 1 ||
+        flow.Client.ZeroWindowTime != 100 || flow.Server.ZeroWindows != 0)
+    {
+        fprintf(stderr, "error: TCP stats summary mismatch\n");
+        goto failed;
+    }
+    result = TRUE;
+
+failed:
+    WinDivertHelperTcpStatsFree(stats);
+    return result;
+}
+
+/*
+ * Run the stateless IPv4/IPv6 translation test.
+ */
+static BOOL run_xlat_test(void)
+{
+    static const struct
+    {
+        const char *prefix;
+        UINT prefix_len;
+        const char *addr;               // 192.0.2.33 embedded in prefix.
+    } embeds[] =
+    {
+        {"2001:db8::",         32, "2001:db8:c000:221::"},
+        {"2001:db8:100::",     40, "2001:db8:1c0:2:21::"},
+        {"2001:db8:122::",     48, "2001:db8:122:c000:2:2100::"},
+        {"2001:db8:122:300::", 56, "2001:db8:122:3c0:0:221::"},
+        {"2001:db8:122:344::", 64, "2001:db8:122:344:c0:2:2100:0"},
+        {"2001:db8:122:344::", 96, "2001:db8:122:344::c000:221"},
+    };
+    char buf[MAX_PACKET], orig[MAX_PACKET], check[MAX_PACKET];
+    UINT len = (UINT)pkt_ipv6_tcp_syn.packet_len, xlat_len, out_len, i;
+    UINT32 prefix[4], expected[4], ipv6_addr[4], ipv4_addr;
+    PWINDIVERT_IPHDR ip_header;
+    PWINDIVERT_IPV6HDR ipv6_header;
+    PWINDIVERT_TCPHDR tcp_header;
+    WINDIVERT_XLAT_ADDR xlat;
+    WINDIVERT_ADDRESS addr;
+    PVOID xlat_packet, out_packet;
+
+    for (i = 0; i < sizeof(embeds) / sizeof(embeds[0]); i++)
+    {
+        if (!WinDivertHelperParseIPv6Address(embeds[i].prefix, prefix) ||
+            !WinDivertHelperParseIPv6Address(embeds[i].addr, expected) ||
+            !WinDivertHelperXlatEmbedAddress(prefix, embeds[i].prefix_len,
+                0xC0000221, ipv6_addr) ||
+            memcmp(ipv6_addr, expected, sizeof(expected)) != 0 ||
+            !WinDivertHelperXlatExtractAddress(prefix, embeds[i].prefix_len,
+                ipv6_addr, &ipv4_addr) ||
+            ipv4_addr != 0xC0000221)
+        {
+            fprintf(stderr, "error: failed to embed IPv4 address into "
+                "%s/%u\n", embeds[i].prefix, embeds[i].prefix_len);
+            return FALSE;
+        }
+    }
+
+    // Translate the SYN to IPv4.  The flow label does not survive the
+    // round trip, so clear it first:
+    memcpy(orig, pkt_ipv6_tcp_syn.packet, len);
+    WinDivertHelperParsePacket(orig, len, NULL, &ipv6_header, NULL, NULL,
+        NULL, &tcp_header, NULL, NULL, NULL, NULL, NULL);
+    WINDIVERT_IPV6HDR_SET_FLOWLABEL(ipv6_header, 0);
+    memcpy(buf, orig, len);
+    memset(&xlat, 0, sizeof(xlat));
+    xlat.SrcAddr[0] = 0xC6336401;       // 198.51.100.1
+    xlat.DstAddr[0] = 0xC0000221;       // 192.0.2.33
+    xlat.SrcPort    = 1024;
+    memset(&addr, 0, sizeof(addr));
+    addr.IPv6 = 1;
+    if (!WinDivertHelperXlat(&xlat, NULL, 0, buf, len, 0, sizeof(buf),
+            &xlat_packet, &xlat_len, &addr) ||
+        xlat_len != len - 20 || addr.IPv6 != 0)
+    {
+        fprintf(stderr, "error: failed to translate IPv6 packet "
+            "(err = %d)\n", GetLastError());
+        return FALSE;
+    }
+    ip_header = (PWINDIVERT_IPHDR)xlat_packet;
+    memcpy(check, xlat_packet, xlat_len);
+    WinDivertHelperCalcChecksums(check, xlat_len, NULL, 0);
+    if (memcmp(check, xlat_packet, xlat_len) != 0 ||
+        ip_header->Version != 4 || ip_header->Protocol != IPPROTO_TCP ||
+        WinDivertHelperNtohl(ip_header->SrcAddr) != 0xC6336401 ||
+        WinDivertHelperNtohl(ip_header->DstAddr) != 0xC0000221 ||
+        WinDivertHelperNtohs(((PWINDIVERT_TCPHDR)(ip_header + 1))->SrcPort)
+            != 1024)
+    {
+        fprintf(stderr, "error: translated IPv4 packet mismatch\n");
+        return FALSE;
+    }
+
+    // ...and back to the original IPv6 packet, using the headroom in front
+    // of the IPv4 packet:
+    WinDivertHelperNtohIPv6Address(ipv6_header->SrcAddr, xlat.SrcAddr);
+    WinDivertHelperNtohIPv6Address(ipv6_header->DstAddr, xlat.DstAddr);
+    xlat.SrcPort = WinDivertHelperNtohs(tcp_header->SrcPort);
+    if (!WinDivertHelperXlat(&xlat, NULL, 0, xlat_packet, xlat_len,
+            (UINT)((char *)xlat_packet - buf), xlat_len, &out_packet,
+            &out_len, &addr) ||
+        out_len != len || addr.IPv6 != 1 ||
+        memcmp(out_packet, orig, len) != 0)
+    {
+        fprintf(stderr, "error: translated IPv6 packet mismatch\n");
+        return FALSE;
+    }
+
+    // Packets with an expiring hop limit are dropped:
+    ipv6_header->HopLimit = 1;
+    if (WinDivertHelperXlat(&xlat, NULL, WINDIVERT_XLAT_FLAG_DECREMENT_TTL,
+            orig, len, 0, sizeof(orig), NULL, NULL, NULL) ||
+        GetLastError() != ERROR_NOT_SUPPORTED)
+    {
+        fprintf(stderr, "error: expired IPv6 packet was translated\n");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * Run the prefix-preserving anonymization test.
+ */
+static BOOL run_anon_test(void)
+{
+    static const UINT8 key[WINDIVERT_ANON_KEY_SIZE] =
+    {
+        21, 34, 23, 141, 51, 164, 207, 128, 19, 10, 91, 22, 73, 144, 125, 16,
+        216, 152, 143, 131, 121, 121, 101, 39, 98, 87, 76, 45, 42, 132, 34, 2
+    };
+    static const struct
+    {
+        const char *addr;
+        const char *anon_addr;
+    } tests[] =
+    {
+        // Crypto-PAn reference vectors:
+        {"128.11.68.132",   "135.242.180.132"},
+        {"129.118.74.4",    "134.136.186.123"},
+        {"130.132.252.244", "133.68.164.234"},
+        {"141.223.7.43",    "141.167.8.160"},
+        {"141.233.145.108", "141.129.237.235"},
+        {"192.102.249.13",  "252.138.62.131"},
+        {"192.215.32.125",  "252.43.47.189"},
+        {"2001:db8:1234:5678:9abc:def0:1122:3344",
+            "4401:2bc:7c04:517f:7947:d910:f0de:ff64"},
+    };
+    static const UINT64 flags[] = {0, WINDIVERT_ANON_FLAG_NO_AESNI};
+    char buf[MAX_PACKET], check[MAX_PACKET];
+    UINT32 addr[4], expected[4], anon_addr[4], src_addr[4], dst_addr[4];
+    UINT len, dns_len = (UINT)pkt_dns_request.packet_len,
+        syn_len = (UINT)pkt_ipv6_tcp_syn.packet_len, i, j;
+    PWINDIVERT_IPHDR ip_header;
+    PWINDIVERT_IPV6HDR ipv6_header;
+    WINDIVERT_ADDRESS addrs[2];
+    PWINDIVERT_ANON anon;
+    UINT64 count;
+    BOOL ipv6;
+
+    if (WinDivertHelperAnonCreate(NULL, 1024, 0) != NULL ||
+        WinDivertHelperAnonCreate(key, 0, 0) != NULL ||
+        WinDivertHelperAnonCreate(key, 1024, 0x8000) != NULL ||
+        GetLastError() != ERROR_INVALID_PARAMETER)
+    {
+        fprintf(stderr, "error: anonymizer created with invalid "
+            "parameters\n");
+        return FALSE;
+    }
+
+    // The AES-NI and table implementations give the same mapping, both
+    // uncached and cached:
+    for (i = 0; i < sizeof(flags) / sizeof(flags[0]); i++)
+    {
+        anon = WinDivertHelperAnonCreate(key, 1024, flags[i]);
+        if (anon == NULL)
+        {
+            fprintf(stderr, "error: failed to create anonymizer "
+                "(err = %d)\n", GetLastError());
+            return FALSE;
+        }
+        for (j = 0; j < 2 * sizeof(tests) / sizeof(tests[0]); j++)
+        {
+            memset(addr, 0, sizeof(addr));
+            memset(expected, 0, sizeof(expected));
+            memset(anon_addr, 0, sizeof(anon_addr));
+            ipv6 = (strchr(tests[j / 2].addr, ':') != NULL);
+            if (ipv6)
+            {
+                WinDivertHelperParseIPv6Address(tests[j / 2].addr, addr);
+                WinDivertHelperParseIPv6Address(tests[j / 2].anon_addr,
+                    expected);
+            }
+            else
+            {
+                WinDivertHelperParseIPv4Address(tests[j / 2].addr, addr);
+                WinDivertHelperParseIPv4Address(tests[j / 2].anon_addr,
+                    expected);
+            }
+            if (!WinDivertHelperAnonAddress(anon, addr, anon_addr, ipv6) ||
+                memcmp(anon_addr, expected, sizeof(expected)) != 0)
+            {
+                fprintf(stderr, "error: address %s was not anonymized to "
+                    "%s (flags = %u)\n", tests[j / 2].addr,
+                    tests[j / 2].anon_addr, (UINT)flags[i]);
+                WinDivertHelperAnonFree(anon);
+                return FALSE;
+            }
+        }
+        if (!WinDivertHelperAnonQuery(anon, &count, NULL, NULL) ||
+            count != 2 * sizeof(tests) / sizeof(tests[0]))
+        {
+            fprintf(stderr, "error: failed to query anonymizer\n");
+            WinDivertHelperAnonFree(anon);
+            return FALSE;
+        }
+        WinDivertHelperAnonFree(anon);
+    }
+
+    // Addresses that share a prefix still share a prefix:
+    anon = WinDivertHelperAnonCreate(key, 1024, 0);
+    if (anon == NULL)
+    {
+        return FALSE;
+    }
+    addr[0] = 0x0A010203;               // 10.1.2.3
+    expected[0] = 0x0A0102C8;           // 10.1.2.200
+    if (!WinDivertHelperAnonAddress(anon, addr, anon_addr, FALSE) ||
+        !WinDivertHelperAnonAddress(anon, expected, expected, FALSE) ||
+        (anon_addr[0] >> 8) != (expected[0] >> 8) ||
+        ((anon_addr[0] ^ expected[0]) & 0x80) == 0)
+    {
+        fprintf(stderr, "error: anonymization did not preserve the "
+            "prefix\n");
+        WinDivertHelperAnonFree(anon);
+        return FALSE;
+    }
+
+    // Anonymize an IPv4/IPv6 batch.  The checksums must remain valid, and
+    // the addresses must match the address mapping:
+    memcpy(buf, pkt_dns_request.packet, dns_len);
+    memcpy(buf + dns_len, pkt_ipv6_tcp_syn.packet, syn_len);
+    len = dns_len + syn_len;
+    WinDivertHelperCalcChecksums(buf, dns_len, NULL, 0);
+    WinDivertHelperCalcChecksums(buf + dns_len, syn_len, NULL, 0);
+    memcpy(check, buf, len);
+    memset(addrs, 0, sizeof(addrs));
+    addrs[0].Layer = addrs[1].Layer = WINDIVERT_LAYER_NETWORK;
+    addrs[1].IPv6 = 1;
+    if (!WinDivertHelperAnonPacket(anon, buf, len, addrs, sizeof(addrs)))
+    {
+        fprintf(stderr, "error: failed to anonymize packets (err = %d)\n",
+            GetLastError());
+        WinDivertHelperAnonFree(anon);
+        return FALSE;
+    }
+    ip_header   = (PWINDIVERT_IPHDR)check;
+    ipv6_header = (PWINDIVERT_IPV6HDR)(check + dns_len);
+    src_addr[0] = WinDivertHelperNtohl(ip_header->SrcAddr);
+    dst_addr[0] = WinDivertHelperNtohl(ip_header->DstAddr);
+    WinDivertHelperAnonAddress(anon, src_addr, src_addr, FALSE);
+    WinDivertHelperAnonAddress(anon, dst_addr, dst_addr, FALSE);
+    ip_header->SrcAddr = WinDivertHelperHtonl(src_addr[0]);
+    ip_header->DstAddr = WinDivertHelperHtonl(dst_addr[0]);
+    WinDivertHelperNtohIPv6Address(ipv6_header->SrcAddr, src_addr);
+    WinDivertHelperNtohIPv6Address(ipv6_header->DstAddr, dst_addr);
+    WinDivertHelperAnonAddress(anon, src_addr, src_addr, TRUE);
+    WinDivertHelperAnonAddress(anon, dst_addr, dst_addr, TRUE);
+    WinDivertHelperHtonIPv6Address(src_addr, ipv6_header->SrcAddr);
+    WinDivertHelperHtonIPv6Address(dst_addr, ipv6_header->DstAddr);
+    WinDivertHelperCalcChecksums(check, dns_len, NULL, 0);
+    WinDivertHelperCalcChecksums(check + dns_len, syn_len, NULL, 0);
+    if (memcmp(buf, check, len) != 0)
+    {
+        fprintf(stderr, "error: anonymized packets mismatch\n");
+        WinDivertHelperAnonFree(anon);
+        return FALSE;
+    }
+    WinDivertHelperAnonFree(anon);
+    return TRUE;
+}
+
+/*
+ * Run the process name/path filter test.
+ */
+static BOOL run_process_filter_test(void)
+{
+    static const struct
+    {
+        const char *filter;
+        BOOL match;
+    } tests[] =
+    {
+        {"processName == \"test.exe\"", TRUE},
+        {"processName == \"TEST.EXE\"", TRUE},
+        {"processName != \"notepad.exe\"", TRUE},
+        {"processName == \"notepad.exe\"", FALSE},
+        {"processPath == \"*\\test.exe\"", TRUE},
+        {"processPath == \"*/test.exe\"", TRUE},
+        {"processPath == \"test.exe\"", FALSE},
+        {"processPath == \"*est.exe\" and processId == 0", FALSE},
+    };
+    char object_1[1024], object_2[1024], format[1024];
+    WINDIVERT_ADDRESS addr;
+    const char *err_str;
+    UINT err_pos, i;
+    BOOL match;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.Layer = WINDIVERT_LAYER_FLOW;
+    addr.Event = WINDIVERT_EVENT_FLOW_ESTABLISHED;
+    addr.Flow.ProcessId = GetCurrentProcessId();
+    for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+    {
+        if (!WinDivertHelperCompileFilter(tests[i].filter,
+                WINDIVERT_LAYER_FLOW, object_1, sizeof(object_1), &err_str,
+                &err_pos))
+        {
+            fprintf(stderr, "error: failed to compile filter \"%s\" with "
+                "error \"%s\" (position=%u)\n", tests[i].filter, err_str,
+                err_pos);
+            return FALSE;
+        }
+        if (!WinDivertHelperFormatFilter(object_1, WINDIVERT_LAYER_FLOW,
+                format, sizeof(format)) ||
+            !WinDivertHelperCompileFilter(format, WINDIVERT_LAYER_FLOW,
+                object_2, sizeof(object_2), NULL, NULL) ||
+            strcmp(object_1, object_2) != 0)
+        {
+            fprintf(stderr, "error: filter \"%s\" does not round-trip\n",
+                tests[i].filter);
+            return FALSE;
+        }
+        match = WinDivertHelperEvalFilter(object_1, NULL, 0, &addr);
+        if (match != tests[i].match)
+        {
+            fprintf(stderr, "error: filter \"%s\" does not match the "
+                "expected result (expected %d, got %d)\n", tests[i].filter,
+                tests[i].match, match);
+            return FALSE;
+        }
+    }
+
+    // Process fields are not valid at the NETWORK layer, and only support
+    // equality tests:
+    if (WinDivertHelperCompileFilter("processName == \"test.exe\"",
+            WINDIVERT_LAYER_NETWORK, NULL, 0, NULL, NULL) ||
+        WinDivertHelperCompileFilter("processName < \"test.exe\"",
+            WINDIVERT_LAYER_FLOW, NULL, 0, NULL, NULL))
+    {
+        fprintf(stderr, "error: invalid process filter compiled\n");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * Receive pool callback.
+ */
+struct recv_pool_state
+{
+    volatile LONG packets;
+    volatile LONG errors;
+};
+static void recv_pool_callback(PVOID context, const VOID *packet,
+    UINT packet_len, const WINDIVERT_ADDRESS *addr, UINT count)
+{
+    struct recv_pool_state *state = (struct recv_pool_state *)context;
+    UINT i;
+
+    for (i = 0; i < count; i++)
+    {
+        if (packet_len < pkt_dns_request.packet_len ||
+            memcmp(packet, pkt_dns_request.packet,
+                pkt_dns_request.packet_len) != 0 ||
+            addr[i].Layer != WINDIVERT_LAYER_NETWORK)
+        {
+            InterlockedIncrement(&state->errors);
+        }
+        packet = (const UINT8 *)packet + pkt_dns_request.packet_len;
+        packet_len -= (UINT)MIN(packet_len, pkt_dns_request.packet_len);
+    }
+    InterlockedExchangeAdd(&state->packets, (LONG)count);
+}
+
+/*
+ * Run the completion-callback receive test.
+ */
+static BOOL run_recv_pool_test(HANDLE inject_handle)
+{
+    const LONG num_packets = 64;
+    struct recv_pool_state state;
+    WINDIVERT_ADDRESS addr;
+    PWINDIVERT_RECV_POOL pool = NULL;
+    HANDLE handle;
+    BOOL result = FALSE;
+    LONG i;
+
+    handle = WinDivertOpen("outbound and udp.DstPort == 53",
+        WINDIVERT_LAYER_NETWORK, 8888, 0);
+    if (handle == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "error: failed to open WinDivert handle for receive "
+            "pool (err = %d)\n", GetLastError());
+        return FALSE;
+    }
+    memset(&state, 0, sizeof(state));
+    pool = WinDivertRecvPoolCreate(handle, 4, 2, 8 * MAX_PACKET, 8, 0,
+        recv_pool_callback, &state);
+    if (pool == NULL)
+    {
+        fprintf(stderr, "error: failed to create receive pool (err = %d)\n",
+            GetLastError());
+        goto failed;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.Outbound = TRUE;
+    for (i = 0; i < num_packets; i++)
+    {
+        if (!WinDivertSend(inject_handle, pkt_dns_request.packet,
+                (UINT)pkt_dns_request.packet_len, NULL, &addr))
+        {
+            fprintf(stderr, "error: failed to inject receive pool packet "
+                "(err = %d)\n", GetLastError());
+            goto failed;
+        }
+    }
+    for (i = 0; i < 100 && state.packets < num_packets; i++)
+    {
+        Sleep(10);
+    }
+
+    // Shutting down recv drains the pool:
+    if (!WinDivertShutdown(handle, WINDIVERT_SHUTDOWN_RECV) ||
+        !WinDivertRecvPoolWait(pool, 1000))
+    {
+        fprintf(stderr, "error: failed to stop receive pool (err = %d)\n",
+            GetLastError());
+        goto failed;
+    }
+    if (state.packets != num_packets || state.errors != 0)
+    {
+        fprintf(stderr, "error: receive pool mismatch (packets=%d/%d, "
+            "errors=%d)\n", state.packets, num_packets, state.errors);
+        goto failed;
+    }
+    result = TRUE;
+
+failed:
+    WinDivertRecvPoolFree(pool);
+    WinDivertClose(handle);
+    return result;
+}
+
 /*
  * Monitor thread.
  */